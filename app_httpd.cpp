@@ -21,6 +21,25 @@
 #include "camera_index.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "frame_arena.h"
+#include "mem_policy.h"
+#include "frame_ring.h"
+#include "copy_service.h"
+#include "motion_detect.h"
+#include "motion_pipeline.h"
+#include "mjpeg_broadcast.h"
+#include "async_pool.h"
+#include "encode_cache.h"
+#include "roi_jpeg.h"
+#include "jpeg_stream.h"
+#include "mask_codec.h"
+#include "detection_json.h"
+#include "detection_wire.h"
+#include "lossless_gray.h"
+#include "frame_store.h"
+#include "ws_channel.h"
+#include "lwip/sockets.h"
+#include <errno.h>
 #if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
 #include "esp32-hal-log.h"
 #include <Arduino.h>
@@ -98,6 +117,9 @@ typedef struct {
 static const char *_STREAM_CONTENT_TYPE = "multipart/x-mixed-replace;boundary=" PART_BOUNDARY;
 static const char *_STREAM_BOUNDARY = "\r\n--" PART_BOUNDARY "\r\n";
 static const char *_STREAM_PART = "Content-Type: image/jpeg\r\nContent-Length: %u\r\nX-Timestamp: %d.%06d\r\n\r\n";
+static const char *_MASK_PART = "Content-Type: application/octet-stream\r\nContent-Length: %u\r\nX-Width: %u\r\nX-Height: %u\r\nX-Frame-Seq: %u\r\n\r\n";
+static const char *_STREAM_TILE_PART = "Content-Type: image/jpeg\r\nContent-Length: %u\r\nX-Tile: %u,%u,%u,%u\r\nX-Keyframe: %d\r\nX-Timestamp: %d.%06d\r\n\r\n";
+static const char *_STREAM_META = "X-Frame-Seq: %u\r\nX-Motion-Score: %u\r\nX-Regions: %u\r\nX-Boxes: ";
 
 httpd_handle_t stream_httpd = NULL;
 httpd_handle_t camera_httpd = NULL;
@@ -280,45 +302,90 @@ void enable_led(bool en) {  // Turn LED On or Off
 }
 #endif
 
-static esp_err_t bmp_handler(httpd_req_t *req) {
-  camera_fb_t *fb = NULL;
-  esp_err_t res = ESP_OK;
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-  uint64_t fr_start = esp_timer_get_time();
-#endif
-  fb = esp_camera_fb_get();
-  if (!fb) {
-    log_e("Camera capture failed");
+// Slow endpoints run on the async pool so the httpd task stays free for
+// /status and /control. Streams are long lived and may not take the
+// workers reserved for snapshots.
+#define HTTPD_ASYNC_WORKERS  5
+#define HTTPD_ASYNC_RESERVED 2
+
+typedef struct {
+  httpd_req_t *req;
+  esp_err_t (*handler)(httpd_req_t *req);
+} httpd_async_job_t;
+
+static void httpd_async_run(void *arg) {
+  httpd_async_job_t *job = (httpd_async_job_t *)arg;
+
+  job->handler(job->req);
+  httpd_req_async_handler_complete(job->req);
+  free(job);
+}
+
+static esp_err_t httpd_async_submit(httpd_req_t *req, esp_err_t (*handler)(httpd_req_t *req), bool long_lived) {
+  httpd_async_job_t *job = NULL;
+
+  if (!async_pool_reserve(long_lived)) {
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    httpd_resp_set_hdr(req, "Retry-After", "1");
+    return httpd_resp_send(req, NULL, 0);
+  }
+  job = (httpd_async_job_t *)malloc(sizeof(httpd_async_job_t));
+  if (!job || httpd_req_async_handler_begin(req, &job->req) != ESP_OK) {
+    log_e("Async request failed");
+    free(job);
+    async_pool_cancel(long_lived);
     httpd_resp_send_500(req);
     return ESP_FAIL;
   }
+  job->handler = handler;
+  async_pool_submit(httpd_async_run, job, long_lived);
+  return ESP_OK;
+}
 
-  httpd_resp_set_type(req, "image/x-windows-bmp");
-  httpd_resp_set_hdr(req, "Content-Disposition", "inline; filename=capture.bmp");
-  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-
-  char ts[32];
-  snprintf(ts, 32, "%lld.%06ld", fb->timestamp.tv_sec, fb->timestamp.tv_usec);
-  httpd_resp_set_hdr(req, "X-Timestamp", (const char *)ts);
+// Snapshot handlers serve the newest pipeline frame from the encode cache.
+// A max_age query parameter (ms) lets a client take a cached encoding of an
+// older frame instead of waiting for an encode of the newest one.
+static esp_err_t send_cached_snapshot(httpd_req_t *req, const ec_key_t *key, const char *type, const char *disposition) {
+  char query[64];
+  char value[12];
+  uint32_t max_age = 0;
+#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
+  int64_t fr_start = esp_timer_get_time();
+#endif
 
-  uint8_t *buf = NULL;
-  size_t buf_len = 0;
-  bool converted = frame2bmp(fb, &buf, &buf_len);
-  esp_camera_fb_return(fb);
-  if (!converted) {
-    log_e("BMP Conversion failed");
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK && httpd_query_key_value(query, "max_age", value, sizeof(value)) == ESP_OK) {
+    max_age = atoi(value);
+  }
+  const ec_output_t *out = encode_cache_get(key, max_age, 1000);
+  if (!out) {
+    log_e("Snapshot encoding failed");
     httpd_resp_send_500(req);
     return ESP_FAIL;
   }
-  res = httpd_resp_send(req, (const char *)buf, buf_len);
-  free(buf);
+
+  char ts[32];
+  char seq[16];
+  snprintf(ts, sizeof(ts), "%d.%06d", (int)(out->capture_us / 1000000), (int)(out->capture_us % 1000000));
+  snprintf(seq, sizeof(seq), "%u", (unsigned)out->seq);
+  httpd_resp_set_type(req, type);
+  httpd_resp_set_hdr(req, "Content-Disposition", disposition);
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  httpd_resp_set_hdr(req, "X-Timestamp", ts);
+  httpd_resp_set_hdr(req, "X-Frame-Seq", seq);
+  esp_err_t res = httpd_resp_send(req, (const char *)out->buf, out->len);
 #if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-  uint64_t fr_end = esp_timer_get_time();
+  int64_t fr_end = esp_timer_get_time();
 #endif
-  log_i("BMP: %llums, %uB", (uint64_t)((fr_end - fr_start) / 1000), buf_len);
+  log_i("%s: %uB %ums seq %u", type, (uint32_t)out->len, (uint32_t)((fr_end - fr_start) / 1000), (unsigned)out->seq);
+  encode_cache_release(out);
   return res;
 }
 
+static esp_err_t bmp_handler(httpd_req_t *req) {
+  ec_key_t key = {EC_FORMAT_BMP, 0, false};
+  return send_cached_snapshot(req, &key, "image/x-windows-bmp", "inline; filename=capture.bmp");
+}
+
 static size_t jpg_encode_stream(void *arg, size_t index, const void *data, size_t len) {
   jpg_chunking_t *j = (jpg_chunking_t *)arg;
   if (!index) {
@@ -332,7 +399,9 @@ static size_t jpg_encode_stream(void *arg, size_t index, const void *data, size_
   
 }
 
-static esp_err_t capture_handler(httpd_req_t *req) {
+#if CONFIG_ESP_FACE_DETECT_ENABLED
+// Face detection draws on a camera frame of its own.
+static esp_err_t capture_face_handler(httpd_req_t *req) {
   camera_fb_t *fb = NULL;
   esp_err_t res = ESP_OK;
   
@@ -435,7 +504,7 @@ static esp_err_t capture_handler(httpd_req_t *req) {
     out_len = fb->width * fb->height * 3;
     out_width = fb->width;
     out_height = fb->height;
-    out_buf = (uint8_t *)malloc(out_len);
+    out_buf = (uint8_t *)mem_class_alloc(MEM_CLASS_FRAME, out_len);
     if (!out_buf) {
       log_e("out_buf malloc failed");
       httpd_resp_send_500(req);
@@ -444,7 +513,7 @@ static esp_err_t capture_handler(httpd_req_t *req) {
     s = fmt2rgb888(fb->buf, fb->len, fb->format, out_buf);
     esp_camera_fb_return(fb);
     if (!s) {
-      free(out_buf);
+      mem_class_free(MEM_CLASS_FRAME, out_buf);
       log_e("To rgb888 failed");
       httpd_resp_send_500(req);
       return ESP_FAIL;
@@ -480,7 +549,7 @@ static esp_err_t capture_handler(httpd_req_t *req) {
     }
 
     s = fmt2jpg_cb(out_buf, out_len, out_width, out_height, PIXFORMAT_RGB888, 90, jpg_encode_stream, &jchunk);
-    free(out_buf);
+    mem_class_free(MEM_CLASS_FRAME, out_buf);
   }
 
   if (!s) {
@@ -495,251 +564,231 @@ static esp_err_t capture_handler(httpd_req_t *req) {
   return res;
 #endif
 }
+#endif
+
+static esp_err_t capture_handler(httpd_req_t *req) {
+  ec_key_t key = {EC_FORMAT_JPEG, 80, false};
+  esp_err_t res;
 
-static esp_err_t stream_handler(httpd_req_t *req) {
-  camera_fb_t *fb = NULL;
-  struct timeval _timestamp;
-  esp_err_t res = ESP_OK;
-  size_t _jpg_buf_len = 0;
-  uint8_t *_jpg_buf = NULL;
-  char *part_buf[128];
 #if CONFIG_ESP_FACE_DETECT_ENABLED
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-  bool detected = false;
-  int64_t fr_ready = 0;
-  int64_t fr_recognize = 0;
-  int64_t fr_encode = 0;
-  int64_t fr_face = 0;
-  int64_t fr_start = 0;
-#endif
-  int face_id = 0;
-  size_t out_len = 0, out_width = 0, out_height = 0;
-  uint8_t *out_buf = NULL;
-  bool s = false;
-#if TWO_STAGE
-  HumanFaceDetectMSR01 s1(0.1F, 0.5F, 10, 0.2F);
-  HumanFaceDetectMNP01 s2(0.5F, 0.3F, 5);
-#else
-  HumanFaceDetectMSR01 s1(0.3F, 0.5F, 10, 0.2F);
+  if (detection_enabled) {
+    return capture_face_handler(req);
+  }
 #endif
+#if CONFIG_LED_ILLUMINATOR_ENABLED
+  if (led_duty) {
+    enable_led(true);
+    vTaskDelay(150 / portTICK_PERIOD_MS);  // The LED needs to be on ~150ms before the frame is captured
+    res = send_cached_snapshot(req, &key, "image/jpeg", "inline; filename=capture.jpg");
+    enable_led(false);
+    return res;
+  }
 #endif
+  res = send_cached_snapshot(req, &key, "image/jpeg", "inline; filename=capture.jpg");
+  return res;
+}
+
+// Stream parts are written straight to the socket without blocking, so a
+// viewer on a slow link loses frames instead of stalling its session. A part
+// is only started once the socket has room for more data; while it has none
+// the viewer keeps just the newest slab. Started parts are always finished,
+// a viewer that stalls for STREAM_STALL_MS is disconnected.
+#define STREAM_STALL_MS  3000
+#define STREAM_POLL_MS   10
+
+static bool stream_writable(int fd, uint32_t timeout_ms) {
+  fd_set wfds;
+  FD_ZERO(&wfds);
+  FD_SET(fd, &wfds);
+  struct timeval tv = {0, (long)timeout_ms * 1000};
+  return select(fd + 1, NULL, &wfds, NULL, &tv) > 0;
+}
 
-  static int64_t last_frame = 0;
-  if (!last_frame) {
-    last_frame = esp_timer_get_time();
+// Whether the viewer has gone, checked while no frames come: a closed or
+// reset socket reads as end of file or an error without blocking.
+static bool stream_peer_closed(int fd) {
+  fd_set rfds;
+  FD_ZERO(&rfds);
+  FD_SET(fd, &rfds);
+  struct timeval tv = {0, 0};
+  if (select(fd + 1, &rfds, NULL, NULL, &tv) <= 0) {
+    return false;
   }
+  char c;
+  int n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+}
 
-  res = httpd_resp_set_type(req, _STREAM_CONTENT_TYPE);
-  if (res != ESP_OK) {
-    return res;
+static bool stream_write(int fd, const char *buf, size_t len, int64_t deadline_us) {
+  while (len) {
+    int n = send(fd, buf, len, MSG_DONTWAIT);
+    if (n > 0) {
+      buf += n;
+      len -= n;
+      continue;
+    }
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      return false;
+    }
+    if (esp_timer_get_time() >= deadline_us) {
+      return false;
+    }
+    stream_writable(fd, STREAM_POLL_MS);
   }
+  return true;
+}
 
-  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-  httpd_resp_set_hdr(req, "X-Framerate", "60");
+// One HTTP chunk: part header, JPEG and the boundary that opens the next part.
+static bool stream_write_chunk(int fd, const char *part, size_t part_len, const uint8_t *jpg, size_t jpg_len, int64_t deadline_us) {
+  char chunk_buf[12];
+  size_t blen = strlen(_STREAM_BOUNDARY);
+  size_t clen = snprintf(chunk_buf, sizeof(chunk_buf), "%x\r\n", (unsigned)(part_len + jpg_len + blen));
 
-#if CONFIG_LED_ILLUMINATOR_ENABLED
-  isStreaming = true;
-  enable_led(true);
-#endif
+  return stream_write(fd, chunk_buf, clen, deadline_us) && stream_write(fd, part, part_len, deadline_us)
+         && stream_write(fd, (const char *)jpg, jpg_len, deadline_us) && stream_write(fd, _STREAM_BOUNDARY, blen, deadline_us)
+         && stream_write(fd, "\r\n", 2, deadline_us);
+}
 
-  while (true) {
-#if CONFIG_ESP_FACE_DETECT_ENABLED
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-    detected = false;
-#endif
-    face_id = 0;
-#endif
+// Part headers with every detection header and MJPEG_MAX_BOXES boxes fit.
+#define STREAM_PART_MAX 512
 
-    fb = esp_camera_fb_get();
-    if (!fb) {
-      log_e("Camera capture failed");
-      res = ESP_FAIL;
-    } else {
-      _timestamp.tv_sec = fb->timestamp.tv_sec;
-      _timestamp.tv_usec = fb->timestamp.tv_usec;
-#if CONFIG_ESP_FACE_DETECT_ENABLED
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-      fr_start = esp_timer_get_time();
-      fr_ready = fr_start;
-      fr_encode = fr_start;
-      fr_recognize = fr_start;
-      fr_face = fr_start;
-#endif
-      if (!detection_enabled || fb->width > 400) {
-#endif
-        if (fb->format != PIXFORMAT_JPEG) {
-          bool jpeg_converted = frame2jpg(fb, 80, &_jpg_buf, &_jpg_buf_len);
-          esp_camera_fb_return(fb);
-          fb = NULL;
-          if (!jpeg_converted) {
-            log_e("JPEG compression failed");
-            res = ESP_FAIL;
-          }
-        } else {
-          _jpg_buf_len = fb->len;
-          _jpg_buf = fb->buf;
-        }
-#if CONFIG_ESP_FACE_DETECT_ENABLED
-      } else {
-        if (fb->format == PIXFORMAT_RGB565
-#if CONFIG_ESP_FACE_RECOGNITION_ENABLED
-            && !recognition_enabled
-#endif
-        ) {
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-          fr_ready = esp_timer_get_time();
-#endif
-#if TWO_STAGE
-          std::list<dl::detect::result_t> &candidates = s1.infer((uint16_t *)fb->buf, {(int)fb->height, (int)fb->width, 3});
-          std::list<dl::detect::result_t> &results = s2.infer((uint16_t *)fb->buf, {(int)fb->height, (int)fb->width, 3}, candidates);
-#else
-          std::list<dl::detect::result_t> &results = s1.infer((uint16_t *)fb->buf, {(int)fb->height, (int)fb->width, 3});
-#endif
-#if CONFIG_ESP_FACE_DETECT_ENABLED && ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-          fr_face = esp_timer_get_time();
-          fr_recognize = fr_face;
-#endif
-          if (results.size() > 0) {
-            fb_data_t rfb;
-            rfb.width = fb->width;
-            rfb.height = fb->height;
-            rfb.data = fb->buf;
-            rfb.bytes_per_pixel = 2;
-            rfb.format = FB_RGB565;
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-            detected = true;
-#endif
-            draw_face_boxes(&rfb, &results, face_id);
-          }
-          s = fmt2jpg(fb->buf, fb->len, fb->width, fb->height, PIXFORMAT_RGB565, 80, &_jpg_buf, &_jpg_buf_len);
-          esp_camera_fb_return(fb);
-          fb = NULL;
-          if (!s) {
-            log_e("fmt2jpg failed");
-            res = ESP_FAIL;
-          }
-#if CONFIG_ESP_FACE_DETECT_ENABLED && ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-          fr_encode = esp_timer_get_time();
-#endif
-        } else {
-          out_len = fb->width * fb->height * 3;
-          out_width = fb->width;
-          out_height = fb->height;
-          out_buf = (uint8_t *)malloc(out_len);
-          if (!out_buf) {
-            log_e("out_buf malloc failed");
-            res = ESP_FAIL;
-          } else {
-            s = fmt2rgb888(fb->buf, fb->len, fb->format, out_buf);
-            esp_camera_fb_return(fb);
-            fb = NULL;
-            if (!s) {
-              free(out_buf);
-              log_e("To rgb888 failed");
-              res = ESP_FAIL;
-            } else {
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-              fr_ready = esp_timer_get_time();
-#endif
+// Adds the detection headers of ?meta=1 viewers to the part header in part,
+// hlen bytes ending in the blank line. X-Boxes lists the largest regions as
+// x,y,w,h;x,y,w,h, empty without motion.
+static size_t stream_part_meta(char *part, size_t hlen, const mjpeg_frame_t *frame) {
+  size_t n = hlen - 2;
 
-              fb_data_t rfb;
-              rfb.width = out_width;
-              rfb.height = out_height;
-              rfb.data = out_buf;
-              rfb.bytes_per_pixel = 3;
-              rfb.format = FB_BGR888;
+  n += snprintf(part + n, STREAM_PART_MAX - n, _STREAM_META, (unsigned)frame->seq, frame->motion_score, frame->region_count);
+  for (int i = 0; i < frame->box_count; i++) {
+    const mjpeg_box_t *b = &frame->boxes[i];
+    n += snprintf(part + n, STREAM_PART_MAX - n, "%s%u,%u,%u,%u", i ? ";" : "", b->x, b->y, b->w, b->h);
+  }
+  n += snprintf(part + n, STREAM_PART_MAX - n, "\r\n\r\n");
+  return n;
+}
 
-#if TWO_STAGE
-              std::list<dl::detect::result_t> &candidates = s1.infer((uint8_t *)out_buf, {(int)out_height, (int)out_width, 3});
-              std::list<dl::detect::result_t> &results = s2.infer((uint8_t *)out_buf, {(int)out_height, (int)out_width, 3}, candidates);
-#else
-              std::list<dl::detect::result_t> &results = s1.infer((uint8_t *)out_buf, {(int)out_height, (int)out_width, 3});
-#endif
+static bool stream_write_part(int fd, const mjpeg_frame_t *frame, bool meta, int64_t deadline_us) {
+  char part_buf[STREAM_PART_MAX];
+  size_t hlen = snprintf(part_buf, sizeof(part_buf), _STREAM_PART, frame->len, (int)(frame->capture_us / 1000000), (int)(frame->capture_us % 1000000));
 
-#if CONFIG_ESP_FACE_DETECT_ENABLED && ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-              fr_face = esp_timer_get_time();
-              fr_recognize = fr_face;
-#endif
+  if (meta) {
+    hlen = stream_part_meta(part_buf, hlen, frame);
+  }
+  return stream_write_chunk(fd, part_buf, hlen, frame->buf, frame->len, deadline_us);
+}
 
-              if (results.size() > 0) {
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-                detected = true;
-#endif
-#if CONFIG_ESP_FACE_RECOGNITION_ENABLED
-                if (recognition_enabled) {
-                  face_id = run_face_recognition(&rfb, &results);
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-                  fr_recognize = esp_timer_get_time();
-#endif
-                }
-#endif
-                draw_face_boxes(&rfb, &results, face_id);
-              }
-              s = fmt2jpg(out_buf, out_len, out_width, out_height, PIXFORMAT_RGB888, 90, &_jpg_buf, &_jpg_buf_len);
-              free(out_buf);
-              if (!s) {
-                log_e("fmt2jpg failed");
-                res = ESP_FAIL;
-              }
-#if CONFIG_ESP_FACE_DETECT_ENABLED && ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-              fr_encode = esp_timer_get_time();
-#endif
-            }
-          }
-        }
-      }
-#endif
-    }
-    if (res == ESP_OK) {
-      res = httpd_resp_send_chunk(req, _STREAM_BOUNDARY, strlen(_STREAM_BOUNDARY));
+// Tile viewers get the keyframe as one tile covering the frame, after it
+// every dirty tile as a part of its own. Detection headers go on the first
+// part of a frame.
+static bool stream_write_tiles(int fd, const mjpeg_frame_t *frame, bool meta, int64_t deadline_us) {
+  char part_buf[STREAM_PART_MAX];
+  int sec = frame->capture_us / 1000000;
+  int usec = frame->capture_us % 1000000;
+
+  if (frame->key) {
+    size_t hlen = snprintf(part_buf, sizeof(part_buf), _STREAM_TILE_PART, frame->len, 0, 0, frame->width, frame->height, 1, sec, usec);
+    if (meta) {
+      hlen = stream_part_meta(part_buf, hlen, frame);
     }
-    if (res == ESP_OK) {
-      size_t hlen = snprintf((char *)part_buf, 128, _STREAM_PART, _jpg_buf_len, _timestamp.tv_sec, _timestamp.tv_usec);
-      res = httpd_resp_send_chunk(req, (const char *)part_buf, hlen);
+    return stream_write_chunk(fd, part_buf, hlen, frame->buf, frame->len, deadline_us);
+  }
+  bool first = true;
+  for (const mjpeg_tile_t *tile = mjpeg_tile_next(frame, NULL); tile; tile = mjpeg_tile_next(frame, tile)) {
+    size_t hlen = snprintf(part_buf, sizeof(part_buf), _STREAM_TILE_PART, (unsigned)tile->len, tile->x, tile->y, tile->w, tile->h, 0, sec, usec);
+    if (meta && first) {
+      hlen = stream_part_meta(part_buf, hlen, frame);
     }
-    if (res == ESP_OK) {
-      res = httpd_resp_send_chunk(req, (const char *)_jpg_buf, _jpg_buf_len);
+    first = false;
+    if (!stream_write_chunk(fd, part_buf, hlen, (const uint8_t *)(tile + 1), tile->len, deadline_us)) {
+      return false;
     }
-    if (fb) {
-      esp_camera_fb_return(fb);
-      fb = NULL;
-      _jpg_buf = NULL;
-    } else if (_jpg_buf) {
-      free(_jpg_buf);
-      _jpg_buf = NULL;
+  }
+  return true;
+}
+
+// Sender of one /stream viewer, runs on an async pool worker. Frames are
+// encoded once by the MJPEG broadcaster, every viewer only pushes the shared
+// slabs to its socket. With ?mode=tiles the viewer gets keyframes and dirty
+// tiles with X-Tile: x,y,w,h part headers, for a client side compositor.
+// With ?meta=1 parts also carry the frame's detections (stream_part_meta).
+static esp_err_t stream_send_handler(httpd_req_t *req) {
+  esp_err_t res = ESP_OK;
+  int fd = httpd_req_to_sockfd(req);
+  int64_t last_frame = esp_timer_get_time();
+  char query[32];
+  char value[8];
+  bool tiles = false;
+  bool meta = false;
+
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+    tiles = httpd_query_key_value(query, "mode", value, sizeof(value)) == ESP_OK && !strcmp(value, "tiles");
+    meta = httpd_query_key_value(query, "meta", value, sizeof(value)) == ESP_OK && atoi(value) != 0;
+  }
+  mjpeg_viewer_t *viewer = mjpeg_broadcast_join(fd, tiles);
+  if (!viewer) {
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    httpd_resp_set_hdr(req, "Retry-After", "1");
+    return httpd_resp_send(req, NULL, 0);
+  }
+
+  res = httpd_resp_set_type(req, _STREAM_CONTENT_TYPE);
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  httpd_resp_set_hdr(req, "X-Framerate", "60");
+
+#if CONFIG_LED_ILLUMINATOR_ENABLED
+  isStreaming = true;
+  enable_led(true);
+#endif
+
+  // Sends the response headers and the first boundary, parts follow raw.
+  if (res == ESP_OK) {
+    res = httpd_resp_send_chunk(req, _STREAM_BOUNDARY, strlen(_STREAM_BOUNDARY));
+  }
+  while (res == ESP_OK) {
+    const mjpeg_frame_t *frame = mjpeg_viewer_next(viewer, 1000);
+    if (!frame) {
+      if (stream_peer_closed(fd)) {
+        res = ESP_FAIL;
+      }
+      continue;
+    }
+    int64_t stall = esp_timer_get_time() + STREAM_STALL_MS * 1000LL;
+    while (!stream_writable(fd, STREAM_POLL_MS)) {
+      const mjpeg_frame_t *newer = mjpeg_viewer_next(viewer, 0);
+      if (newer) {
+        mjpeg_viewer_done(viewer, frame, false, 0);
+        frame = newer;
+      }
+      if (esp_timer_get_time() >= stall) {
+        res = ESP_FAIL;
+        break;
+      }
     }
     if (res != ESP_OK) {
-      log_e("Send frame failed");
+      mjpeg_viewer_done(viewer, frame, false, 0);
       break;
     }
-    int64_t fr_end = esp_timer_get_time();
-
-#if CONFIG_ESP_FACE_DETECT_ENABLED && ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-    int64_t ready_time = (fr_ready - fr_start) / 1000;
-    int64_t face_time = (fr_face - fr_ready) / 1000;
-    int64_t recognize_time = (fr_recognize - fr_face) / 1000;
-    int64_t encode_time = (fr_encode - fr_recognize) / 1000;
-    int64_t process_time = (fr_encode - fr_start) / 1000;
-#endif
+    int64_t send_us = esp_timer_get_time();
+    int64_t deadline_us = send_us + STREAM_STALL_MS * 1000LL;
+    bool written = tiles ? stream_write_tiles(fd, frame, meta, deadline_us) : stream_write_part(fd, frame, meta, deadline_us);
+    if (!written) {
+      res = ESP_FAIL;
+    }
+    size_t frame_len = tiles && !frame->key ? frame->tiles_len : frame->len;
+    mjpeg_viewer_done(viewer, frame, res == ESP_OK, send_us);
 
-    int64_t frame_time = fr_end - last_frame;
-    frame_time /= 1000;
+    int64_t fr_end = esp_timer_get_time();
+    int64_t frame_time = (fr_end - last_frame) / 1000;
+    last_frame = fr_end;
 #if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
     uint32_t avg_frame_time = ra_filter_run(&ra_filter, frame_time);
 #endif
-    log_i(
-      "MJPG: %uB %ums (%.1ffps), AVG: %ums (%.1ffps)"
-#if CONFIG_ESP_FACE_DETECT_ENABLED
-      ", %u+%u+%u+%u=%u %s%d"
-#endif
-      ,
-      (uint32_t)(_jpg_buf_len), (uint32_t)frame_time, 1000.0 / (uint32_t)frame_time, avg_frame_time, 1000.0 / avg_frame_time
-#if CONFIG_ESP_FACE_DETECT_ENABLED
-      ,
-      (uint32_t)ready_time, (uint32_t)face_time, (uint32_t)recognize_time, (uint32_t)encode_time, (uint32_t)process_time, (detected) ? "DETECTED " : "", face_id
-#endif
-    );
+    log_i("MJPG: %uB %ums (%.1ffps), AVG: %ums (%.1ffps)", (uint32_t)frame_len, (uint32_t)frame_time, 1000.0 / (uint32_t)frame_time, avg_frame_time, 1000.0 / avg_frame_time);
   }
+  log_i("Stream viewer left: %u sent, %u dropped", (unsigned)viewer->sent, (unsigned)viewer->dropped);
+  mjpeg_broadcast_leave(viewer);
+  // a part may have been cut off, the connection can't be reused
+  httpd_sess_trigger_close(req->handle, fd);
 
 #if CONFIG_LED_ILLUMINATOR_ENABLED
   isStreaming = false;
@@ -749,6 +798,18 @@ static esp_err_t stream_handler(httpd_req_t *req) {
   return res;
 }
 
+static esp_err_t stream_handler(httpd_req_t *req) {
+  return httpd_async_submit(req, stream_send_handler, true);
+}
+
+static esp_err_t capture_async_handler(httpd_req_t *req) {
+  return httpd_async_submit(req, capture_handler, false);
+}
+
+static esp_err_t bmp_async_handler(httpd_req_t *req) {
+  return httpd_async_submit(req, bmp_handler, false);
+}
+
 static esp_err_t parse_get(httpd_req_t *req, char **obuf) {
   char *buf = NULL;
   size_t buf_len = 0;
@@ -770,22 +831,8 @@ static esp_err_t parse_get(httpd_req_t *req, char **obuf) {
   return ESP_FAIL;
 }
 
-static esp_err_t cmd_handler(httpd_req_t *req) {
-  char *buf = NULL;
-  char variable[32];
-  char value[32];
-
-  if (parse_get(req, &buf) != ESP_OK) {
-    return ESP_FAIL;
-  }
-  if (httpd_query_key_value(buf, "var", variable, sizeof(variable)) != ESP_OK || httpd_query_key_value(buf, "val", value, sizeof(value)) != ESP_OK) {
-    free(buf);
-    httpd_resp_send_404(req);
-    return ESP_FAIL;
-  }
-  free(buf);
-
-  int val = atoi(value);
+// Applies one /control variable, shared with the WebSocket channel.
+static int apply_control(const char *variable, int val) {
   log_i("%s = %d", variable, val);
   sensor_t *s = esp_camera_sensor_get();
   int res = 0;
@@ -875,8 +922,25 @@ static esp_err_t cmd_handler(httpd_req_t *req) {
     log_i("Unknown command: %s", variable);
     res = -1;
   }
+  return res;
+}
 
-  if (res < 0) {
+static esp_err_t cmd_handler(httpd_req_t *req) {
+  char *buf = NULL;
+  char variable[32];
+  char value[32];
+
+  if (parse_get(req, &buf) != ESP_OK) {
+    return ESP_FAIL;
+  }
+  if (httpd_query_key_value(buf, "var", variable, sizeof(variable)) != ESP_OK || httpd_query_key_value(buf, "val", value, sizeof(value)) != ESP_OK) {
+    free(buf);
+    httpd_resp_send_404(req);
+    return ESP_FAIL;
+  }
+  free(buf);
+
+  if (apply_control(variable, atoi(value)) < 0) {
     return httpd_resp_send_500(req);
   }
 
@@ -969,6 +1033,15 @@ static esp_err_t status_handler(httpd_req_t *req) {
   return httpd_resp_send(req, json_response, strlen(json_response));
 }
 
+static esp_err_t heap_handler(httpd_req_t *req) {
+  static char json_response[2048];
+
+  mem_policy_report_json(json_response, sizeof(json_response));
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  return httpd_resp_send(req, json_response, strlen(json_response));
+}
+
 static esp_err_t xclk_handler(httpd_req_t *req) {
   char *buf = NULL;
   char _xclk[32];
@@ -1306,7 +1379,7 @@ static esp_err_t subtraction_handler(httpd_req_t *req) {
 
     // Subtração dos dois frames
     size_t frame_size = fb1->len;
-    uint8_t *result_buf = (uint8_t *)malloc(frame_size);
+    uint8_t *result_buf = (uint8_t *)mem_class_alloc(MEM_CLASS_FRAME, frame_size);
     if (!result_buf) {
         ESP_LOGE("CAMERA", "Memory allocation for result frame failed");
         esp_camera_fb_return(fb1);
@@ -1332,7 +1405,7 @@ static esp_err_t subtraction_handler(httpd_req_t *req) {
     size_t jpg_len = 0;
 
     bool jpeg_converted = fmt2jpg(result_buf, frame_size, fb2->width, fb2->height, fb2->format, 90, &jpg_buf, &jpg_len);
-    free(result_buf);
+    mem_class_free(MEM_CLASS_FRAME, result_buf);
 
     if (!jpeg_converted) {
         ESP_LOGE("CAMERA", "JPEG conversion failed");
@@ -1357,26 +1430,36 @@ static esp_err_t subtraction_handler(httpd_req_t *req) {
     return ESP_OK;
 }
 
-#include <JPEGENC.h>
-JPEGENC jpgenc;
+static bool jpeg_stream_send_chunk(void *arg, const uint8_t *data, size_t len) {
+  return httpd_resp_send_chunk((httpd_req_t *)arg, (const char *)data, len) == ESP_OK;
+}
+
+// Newest pipeline frame, sent MCU row by MCU row while it is encoded
 static esp_err_t capture_two_frames_handler1(httpd_req_t *req) {
-    JPEGENCODE enc;
-    uint8_t *out_jpg   = NULL;
-    size_t out_jpg_len1 = 0, out_jpg_len2;
-    camera_fb_t *fb1 = esp_camera_fb_get();
-    sensor_t *s = esp_camera_sensor_get();
-    s->set_pixformat(s, PIXFORMAT_YUV422);
-    out_jpg = (uint8_t *) malloc(65536);
-    jpgenc.open(out_jpg, 65536);
-    jpgenc.encodeBegin(&enc, fb1->width, fb1->height, JPEGE_PIXEL_YUV422, JPEGE_SUBSAMPLE_420, JPEGE_Q_MED);
-    jpgenc.addFrame(&enc, fb1->buf, fb1->width * 2);
-    out_jpg_len2 = jpgenc.close(); 
-    httpd_resp_set_type(req, "image/jpeg");
-   // esp_err_t res = httpd_resp_send(req, (const char *)fb2->buf, fb2->len);
-    esp_err_t res = httpd_resp_send(req, (const char *)out_jpg, out_jpg_len2);
-    esp_camera_fb_return(fb1);
-    return res;
-    //free(out_jpg_len2);
+  const mp_result_t *result = motion_pipeline_acquire(0, 1000);
+  if (!result) {
+    log_e("No pipeline frame");
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+
+  char seq[16];
+  snprintf(seq, sizeof(seq), "%u", (unsigned)result->seq);
+  httpd_resp_set_type(req, "image/jpeg");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  httpd_resp_set_hdr(req, "X-Frame-Seq", seq);
+  jpeg_stream_res_t res = jpeg_stream_encode(result->frame, result->width, result->height, result->width, 80, jpeg_stream_send_chunk, req, 1000);
+  motion_pipeline_release(result);
+  if (res == JPEG_STREAM_BUSY) {
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    httpd_resp_sendstr(req, "JPEG encoder busy");
+    return ESP_OK;
+  }
+  if (res != JPEG_STREAM_OK) {
+    log_e("JPEG stream failed");
+    return ESP_FAIL;
+  }
+  return httpd_resp_send_chunk(req, NULL, 0);
 }
 
 static esp_err_t capture_two_frames_handler(httpd_req_t *req) {
@@ -1552,18 +1635,8 @@ static esp_err_t capture_and_subtract_handler(httpd_req_t *req) {
 static esp_err_t capture_and_test_jpeg_handler(httpd_req_t *req) {
     uint32_t totalHeap = ESP.getFreeHeap();
     
-    size_t max_jpg_len = 6000;  // Exemplo de 200 KB, ajuste conforme necessário
-    //uint8_t *jpg_buf = (uint8_t *) heap_caps_malloc(max_jpg_len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-    uint8_t *jpg_buf = (uint8_t *)  malloc(max_jpg_len);
-    //uint8_t *jpg_buf = (uint8_t *) heap_caps_malloc(5802, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-    //uint8_t *jpg_buf = NULL;
-    /*if (!jpg_buf) {
-        //esp_camera_fb_return(fb);
-        httpd_resp_set_status(req, "500 Internal Server Error");
-        httpd_resp_set_type(req, "text/plain");
-        httpd_resp_sendstr(req, "Error: memoria allocation for JPEG buffer failed");
-        return ESP_FAIL;
-    }*/
+    // fmt2jpg allocates its own output buffer, a preallocated one would only leak
+    uint8_t *jpg_buf = NULL;
     camera_fb_t *fb = esp_camera_fb_get();
     if (!fb) {
         httpd_resp_set_status(req, "500 Internal Server Error");
@@ -1633,35 +1706,49 @@ static esp_err_t capture_and_test_jpeg_handler(httpd_req_t *req) {
 #include <stdlib.h>
 
 #define BMP_HEADER_SIZE 54  // Cabeçalho BMP fixo de 54 bytes
+#define BMP_PALETTE_SIZE 1024  // 256 entradas BGRA, só para 8 bits por pixel
+
+static void bmp_put16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void bmp_put32(uint8_t *p, uint32_t v) {
+    bmp_put16(p, v);
+    bmp_put16(p + 2, v >> 16);
+}
 
-// Função para criar o cabeçalho BMP
-void create_bmp_header(uint8_t *header, size_t width, size_t height, size_t data_size) {
+// Função para criar o cabeçalho BMP. Com 8 bits por pixel a paleta vem logo
+// depois do cabeçalho; altura negativa grava as linhas de cima para baixo.
+// Escrito byte a byte, o cabeçalho não precisa estar alinhado.
+void create_bmp_header(uint8_t *header, size_t width, int32_t height, uint16_t bpp, size_t data_size) {
+    uint32_t offset = BMP_HEADER_SIZE + (bpp == 8 ? BMP_PALETTE_SIZE : 0);
     memset(header, 0, BMP_HEADER_SIZE);
 
     // Cabeçalho de Arquivo (14 bytes)
     header[0] = 'B';
     header[1] = 'M';  // Assinatura BMP
-    *(uint32_t *)(header + 2) = BMP_HEADER_SIZE + data_size;  // Tamanho total do arquivo
-    *(uint32_t *)(header + 10) = BMP_HEADER_SIZE;  // Offset para dados da imagem
+    bmp_put32(header + 2, offset + data_size);  // Tamanho total do arquivo
+    bmp_put32(header + 10, offset);  // Offset para dados da imagem
 
     // Cabeçalho de Informação (40 bytes)
-    *(uint32_t *)(header + 14) = 40;  // Tamanho do cabeçalho de informação
-    *(uint32_t *)(header + 18) = width;  // Largura da imagem
-    *(uint32_t *)(header + 22) = height;  // Altura da imagem
-    *(uint16_t *)(header + 26) = 1;  // Número de planos de cor
-    *(uint16_t *)(header + 28) = 24;  // Bits por pixel
-    *(uint32_t *)(header + 30) = 0;  // Compressão (0 para nenhum)
-    *(uint32_t *)(header + 34) = data_size;  // Tamanho dos dados da imagem
-    *(uint32_t *)(header + 38) = 2835;  // Resolução horizontal (pixels por metro)
-    *(uint32_t *)(header + 42) = 2835;  // Resolução vertical (pixels por metro)
-    *(uint32_t *)(header + 46) = 0;  // Número de cores na paleta (0 para padrão)
-    *(uint32_t *)(header + 50) = 0;  // Número de cores importantes (0 para todas)
+    bmp_put32(header + 14, 40);  // Tamanho do cabeçalho de informação
+    bmp_put32(header + 18, width);  // Largura da imagem
+    bmp_put32(header + 22, (uint32_t)height);  // Altura da imagem
+    bmp_put16(header + 26, 1);  // Número de planos de cor
+    bmp_put16(header + 28, bpp);  // Bits por pixel
+    bmp_put32(header + 30, 0);  // Compressão (0 para nenhum)
+    bmp_put32(header + 34, data_size);  // Tamanho dos dados da imagem
+    bmp_put32(header + 38, 2835);  // Resolução horizontal (pixels por metro)
+    bmp_put32(header + 42, 2835);  // Resolução vertical (pixels por metro)
+    bmp_put32(header + 46, bpp == 8 ? 256 : 0);  // Número de cores na paleta (0 para padrão)
+    bmp_put32(header + 50, 0);  // Número de cores importantes (0 para todas)
 }
 
 // Função para manipular a solicitação HTTP e enviar a imagem BMP
 static esp_err_t capture_and_test_bmp_handler(httpd_req_t *req) {
     size_t max_bmp_len = 10000;  // Ajuste o tamanho conforme necessário
-    uint8_t *bmp_buf = (uint8_t *) malloc(max_bmp_len);
+    uint8_t *bmp_buf = (uint8_t *) mem_class_alloc(MEM_CLASS_FRAME, max_bmp_len);
     if (!bmp_buf) {
         httpd_resp_set_status(req, "500 Internal Server Error");
         httpd_resp_set_type(req, "text/plain");
@@ -1674,7 +1761,7 @@ static esp_err_t capture_and_test_bmp_handler(httpd_req_t *req) {
         httpd_resp_set_status(req, "500 Internal Server Error");
         httpd_resp_set_type(req, "text/plain");
         httpd_resp_sendstr(req, "Error: Camera capture failed");
-        free(bmp_buf);
+        mem_class_free(MEM_CLASS_FRAME, bmp_buf);
         return ESP_FAIL;
     }
 
@@ -1682,7 +1769,7 @@ static esp_err_t capture_and_test_bmp_handler(httpd_req_t *req) {
     size_t bmp_total_size = BMP_HEADER_SIZE + bmp_data_size;
 
     if (bmp_total_size > max_bmp_len) {
-        free(bmp_buf);
+        mem_class_free(MEM_CLASS_FRAME, bmp_buf);
         esp_camera_fb_return(fb);
         httpd_resp_set_status(req, "500 Internal Server Error");
         httpd_resp_set_type(req, "text/plain");
@@ -1691,7 +1778,7 @@ static esp_err_t capture_and_test_bmp_handler(httpd_req_t *req) {
     }
 
     // Cria o cabeçalho BMP
-    create_bmp_header(bmp_buf, fb->width, fb->height, bmp_data_size);
+    create_bmp_header(bmp_buf, fb->width, fb->height, 24, bmp_data_size);
 
     // Copia os dados da imagem para o buffer BMP
     uint8_t *image_data = bmp_buf + BMP_HEADER_SIZE;
@@ -1717,7 +1804,7 @@ static esp_err_t capture_and_test_bmp_handler(httpd_req_t *req) {
     esp_err_t res = httpd_resp_send(req, (const char *)bmp_buf, bmp_total_size);
 
     // Libera a memória
-    free(bmp_buf);
+    mem_class_free(MEM_CLASS_FRAME, bmp_buf);
     esp_camera_fb_return(fb);
 
     if (res != ESP_OK) {
@@ -1730,31 +1817,237 @@ static esp_err_t capture_and_test_bmp_handler(httpd_req_t *req) {
     return ESP_OK;
 }
 
-static esp_err_t stream_handler1(httpd_req_t *req) {
-    camera_fb_t *fb1 = NULL;
-    camera_fb_t *fb2 = NULL;
-    camera_fb_t *fb1_aux = NULL;
-    camera_fb_t *fb2_aux = NULL;
-    esp_err_t res = ESP_OK;
-    size_t _jpg_buf_len = 0;
-    uint8_t *_jpg_buf = NULL;
-    char *part_buf[128];
 
-    static int64_t last_frame = 0;
-    if (!last_frame) {
-        last_frame = esp_timer_get_time();
-    }
+// Grayscale ramp palette of the 8-bit BMPs, built on first use.
+static const uint8_t *bmp_gray_palette(void) {
+  static uint8_t palette[BMP_PALETTE_SIZE];
 
-    res = httpd_resp_set_type(req, _STREAM_CONTENT_TYPE);
-    if (res != ESP_OK) {
-        return res;
+  if (!palette[BMP_PALETTE_SIZE - 2]) {
+    for (int i = 0; i < 256; i++) {
+      palette[i * 4] = palette[i * 4 + 1] = palette[i * 4 + 2] = i;
     }
+  }
+  return palette;
+}
 
-    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-    httpd_resp_set_hdr(req, "X-Framerate", "60");
+// Lossless capture for datasets: the newest frame as captured, without
+// annotations, as a binary PGM or with ?format=bmp as an 8-bit palettized
+// top-down BMP. The rows go from the pipeline result straight to the socket,
+// no conversion buffer.
+static esp_err_t raw_handler(httpd_req_t *req) {
+  char query[32];
+  char format[8];
+  bool bmp = httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK && httpd_query_key_value(query, "format", format, sizeof(format)) == ESP_OK
+             && !strcmp(format, "bmp");
+
+  const mp_result_t *result = motion_pipeline_acquire(0, 1000);
+  if (!result) {
+    log_e("No pipeline frame");
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+  const uint8_t *px = result->raw ? result->raw : result->frame;
+  size_t width = result->width;
+  size_t height = result->height;
 
-#if CONFIG_LED_ILLUMINATOR_ENABLED
-    isStreaming = true;
+  char ts[32];
+  char seq[16];
+  char disposition[48];
+  snprintf(ts, sizeof(ts), "%d.%06d", (int)(result->capture_us / 1000000), (int)(result->capture_us % 1000000));
+  snprintf(seq, sizeof(seq), "%u", (unsigned)result->seq);
+  snprintf(disposition, sizeof(disposition), "inline; filename=frame_%u.%s", (unsigned)result->seq, bmp ? "bmp" : "pgm");
+  httpd_resp_set_type(req, bmp ? "image/bmp" : "image/x-portable-graymap");
+  httpd_resp_set_hdr(req, "Content-Disposition", disposition);
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  httpd_resp_set_hdr(req, "X-Timestamp", ts);
+  httpd_resp_set_hdr(req, "X-Frame-Seq", seq);
+
+  esp_err_t res;
+  if (bmp) {
+    // BMP rows are padded to 4 bytes
+    size_t stride = (width + 3) & ~3;
+    uint8_t header[BMP_HEADER_SIZE];
+    create_bmp_header(header, width, -(int32_t)height, 8, stride * height);
+    res = httpd_resp_send_chunk(req, (const char *)header, sizeof(header));
+    if (res == ESP_OK) {
+      res = httpd_resp_send_chunk(req, (const char *)bmp_gray_palette(), BMP_PALETTE_SIZE);
+    }
+    if (stride == width) {
+      if (res == ESP_OK) {
+        res = httpd_resp_send_chunk(req, (const char *)px, width * height);
+      }
+    } else {
+      static const char pad[3] = {};
+      for (size_t y = 0; y < height && res == ESP_OK; y++) {
+        res = httpd_resp_send_chunk(req, (const char *)px + y * width, width);
+        if (res == ESP_OK) {
+          res = httpd_resp_send_chunk(req, pad, stride - width);
+        }
+      }
+    }
+  } else {
+    char header[24];
+    int hlen = snprintf(header, sizeof(header), "P5\n%u %u\n255\n", (unsigned)width, (unsigned)height);
+    res = httpd_resp_send_chunk(req, header, hlen);
+    if (res == ESP_OK) {
+      res = httpd_resp_send_chunk(req, (const char *)px, width * height);
+    }
+  }
+  motion_pipeline_release(result);
+  if (res == ESP_OK) {
+    res = httpd_resp_send_chunk(req, NULL, 0);
+  }
+  return res;
+}
+
+static esp_err_t raw_async_handler(httpd_req_t *req) {
+  return httpd_async_submit(req, raw_handler, false);
+}
+
+static size_t lossless_send_chunk(void *arg, size_t index, const void *data, size_t len) {
+  return httpd_resp_send_chunk((httpd_req_t *)arg, (const char *)data, len) == ESP_OK ? len : 0;
+}
+
+static bool lossless_wants_mask(httpd_req_t *req) {
+  char query[48];
+  char value[8];
+
+  return httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK && httpd_query_key_value(query, "src", value, sizeof(value)) == ESP_OK
+         && !strcmp(value, "mask");
+}
+
+// Newest frame as captured, or with ?src=mask the motion mask, coded with
+// the lossless codec (lossless_gray.h) while it is being sent.
+static esp_err_t lossless_handler(httpd_req_t *req) {
+  bool mask = lossless_wants_mask(req);
+
+  const mp_result_t *result = motion_pipeline_acquire(0, 1000);
+  if (!result) {
+    log_e("No pipeline frame");
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+  const uint8_t *px = mask ? result->mask : result->raw ? result->raw : result->frame;
+  char ts[32];
+  char seq[16];
+  char disposition[48];
+  snprintf(ts, sizeof(ts), "%d.%06d", (int)(result->capture_us / 1000000), (int)(result->capture_us % 1000000));
+  snprintf(seq, sizeof(seq), "%u", (unsigned)result->seq);
+  snprintf(disposition, sizeof(disposition), "inline; filename=%s_%u.lgr", mask ? "mask" : "frame", (unsigned)result->seq);
+  httpd_resp_set_type(req, "application/octet-stream");
+  httpd_resp_set_hdr(req, "Content-Disposition", disposition);
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  httpd_resp_set_hdr(req, "X-Timestamp", ts);
+  httpd_resp_set_hdr(req, "X-Frame-Seq", seq);
+  bool ok = lossless_gray_encode(px, result->width, result->height, result->width, lossless_send_chunk, req);
+  motion_pipeline_release(result);
+  return ok ? httpd_resp_send_chunk(req, NULL, 0) : ESP_FAIL;
+}
+
+static esp_err_t lossless_async_handler(httpd_req_t *req) {
+  return httpd_async_submit(req, lossless_handler, false);
+}
+
+#define STORE_RECORD_MAX_S 60
+
+// Lossless archive on flash (frame_store.h): ?save=1 stores the newest frame
+// (&src=mask its mask) and answers {"id":n}, ?record=<seconds> starts a
+// sequence and answers {"id":n}, ?get=<name> sends a stored file, otherwise
+// the file list.
+static esp_err_t store_handler(httpd_req_t *req) {
+  char query[48];
+  char value[16];
+  bool has_query = httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK;
+
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  if (has_query && httpd_query_key_value(query, "get", value, sizeof(value)) == ESP_OK) {
+    httpd_resp_set_type(req, "application/octet-stream");
+    frame_store_res_t sent = frame_store_send(value, lossless_send_chunk, req);
+    if (sent == FRAME_STORE_MISSING) {
+      return httpd_resp_send_404(req);
+    }
+    if (sent == FRAME_STORE_BUSY) {
+      httpd_resp_set_status(req, "503 Service Unavailable");
+      httpd_resp_set_hdr(req, "Retry-After", "1");
+      return httpd_resp_send(req, NULL, 0);
+    }
+    return sent == FRAME_STORE_OK ? httpd_resp_send_chunk(req, NULL, 0) : ESP_FAIL;
+  }
+
+  httpd_resp_set_type(req, "application/json");
+  if (has_query && httpd_query_key_value(query, "record", value, sizeof(value)) == ESP_OK) {
+    int seconds = atoi(value);
+    if (seconds < 1 || seconds > STORE_RECORD_MAX_S) {
+      return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "record takes 1-60 seconds");
+    }
+    int32_t id = frame_store_record(seconds * 1000);
+    if (id < 0) {
+      httpd_resp_set_status(req, "503 Service Unavailable");
+      return httpd_resp_sendstr(req, "{\"error\":\"recording or no space\"}");
+    }
+    char reply[24];
+    snprintf(reply, sizeof(reply), "{\"id\":%d}", (int)id);
+    return httpd_resp_sendstr(req, reply);
+  }
+  if (has_query && httpd_query_key_value(query, "save", value, sizeof(value)) == ESP_OK && atoi(value)) {
+    const mp_result_t *result = motion_pipeline_acquire(0, 1000);
+    if (!result) {
+      log_e("No pipeline frame");
+      httpd_resp_send_500(req);
+      return ESP_FAIL;
+    }
+    int32_t id = frame_store_save(result, lossless_wants_mask(req));
+    motion_pipeline_release(result);
+    if (id < 0) {
+      httpd_resp_send_500(req);
+      return ESP_FAIL;
+    }
+    char reply[24];
+    snprintf(reply, sizeof(reply), "{\"id\":%d}", (int)id);
+    return httpd_resp_sendstr(req, reply);
+  }
+
+  // Runs on a pool worker, next to other requests: no static buffer
+  char *json = (char *)mem_class_alloc(MEM_CLASS_JPEG, FRAME_STORE_JSON_MAX);
+  if (!json) {
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+  size_t len = frame_store_report_json(json, FRAME_STORE_JSON_MAX);
+  esp_err_t res = httpd_resp_send(req, json, len);
+  mem_class_free(MEM_CLASS_JPEG, json);
+  return res;
+}
+
+static esp_err_t store_async_handler(httpd_req_t *req) {
+  return httpd_async_submit(req, store_handler, false);
+}
+
+static esp_err_t stream_handler1(httpd_req_t *req) {
+    camera_fb_t *fb1 = NULL;
+    camera_fb_t *fb2 = NULL;
+    camera_fb_t *fb1_aux = NULL;
+    camera_fb_t *fb2_aux = NULL;
+    esp_err_t res = ESP_OK;
+    size_t _jpg_buf_len = 0;
+    uint8_t *_jpg_buf = NULL;
+    char *part_buf[128];
+
+    static int64_t last_frame = 0;
+    if (!last_frame) {
+        last_frame = esp_timer_get_time();
+    }
+
+    res = httpd_resp_set_type(req, _STREAM_CONTENT_TYPE);
+    if (res != ESP_OK) {
+        return res;
+    }
+
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    httpd_resp_set_hdr(req, "X-Framerate", "60");
+
+#if CONFIG_LED_ILLUMINATOR_ENABLED
+    isStreaming = true;
     enable_led(true);
 #endif
     Serial.begin(115200);
@@ -1802,7 +2095,7 @@ static esp_err_t stream_handler1(httpd_req_t *req) {
 
         // Subtração dos dois frames
         size_t frame_size = fb1_aux->len;
-        uint8_t *result_buf = (uint8_t *)malloc(frame_size);
+        uint8_t *result_buf = (uint8_t *)mem_class_alloc(MEM_CLASS_FRAME, frame_size);
         if (!result_buf) {
             esp_camera_fb_return(fb1_aux);
             esp_camera_fb_return(fb2_aux);
@@ -1832,7 +2125,7 @@ static esp_err_t stream_handler1(httpd_req_t *req) {
         // Convertendo o resultado para JPEG
         bool jpeg_converted = fmt2jpg(result_buf, frame_size, fb1_aux->width, fb1_aux->height, PIXFORMAT_GRAYSCALE, 80, &_jpg_buf, &_jpg_buf_len);
         
-        free(result_buf);
+        mem_class_free(MEM_CLASS_FRAME, result_buf);
 
         if (!jpeg_converted) {
             log_e("JPEG conversion failed");
@@ -2066,15 +2359,16 @@ static esp_err_t capture_and_subtract_handler4(httpd_req_t *req) {
     Serial.println(freeHeap);
     // Captura o primeiro frame
     camera_fb_t *fb1 = esp_camera_fb_get();
-    uint8_t *frame1_copy = (uint8_t *)malloc(fb1->len);
+    uint8_t *frame1_copy = (uint8_t *)mem_class_alloc(MEM_CLASS_FRAME, fb1->len);
+    static copy_job_t copy;
+    static bool copy_ready = copy_job_init(&copy);
+    (void)copy_ready;
+    copy_service_submit(&copy, frame1_copy, fb1->buf, fb1->len, NULL, NULL);
     Serial.println("fb1 len \n");
     Serial.println(fb1->len);
-    for(uint8_t i=0;i<fb1->len;i++){
-      frame1_copy[i] = fb1->buf[i];
-      //Serial.println(i);
-    }
 
-    //memcpy(frame1_copy, fb1->buf, fb1->len);
+    // The driver buffer can only be given back once the copy is done
+    copy_service_wait(&copy, OS_WAIT_FOREVER);
     esp_camera_fb_return(fb1);
     size_t freeHeap2 = heap_caps_get_free_size(MALLOC_CAP_8BIT);
     camera_fb_t *fb2 = esp_camera_fb_get();
@@ -2093,8 +2387,8 @@ static esp_err_t capture_and_subtract_handler4(httpd_req_t *req) {
       Serial.println(fb2->buf[i]);
     
     } 
-    esp_camera_fb_return(fb1);
     esp_camera_fb_return(fb2);
+    mem_class_free(MEM_CLASS_FRAME, frame1_copy);
     return ESP_OK;
 }
 
@@ -2102,12 +2396,6 @@ static esp_err_t capture_and_subtract_handler4(httpd_req_t *req) {
 
 
 
-uint8_t *  jpg_buf = NULL;
-size_t  len = NULL;
-size_t  wt = NULL;
-size_t  he = NULL;
-int cont = 0;
-
 typedef struct {
     int x_min, x_max, y_min, y_max;
     int pixel_count;
@@ -2217,41 +2505,20 @@ static Region* process_image(uint8_t *buffer,size_t buf_len,size_t width) {
 }
 
 static int detectObjectsInMotion(uint8_t* binaryImage, int width, int height) {
-    //const int MAX_LABELS = 256; // Limite de regiões a detectar
-    int labels[width * height]; // Matriz de rótulos
-    int labelCount = 1;
-    int tes = 1;
-    // Array para armazenar tamanhos das regiões
-    int regionSizes[240 * 240];
-    printf("inicio");
-    // Algoritmo de rotulagem simples (4 conectados)
-    for (int y = 0; y < height; y++) {
-       printf("inicio1");
-        for (int x = 0; x < width; x++) {
-            if (binaryImage[y * width + x] > 0) {
-                int left = (x > 0) ? labels[y * width + (x - 1)] : 0;
-                int top = (y > 0) ? labels[(y - 1) * width + x] : 0;
-
-                if (left > 0) {
-                    labels[y * width + x] = left;
-                } else if (top > 0) {
-                    labels[y * width + x] = top;
-                } else {
-                    labelCount++;
-                    labels[y * width + x] =labelCount ;
-                }
-
-                // Incrementa o tamanho da região
-                regionSizes[labels[y * width + x]]++;
-            }
-        }
+    // Rotulagem em duas linhas de rótulos, as estatísticas ficam em md_regions_t
+    md_regions_t regions;
+    void *scratch = frame_arena_alloc(MEM_CLASS_LABELS, md_scratch_size(width));
+    if (!scratch) {
+        return 0;
     }
-    return labelCount;
- 
+    return md_label_regions(binaryImage, width, height, scratch, &regions, NULL);
 }
 static int detectObjectsInMotion1(uint8_t* binaryImage){
   int labelc = 1;
-  int labels[240 * 240];
+  md_label_t *labels = (md_label_t *) frame_arena_alloc(MEM_CLASS_LABELS, 240 * 240 * sizeof(md_label_t));
+  if (!labels) {
+    return 0;
+  }
   for (int y = 0; y < 240; y++) {
     for (int x = 0; x < 240; x++) {
       if(binaryImage[y * 240 + x] == 255){
@@ -2270,8 +2537,8 @@ static int detectObjectsInMotion1(uint8_t* binaryImage){
 #define MAX_LABELS 256 // Limite de rótulos, ajustável para a resolução da imagem
 
 typedef struct {
-    int parent[MAX_LABELS];
-    int rank[MAX_LABELS];
+    uint16_t parent[MAX_LABELS];
+    uint8_t rank[MAX_LABELS];
 } LabelEquivalence;
 
 // Inicializa o sistema de equivalência
@@ -2308,7 +2575,7 @@ void unionLabels(LabelEquivalence* eq, int x, int y) {
 }
 
 // Função principal para 4-conectados
-int connectedComponents4(uint8_t* binaryImage, int width, int height, int* labels) {
+int connectedComponents4(uint8_t* binaryImage, int width, int height, md_label_t* labels) {
     LabelEquivalence eq;
     initEquivalence(&eq);
 
@@ -2336,9 +2603,12 @@ int connectedComponents4(uint8_t* binaryImage, int width, int height, int* label
                     if (top > 0 && top != smallestLabel) {
                         unionLabels(&eq, top, smallestLabel);
                     }
-                } else {
+                } else if (currentLabel < MAX_LABELS) {
                     // Novo rótulo
                     labels[y * width + x] = currentLabel++;
+                } else {
+                    // Sem rótulos livres: junta ao último rótulo
+                    labels[y * width + x] = MAX_LABELS - 1;
                 }
             } else {
                 labels[y * width + x] = 0; // Fundo
@@ -2359,30 +2629,11 @@ int connectedComponents4(uint8_t* binaryImage, int width, int height, int* label
 }
 
 void dilate(uint8_t* image, int width, int height) {
-    uint8_t* temp = (uint8_t*)malloc(width * height);
-    for (int y = 1; y < height - 1; y++) {
-        for (int x = 1; x < width - 1; x++) {
-            uint8_t maxPixel = 0;
-            for (int dy = -1; dy <= 1; dy++) {
-                for (int dx = -1; dx <= 1; dx++) {
-                    maxPixel = max(maxPixel, image[(y + dy) * width + (x + dx)]);
-                }
-            }
-            temp[y * width + x] = maxPixel;
-        }
-    }
-    // Define as bordas como zero
-    for (int x = 0; x < width; x++) {
-        temp[x] = 0;                     // Linha superior
-        temp[(height - 1) * width + x] = 0; // Linha inferior
-    }
-    for (int y = 0; y < height; y++) {
-        temp[y * width] = 0;             // Coluna esquerda
-        temp[y * width + (width - 1)] = 0; // Coluna direita
+    uint8_t* temp = (uint8_t*)frame_arena_alloc(MEM_CLASS_MASK, width * height);
+    if (!temp) {
+        return;
     }
-
-    memcpy(image, temp, width * height);
-    free(temp);
+    md_dilate(image, width, height, temp);
 }
 
 
@@ -2408,7 +2659,7 @@ int detectContoursNoModify(const uint8_t* binaryImage, int width, int height, Co
     int numContours = 0;
     
     // Matriz de pixels visitados
-    bool* visited = (bool*)malloc(width * height * sizeof(bool));
+    bool* visited = (bool*)frame_arena_alloc(MEM_CLASS_MASK, width * height * sizeof(bool));
     if (!visited) {
         printf("Erro: Falha ao alocar memória para matriz visited.\n");
         return 0;
@@ -2434,7 +2685,6 @@ int detectContoursNoModify(const uint8_t* binaryImage, int width, int height, Co
             // Verifica limite de contornos
             if (numContours >= maxContours) {
                 printf("Aviso: Número máximo de contornos atingido.\n");
-                free(visited);
                 return numContours;
             }
 
@@ -2478,14 +2728,13 @@ int detectContoursNoModify(const uint8_t* binaryImage, int width, int height, Co
         }
     }
 
-    free(visited); // Libera a memória da matriz visited
     return numContours;
 }
 #include <stack>
 // Função para contar regiões conectadas (8-conectados)
 int countRegions(uint8_t* image, int width, int height) {
     // Matriz para marcar os pixels visitados
-    bool* visited = (bool*)malloc(width * height * sizeof(bool));
+    bool* visited = (bool*)frame_arena_alloc(MEM_CLASS_MASK, width * height * sizeof(bool));
     if (!visited) {
         // Tratar erro de alocação de memória
         return -1;
@@ -2538,7 +2787,6 @@ int countRegions(uint8_t* image, int width, int height) {
         }
     }
 
-    free(visited); // Libera a memória alocada
     return regionCount;
 }
 
@@ -2551,7 +2799,7 @@ struct BoundingBox {
 // Função para detectar regiões conectadas e calcular as bounding boxes
 std::vector<BoundingBox> detectRegionsWithBoundingBoxes(uint8_t* image, int width, int height) {
     // Matriz para marcar os pixels visitados
-    bool* visited = (bool*)ps_malloc(width * height * sizeof(bool));
+    bool* visited = (bool*)frame_arena_alloc(MEM_CLASS_MASK, width * height * sizeof(bool));
     if (!visited) {
         // Tratar erro de alocação de memória
         return {};
@@ -2613,7 +2861,6 @@ std::vector<BoundingBox> detectRegionsWithBoundingBoxes(uint8_t* image, int widt
         }
     }
 
-    free(visited); // Libera a memória alocada
     return boundingBoxes;
 }
 void applyMeanFilter(uint8_t* image, uint8_t* output, int width, int height, int kernelSize) {
@@ -2650,7 +2897,7 @@ void applyMeanFilterInPlace(uint8_t* image, int width, int height, int kernelSiz
     int halfKernel = kernelSize / 2;
 
     // Buffer temporário para armazenar uma linha suavizada
-    uint8_t* tempRow = (uint8_t*) ps_malloc(width * sizeof(uint8_t));
+    uint8_t* tempRow = (uint8_t*) frame_arena_alloc(MEM_CLASS_LINE, width * sizeof(uint8_t));
     if (!tempRow) {
         // Erro de alocação
         return;
@@ -2684,125 +2931,369 @@ void applyMeanFilterInPlace(uint8_t* image, int width, int height, int kernelSiz
         // Copia a linha suavizada de volta para a imagem
         memcpy(&image[y * width], tempRow, width);
     }
+}
+// Draws the motion boxes on the published copy of the frame, called by the
+// processing task of the motion pipeline.
+static void draw_motion_boxes(uint8_t *frame, uint16_t width, uint16_t height, const md_regions_t *boxes, void *arg) {
+    uint32_t color = FACE_COLOR_GREEN;
+    fb_data_t fb_aux_data;
+    fb_data_t *fb_aux = &fb_aux_data;
+    fb_aux->width = width;
+    fb_aux->height = height;
+    fb_aux->bytes_per_pixel = 1;
+    fb_aux->format = FB_GRAY;
+    fb_aux->data = frame;
+    for (int i = 0; i < boxes->count; i++) {
+      int w =  boxes->max_x[i] - boxes->min_x[i] + 1;
+      int h =  boxes->max_y[i] - boxes->min_y[i] + 1;
 
-    free(tempRow); // Libera o buffer temporário
+      fb_gfx_drawFastHLine(fb_aux, boxes->min_x[i], boxes->min_y[i], w, color);
+      fb_gfx_drawFastHLine(fb_aux, boxes->min_x[i], boxes->min_y[i]+h, w, color);
+      fb_gfx_drawFastVLine(fb_aux, boxes->min_x[i], boxes->min_y[i], h, color);
+      fb_gfx_drawFastVLine(fb_aux, boxes->min_x[i]+w-1, boxes->min_y[i], h, color);
+    }
 }
+
+// Capture, diff and labeling run in the motion pipeline tasks, the handler
+// only serves the newest annotated result from the encode cache.
 static esp_err_t capture_and_subtract_handler5(httpd_req_t *req) {
-  
+  ec_key_t key = {EC_FORMAT_JPEG, 90, true};
+  return send_cached_snapshot(req, &key, "image/jpeg", "inline; filename=capture.jpg");
+}
+
+static esp_err_t subtraction_async_handler(httpd_req_t *req) {
+  return httpd_async_submit(req, capture_and_subtract_handler5, false);
+}
+
+#define ROI_MAX_CROPS 8
+#define ROI_OUT_SIZE  (32 * 1024)
+
+static const char *_ROI_CONTENT_TYPE = "multipart/mixed;boundary=" PART_BOUNDARY;
+static const char *_ROI_PART = "\r\n--" PART_BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\nX-Roi: %u,%u,%u,%u\r\n\r\n";
+static const char *_ROI_END = "\r\n--" PART_BOUNDARY "--\r\n";
+
+// JPEG crops around the moving objects of the newest result, taken from the
+// frame without the motion boxes. Without parameters the largest region is
+// sent; box=N picks region N, multipart=1 sends every region as one part of
+// a multipart/mixed response. margin (px) and quality (0-100) tune the crops.
+static esp_err_t roi_handler(httpd_req_t *req) {
+  char query[96];
+  char value[12];
+  char roi_hdr[32];
+  int box = -1;
+  bool multipart = false;
+  int margin = 8;
+  int quality = 90;
   esp_err_t res = ESP_OK;
-  printf("\n memoria livre %d",ESP.getFreeHeap());
-  if(cont == 0){
-     camera_fb_t *fb = esp_camera_fb_get();
-     jpg_buf = (uint8_t *) ps_malloc(fb->len);
-     jpg_buf = fb->buf;
-     len = fb->len;
-     wt = fb->width;
-     he = fb->height;
-     esp_camera_fb_return(fb);
-     Serial.print("buffer par \n");
-  }
-  else{
-  Contour contours[MAX_CONTOURS];
-  camera_fb_t *fb2 = esp_camera_fb_get();
-  len = fb2->len;
-  uint8_t * subtraction_buffer = NULL;
-  subtraction_buffer = (uint8_t *) ps_malloc(fb2->len);
-  printf("controle0 \n");
-  //applyMeanFilterInPlace(fb2->buf,240,240,3);
-  for (int i = 0; i < len; i++) {
-    uint8_t diff = abs(fb2->buf[i] - jpg_buf[i]); // Subtração absoluta de cada pixel
-    
-    if (diff > 70) {
-      diff = 255; // Branco
-    } else {
-      diff = 0; // Preto
+
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+    if (httpd_query_key_value(query, "box", value, sizeof(value)) == ESP_OK) {
+      box = atoi(value);
+    }
+    if (httpd_query_key_value(query, "multipart", value, sizeof(value)) == ESP_OK) {
+      multipart = atoi(value) != 0;
+    }
+    if (httpd_query_key_value(query, "margin", value, sizeof(value)) == ESP_OK) {
+      margin = atoi(value);
+    }
+    if (httpd_query_key_value(query, "quality", value, sizeof(value)) == ESP_OK) {
+      quality = atoi(value);
     }
-    subtraction_buffer[i] = (uint8_t)diff; // Armazenando o resultado da subtração
   }
-  //int number = detectObjectsInMotion(subtraction_buffer,240,240);
-  dilate(subtraction_buffer,240,240);
-  int* labels = (int*) ps_malloc(240 * 240 * sizeof(int));
 
-  // Inicializa o array
-  for (int i = 0; i < 240 * 240; i++) {
-      labels[i] = 0;
+  margin = margin < 0 ? 0 : margin > 64 ? 64 : margin;
+  quality = quality < 0 ? 0 : quality > 100 ? 100 : quality;
+
+  const mp_result_t *result = motion_pipeline_acquire(0, 1000);
+  if (!result) {
+    log_e("No motion result published");
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
   }
-  //int numComponents = connectedComponents4(subtraction_buffer, 240, 240, labels);
-  int numComponents = countRegions(subtraction_buffer,240,240);
-  std::vector<BoundingBox> boxes = detectRegionsWithBoundingBoxes(subtraction_buffer,240,240); 
- /* for (size_t i = 0; i < boxes.size(); i++) {
-        printf("Região %zu: MinX=%d, MinY=%d, MaxX=%d, MaxY=%d\n",
-               i + 1, boxes[i].minX, boxes[i].minY, boxes[i].maxX, boxes[i].maxY);
-  }*/
-  //int number = detectObjectsInMotion1(subtraction_buffer);
- 
-  
-  //Region* reg = process_image(subtraction_buffer,fb2->len,fb2->width);
-    
-    /*int x =  boxes[0].minX;
-    int y =  boxes[0].minY;
-    int w =  boxes[0].maxX - x + 1;
-    int h =  boxes[0].maxY - y + 1;*/
-    //printf("%d %d %d %d ",x,y,reg[0].x_max,reg[0].y_max);
-    uint32_t color = FACE_COLOR_GREEN;
-    fb_data_t *fb_aux = NULL;
-    printf("controle1 \n");
-    //fb_aux = (fb_data_t *) heap_caps_malloc(fb2->len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-    fb_aux = (fb_data_t *) ps_malloc(fb2->len);
-    fb_format_t forma = FB_GRAY;
-    printf("\n controle2 \n");
-    fb_aux->width = fb2->width;
-    fb_aux->height = fb2->height;
-    fb_aux->bytes_per_pixel = 1;
-    fb_aux->format = forma;
-    fb_aux->data = fb2->buf;
-    printf("\n controle3 \n");
-    //fb_gfx_drawFastHLine(fb_aux, 207, 235, 213-207 + 1, color);
-     if(boxes.size() > 0){
-      for (size_t i = 0; i < boxes.size(); i++) {
-        int w =  boxes[i].maxX - boxes[i].minX + 1;
-        int h =  boxes[i].maxY - boxes[i].minY + 1;
-        
-        fb_gfx_drawFastHLine(fb_aux, boxes[i].minX, boxes[i].minY, w, color);
-        fb_gfx_drawFastHLine(fb_aux, boxes[i].minX, boxes[i].minY+h, w, color);
-        fb_gfx_drawFastVLine(fb_aux, boxes[i].minX, boxes[i].minY, h, color);
-        fb_gfx_drawFastVLine(fb_aux, boxes[i].minX+w-1, boxes[i].minY, h, color);
+  const md_regions_t *regions = &result->regions;
+  const uint8_t *frame = result->raw ? result->raw : result->frame;
+  int first = multipart ? 0 : box < 0 ? roi_jpeg_largest(regions) : box;
+  int last = multipart ? (regions->count < ROI_MAX_CROPS ? regions->count : ROI_MAX_CROPS) : first + 1;
+
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  char seq[16];
+  snprintf(seq, sizeof(seq), "%u", result->seq);
+  httpd_resp_set_hdr(req, "X-Frame-Seq", seq);
+  if (first < 0 || first >= regions->count) {
+    motion_pipeline_release(result);
+    httpd_resp_set_status(req, multipart || box < 0 ? "204 No Content" : "404 Not Found");
+    return httpd_resp_send(req, NULL, 0);
+  }
+
+  uint8_t *out = (uint8_t *)mem_class_alloc(MEM_CLASS_JPEG, ROI_OUT_SIZE);
+  if (!out) {
+    motion_pipeline_release(result);
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+  httpd_resp_set_type(req, multipart ? _ROI_CONTENT_TYPE : "image/jpeg");
+  for (int i = first; i < last && res == ESP_OK; i++) {
+    roi_rect_t roi;
+    size_t len = 0;
+    if (roi_jpeg_align(regions, i, result->width, result->height, margin, &roi)) {
+      len = roi_jpeg_encode(frame, result->width, &roi, quality, out, ROI_OUT_SIZE);
+    }
+    if (!len) {
+      res = ESP_FAIL;
+      break;
+    }
+    if (!multipart) {
+      snprintf(roi_hdr, sizeof(roi_hdr), "%u,%u,%u,%u", roi.x, roi.y, roi.w, roi.h);
+      httpd_resp_set_hdr(req, "X-Roi", roi_hdr);
+      res = httpd_resp_send(req, (const char *)out, len);
+      break;
+    }
+    char part_buf[192];
+    size_t hlen = snprintf(part_buf, sizeof(part_buf), _ROI_PART, (unsigned)len, roi.x, roi.y, roi.w, roi.h);
+    res = httpd_resp_send_chunk(req, part_buf, hlen);
+    if (res == ESP_OK) {
+      res = httpd_resp_send_chunk(req, (const char *)out, len);
+    }
+  }
+  if (multipart && res == ESP_OK) {
+    res = httpd_resp_send_chunk(req, _ROI_END, strlen(_ROI_END));
+    httpd_resp_send_chunk(req, NULL, 0);
+  } else if (!multipart && res != ESP_OK) {
+    httpd_resp_send_500(req);
+  }
+  mem_class_free(MEM_CLASS_JPEG, out);
+  motion_pipeline_release(result);
+  return res;
+}
+
+static esp_err_t roi_async_handler(httpd_req_t *req) {
+  return httpd_async_submit(req, roi_handler, false);
+}
+
+static bool mask_wants_stream(httpd_req_t *req) {
+  char query[32];
+  char value[4];
+
+  return httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK && httpd_query_key_value(query, "stream", value, sizeof(value)) == ESP_OK
+         && atoi(value) != 0;
+}
+
+// Binary motion mask of the newest pipeline result, bit-packed and PackBits
+// coded (see mask_codec.h), with its size and frame in X- headers. With
+// ?stream=1 every following result is sent as a multipart part.
+static esp_err_t mask_handler(httpd_req_t *req) {
+  bool stream = mask_wants_stream(req);
+  esp_err_t res = ESP_OK;
+  uint8_t *out = NULL;
+  size_t out_cap = 0;
+  uint32_t last_seq = 0;
+
+  if (stream) {
+    httpd_resp_set_type(req, _STREAM_CONTENT_TYPE);
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    res = httpd_resp_send_chunk(req, _STREAM_BOUNDARY, strlen(_STREAM_BOUNDARY));
+  }
+  while (res == ESP_OK) {
+    const mp_result_t *result = motion_pipeline_acquire(last_seq, 1000);
+    if (!result) {
+      if (stream) {
+        if (stream_peer_closed(httpd_req_to_sockfd(req))) {
+          res = ESP_FAIL;
+        }
+        continue;
       }
-     }
-    /*
-    int x =  boxes[0].minX;
-    int y =  boxes[0].minY;
-    int w =  boxes[0].maxX - x + 1;
-    int h =  boxes[0].maxY - y + 1;
-    
-    fb_gfx_drawFastHLine(fb_aux, x, y+h-1, w, color);
-    fb_gfx_drawFastVLine(fb_aux, x, y, h, color);
-    fb_gfx_drawFastVLine(fb_aux, x+w-1, y, w, color);*/
-    //delete[] reg;
-  
-  //heap_caps_free(jpg_buf);
-  //jpg_buf = NULL;
-  //jpg_buf = (uint8_t *) heap_caps_malloc(fb2->len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-  jpg_buf = (uint8_t *) ps_malloc(fb2->len);
-  memcpy(jpg_buf,fb2->buf,fb2->len);
-  printf("\n controle4 \n");
-  httpd_resp_set_type(req, "image/jpeg");
-  httpd_resp_set_hdr(req, "Content-Disposition", "inline; filename=capture.jpg");
+      log_e("No pipeline frame");
+      httpd_resp_send_500(req);
+      return ESP_FAIL;
+    }
+    unsigned width = result->width;
+    unsigned height = result->height;
+    size_t need = mask_encoded_max(width, height);
+    if (need > out_cap) {
+      mem_class_free(MEM_CLASS_MASK, out);
+      out = (uint8_t *)mem_class_alloc(MEM_CLASS_MASK, need);
+      out_cap = out ? need : 0;
+    }
+    size_t len = out ? mask_encode(result->mask, width, height, out, out_cap) : 0;
+    last_seq = result->seq;
+    motion_pipeline_release(result);
+    if (!len) {
+      log_e("Mask encoding failed");
+      if (!stream) {
+        httpd_resp_send_500(req);
+      }
+      res = ESP_FAIL;
+      break;
+    }
+
+    if (stream) {
+      char part_buf[160];
+      size_t hlen = snprintf(part_buf, sizeof(part_buf), _MASK_PART, (unsigned)len, width, height, (unsigned)last_seq);
+      res = httpd_resp_send_chunk(req, part_buf, hlen);
+      if (res == ESP_OK) {
+        res = httpd_resp_send_chunk(req, (const char *)out, len);
+      }
+      if (res == ESP_OK) {
+        res = httpd_resp_send_chunk(req, _STREAM_BOUNDARY, strlen(_STREAM_BOUNDARY));
+      }
+      continue;
+    }
+    char w_str[8];
+    char h_str[8];
+    char seq[16];
+    snprintf(w_str, sizeof(w_str), "%u", width);
+    snprintf(h_str, sizeof(h_str), "%u", height);
+    snprintf(seq, sizeof(seq), "%u", (unsigned)last_seq);
+    httpd_resp_set_type(req, "application/octet-stream");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    httpd_resp_set_hdr(req, "X-Width", w_str);
+    httpd_resp_set_hdr(req, "X-Height", h_str);
+    httpd_resp_set_hdr(req, "X-Frame-Seq", seq);
+    httpd_resp_set_hdr(req, "X-Encoding", "packbits");
+    res = httpd_resp_send(req, (const char *)out, len);
+    break;
+  }
+  mem_class_free(MEM_CLASS_MASK, out);
+  return res;
+}
+
+static esp_err_t mask_async_handler(httpd_req_t *req) {
+  return httpd_async_submit(req, mask_handler, mask_wants_stream(req));
+}
+
+static bool detections_want_binary(httpd_req_t *req) {
+  char query[32];
+  char value[8];
+
+  return httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK && httpd_query_key_value(query, "format", value, sizeof(value)) == ESP_OK
+         && !strcmp(value, "bin");
+}
+
+// Regions of the newest pipeline result as JSON, or with ?format=bin as a
+// detection_wire.h record. Runs on the httpd task, which is the only user of
+// the static buffer.
+static esp_err_t detections_handler(httpd_req_t *req) {
+  static char json_response[DETECTION_JSON_MAX];
+  bool binary = detections_want_binary(req);
+
+  const mp_result_t *result = motion_pipeline_acquire(0, 1000);
+  if (!result) {
+    log_e("No pipeline frame");
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+  size_t len;
+  if (binary) {
+    len = detection_wire_encode(result, (uint8_t *)json_response, sizeof(json_response));
+  } else {
+    len = detection_json(result, json_response, sizeof(json_response));
+  }
+  motion_pipeline_release(result);
+  httpd_resp_set_type(req, binary ? "application/octet-stream" : "application/json");
   httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-  jpg_chunking_t jchunk = {req, 0};
-  //res = frame2jpg_cb(fb, 80, jpg_encode_stream, &jchunk) ? ESP_OK : ESP_FAIL;
-  res = fmt2jpg_cb(fb_aux->data, len, fb_aux->width, fb_aux->height, PIXFORMAT_GRAYSCALE, 90, jpg_encode_stream, &jchunk);
-  printf("\n controle5 \n");
-  
-  esp_camera_fb_return(fb2);
-  free(subtraction_buffer);
-  free(fb_aux); 
+  return httpd_resp_send(req, json_response, len);
+}
+
+// Server-Sent Events with the detections of every pipeline result. Frames
+// without regions are only sent once after motion ends; an idle stream gets
+// a comment every EVENTS_KEEPALIVE_MS so proxies keep it open.
+#define EVENTS_KEEPALIVE_MS 15000
+
+static esp_err_t events_handler(httpd_req_t *req) {
+  esp_err_t res = ESP_OK;
+  uint32_t last_seq = 0;
+  bool last_empty = false;
+  int64_t last_send = esp_timer_get_time();
+
+  char *buf = detection_sse_claim();
+  if (!buf) {
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    httpd_resp_set_hdr(req, "Retry-After", "5");
+    return httpd_resp_send(req, NULL, 0);
   }
-  cont++;
- 
+  httpd_resp_set_type(req, "text/event-stream");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  // Sends the response headers, events follow as chunks
+  res = httpd_resp_sendstr_chunk(req, ": detections\n\n");
+
+  while (res == ESP_OK) {
+    size_t n = 0;
+    const mp_result_t *result = motion_pipeline_acquire(last_seq, 1000);
+    if (result) {
+      bool empty = !result->regions.count;
+      last_seq = result->seq;
+      if (!empty || !last_empty) {
+        n = snprintf(buf, DETECTION_SSE_BUF_SIZE, "id: %u\nevent: detections\ndata: ", (unsigned)result->seq);
+        n += detection_json(result, buf + n, DETECTION_SSE_BUF_SIZE - n - 2);
+        buf[n++] = '\n';
+        buf[n++] = '\n';
+      }
+      last_empty = empty;
+      motion_pipeline_release(result);
+    }
+    int64_t now = esp_timer_get_time();
+    if (n) {
+      res = httpd_resp_send_chunk(req, buf, n);
+      last_send = now;
+    } else if (now - last_send >= EVENTS_KEEPALIVE_MS * 1000LL) {
+      res = httpd_resp_sendstr_chunk(req, ": keepalive\n\n");
+      last_send = now;
+    } else if (stream_peer_closed(httpd_req_to_sockfd(req))) {
+      // Otherwise a gone client holds its slot and buffer until the keepalive
+      res = ESP_FAIL;
+    }
+  }
+  detection_sse_release(buf);
   return res;
 }
 
+static esp_err_t events_async_handler(httpd_req_t *req) {
+  return httpd_async_submit(req, events_handler, true);
+}
+
+static esp_err_t jpeg_async_handler(httpd_req_t *req) {
+  return httpd_async_submit(req, capture_two_frames_handler1, false);
+}
+
+// Worst cases of the sections add up to about 1.7 KB; the appends are clamped
+// so a longer report is cut short instead of running past the buffer.
+static esp_err_t pipeline_handler(httpd_req_t *req) {
+  static char json_response[2048];
+  size_t n = 0;
+
+#define REPORT(...)                                                             \
+  do {                                                                          \
+    if (n < sizeof(json_response)) {                                            \
+      n += snprintf(json_response + n, sizeof(json_response) - n, __VA_ARGS__); \
+    }                                                                           \
+  } while (0)
+#define SECTION(fmt, report)                                                    \
+  do {                                                                          \
+    REPORT(fmt);                                                                \
+    if (n < sizeof(json_response)) {                                            \
+      n += report(json_response + n, sizeof(json_response) - n);                \
+    }                                                                           \
+  } while (0)
+
+  SECTION("{\"pipeline\":", motion_pipeline_report_json);
+  SECTION(",\"mjpeg\":", mjpeg_broadcast_report_json);
+  SECTION(",\"async\":", async_pool_report_json);
+  SECTION(",\"cache\":", encode_cache_report_json);
+  SECTION(",\"jpeg_stream\":", jpeg_stream_report_json);
+  SECTION(",\"ws\":", ws_channel_report_json);
+  REPORT("}");
+#undef SECTION
+#undef REPORT
+
+  if (n >= sizeof(json_response)) {
+    n = sizeof(json_response) - 1;
+  }
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  return httpd_resp_send(req, json_response, n);
+}
+
 /*for (size_t i = 0; i < 20; i+=2) {
     // Cada pixel em RGB565 ocupa 2 bytes
     uint16_t pixel = (fb->buf[i] << 8) | fb->buf[i+1];
@@ -2819,7 +3310,7 @@ static esp_err_t capture_and_subtract_handler5(httpd_req_t *req) {
   }*/
 void startCameraServer() {
   httpd_config_t config = HTTPD_DEFAULT_CONFIG();
-  config.max_uri_handlers = 16;
+  config.max_uri_handlers = 24;
 
   httpd_uri_t index_uri = {
     .uri = "/",
@@ -2863,7 +3354,7 @@ void startCameraServer() {
   httpd_uri_t capture_uri = {
     .uri = "/capture",
     .method = HTTP_GET,
-    .handler = capture_handler,
+    .handler = capture_async_handler,
     .user_ctx = NULL
 #ifdef CONFIG_HTTPD_WS_SUPPORT
     ,
@@ -2876,7 +3367,7 @@ void startCameraServer() {
   httpd_uri_t subtraction_uri = {
     .uri = "/subtraction",
     .method = HTTP_GET,
-    .handler = capture_and_subtract_handler5/*capture_two_frames_handler1*/,
+    .handler = subtraction_async_handler/*capture_two_frames_handler1*/,
     .user_ctx = NULL
 #ifdef CONFIG_HTTPD_WS_SUPPORT
     ,
@@ -2902,7 +3393,72 @@ void startCameraServer() {
   httpd_uri_t bmp_uri = {
     .uri = "/bmp",
     .method = HTTP_GET,
-    .handler = bmp_handler,
+    .handler = bmp_async_handler,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
+  httpd_uri_t heap_uri = {
+    .uri = "/heap",
+    .method = HTTP_GET,
+    .handler = heap_handler,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
+  httpd_uri_t pipeline_uri = {
+    .uri = "/pipeline",
+    .method = HTTP_GET,
+    .handler = pipeline_handler,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
+  httpd_uri_t roi_uri = {
+    .uri = "/roi",
+    .method = HTTP_GET,
+    .handler = roi_async_handler,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
+  httpd_uri_t jpeg_uri = {
+    .uri = "/jpeg",
+    .method = HTTP_GET,
+    .handler = jpeg_async_handler,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
+  httpd_uri_t mask_uri = {
+    .uri = "/mask",
+    .method = HTTP_GET,
+    .handler = mask_async_handler,
     .user_ctx = NULL
 #ifdef CONFIG_HTTPD_WS_SUPPORT
     ,
@@ -2912,6 +3468,83 @@ void startCameraServer() {
 #endif
   };
 
+  httpd_uri_t raw_uri = {
+    .uri = "/raw",
+    .method = HTTP_GET,
+    .handler = raw_async_handler,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
+  httpd_uri_t lossless_uri = {
+    .uri = "/lossless",
+    .method = HTTP_GET,
+    .handler = lossless_async_handler,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
+  httpd_uri_t store_uri = {
+    .uri = "/store",
+    .method = HTTP_GET,
+    .handler = store_async_handler,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
+  httpd_uri_t detections_uri = {
+    .uri = "/detections",
+    .method = HTTP_GET,
+    .handler = detections_handler,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
+  httpd_uri_t events_uri = {
+    .uri = "/events",
+    .method = HTTP_GET,
+    .handler = events_async_handler,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+  httpd_uri_t ws_uri = {
+    .uri = "/ws",
+    .method = HTTP_GET,
+    .handler = ws_channel_handler,
+    .user_ctx = NULL,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+  };
+#endif
+
   httpd_uri_t xclk_uri = {
     .uri = "/xclk",
     .method = HTTP_GET,
@@ -2978,6 +3611,39 @@ void startCameraServer() {
   };
 
   ra_filter_init(&ra_filter, 20);
+  if (!copy_service_init()) {
+    log_e("Copy service init failed");
+  }
+  // The pipeline goes first so its label scratch gets internal RAM
+  mp_config_t mp_cfg = {frame_ring_source(), 240, 240, 70, 2, draw_motion_boxes, NULL, true, 2};
+  // Without PSRAM the driver has a single frame buffer, which the pipeline
+  // would keep as its reference frame and starve the capture
+  if (!psramFound()) {
+    log_e("No PSRAM, motion pipeline not started");
+  } else if (!motion_pipeline_start(&mp_cfg)) {
+    log_e("Motion pipeline start failed");
+  }
+  if (!mjpeg_broadcast_start(80)) {
+    log_e("MJPEG broadcaster start failed");
+  }
+  if (!async_pool_start(HTTPD_ASYNC_WORKERS, HTTPD_ASYNC_RESERVED, 4096, 4)) {
+    log_e("Async pool start failed");
+  }
+  if (!encode_cache_init()) {
+    log_e("Encode cache init failed");
+  }
+  if (!roi_jpeg_init()) {
+    log_e("ROI encoder init failed");
+  }
+  if (!jpeg_stream_start()) {
+    log_e("JPEG stream start failed");
+  }
+  if (!detection_sse_init()) {
+    log_e("Detection events init failed");
+  }
+  if (!frame_store_begin()) {
+    log_e("Frame store init failed");
+  }
 
 #if CONFIG_ESP_FACE_RECOGNITION_ENABLED
   recognizer.set_partition(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "fr");
@@ -2993,6 +3659,22 @@ void startCameraServer() {
     httpd_register_uri_handler(camera_httpd, &capture_uri);
     httpd_register_uri_handler(camera_httpd, &subtraction_uri);
     httpd_register_uri_handler(camera_httpd, &bmp_uri);
+    httpd_register_uri_handler(camera_httpd, &heap_uri);
+    httpd_register_uri_handler(camera_httpd, &pipeline_uri);
+    httpd_register_uri_handler(camera_httpd, &roi_uri);
+    httpd_register_uri_handler(camera_httpd, &jpeg_uri);
+    httpd_register_uri_handler(camera_httpd, &mask_uri);
+    httpd_register_uri_handler(camera_httpd, &raw_uri);
+    httpd_register_uri_handler(camera_httpd, &lossless_uri);
+    httpd_register_uri_handler(camera_httpd, &store_uri);
+    httpd_register_uri_handler(camera_httpd, &detections_uri);
+    httpd_register_uri_handler(camera_httpd, &events_uri);
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    httpd_register_uri_handler(camera_httpd, &ws_uri);
+    if (!ws_channel_start(camera_httpd, apply_control)) {
+      log_e("WebSocket channel start failed");
+    }
+#endif
 
     httpd_register_uri_handler(camera_httpd, &xclk_uri);
     httpd_register_uri_handler(camera_httpd, &reg_uri);
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <atomic>
+#include "os_port.h"
+#include "async_pool.h"
+
+#ifdef ESP_PLATFORM
+#include "esp32-hal-log.h"
+#else
+#define log_e(format, ...) fprintf(stderr, format "\n", ##__VA_ARGS__)
+#endif
+
+typedef struct {
+  async_job_fn_t fn;
+  void *arg;
+  bool long_lived;
+} async_job_t;
+
+static os_queue_t pool_queue;
+static int pool_workers;
+static int pool_reserved;
+static std::atomic<int32_t> pool_in_flight(0);
+static std::atomic<int32_t> pool_long_lived(0);
+static std::atomic<uint32_t> pool_submitted(0);
+static std::atomic<uint32_t> pool_rejected(0);
+static std::atomic<uint32_t> pool_completed(0);
+
+static void pool_worker_task(void *arg) {
+  for (;;) {
+    async_job_t job;
+    if (!os_queue_receive(pool_queue, &job, OS_WAIT_FOREVER)) {
+      continue;
+    }
+    job.fn(job.arg);
+    pool_completed++;
+    if (job.long_lived) {
+      pool_long_lived--;
+    }
+    pool_in_flight--;
+  }
+}
+
+bool async_pool_start(int workers, int reserved, uint32_t stack_size, int priority) {
+  if (pool_queue) {
+    return true;
+  }
+  pool_workers = workers < ASYNC_POOL_MAX_WORKERS ? workers : ASYNC_POOL_MAX_WORKERS;
+  pool_reserved = reserved < pool_workers ? reserved : pool_workers - 1;
+  pool_queue = os_queue_create(ASYNC_POOL_QUEUE, sizeof(async_job_t));
+  if (!pool_queue) {
+    log_e("Async pool: queue creation failed");
+    return false;
+  }
+  for (int i = 0; i < pool_workers; i++) {
+    if (!os_task_create(pool_worker_task, "async_worker", stack_size, NULL, priority, OS_NO_AFFINITY)) {
+      log_e("Async pool: worker %d creation failed", i);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool async_pool_reserve(bool long_lived) {
+  if (!pool_queue) {
+    pool_rejected++;
+    return false;
+  }
+  if (long_lived && ++pool_long_lived > pool_workers - pool_reserved) {
+    pool_long_lived--;
+    pool_rejected++;
+    return false;
+  }
+  if (++pool_in_flight > ASYNC_POOL_QUEUE) {
+    pool_in_flight--;
+    if (long_lived) {
+      pool_long_lived--;
+    }
+    pool_rejected++;
+    return false;
+  }
+  return true;
+}
+
+void async_pool_cancel(bool long_lived) {
+  if (long_lived) {
+    pool_long_lived--;
+  }
+  pool_in_flight--;
+}
+
+void async_pool_submit(async_job_fn_t fn, void *arg, bool long_lived) {
+  async_job_t job = {fn, arg, long_lived};
+
+  // The reservation guarantees a free queue entry
+  os_queue_send(pool_queue, &job, OS_WAIT_FOREVER);
+  pool_submitted++;
+}
+
+void async_pool_get_stats(async_pool_stats_t *stats) {
+  stats->submitted = pool_submitted.load();
+  stats->rejected = pool_rejected.load();
+  stats->completed = pool_completed.load();
+  stats->in_flight = pool_in_flight.load();
+  stats->long_lived = pool_long_lived.load();
+}
+
+size_t async_pool_report_json(char *buf, size_t buf_len) {
+  async_pool_stats_t st;
+  async_pool_get_stats(&st);
+
+  int n = snprintf(
+    buf, buf_len, "{\"workers\":%d,\"reserved\":%d,\"in_flight\":%d,\"long_lived\":%d,\"submitted\":%u,\"completed\":%u,\"rejected\":%u}", pool_workers,
+    pool_reserved, (int)st.in_flight, (int)st.long_lived, (unsigned)st.submitted, (unsigned)st.completed, (unsigned)st.rejected
+  );
+  if (n < 0) {
+    return 0;
+  }
+  return (size_t)n < buf_len ? n : buf_len - 1;
+}
@@ -0,0 +1,40 @@
+#ifndef _ASYNC_POOL_H_
+#define _ASYNC_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Fixed pool of worker tasks for request work that must not run on the httpd
+// task. Long lived jobs (streams) may never take the last `reserved` workers,
+// so short jobs (snapshots) always get served. Built on os_port, so the same
+// pool runs on pthreads in host builds.
+
+#define ASYNC_POOL_MAX_WORKERS 8
+#define ASYNC_POOL_QUEUE       8
+
+typedef void (*async_job_fn_t)(void *arg);
+
+typedef struct {
+  uint32_t submitted;
+  uint32_t rejected;
+  uint32_t completed;
+  int32_t in_flight;    // queued or running
+  int32_t long_lived;   // long lived jobs in flight
+} async_pool_stats_t;
+
+bool async_pool_start(int workers, int reserved, uint32_t stack_size, int priority);
+
+// Reserves room for one job; false when the pool is saturated, or for long
+// lived jobs when only reserved workers are left. A successful reservation
+// must be followed by async_pool_submit() or async_pool_cancel().
+bool async_pool_reserve(bool long_lived);
+void async_pool_cancel(bool long_lived);
+
+// Queues a reserved job, never fails.
+void async_pool_submit(async_job_fn_t fn, void *arg, bool long_lived);
+
+void async_pool_get_stats(async_pool_stats_t *stats);
+size_t async_pool_report_json(char *buf, size_t buf_len);
+
+#endif /* _ASYNC_POOL_H_ */
@@ -1,971 +1,1125 @@
 
 
-//File: index_ov2640.html.gz, Size: 6787
-#define index_ov2640_html_gz_len 6787
+//File: index_ov2640.html.gz, Size: 8175
+#define index_ov2640_html_gz_len 8175
 const uint8_t index_ov2640_html_gz[] = {
-  0x1F, 0x8B, 0x08, 0x08, 0x23, 0xFC, 0x69, 0x5E, 0x00, 0x03, 0x69, 0x6E, 0x64, 0x65, 0x78, 0x5F, 0x6F, 0x76, 0x32, 0x36, 0x34, 0x30, 0x2E, 0x68, 0x74, 0x6D,
-  0x6C, 0x00, 0xED, 0x3D, 0x6B, 0x73, 0xDB, 0x46, 0x92, 0xDF, 0xFD, 0x2B, 0x60, 0x24, 0x6B, 0x92, 0x25, 0x92, 0x22, 0x29, 0x4A, 0x96, 0x15, 0x89, 0x3E, 0x5B,
-  0x96, 0x1F, 0xB5, 0x76, 0xE2, 0xB5, 0x12, 0xC7, 0x5B, 0xA9, 0x2D, 0x07, 0x04, 0x86, 0x24, 0x62, 0x10, 0xE0, 0x02, 0xA0, 0x48, 0x26, 0xA5, 0xDF, 0x71, 0x3F,
-  0xE8, 0xFE, 0xD8, 0x75, 0xCF, 0x03, 0x18, 0x00, 0x83, 0x07, 0x49, 0x89, 0xF4, 0xFA, 0x8E, 0x4E, 0x45, 0x78, 0x4C, 0xF7, 0xF4, 0xBB, 0x7B, 0x66, 0x30, 0xC0,
-  0xF9, 0x43, 0xCB, 0x33, 0xC3, 0xD5, 0x8C, 0x68, 0x93, 0x70, 0xEA, 0x0C, 0x1E, 0x9C, 0xB3, 0x3F, 0x1A, 0xFC, 0xCE, 0x27, 0xC4, 0xB0, 0xD8, 0x21, 0x3D, 0x9D,
-  0x92, 0xD0, 0xD0, 0xCC, 0x89, 0xE1, 0x07, 0x24, 0xBC, 0xD0, 0xE7, 0xE1, 0xA8, 0x75, 0xAA, 0xA7, 0x6F, 0xBB, 0xC6, 0x94, 0x5C, 0xE8, 0x37, 0x36, 0x59, 0xCC,
-  0x3C, 0x3F, 0xD4, 0x35, 0xD3, 0x73, 0x43, 0xE2, 0x42, 0xF3, 0x85, 0x6D, 0x85, 0x93, 0x0B, 0x8B, 0xDC, 0xD8, 0x26, 0x69, 0xD1, 0x93, 0xA6, 0xED, 0xDA, 0xA1,
-  0x6D, 0x38, 0xAD, 0xC0, 0x34, 0x1C, 0x72, 0xD1, 0x95, 0x71, 0x85, 0x76, 0xE8, 0x90, 0xC1, 0xD5, 0xF5, 0xFB, 0xA3, 0x9E, 0xF6, 0xD3, 0xC7, 0x5E, 0xFF, 0xA4,
-  0x73, 0x7E, 0xC8, 0xAE, 0xC5, 0x6D, 0x82, 0x70, 0x25, 0x9F, 0xE3, 0x6F, 0xE8, 0x59, 0x2B, 0xED, 0xAF, 0xC4, 0x25, 0xFC, 0x8D, 0x80, 0x88, 0xD6, 0xC8, 0x98,
-  0xDA, 0xCE, 0xEA, 0x4C, 0x7B, 0xE6, 0x43, 0x9F, 0xCD, 0xD7, 0xC4, 0xB9, 0x21, 0xA1, 0x6D, 0x1A, 0xCD, 0xC0, 0x70, 0x83, 0x56, 0x40, 0x7C, 0x7B, 0xF4, 0x43,
-  0x06, 0x70, 0x68, 0x98, 0x5F, 0xC6, 0xBE, 0x37, 0x77, 0xAD, 0x33, 0xED, 0xBB, 0xEE, 0x29, 0xFE, 0xCB, 0x36, 0x32, 0x3D, 0xC7, 0xF3, 0xE1, 0xFE, 0xD5, 0x4B,
-  0xFC, 0x97, 0xBD, 0x4F, 0x7B, 0x0F, 0xEC, 0x3F, 0xC9, 0x99, 0xD6, 0x3D, 0x99, 0x2D, 0x13, 0xF7, 0x6F, 0x1F, 0x24, 0x4E, 0x27, 0xBD, 0x3C, 0xEA, 0x39, 0xFC,
-  0x69, 0x31, 0x7C, 0x40, 0xCC, 0xD0, 0xF6, 0xDC, 0xF6, 0xD4, 0xB0, 0x5D, 0x05, 0x26, 0xCB, 0x0E, 0x66, 0x8E, 0x01, 0x32, 0x18, 0x39, 0xA4, 0x10, 0xCF, 0x77,
-  0x53, 0xE2, 0xCE, 0x9B, 0x25, 0xD8, 0x10, 0x49, 0xCB, 0xB2, 0x7D, 0xD6, 0xEA, 0x0C, 0xE5, 0x30, 0x9F, 0xBA, 0xA5, 0x68, 0x8B, 0xE8, 0x72, 0x3D, 0x97, 0x28,
-  0x04, 0x88, 0x1D, 0x2D, 0x7C, 0x63, 0x86, 0x0D, 0xF0, 0x6F, 0xB6, 0xC9, 0xD4, 0x76, 0x99, 0x51, 0x9D, 0x69, 0x47, 0xFD, 0xCE, 0x6C, 0x59, 0xA2, 0xCA, 0xA3,
-  0x13, 0xFC, 0x97, 0x6D, 0x34, 0x33, 0x2C, 0xCB, 0x76, 0xC7, 0x67, 0xDA, 0xA9, 0x12, 0x85, 0xE7, 0x5B, 0xC4, 0x6F, 0xF9, 0x86, 0x65, 0xCF, 0x83, 0x33, 0xAD,
-  0xAF, 0x6A, 0x33, 0x35, 0xFC, 0x31, 0xD0, 0x12, 0x7A, 0x40, 0x6C, 0xAB, 0xAB, 0xA4, 0x84, 0x37, 0xF1, 0xED, 0xF1, 0x24, 0x04, 0x95, 0x66, 0xDA, 0xA4, 0x85,
-  0xC6, 0x5D, 0xA8, 0x4C, 0x9F, 0x85, 0x72, 0x53, 0x4B, 0xCD, 0x70, 0xEC, 0xB1, 0xDB, 0xB2, 0x43, 0x32, 0x05, 0x76, 0x82, 0xD0, 0x27, 0xA1, 0x39, 0x29, 0x22,
-  0x65, 0x64, 0x8F, 0xE7, 0x3E, 0x51, 0x10, 0x12, 0xC9, 0xAD, 0x80, 0x61, 0xB8, 0x99, 0xBD, 0xD5, 0x5A, 0x90, 0xE1, 0x17, 0x3B, 0x6C, 0x71, 0x99, 0x0C, 0xC9,
-  0xC8, 0xF3, 0x89, 0xB2, 0xA5, 0x68, 0xE1, 0x78, 0xE6, 0x97, 0x56, 0x10, 0x1A, 0x7E, 0x58, 0x05, 0xA1, 0x31, 0x0A, 0x89, 0x5F, 0x8E, 0x8F, 0xA0, 0x55, 0x94,
-  0x63, 0xCB, 0xEF, 0x96, 0x37, 0xB0, 0x5D, 0xC7, 0x76, 0x49, 0x75, 0xF2, 0xF2, 0xFA, 0x4D, 0xA2, 0x63, 0xAD, 0x2A, 0x28, 0xC6, 0x9E, 0x8E, 0x8B, 0xAC, 0x84,
-  0xF2, 0x9A, 0xED, 0x8C, 0xFB, 0x4D, 0xB7, 0xD3, 0xF9, 0x5B, 0xF6, 0xE6, 0x84, 0x30, 0x33, 0x35, 0xE6, 0xA1, 0xB7, 0xBD, 0x47, 0x64, 0xDC, 0x2A, 0xC5, 0xC7,
-  0x7F, 0x4D, 0x89, 0x65, 0x1B, 0x5A, 0x5D, 0x72, 0xE7, 0xD3, 0x0E, 0xD8, 0x54, 0x43, 0x33, 0x5C, 0x4B, 0xAB, 0x7B, 0xBE, 0x0D, 0x8E, 0x60, 0xD0, 0x70, 0xE3,
-  0xC0, 0x15, 0x48, 0x1C, 0x33, 0xD2, 0x50, 0xB0, 0x5C, 0xE0, 0x33, 0xB2, 0x44, 0xD4, 0x6E, 0x83, 0xBF, 0x0A, 0x21, 0x07, 0x7F, 0xA5, 0x0E, 0xA4, 0xE0, 0x91,
-  0xA2, 0x2F, 0xD2, 0x97, 0x4C, 0x61, 0x9E, 0xCE, 0xF0, 0x37, 0x35, 0x96, 0xAD, 0x42, 0xDD, 0x89, 0x46, 0x42, 0x87, 0x90, 0x66, 0xCD, 0x3A, 0x34, 0xBD, 0x99,
-  0x68, 0x2D, 0x0D, 0xA3, 0x64, 0x43, 0x0D, 0xC3, 0x91, 0xAA, 0x55, 0x8E, 0x3F, 0xD9, 0x28, 0xD6, 0x60, 0x57, 0xCD, 0x6A, 0x1C, 0x3B, 0xD8, 0x3F, 0x95, 0x0D,
-  0x31, 0x4E, 0x72, 0xA3, 0x08, 0xFE, 0xAA, 0x47, 0x92, 0x18, 0x59, 0x69, 0x34, 0x51, 0x20, 0xCE, 0x8F, 0x28, 0x19, 0xBC, 0x79, 0xDE, 0xAD, 0xC0, 0x5A, 0x4C,
-  0x42, 0xD5, 0xE8, 0xA2, 0x40, 0x5C, 0x44, 0x43, 0x69, 0x94, 0xC1, 0xDF, 0x6D, 0x85, 0x7A, 0xE3, 0xBB, 0xE1, 0x3C, 0x0C, 0x3D, 0x37, 0xD8, 0x2A, 0x45, 0xE5,
-  0xF9, 0xD9, 0x1F, 0xF3, 0x20, 0xB4, 0x47, 0xAB, 0x16, 0x77, 0x69, 0xF0, 0xB3, 0x99, 0x01, 0x25, 0xE4, 0x90, 0x84, 0x0B, 0x42, 0x8A, 0xCB, 0x0D, 0xD7, 0xB8,
-  0x81, 0xB8, 0x33, 0x1E, 0x3B, 0x2A, 0xDB, 0x33, 0xE7, 0x7E, 0x80, 0x75, 0xDB, 0xCC, 0xB3, 0x01, 0xB1, 0x9F, 0xED, 0x38, 0xE9, 0x83, 0x15, 0x3B, 0x6A, 0x99,
-  0x43, 0x45, 0x5F, 0xDE, 0x3C, 0x44, 0x19, 0x2B, 0x35, 0xE1, 0x01, 0x3B, 0x76, 0xB8, 0x52, 0xDE, 0xE3, 0x9E, 0xA8, 0xB8, 0x23, 0x5C, 0xB0, 0x30, 0x2D, 0x24,
-  0xE9, 0x3A, 0x33, 0x27, 0xC4, 0xFC, 0x42, 0xAC, 0x83, 0xD2, 0x32, 0xAC, 0xAC, 0x3C, 0x6C, 0xDB, 0xEE, 0x6C, 0x1E, 0xB6, 0xB0, 0x9C, 0x9A, 0xDD, 0x8B, 0xCE,
-  0xA9, 0x41, 0x0A, 0x16, 0x7B, 0xBD, 0xA2, 0xA2, 0xE2, 0x78, 0xB6, 0x2C, 0x16, 0x82, 0x4C, 0xEC, 0xC0, 0x31, 0x86, 0xC4, 0x29, 0x22, 0x99, 0x3B, 0x43, 0x4E,
-  0xD8, 0xE5, 0xB1, 0x2A, 0xBF, 0x76, 0xA3, 0x94, 0xC5, 0xC9, 0xAB, 0xFF, 0xF8, 0x6F, 0x95, 0xE5, 0x48, 0x8F, 0x9B, 0x89, 0x4B, 0x01, 0x71, 0xC0, 0xC1, 0xF2,
-  0x4A, 0x6F, 0x68, 0xB3, 0x00, 0x1A, 0x0A, 0x3B, 0xF0, 0x0D, 0x77, 0x4C, 0x20, 0x16, 0x2C, 0x9B, 0xE2, 0xB0, 0x78, 0x60, 0x50, 0x89, 0x7D, 0x0C, 0xD5, 0xC7,
-  0xC5, 0x03, 0x11, 0x16, 0x10, 0x9A, 0x5A, 0x9B, 0x1D, 0x6C, 0x50, 0x95, 0x48, 0xFA, 0x2D, 0x24, 0xA4, 0xAB, 0xB4, 0x0E, 0x56, 0x98, 0x28, 0x3D, 0x27, 0x69,
-  0x5B, 0xCA, 0x42, 0xBF, 0x34, 0x34, 0x88, 0x21, 0xDF, 0x68, 0x54, 0x36, 0x68, 0x1C, 0x8D, 0x8E, 0x3A, 0x47, 0xFD, 0xD2, 0xCA, 0x49, 0xC9, 0x65, 0x6A, 0xE0,
-  0xA8, 0x08, 0x1D, 0x51, 0x58, 0x29, 0x34, 0x82, 0xC0, 0xB8, 0x51, 0x16, 0xED, 0x5E, 0x60, 0xB3, 0x91, 0x9B, 0x31, 0x0C, 0x60, 0xEC, 0x16, 0x2A, 0x86, 0x5E,
-  0xDC, 0xD0, 0x7B, 0x4A, 0xFA, 0x68, 0x49, 0xA7, 0x74, 0x01, 0x21, 0x5E, 0x35, 0xD9, 0x09, 0x0D, 0xA8, 0x9B, 0x48, 0x0A, 0x56, 0x16, 0x95, 0x21, 0x59, 0x86,
-  0x2D, 0x8B, 0x98, 0x9E, 0xCF, 0xAA, 0xC1, 0x9C, 0x91, 0x63, 0x4A, 0x91, 0xE5, 0x16, 0x7B, 0x36, 0xF1, 0x6E, 0x88, 0xAF, 0x10, 0x56, 0x4A, 0xA9, 0xFD, 0x27,
-  0x7D, 0xAB, 0x02, 0x36, 0x03, 0xD2, 0xA3, 0x52, 0xF6, 0x49, 0x74, 0xBD, 0xAE, 0xD9, 0x2B, 0xF4, 0x63, 0x86, 0xAE, 0x0D, 0x3E, 0x63, 0x0C, 0x1D, 0x62, 0x15,
-  0x64, 0x33, 0x8B, 0x8C, 0x8C, 0xB9, 0x13, 0x96, 0x58, 0xA5, 0xD1, 0xC1, 0x7F, 0x45, 0x3D, 0xD2, 0x30, 0xF4, 0x1B, 0xCE, 0x0B, 0x5D, 0xD0, 0xC0, 0xF1, 0x2F,
-  0x45, 0x9F, 0xA2, 0xD4, 0x30, 0x66, 0x33, 0x62, 0x40, 0x2B, 0x93, 0xE4, 0xE9, 0xA1, 0xD2, 0x10, 0x43, 0x1D, 0xE7, 0x2B, 0x8D, 0xDB, 0x4B, 0x1D, 0x36, 0x2A,
-  0x1E, 0xD7, 0xE2, 0xF9, 0x6C, 0xE4, 0x99, 0x73, 0x55, 0x55, 0x53, 0xCD, 0xF1, 0xB2, 0xF8, 0xCE, 0x84, 0xC8, 0x02, 0xC7, 0xA6, 0xEE, 0x3F, 0x77, 0x5D, 0xD4,
-  0x68, 0x2B, 0xF4, 0x81, 0x4D, 0x45, 0x47, 0xD5, 0x04, 0xB7, 0x51, 0x0C, 0x4B, 0x08, 0x36, 0x6F, 0xEE, 0x2A, 0x15, 0xA6, 0x14, 0xE1, 0x34, 0x8A, 0xB4, 0x1A,
-  0xC4, 0x10, 0xDB, 0x12, 0xA8, 0xB6, 0x93, 0x4B, 0x38, 0x99, 0x4F, 0x55, 0x75, 0x94, 0xE8, 0xAC, 0x0B, 0x49, 0x9F, 0x75, 0xE7, 0x8F, 0x87, 0x46, 0xBD, 0xD3,
-  0xEC, 0x34, 0x8F, 0xE0, 0x7F, 0x8A, 0xF1, 0x4C, 0xB1, 0x71, 0x71, 0xF1, 0xE6, 0x58, 0x5E, 0x2A, 0x44, 0x97, 0x4F, 0x2B, 0xE5, 0x05, 0xFB, 0x52, 0x5D, 0x54,
-  0xF7, 0xA4, 0xE4, 0xFC, 0x52, 0xB7, 0x5D, 0x92, 0x87, 0x73, 0x4C, 0x7A, 0x7D, 0x43, 0x54, 0x58, 0xCB, 0xBA, 0x2A, 0x9E, 0x7A, 0x7F, 0xB6, 0x58, 0x11, 0xF2,
-  0x7F, 0xDE, 0xDA, 0x25, 0x51, 0x7C, 0xD3, 0x96, 0xBE, 0xB6, 0x5C, 0x82, 0x7D, 0xDB, 0x46, 0x27, 0x5F, 0xEB, 0x2D, 0x5E, 0xF5, 0x01, 0x85, 0x2E, 0x8C, 0x41,
-  0x7D, 0x18, 0x8C, 0xE6, 0x56, 0x86, 0x52, 0x9B, 0x0D, 0x64, 0x30, 0xB2, 0x1D, 0xA7, 0xE5, 0x78, 0x8B, 0xF2, 0x4A, 0xA4, 0xD8, 0x92, 0x33, 0x76, 0x5A, 0x6E,
-  0xF2, 0x9B, 0x52, 0x3B, 0x87, 0xC8, 0xF5, 0x1F, 0x41, 0xED, 0xB7, 0xED, 0x70, 0x85, 0xAE, 0xB1, 0x59, 0xA2, 0xD8, 0xC0, 0x1E, 0xB7, 0xEB, 0xA8, 0x92, 0x29,
-  0xB1, 0x4A, 0xB0, 0x78, 0xD8, 0xB3, 0xB0, 0x43, 0x73, 0xB2, 0xC1, 0xD0, 0x33, 0x1E, 0x18, 0xF9, 0xC4, 0x31, 0xB0, 0x82, 0xDF, 0x68, 0x86, 0xA2, 0x74, 0xF8,
-  0x26, 0x83, 0x57, 0xE1, 0x84, 0x8A, 0xEE, 0xEB, 0x99, 0x5D, 0x6A, 0xB3, 0xDA, 0x21, 0x3F, 0x56, 0xAB, 0xCD, 0xBA, 0xA4, 0xDC, 0x4F, 0x7A, 0x86, 0xBA, 0xD1,
-  0x1A, 0x11, 0x5D, 0x04, 0xED, 0xB1, 0x4F, 0x56, 0x15, 0x98, 0x69, 0xF2, 0xBF, 0x67, 0x6C, 0xFE, 0x78, 0xF3, 0xA9, 0x12, 0x9A, 0x00, 0xB8, 0x15, 0xB5, 0xFB,
-  0x41, 0x85, 0xAE, 0xF3, 0xBB, 0xAC, 0x62, 0x8F, 0xD1, 0xEC, 0xA8, 0xAE, 0x57, 0x08, 0x37, 0x05, 0x29, 0x54, 0x6D, 0xAA, 0x22, 0xFB, 0xAA, 0xC7, 0xF3, 0x64,
-  0x14, 0xE6, 0x2C, 0xFE, 0xD0, 0x3A, 0xF5, 0xA8, 0x38, 0xBA, 0xB5, 0xA4, 0xD9, 0x94, 0xD2, 0xC8, 0x11, 0x4D, 0x62, 0xE6, 0x5B, 0x9F, 0x12, 0x33, 0x46, 0xCF,
-  0xB5, 0x91, 0xE7, 0xAB, 0x44, 0x94, 0xCF, 0x54, 0xCD, 0xD0, 0x66, 0xCA, 0x53, 0x3E, 0xA8, 0x87, 0x7C, 0xAA, 0xF7, 0x4E, 0x94, 0x6B, 0x2B, 0x05, 0x8D, 0x8B,
-  0x48, 0xCB, 0x9D, 0x05, 0xCC, 0xA6, 0xAC, 0xDC, 0x01, 0xB2, 0x1C, 0x8B, 0x94, 0x8A, 0x2A, 0xF6, 0xCA, 0xA2, 0x08, 0x93, 0x9D, 0xC9, 0x2A, 0x34, 0x76, 0x7B,
-  0x6A, 0x40, 0xD9, 0x8B, 0xE6, 0x6A, 0x00, 0x46, 0x95, 0xFE, 0xAA, 0x98, 0xBB, 0x34, 0xC7, 0xDA, 0x3D, 0xE9, 0x94, 0x74, 0x69, 0x3A, 0x5E, 0xB0, 0xE5, 0x04,
-  0x58, 0xFE, 0xFC, 0x97, 0xF2, 0x4E, 0xA5, 0xD4, 0x5D, 0xE8, 0x53, 0xC5, 0xEE, 0x98, 0x92, 0x79, 0xB7, 0xA3, 0x8C, 0xB4, 0x85, 0xB3, 0x94, 0x74, 0x06, 0x8D,
-  0xAE, 0x5F, 0x9E, 0x69, 0x26, 0x51, 0x87, 0xD1, 0xE4, 0x44, 0x5D, 0x95, 0xA9, 0xD2, 0x42, 0x3D, 0x4C, 0x6C, 0xCB, 0x22, 0x85, 0x73, 0xC1, 0x38, 0xE6, 0xAD,
-  0x58, 0x3C, 0x20, 0xFD, 0xAA, 0x49, 0xA9, 0x7B, 0x71, 0x8A, 0xC2, 0xC7, 0x1A, 0xBA, 0xF7, 0xED, 0x31, 0x3C, 0xD1, 0xE4, 0xCD, 0xA4, 0x27, 0x4B, 0x91, 0x42,
-  0x52, 0x95, 0xCE, 0x1D, 0xCD, 0xB5, 0xA2, 0xC8, 0x40, 0x0E, 0xD8, 0x2A, 0x1B, 0xCD, 0x53, 0x54, 0xD1, 0x85, 0x94, 0x36, 0x5F, 0x5B, 0xE2, 0xCB, 0x80, 0xAD,
-  0xBC, 0xD5, 0x95, 0x3B, 0x5C, 0x6A, 0xA3, 0x16, 0x90, 0xEE, 0x37, 0x57, 0x34, 0x7B, 0xAA, 0x8C, 0x0A, 0x88, 0x8C, 0x52, 0x8C, 0x78, 0xB8, 0x2A, 0xD9, 0x6A,
-  0x53, 0xE7, 0x38, 0x3F, 0x94, 0x9E, 0x86, 0x3B, 0x3F, 0x8C, 0x1F, 0xDC, 0x3B, 0xC7, 0x47, 0xE2, 0xE4, 0x87, 0xE6, 0x78, 0x3F, 0xA6, 0x63, 0x04, 0xC1, 0x85,
-  0x8E, 0x8F, 0x76, 0xE9, 0xC9, 0x67, 0xE8, 0xCE, 0x2D, 0xFB, 0x46, 0xB3, 0xAD, 0x0B, 0xDD, 0xF1, 0xC6, 0x5E, 0xEA, 0x1E, 0xBD, 0xCF, 0xB4, 0x0C, 0x79, 0xEC,
-  0x42, 0x4F, 0xAC, 0x2F, 0xEA, 0x14, 0x2A, 0xBE, 0xA4, 0x0F, 0x1E, 0x7D, 0xF7, 0xE4, 0xF1, 0xE3, 0x93, 0x1F, 0x1E, 0xB9, 0xC3, 0x60, 0xC6, 0xFF, 0xFF, 0x33,
-  0x5B, 0x8E, 0xFD, 0xE9, 0x63, 0xEF, 0xA4, 0x0F, 0xC3, 0x3D, 0x12, 0x86, 0x60, 0x7A, 0xC1, 0xF9, 0x21, 0x45, 0x9A, 0x22, 0xE4, 0x10, 0x28, 0xC9, 0xA1, 0x8D,
-  0x97, 0x3B, 0x2A, 0xF2, 0x44, 0x93, 0x00, 0x32, 0xF8, 0xD0, 0xF0, 0x15, 0x4D, 0x68, 0x33, 0x56, 0x4C, 0xD3, 0x50, 0xA2, 0x53, 0x9D, 0x0C, 0xBD, 0x65, 0x9A,
-  0x03, 0xCA, 0x14, 0x57, 0x18, 0x6F, 0x45, 0xAC, 0x3C, 0x84, 0x00, 0x46, 0xC1, 0x71, 0x71, 0x15, 0xDA, 0x28, 0x1B, 0x25, 0x54, 0x80, 0x8D, 0x97, 0xA6, 0xF3,
-  0x45, 0xE8, 0x5E, 0x17, 0x4A, 0x71, 0xBD, 0x90, 0x85, 0xCA, 0x9C, 0xAE, 0x12, 0xAC, 0x72, 0x18, 0x69, 0xD9, 0x90, 0x71, 0x01, 0xA2, 0x6D, 0x51, 0xEC, 0xEC,
-  0x5A, 0x31, 0x26, 0x8A, 0x4D, 0xD2, 0xAB, 0x00, 0xD6, 0x07, 0x9F, 0x2E, 0xDF, 0xFE, 0x5D, 0x7B, 0xF7, 0xFA, 0x4F, 0xA5, 0x86, 0xCA, 0x88, 0xC2, 0x18, 0x5D,
-  0xA1, 0x67, 0x0A, 0xC6, 0xF4, 0x21, 0x64, 0xA2, 0x73, 0xCD, 0x50, 0x0C, 0x98, 0xED, 0x1D, 0xE2, 0x8E, 0xC3, 0xC9, 0x85, 0xDE, 0xD5, 0xF1, 0x91, 0x16, 0x71,
-  0xD6, 0xD3, 0x35, 0x8C, 0xDF, 0xF4, 0xE0, 0xC6, 0x70, 0xE6, 0x78, 0xD4, 0xA9, 0xC2, 0x6B, 0xD6, 0xB4, 0x94, 0xCD, 0x78, 0x60, 0x89, 0x64, 0x2C, 0x05, 0xE2,
-  0xA4, 0x94, 0xF5, 0xC1, 0x35, 0x09, 0xCF, 0x0F, 0xD9, 0xAD, 0x12, 0xAD, 0x15, 0xF7, 0x0D, 0x9E, 0xCC, 0xCC, 0xA1, 0xC8, 0x84, 0x8A, 0x14, 0x3F, 0xF2, 0x8D,
-  0x29, 0x41, 0xA9, 0x54, 0xD2, 0xBC, 0xAC, 0xF5, 0x08, 0x52, 0x1F, 0x7C, 0x20, 0xB4, 0x20, 0x02, 0x32, 0x2A, 0x29, 0xFE, 0x9C, 0xD7, 0xA8, 0x89, 0xFE, 0x23,
-  0x7B, 0xE6, 0x6B, 0x52, 0x2D, 0x83, 0x99, 0x79, 0x05, 0xB9, 0x3F, 0x6C, 0xB5, 0xB4, 0xDE, 0xBB, 0xF7, 0x5A, 0xAB, 0x55, 0xA1, 0xB1, 0x37, 0xA3, 0xEE, 0xC4,
-  0xF5, 0xDF, 0x3D, 0xD2, 0x07, 0xBF, 0x7C, 0x7A, 0xF5, 0xAC, 0x0E, 0x75, 0x61, 0x67, 0xD9, 0xED, 0x75, 0x3A, 0x8D, 0xF3, 0x43, 0xD6, 0x64, 0x7D, 0x5C, 0x3D,
-  0xD0, 0x2B, 0xC5, 0xD5, 0x3B, 0x05, 0x5C, 0x9D, 0x5E, 0x7F, 0x0B, 0x5C, 0x5D, 0x7D, 0xF0, 0xFA, 0x05, 0xC3, 0xF4, 0xB8, 0xB7, 0x0D, 0x51, 0x60, 0xE0, 0x94,
-  0x26, 0x20, 0x67, 0xF9, 0xF8, 0xE4, 0x74, 0x73, 0x4C, 0x4F, 0x80, 0xBB, 0x8F, 0x80, 0xE9, 0x14, 0x04, 0x75, 0xB2, 0x8D, 0x9C, 0x4E, 0xF5, 0x01, 0xE2, 0x81,
-  0x88, 0xBE, 0xEC, 0x9F, 0x6E, 0x81, 0xE7, 0x31, 0x88, 0x08, 0x11, 0x01, 0x92, 0xE5, 0xD1, 0x36, 0x32, 0x3A, 0xD1, 0x07, 0x97, 0x6F, 0x5E, 0xD6, 0xFB, 0xC0,
-  0x58, 0xEF, 0xC9, 0xC9, 0xE6, 0x78, 0x8E, 0xF5, 0xC1, 0x3F, 0x90, 0x20, 0x20, 0x66, 0xD9, 0xEB, 0x6F, 0x41, 0x50, 0x5F, 0x1F, 0x00, 0x3C, 0xE2, 0xD8, 0x18,
-  0x05, 0xD8, 0xF5, 0x6B, 0x4A, 0x0C, 0x22, 0xEA, 0x3E, 0xDE, 0x82, 0x2B, 0xB0, 0xEA, 0x7F, 0xA0, 0x78, 0x00, 0xC9, 0xB2, 0xDB, 0xDF, 0xC6, 0xA6, 0x01, 0x11,
-  0x25, 0x09, 0x7C, 0x0D, 0x5D, 0x6D, 0x73, 0x4C, 0x60, 0xD3, 0x4F, 0x4E, 0x96, 0x4F, 0x4E, 0xAA, 0x21, 0xC0, 0x18, 0x89, 0xF1, 0xA6, 0x28, 0x8A, 0x16, 0x07,
-  0xD9, 0xA2, 0x00, 0xFA, 0xEF, 0x39, 0x0C, 0x8B, 0xC2, 0xD5, 0xDA, 0xE1, 0x93, 0xC3, 0x81, 0x4C, 0xD8, 0x41, 0xB5, 0xC8, 0x29, 0x51, 0x12, 0x3D, 0xA1, 0xA3,
-  0x0F, 0xFA, 0x15, 0x32, 0x54, 0xA2, 0x84, 0xA1, 0xB0, 0x09, 0xFA, 0x69, 0xDA, 0x44, 0xCB, 0xC3, 0x84, 0x09, 0x2E, 0x71, 0xA4, 0x4B, 0x11, 0x64, 0xA3, 0xD0,
-  0xAC, 0xA0, 0xD5, 0x58, 0xEA, 0x83, 0x93, 0xA3, 0xD2, 0x94, 0xB6, 0xB9, 0x32, 0x86, 0x74, 0x00, 0xEE, 0x92, 0x20, 0x58, 0x5B, 0x1F, 0x31, 0xA8, 0x3E, 0x78,
-  0x1E, 0x1D, 0x6F, 0xA3, 0x95, 0x56, 0x6F, 0x0B, 0xB5, 0x48, 0xE4, 0x30, 0xCD, 0xB4, 0x7A, 0x5C, 0x35, 0x71, 0xF1, 0x72, 0xB7, 0x8A, 0x29, 0xA3, 0x76, 0x1B,
-  0xBD, 0x60, 0x01, 0xEE, 0x1B, 0x41, 0xB8, 0xB6, 0x56, 0x04, 0x20, 0x44, 0x68, 0x7E, 0xB4, 0x37, 0x8D, 0x44, 0xA4, 0x7C, 0x03, 0xFA, 0x08, 0x8C, 0x70, 0xCE,
-  0x9E, 0x85, 0x5A, 0x5B, 0x23, 0x31, 0x28, 0xD4, 0x03, 0xD1, 0xF1, 0xDE, 0xB4, 0x22, 0x91, 0xF3, 0x2D, 0xE8, 0x65, 0x46, 0x4C, 0xDB, 0x70, 0x3E, 0x93, 0xD1,
-  0x08, 0x12, 0xD6, 0xFA, 0xBA, 0x49, 0x80, 0x83, 0x7E, 0xD8, 0xB9, 0x76, 0x45, 0xCF, 0xD7, 0xAE, 0xCD, 0x53, 0xE8, 0x36, 0x2F, 0xD0, 0xD3, 0xD9, 0x9B, 0x4F,
-  0x52, 0x13, 0x3A, 0x24, 0x62, 0x47, 0xFA, 0xE0, 0x47, 0x2F, 0xA2, 0x73, 0xF3, 0x02, 0xE3, 0x47, 0x32, 0xA6, 0x73, 0xC0, 0xDB, 0x54, 0x3B, 0xAF, 0x7C, 0x63,
-  0x45, 0x37, 0x19, 0x6E, 0x53, 0x7C, 0x7D, 0x20, 0x96, 0xF6, 0xB3, 0xED, 0x6E, 0xCE, 0x4C, 0x1F, 0x09, 0x21, 0xC4, 0xDD, 0x0E, 0x0B, 0x94, 0xA4, 0xCF, 0xE1,
-  0x60, 0x3B, 0x24, 0x27, 0x38, 0x5E, 0x9D, 0xD9, 0xC6, 0xD7, 0x50, 0x6E, 0x19, 0x8B, 0xE1, 0xDA, 0x6E, 0x01, 0x30, 0xFA, 0xE0, 0xD9, 0xAF, 0xCF, 0xD7, 0x0E,
-  0x52, 0x6C, 0x25, 0xB5, 0x8A, 0x85, 0xC7, 0xF3, 0x11, 0xD8, 0x59, 0x66, 0xA2, 0x48, 0xED, 0x39, 0x55, 0x27, 0x8B, 0x14, 0x7C, 0x09, 0x02, 0xE9, 0xC2, 0x93,
-  0x2E, 0xB1, 0x59, 0x8D, 0xC7, 0xFB, 0x8B, 0x60, 0x40, 0xC4, 0xE7, 0xB1, 0x61, 0xAF, 0x9F, 0x57, 0x04, 0x20, 0xD5, 0x94, 0xF6, 0x0A, 0x8E, 0x76, 0xA5, 0x2E,
-  0xD6, 0xED, 0xDE, 0x74, 0xC6, 0xB9, 0xDE, 0xB7, 0xE2, 0x80, 0x90, 0xA9, 0x67, 0xAD, 0x3F, 0x0D, 0xC4, 0xE1, 0xF4, 0x01, 0x68, 0xED, 0x1D, 0x1C, 0xAC, 0x9D,
-  0x65, 0x04, 0x82, 0x7B, 0x4E, 0x2F, 0xCF, 0xE6, 0xA1, 0xB7, 0x4D, 0x66, 0xB9, 0x9E, 0xBB, 0xEE, 0x6A, 0x9B, 0xB4, 0x72, 0xE9, 0x78, 0x73, 0x6B, 0x73, 0x0C,
-  0x90, 0x53, 0x7E, 0x1A, 0x8D, 0x6C, 0x73, 0xF3, 0xAC, 0x04, 0x19, 0xE5, 0xB5, 0x37, 0xAD, 0x08, 0x7F, 0xCF, 0x51, 0x9C, 0x98, 0xEB, 0x07, 0x08, 0x62, 0x82,
-  0x16, 0xAF, 0x2E, 0xB5, 0xEB, 0xAB, 0x1F, 0xAF, 0x7F, 0xFA, 0xB0, 0x9B, 0xE8, 0x00, 0x7D, 0xEE, 0x29, 0x30, 0x20, 0xB7, 0xFB, 0x8E, 0x09, 0x40, 0x44, 0x6F,
-  0x13, 0x3D, 0xF5, 0x98, 0xA2, 0x5E, 0x5C, 0xBF, 0xDF, 0x95, 0x96, 0x7A, 0xFB, 0x53, 0x53, 0xEF, 0x6B, 0xD0, 0xD3, 0x67, 0x87, 0xDC, 0x10, 0x67, 0x03, 0x5D,
-  0x31, 0x40, 0xD4, 0x97, 0xF6, 0x16, 0x8F, 0xF6, 0x36, 0x90, 0x8B, 0x48, 0xF9, 0x06, 0x86, 0x71, 0x60, 0x15, 0x9F, 0x29, 0xD1, 0x9B, 0x38, 0x0F, 0x83, 0xD4,
-  0x07, 0x57, 0xCB, 0x99, 0x17, 0xCC, 0xFD, 0x8A, 0x09, 0x55, 0xAD, 0x91, 0xCE, 0x56, 0x0A, 0x11, 0xA4, 0x30, 0x8D, 0x74, 0xB8, 0x42, 0x70, 0x91, 0x44, 0x5A,
-  0x3F, 0xEB, 0xDF, 0xA9, 0x56, 0x10, 0xF9, 0x7D, 0x2A, 0x66, 0xBC, 0x41, 0xDE, 0x19, 0x63, 0xDE, 0x79, 0x75, 0xB9, 0x9B, 0x50, 0x36, 0xDE, 0x5B, 0xC2, 0x19,
-  0xEF, 0x35, 0xE1, 0x68, 0x7C, 0x0D, 0x5B, 0x48, 0x61, 0xC3, 0x41, 0x04, 0x07, 0x84, 0xB1, 0xF3, 0x26, 0x03, 0x08, 0xC9, 0x73, 0xBA, 0xCB, 0x6D, 0x5C, 0x47,
-  0x90, 0x91, 0xF4, 0x9C, 0xA3, 0xD8, 0x6F, 0x8E, 0xEF, 0xD4, 0x6B, 0x8E, 0x4A, 0xA9, 0xDD, 0xC6, 0x69, 0x90, 0x13, 0x93, 0xD8, 0x0E, 0x6E, 0x65, 0x5E, 0x57,
-  0x21, 0x12, 0x2C, 0xD3, 0x89, 0x76, 0xC9, 0xCE, 0xB6, 0xD1, 0x4D, 0x6F, 0x1B, 0xDD, 0xC8, 0x14, 0x25, 0xD5, 0x73, 0x72, 0x4F, 0x99, 0xA6, 0xDB, 0x3B, 0xBD,
-  0x4F, 0xF5, 0x0C, 0x67, 0xEB, 0xC7, 0x34, 0x80, 0xD1, 0x07, 0xCF, 0xDF, 0xEF, 0x26, 0xA6, 0x61, 0x67, 0x15, 0x63, 0xDA, 0x56, 0x11, 0x8C, 0x32, 0xB5, 0xEF,
-  0x52, 0x6C, 0xB1, 0x81, 0x36, 0x16, 0x48, 0xF8, 0xAF, 0x3B, 0xD2, 0xC6, 0xA2, 0xBA, 0x36, 0xEE, 0x38, 0xC3, 0x2C, 0xBE, 0x06, 0xFD, 0xF8, 0xC6, 0xE2, 0xF3,
-  0x78, 0x6A, 0xAC, 0xAD, 0x23, 0x0E, 0xA7, 0x0F, 0x3E, 0x18, 0x0B, 0xED, 0xD5, 0xBB, 0x67, 0x3B, 0xD1, 0x95, 0xE8, 0x74, 0x3F, 0xFA, 0x8A, 0x58, 0xDE, 0xB7,
-  0xCE, 0x1C, 0xE2, 0xAE, 0xEF, 0x54, 0x08, 0xA4, 0x0F, 0xDE, 0x12, 0x37, 0xD0, 0x2E, 0x3D, 0x9F, 0xBF, 0x76, 0x6E, 0x27, 0x5A, 0xA3, 0x3D, 0xEF, 0x47, 0x65,
-  0x8C, 0xE9, 0x7D, 0xEB, 0x6B, 0x32, 0xB5, 0x7D, 0xDF, 0xF3, 0xD7, 0x56, 0x19, 0x87, 0xD3, 0x07, 0xAF, 0x5B, 0xEF, 0xE8, 0xD1, 0x4E, 0xD4, 0x25, 0x7A, 0xDD,
-  0x8F, 0xC6, 0x22, 0x9E, 0xF7, 0xAD, 0xB4, 0x9B, 0x91, 0x63, 0xCF, 0xD6, 0x56, 0x19, 0x85, 0xD2, 0x07, 0x1F, 0x5B, 0x2F, 0xE1, 0xEF, 0x4E, 0xD4, 0xC5, 0x7A,
-  0xDC, 0x8F, 0xB2, 0x38, 0xB7, 0xFB, 0x56, 0x95, 0x65, 0x2E, 0xD6, 0x56, 0x14, 0xC0, 0xE8, 0x83, 0x17, 0x97, 0xBF, 0x6A, 0xF5, 0x17, 0xDE, 0xC2, 0xC5, 0x07,
-  0x2E, 0xB5, 0xAB, 0x1F, 0x1B, 0x3B, 0xD1, 0x18, 0x76, 0xBD, 0x1F, 0x7D, 0x51, 0xA6, 0xF7, 0xAD, 0x2D, 0xBA, 0xAF, 0x66, 0x68, 0xAC, 0x1F, 0x0E, 0x05, 0x20,
-  0x3E, 0xFB, 0x02, 0x47, 0xDA, 0x73, 0x63, 0x37, 0x01, 0x31, 0xEA, 0x77, 0x17, 0x45, 0x7B, 0xCC, 0xE4, 0xBE, 0xF5, 0xE4, 0x10, 0xAB, 0x82, 0x8A, 0x92, 0x25,
-  0x86, 0xF5, 0x19, 0xB7, 0xA8, 0xE0, 0xD6, 0xCD, 0x15, 0xD4, 0x1A, 0x57, 0x2F, 0xB4, 0x37, 0xE2, 0xB4, 0x02, 0x37, 0x1B, 0xCF, 0xD9, 0xE5, 0x0D, 0x6D, 0x93,
-  0xF4, 0x24, 0x07, 0xB7, 0xBD, 0xE3, 0xE3, 0xED, 0x86, 0xB7, 0x79, 0xD3, 0xA8, 0xC7, 0xC7, 0xF7, 0xA8, 0x93, 0x91, 0x61, 0x92, 0xCF, 0x16, 0x09, 0x37, 0x79,
-  0x18, 0x46, 0x82, 0xD5, 0x07, 0x2F, 0xE1, 0x44, 0x7B, 0x41, 0x4F, 0x76, 0x55, 0x06, 0xCA, 0xFD, 0xEF, 0xC2, 0x93, 0x12, 0xFC, 0xEE, 0xDB, 0x99, 0x28, 0x31,
-  0x50, 0x74, 0x7B, 0x63, 0x77, 0xA3, 0xBD, 0x05, 0x09, 0x70, 0xAE, 0xBE, 0x0F, 0xEC, 0x7C, 0xB7, 0x0A, 0x8C, 0x89, 0xD8, 0x99, 0x0E, 0x25, 0xBE, 0x77, 0xA1,
-  0x46, 0x79, 0x83, 0x11, 0x7F, 0x33, 0x67, 0x99, 0xA6, 0xF8, 0x46, 0x17, 0x3A, 0x9D, 0x46, 0xC2, 0x56, 0x10, 0xDA, 0x8E, 0xA3, 0x0F, 0x5E, 0x91, 0x50, 0xBB,
-  0xC6, 0xC3, 0x8A, 0x3B, 0x5B, 0x24, 0x2C, 0x62, 0x5B, 0x5B, 0xE8, 0x13, 0x63, 0xAA, 0x0F, 0xAE, 0xF1, 0x9D, 0xA5, 0x80, 0x0B, 0xCF, 0xD6, 0x47, 0x46, 0x85,
-  0x48, 0x5C, 0xDF, 0x03, 0xA2, 0x22, 0x25, 0xF1, 0x77, 0xA1, 0xE9, 0x9A, 0x38, 0x92, 0xAE, 0x0D, 0xAE, 0x68, 0x63, 0x0D, 0xAD, 0xAC, 0xBC, 0xBB, 0xCA, 0x5B,
-  0x6E, 0xE8, 0x1E, 0x3B, 0xDC, 0x34, 0x97, 0x7C, 0xA3, 0x31, 0x68, 0x95, 0xED, 0xA0, 0x1D, 0x9C, 0x07, 0x33, 0xC3, 0x15, 0xCD, 0xE8, 0xF6, 0xD2, 0x05, 0xDF,
-  0x2F, 0x38, 0xF4, 0x1C, 0x0B, 0x1A, 0x3E, 0xB3, 0x6E, 0xF0, 0xED, 0x4E, 0x96, 0x76, 0x1D, 0xED, 0x7C, 0x43, 0x10, 0x30, 0x0B, 0x81, 0xA1, 0x44, 0xB7, 0x13,
-  0x5F, 0xA0, 0x67, 0x7B, 0x14, 0xF1, 0x7D, 0x38, 0x05, 0xCA, 0xCD, 0xD9, 0xAC, 0xE7, 0x93, 0x71, 0x24, 0x48, 0xD5, 0x1E, 0x4E, 0xE5, 0xD6, 0xBD, 0x0F, 0x64,
-  0x6C, 0x07, 0x40, 0xA3, 0x06, 0x66, 0x71, 0x48, 0xB7, 0x3B, 0x31, 0x53, 0xAE, 0xB6, 0x95, 0x4E, 0xEE, 0x92, 0x6F, 0x04, 0x56, 0x6E, 0x90, 0x5C, 0xAB, 0x62,
-  0x4C, 0x6F, 0x67, 0x4C, 0x62, 0x2C, 0x33, 0xFA, 0x87, 0xAD, 0xD6, 0xA4, 0x8F, 0x1B, 0xB7, 0x34, 0xC1, 0xDA, 0xF9, 0xE1, 0xA4, 0x5F, 0xB6, 0xE7, 0xA8, 0x74,
-  0xD7, 0x1D, 0x70, 0xBA, 0xF1, 0xA6, 0x3B, 0x94, 0xD2, 0x00, 0xA8, 0x69, 0x6A, 0xEF, 0x8C, 0xE0, 0x4B, 0x53, 0xFB, 0x88, 0xF9, 0x7D, 0x87, 0x7B, 0xEF, 0x90,
-  0x76, 0xC3, 0xB2, 0xFC, 0xDC, 0xFD, 0x77, 0xFD, 0xC4, 0xFE, 0xBB, 0x13, 0xB1, 0xFF, 0x4E, 0x9A, 0x69, 0x5F, 0x76, 0xBB, 0xDD, 0x2A, 0x9C, 0x57, 0xDC, 0x82,
-  0x77, 0x27, 0x2C, 0x4D, 0x41, 0x98, 0x15, 0x59, 0xEA, 0x0B, 0x96, 0xFA, 0x12, 0x4B, 0xA7, 0x77, 0xB9, 0xA9, 0xF0, 0x4E, 0x38, 0xE2, 0xEB, 0xB8, 0x5F, 0x09,
-  0x4B, 0x95, 0xF6, 0x49, 0x52, 0xDB, 0xBE, 0xAB, 0x6D, 0x92, 0xB4, 0x49, 0x3A, 0x18, 0x1E, 0x17, 0xC6, 0x42, 0x0A, 0xC2, 0x7C, 0xFE, 0xD5, 0x5D, 0xFA, 0xFC,
-  0x78, 0x0B, 0x9F, 0x1F, 0x67, 0x7C, 0x7E, 0x87, 0xCE, 0x2E, 0x08, 0xFF, 0xC6, 0x1C, 0x5E, 0xB0, 0xB5, 0x86, 0xD3, 0x2B, 0xD9, 0xDA, 0xAD, 0x87, 0x44, 0x96,
-  0xF0, 0xEA, 0x2E, 0x3D, 0x24, 0xC7, 0x6E, 0x37, 0x32, 0x52, 0x1E, 0x73, 0x06, 0xBB, 0xC9, 0x49, 0xB4, 0x92, 0x92, 0xD5, 0xC9, 0x7B, 0xC7, 0x8D, 0x86, 0x47,
-  0x7D, 0x5E, 0x36, 0xDD, 0x85, 0x7A, 0xAA, 0xEF, 0xC7, 0xCE, 0x6D, 0x72, 0x37, 0x45, 0x19, 0xBE, 0x11, 0x61, 0x26, 0x55, 0xB8, 0x95, 0x0B, 0xB3, 0xCB, 0xB7,
-  0x7F, 0x5F, 0xAF, 0x16, 0x4B, 0xF7, 0xB4, 0xBB, 0x7A, 0x6C, 0x33, 0x6B, 0x95, 0x05, 0xC6, 0x69, 0x87, 0x88, 0x83, 0x6F, 0x26, 0xE8, 0x7D, 0x8A, 0x38, 0x57,
-  0x8C, 0x0D, 0xA5, 0xA0, 0x10, 0x81, 0xE5, 0x0D, 0xFA, 0x68, 0x20, 0xE4, 0x73, 0x96, 0x70, 0x2C, 0xE2, 0x9A, 0xE6, 0x8D, 0x46, 0xF4, 0x73, 0x57, 0x8F, 0x31,
-  0x60, 0x04, 0x5F, 0xF0, 0x7A, 0xA7, 0x1B, 0x91, 0xA4, 0x1A, 0xF2, 0xC5, 0x14, 0x46, 0xB4, 0x51, 0x13, 0xE3, 0x86, 0x76, 0x67, 0x22, 0x38, 0x62, 0x22, 0x78,
-  0xF1, 0xE6, 0xA3, 0x4A, 0x06, 0xCC, 0xD7, 0x3A, 0x59, 0x11, 0x1C, 0x6D, 0xFE, 0x6E, 0x85, 0x6E, 0x65, 0x69, 0x75, 0x62, 0x69, 0x1D, 0x8D, 0xE2, 0x2D, 0xA2,
-  0xDB, 0x84, 0x2C, 0x85, 0x04, 0x8E, 0xD9, 0x43, 0xE0, 0xDA, 0x7B, 0xD9, 0x03, 0x2A, 0xD9, 0xC1, 0xF1, 0x3A, 0x76, 0x60, 0x1D, 0x6D, 0x61, 0x06, 0xC7, 0x39,
-  0x66, 0x70, 0x57, 0x32, 0xE8, 0xEB, 0x83, 0xF7, 0x9B, 0x98, 0x41, 0xBF, 0xA2, 0x19, 0x1C, 0x09, 0x33, 0x88, 0xF7, 0x0F, 0xF7, 0xAB, 0x0A, 0x4B, 0xB2, 0x82,
-  0xC7, 0x23, 0x7C, 0x6C, 0xE6, 0x71, 0x35, 0x4F, 0xD8, 0x5D, 0xCC, 0x5D, 0xD8, 0xEE, 0xFA, 0xF1, 0xF6, 0x57, 0xDB, 0xB5, 0xBC, 0xC5, 0x7A, 0x21, 0x57, 0xEE,
-  0xE8, 0x6B, 0x0F, 0xB7, 0xEB, 0x8D, 0x5A, 0x71, 0x66, 0xA7, 0xB5, 0xC4, 0xCA, 0xDE, 0x0D, 0x3C, 0x5F, 0xCB, 0xBE, 0x39, 0x24, 0xB1, 0x01, 0x51, 0xB4, 0xAE,
-  0x56, 0x04, 0x64, 0xB7, 0x5C, 0xBC, 0x79, 0xA9, 0x6D, 0xF0, 0x5A, 0x07, 0x05, 0xB2, 0x2E, 0x7B, 0xF9, 0x85, 0xB6, 0xC1, 0xDB, 0x2F, 0x14, 0xD8, 0x72, 0xB6,
-  0xA8, 0xE0, 0x8B, 0x48, 0xB4, 0xCD, 0xDE, 0x44, 0x52, 0xBA, 0x5B, 0x83, 0xB5, 0xDA, 0x3C, 0xA5, 0x44, 0xE3, 0x32, 0xE6, 0xAD, 0x50, 0x63, 0x55, 0xDB, 0x62,
-  0x4F, 0x71, 0x4A, 0x06, 0xC0, 0xC1, 0x97, 0x74, 0x37, 0x4B, 0x40, 0xAA, 0x6D, 0x4A, 0x4D, 0x13, 0xB6, 0x46, 0x65, 0xF8, 0xE9, 0x4C, 0x0A, 0x66, 0x51, 0xE7,
-  0x6B, 0x06, 0xB3, 0xB8, 0xCE, 0x07, 0x63, 0xDA, 0xFB, 0xE0, 0xE5, 0x9F, 0x0A, 0x96, 0x56, 0x9B, 0xB3, 0x74, 0x74, 0x57, 0x2C, 0x6D, 0x91, 0xAA, 0x22, 0xEB,
-  0x0A, 0xBD, 0xD0, 0x70, 0x36, 0x36, 0x2E, 0x06, 0x0D, 0xB6, 0xC5, 0x62, 0xAE, 0x76, 0x0D, 0xAC, 0xEE, 0xD4, 0xC0, 0x04, 0x01, 0xD5, 0x94, 0xD1, 0xCF, 0x2A,
-  0xE3, 0xF4, 0x6B, 0xB3, 0x2F, 0xC6, 0x51, 0x55, 0xF3, 0x52, 0x70, 0x74, 0xF2, 0x35, 0x99, 0x97, 0x37, 0x0F, 0xF1, 0xEA, 0xC6, 0xC1, 0x8B, 0x81, 0x63, 0xF0,
-  0xA2, 0x47, 0xBB, 0x37, 0xB0, 0x88, 0x82, 0x8D, 0xF5, 0x71, 0x74, 0xA7, 0xAF, 0x3C, 0xBB, 0x8B, 0x08, 0xC6, 0x58, 0xDA, 0xC2, 0xC4, 0x7A, 0xFD, 0x1D, 0x9A,
-  0x98, 0xB4, 0xD0, 0xC4, 0xF3, 0x20, 0x2F, 0x60, 0x74, 0xBE, 0x36, 0x10, 0x17, 0x34, 0xEB, 0xAC, 0x24, 0xA9, 0xB3, 0xF2, 0xF9, 0x21, 0x14, 0x85, 0x59, 0x04,
-  0x39, 0x74, 0x9E, 0xB3, 0x2F, 0x27, 0xAA, 0x3B, 0x8C, 0xDF, 0x74, 0x48, 0x97, 0xD5, 0xE2, 0x77, 0xEA, 0x46, 0x85, 0x66, 0xFA, 0x5D, 0xBB, 0xA5, 0x6F, 0x15,
-  0x3C, 0x37, 0xF8, 0x2B, 0x38, 0x6E, 0x08, 0x5F, 0x03, 0xD4, 0x26, 0x3E, 0x19, 0x5D, 0xE8, 0xDF, 0x45, 0x38, 0xB9, 0xB4, 0xB0, 0x89, 0xAE, 0x41, 0x48, 0x76,
-  0x1D, 0xCF, 0xC0, 0x62, 0xD5, 0x98, 0x85, 0x40, 0x69, 0xFB, 0x8F, 0x19, 0x4E, 0xF2, 0x1A, 0xF8, 0xBE, 0x06, 0xA3, 0xDA, 0x4A, 0x33, 0x7D, 0x3B, 0x2F, 0x7F,
-  0xB0, 0x06, 0x0F, 0xA3, 0x35, 0xC3, 0xFF, 0xF9, 0xEF, 0xB2, 0xA9, 0x19, 0xFC, 0x7E, 0x66, 0x2C, 0x00, 0x30, 0x23, 0xDF, 0xBC, 0xD0, 0x81, 0x52, 0xDF, 0x0B,
-  0xA0, 0x14, 0xB5, 0xC7, 0x76, 0x8E, 0xAA, 0xF2, 0xA4, 0x7D, 0xA8, 0x12, 0x77, 0xAA, 0xB1, 0x62, 0x6C, 0x72, 0x1E, 0x98, 0xBE, 0x3D, 0x83, 0x52, 0xCD, 0xF2,
-  0xCC, 0xF9, 0x94, 0xB8, 0x61, 0xDB, 0xB0, 0xAC, 0xAB, 0x1B, 0x38, 0x78, 0x8B, 0x33, 0xCC, 0x20, 0xF9, 0x7A, 0xED, 0xC5, 0x4F, 0xEF, 0x2E, 0xD9, 0x3B, 0x2B,
-  0xDF, 0x82, 0xBC, 0x88, 0x55, 0x6B, 0x6A, 0xA3, 0xB9, 0xCB, 0xAA, 0xF7, 0x3A, 0xC1, 0xB6, 0xEC, 0x3B, 0xA6, 0x37, 0x86, 0xAF, 0x0D, 0x8D, 0x80, 0xBC, 0xF6,
-  0x82, 0x50, 0xBB, 0xD0, 0x22, 0x8C, 0x8E, 0x67, 0xD2, 0x77, 0xA2, 0xB4, 0x19, 0x5F, 0xBC, 0x25, 0x63, 0xFC, 0x17, 0xDF, 0x81, 0xA6, 0x11, 0xD4, 0x81, 0x56,
-  0x3B, 0x3B, 0xED, 0xD6, 0xD0, 0xFE, 0xA2, 0x2E, 0x46, 0xF8, 0x65, 0x52, 0x68, 0x57, 0x9F, 0xFB, 0x4E, 0x53, 0x33, 0x87, 0x0D, 0xF6, 0x9E, 0x51, 0x7A, 0x19,
-  0xAF, 0x89, 0x17, 0x50, 0xB7, 0xC3, 0x09, 0x71, 0xEB, 0x31, 0x65, 0xE0, 0x0C, 0x33, 0xCF, 0x0D, 0x12, 0x1F, 0x59, 0xB5, 0x47, 0xF1, 0xF5, 0x36, 0x14, 0xF4,
-  0xE1, 0x3C, 0xD0, 0x1E, 0x5E, 0x5C, 0x68, 0x58, 0xE0, 0x26, 0xDE, 0x5F, 0x6A, 0x0E, 0xD3, 0xED, 0x9A, 0x5A, 0xEA, 0xC2, 0xCF, 0x10, 0x1A, 0xA4, 0x37, 0x65,
-  0xDF, 0x6A, 0xC4, 0x49, 0xBD, 0xAA, 0x39, 0x02, 0xC0, 0x28, 0x52, 0x6F, 0x24, 0x09, 0xAC, 0x5B, 0x46, 0x68, 0x34, 0x92, 0xEF, 0x4C, 0x85, 0x5E, 0x81, 0x92,
-  0xA6, 0x46, 0x6F, 0xC9, 0x2F, 0x70, 0xBD, 0x6D, 0xB4, 0x41, 0x86, 0xC0, 0x6F, 0x04, 0x4D, 0x7C, 0x3F, 0xFD, 0xF5, 0x58, 0x80, 0x6E, 0x75, 0x9B, 0x1A, 0xDE,
-  0x49, 0xC2, 0x4A, 0x44, 0x3E, 0x10, 0xD7, 0x84, 0xD0, 0x8A, 0xD1, 0x2A, 0x50, 0x32, 0x74, 0xB7, 0x09, 0x15, 0x41, 0xEC, 0xF9, 0x40, 0xC6, 0x20, 0xB1, 0x71,
-  0x93, 0x0F, 0xA0, 0x9B, 0x74, 0xF4, 0xDC, 0x64, 0x41, 0x51, 0xD2, 0xDA, 0xE1, 0x21, 0xB8, 0x34, 0x04, 0x25, 0x02, 0x56, 0x31, 0xAE, 0xD7, 0xF8, 0x02, 0x26,
-  0x58, 0x54, 0xAD, 0xB3, 0xAC, 0x1D, 0x00, 0x82, 0x76, 0xE8, 0x5D, 0x87, 0xBE, 0xED, 0x8E, 0x61, 0xE8, 0xD1, 0x88, 0xB1, 0xD1, 0xDB, 0x88, 0x32, 0x75, 0x9F,
-  0x5E, 0xA7, 0x9D, 0xA4, 0x6F, 0xD4, 0xF9, 0xF5, 0x83, 0x5A, 0xA3, 0xC6, 0x89, 0xA7, 0xE7, 0x60, 0x6E, 0x75, 0x76, 0xF0, 0x88, 0xD2, 0xD8, 0xD0, 0xCE, 0xCF,
-  0x79, 0x37, 0xAC, 0x15, 0x5E, 0x84, 0x46, 0xF4, 0x4F, 0xEA, 0x56, 0x64, 0x8A, 0xBF, 0x7F, 0xFF, 0x97, 0xB0, 0xD9, 0xDB, 0x43, 0xA0, 0xFA, 0x29, 0xCE, 0x20,
-  0x7C, 0xFF, 0x17, 0xFC, 0xFF, 0xF6, 0x11, 0x9D, 0x36, 0xF8, 0xFE, 0x2F, 0xFC, 0x73, 0xFB, 0x08, 0x7A, 0x82, 0x63, 0xDA, 0xDF, 0xED, 0xEF, 0x54, 0x0E, 0x59,
-  0xE9, 0x8D, 0x73, 0xA5, 0x17, 0x89, 0x6D, 0x6D, 0x9A, 0xC6, 0x05, 0x44, 0xFD, 0x1E, 0xFB, 0x6F, 0xDD, 0xF4, 0x2C, 0x50, 0x4F, 0x08, 0x96, 0x2C, 0x94, 0xEE,
-  0x80, 0x4A, 0x84, 0xA0, 0xA2, 0x97, 0x08, 0xDB, 0x23, 0xDA, 0x52, 0xE3, 0xAE, 0x12, 0x1B, 0x88, 0x68, 0x39, 0x33, 0xFC, 0x80, 0xBC, 0x71, 0xC3, 0x7A, 0x98,
-  0x70, 0x8A, 0x1C, 0x89, 0x0F, 0x06, 0x09, 0x16, 0xF0, 0x07, 0x70, 0xD0, 0xAE, 0xC6, 0x95, 0x16, 0x19, 0xDB, 0x83, 0xC8, 0x0E, 0x63, 0x4A, 0xD9, 0xCD, 0x1C,
-  0x3B, 0xFC, 0x64, 0x3A, 0x5F, 0xEA, 0xF8, 0x5A, 0xD3, 0x74, 0xA8, 0xC8, 0x88, 0x08, 0x1B, 0x3D, 0xC5, 0xFF, 0x81, 0x5C, 0xF0, 0x4F, 0xAE, 0x7E, 0x00, 0x2B,
-  0x2B, 0xE1, 0xEB, 0x74, 0x0A, 0xE0, 0xF3, 0xB2, 0xA9, 0xB1, 0x83, 0x15, 0x78, 0x86, 0x6B, 0xE1, 0x39, 0xFE, 0x59, 0x09, 0xED, 0xE1, 0x05, 0x7E, 0x04, 0xD7,
-  0x68, 0xCD, 0x8A, 0x97, 0xD8, 0x01, 0xB6, 0xA2, 0x35, 0x06, 0x6D, 0xC5, 0x8E, 0xE0, 0x1A, 0xBE, 0xE2, 0x07, 0x6C, 0xB7, 0xA9, 0x0D, 0x6D, 0xD7, 0xA5, 0x07,
-  0x25, 0xD4, 0xC7, 0xA9, 0xFE, 0x69, 0xB0, 0x04, 0x0E, 0x38, 0x69, 0xB7, 0x8F, 0x82, 0x55, 0x74, 0xB6, 0xBA, 0x7D, 0x44, 0xF0, 0x1E, 0x25, 0x12, 0x8E, 0x57,
-  0xFC, 0x18, 0xAE, 0x03, 0x7D, 0x78, 0x47, 0x10, 0x4C, 0x2F, 0xAC, 0xE2, 0x0B, 0xD0, 0x22, 0xC4, 0xFB, 0x9C, 0x78, 0x38, 0x5B, 0x45, 0x67, 0x08, 0x4D, 0x61,
-  0x39, 0x1B, 0x70, 0xBA, 0x8A, 0x4F, 0xE1, 0x2E, 0x7D, 0x5D, 0x11, 0x12, 0xC1, 0x78, 0xBA, 0x7D, 0xC4, 0x79, 0x82, 0x4B, 0xFC, 0x28, 0x2D, 0x6A, 0x8C, 0x09,
-  0x21, 0x8F, 0x22, 0xCF, 0x59, 0x92, 0x96, 0xF2, 0x07, 0xF8, 0xC7, 0x95, 0x43, 0xF0, 0xF0, 0xF9, 0xEA, 0x8D, 0x55, 0xAF, 0xF1, 0x05, 0xD9, 0x1A, 0xC6, 0x30,
-  0x19, 0xA6, 0xED, 0xB9, 0xA6, 0x63, 0x9B, 0xE8, 0x28, 0xF5, 0x86, 0x76, 0x31, 0xE0, 0x71, 0x0C, 0x0D, 0x1A, 0x9A, 0xCB, 0x46, 0x9A, 0x8B, 0x5A, 0x2C, 0x29,
-  0xD6, 0x1A, 0x6D, 0x6A, 0x87, 0xDC, 0xD6, 0x10, 0x05, 0x77, 0xC1, 0x6A, 0x38, 0xB0, 0xB1, 0x02, 0x47, 0xC6, 0x5B, 0x0A, 0x91, 0xD0, 0xD6, 0x12, 0x16, 0x8A,
-  0x46, 0x0E, 0xB5, 0x9D, 0x54, 0x94, 0x2D, 0xF0, 0x6A, 0xE1, 0xC0, 0x0F, 0xD3, 0x0E, 0x0C, 0xAA, 0xF2, 0xC3, 0x7A, 0xED, 0x0A, 0x9F, 0xFB, 0xFF, 0xAD, 0x76,
-  0x80, 0x8D, 0x0E, 0x6A, 0xFF, 0x3A, 0xD3, 0x6A, 0x07, 0xB2, 0x27, 0xDF, 0xA6, 0x5D, 0x8E, 0x69, 0x6C, 0x5C, 0x51, 0x63, 0x63, 0x49, 0x63, 0xE3, 0xBB, 0xD5,
-  0x98, 0xBC, 0x10, 0xBC, 0x8D, 0xD6, 0xE4, 0x95, 0xD7, 0x02, 0xCD, 0x95, 0xC2, 0x73, 0xA5, 0x71, 0x6D, 0x8D, 0x55, 0xDA, 0xDA, 0x44, 0x4D, 0x2C, 0xC5, 0x81,
-  0xF7, 0x10, 0xFF, 0xF5, 0xCF, 0xEF, 0xDE, 0x62, 0xA8, 0x54, 0xAB, 0x2C, 0xD2, 0x58, 0xBA, 0x1C, 0x51, 0x60, 0xC0, 0xDC, 0x99, 0x08, 0xDC, 0x89, 0x1C, 0x7A,
-  0x50, 0xD3, 0xEA, 0x14, 0x25, 0x66, 0xD0, 0x12, 0x43, 0xE0, 0x81, 0xB7, 0x9A, 0xEF, 0x62, 0xB0, 0x15, 0xCE, 0x1B, 0x43, 0x15, 0xD8, 0x02, 0x02, 0x54, 0x52,
-  0x22, 0xC3, 0x9C, 0x71, 0x18, 0x29, 0x27, 0xEC, 0xDC, 0x45, 0xA8, 0xBF, 0x06, 0x55, 0x83, 0x9A, 0x88, 0xE9, 0x71, 0x6C, 0x0B, 0x4A, 0xA5, 0xC3, 0x23, 0x7F,
-  0x25, 0x01, 0xF1, 0x39, 0x6C, 0x85, 0x81, 0x8B, 0x4C, 0x50, 0x09, 0x8D, 0x98, 0xBA, 0xCC, 0xC7, 0xB3, 0x5A, 0x07, 0xCF, 0x4A, 0x81, 0x87, 0x67, 0x9E, 0x4A,
-  0x68, 0xF8, 0x44, 0x57, 0x2E, 0x96, 0x6A, 0xC4, 0xF0, 0xC9, 0x25, 0x15, 0x4F, 0x3C, 0xD3, 0x55, 0xE3, 0x89, 0x4F, 0x8A, 0xE4, 0xE3, 0xA9, 0x28, 0x1B, 0x3E,
-  0x13, 0xA1, 0xB0, 0xE7, 0x74, 0x35, 0xD2, 0x11, 0xFF, 0x6D, 0x5E, 0x7F, 0x8C, 0x0C, 0x88, 0x16, 0xF1, 0x9F, 0xBD, 0x78, 0xC9, 0xF8, 0xA3, 0xA8, 0x16, 0x89,
-  0xA3, 0xCC, 0x06, 0xC4, 0x69, 0x1B, 0x21, 0xC4, 0x27, 0x18, 0xC7, 0x93, 0xA0, 0x8D, 0x15, 0x6E, 0x24, 0xC6, 0xCC, 0xAD, 0xB6, 0x0B, 0x04, 0x50, 0x84, 0x8D,
-  0xB3, 0x4E, 0xDA, 0x3C, 0x33, 0xB8, 0xD8, 0xE5, 0x3C, 0x74, 0xEC, 0x6E, 0x0E, 0x46, 0x9E, 0x61, 0x92, 0x10, 0x78, 0x31, 0x0F, 0x1B, 0x1D, 0xC5, 0x48, 0xB8,
-  0x7A, 0xC7, 0xC7, 0xD9, 0x3C, 0xC3, 0x3B, 0xE0, 0x5F, 0x4F, 0x43, 0x0C, 0x38, 0x1F, 0x15, 0x0F, 0xCD, 0x4C, 0x28, 0x04, 0xB5, 0x9A, 0x58, 0xB2, 0xAB, 0x9D,
-  0x65, 0x2A, 0x6E, 0x80, 0xE0, 0x8B, 0x70, 0xDA, 0x53, 0x46, 0x63, 0xE2, 0x9B, 0x20, 0x43, 0x18, 0x7C, 0x47, 0x9F, 0xFE, 0x62, 0xC8, 0xE8, 0x3E, 0x8A, 0x08,
-  0x13, 0xBB, 0x86, 0x03, 0xD7, 0xD4, 0x25, 0xB6, 0xB6, 0xD3, 0xF2, 0x5C, 0xA2, 0xEE, 0x35, 0x51, 0xBF, 0xF3, 0x8E, 0xF8, 0x19, 0x7F, 0x38, 0x3D, 0x06, 0xF3,
-  0x49, 0x38, 0xF7, 0x5D, 0x5E, 0xCF, 0x67, 0xEB, 0x1B, 0xE5, 0x50, 0x72, 0x87, 0xB6, 0x79, 0x78, 0xA8, 0x3D, 0x0B, 0x43, 0x03, 0x14, 0x80, 0xEB, 0x94, 0x13,
-  0x94, 0x8F, 0x66, 0xF0, 0x49, 0x09, 0xCF, 0x47, 0xA3, 0x64, 0x0F, 0x15, 0x13, 0xE6, 0xB7, 0xF8, 0xA5, 0x34, 0xE1, 0xCE, 0x14, 0x55, 0xFB, 0xDF, 0x73, 0xE2,
-  0xAF, 0xAE, 0xA9, 0xC0, 0x3C, 0xFF, 0x99, 0xE3, 0xD4, 0x6B, 0xED, 0x78, 0xD9, 0xB9, 0xC6, 0xC6, 0xE0, 0x6D, 0x40, 0x75, 0x05, 0x7D, 0x80, 0x8E, 0x63, 0x9B,
-  0x67, 0xDC, 0x44, 0x7A, 0x87, 0x71, 0xD7, 0x05, 0x57, 0x46, 0x7A, 0xD0, 0x0F, 0x2D, 0x3C, 0xF7, 0x0B, 0x59, 0xCD, 0x67, 0x20, 0xFE, 0x78, 0x18, 0x9F, 0x9A,
-  0x58, 0xE0, 0xD2, 0x21, 0x6D, 0x68, 0x79, 0xC9, 0x07, 0x72, 0xDD, 0x23, 0x45, 0xA3, 0x58, 0x05, 0xD4, 0x3A, 0xD1, 0x13, 0xB3, 0x1F, 0x92, 0xB9, 0x7D, 0xA0,
-  0x3E, 0x53, 0x4C, 0x81, 0x70, 0x02, 0xB9, 0xF0, 0x44, 0xF2, 0x4A, 0xF5, 0x90, 0x9A, 0x9E, 0xB8, 0x6D, 0x3C, 0x88, 0x23, 0xC3, 0x7C, 0x66, 0x19, 0x21, 0x49,
-  0x06, 0x87, 0xC8, 0x16, 0xC4, 0xCD, 0xA9, 0x17, 0x92, 0x54, 0xC4, 0xB0, 0x71, 0x6F, 0x86, 0xE1, 0x7C, 0x8C, 0xAD, 0xF1, 0x5E, 0xDD, 0x5F, 0xE1, 0xE3, 0x6B,
-  0xF8, 0x7F, 0x66, 0x0E, 0xA2, 0xDA, 0xB8, 0x39, 0x63, 0x21, 0x51, 0x3C, 0x88, 0xAD, 0x44, 0x96, 0x43, 0x22, 0x2C, 0xF0, 0xFB, 0xA2, 0xA7, 0x87, 0x0F, 0xE9,
-  0xD1, 0x83, 0x48, 0x69, 0x22, 0x7A, 0x5C, 0x68, 0xF1, 0x8D, 0x94, 0x82, 0xB3, 0xB8, 0x53, 0x38, 0x04, 0x72, 0x09, 0x03, 0xF3, 0xAD, 0x48, 0xBD, 0x33, 0xA8,
-  0x36, 0xD1, 0x16, 0xFE, 0x3F, 0xEA, 0x7F, 0x45, 0x51, 0xFF, 0xFE, 0x42, 0x7C, 0x81, 0x6D, 0xA7, 0x3C, 0x80, 0xC1, 0xA9, 0xA7, 0x05, 0x0F, 0x6A, 0x50, 0xED,
-  0x28, 0xE7, 0xFD, 0x78, 0xE8, 0x8E, 0xED, 0x6B, 0x62, 0x5B, 0x8C, 0xE8, 0xD8, 0xB2, 0x50, 0x46, 0x38, 0x7D, 0x8F, 0x13, 0xDC, 0x38, 0xDB, 0x5D, 0xAF, 0xB1,
-  0xB5, 0x05, 0x1A, 0x8F, 0x6F, 0xE3, 0x92, 0x64, 0xE2, 0x2D, 0x8A, 0x20, 0x7D, 0x88, 0x3A, 0x37, 0x24, 0x05, 0x1C, 0x41, 0xF3, 0xED, 0x3C, 0xA5, 0x5D, 0x8B,
-  0x6D, 0x3F, 0x3C, 0x19, 0x40, 0x03, 0x71, 0x05, 0x40, 0x43, 0x9F, 0x7A, 0x8D, 0x84, 0x96, 0xB8, 0x65, 0x58, 0x05, 0x59, 0x85, 0x88, 0x69, 0x99, 0x97, 0xC4,
-  0xCC, 0x42, 0xE9, 0x1A, 0x41, 0x56, 0xBE, 0x0C, 0x10, 0xC9, 0xD3, 0x0B, 0xCD, 0x9D, 0x3B, 0x0E, 0xD8, 0x20, 0xB2, 0x00, 0x36, 0x28, 0xDF, 0x55, 0x86, 0xE8,
-  0xFF, 0xDC, 0x78, 0x16, 0x51, 0x9E, 0x90, 0xC0, 0xA3, 0x47, 0x49, 0x6C, 0xB8, 0xC8, 0xC0, 0xCA, 0xF8, 0xA8, 0x37, 0xD6, 0xFE, 0xD2, 0x73, 0x47, 0xF6, 0x38,
-  0xCE, 0xB3, 0x9C, 0x24, 0x48, 0xD6, 0x0F, 0x13, 0x82, 0x97, 0x6A, 0x1C, 0x20, 0xC4, 0xB6, 0xA8, 0x80, 0xE8, 0x8B, 0x39, 0x33, 0xB3, 0xB1, 0x4F, 0xA9, 0xD5,
-  0xD7, 0x09, 0x7F, 0x65, 0x5F, 0x03, 0xE4, 0x8F, 0xC6, 0x1C, 0x5F, 0x10, 0xF5, 0x4E, 0xD4, 0x95, 0x8C, 0x71, 0x9C, 0xC0, 0x88, 0x8C, 0xA5, 0xE8, 0xC6, 0x1F,
-  0xC5, 0x87, 0x2F, 0xAF, 0xE2, 0x2F, 0xD0, 0x92, 0x3F, 0x02, 0x4A, 0x3B, 0x07, 0x34, 0xF8, 0x82, 0x2D, 0x29, 0xB5, 0x67, 0x6B, 0x03, 0xDA, 0x30, 0x07, 0x09,
-  0xED, 0x20, 0x8B, 0xA4, 0x90, 0x72, 0xF1, 0xF6, 0x62, 0x85, 0x40, 0x28, 0xBA, 0xC5, 0x10, 0x45, 0x41, 0x7B, 0x85, 0xC3, 0x22, 0x54, 0xA9, 0x9D, 0x8F, 0x0A,
-  0x84, 0xCC, 0x11, 0xEB, 0x6C, 0x63, 0x1F, 0x1B, 0xA2, 0x23, 0x72, 0xEE, 0x63, 0xC9, 0xEB, 0xB9, 0x3D, 0x69, 0xA9, 0x4D, 0xD2, 0x99, 0x7E, 0x06, 0x5A, 0xAB,
-  0x2B, 0xA8, 0x87, 0xA6, 0xAF, 0xF0, 0x29, 0x81, 0x88, 0x87, 0xE8, 0x42, 0xB2, 0x7C, 0x15, 0x6E, 0x1D, 0x4D, 0x5F, 0xCB, 0x76, 0xC6, 0x92, 0x6C, 0x9C, 0x61,
-  0x63, 0x43, 0xBE, 0xA3, 0x9C, 0xD3, 0xD5, 0xE4, 0xEF, 0x0B, 0xCA, 0x99, 0x61, 0xCB, 0x74, 0x53, 0x80, 0x93, 0x2D, 0xEB, 0xA6, 0x91, 0xCE, 0x87, 0x53, 0x3B,
-  0x54, 0x20, 0xAC, 0x75, 0x6B, 0xEB, 0x64, 0x2E, 0xD9, 0xCB, 0x59, 0xA4, 0xA4, 0x45, 0x3D, 0x20, 0x4A, 0x4C, 0xC7, 0xD3, 0xEF, 0x71, 0x78, 0xCE, 0xD3, 0x1B,
-  0xC3, 0xC7, 0x49, 0x76, 0x54, 0x70, 0x6A, 0xF1, 0x87, 0xA1, 0x60, 0xAB, 0x96, 0x14, 0x45, 0x72, 0xDD, 0x52, 0xAC, 0x15, 0x26, 0xC7, 0x00, 0xF2, 0x62, 0xD9,
-  0xEF, 0x3E, 0x01, 0xB8, 0x00, 0x27, 0x35, 0xB4, 0xEF, 0xFF, 0xA2, 0x28, 0x6E, 0xB5, 0x11, 0x44, 0x99, 0x60, 0x42, 0x2C, 0xBA, 0x24, 0x11, 0xE2, 0x27, 0x39,
-  0x71, 0xC1, 0x27, 0xB1, 0x4E, 0x79, 0xFB, 0x7B, 0x64, 0x21, 0x51, 0x92, 0x2A, 0x1D, 0xA6, 0xD0, 0xE5, 0xEC, 0xE2, 0x11, 0x0A, 0x2B, 0xEC, 0x15, 0x93, 0x52,
-  0xF8, 0x63, 0x11, 0xC8, 0x69, 0x43, 0x35, 0x04, 0xDD, 0xFC, 0x08, 0x75, 0x4F, 0xCA, 0x4C, 0x1B, 0x7C, 0x80, 0x05, 0x1A, 0xB0, 0x44, 0xA8, 0x64, 0x3A, 0xC2,
-  0x61, 0x14, 0x13, 0x53, 0x42, 0xC2, 0x8C, 0x19, 0xCE, 0x4B, 0xF9, 0x5A, 0x2F, 0xAF, 0x1F, 0x22, 0x59, 0xFC, 0x11, 0xC0, 0xB0, 0xA8, 0xF1, 0x20, 0x12, 0x43,
-  0x16, 0x07, 0x76, 0x20, 0x21, 0x48, 0x88, 0x28, 0x4F, 0x4C, 0xC9, 0xED, 0xD6, 0xB5, 0x38, 0x52, 0xE5, 0x8E, 0xEA, 0x34, 0x39, 0xD3, 0xD2, 0x34, 0x4B, 0xFB,
-  0xFD, 0x8D, 0x9A, 0xCC, 0xBF, 0xF8, 0x0C, 0x8C, 0x14, 0xF1, 0x1A, 0xEB, 0x90, 0x93, 0x19, 0x5C, 0x96, 0x90, 0x72, 0x87, 0x65, 0xB6, 0xF8, 0x41, 0x78, 0xA3,
-  0xF8, 0xA0, 0x98, 0xCD, 0x0C, 0x2F, 0xE5, 0x5A, 0x30, 0x62, 0x30, 0x71, 0x96, 0x1C, 0xED, 0x49, 0xE2, 0x51, 0xD6, 0x81, 0xB9, 0xE2, 0x62, 0xD6, 0xC5, 0xDC,
-  0xF5, 0xC6, 0x26, 0x8B, 0xC2, 0x89, 0x57, 0xFA, 0x1C, 0x02, 0x95, 0x57, 0x0C, 0x70, 0x19, 0x3D, 0x77, 0x52, 0x0A, 0x19, 0x3F, 0xA3, 0x22, 0xE1, 0xA0, 0x0F,
-  0xA0, 0x54, 0x5B, 0x17, 0xA1, 0x4D, 0x13, 0xA0, 0x88, 0xB5, 0x1C, 0x36, 0xB1, 0x4B, 0x5D, 0x82, 0x97, 0x53, 0x4F, 0x11, 0xBC, 0xB4, 0x31, 0x5D, 0x82, 0xA6,
-  0x7E, 0x5F, 0x0E, 0x2C, 0x3F, 0xED, 0x22, 0xD3, 0x6E, 0xDC, 0x54, 0x00, 0x8E, 0x1F, 0xD1, 0x91, 0x40, 0x45, 0x36, 0x2B, 0x02, 0x8C, 0x5E, 0x8A, 0x52, 0x93,
-  0xF4, 0x1B, 0x84, 0xDE, 0x8C, 0x6D, 0xCE, 0x4F, 0x85, 0xA1, 0x05, 0x9D, 0x25, 0x6D, 0xE3, 0xFD, 0x3A, 0x2F, 0xAE, 0x64, 0xD9, 0x26, 0x97, 0x42, 0xE4, 0x4D,
-  0xFE, 0xB5, 0x64, 0x65, 0x4C, 0xA7, 0x59, 0x95, 0x3D, 0xA0, 0xA5, 0xB4, 0x03, 0xDF, 0x64, 0xC9, 0x20, 0x7A, 0xA0, 0x05, 0x63, 0x15, 0x1E, 0xFE, 0xCE, 0xFA,
-  0xC4, 0xE4, 0x9D, 0xB0, 0xA9, 0x46, 0x29, 0x2D, 0xDE, 0x2C, 0x4D, 0x4A, 0x3C, 0x15, 0xC5, 0xFC, 0x3B, 0xC0, 0x2C, 0xC0, 0x5F, 0x90, 0xF0, 0x40, 0x93, 0xED,
-  0x2D, 0x27, 0x28, 0xC7, 0x62, 0xE2, 0x51, 0x30, 0x49, 0xBC, 0x94, 0xC9, 0xD8, 0xD3, 0x50, 0x4F, 0x3F, 0x9B, 0x43, 0x48, 0x5E, 0x2F, 0xC0, 0xF9, 0xC0, 0xDB,
-  0x17, 0xF5, 0xC6, 0x6D, 0x11, 0x3B, 0x4C, 0x5C, 0xB1, 0xED, 0x54, 0x25, 0x82, 0xA6, 0x09, 0x35, 0xB6, 0x84, 0x7C, 0xD4, 0xE8, 0x64, 0x87, 0xB9, 0x72, 0xC5,
-  0xE0, 0x26, 0x4F, 0xB0, 0x17, 0x59, 0xD1, 0xB2, 0xFA, 0x36, 0x81, 0x20, 0x4E, 0x00, 0x19, 0x62, 0x53, 0x25, 0xAC, 0x64, 0x17, 0xA2, 0x81, 0xA0, 0x5D, 0xF6,
-  0xC1, 0x1C, 0xDA, 0x93, 0xD5, 0x7F, 0xAA, 0x5C, 0x64, 0x02, 0x88, 0x9C, 0x29, 0x07, 0x05, 0x3E, 0x45, 0x65, 0x1A, 0xEE, 0x8D, 0x11, 0xC8, 0x4E, 0x63, 0x02,
-  0x41, 0x21, 0xE1, 0x7E, 0x53, 0xD7, 0x59, 0x03, 0x9D, 0x3B, 0x00, 0x3B, 0x6B, 0xD3, 0x6D, 0x27, 0x38, 0x8E, 0x41, 0x1B, 0xA0, 0x27, 0x89, 0xDB, 0xEC, 0x43,
-  0xD1, 0xE2, 0x3E, 0x3B, 0x63, 0x0D, 0xA2, 0x5E, 0xF0, 0xD3, 0xCC, 0x6D, 0x63, 0x36, 0x23, 0xAE, 0x75, 0x39, 0xB1, 0x1D, 0xAB, 0xCE, 0x40, 0xA3, 0x07, 0x6D,
-  0x7C, 0x8D, 0x7E, 0xE6, 0x98, 0x3E, 0xD4, 0xC1, 0xB1, 0x82, 0x37, 0x5F, 0xB2, 0x6B, 0xF5, 0x5A, 0xCF, 0x12, 0xCF, 0xE4, 0xF0, 0x66, 0x6D, 0xCB, 0x37, 0x16,
-  0x6F, 0xF0, 0x99, 0x3F, 0x6A, 0x0E, 0xCD, 0x4E, 0xB3, 0xC3, 0x1B, 0x84, 0x50, 0x6C, 0x09, 0x91, 0x23, 0x5E, 0x7C, 0x36, 0xEA, 0x97, 0x0F, 0x6F, 0x63, 0xBC,
-  0xA1, 0xF7, 0x82, 0x5D, 0xAA, 0xD7, 0xE8, 0x43, 0x83, 0x87, 0x7F, 0xCC, 0x70, 0xA9, 0x59, 0xA4, 0x19, 0x49, 0x8C, 0xF8, 0x3C, 0x20, 0x8A, 0x8A, 0x35, 0xFF,
-  0x41, 0x46, 0x0A, 0x97, 0x5D, 0xC8, 0x13, 0x68, 0xEE, 0x75, 0x15, 0xA8, 0x78, 0x5A, 0x10, 0xC1, 0x91, 0x93, 0x97, 0x30, 0xBC, 0xFD, 0x27, 0x31, 0x7C, 0xD0,
-  0xC7, 0x81, 0x56, 0xD7, 0x3B, 0xFA, 0x41, 0x9D, 0x5E, 0x7F, 0x07, 0xEC, 0x4C, 0xEA, 0x8D, 0x83, 0x6E, 0xA3, 0xD1, 0x0E, 0x40, 0x67, 0xA4, 0xDE, 0xEA, 0x89,
-  0x26, 0xF0, 0x87, 0xB6, 0x61, 0x9D, 0xE4, 0xDF, 0x7F, 0xED, 0xCD, 0xFD, 0xA0, 0xA8, 0xC1, 0x3B, 0xDB, 0xC5, 0x4C, 0x5C, 0xD4, 0xE4, 0x1A, 0x06, 0x2F, 0xAE,
-  0x95, 0x69, 0xA2, 0xD3, 0x87, 0x1C, 0xC5, 0x48, 0x93, 0x3E, 0xFB, 0x05, 0x25, 0xBF, 0x54, 0xEC, 0xF3, 0x7A, 0x93, 0xE0, 0x4C, 0x79, 0x5D, 0xAC, 0x5D, 0xDD,
-  0xCA, 0xC6, 0x11, 0x57, 0x74, 0x7C, 0xAE, 0x21, 0xA3, 0xFF, 0x54, 0xC0, 0xE2, 0x35, 0x52, 0x66, 0x0E, 0xBD, 0x4A, 0x19, 0xAA, 0xAC, 0xAF, 0x0A, 0xEB, 0xD1,
-  0xE4, 0x44, 0x73, 0x7A, 0x8C, 0x9D, 0xAC, 0x3D, 0x2F, 0xE7, 0xE0, 0xE3, 0x53, 0x11, 0x51, 0xD9, 0x35, 0x1C, 0x70, 0x46, 0xA1, 0x1F, 0x06, 0xA0, 0x45, 0xF9,
-  0x08, 0x6E, 0x4B, 0x19, 0x8C, 0x8F, 0x56, 0x4B, 0x00, 0xA4, 0x57, 0x89, 0x4B, 0xB0, 0xD2, 0x28, 0xB8, 0xB0, 0x5E, 0x48, 0xBF, 0xFC, 0x9A, 0xA2, 0x00, 0xAC,
-  0x59, 0xCE, 0x15, 0x51, 0x06, 0xDA, 0x35, 0xA2, 0xA0, 0x87, 0x40, 0x7C, 0xD8, 0x26, 0x85, 0xBC, 0x9C, 0x61, 0x7D, 0x76, 0x48, 0x9F, 0x8A, 0x85, 0x79, 0x43,
-  0xF9, 0xEC, 0x30, 0xFE, 0x56, 0x32, 0x10, 0xF1, 0x51, 0x81, 0x58, 0x84, 0xA4, 0x58, 0xDE, 0x44, 0x96, 0xB7, 0x98, 0xCE, 0x28, 0x81, 0x90, 0xBF, 0x7D, 0xC0,
-  0xC4, 0x45, 0x2A, 0x8A, 0x8B, 0x70, 0x71, 0x21, 0x40, 0x3C, 0xC2, 0x2D, 0x9F, 0x5B, 0x89, 0xEC, 0xFF, 0xD7, 0xE7, 0x31, 0x67, 0x8B, 0x61, 0x21, 0x9D, 0x7C,
-  0xEE, 0x42, 0x62, 0xAF, 0x18, 0x20, 0xF1, 0x81, 0x24, 0xC6, 0xD6, 0x62, 0x58, 0x8D, 0x2D, 0x31, 0xF7, 0x81, 0x00, 0x31, 0x5B, 0xEA, 0x19, 0x12, 0xC1, 0x4A,
-  0xF4, 0xB2, 0x32, 0xCD, 0x70, 0x2D, 0x2D, 0xFA, 0x4C, 0x76, 0x44, 0x2C, 0x7B, 0xD3, 0x57, 0x69, 0xB9, 0xC9, 0x9A, 0x49, 0x4C, 0x46, 0x73, 0x2C, 0xA5, 0xA0,
-  0x51, 0x4B, 0x09, 0x3A, 0xA2, 0xA3, 0x10, 0x5A, 0x34, 0x62, 0x45, 0x63, 0x74, 0x5A, 0x49, 0x58, 0x51, 0xEB, 0xD8, 0x71, 0x62, 0x04, 0x62, 0x8E, 0xE6, 0x38,
-  0x3D, 0xA7, 0xC7, 0x06, 0x2F, 0x8C, 0xD9, 0xD4, 0x10, 0x45, 0x6E, 0x10, 0xB1, 0x94, 0x68, 0x13, 0x39, 0x08, 0x83, 0xCF, 0x23, 0xB3, 0x94, 0x14, 0xB6, 0xE6,
-  0xA9, 0xBF, 0x77, 0x08, 0xCE, 0x87, 0xF0, 0x7D, 0x8C, 0xB8, 0x07, 0xD1, 0xF3, 0x35, 0xC7, 0x5B, 0x10, 0x5C, 0xBF, 0x14, 0x8F, 0x9B, 0x68, 0x43, 0x02, 0x31,
-  0x95, 0xB0, 0x59, 0x2D, 0x8C, 0x41, 0xE1, 0xC4, 0x0E, 0x60, 0x10, 0x8E, 0x9F, 0xB3, 0x24, 0x0F, 0xF5, 0x28, 0x21, 0x96, 0xB2, 0x97, 0x9D, 0xED, 0x4F, 0x88,
-  0x93, 0xC1, 0xC4, 0xB2, 0x7C, 0xC8, 0x79, 0xCC, 0x04, 0xA2, 0xA2, 0x79, 0xB4, 0x35, 0x44, 0x18, 0xDD, 0xFE, 0x6A, 0xA5, 0xA8, 0x66, 0xA0, 0x54, 0x90, 0x11,
-  0x58, 0x2C, 0xCB, 0x98, 0xD7, 0x8C, 0x34, 0x55, 0x93, 0x95, 0x05, 0x1A, 0xC5, 0x39, 0x7B, 0x65, 0x94, 0xCF, 0xD7, 0x0A, 0x93, 0x38, 0x4B, 0xAC, 0xEC, 0x77,
-  0x7E, 0x28, 0x76, 0x16, 0xB0, 0x33, 0x2C, 0x18, 0x07, 0x0F, 0xCE, 0x0F, 0x27, 0xE1, 0xD4, 0x19, 0x3C, 0xF8, 0x5F, 0x94, 0x18, 0xA6, 0xBF, 0xBA, 0xAB, 0x00,
-  0x00
+  0x1F, 0x8B, 0x08, 0x08, 0x00, 0x00, 0x00, 0x00, 0x02, 0xFF, 0x69, 0x6E, 0x64, 0x65, 0x78, 0x5F, 0x6F, 0x76, 0x32, 0x36, 0x34, 0x30, 0x2E, 0x68, 0x74, 0x6D,
+  0x6C, 0x00, 0xED, 0x3D, 0xEB, 0x7A, 0xD3, 0x48, 0xB2, 0xFF, 0xF3, 0x14, 0x8D, 0x66, 0x16, 0xDB, 0x1B, 0xDB, 0xB1, 0x1D, 0x27, 0x64, 0x42, 0x62, 0x16, 0x42,
+  0x06, 0xE6, 0x2C, 0x30, 0x2C, 0x99, 0x61, 0xD8, 0x8F, 0xC3, 0x07, 0xB2, 0xD5, 0xB6, 0x35, 0xC8, 0x92, 0x57, 0x92, 0x63, 0x7B, 0xD9, 0x3C, 0xC7, 0x79, 0xA0,
+  0xF3, 0x62, 0xA7, 0xAA, 0x2F, 0x52, 0xEB, 0x2E, 0xD9, 0xC1, 0x61, 0x67, 0x0F, 0xCC, 0x60, 0x5D, 0xBA, 0xAB, 0xAB, 0xEB, 0xD6, 0x55, 0xD5, 0x17, 0x9D, 0xDD,
+  0x33, 0x9C, 0x91, 0xBF, 0x9E, 0x53, 0x32, 0xF5, 0x67, 0xD6, 0x60, 0xEF, 0x8C, 0xFF, 0x10, 0xF8, 0x73, 0x36, 0xA5, 0xBA, 0xC1, 0x2F, 0xD9, 0xED, 0x8C, 0xFA,
+  0x3A, 0x19, 0x4D, 0x75, 0xD7, 0xA3, 0xFE, 0xB9, 0xB6, 0xF0, 0xC7, 0xAD, 0x13, 0x2D, 0xFE, 0xDA, 0xD6, 0x67, 0xF4, 0x5C, 0xBB, 0x36, 0xE9, 0x72, 0xEE, 0xB8,
+  0xBE, 0x46, 0x46, 0x8E, 0xED, 0x53, 0x1B, 0x8A, 0x2F, 0x4D, 0xC3, 0x9F, 0x9E, 0x1B, 0xF4, 0xDA, 0x1C, 0xD1, 0x16, 0xBB, 0x69, 0x9A, 0xB6, 0xE9, 0x9B, 0xBA,
+  0xD5, 0xF2, 0x46, 0xBA, 0x45, 0xCF, 0xBB, 0x2A, 0x2C, 0xDF, 0xF4, 0x2D, 0x3A, 0xB8, 0xBC, 0x7A, 0x7D, 0xD8, 0x23, 0x3F, 0xBF, 0xED, 0xF5, 0x8F, 0x3B, 0x67,
+  0x07, 0xFC, 0x59, 0x58, 0xC6, 0xF3, 0xD7, 0xEA, 0x3D, 0xFE, 0x19, 0x3A, 0xC6, 0x9A, 0x7C, 0x89, 0x3C, 0xC2, 0x3F, 0x63, 0x40, 0xA2, 0x35, 0xD6, 0x67, 0xA6,
+  0xB5, 0x3E, 0x25, 0x8F, 0x5D, 0x68, 0xB3, 0xF9, 0x9C, 0x5A, 0xD7, 0xD4, 0x37, 0x47, 0x7A, 0xD3, 0xD3, 0x6D, 0xAF, 0xE5, 0x51, 0xD7, 0x1C, 0x3F, 0x4C, 0x54,
+  0x1C, 0xEA, 0xA3, 0xCF, 0x13, 0xD7, 0x59, 0xD8, 0xC6, 0x29, 0xF9, 0xAE, 0x7B, 0x82, 0x7F, 0x93, 0x85, 0x46, 0x8E, 0xE5, 0xB8, 0xF0, 0xFE, 0xF2, 0x47, 0xFC,
+  0xFB, 0x30, 0xBD, 0x75, 0xCF, 0xFC, 0x27, 0x3D, 0x25, 0xDD, 0xE3, 0xF9, 0x2A, 0xF2, 0xFE, 0x66, 0x2F, 0x72, 0x3B, 0xED, 0x65, 0x61, 0x2F, 0xEA, 0x9F, 0xE4,
+  0xD7, 0xF7, 0xE8, 0xC8, 0x37, 0x1D, 0xBB, 0x3D, 0xD3, 0x4D, 0x3B, 0x05, 0x92, 0x61, 0x7A, 0x73, 0x4B, 0x07, 0x1A, 0x8C, 0x2D, 0x9A, 0x0B, 0xE7, 0xBB, 0x19,
+  0xB5, 0x17, 0xCD, 0x02, 0x68, 0x08, 0xA4, 0x65, 0x98, 0x2E, 0x2F, 0x75, 0x8A, 0x74, 0x58, 0xCC, 0xEC, 0x42, 0xB0, 0x79, 0x78, 0xD9, 0x8E, 0x4D, 0x1F, 0xA6,
+  0x37, 0xB4, 0x74, 0xF5, 0x39, 0x16, 0xC0, 0xDF, 0x64, 0x91, 0x99, 0x69, 0x73, 0xA1, 0x3A, 0x25, 0x87, 0xFD, 0xCE, 0x7C, 0x55, 0xC0, 0xCA, 0xC3, 0x63, 0xFC,
+  0x9B, 0x2C, 0x34, 0xD7, 0x0D, 0xC3, 0xB4, 0x27, 0xA7, 0xE4, 0x24, 0x15, 0x84, 0xE3, 0x1A, 0xD4, 0x6D, 0xB9, 0xBA, 0x61, 0x2E, 0xBC, 0x53, 0xD2, 0x4F, 0x2B,
+  0x33, 0xD3, 0xDD, 0x09, 0xE0, 0xE2, 0x3B, 0x80, 0x6C, 0xAB, 0xDB, 0xC9, 0x29, 0xE2, 0x9A, 0x93, 0xA9, 0x0F, 0x2C, 0x4D, 0x94, 0x89, 0x13, 0x4D, 0xA8, 0x50,
+  0x11, 0x3F, 0x73, 0xE9, 0x96, 0x4E, 0x35, 0xDD, 0x32, 0x27, 0x76, 0xCB, 0xF4, 0xE9, 0x0C, 0xBA, 0xE3, 0xF9, 0x2E, 0xF5, 0x47, 0xD3, 0x3C, 0x54, 0xC6, 0xE6,
+  0x64, 0xE1, 0xD2, 0x14, 0x44, 0x02, 0xBA, 0xE5, 0x74, 0x18, 0x5E, 0x26, 0x5F, 0xB5, 0x96, 0x74, 0xF8, 0xD9, 0xF4, 0x5B, 0x82, 0x26, 0x43, 0x3A, 0x76, 0x5C,
+  0x9A, 0x5A, 0x52, 0x96, 0xB0, 0x9C, 0xD1, 0xE7, 0x96, 0xE7, 0xEB, 0xAE, 0x5F, 0x06, 0xA0, 0x3E, 0xF6, 0xA9, 0x5B, 0x0C, 0x8F, 0xA2, 0x54, 0x14, 0x43, 0xCB,
+  0x6E, 0x56, 0x14, 0x30, 0x6D, 0xCB, 0xB4, 0x69, 0x79, 0xF4, 0xB2, 0xDA, 0x8D, 0x82, 0xE3, 0xA5, 0x4A, 0x30, 0xC6, 0x9C, 0x4D, 0x9A, 0xF2, 0x7A, 0xA4, 0xDB,
+  0xD7, 0xBA, 0x97, 0x27, 0x34, 0xAC, 0xEB, 0xC9, 0xB6, 0x85, 0x1A, 0x75, 0x3B, 0x9D, 0x3F, 0x25, 0x5F, 0x4E, 0x29, 0x97, 0x5A, 0x7D, 0xE1, 0x3B, 0xDB, 0x2B,
+  0xC8, 0x49, 0x81, 0xE8, 0xFF, 0x65, 0x46, 0x0D, 0x53, 0x27, 0x75, 0x45, 0xBB, 0x4F, 0x3A, 0x20, 0x62, 0x0D, 0xA2, 0xDB, 0x06, 0xA9, 0x3B, 0xAE, 0x09, 0x7A,
+  0xA1, 0x33, 0xEB, 0x63, 0xC1, 0x13, 0x18, 0x47, 0xE6, 0xB4, 0x91, 0xD2, 0xE5, 0x1C, 0x15, 0x52, 0x29, 0x92, 0xAE, 0x45, 0x25, 0x2D, 0x50, 0x29, 0x7D, 0x4A,
+  0xE9, 0x63, 0x55, 0xF6, 0x95, 0x61, 0x21, 0xA7, 0xF3, 0xAA, 0x95, 0xCB, 0x4A, 0x59, 0x48, 0xB2, 0x14, 0x06, 0xE1, 0x51, 0x1D, 0x8A, 0x5E, 0x4F, 0x49, 0x8B,
+  0xA0, 0x0D, 0x6D, 0xA4, 0xD7, 0x11, 0x40, 0xD3, 0x25, 0x20, 0x2E, 0x23, 0x15, 0x7A, 0x9F, 0xDE, 0xD5, 0xD0, 0xB2, 0xF0, 0xBF, 0xF3, 0x55, 0x56, 0x4F, 0x32,
+  0x6D, 0x4C, 0x35, 0x3B, 0x53, 0xC1, 0xD6, 0x54, 0xB2, 0x37, 0xA5, 0x6D, 0x4E, 0x25, 0xBB, 0x53, 0xC5, 0xF6, 0x54, 0xB0, 0x3F, 0xA5, 0x6C, 0x10, 0x67, 0x67,
+  0xB1, 0x37, 0xF2, 0xDD, 0x70, 0xE1, 0xFB, 0x8E, 0xED, 0x6D, 0x35, 0x80, 0x65, 0xA9, 0xDD, 0xEF, 0x0B, 0xCF, 0x37, 0xC7, 0xEB, 0x96, 0xD0, 0x70, 0x50, 0xBB,
+  0xB9, 0x0E, 0x0E, 0xE6, 0x90, 0xFA, 0x4B, 0x4A, 0xF3, 0x9D, 0x11, 0x5B, 0xBF, 0x06, 0x33, 0x34, 0x99, 0x58, 0x69, 0xB2, 0x37, 0x5A, 0xB8, 0x1E, 0x7A, 0x75,
+  0x73, 0xC7, 0x04, 0xC0, 0xEE, 0xC3, 0x02, 0x33, 0x5A, 0xB2, 0xA1, 0xD6, 0x68, 0x98, 0xD2, 0x96, 0xB3, 0xF0, 0x91, 0xC6, 0xA9, 0x9C, 0x70, 0xA0, 0x3B, 0xA6,
+  0xBF, 0x4E, 0x7D, 0x27, 0x34, 0xB1, 0x93, 0x6D, 0xA6, 0x3B, 0xE5, 0xF1, 0x3A, 0x1D, 0x4D, 0xE9, 0xE8, 0x33, 0x35, 0xF6, 0x0B, 0x9D, 0xB4, 0x22, 0xE7, 0xB1,
+  0x6D, 0xDA, 0xF3, 0x85, 0xDF, 0x42, 0x67, 0x6B, 0xFE, 0x55, 0x78, 0xCE, 0x04, 0x52, 0x76, 0xB1, 0xD7, 0xCB, 0x73, 0x39, 0x8E, 0xE6, 0xAB, 0x7C, 0x22, 0xA8,
+  0xC8, 0x0E, 0x2C, 0x7D, 0x48, 0xAD, 0x3C, 0x94, 0x85, 0x32, 0x64, 0x98, 0x5D, 0x61, 0xAB, 0xB2, 0x3D, 0xBB, 0x98, 0xA7, 0xDA, 0x7F, 0xF0, 0xA7, 0xD2, 0x74,
+  0x64, 0xD7, 0xCD, 0xC8, 0x23, 0x8F, 0x5A, 0xA0, 0x60, 0x59, 0x8E, 0x39, 0x94, 0x59, 0x02, 0x0E, 0xB9, 0x0D, 0xB8, 0xBA, 0x3D, 0xA1, 0x60, 0x0B, 0x56, 0x4D,
+  0x79, 0x99, 0x1F, 0x36, 0x94, 0xEA, 0x3E, 0x9A, 0xEA, 0xA3, 0xFC, 0x30, 0x85, 0x1B, 0x84, 0x26, 0x69, 0xF3, 0x8B, 0x0D, 0x9C, 0x14, 0x85, 0xBF, 0xB9, 0x88,
+  0x74, 0x7B, 0xD9, 0x8E, 0x7C, 0xAA, 0xE6, 0x44, 0x65, 0x2B, 0x35, 0x0C, 0x28, 0x34, 0x0D, 0x32, 0x20, 0x1C, 0x8F, 0x8B, 0x42, 0xCA, 0xF1, 0xF8, 0xB0, 0x73,
+  0xD8, 0x2F, 0x74, 0xA4, 0x52, 0x7B, 0x19, 0x0B, 0x2B, 0x1F, 0xE6, 0x98, 0x95, 0x5C, 0x21, 0xF0, 0xF4, 0xEB, 0x54, 0x97, 0xDE, 0xF1, 0x4C, 0x1E, 0xD7, 0xE9,
+  0x43, 0x0F, 0x22, 0x3B, 0x3F, 0x25, 0x30, 0x13, 0x82, 0xDE, 0x4B, 0xC5, 0x8F, 0x79, 0x78, 0xA9, 0x2A, 0x20, 0xC9, 0x9B, 0x8E, 0x76, 0x84, 0x03, 0xE9, 0x45,
+  0x14, 0x06, 0xA7, 0xFA, 0x98, 0x3E, 0x5D, 0xF9, 0x2D, 0x83, 0x8E, 0x1C, 0x97, 0x3B, 0x87, 0x19, 0x71, 0x65, 0x8C, 0x91, 0xC5, 0x12, 0x7B, 0x3A, 0x75, 0xAE,
+  0xA9, 0x9B, 0x42, 0xAC, 0x18, 0x53, 0xFB, 0x3F, 0xF4, 0x8D, 0x12, 0xD0, 0x74, 0x18, 0x1E, 0x53, 0x69, 0x1F, 0x05, 0xD7, 0xEB, 0x8E, 0x7A, 0xDD, 0x62, 0x70,
+  0x6D, 0xD0, 0x19, 0x7D, 0x68, 0x51, 0x23, 0x67, 0x34, 0x33, 0xE8, 0x58, 0x5F, 0x58, 0x7E, 0x81, 0x54, 0xEA, 0x1D, 0xFC, 0x9B, 0xD7, 0x22, 0x33, 0x43, 0xEF,
+  0x31, 0x6B, 0x74, 0xCE, 0x0C, 0xC7, 0x87, 0x94, 0x36, 0xA5, 0xAB, 0xA1, 0xCF, 0xE7, 0x54, 0x87, 0x52, 0x23, 0x9A, 0xC5, 0x87, 0x52, 0x11, 0x47, 0xBA, 0x9D,
+  0x2F, 0x15, 0xD5, 0x17, 0x2A, 0x6C, 0xE0, 0x3C, 0x56, 0xEA, 0xF3, 0xE9, 0xD8, 0x19, 0x2D, 0xBC, 0xDC, 0xF1, 0xBC, 0x1A, 0xBC, 0x53, 0x49, 0x32, 0xCF, 0x32,
+  0x99, 0xFA, 0x2F, 0x6C, 0x1B, 0x39, 0xDA, 0xF2, 0x5D, 0xE8, 0x66, 0x4A, 0x43, 0xE5, 0x08, 0xB7, 0x91, 0x0D, 0x8B, 0x10, 0x36, 0x2B, 0xB3, 0x15, 0x33, 0x53,
+  0x9D, 0x1C, 0x4B, 0x4B, 0xC0, 0x86, 0x98, 0x86, 0x04, 0xB5, 0x1D, 0x5D, 0xFC, 0xE9, 0x62, 0x96, 0xE6, 0x47, 0xC9, 0xC6, 0xBA, 0x30, 0xE8, 0xF3, 0xE6, 0xDC,
+  0xC9, 0x50, 0xAF, 0x77, 0x9A, 0x9D, 0xE6, 0x21, 0xFC, 0xD3, 0xA8, 0x2A, 0x5C, 0x82, 0xBC, 0xBD, 0x5E, 0x89, 0x64, 0xD0, 0x51, 0x71, 0xD2, 0x29, 0xCB, 0xD8,
+  0x17, 0xF2, 0xA2, 0xBC, 0x26, 0x45, 0xB3, 0x4F, 0xDD, 0x76, 0xC1, 0x38, 0x9C, 0x21, 0xD2, 0xD5, 0x05, 0x31, 0x45, 0x5A, 0xAA, 0xB2, 0x78, 0xE6, 0xFC, 0xB3,
+  0xC5, 0x9D, 0x90, 0xFF, 0x78, 0x69, 0x57, 0x48, 0xF1, 0x87, 0x96, 0xF4, 0xCA, 0x74, 0xF1, 0xEE, 0x5A, 0x36, 0x3A, 0xD9, 0x5C, 0x6F, 0x09, 0xAF, 0x0F, 0x30,
+  0xB4, 0x21, 0x06, 0x75, 0x21, 0x18, 0xCD, 0xF4, 0x0C, 0x95, 0x32, 0x1B, 0xD0, 0x60, 0x6C, 0x5A, 0x56, 0xCB, 0x72, 0x96, 0xC5, 0x9E, 0x48, 0xBE, 0x24, 0x27,
+  0xE4, 0xB4, 0x58, 0xE4, 0x37, 0xC5, 0x76, 0x01, 0x96, 0xEB, 0xDF, 0x02, 0xDB, 0xFF, 0xB4, 0xA1, 0x45, 0x51, 0x8D, 0xCD, 0x06, 0x8A, 0x0D, 0xE4, 0x71, 0xBB,
+  0x86, 0x4A, 0x89, 0x12, 0xF7, 0x04, 0xF3, 0xC3, 0x9E, 0xA5, 0xE9, 0x8F, 0xA6, 0x1B, 0x84, 0x9E, 0x61, 0x60, 0xE4, 0x52, 0x4B, 0x47, 0x0F, 0x7E, 0xA3, 0x0C,
+  0x45, 0x61, 0xF8, 0xA6, 0x56, 0x2F, 0xD3, 0x13, 0x46, 0xBA, 0x6F, 0x27, 0xBB, 0xD4, 0xE6, 0xBE, 0x43, 0xB6, 0xAD, 0x3E, 0xEA, 0x14, 0xF5, 0xBA, 0x50, 0x33,
+  0x7A, 0xDB, 0x5A, 0x74, 0x69, 0xB4, 0x27, 0x2E, 0x5D, 0x97, 0xE8, 0x4C, 0x53, 0xFC, 0x9E, 0xF2, 0xFC, 0xF1, 0xE6, 0xA9, 0x12, 0x36, 0x00, 0x08, 0x29, 0x6A,
+  0xF7, 0xBD, 0x12, 0x4D, 0x67, 0x37, 0x59, 0x46, 0x1E, 0x83, 0xEC, 0xA8, 0xA6, 0x95, 0x30, 0x37, 0x7F, 0xAA, 0x1A, 0xB2, 0xCB, 0xD1, 0x37, 0x3D, 0x9E, 0xA7,
+  0x63, 0x3F, 0x63, 0x2E, 0x88, 0xF9, 0xA9, 0x87, 0xF9, 0xD6, 0xAD, 0xA5, 0x64, 0x53, 0x0A, 0x2D, 0x47, 0x90, 0xC4, 0xCC, 0x96, 0xBE, 0x54, 0xC8, 0x68, 0x3D,
+  0x2B, 0x03, 0xCF, 0x66, 0x89, 0x74, 0x9F, 0x19, 0x9B, 0xA1, 0xCC, 0x4C, 0x0C, 0xF9, 0xC0, 0x1E, 0xFA, 0xAE, 0xDE, 0x3B, 0x4E, 0x9D, 0x5B, 0xC9, 0x29, 0x9C,
+  0x9F, 0x64, 0xCF, 0xC8, 0x02, 0x26, 0x87, 0xAC, 0xCC, 0x00, 0x59, 0xB5, 0x45, 0xFD, 0xEA, 0x5A, 0x99, 0x67, 0x61, 0x92, 0x99, 0xAC, 0xFC, 0x94, 0xE7, 0x4C,
+  0x07, 0xB7, 0x17, 0xC5, 0x55, 0x07, 0x88, 0xEE, 0x86, 0xE2, 0xAE, 0xE4, 0x58, 0xBB, 0xC7, 0x9D, 0x82, 0x26, 0x47, 0x96, 0xE3, 0x6D, 0x99, 0x00, 0xCB, 0xCE,
+  0x7F, 0x1D, 0x6D, 0x3C, 0x74, 0xE7, 0xEA, 0x54, 0xBE, 0x3A, 0xC6, 0x68, 0xDE, 0xED, 0xA4, 0x5A, 0xDA, 0xDC, 0x2C, 0x25, 0xCB, 0xA0, 0xB1, 0xE9, 0xCC, 0x53,
+  0x32, 0xA2, 0xE9, 0x66, 0x34, 0x9A, 0xA8, 0x2B, 0x93, 0x2A, 0xCD, 0xE5, 0xC3, 0xD4, 0x34, 0x0C, 0x6A, 0x17, 0xAD, 0x0E, 0x29, 0xE9, 0x3C, 0x20, 0xFE, 0x1F,
+  0x76, 0xA5, 0x14, 0xB9, 0x8B, 0x1E, 0xBA, 0x5F, 0x5B, 0x63, 0xC4, 0x40, 0x93, 0x95, 0x49, 0x8F, 0xBA, 0x22, 0xB9, 0xA8, 0xF6, 0x72, 0x73, 0xAD, 0x48, 0x32,
+  0xA0, 0x03, 0x96, 0x4A, 0x5A, 0xF3, 0x18, 0x56, 0x6C, 0x22, 0xA5, 0x2D, 0xE6, 0x96, 0xC4, 0x34, 0x60, 0x2B, 0x6B, 0x76, 0xE5, 0x16, 0xA7, 0xDA, 0x98, 0x04,
+  0xC4, 0xDB, 0xCD, 0x24, 0xCD, 0x1D, 0x79, 0x46, 0x39, 0x48, 0x06, 0x43, 0x8C, 0x5C, 0x7A, 0x15, 0x2D, 0xB5, 0xA9, 0x72, 0x9C, 0x1D, 0x28, 0x6B, 0xE5, 0xCE,
+  0x0E, 0xC2, 0x65, 0x7D, 0x67, 0xB8, 0x60, 0x4E, 0x5D, 0x52, 0x27, 0xDA, 0x19, 0x59, 0xBA, 0xE7, 0x9D, 0x6B, 0xB8, 0xF0, 0x4B, 0x8B, 0xAE, 0xB0, 0x3B, 0x33,
+  0xCC, 0x6B, 0x62, 0x1A, 0xE7, 0x9A, 0xE5, 0x4C, 0x9C, 0xD8, 0x3B, 0xF6, 0x9E, 0x73, 0x19, 0xC6, 0xB1, 0x73, 0x2D, 0x32, 0xBF, 0xA8, 0xB1, 0x5A, 0xE1, 0x23,
+  0x6D, 0x70, 0xFF, 0xBB, 0x1F, 0x1E, 0x3C, 0x38, 0x7E, 0x78, 0xDF, 0x1E, 0x7A, 0x73, 0xF1, 0xEF, 0x2F, 0x7C, 0x3A, 0xF6, 0xE7, 0xB7, 0xBD, 0xE3, 0x3E, 0x84,
+  0x7B, 0xD4, 0xF7, 0x41, 0xF4, 0xBC, 0xB3, 0x03, 0x06, 0x34, 0x86, 0xC8, 0x01, 0x60, 0x92, 0x81, 0x9B, 0x70, 0x77, 0xD2, 0xD0, 0x93, 0x45, 0x3C, 0x18, 0xC1,
+  0x87, 0xBA, 0x9B, 0x52, 0x84, 0x15, 0xE3, 0xCE, 0x34, 0x33, 0x25, 0x1A, 0xE3, 0xC9, 0xD0, 0x59, 0xC5, 0x7B, 0xC0, 0x3A, 0x25, 0x18, 0x26, 0x4A, 0x51, 0x23,
+  0x0B, 0x20, 0x54, 0x63, 0xD5, 0x71, 0x72, 0x15, 0xCA, 0xA4, 0x16, 0x8A, 0xB0, 0x00, 0x0B, 0xAF, 0x46, 0xD6, 0x67, 0xC9, 0x7B, 0x4D, 0x32, 0xC5, 0x76, 0x7C,
+  0x6E, 0x2A, 0x33, 0x9A, 0x8A, 0x74, 0x55, 0xD4, 0x51, 0xA6, 0x0D, 0x79, 0x2F, 0x80, 0xB4, 0x2D, 0x06, 0x9D, 0x3F, 0xCB, 0x87, 0x14, 0xE7, 0xAB, 0xAC, 0xAC,
+  0x0D, 0xDE, 0x5D, 0xBC, 0xF8, 0x2B, 0x79, 0xF9, 0xFC, 0x9F, 0xA9, 0x1C, 0x2A, 0x42, 0x0A, 0x6D, 0x74, 0x89, 0x96, 0x15, 0x7E, 0x48, 0x9A, 0x68, 0x82, 0x33,
+  0x0C, 0x02, 0x8E, 0xF6, 0x16, 0xB5, 0x27, 0xFE, 0xF4, 0x5C, 0xEB, 0x6A, 0xB8, 0xA4, 0x45, 0xDE, 0xF5, 0x34, 0x82, 0xF6, 0x9B, 0x5D, 0x5C, 0xEB, 0xD6, 0x02,
+  0xAF, 0x3A, 0x65, 0xFA, 0x9A, 0x14, 0xAD, 0xD4, 0x62, 0xC2, 0xB0, 0x04, 0x34, 0x56, 0x0C, 0x71, 0x94, 0xCA, 0xDA, 0xE0, 0x8A, 0xFA, 0x67, 0x07, 0xFC, 0x55,
+  0x01, 0xD7, 0xF2, 0xDB, 0x06, 0x4D, 0xE6, 0xE2, 0x90, 0x27, 0x42, 0x79, 0x8C, 0x1F, 0xBB, 0xFA, 0x8C, 0x22, 0x55, 0x4A, 0x71, 0x5E, 0xE5, 0x7A, 0x50, 0x53,
+  0x1B, 0xBC, 0xA1, 0xCC, 0x21, 0x02, 0x34, 0x4A, 0x31, 0xFE, 0x4C, 0xF8, 0xA8, 0x91, 0xF6, 0x03, 0x79, 0x16, 0x73, 0x52, 0x2D, 0x9D, 0x8B, 0x79, 0x09, 0xBA,
+  0xDF, 0x6B, 0xB5, 0x48, 0xEF, 0xE5, 0x6B, 0xD2, 0x6A, 0x95, 0x28, 0xEC, 0xCC, 0x99, 0x3A, 0x09, 0xFE, 0x77, 0x0F, 0xB5, 0xC1, 0xAF, 0xEF, 0x9E, 0x3D, 0xAE,
+  0x83, 0x5F, 0xD8, 0x59, 0x75, 0x7B, 0x9D, 0x4E, 0xE3, 0xEC, 0x80, 0x17, 0xA9, 0x0E, 0xAB, 0x07, 0x7C, 0x65, 0xB0, 0x7A, 0x27, 0x00, 0xAB, 0xD3, 0xEB, 0x6F,
+  0x01, 0xAB, 0xAB, 0x0D, 0x9E, 0x3F, 0xE5, 0x90, 0x1E, 0xF4, 0xB6, 0x41, 0x0A, 0x04, 0x9C, 0xE1, 0x04, 0xE8, 0xAC, 0x1E, 0x1C, 0x9F, 0x6C, 0x0E, 0xE9, 0x07,
+  0xE8, 0xDD, 0x5B, 0x80, 0x74, 0x02, 0x84, 0x3A, 0xDE, 0x86, 0x4E, 0x27, 0xDA, 0x00, 0xE1, 0x80, 0x45, 0x5F, 0xF5, 0x4F, 0xB6, 0x80, 0xF3, 0x00, 0x48, 0x84,
+  0x80, 0x00, 0xC8, 0xEA, 0x70, 0x1B, 0x1A, 0x1D, 0x6B, 0x83, 0x8B, 0x9F, 0x7E, 0xAC, 0xF7, 0xA1, 0x63, 0xBD, 0x1F, 0x8E, 0x37, 0x87, 0x73, 0xA4, 0x0D, 0xFE,
+  0x86, 0x08, 0x01, 0x32, 0xAB, 0x5E, 0x7F, 0x0B, 0x84, 0xFA, 0xDA, 0x00, 0xEA, 0x23, 0x8C, 0x8D, 0x41, 0x80, 0x5C, 0x3F, 0x67, 0xC8, 0x20, 0xA0, 0xEE, 0x83,
+  0x2D, 0x7A, 0x05, 0x52, 0xFD, 0x37, 0x24, 0x0F, 0x00, 0x59, 0x75, 0xFB, 0xDB, 0xC8, 0x34, 0x00, 0x62, 0x28, 0x81, 0xAE, 0xA1, 0xAA, 0x6D, 0x0E, 0x09, 0x64,
+  0xFA, 0x87, 0xE3, 0xD5, 0x0F, 0xC7, 0xE5, 0x00, 0xA0, 0x8D, 0x44, 0x7B, 0x93, 0x67, 0x45, 0xF3, 0x8D, 0x6C, 0x9E, 0x01, 0xFD, 0xC7, 0x02, 0xC2, 0x22, 0x7F,
+  0x5D, 0xD9, 0x7C, 0x8A, 0x7A, 0x40, 0x13, 0x7E, 0x51, 0xCE, 0x72, 0x2A, 0x98, 0x04, 0x2B, 0x74, 0xB4, 0x41, 0xBF, 0xC4, 0x08, 0x15, 0x71, 0x61, 0x58, 0xDD,
+  0x08, 0xFE, 0x6C, 0xD8, 0x44, 0xC9, 0xC3, 0x01, 0x13, 0x54, 0xE2, 0x50, 0x53, 0x2C, 0xC8, 0x46, 0xA6, 0x39, 0x05, 0x57, 0x7D, 0xA5, 0x0D, 0x8E, 0x0F, 0x0B,
+  0x87, 0xB4, 0xCD, 0x99, 0x31, 0x64, 0x01, 0xB8, 0x4D, 0x3D, 0xAF, 0x32, 0x3F, 0xC2, 0xAA, 0xDA, 0xE0, 0x49, 0x70, 0xBD, 0x0D, 0x57, 0x5A, 0xBD, 0x2D, 0xD8,
+  0xA2, 0xA0, 0xC3, 0x39, 0xD3, 0xEA, 0x09, 0xD6, 0x84, 0xCE, 0xCB, 0xED, 0x32, 0xA6, 0xF7, 0x15, 0xF9, 0x82, 0x0E, 0xB8, 0xAB, 0x7B, 0x7E, 0x65, 0xAE, 0xC8,
+  0x8A, 0x60, 0xA1, 0xC5, 0xD5, 0x9D, 0x71, 0x24, 0x40, 0xE5, 0x0F, 0xC0, 0x0F, 0x4F, 0xF7, 0x17, 0x7C, 0x2D, 0x54, 0x65, 0x8E, 0x84, 0x55, 0xC1, 0x1F, 0x08,
+  0xAE, 0xEF, 0x8C, 0x2B, 0x0A, 0x3A, 0x7F, 0x04, 0xBE, 0xCC, 0xE9, 0xC8, 0xD4, 0xAD, 0x8F, 0x74, 0x3C, 0x86, 0x01, 0xAB, 0x3A, 0x6F, 0x22, 0xD5, 0x81, 0x3F,
+  0xFC, 0x9E, 0x5C, 0xB2, 0xFB, 0xCA, 0xBE, 0x79, 0x0C, 0xDC, 0xE6, 0x0E, 0x7A, 0x7C, 0xF4, 0x16, 0x49, 0x6A, 0xCA, 0x42, 0x22, 0x7E, 0xA5, 0x0D, 0x5E, 0x39,
+  0x01, 0x9E, 0x9B, 0x3B, 0x18, 0xAF, 0xE8, 0x84, 0xE5, 0x80, 0xB7, 0xF1, 0x76, 0x9E, 0xB9, 0xFA, 0x9A, 0x6D, 0x41, 0xDC, 0xC6, 0xF9, 0x7A, 0x43, 0x0D, 0xF2,
+  0x8B, 0x69, 0xFB, 0xDB, 0xF8, 0x80, 0xCF, 0x5C, 0x4A, 0xED, 0xED, 0xA0, 0x80, 0x4B, 0xFA, 0x04, 0x2E, 0xB6, 0x03, 0x72, 0x8C, 0xF1, 0xEA, 0xDC, 0xD4, 0xBF,
+  0x05, 0x77, 0x4B, 0x5F, 0x0E, 0x2B, 0xAB, 0x05, 0xD4, 0xD1, 0x06, 0x8F, 0x7F, 0x7B, 0x52, 0xD9, 0x48, 0xF1, 0x99, 0xD4, 0x32, 0x12, 0x1E, 0xE6, 0x23, 0xB0,
+  0xB1, 0x44, 0xA2, 0x28, 0x5D, 0x73, 0xCA, 0x26, 0x8B, 0x52, 0xFA, 0x25, 0x11, 0x64, 0x13, 0x4F, 0x9A, 0xD2, 0xCD, 0x72, 0x7D, 0xFC, 0x7A, 0x16, 0x0C, 0x90,
+  0xF8, 0x38, 0xD1, 0x4D, 0x7B, 0x13, 0x26, 0xB1, 0x8A, 0x8C, 0x53, 0xE4, 0x19, 0x5C, 0xED, 0x8A, 0x5D, 0xBC, 0xD9, 0x3B, 0xE3, 0x99, 0xE8, 0xF5, 0x5D, 0x33,
+  0x0E, 0x10, 0x99, 0x39, 0x46, 0xF5, 0x34, 0x90, 0xA8, 0xA7, 0x0D, 0x80, 0x6B, 0x2F, 0xE1, 0xA2, 0xF2, 0x28, 0x23, 0x01, 0x7C, 0xE5, 0xE1, 0xE5, 0xF1, 0xC2,
+  0x77, 0xB6, 0x19, 0x59, 0xAE, 0x16, 0xB6, 0xBD, 0xDE, 0x66, 0x58, 0xB9, 0xB0, 0x9C, 0x85, 0xB1, 0xDE, 0x66, 0x4C, 0xF9, 0x79, 0x3C, 0x36, 0x47, 0x74, 0x9B,
+  0x11, 0xE5, 0xB9, 0x33, 0xA3, 0xDF, 0x84, 0x15, 0xA7, 0xA3, 0xEA, 0x06, 0x82, 0x8E, 0x80, 0x8B, 0x97, 0x17, 0xE4, 0xEA, 0xF2, 0xD5, 0xD5, 0xCF, 0x6F, 0x76,
+  0x63, 0x1D, 0xA0, 0xCD, 0x3B, 0x32, 0x0C, 0xD8, 0xDB, 0x3B, 0x37, 0xE6, 0x74, 0xD4, 0xDB, 0x84, 0x4F, 0x3D, 0xCE, 0xA8, 0xA7, 0x57, 0xAF, 0x77, 0xC5, 0xA5,
+  0xDE, 0xDD, 0xB1, 0xA9, 0xF7, 0x2D, 0xF0, 0xE9, 0xA3, 0x45, 0xAF, 0xA9, 0xB5, 0x01, 0xAF, 0x78, 0x45, 0xE4, 0x17, 0x79, 0x81, 0x57, 0x77, 0x16, 0xC8, 0x05,
+  0xA8, 0xFC, 0x01, 0xC2, 0x38, 0x90, 0x8A, 0x8F, 0x0C, 0xE9, 0x4D, 0x94, 0x87, 0xD7, 0xD4, 0x06, 0x97, 0xAB, 0xB9, 0xE3, 0x2D, 0x5C, 0xBA, 0x0D, 0x47, 0x3A,
+  0x5B, 0x31, 0x44, 0xA2, 0xC2, 0x39, 0xD2, 0x11, 0x0C, 0xC1, 0x49, 0x12, 0x65, 0xFE, 0xAC, 0x7F, 0xAB, 0x5C, 0x41, 0xE0, 0x5F, 0x93, 0x31, 0x93, 0x0D, 0xC6,
+  0x9D, 0x09, 0x8E, 0x3B, 0xCF, 0x2E, 0x76, 0x63, 0xCA, 0x26, 0x77, 0x36, 0xE0, 0x4C, 0xEE, 0x74, 0xC0, 0x21, 0x62, 0x0E, 0x5B, 0x52, 0x61, 0xC3, 0x20, 0x42,
+  0x54, 0x84, 0xD8, 0x79, 0x93, 0x00, 0x42, 0xD1, 0x9C, 0xEE, 0x6A, 0x1B, 0xD5, 0x91, 0x68, 0x44, 0x35, 0xE7, 0x30, 0xD4, 0x9B, 0xA3, 0x5B, 0xD5, 0x9A, 0xC3,
+  0x42, 0x6C, 0xB7, 0x51, 0x1A, 0xEC, 0xC9, 0x88, 0x9A, 0x16, 0x6E, 0x65, 0xAE, 0xCA, 0x10, 0xA5, 0x2E, 0xE7, 0x09, 0xB9, 0xE0, 0x77, 0xDB, 0xF0, 0xA6, 0xB7,
+  0x0D, 0x6F, 0x54, 0x8C, 0xA2, 0xEC, 0x39, 0xFE, 0x4A, 0x23, 0x4D, 0xB7, 0x77, 0xF2, 0x35, 0xD9, 0x33, 0x9C, 0x57, 0xB7, 0x69, 0x50, 0x47, 0x1B, 0x3C, 0x79,
+  0xBD, 0x1B, 0x9B, 0x86, 0x8D, 0x95, 0xB4, 0x69, 0x5B, 0x59, 0x30, 0xD6, 0xA9, 0x3B, 0x0F, 0xA3, 0x37, 0xE0, 0xC6, 0x12, 0x11, 0xFF, 0x6D, 0x47, 0xDC, 0x58,
+  0xCE, 0xEF, 0x6A, 0x84, 0x59, 0x7E, 0x0B, 0xFC, 0x71, 0xF5, 0xE5, 0xC7, 0xC9, 0x4C, 0xAF, 0xCC, 0x23, 0x51, 0x4F, 0x1B, 0xBC, 0xD1, 0x97, 0xE4, 0xD9, 0xCB,
+  0xC7, 0x3B, 0xE1, 0x95, 0x6C, 0xF4, 0x6E, 0xF8, 0x15, 0x74, 0xF9, 0xAE, 0x79, 0x66, 0x51, 0xBB, 0xBA, 0x52, 0x61, 0x25, 0x6D, 0xF0, 0x82, 0xDA, 0x1E, 0xB9,
+  0x70, 0x5C, 0x71, 0x28, 0xDD, 0x4E, 0xB8, 0xC6, 0x5A, 0xBE, 0x1B, 0x96, 0xF1, 0x4E, 0xDF, 0x35, 0xBF, 0xA6, 0x33, 0xD3, 0x75, 0x1D, 0xB7, 0x32, 0xCB, 0x44,
+  0x3D, 0x6D, 0xF0, 0xBC, 0xF5, 0x92, 0x5D, 0xED, 0x84, 0x5D, 0xB2, 0xD5, 0xBB, 0xE1, 0x58, 0xD0, 0xE7, 0xBB, 0x66, 0xDA, 0xF5, 0xD8, 0x32, 0xE7, 0x95, 0x59,
+  0xC6, 0x6A, 0x69, 0x83, 0xB7, 0xAD, 0x1F, 0xE1, 0x77, 0x27, 0xEC, 0xE2, 0x2D, 0xDE, 0x0D, 0xB3, 0x44, 0x6F, 0xEF, 0x9A, 0x55, 0xC6, 0x68, 0x59, 0x99, 0x51,
+  0x50, 0x47, 0x1B, 0x3C, 0xBD, 0xF8, 0x8D, 0xD4, 0x9F, 0x3A, 0x4B, 0x1B, 0x17, 0x5C, 0x92, 0xCB, 0x57, 0x8D, 0x9D, 0x70, 0x0C, 0x9B, 0xBE, 0x1B, 0x7E, 0xB1,
+  0x4E, 0xDF, 0x35, 0xB7, 0xD8, 0xBE, 0x9A, 0xA1, 0xEE, 0x6E, 0xB0, 0xF6, 0x85, 0x57, 0xC4, 0xB5, 0x2F, 0x70, 0x45, 0x9E, 0xE8, 0xBB, 0x31, 0x88, 0x41, 0xBB,
+  0xBB, 0x70, 0xDA, 0xC3, 0x4E, 0xDE, 0xBD, 0x97, 0x61, 0x94, 0x60, 0x51, 0xD4, 0xC5, 0x30, 0x3E, 0xE2, 0x16, 0x15, 0xDC, 0xBA, 0xB9, 0x06, 0x5F, 0xE3, 0xF2,
+  0x29, 0xF9, 0x49, 0xDE, 0x96, 0xE8, 0xCD, 0xC6, 0x39, 0xBB, 0xAC, 0xD0, 0x36, 0x8A, 0x4F, 0x34, 0xB8, 0xED, 0x1D, 0x1D, 0x6D, 0x17, 0xDE, 0x66, 0xA5, 0x51,
+  0x8F, 0x8E, 0xBE, 0x22, 0x4F, 0xC6, 0xFA, 0x88, 0x7E, 0x34, 0xA8, 0xBF, 0xC9, 0x62, 0x18, 0xA5, 0xAE, 0x36, 0xF8, 0x11, 0x6E, 0xC8, 0x53, 0x76, 0xB3, 0x2B,
+  0x37, 0x50, 0x6D, 0x7F, 0x17, 0x9A, 0x14, 0xE9, 0xEF, 0x5D, 0x2B, 0x13, 0x43, 0x06, 0x9C, 0x6E, 0x67, 0x62, 0x6F, 0xB4, 0xB7, 0x20, 0x52, 0x5D, 0xB0, 0xEF,
+  0x0D, 0xBF, 0xDF, 0x2D, 0x03, 0x43, 0x24, 0x76, 0xC6, 0x43, 0xA5, 0xDF, 0x77, 0xEE, 0x69, 0x50, 0xCB, 0xD7, 0x3F, 0xFA, 0xA6, 0x45, 0xAB, 0x2F, 0xA8, 0x55,
+  0xEA, 0x82, 0xE7, 0x81, 0x37, 0xE4, 0x17, 0xBC, 0xD9, 0x8D, 0xCF, 0xA1, 0x34, 0x1E, 0x67, 0xDC, 0x76, 0x2E, 0x85, 0xDA, 0xAB, 0x5D, 0xB0, 0x47, 0xDD, 0xFF,
+  0x25, 0x0E, 0x4E, 0x2D, 0x62, 0x82, 0xD8, 0x87, 0xC4, 0xB2, 0x9D, 0xD4, 0x6F, 0x79, 0x80, 0xAD, 0xA5, 0x0D, 0x9E, 0x51, 0x9F, 0x5C, 0xE1, 0x65, 0xC9, 0x8D,
+  0x47, 0x0A, 0x14, 0xB9, 0xEB, 0xD0, 0x77, 0xA9, 0x3E, 0xD3, 0x06, 0x57, 0x78, 0xA4, 0x2C, 0xC0, 0xC2, 0xBB, 0x8D, 0x81, 0xCD, 0x74, 0xEF, 0x33, 0x8C, 0x99,
+  0x78, 0xE0, 0xDD, 0x4B, 0xB8, 0xAC, 0x0E, 0x87, 0xE9, 0x0A, 0xB5, 0x5D, 0x07, 0x3A, 0x17, 0xE8, 0xA2, 0x38, 0xF2, 0x4E, 0x23, 0xF2, 0x4A, 0x79, 0x36, 0xB8,
+  0x64, 0x85, 0x09, 0x1A, 0x93, 0xE2, 0xE6, 0x4A, 0xEF, 0xAC, 0x62, 0x5B, 0x29, 0x71, 0x6F, 0x64, 0xF4, 0x1C, 0x6B, 0x90, 0x0E, 0xBE, 0x51, 0x7A, 0x70, 0xE6,
+  0xCD, 0x75, 0x5B, 0x16, 0x63, 0xBB, 0x88, 0x97, 0x62, 0x5B, 0xE8, 0xD0, 0xB1, 0x0C, 0x28, 0xF8, 0xD8, 0xB8, 0xC6, 0x43, 0xBC, 0x0C, 0x72, 0x15, 0x6C, 0x70,
+  0xC4, 0x2A, 0x20, 0x5E, 0x12, 0x42, 0x81, 0x8C, 0x4C, 0x5D, 0x09, 0x9E, 0x6F, 0x45, 0xC5, 0x63, 0x8F, 0x72, 0x84, 0x24, 0x63, 0x4F, 0xA6, 0x4B, 0x27, 0x01,
+  0x21, 0xD3, 0xB6, 0xEA, 0xA6, 0xEE, 0xD0, 0x7C, 0x43, 0x27, 0xA6, 0x07, 0x38, 0x12, 0x10, 0xAF, 0x03, 0xB6, 0xAB, 0x8D, 0xAB, 0x44, 0xB9, 0x1D, 0x93, 0x6A,
+  0x93, 0x62, 0xBF, 0x77, 0xEA, 0x3E, 0xD8, 0x4A, 0x81, 0x41, 0x7C, 0xD7, 0x6A, 0x14, 0x62, 0x91, 0xF2, 0xDC, 0x6B, 0xB5, 0xA6, 0x7D, 0xDC, 0x9F, 0x47, 0x64,
+  0xD7, 0xCE, 0x0E, 0xA6, 0xFD, 0xA2, 0xAD, 0x65, 0x85, 0x9B, 0x2B, 0xA1, 0xA7, 0x1B, 0xEF, 0xAD, 0x44, 0x2A, 0x0D, 0x00, 0x9B, 0x26, 0xD3, 0x94, 0x26, 0x79,
+  0x8B, 0x6E, 0xDC, 0x0E, 0xB7, 0x58, 0x22, 0xEE, 0xBA, 0x61, 0xB8, 0x99, 0xDB, 0x2C, 0xFB, 0x91, 0x6D, 0x96, 0xC7, 0x72, 0x9B, 0xA5, 0x32, 0xA1, 0xB2, 0xEA,
+  0x76, 0xBB, 0xB7, 0xB8, 0xD3, 0xF2, 0x56, 0xBA, 0xC4, 0x2C, 0x50, 0xB9, 0x2E, 0xF5, 0x65, 0x97, 0xFA, 0x4A, 0x97, 0x4E, 0x3A, 0xDF, 0x5A, 0x8F, 0xC4, 0x74,
+  0xFD, 0x37, 0xD2, 0xA5, 0x52, 0xDB, 0x61, 0x99, 0x6C, 0xDF, 0xD6, 0x6E, 0xD8, 0x54, 0x63, 0x78, 0x94, 0x6B, 0x0B, 0x15, 0x9D, 0x7F, 0x76, 0x9B, 0x3A, 0x3F,
+  0xD9, 0x42, 0xE7, 0x27, 0x09, 0x9D, 0xDF, 0xA1, 0xB2, 0x4B, 0xC4, 0xFF, 0x60, 0x0A, 0x2F, 0xBB, 0x55, 0x41, 0xE9, 0x53, 0xBB, 0xB5, 0x5B, 0x0D, 0x09, 0x24,
+  0xE1, 0xD9, 0x6D, 0x6A, 0x48, 0x86, 0xDC, 0x6E, 0x24, 0xA4, 0xC2, 0xE6, 0x0C, 0x76, 0x33, 0x26, 0x31, 0x4F, 0x4A, 0x65, 0xA7, 0x68, 0x1D, 0xF7, 0x93, 0x1E,
+  0xF6, 0x85, 0xDB, 0x74, 0x1B, 0xEC, 0x29, 0xBF, 0xED, 0xFE, 0x2B, 0x3B, 0x65, 0x78, 0xF0, 0xC5, 0x5C, 0xF1, 0x70, 0x4B, 0x3B, 0x66, 0x17, 0x2F, 0xFE, 0x5A,
+  0xCD, 0x17, 0x8B, 0xB7, 0xB4, 0x3B, 0x7F, 0x6C, 0x33, 0x69, 0x55, 0x09, 0x26, 0x70, 0x07, 0x8B, 0x83, 0x07, 0x50, 0xF4, 0xDE, 0x05, 0x3D, 0x4F, 0x09, 0x23,
+  0x15, 0xA3, 0x10, 0x54, 0xCB, 0x8A, 0xED, 0x99, 0x21, 0x14, 0xA9, 0x69, 0xB8, 0x96, 0x76, 0x8D, 0x38, 0xE3, 0x31, 0xFB, 0xE6, 0xD9, 0x03, 0x34, 0x18, 0xDE,
+  0x67, 0x7C, 0xDE, 0xE9, 0x06, 0x28, 0xA5, 0xC5, 0x8D, 0x21, 0x86, 0x01, 0x6E, 0x4C, 0xC4, 0x84, 0xA0, 0xDD, 0x1A, 0x09, 0x0E, 0x39, 0x09, 0x9E, 0xFE, 0xF4,
+  0x36, 0x8D, 0x06, 0x5C, 0xD7, 0x3A, 0x49, 0x12, 0x1C, 0x6E, 0x7E, 0x84, 0x46, 0xB7, 0x34, 0xB5, 0x3A, 0x21, 0xB5, 0x0E, 0xC7, 0xE1, 0x4E, 0xE0, 0x6D, 0x4C,
+  0x56, 0x0A, 0x05, 0x8E, 0xF8, 0x5A, 0x7F, 0xF2, 0x5A, 0xD5, 0x80, 0x52, 0x72, 0x70, 0x54, 0x45, 0x0E, 0x8C, 0xC3, 0x2D, 0xC4, 0xE0, 0x28, 0x43, 0x0C, 0x6E,
+  0x8B, 0x06, 0x7D, 0x6D, 0xF0, 0x7A, 0x13, 0x31, 0xE8, 0x97, 0x14, 0x83, 0x43, 0x29, 0x06, 0xE1, 0x36, 0xF1, 0x7E, 0x59, 0x62, 0x29, 0x52, 0xF0, 0x60, 0x8C,
+  0xAB, 0xA3, 0x1E, 0x94, 0xD3, 0x84, 0xDD, 0xD9, 0xDC, 0xA5, 0x69, 0x57, 0xB7, 0xB7, 0xBF, 0x99, 0xB6, 0xE1, 0x2C, 0xAB, 0x99, 0x5C, 0xB5, 0xA1, 0x6F, 0xDD,
+  0xDC, 0x56, 0x8B, 0x5A, 0x31, 0x43, 0xD4, 0x5A, 0xA1, 0x67, 0x6F, 0x7B, 0x8E, 0x4B, 0x92, 0x07, 0xC4, 0x44, 0xF6, 0x99, 0xCA, 0xD2, 0xE5, 0x9C, 0x80, 0xE4,
+  0xCE, 0x9A, 0x9F, 0x7E, 0x24, 0x1B, 0x9C, 0xDE, 0x91, 0x02, 0xAC, 0xCB, 0xCF, 0x38, 0x21, 0x1B, 0x1C, 0x72, 0x92, 0x02, 0x2D, 0x63, 0x27, 0x12, 0x9E, 0x37,
+  0x43, 0x36, 0x3B, 0x70, 0xA6, 0x70, 0x53, 0x8E, 0xE2, 0xBB, 0x6C, 0x97, 0xAF, 0xE0, 0xDA, 0x0A, 0x3E, 0x96, 0xB7, 0x91, 0x00, 0x88, 0xEA, 0x2B, 0xB6, 0x69,
+  0xC9, 0xA3, 0xFE, 0xD7, 0xF6, 0x0C, 0xDF, 0x9D, 0x2A, 0xC6, 0x2C, 0x68, 0xBC, 0xA2, 0x31, 0x0B, 0xFD, 0x7C, 0x10, 0xA6, 0x3B, 0x0F, 0x5E, 0xFE, 0x9E, 0xD2,
+  0xA5, 0xF5, 0xE6, 0x5D, 0x3A, 0xBC, 0xAD, 0x2E, 0x6D, 0x31, 0x54, 0x05, 0xD2, 0xE5, 0x3B, 0xBE, 0x6E, 0x6D, 0x2C, 0x5C, 0xBC, 0x36, 0xC8, 0x16, 0xB7, 0xB9,
+  0xE4, 0x0A, 0xBA, 0xBA, 0x53, 0x01, 0x93, 0x08, 0x94, 0x63, 0x46, 0x3F, 0xC9, 0x8C, 0x93, 0x6F, 0x4D, 0xBE, 0x78, 0x8F, 0xD6, 0x9B, 0xF7, 0xE8, 0xF8, 0x5B,
+  0x12, 0x2F, 0x67, 0xE1, 0xE3, 0xD3, 0x8D, 0x8D, 0x17, 0xAF, 0x8E, 0xC6, 0x8B, 0x5D, 0xED, 0x5E, 0xC0, 0x02, 0x0C, 0x36, 0xE6, 0xC7, 0x61, 0xEF, 0x5B, 0xB3,
+  0x60, 0xBC, 0x4B, 0x5B, 0x88, 0x58, 0xAF, 0xBF, 0x43, 0x11, 0x53, 0x26, 0x9A, 0xC4, 0x38, 0x28, 0x1C, 0x18, 0x4D, 0xCC, 0x0D, 0x84, 0x0E, 0x4D, 0x95, 0x99,
+  0xA4, 0xF4, 0x51, 0xF9, 0xEC, 0x00, 0x9C, 0xC2, 0x94, 0xC3, 0x29, 0xD3, 0xF1, 0x3C, 0xE3, 0x1F, 0xC8, 0xCC, 0x38, 0x58, 0x32, 0x38, 0xD0, 0x92, 0x4D, 0xCF,
+  0x85, 0x47, 0x27, 0x07, 0x8E, 0x66, 0xFC, 0x48, 0xE5, 0xC2, 0xC3, 0x23, 0xCF, 0x74, 0x71, 0xD2, 0xCA, 0x35, 0x15, 0x73, 0x89, 0x64, 0xEA, 0xD2, 0xF1, 0xB9,
+  0xF6, 0x5D, 0x00, 0x53, 0x50, 0x0B, 0x8B, 0x68, 0x04, 0x4C, 0xB2, 0x6D, 0x39, 0x3A, 0x3A, 0xAB, 0xFA, 0xDC, 0x07, 0x4C, 0xDB, 0xBF, 0xCF, 0x31, 0xC9, 0xAB,
+  0xE3, 0xB1, 0x1C, 0x7A, 0xB9, 0x99, 0x68, 0x76, 0x08, 0xB3, 0x58, 0x3F, 0x85, 0x97, 0xC1, 0xDC, 0xE3, 0xFF, 0xFE, 0x4F, 0x51, 0x6A, 0xC6, 0x9C, 0x4D, 0x14,
+  0x02, 0x80, 0x18, 0xB9, 0xA3, 0x73, 0x0D, 0x30, 0x75, 0x1D, 0x0F, 0x5C, 0x51, 0x73, 0x62, 0xE6, 0xB1, 0x4A, 0x7C, 0x66, 0x55, 0x21, 0xA0, 0x98, 0x43, 0x8E,
+  0x78, 0xE9, 0x18, 0xBD, 0xF1, 0x92, 0x95, 0x40, 0xF1, 0xDC, 0x63, 0x25, 0x48, 0x59, 0x22, 0x70, 0x90, 0x26, 0x03, 0xB1, 0xC2, 0x29, 0x01, 0xD3, 0x99, 0x37,
+  0x72, 0xCD, 0x39, 0xF8, 0x8F, 0x86, 0x33, 0x5A, 0xCC, 0xA8, 0xED, 0xB7, 0x75, 0xC3, 0xB8, 0xBC, 0x86, 0x8B, 0x17, 0x98, 0xF6, 0x06, 0x71, 0xA8, 0xD7, 0x9E,
+  0xFE, 0xFC, 0xF2, 0x82, 0x9F, 0x97, 0xFA, 0x02, 0x98, 0x48, 0x8D, 0x5A, 0x93, 0x8C, 0x17, 0x36, 0x0F, 0x29, 0xEA, 0x14, 0xCB, 0xF2, 0x4F, 0xEA, 0x5E, 0xEB,
+  0x2E, 0x19, 0xEA, 0x1E, 0x7D, 0xEE, 0x78, 0x3E, 0x39, 0x27, 0x01, 0x44, 0xCB, 0x19, 0xB1, 0xF3, 0x78, 0xDA, 0x9C, 0xD8, 0xA2, 0x24, 0x27, 0xC1, 0xAF, 0xAE,
+  0x05, 0x45, 0x83, 0x5A, 0xFB, 0xA4, 0x76, 0x7A, 0xD2, 0xAD, 0xA1, 0x52, 0x04, 0x4D, 0x8C, 0xF1, 0x23, 0xB9, 0x50, 0xAE, 0xBE, 0x70, 0xAD, 0x26, 0x19, 0x0D,
+  0x1B, 0xFC, 0x8C, 0x5B, 0xF6, 0x18, 0x9F, 0xC9, 0xC3, 0xCF, 0xDB, 0xFE, 0x94, 0xDA, 0xF5, 0x10, 0x33, 0xD0, 0xD0, 0xB9, 0x63, 0x7B, 0x91, 0xEF, 0xFD, 0x9A,
+  0xE3, 0xF0, 0x79, 0x1B, 0xA2, 0x0C, 0x7F, 0xE1, 0x91, 0x7B, 0xE7, 0xE7, 0x04, 0xBD, 0xEE, 0xC8, 0xD9, 0xB9, 0xA3, 0x61, 0xBC, 0x5C, 0x93, 0xC4, 0x1E, 0xFC,
+  0x02, 0xF6, 0x4A, 0x39, 0xA5, 0xFD, 0x86, 0x50, 0x2B, 0x76, 0x4C, 0x78, 0x50, 0x01, 0x4D, 0x5B, 0xBD, 0x11, 0x45, 0xB0, 0x6E, 0xE8, 0xBE, 0xDE, 0x88, 0x9E,
+  0xD7, 0x0B, 0xAD, 0x02, 0x26, 0x4D, 0xC2, 0x5E, 0xA9, 0x87, 0x07, 0xDF, 0x34, 0xDA, 0x40, 0x43, 0xE8, 0x6F, 0x50, 0x9B, 0xBA, 0x6E, 0xFC, 0x43, 0xC6, 0x50,
+  0xBB, 0xD5, 0x6D, 0x12, 0x7C, 0x13, 0xAD, 0xAB, 0x20, 0xB9, 0x27, 0x9F, 0x49, 0xA2, 0xE5, 0x83, 0x4D, 0x01, 0xC9, 0xC1, 0xDD, 0x44, 0x58, 0x04, 0x06, 0xF1,
+  0x0D, 0x9D, 0x00, 0xC5, 0x26, 0x4D, 0x11, 0xD5, 0x37, 0x59, 0x48, 0xDF, 0xE4, 0x96, 0x5A, 0xE1, 0xDA, 0xC1, 0x01, 0xD8, 0x19, 0xB0, 0x94, 0x14, 0xA4, 0x62,
+  0x52, 0xAF, 0x89, 0x59, 0x55, 0x90, 0xA8, 0x5A, 0x67, 0x55, 0xDB, 0x07, 0x00, 0x6D, 0xDF, 0xB9, 0xF2, 0x5D, 0xD3, 0x9E, 0x40, 0x3C, 0xD4, 0x08, 0xA1, 0xB1,
+  0xD7, 0x08, 0x32, 0xF6, 0x9E, 0x3D, 0x67, 0x8D, 0xC4, 0x5F, 0xD4, 0xC5, 0xF3, 0xFD, 0x5A, 0xA3, 0x26, 0x90, 0x67, 0xF7, 0x20, 0x6E, 0x75, 0x7E, 0x71, 0x9F,
+  0xE1, 0xD8, 0x20, 0x67, 0x67, 0xA2, 0x19, 0x5E, 0x0A, 0x1F, 0x42, 0x21, 0xF6, 0x13, 0x7B, 0x15, 0x88, 0xE2, 0xA7, 0xEF, 0xBF, 0x48, 0x99, 0xBD, 0x39, 0x00,
+  0xAC, 0x1F, 0x61, 0x5A, 0xE3, 0xFB, 0x2F, 0xF0, 0xEF, 0xCD, 0x7D, 0x96, 0xCB, 0xF8, 0xFE, 0x0B, 0xFE, 0xDC, 0xDC, 0x87, 0x96, 0xE0, 0x9A, 0xB5, 0x77, 0xF3,
+  0x89, 0xD1, 0x21, 0x49, 0xBD, 0x49, 0x26, 0xF5, 0x02, 0xB2, 0x55, 0xC6, 0x69, 0x92, 0x83, 0xD4, 0xA7, 0x50, 0x7F, 0xEB, 0x23, 0xC7, 0x00, 0xF6, 0xF8, 0x20,
+  0xC9, 0x92, 0xE9, 0x16, 0xB0, 0x44, 0x12, 0x2A, 0x38, 0xC0, 0xDA, 0x1C, 0xB3, 0x92, 0x44, 0xA8, 0x4A, 0x28, 0x20, 0xB2, 0xE4, 0x5C, 0x77, 0x3D, 0xFA, 0x93,
+  0xED, 0xD7, 0xFD, 0x88, 0x52, 0x64, 0x50, 0x7C, 0x30, 0x88, 0x74, 0x01, 0xFF, 0x40, 0x3D, 0x28, 0x57, 0x13, 0x4C, 0x0B, 0x84, 0x6D, 0x2F, 0x90, 0xC3, 0x10,
+  0x53, 0xFE, 0x32, 0x43, 0x0E, 0xDF, 0x8D, 0xAC, 0xCF, 0x75, 0x3C, 0x52, 0x37, 0x6E, 0x2A, 0x12, 0x24, 0xC2, 0x42, 0x8F, 0xF0, 0x1F, 0xA0, 0x0B, 0xFE, 0x64,
+  0xF2, 0x07, 0xA0, 0xF2, 0xB8, 0xA2, 0xCE, 0xF2, 0x12, 0x1F, 0x57, 0x4D, 0xC2, 0x2F, 0xD6, 0xA0, 0x19, 0xB6, 0x81, 0xF7, 0xF8, 0xB3, 0x96, 0xDC, 0xC3, 0x07,
+  0xE2, 0x0A, 0x9E, 0x31, 0x47, 0x1A, 0x1F, 0xF1, 0x0B, 0x2C, 0xC5, 0x1C, 0x1F, 0x56, 0x8A, 0x5F, 0xC1, 0x33, 0x3C, 0x5E, 0x0A, 0x64, 0xB7, 0x49, 0x86, 0xA6,
+  0x6D, 0xB3, 0x8B, 0x02, 0xEC, 0x43, 0xFF, 0xE3, 0x91, 0xB7, 0x82, 0x1E, 0x08, 0xD4, 0x6E, 0xEE, 0x7B, 0xEB, 0xE0, 0x6E, 0x7D, 0x73, 0x9F, 0xE2, 0x3B, 0x86,
+  0x24, 0x5C, 0xAF, 0xC5, 0x35, 0x3C, 0x07, 0xFC, 0xF0, 0x8D, 0x44, 0x98, 0x3D, 0x58, 0x87, 0x0F, 0xA0, 0x84, 0x8F, 0xEF, 0x05, 0xF2, 0x70, 0xB7, 0x0E, 0xEE,
+  0xB0, 0x36, 0xAB, 0x2B, 0xBA, 0x01, 0xB7, 0xEB, 0xF0, 0x16, 0xDE, 0xB2, 0xA3, 0xB2, 0x10, 0x09, 0xDE, 0xA7, 0x9B, 0xFB, 0xA2, 0x4F, 0xF0, 0x48, 0x5C, 0xC5,
+  0x49, 0x8D, 0x36, 0xC1, 0x17, 0x56, 0xE4, 0x09, 0xF7, 0x1C, 0x94, 0xF1, 0x03, 0xF4, 0xE3, 0xD2, 0xA2, 0x78, 0xF9, 0x64, 0xFD, 0x93, 0x51, 0xAF, 0x89, 0x59,
+  0xE2, 0x1A, 0xDA, 0x30, 0xB5, 0x4E, 0xDB, 0xB1, 0x47, 0x96, 0x39, 0x42, 0x45, 0xA9, 0x37, 0xC8, 0xF9, 0x40, 0xD8, 0x31, 0x14, 0x68, 0x28, 0xAE, 0x0A, 0x69,
+  0x26, 0x68, 0x39, 0xCF, 0x59, 0x6B, 0xB4, 0x99, 0x1C, 0x0A, 0x59, 0x43, 0x10, 0x42, 0x05, 0xCB, 0xC1, 0xC0, 0xC2, 0x29, 0x30, 0x12, 0xDA, 0x92, 0x0B, 0x84,
+  0x95, 0x56, 0xA0, 0x30, 0x30, 0xAA, 0xA9, 0xED, 0xC4, 0xAC, 0x6C, 0x8E, 0x56, 0x4B, 0x05, 0xBE, 0x17, 0x57, 0x60, 0x60, 0x95, 0xEB, 0xD7, 0x6B, 0x97, 0xB8,
+  0xE7, 0xE4, 0x7D, 0x6D, 0x1F, 0x0B, 0xED, 0xD7, 0x3E, 0x9C, 0x92, 0xDA, 0xBE, 0xAA, 0xC9, 0x37, 0x71, 0x95, 0xE3, 0x1C, 0x9B, 0x94, 0xE4, 0xD8, 0x44, 0xE1,
+  0xD8, 0xE4, 0x76, 0x39, 0xA6, 0xCE, 0x4E, 0x6F, 0xC3, 0x35, 0x75, 0x3A, 0x38, 0x87, 0x73, 0x85, 0xF5, 0x05, 0xD3, 0x04, 0xB7, 0x26, 0x69, 0xDC, 0xDA, 0x84,
+  0x4D, 0x7C, 0x88, 0x03, 0xED, 0xA1, 0xEE, 0xF3, 0x5F, 0x5E, 0xBE, 0x40, 0x53, 0x99, 0xCE, 0xB2, 0x80, 0x63, 0x71, 0x77, 0x24, 0x05, 0x02, 0x8E, 0x9D, 0x11,
+  0xC3, 0x1D, 0x19, 0x43, 0xF7, 0x6B, 0xA4, 0xCE, 0x40, 0xE2, 0x08, 0x5A, 0x20, 0x08, 0xC2, 0xF0, 0x96, 0xD3, 0x5D, 0x34, 0xB6, 0x52, 0x79, 0xC3, 0x5A, 0x39,
+  0xB2, 0x80, 0x15, 0x4A, 0x31, 0x91, 0x43, 0x4E, 0x28, 0x8C, 0x32, 0x26, 0xEC, 0x5C, 0x45, 0x98, 0xBE, 0x7A, 0x65, 0x8D, 0x9A, 0xB4, 0xE9, 0xA1, 0x6D, 0xF3,
+  0x0A, 0xA9, 0x23, 0x2C, 0x7F, 0x29, 0x02, 0x89, 0xC4, 0x7A, 0x8A, 0x80, 0xCB, 0x91, 0xA0, 0x14, 0x18, 0x99, 0x4F, 0xCD, 0x86, 0xB3, 0xAE, 0x02, 0x67, 0x9D,
+  0x02, 0x47, 0x8C, 0x3C, 0xA5, 0xC0, 0x88, 0xEC, 0x5B, 0x26, 0x94, 0x75, 0x05, 0x28, 0x69, 0xB8, 0xC8, 0x91, 0xAE, 0x5C, 0x9F, 0x44, 0xA6, 0x26, 0x1B, 0xCE,
+  0xBA, 0x0A, 0x9C, 0x75, 0x8A, 0x3C, 0xC7, 0xBD, 0x91, 0x8E, 0xFC, 0x6F, 0x73, 0xFF, 0x63, 0xAC, 0x83, 0xB5, 0x08, 0x7F, 0xEE, 0x44, 0x4B, 0x26, 0x6F, 0xA5,
+  0xB7, 0x48, 0xAD, 0xD4, 0xD1, 0x80, 0x5A, 0x6D, 0xDD, 0x07, 0xFB, 0x34, 0x5C, 0xF8, 0xD4, 0x6B, 0xA3, 0x87, 0x1B, 0x90, 0x31, 0xF1, 0xAA, 0x6D, 0x03, 0x02,
+  0x0C, 0x60, 0xE3, 0xB4, 0x13, 0x17, 0xCF, 0x04, 0x2C, 0xFE, 0x38, 0x0B, 0x1C, 0x7F, 0x9B, 0x01, 0x51, 0x8C, 0x30, 0xD1, 0x1A, 0xF8, 0x30, 0x0B, 0x1A, 0x8B,
+  0x62, 0x14, 0x58, 0xBD, 0xA3, 0xA3, 0xE4, 0x38, 0x23, 0x1A, 0x10, 0x5F, 0xEE, 0x43, 0x08, 0x98, 0x24, 0x0B, 0x43, 0xB3, 0x11, 0x38, 0x82, 0xA4, 0x26, 0xE7,
+  0x11, 0x6B, 0xA7, 0x09, 0x8F, 0x1B, 0x6A, 0x88, 0x99, 0x41, 0xF2, 0x88, 0xE3, 0x18, 0xF9, 0x1E, 0xCD, 0x10, 0x82, 0xEF, 0xE0, 0xB3, 0x73, 0x1C, 0x18, 0xDB,
+  0xC3, 0x13, 0x40, 0xE2, 0xCF, 0x30, 0x70, 0x8D, 0x3D, 0xE2, 0x13, 0x4E, 0x2D, 0xC7, 0xA6, 0xE9, 0xAD, 0x46, 0xFC, 0x77, 0xD1, 0x90, 0xB8, 0x13, 0x1B, 0x23,
+  0xC2, 0x6A, 0x2E, 0xF5, 0x17, 0xAE, 0x2D, 0xFC, 0xF9, 0xA4, 0x7F, 0x93, 0x1A, 0x4A, 0xEE, 0x50, 0x36, 0x0F, 0x0E, 0xC8, 0x63, 0xDF, 0xD7, 0x81, 0x01, 0x38,
+  0x79, 0x3A, 0x45, 0xFA, 0x10, 0x5D, 0x24, 0x25, 0x1C, 0x17, 0x85, 0x92, 0xAF, 0x74, 0xA6, 0x5C, 0x6F, 0xF1, 0x2B, 0x7D, 0x52, 0x9D, 0x19, 0xA8, 0xF6, 0x3F,
+  0x16, 0xD4, 0x5D, 0x5F, 0x31, 0x82, 0x39, 0xEE, 0x63, 0xCB, 0xAA, 0xD7, 0xDA, 0xE1, 0x5C, 0x78, 0x8D, 0xC7, 0xE0, 0x6D, 0x00, 0x75, 0x09, 0x6D, 0x00, 0x8F,
+  0x43, 0x99, 0x97, 0xB9, 0x0A, 0xC1, 0x77, 0x88, 0xBB, 0xCE, 0x05, 0x33, 0xE2, 0x41, 0x3F, 0x94, 0x70, 0xEC, 0xCF, 0x74, 0xBD, 0x98, 0x03, 0xF9, 0xC3, 0x30,
+  0xBE, 0x91, 0xFC, 0x10, 0x10, 0x50, 0x87, 0xB6, 0xA1, 0xE4, 0x85, 0x08, 0xE4, 0xBA, 0x87, 0x29, 0x85, 0x42, 0x16, 0x30, 0xE9, 0x44, 0x4D, 0x4C, 0x7E, 0xC4,
+  0xE8, 0x66, 0x2F, 0xFD, 0x2E, 0x25, 0x05, 0x22, 0x10, 0x14, 0xC4, 0x93, 0x83, 0x57, 0xAC, 0x85, 0x58, 0x7A, 0xE2, 0xA6, 0xB1, 0x17, 0x5A, 0x86, 0xC5, 0xDC,
+  0xD0, 0x7D, 0x1A, 0x35, 0x0E, 0x81, 0x2C, 0xC8, 0x97, 0x33, 0xC7, 0xA7, 0x31, 0x8B, 0x61, 0xE2, 0xBE, 0x20, 0xDD, 0x7A, 0x1B, 0x4A, 0xE3, 0x57, 0x55, 0xFF,
+  0xFA, 0x56, 0xFA, 0x9F, 0xC8, 0x41, 0x94, 0x8B, 0x9B, 0x13, 0x12, 0x12, 0xD8, 0x83, 0x50, 0x4A, 0x54, 0x3A, 0x44, 0xCC, 0xC2, 0x5E, 0x54, 0x73, 0xEF, 0xDD,
+  0x63, 0x57, 0x7B, 0x01, 0xD3, 0xA4, 0xF5, 0x38, 0x27, 0xE1, 0x8B, 0x18, 0x83, 0x93, 0xB0, 0x63, 0x30, 0x24, 0x70, 0x05, 0x02, 0xD7, 0xAD, 0x80, 0xBD, 0x73,
+  0xF0, 0x36, 0x51, 0x16, 0xFE, 0xDF, 0xEA, 0x7F, 0x43, 0x56, 0xFF, 0xEB, 0x99, 0xF8, 0xF2, 0x59, 0x38, 0x5E, 0x2F, 0x3D, 0x2D, 0xB8, 0x5F, 0x03, 0x6F, 0x27,
+  0x35, 0xEF, 0x27, 0x4C, 0x77, 0x28, 0x5F, 0x53, 0xD3, 0xE0, 0x48, 0x87, 0x92, 0x85, 0x34, 0xC2, 0x8C, 0x3B, 0x26, 0xB8, 0x31, 0xDB, 0x5D, 0xAF, 0xF1, 0xCC,
+  0x3B, 0xB3, 0xC7, 0x37, 0xA1, 0x4B, 0x32, 0x75, 0x96, 0x79, 0x35, 0x5D, 0xB0, 0x3A, 0xD7, 0x34, 0x56, 0x39, 0xA8, 0x2D, 0xF6, 0x18, 0x15, 0x36, 0x2D, 0xF7,
+  0x22, 0x89, 0xC1, 0x00, 0x0A, 0xC8, 0x27, 0x50, 0xD5, 0x77, 0x99, 0xD6, 0x28, 0x60, 0xA9, 0x5D, 0x04, 0x55, 0xA2, 0x95, 0x0B, 0x98, 0xB9, 0x79, 0x51, 0xC8,
+  0xDC, 0x94, 0x56, 0x30, 0xB2, 0xEA, 0x63, 0xA8, 0x11, 0xBD, 0x3D, 0x27, 0xF6, 0xC2, 0xB2, 0x40, 0x06, 0xB1, 0x0B, 0x20, 0x83, 0xEA, 0xDB, 0x54, 0x13, 0xFD,
+  0xEF, 0x6B, 0xCF, 0x02, 0xCC, 0x23, 0x14, 0xB8, 0x7F, 0x3F, 0x0A, 0x0D, 0x27, 0x19, 0xB8, 0x1B, 0x1F, 0xB4, 0xC6, 0xCB, 0x5F, 0x38, 0xF6, 0xD8, 0x9C, 0x84,
+  0xE3, 0xAC, 0x40, 0x09, 0x06, 0xEB, 0x7B, 0x11, 0xC2, 0x2B, 0x3E, 0x0E, 0x20, 0x62, 0x1A, 0x8C, 0x40, 0xEC, 0x50, 0xD8, 0x44, 0x36, 0xF6, 0x11, 0x93, 0xFA,
+  0x3A, 0x15, 0xC7, 0x45, 0x36, 0x80, 0xFE, 0x28, 0xCC, 0xE1, 0x83, 0x68, 0x8A, 0x20, 0x06, 0x71, 0x12, 0x81, 0x88, 0x1D, 0x8B, 0xE1, 0xCD, 0x2C, 0x14, 0xC2,
+  0xC3, 0x83, 0xD3, 0xC4, 0xE1, 0x6D, 0xEA, 0x07, 0x68, 0x59, 0xE3, 0x00, 0x06, 0x0F, 0x77, 0x6B, 0xE4, 0xF9, 0x06, 0xAC, 0x60, 0x06, 0x10, 0xD6, 0x40, 0x12,
+  0x48, 0x2E, 0xE6, 0xF2, 0xE4, 0xEC, 0x14, 0x82, 0x30, 0x70, 0xCB, 0x21, 0x92, 0x82, 0xB5, 0x0A, 0x97, 0x79, 0xA0, 0x62, 0xBB, 0x6E, 0x53, 0x00, 0x72, 0x45,
+  0xAC, 0xF3, 0xDD, 0x86, 0x3C, 0x44, 0x47, 0xE0, 0x42, 0xC7, 0xA2, 0xCF, 0x33, 0x5B, 0x22, 0xB1, 0x0D, 0xFA, 0x89, 0x76, 0x06, 0xA4, 0xD5, 0x95, 0xD8, 0x43,
+  0xD1, 0x67, 0xB8, 0x74, 0x21, 0xE8, 0x43, 0xF0, 0x20, 0xEA, 0xBE, 0x26, 0xD2, 0xD7, 0xAA, 0x9C, 0xF1, 0x41, 0xF6, 0x4B, 0x74, 0xE0, 0xB9, 0xCD, 0x31, 0xA7,
+  0x4B, 0xD4, 0x6F, 0x5B, 0xAA, 0x23, 0xC3, 0x96, 0xC3, 0x4D, 0x0E, 0x4C, 0x3E, 0xD7, 0x1C, 0x07, 0xBA, 0x18, 0xCE, 0x4C, 0x3F, 0x05, 0x60, 0xAD, 0x5B, 0xAB,
+  0x32, 0x72, 0xA9, 0x5A, 0xCE, 0x2D, 0x25, 0x73, 0xEA, 0x01, 0x50, 0x24, 0x1D, 0xCF, 0xBE, 0x05, 0xE3, 0x58, 0x8F, 0xAE, 0x75, 0x17, 0x93, 0xEC, 0xC8, 0xE0,
+  0xD8, 0xE4, 0xCF, 0x9E, 0x32, 0x6B, 0xC9, 0x40, 0x44, 0xE7, 0x2D, 0xE5, 0x5C, 0x61, 0x34, 0x06, 0x50, 0x27, 0xCB, 0x3E, 0xB9, 0x14, 0xEA, 0x79, 0x98, 0xD4,
+  0x20, 0xDF, 0x7F, 0x61, 0x20, 0x6E, 0xC8, 0x18, 0xAC, 0x8C, 0x37, 0xA5, 0x06, 0x9B, 0x92, 0xF0, 0xF1, 0x73, 0xB0, 0x38, 0xE1, 0x13, 0x99, 0xA7, 0xBC, 0xF9,
+  0xD4, 0x50, 0x67, 0xFD, 0x58, 0x5F, 0x0A, 0xC3, 0x14, 0x36, 0xC7, 0x9E, 0x1F, 0xA1, 0x70, 0xC7, 0x3E, 0x25, 0x29, 0x15, 0xE8, 0x36, 0x94, 0x00, 0x6F, 0x08,
+  0x9A, 0x79, 0x05, 0x7E, 0x4F, 0x4C, 0x4C, 0x1B, 0x22, 0xC0, 0x02, 0x0E, 0x18, 0xD2, 0x54, 0x72, 0x1E, 0x61, 0x18, 0xC5, 0xC9, 0x14, 0xA1, 0x30, 0xEF, 0x8C,
+  0xE8, 0x4B, 0xF1, 0x5C, 0xAF, 0xF0, 0x1F, 0x02, 0x5A, 0xFC, 0xEE, 0x41, 0x58, 0xD4, 0xD8, 0x53, 0x26, 0x3F, 0xE3, 0x30, 0xB0, 0x01, 0x05, 0x40, 0x84, 0x44,
+  0x59, 0x64, 0x8A, 0x6E, 0xF5, 0xAF, 0x85, 0x96, 0x2A, 0x33, 0xAA, 0x23, 0xEA, 0x48, 0xCB, 0x86, 0x59, 0xD6, 0xEE, 0x7B, 0x26, 0x32, 0x1F, 0x44, 0x06, 0x46,
+  0xB1, 0x78, 0x8D, 0x2A, 0xE8, 0x24, 0x82, 0xCB, 0x02, 0x54, 0x6E, 0xD1, 0xCD, 0x56, 0xA2, 0x4C, 0x06, 0x0F, 0x9C, 0xD9, 0x44, 0x78, 0xA9, 0xFA, 0x82, 0xE9,
+  0xB1, 0x64, 0x34, 0xDA, 0x53, 0xC8, 0x93, 0xEA, 0x07, 0x66, 0x92, 0x8B, 0x4B, 0x17, 0x57, 0xD7, 0x6B, 0x93, 0x2E, 0x73, 0x13, 0xAF, 0x6C, 0x1D, 0x02, 0xA3,
+  0x57, 0x58, 0xE1, 0x22, 0x58, 0x0C, 0x53, 0x58, 0x33, 0x5C, 0x38, 0xA3, 0xC0, 0x60, 0xAB, 0x62, 0xCA, 0xCD, 0x8B, 0xB0, 0xA2, 0x91, 0xAA, 0x08, 0xB5, 0xB8,
+  0x6E, 0x64, 0x0B, 0xBE, 0x52, 0x5F, 0x1D, 0x7A, 0xF2, 0xEA, 0x2B, 0xBB, 0xE5, 0x95, 0xDA, 0x4C, 0xEF, 0x8B, 0x2B, 0xAB, 0x4B, 0x70, 0x54, 0xDC, 0xF5, 0xEB,
+  0x12, 0x95, 0xC3, 0x75, 0x43, 0x4A, 0x55, 0x39, 0x9A, 0xE5, 0x55, 0x0C, 0x0E, 0xE4, 0xA9, 0x29, 0xFC, 0xC5, 0xE5, 0x38, 0x6F, 0x4B, 0xF1, 0x98, 0xAF, 0xDC,
+  0x51, 0xDA, 0xC4, 0xC0, 0xA3, 0x64, 0x55, 0x3E, 0x2D, 0x14, 0xBA, 0xF7, 0x78, 0xE8, 0x03, 0x3B, 0xBC, 0x22, 0xAF, 0xAE, 0x72, 0x34, 0x44, 0xAC, 0xD5, 0xD2,
+  0xEC, 0x0D, 0xDA, 0x45, 0x45, 0x05, 0x85, 0xF4, 0xBD, 0xC7, 0x43, 0xC7, 0xC5, 0x50, 0x16, 0x1D, 0x6C, 0x25, 0x81, 0xEA, 0x3B, 0x73, 0x7E, 0xFE, 0x42, 0xCC,
+  0x18, 0x2F, 0x59, 0xAE, 0xB8, 0x8D, 0xEF, 0xEB, 0x8D, 0x30, 0x6D, 0x10, 0x82, 0x0A, 0x2D, 0x5E, 0xF8, 0xAC, 0xAD, 0xE3, 0xBF, 0xF5, 0x46, 0xE2, 0x85, 0x6C,
+  0x37, 0xD4, 0x5C, 0x55, 0x5C, 0xA3, 0xB3, 0x4B, 0xEA, 0xA1, 0x10, 0xB5, 0x60, 0x15, 0x43, 0x5A, 0xC9, 0xE0, 0xCC, 0x87, 0x5A, 0x2C, 0x2B, 0x0C, 0x7E, 0x8F,
+  0xE0, 0x8F, 0x6A, 0xBB, 0xDE, 0xA3, 0x86, 0x36, 0x03, 0xC6, 0x37, 0x03, 0x3E, 0x7E, 0x08, 0x4C, 0xDD, 0x35, 0x96, 0xBE, 0x66, 0xCE, 0x1C, 0xB5, 0xA4, 0x07,
+  0x75, 0x1D, 0xB8, 0x4E, 0xD7, 0x0D, 0xDE, 0x35, 0xFE, 0x58, 0xD5, 0xF7, 0x58, 0x18, 0x87, 0x1F, 0xC2, 0xA6, 0xEE, 0xA5, 0x8D, 0x61, 0xC3, 0x70, 0x31, 0x0E,
+  0x71, 0xC0, 0xFC, 0x5F, 0x9D, 0x05, 0x31, 0x2C, 0x6C, 0x87, 0x9F, 0x7D, 0x72, 0x48, 0xCE, 0xB0, 0x50, 0x9B, 0xAF, 0x58, 0x84, 0x67, 0xFB, 0xFB, 0x4A, 0xDC,
+  0x02, 0x44, 0x87, 0x97, 0xEF, 0xCD, 0x0F, 0x0C, 0xAB, 0xEE, 0x21, 0x86, 0x08, 0xEC, 0x01, 0xD4, 0xEC, 0x8A, 0x87, 0x1D, 0xF5, 0x61, 0x2F, 0xAD, 0xE4, 0xA1,
+  0x2C, 0xA9, 0xFA, 0xE3, 0x62, 0xAC, 0x33, 0x13, 0x8E, 0x60, 0xF0, 0xAA, 0xD5, 0x55, 0x72, 0x9A, 0x6F, 0xA0, 0x53, 0x1E, 0xD1, 0xC9, 0x0C, 0x46, 0x2E, 0x13,
+  0x79, 0x2B, 0x98, 0x08, 0xB2, 0xE2, 0x4F, 0xC5, 0xD0, 0x8B, 0x4B, 0x6F, 0xEC, 0xD7, 0xF0, 0xAE, 0xCE, 0x49, 0xE0, 0x35, 0x09, 0x7E, 0x09, 0xBC, 0x41, 0x4C,
+  0xA8, 0xB9, 0xD4, 0x4D, 0x9F, 0x05, 0x5C, 0x00, 0x0C, 0x09, 0x41, 0xAF, 0xD1, 0x23, 0x62, 0x90, 0x4C, 0x9B, 0xB0, 0xAF, 0xD3, 0x07, 0x14, 0xC4, 0xF1, 0x1D,
+  0xE1, 0xA0, 0xA2, 0xE8, 0xDE, 0xDA, 0x1E, 0x11, 0xBE, 0x8E, 0x8B, 0x43, 0x57, 0x04, 0x95, 0x17, 0xD7, 0xA5, 0x94, 0x01, 0xD7, 0x99, 0xC4, 0x5D, 0x70, 0xC7,
+  0xCA, 0xA2, 0xAE, 0x10, 0x47, 0xA9, 0x80, 0x98, 0xC4, 0x75, 0x45, 0x49, 0x5C, 0x8A, 0xF5, 0x94, 0x3F, 0x11, 0xA5, 0x90, 0x35, 0x8C, 0x61, 0xEC, 0xFD, 0xAF,
+  0xE0, 0x63, 0x9F, 0x3C, 0x76, 0x5D, 0x7D, 0x5D, 0xEF, 0xF0, 0xF7, 0x11, 0x91, 0x66, 0x8D, 0xB2, 0xC7, 0x3E, 0xF4, 0x23, 0x70, 0x7C, 0x05, 0xFE, 0xD2, 0x2F,
+  0xE3, 0xFD, 0x0E, 0xD7, 0x9D, 0x35, 0xC9, 0x17, 0xCF, 0x9C, 0xD8, 0xBA, 0x75, 0xCA, 0x01, 0xB4, 0xF9, 0x5D, 0x30, 0x62, 0x87, 0xFD, 0x67, 0x78, 0x06, 0x9E,
+  0x08, 0xD2, 0xB1, 0xCD, 0x26, 0x86, 0xF5, 0x10, 0x5F, 0x21, 0x51, 0x0F, 0x1F, 0x36, 0x62, 0xDE, 0x9F, 0x4F, 0xBE, 0x18, 0xE0, 0x19, 0x8B, 0x68, 0xFC, 0x26,
+  0x40, 0x83, 0xC3, 0x6D, 0xE3, 0x4F, 0xBD, 0x11, 0x09, 0xD7, 0xB0, 0x78, 0x34, 0x5A, 0x53, 0xDD, 0x5C, 0x75, 0xC4, 0xE5, 0xF0, 0x7F, 0x77, 0x40, 0xF0, 0x8D,
+  0x24, 0xA5, 0x42, 0x51, 0x06, 0xB9, 0xE3, 0xA9, 0x16, 0x7E, 0x1B, 0x36, 0xC7, 0xAB, 0xB6, 0x3D, 0xEA, 0x63, 0xE9, 0xD4, 0xE7, 0x22, 0x89, 0x10, 0x02, 0x0B,
+  0x4B, 0x71, 0xFE, 0xF0, 0xB2, 0xC1, 0xC3, 0x14, 0x32, 0x84, 0x23, 0x1B, 0x62, 0x19, 0xA8, 0x64, 0xB4, 0x49, 0x91, 0x3D, 0x80, 0x22, 0x67, 0xA4, 0x13, 0x4F,
+  0x92, 0x47, 0x09, 0x10, 0x75, 0x3A, 0x42, 0x45, 0x47, 0x73, 0xCC, 0x85, 0xA8, 0xCD, 0x7F, 0x19, 0x09, 0x20, 0x90, 0xD0, 0xB9, 0xE4, 0xB0, 0x65, 0x3E, 0x8D,
+  0x46, 0xA2, 0x2E, 0xF4, 0x4B, 0x9D, 0xD1, 0x63, 0x1A, 0xD3, 0x9E, 0xB1, 0x75, 0x75, 0x07, 0x62, 0xE1, 0x64, 0xEB, 0x05, 0xEB, 0xFB, 0x29, 0xA9, 0xFF, 0xB7,
+  0xB1, 0xDF, 0x38, 0x30, 0x1B, 0xE4, 0x5F, 0xFF, 0x22, 0xEF, 0x3F, 0x34, 0xDE, 0x77, 0x3F, 0xC4, 0xBB, 0x60, 0x7A, 0xAF, 0xF4, 0x57, 0x60, 0x5A, 0xEC, 0x46,
+  0xA2, 0x17, 0x8C, 0x5E, 0x11, 0x9C, 0xB0, 0xBF, 0xFB, 0xA4, 0xDF, 0x88, 0xAE, 0x03, 0x84, 0x36, 0x4D, 0x5B, 0x09, 0x99, 0xA2, 0x1D, 0x16, 0x96, 0x48, 0xF2,
+  0xF6, 0x8C, 0x08, 0x20, 0xF0, 0x3F, 0xB6, 0x5A, 0x99, 0x74, 0x28, 0xCF, 0x12, 0x2F, 0x88, 0x06, 0xA8, 0x44, 0xAA, 0x19, 0x03, 0xBC, 0x57, 0xA6, 0x27, 0xC9,
+  0xB2, 0x5C, 0xDC, 0x15, 0x63, 0x24, 0x2C, 0x51, 0x32, 0x29, 0x20, 0xF2, 0x27, 0x6C, 0x45, 0x23, 0x88, 0x42, 0xD4, 0xF6, 0xD2, 0xB6, 0xAD, 0xCF, 0x78, 0x1E,
+  0xA6, 0xC6, 0xF4, 0x9E, 0x4D, 0x06, 0xD5, 0x1A, 0x29, 0xC1, 0x16, 0xC5, 0x37, 0x75, 0x9A, 0x11, 0x57, 0x83, 0xCD, 0xE3, 0x67, 0x57, 0x71, 0xA3, 0x09, 0xCA,
+  0x4F, 0x3E, 0xD3, 0x35, 0xFB, 0x6A, 0x39, 0x8C, 0x49, 0x10, 0x52, 0x00, 0xAE, 0xD6, 0x1A, 0xAF, 0xD8, 0x08, 0xE5, 0xC1, 0x95, 0xEE, 0x8B, 0xD9, 0x23, 0x83,
+  0x78, 0x78, 0xD6, 0x3C, 0x31, 0x7D, 0x20, 0x0E, 0x8C, 0x53, 0x1C, 0x9C, 0x4E, 0xFE, 0xEB, 0xF5, 0xE5, 0x33, 0x6E, 0x3F, 0x99, 0x09, 0xD6, 0x6D, 0xF2, 0xAE,
+  0x85, 0xDE, 0xC5, 0x29, 0x59, 0x35, 0xD7, 0xCD, 0x65, 0x73, 0x2A, 0xA4, 0xBE, 0x09, 0x85, 0xA0, 0x73, 0x14, 0x23, 0x26, 0x88, 0x02, 0xB1, 0x0D, 0xBE, 0x56,
+  0x58, 0xF1, 0x03, 0x00, 0x0A, 0x56, 0x4D, 0x75, 0x06, 0x84, 0x8F, 0xE7, 0xE3, 0x4C, 0xB6, 0x1C, 0x3E, 0xD1, 0x14, 0x31, 0x29, 0x5D, 0xF9, 0xF5, 0x5A, 0x4F,
+  0xE6, 0x0B, 0x03, 0xB3, 0x8D, 0x41, 0x58, 0xB0, 0x54, 0x17, 0xA3, 0x30, 0xBC, 0x7C, 0x84, 0xDF, 0xE7, 0x3A, 0x67, 0xDD, 0xFB, 0xD4, 0x94, 0x66, 0x9D, 0xF3,
+  0xE6, 0xF7, 0x39, 0x9D, 0x44, 0x62, 0xC1, 0xD0, 0x4B, 0x43, 0x64, 0x54, 0xDD, 0x90, 0x7D, 0x64, 0x3A, 0xD1, 0x4C, 0xFC, 0x1B, 0x6A, 0x89, 0x90, 0xAB, 0x6E,
+  0x03, 0x6A, 0xCE, 0xEB, 0xAF, 0x16, 0xB3, 0x21, 0x1F, 0xA8, 0x25, 0x6F, 0x11, 0xB8, 0x14, 0x67, 0x64, 0x70, 0x3F, 0x39, 0x38, 0xC6, 0xD6, 0x13, 0x62, 0x2D,
+  0x68, 0xFF, 0xAF, 0x82, 0x71, 0xA7, 0xA4, 0x7B, 0x60, 0xB6, 0x21, 0xB8, 0xE1, 0x12, 0xD6, 0xC0, 0x11, 0xB7, 0x1E, 0x10, 0x88, 0xED, 0x1C, 0x65, 0x80, 0xF1,
+  0xD1, 0x7B, 0x18, 0x97, 0x01, 0xAD, 0xE0, 0xED, 0x94, 0x1D, 0xDD, 0x14, 0xBE, 0x3E, 0xFC, 0x10, 0x51, 0xDC, 0x18, 0x94, 0x00, 0x46, 0xB2, 0x80, 0x00, 0x14,
+  0x80, 0x89, 0x2F, 0x81, 0xF4, 0x57, 0x6D, 0xC3, 0xD5, 0x97, 0x3F, 0xE1, 0x6A, 0xFD, 0x3A, 0xD7, 0x8A, 0x11, 0x30, 0xC3, 0xA7, 0xEC, 0xC9, 0x13, 0xD3, 0x47,
+  0xE2, 0xA0, 0x0D, 0x7F, 0x62, 0x39, 0xC3, 0xFA, 0x7B, 0x64, 0x04, 0x04, 0x48, 0x5F, 0x30, 0x9B, 0x73, 0x4A, 0x6A, 0x6C, 0x91, 0xFF, 0x01, 0x3E, 0xAC, 0xDD,
+  0x34, 0x1A, 0xDC, 0x7B, 0x7A, 0xDF, 0xF9, 0x20, 0x2E, 0xA4, 0x19, 0x0A, 0x33, 0x04, 0x20, 0x97, 0x2F, 0x1D, 0x16, 0x18, 0xB3, 0x69, 0x84, 0xB1, 0xEB, 0xCC,
+  0xC8, 0x01, 0x5E, 0x9E, 0x92, 0xD7, 0xFA, 0xE8, 0x33, 0x34, 0xE7, 0x11, 0x07, 0xC6, 0x7D, 0x90, 0x76, 0x4A, 0x86, 0x80, 0xCB, 0x1C, 0xAE, 0xE7, 0xE6, 0x0A,
+  0x43, 0xB6, 0x97, 0x57, 0x4F, 0xC8, 0xD8, 0x74, 0x3D, 0x3F, 0xF4, 0x97, 0x01, 0xF1, 0x97, 0x62, 0xA6, 0x0C, 0x17, 0x37, 0x37, 0x09, 0xB8, 0x6D, 0x53, 0x45,
+  0x4E, 0x90, 0x21, 0xD2, 0x8D, 0x53, 0x08, 0xBE, 0x44, 0x52, 0x07, 0xCF, 0x15, 0x52, 0x4F, 0x43, 0x1A, 0xC7, 0xAA, 0x41, 0xA5, 0xF8, 0x8B, 0x80, 0xB2, 0x53,
+  0xC5, 0x33, 0x52, 0x75, 0x21, 0x28, 0x99, 0xAA, 0x0B, 0xBC, 0x24, 0xEE, 0x22, 0x38, 0x67, 0x5C, 0x50, 0xA8, 0xFE, 0x14, 0xFA, 0x52, 0x67, 0x5D, 0x09, 0xBD,
+  0x0E, 0x13, 0x5B, 0xEA, 0x28, 0x35, 0x71, 0xC3, 0xCB, 0x39, 0xB9, 0x56, 0x95, 0x22, 0x70, 0x1F, 0x87, 0xF0, 0xE6, 0xC1, 0x43, 0xF8, 0x19, 0x40, 0x1D, 0xE6,
+  0xE8, 0x41, 0xF5, 0x33, 0xE8, 0xF7, 0x9F, 0x09, 0x78, 0x90, 0xC3, 0x56, 0x0B, 0x57, 0x84, 0xFA, 0xAA, 0x23, 0x29, 0xA1, 0xB2, 0xF0, 0x01, 0x1C, 0xDD, 0xC1,
+  0x80, 0x0C, 0x41, 0x60, 0x09, 0x26, 0x0A, 0x7B, 0x47, 0x47, 0x91, 0xFC, 0x1B, 0xE0, 0xDC, 0x46, 0x72, 0xBF, 0x47, 0xA8, 0x7F, 0x26, 0x7D, 0x70, 0x1E, 0x13,
+  0xCF, 0x84, 0xFB, 0x99, 0xF6, 0x1C, 0x3D, 0x50, 0x68, 0x27, 0x13, 0x9C, 0xF0, 0x47, 0xB1, 0xD9, 0x14, 0xD7, 0x33, 0xE9, 0x22, 0x9F, 0xB1, 0x85, 0xED, 0x52,
+  0x53, 0x63, 0x9D, 0x6D, 0xC4, 0x2C, 0x06, 0x8B, 0x8E, 0xB0, 0x31, 0xF0, 0x98, 0xCF, 0x48, 0xB7, 0x77, 0x02, 0xFD, 0x93, 0xF7, 0xA7, 0xC1, 0x55, 0x0B, 0x1A,
+  0x3F, 0x96, 0x4A, 0xBD, 0xBF, 0xAF, 0xA8, 0xB7, 0xCD, 0x48, 0xAA, 0xD2, 0x2D, 0x40, 0xE8, 0x33, 0x47, 0xE8, 0x33, 0x39, 0x03, 0xA7, 0x07, 0x7E, 0xA3, 0xE4,
+  0x25, 0xC8, 0xB0, 0x3A, 0x6F, 0x60, 0x7F, 0xFF, 0x43, 0x4E, 0xF6, 0x19, 0x1B, 0x41, 0x61, 0x6C, 0x01, 0x76, 0x05, 0x0D, 0x01, 0x7B, 0x5A, 0x05, 0x6D, 0xA5,
+  0xB4, 0xA4, 0xF6, 0x49, 0x25, 0x2D, 0x4A, 0x21, 0x54, 0x0C, 0x45, 0x10, 0x38, 0xC3, 0xD7, 0x00, 0xC5, 0xE2, 0x17, 0x36, 0x1C, 0x48, 0xC5, 0x53, 0xD4, 0x4D,
+  0x46, 0x56, 0x81, 0xCE, 0x35, 0x72, 0x03, 0xB4, 0x2B, 0x88, 0x1E, 0x83, 0x00, 0x2D, 0x36, 0x38, 0x84, 0x19, 0x3A, 0x36, 0xFD, 0xC9, 0x07, 0x88, 0xF3, 0x2E,
+  0x8C, 0x0B, 0x62, 0x44, 0x60, 0x9B, 0x19, 0x92, 0x23, 0xC2, 0x32, 0xD3, 0x67, 0x7A, 0xD7, 0xFA, 0x8D, 0xED, 0xD5, 0xCF, 0x71, 0x96, 0x84, 0xD3, 0x96, 0x03,
+  0xE2, 0xB9, 0x38, 0x51, 0x2F, 0x1B, 0x06, 0xF2, 0x6F, 0x89, 0x52, 0x38, 0x55, 0x39, 0x22, 0x2D, 0x95, 0x6A, 0xA6, 0xE2, 0x99, 0xCB, 0x24, 0x89, 0x53, 0x47,
+  0x5B, 0xE6, 0x8C, 0x07, 0x89, 0x02, 0x99, 0x24, 0x0F, 0x1B, 0x0B, 0x98, 0x20, 0x87, 0x00, 0xD9, 0x50, 0x6C, 0x10, 0x97, 0x69, 0xCB, 0xE8, 0x0C, 0x4A, 0x50,
+  0xFB, 0x5A, 0xA9, 0x89, 0xD7, 0x6D, 0xCF, 0x1D, 0xF1, 0xF4, 0x74, 0x62, 0xDC, 0xFE, 0x54, 0x32, 0x70, 0x07, 0x6E, 0x87, 0x71, 0x7B, 0x6C, 0x29, 0x0C, 0xCF,
+  0x2F, 0x7A, 0x98, 0x85, 0x16, 0xA7, 0x4F, 0xE2, 0x52, 0xC5, 0x30, 0xDF, 0x95, 0x91, 0x14, 0x0E, 0x13, 0x14, 0xF5, 0xC6, 0x5E, 0x06, 0xFE, 0x51, 0xEC, 0x95,
+  0xE4, 0x3A, 0xDF, 0x35, 0xF6, 0xE8, 0xE3, 0x68, 0x78, 0xFE, 0xFD, 0x17, 0x10, 0x78, 0x70, 0xE6, 0x20, 0x70, 0x6F, 0xDC, 0x7C, 0x2A, 0x8C, 0xE2, 0xC3, 0x74,
+  0x56, 0x59, 0xBC, 0x78, 0x82, 0x20, 0x15, 0x5A, 0x84, 0x64, 0xE9, 0xE0, 0xD4, 0x1C, 0xDE, 0xA5, 0x2D, 0xE7, 0x5B, 0xB3, 0x68, 0x7D, 0x9E, 0xA4, 0x76, 0x0A,
+  0x46, 0x28, 0x47, 0xF7, 0x22, 0x20, 0x15, 0x19, 0x0A, 0xA5, 0x4F, 0x8A, 0x89, 0xC4, 0x56, 0x51, 0xE6, 0x3C, 0x5C, 0xB1, 0x58, 0x88, 0x69, 0xBA, 0x05, 0x38,
+  0x4F, 0xDA, 0x80, 0x74, 0x2C, 0x15, 0x60, 0x31, 0x1C, 0x99, 0x4E, 0xC5, 0x30, 0x54, 0x53, 0x95, 0x19, 0x38, 0x46, 0x27, 0x49, 0x63, 0xB3, 0x6A, 0x9C, 0x29,
+  0x41, 0xCE, 0x31, 0x03, 0x04, 0xDB, 0x6C, 0xE6, 0x2C, 0xDC, 0x11, 0x3A, 0xA0, 0x79, 0xB9, 0x23, 0x13, 0x62, 0x4A, 0x36, 0x4A, 0xDF, 0xBB, 0x56, 0x26, 0xD4,
+  0x45, 0x7A, 0xD7, 0x0B, 0x67, 0xFA, 0x99, 0x2D, 0x41, 0x38, 0x0F, 0x03, 0xF8, 0x62, 0x6B, 0x9F, 0x92, 0xCF, 0xE3, 0x4E, 0x82, 0x48, 0xE9, 0xD5, 0x35, 0x5E,
+  0x40, 0x13, 0x19, 0x38, 0x7E, 0x17, 0x38, 0x2C, 0x1C, 0x3B, 0x7E, 0x1B, 0x29, 0x10, 0x38, 0x2E, 0xA2, 0x04, 0xBF, 0xE7, 0x45, 0x82, 0x96, 0x58, 0x3E, 0x41,
+  0x9F, 0xCF, 0x21, 0x82, 0xBA, 0x98, 0x9A, 0x96, 0x51, 0xE7, 0x95, 0x1B, 0x0A, 0x76, 0xDC, 0xA5, 0x41, 0xF7, 0x85, 0xC3, 0x8D, 0xBB, 0x39, 0x0F, 0xA5, 0x3C,
+  0xE0, 0x23, 0xC5, 0xCB, 0xE4, 0xCD, 0x36, 0x3B, 0xCD, 0x8E, 0x28, 0xA2, 0xE6, 0x47, 0x10, 0x32, 0x1A, 0xC9, 0x5F, 0xDF, 0xBC, 0x08, 0x21, 0xFB, 0xCE, 0x53,
+  0xFE, 0xA8, 0xAE, 0x7A, 0x9C, 0xC1, 0x1A, 0x32, 0x85, 0x59, 0xB8, 0x63, 0x54, 0x0C, 0xF1, 0x50, 0xFC, 0xA1, 0x0A, 0x54, 0xE4, 0x22, 0x50, 0xD1, 0xEB, 0x69,
+  0x55, 0xE5, 0x7E, 0x52, 0xAC, 0x8E, 0x7D, 0xF9, 0x71, 0x61, 0x59, 0x7F, 0xA7, 0xBA, 0x0B, 0x5C, 0xDF, 0x27, 0x75, 0xAD, 0xA3, 0xED, 0xD7, 0xD9, 0xF3, 0x97,
+  0xD0, 0xA1, 0x69, 0xBD, 0xB1, 0xDF, 0x6D, 0xC8, 0x10, 0xA2, 0xD5, 0x93, 0x45, 0xE0, 0x87, 0x95, 0xE1, 0x8D, 0x64, 0xBF, 0x7F, 0x0E, 0x24, 0xF0, 0xF2, 0x0A,
+  0xBC, 0x84, 0x50, 0x1B, 0x22, 0x87, 0xBC, 0x22, 0x57, 0x14, 0x48, 0x6B, 0x24, 0x8A, 0x68, 0x6C, 0x1B, 0xEC, 0xC3, 0xCC, 0xB0, 0x35, 0x1E, 0x8F, 0xAA, 0x8B,
+  0x68, 0x04, 0xB9, 0xC3, 0xE9, 0x35, 0xB1, 0xF0, 0x23, 0x21, 0x01, 0x31, 0xEB, 0x2D, 0x26, 0xAC, 0x12, 0x0B, 0x1A, 0xCB, 0xCC, 0x09, 0xA6, 0x4E, 0x76, 0xE5,
+  0x4E, 0x0E, 0x46, 0x57, 0xFD, 0xC5, 0x17, 0x3C, 0x44, 0x27, 0x02, 0x2F, 0x16, 0x60, 0x52, 0x66, 0x72, 0x78, 0xE1, 0xCF, 0x70, 0xF6, 0x3F, 0x18, 0x68, 0xF5,
+  0xC9, 0x28, 0x2F, 0x61, 0x0E, 0xAF, 0x95, 0x24, 0xBB, 0x58, 0x3A, 0x50, 0x50, 0x41, 0xF9, 0xA6, 0xA0, 0x52, 0x57, 0x59, 0x92, 0x90, 0x3B, 0x79, 0x13, 0xFF,
+  0x0A, 0x1E, 0x03, 0x01, 0x50, 0x93, 0x3D, 0x4F, 0xB1, 0x65, 0x50, 0x2E, 0xB4, 0x9B, 0x58, 0x29, 0xD5, 0x3D, 0x48, 0x5B, 0x1E, 0x91, 0x5C, 0x5F, 0x11, 0xF3,
+  0x0C, 0xB2, 0xD6, 0x55, 0x24, 0xD7, 0x54, 0xA8, 0x49, 0x0D, 0xF9, 0x75, 0xD1, 0x90, 0x84, 0x34, 0x9F, 0xDE, 0x54, 0xA5, 0xB7, 0x5C, 0x5B, 0x52, 0x50, 0x43,
+  0xFD, 0x08, 0x2A, 0x27, 0x17, 0x2D, 0x49, 0x2E, 0x2A, 0xC8, 0x85, 0x15, 0xC2, 0xE5, 0x06, 0xC5, 0x0B, 0x5D, 0x02, 0xF9, 0xFF, 0xED, 0x49, 0xD8, 0xB3, 0xE5,
+  0x30, 0x17, 0x4F, 0xB1, 0x90, 0x44, 0xE9, 0x5E, 0x7E, 0x85, 0xC8, 0x97, 0xD2, 0x79, 0xB7, 0x96, 0xC3, 0x72, 0xDD, 0x92, 0x0B, 0x51, 0xB0, 0x42, 0xD8, 0xAD,
+  0xF4, 0xE5, 0x2A, 0x61, 0xFA, 0x49, 0x7C, 0xB5, 0x80, 0xE8, 0xB6, 0x41, 0x58, 0x02, 0x03, 0x4F, 0x46, 0x50, 0x26, 0xA7, 0xF0, 0x7D, 0xE1, 0xDC, 0x1F, 0x2F,
+  0xA6, 0x74, 0x32, 0x58, 0xF0, 0x52, 0x58, 0x35, 0x28, 0xA9, 0xD4, 0x0E, 0xF0, 0xC8, 0xAD, 0x2D, 0x0B, 0xF1, 0x19, 0xBC, 0xE0, 0xB6, 0x14, 0xB1, 0x82, 0xD2,
+  0xA1, 0xE2, 0x84, 0x00, 0xE4, 0x82, 0x99, 0xA3, 0xF8, 0x02, 0x2B, 0x3E, 0x93, 0xCC, 0x3B, 0x1B, 0x9B, 0x2F, 0x56, 0x0B, 0x04, 0x5D, 0x8A, 0x94, 0x09, 0x14,
+  0x84, 0xD7, 0xCF, 0x42, 0xB3, 0x10, 0x15, 0xBE, 0x00, 0x5D, 0x7B, 0x6D, 0x51, 0x5C, 0x9C, 0x22, 0x4E, 0xBA, 0xC2, 0x53, 0xAA, 0x20, 0x52, 0xB4, 0x9C, 0x25,
+  0xC5, 0xC5, 0xE4, 0x72, 0xEF, 0x0F, 0x19, 0x52, 0xB0, 0xA9, 0x94, 0x2F, 0x31, 0x42, 0x1B, 0xE4, 0x4F, 0x4D, 0x8F, 0x8C, 0xC1, 0x9D, 0x00, 0x91, 0xBE, 0xA7,
+  0x05, 0x03, 0x62, 0x61, 0xF7, 0x92, 0x4B, 0x2F, 0x23, 0xE4, 0xE4, 0x75, 0x14, 0xE7, 0x4D, 0xF4, 0x31, 0x61, 0x88, 0xF2, 0x16, 0x35, 0x55, 0x20, 0x61, 0xF0,
+  0xFA, 0x9B, 0xA5, 0x62, 0x7A, 0x07, 0x0A, 0x09, 0x19, 0x54, 0x0B, 0x69, 0x19, 0xF6, 0x35, 0x41, 0xCD, 0xB4, 0x95, 0x63, 0x39, 0x1C, 0xC5, 0x05, 0x94, 0xA9,
+  0x56, 0x3E, 0x9B, 0x2B, 0x9C, 0xE2, 0x7C, 0x60, 0x0D, 0x0E, 0x7E, 0x10, 0xC7, 0x3C, 0xF0, 0x3B, 0x74, 0x19, 0x07, 0x7B, 0x67, 0x07, 0x53, 0x7F, 0x66, 0x0D,
+  0xF6, 0xFE, 0x0F, 0xD9, 0xAD, 0xA5, 0x7C, 0xE1, 0xBF, 0x00, 0x00
 };
 
-//File: index_ov3660.html.gz, Size: 8887
-#define index_ov3660_html_gz_len 8887
+//File: index_ov3660.html.gz, Size: 10200
+#define index_ov3660_html_gz_len 10200
 const uint8_t index_ov3660_html_gz[] = {
-  0x1F, 0x8B, 0x08, 0x08, 0xA3, 0xFA, 0x69, 0x5E, 0x00, 0x03, 0x69, 0x6E, 0x64, 0x65, 0x78, 0x5F, 0x6F, 0x76, 0x33, 0x36, 0x36, 0x30, 0x2E, 0x68, 0x74, 0x6D,
-  0x6C, 0x00, 0xED, 0x3D, 0x69, 0x73, 0xDB, 0x46, 0xB2, 0xDF, 0xFD, 0x2B, 0x60, 0x24, 0x6B, 0x51, 0x65, 0x91, 0xE2, 0xAD, 0x23, 0x12, 0xFD, 0x6C, 0x59, 0xB1,
-  0x53, 0x1B, 0x67, 0xBD, 0x71, 0xE2, 0x24, 0xB5, 0xB5, 0xE5, 0x80, 0xC4, 0x90, 0x44, 0x0C, 0x02, 0x5C, 0x00, 0xD4, 0x91, 0x94, 0x7E, 0xC7, 0xFB, 0x41, 0xEF,
-  0x8F, 0xBD, 0xEE, 0x39, 0x70, 0x71, 0x00, 0x0C, 0x00, 0x11, 0x52, 0xF2, 0x1E, 0x5D, 0x65, 0xE1, 0x98, 0xEE, 0xE9, 0x7B, 0x7A, 0x7A, 0x06, 0xC0, 0xD9, 0x53,
-  0xD3, 0x9D, 0x05, 0xB7, 0x6B, 0xA2, 0x2D, 0x83, 0x95, 0x3D, 0x79, 0x72, 0xC6, 0xFE, 0x68, 0xF0, 0x3B, 0x5B, 0x12, 0xC3, 0x64, 0x87, 0xF4, 0x74, 0x45, 0x02,
-  0x43, 0x9B, 0x2D, 0x0D, 0xCF, 0x27, 0xC1, 0xB9, 0xBE, 0x09, 0xE6, 0xED, 0x63, 0x3D, 0x7D, 0xDB, 0x31, 0x56, 0xE4, 0x5C, 0xBF, 0xB2, 0xC8, 0xF5, 0xDA, 0xF5,
-  0x02, 0x5D, 0x9B, 0xB9, 0x4E, 0x40, 0x1C, 0x68, 0x7E, 0x6D, 0x99, 0xC1, 0xF2, 0xDC, 0x24, 0x57, 0xD6, 0x8C, 0xB4, 0xE9, 0xC9, 0x81, 0xE5, 0x58, 0x81, 0x65,
-  0xD8, 0x6D, 0x7F, 0x66, 0xD8, 0xE4, 0xBC, 0x17, 0xC7, 0x15, 0x58, 0x81, 0x4D, 0x26, 0x97, 0x1F, 0xDE, 0x0F, 0xFA, 0xDA, 0x3F, 0x3E, 0x0E, 0xC6, 0xE3, 0xEE,
-  0xD9, 0x21, 0xBB, 0x16, 0xB5, 0xF1, 0x83, 0xDB, 0xF8, 0x39, 0xFE, 0xA6, 0xAE, 0x79, 0xAB, 0xFD, 0x91, 0xB8, 0x84, 0xBF, 0x39, 0x10, 0xD1, 0x9E, 0x1B, 0x2B,
-  0xCB, 0xBE, 0x3D, 0xD5, 0x5E, 0x7A, 0xD0, 0xE7, 0xC1, 0x5B, 0x62, 0x5F, 0x91, 0xC0, 0x9A, 0x19, 0x07, 0xBE, 0xE1, 0xF8, 0x6D, 0x9F, 0x78, 0xD6, 0xFC, 0xAB,
-  0x2D, 0xC0, 0xA9, 0x31, 0xFB, 0xBC, 0xF0, 0xDC, 0x8D, 0x63, 0x9E, 0x6A, 0x5F, 0xF4, 0x8E, 0xF1, 0xDF, 0x76, 0xA3, 0x99, 0x6B, 0xBB, 0x1E, 0xDC, 0xBF, 0xFC,
-  0x1A, 0xFF, 0x6D, 0xDF, 0xA7, 0xBD, 0xFB, 0xD6, 0xEF, 0xE4, 0x54, 0xEB, 0x8D, 0xD7, 0x37, 0x89, 0xFB, 0x77, 0x4F, 0x12, 0xA7, 0xCB, 0x7E, 0x16, 0xF5, 0x1C,
-  0xFE, 0x38, 0x1F, 0xDE, 0x27, 0xB3, 0xC0, 0x72, 0x9D, 0xCE, 0xCA, 0xB0, 0x1C, 0x09, 0x26, 0xD3, 0xF2, 0xD7, 0xB6, 0x01, 0x32, 0x98, 0xDB, 0x24, 0x17, 0xCF,
-  0x17, 0x2B, 0xE2, 0x6C, 0x0E, 0x0A, 0xB0, 0x21, 0x92, 0xB6, 0x69, 0x79, 0xAC, 0xD5, 0x29, 0xCA, 0x61, 0xB3, 0x72, 0x0A, 0xD1, 0xE6, 0xD1, 0xE5, 0xB8, 0x0E,
-  0x91, 0x08, 0x10, 0x3B, 0xBA, 0xF6, 0x8C, 0x35, 0x36, 0xC0, 0xBF, 0xDB, 0x4D, 0x56, 0x96, 0xC3, 0x8C, 0xEA, 0x54, 0x1B, 0x0C, 0xBB, 0xEB, 0x9B, 0x02, 0x55,
-  0x0E, 0xC6, 0xF8, 0x6F, 0xBB, 0xD1, 0xDA, 0x30, 0x4D, 0xCB, 0x59, 0x9C, 0x6A, 0xC7, 0x52, 0x14, 0xAE, 0x67, 0x12, 0xAF, 0xED, 0x19, 0xA6, 0xB5, 0xF1, 0x4F,
-  0xB5, 0xA1, 0xAC, 0xCD, 0xCA, 0xF0, 0x16, 0x40, 0x4B, 0xE0, 0x02, 0xB1, 0xED, 0x9E, 0x94, 0x12, 0xDE, 0xC4, 0xB3, 0x16, 0xCB, 0x00, 0x54, 0xBA, 0xD5, 0x26,
-  0x2D, 0x34, 0xEE, 0x42, 0x45, 0xFA, 0xCC, 0x95, 0x9B, 0x5C, 0x6A, 0x86, 0x6D, 0x2D, 0x9C, 0xB6, 0x15, 0x90, 0x15, 0xB0, 0xE3, 0x07, 0x1E, 0x09, 0x66, 0xCB,
-  0x3C, 0x52, 0xE6, 0xD6, 0x62, 0xE3, 0x11, 0x09, 0x21, 0xA1, 0xDC, 0x72, 0x18, 0x86, 0x9B, 0xDB, 0xB7, 0xDA, 0xD7, 0x64, 0xFA, 0xD9, 0x0A, 0xDA, 0x5C, 0x26,
-  0x53, 0x32, 0x77, 0x3D, 0x22, 0x6D, 0x29, 0x5A, 0xD8, 0xEE, 0xEC, 0x73, 0xDB, 0x0F, 0x0C, 0x2F, 0x50, 0x41, 0x68, 0xCC, 0x03, 0xE2, 0x15, 0xE3, 0x23, 0x68,
-  0x15, 0xC5, 0xD8, 0xB2, 0xBB, 0xE5, 0x0D, 0x2C, 0xC7, 0xB6, 0x1C, 0xA2, 0x4E, 0x5E, 0x56, 0xBF, 0x49, 0x74, 0xAC, 0x95, 0x82, 0x62, 0xAC, 0xD5, 0x22, 0xCF,
-  0x4A, 0x28, 0xAF, 0xDB, 0x9D, 0x71, 0xBF, 0xE9, 0x75, 0xBB, 0x7F, 0xDB, 0xBE, 0xB9, 0x24, 0xCC, 0x4C, 0x8D, 0x4D, 0xE0, 0xD6, 0xF7, 0x88, 0x2D, 0xB7, 0x4A,
-  0xF1, 0xF1, 0x5F, 0x2B, 0x62, 0x5A, 0x86, 0xD6, 0x8A, 0xB9, 0xF3, 0x71, 0x17, 0x6C, 0x6A, 0x5F, 0x33, 0x1C, 0x53, 0x6B, 0xB9, 0x9E, 0x05, 0x8E, 0x60, 0xD0,
-  0x70, 0x63, 0xC3, 0x15, 0x18, 0x38, 0xD6, 0x64, 0x5F, 0xC2, 0x72, 0x8E, 0xCF, 0xC4, 0x25, 0x22, 0x77, 0x1B, 0xFC, 0x29, 0x84, 0x1C, 0xFC, 0x15, 0x3A, 0x90,
-  0x84, 0x47, 0x8A, 0x3E, 0x4F, 0x5F, 0x71, 0x0A, 0xB3, 0x74, 0x86, 0xBF, 0x95, 0x71, 0xD3, 0xCE, 0xD5, 0x9D, 0x68, 0x24, 0x74, 0x08, 0xC3, 0xEC, 0xAC, 0x05,
-  0x4D, 0xAF, 0x96, 0x5A, 0x5B, 0xC3, 0x28, 0xB9, 0x2F, 0x87, 0xE1, 0x48, 0xE5, 0x2A, 0xC7, 0x5F, 0xDC, 0x28, 0x4A, 0xB0, 0x2B, 0x67, 0x35, 0x8A, 0x1D, 0xEC,
-  0x9F, 0xCC, 0x86, 0x18, 0x27, 0x99, 0x51, 0x04, 0x7F, 0xEA, 0x91, 0x24, 0x42, 0x56, 0x18, 0x4D, 0x24, 0x88, 0xB3, 0x23, 0xCA, 0x16, 0xDE, 0x2C, 0xEF, 0x96,
-  0x60, 0xCD, 0x27, 0x41, 0x35, 0xBA, 0x48, 0x10, 0xE7, 0xD1, 0x50, 0x18, 0x65, 0xF0, 0x77, 0xA7, 0x90, 0x6F, 0x7C, 0x31, 0xDD, 0x04, 0x81, 0xEB, 0xF8, 0xB5,
-  0x86, 0xA8, 0x2C, 0x3F, 0xFB, 0x6D, 0xE3, 0x07, 0xD6, 0xFC, 0xB6, 0xCD, 0x5D, 0x1A, 0xFC, 0x6C, 0x6D, 0x40, 0x0A, 0x39, 0x25, 0xC1, 0x35, 0x21, 0xF9, 0xE9,
-  0x86, 0x63, 0x5C, 0x41, 0xDC, 0x59, 0x2C, 0x6C, 0x99, 0xED, 0xCD, 0x36, 0x9E, 0x8F, 0x79, 0xDB, 0xDA, 0xB5, 0x00, 0xB1, 0xB7, 0xDD, 0x71, 0xD2, 0x07, 0x15,
-  0x3B, 0x6A, 0xCF, 0xA6, 0x92, 0xBE, 0xDC, 0x4D, 0x80, 0x32, 0x96, 0x6A, 0xC2, 0x05, 0x76, 0xAC, 0xE0, 0x56, 0x7A, 0x8F, 0x7B, 0xA2, 0xE4, 0x8E, 0x70, 0xC1,
-  0xDC, 0x61, 0x21, 0x49, 0xD7, 0xE9, 0x6C, 0x49, 0x66, 0x9F, 0x89, 0xF9, 0xBC, 0x30, 0x0D, 0x2B, 0x4A, 0x0F, 0x3B, 0x96, 0xB3, 0xDE, 0x04, 0x6D, 0x4C, 0xA7,
-  0xD6, 0x3B, 0xD1, 0x39, 0x35, 0x48, 0xC1, 0x62, 0xBF, 0x9F, 0x97, 0x54, 0x8C, 0xD6, 0x37, 0xF9, 0x42, 0x88, 0x13, 0x3B, 0xB1, 0x8D, 0x29, 0xB1, 0xF3, 0x48,
-  0xE6, 0xCE, 0x90, 0x11, 0x76, 0x79, 0xAC, 0xCA, 0xCE, 0xDD, 0x28, 0x65, 0xD1, 0xE0, 0x35, 0x3C, 0xFA, 0x9B, 0xB2, 0x1C, 0xE9, 0xF1, 0x41, 0xE2, 0x92, 0x4F,
-  0x6C, 0x70, 0xB0, 0xAC, 0xD4, 0x1B, 0xDA, 0x5C, 0x03, 0x0D, 0xB9, 0x1D, 0x78, 0x86, 0xB3, 0x20, 0x10, 0x0B, 0x6E, 0x0E, 0xC4, 0x61, 0xFE, 0xC4, 0x40, 0x89,
-  0x7D, 0x0C, 0xD5, 0xA3, 0xFC, 0x89, 0x08, 0x0B, 0x08, 0x07, 0x5A, 0x87, 0x1D, 0x54, 0xC8, 0x4A, 0x62, 0xFA, 0xCD, 0x25, 0xA4, 0x27, 0xB5, 0x0E, 0x96, 0x98,
-  0x48, 0x3D, 0x27, 0x69, 0x5B, 0xD2, 0x44, 0xBF, 0x30, 0x34, 0x88, 0x29, 0xDF, 0x7C, 0x5E, 0x34, 0x69, 0x9C, 0xCF, 0x07, 0xDD, 0xC1, 0xB0, 0x30, 0x73, 0x92,
-  0x72, 0x99, 0x9A, 0x38, 0x4A, 0x42, 0x47, 0x18, 0x56, 0x72, 0x8D, 0xC0, 0x37, 0xAE, 0xA4, 0x49, 0xBB, 0xEB, 0x5B, 0x6C, 0xE6, 0x66, 0x4C, 0x7D, 0x98, 0xBB,
-  0x05, 0x92, 0xA9, 0x17, 0x37, 0xF4, 0xBE, 0x94, 0x3E, 0x9A, 0xD2, 0x49, 0x5D, 0x40, 0x88, 0x57, 0x4E, 0x76, 0x42, 0x03, 0xF2, 0x26, 0x31, 0x05, 0x4B, 0x93,
-  0xCA, 0x80, 0xDC, 0x04, 0x6D, 0x93, 0xCC, 0x5C, 0x8F, 0x65, 0x83, 0x19, 0x33, 0xC7, 0x94, 0x22, 0x8B, 0x2D, 0xF6, 0x74, 0xE9, 0x5E, 0x11, 0x4F, 0x22, 0xAC,
-  0x94, 0x52, 0x87, 0x27, 0x43, 0x53, 0x01, 0x9B, 0x01, 0xC3, 0xA3, 0x54, 0xF6, 0x49, 0x74, 0xFD, 0xDE, 0xAC, 0x9F, 0xEB, 0xC7, 0x0C, 0x5D, 0x07, 0x7C, 0xC6,
-  0x98, 0xDA, 0xC4, 0xCC, 0x19, 0xCD, 0x4C, 0x32, 0x37, 0x36, 0x76, 0x50, 0x60, 0x95, 0x46, 0x17, 0xFF, 0xE5, 0xF5, 0x48, 0xC3, 0xD0, 0xBF, 0xB0, 0x2E, 0x74,
-  0x4E, 0x03, 0xC7, 0xBF, 0x25, 0x7D, 0x8A, 0x54, 0xC3, 0x58, 0xAF, 0x89, 0x01, 0xAD, 0x66, 0x24, 0x4B, 0x0F, 0x4A, 0x53, 0x0C, 0x79, 0x9C, 0x57, 0x9A, 0xB7,
-  0x17, 0x3A, 0x6C, 0x98, 0x3C, 0x96, 0xE2, 0xF9, 0x74, 0xEE, 0xCE, 0x36, 0xB2, 0xAC, 0x46, 0xCD, 0xF1, 0xB6, 0xF1, 0x9D, 0x0A, 0x91, 0xF9, 0xB6, 0x45, 0xDD,
-  0x7F, 0xE3, 0x38, 0xA8, 0xD1, 0x76, 0xE0, 0x01, 0x9B, 0x92, 0x8E, 0xD4, 0x04, 0x57, 0x29, 0x86, 0x25, 0x04, 0x9B, 0x55, 0xBB, 0x4A, 0x85, 0x29, 0x49, 0x38,
-  0x0D, 0x23, 0xAD, 0x06, 0x31, 0xC4, 0x32, 0x05, 0xAA, 0x7A, 0x72, 0x09, 0x96, 0x9B, 0x95, 0x2C, 0x8F, 0x12, 0x9D, 0xF5, 0x60, 0xD0, 0x67, 0xDD, 0x79, 0x8B,
-  0xA9, 0xD1, 0xEA, 0x1E, 0x74, 0x0F, 0x06, 0xF0, 0x9F, 0x64, 0x3E, 0x93, 0x6F, 0x5C, 0x5C, 0xBC, 0x19, 0x96, 0x97, 0x0A, 0xD1, 0xC5, 0x65, 0xA5, 0xAC, 0x60,
-  0x5F, 0xA8, 0x0B, 0x75, 0x4F, 0x4A, 0xD6, 0x97, 0x7A, 0x9D, 0x82, 0x71, 0x38, 0xC3, 0xA4, 0xCB, 0x1B, 0xA2, 0xC4, 0x5A, 0xCA, 0xAA, 0x78, 0xE5, 0xFE, 0xDE,
-  0x66, 0x49, 0xC8, 0xFF, 0x79, 0x6B, 0x8F, 0x89, 0xE2, 0x2F, 0x6D, 0xE9, 0xA5, 0xE5, 0xE2, 0x3F, 0xB4, 0x6D, 0x74, 0xB3, 0xB5, 0xDE, 0xE6, 0x59, 0x1F, 0x50,
-  0xE8, 0xC0, 0x1C, 0xD4, 0x83, 0xC9, 0x68, 0x66, 0x66, 0x18, 0x6B, 0x53, 0x41, 0x06, 0x73, 0xCB, 0xB6, 0xDB, 0xB6, 0x7B, 0x5D, 0x9C, 0x89, 0xE4, 0x5B, 0xF2,
-  0x96, 0x9D, 0x16, 0x9B, 0x7C, 0x55, 0x6A, 0x37, 0x10, 0xB9, 0xFE, 0x14, 0xD4, 0xFE, 0xB5, 0x1D, 0x2E, 0xD7, 0x35, 0xAA, 0x0D, 0x14, 0x15, 0xEC, 0xB1, 0x5E,
-  0x47, 0x4A, 0xA6, 0xC4, 0x32, 0xC1, 0xFC, 0x69, 0xCF, 0xB5, 0x15, 0xCC, 0x96, 0x15, 0xA6, 0x9E, 0xD1, 0xC4, 0xC8, 0x23, 0xB6, 0x81, 0x19, 0x7C, 0xA5, 0x0A,
-  0x45, 0xE1, 0xF4, 0x2D, 0x0E, 0xAE, 0xC2, 0x09, 0x15, 0xDD, 0xE3, 0xA9, 0x2E, 0x75, 0x58, 0xEE, 0x90, 0x1D, 0xAB, 0xE5, 0x66, 0x5D, 0x90, 0xEE, 0x27, 0x3D,
-  0x43, 0xDE, 0xA8, 0x44, 0x44, 0x17, 0x41, 0x7B, 0xE1, 0x91, 0x5B, 0x05, 0x66, 0x0E, 0xF8, 0xDF, 0x53, 0x56, 0x3F, 0xAE, 0x5E, 0x2A, 0xA1, 0x03, 0x00, 0xB7,
-  0xA2, 0xCE, 0xD0, 0x57, 0xE8, 0x3A, 0xBB, 0x4B, 0x15, 0x7B, 0x0C, 0xAB, 0xA3, 0xBA, 0xAE, 0x10, 0x6E, 0x72, 0x86, 0x50, 0xB9, 0xA9, 0x8A, 0xD1, 0x57, 0x3E,
-  0x9F, 0x27, 0xF3, 0x20, 0x63, 0xF1, 0x87, 0xE6, 0xA9, 0x83, 0xFC, 0xE8, 0xD6, 0x8E, 0x55, 0x53, 0x0A, 0x23, 0x47, 0x58, 0xC4, 0xCC, 0xB6, 0x3E, 0x29, 0x66,
-  0x8C, 0x9E, 0xA5, 0x91, 0x67, 0xAB, 0x44, 0xA4, 0xCF, 0x54, 0xCD, 0xD0, 0x66, 0xC5, 0x87, 0x7C, 0x50, 0x0F, 0xF9, 0xB9, 0xD5, 0x1F, 0x4B, 0xD7, 0x56, 0x72,
-  0x1A, 0xE7, 0x91, 0x96, 0x59, 0x05, 0xDC, 0x1E, 0xB2, 0x32, 0x27, 0xC8, 0xF1, 0x58, 0x24, 0x55, 0x54, 0xBE, 0x57, 0xE6, 0x45, 0x98, 0xED, 0x4A, 0x56, 0xAE,
-  0xB1, 0x5B, 0x2B, 0x03, 0xD2, 0x5E, 0x34, 0x57, 0x03, 0x30, 0xCA, 0xF4, 0xA7, 0x62, 0xEE, 0xB1, 0x1A, 0x6B, 0x6F, 0xDC, 0x2D, 0xE8, 0x72, 0x66, 0xBB, 0x7E,
-  0xCD, 0x02, 0x58, 0x76, 0xFD, 0x4B, 0x7A, 0x47, 0x69, 0xE8, 0xCE, 0xF5, 0xA9, 0x7C, 0x77, 0x4C, 0xC9, 0xBC, 0xD7, 0x95, 0x46, 0xDA, 0xDC, 0x2A, 0x25, 0xAD,
-  0xA0, 0xD1, 0xF5, 0xCB, 0x53, 0x6D, 0x46, 0xE4, 0x61, 0x34, 0x59, 0xA8, 0x53, 0x29, 0x95, 0xE6, 0xEA, 0x61, 0x69, 0x99, 0x26, 0xC9, 0xAD, 0x05, 0xE3, 0x9C,
-  0x57, 0x31, 0x79, 0x40, 0xFA, 0x65, 0x45, 0xA9, 0x9D, 0x38, 0x45, 0xEE, 0xB6, 0x86, 0xDE, 0xAE, 0x3D, 0x86, 0x0F, 0x34, 0x59, 0x95, 0xF4, 0x64, 0x2A, 0x92,
-  0x4B, 0xAA, 0xD4, 0xB9, 0xC3, 0x5A, 0x2B, 0x8A, 0x0C, 0xE4, 0x80, 0xAD, 0xB6, 0xA3, 0x79, 0x8A, 0x2A, 0xBA, 0x90, 0xD2, 0xE1, 0x6B, 0x4B, 0x7C, 0x19, 0xB0,
-  0x9D, 0xB5, 0xBA, 0x72, 0x8F, 0x4B, 0x6D, 0xD4, 0x02, 0xD2, 0xFD, 0x66, 0x8A, 0xE6, 0x81, 0x32, 0xA3, 0x1C, 0x22, 0xC3, 0x21, 0x46, 0x6C, 0xAE, 0x4A, 0xB6,
-  0x2A, 0xEB, 0x1C, 0xE1, 0xF9, 0xD9, 0x61, 0x6C, 0x3B, 0xDC, 0xD9, 0x61, 0xB4, 0x73, 0xEF, 0x0C, 0xF7, 0xC4, 0xC5, 0x77, 0xCD, 0xF1, 0x8E, 0x66, 0xB6, 0xE1,
-  0xFB, 0xE7, 0x3A, 0xEE, 0xED, 0xD2, 0x93, 0x9B, 0xE8, 0xCE, 0x4C, 0xEB, 0x4A, 0xB3, 0xCC, 0x73, 0xDD, 0x76, 0x17, 0x6E, 0xEA, 0x1E, 0xBD, 0xCF, 0xD4, 0x0C,
-  0x03, 0xD9, 0xB9, 0x9E, 0x58, 0x60, 0xD4, 0x29, 0x54, 0x74, 0x49, 0x9F, 0x3C, 0xFB, 0xE2, 0xE4, 0xE8, 0x68, 0xFC, 0xD5, 0x33, 0x67, 0xEA, 0xAF, 0xF9, 0xFF,
-  0x3F, 0xB0, 0xF5, 0x58, 0xB6, 0xA9, 0x0F, 0xC6, 0xB6, 0x20, 0x00, 0xDB, 0xF3, 0xCF, 0x0E, 0x29, 0xD2, 0x14, 0x21, 0x87, 0x40, 0x49, 0x06, 0x6D, 0x3C, 0xDF,
-  0x91, 0x91, 0x27, 0x9A, 0xF8, 0x30, 0x84, 0x4F, 0x0D, 0x4F, 0xD2, 0x84, 0x36, 0x63, 0xD9, 0x34, 0x8D, 0x25, 0x3A, 0x55, 0xCA, 0xD4, 0xBD, 0x49, 0x73, 0x40,
-  0x99, 0xE2, 0x1A, 0xE3, 0xAD, 0x88, 0x99, 0x85, 0x10, 0xC0, 0x28, 0x38, 0xAE, 0xAE, 0x42, 0x1B, 0x69, 0xA3, 0x84, 0x0A, 0xB0, 0xF1, 0xCD, 0xCC, 0xFE, 0x2C,
-  0x94, 0xAF, 0x0B, 0xA5, 0x38, 0x6E, 0xC0, 0x62, 0x65, 0x46, 0x57, 0x09, 0x56, 0x39, 0x4C, 0x6C, 0xDD, 0x90, 0x71, 0x01, 0xA2, 0x6D, 0x53, 0xEC, 0xEC, 0x5A,
-  0x3E, 0x26, 0x8A, 0x2D, 0xA6, 0x57, 0x01, 0xAC, 0x4F, 0x7E, 0xBE, 0xF8, 0xF6, 0xEF, 0xDA, 0xBB, 0xB7, 0xBF, 0x4B, 0x35, 0x54, 0x44, 0x14, 0x06, 0x69, 0x85,
-  0x9E, 0x29, 0x18, 0xD3, 0x87, 0x90, 0x89, 0xCE, 0x35, 0x43, 0x31, 0xE0, 0x70, 0x6F, 0x13, 0x67, 0x11, 0x2C, 0xCF, 0xF5, 0x9E, 0x8E, 0x7B, 0x5A, 0xC4, 0x59,
-  0x5F, 0xD7, 0x30, 0x80, 0xD3, 0x83, 0x2B, 0xC3, 0xDE, 0xE0, 0x51, 0x57, 0x85, 0xD7, 0x6D, 0xD3, 0x92, 0x36, 0xE3, 0x91, 0x25, 0x94, 0x71, 0x2C, 0x12, 0x27,
-  0xA5, 0xAC, 0x4F, 0x3E, 0x90, 0xE0, 0xEC, 0x90, 0xDD, 0x2A, 0xD0, 0x5A, 0x7E, 0xDF, 0xE0, 0xC9, 0xCC, 0x1C, 0xF2, 0x4C, 0x28, 0x4F, 0xF1, 0x73, 0xCF, 0x58,
-  0x11, 0x94, 0x8A, 0x92, 0xE6, 0xE3, 0x5A, 0x0F, 0x21, 0xF5, 0xC9, 0xF7, 0x84, 0x66, 0x44, 0x40, 0x86, 0x92, 0xE2, 0xCF, 0x78, 0x92, 0x9A, 0xE8, 0x3F, 0xB4,
-  0x67, 0xBE, 0x28, 0xD5, 0x36, 0x98, 0x99, 0x2B, 0xC8, 0xFD, 0x69, 0xBB, 0xAD, 0x0D, 0xDE, 0xBD, 0xD7, 0xDA, 0x6D, 0x85, 0xC6, 0xEE, 0x9A, 0xBA, 0x13, 0xD7,
-  0x7F, 0xEF, 0x48, 0x9F, 0xFC, 0xF3, 0xE7, 0x37, 0x2F, 0x5B, 0xFD, 0xEE, 0xF0, 0xF8, 0xA6, 0x37, 0x1A, 0x0F, 0xF7, 0xCF, 0x0E, 0x59, 0x93, 0xF2, 0xB8, 0xC6,
-  0xFA, 0xE4, 0x3D, 0x12, 0xD2, 0x3A, 0x1E, 0x0F, 0xEB, 0xE2, 0x1A, 0x21, 0xAE, 0xB7, 0xAF, 0x5B, 0x47, 0xFD, 0xEE, 0x4D, 0xAF, 0x7F, 0xDC, 0xAD, 0x81, 0x6A,
-  0xA8, 0x4F, 0xBE, 0x06, 0x4C, 0xBD, 0x13, 0x44, 0xD5, 0x2D, 0x87, 0x0A, 0x45, 0xDB, 0xAF, 0x28, 0xDA, 0x81, 0x3E, 0xF9, 0x11, 0x45, 0x0B, 0x39, 0x37, 0xF2,
-  0xD0, 0xAD, 0xC3, 0x43, 0x1F, 0x5C, 0x86, 0xE2, 0x02, 0x51, 0x00, 0x13, 0xFD, 0x3A, 0xA2, 0xED, 0xE9, 0x13, 0x14, 0x07, 0x62, 0x02, 0xE9, 0xD6, 0x40, 0x04,
-  0xB1, 0x83, 0xD2, 0x04, 0xE4, 0xDC, 0x1C, 0x8D, 0x8F, 0xAB, 0x63, 0x3A, 0x01, 0xEE, 0x3E, 0x02, 0xA6, 0x63, 0x10, 0xD4, 0xB8, 0x8E, 0x9C, 0x8E, 0xF5, 0x09,
-  0xE2, 0x19, 0x0F, 0xBB, 0x37, 0xC3, 0x3A, 0x36, 0x03, 0x5E, 0xF1, 0x16, 0x11, 0x01, 0x92, 0x9B, 0x41, 0x1D, 0x19, 0x81, 0x4B, 0x5C, 0x7C, 0xF3, 0x75, 0x6B,
-  0x08, 0x8C, 0xF5, 0x4F, 0xC6, 0xD5, 0xF1, 0x80, 0x3B, 0xFC, 0x13, 0x09, 0x02, 0x62, 0x6E, 0xFA, 0xC3, 0x1A, 0x04, 0x81, 0x33, 0x00, 0x3C, 0xE2, 0xA8, 0x8C,
-  0x02, 0xEC, 0xFA, 0x2D, 0x25, 0x06, 0x11, 0xF5, 0x8E, 0x6A, 0x70, 0x05, 0x56, 0xFD, 0x4F, 0x14, 0x0F, 0x20, 0xB9, 0xE9, 0x0D, 0xEB, 0xD8, 0x34, 0x20, 0xA2,
-  0x24, 0x81, 0xAF, 0xA1, 0xAB, 0x55, 0xC7, 0x04, 0x36, 0x7D, 0x32, 0xBE, 0x39, 0x19, 0xAB, 0x21, 0xC0, 0xE1, 0x07, 0x43, 0x79, 0xDE, 0x00, 0x95, 0x3F, 0x7E,
-  0xE5, 0x8D, 0x4D, 0xFF, 0xD9, 0xC0, 0x94, 0x33, 0xB8, 0x2D, 0x3D, 0x32, 0x71, 0x38, 0x90, 0x09, 0x3B, 0x50, 0x1B, 0x94, 0x62, 0x94, 0x84, 0xBB, 0x9F, 0xF4,
-  0xC9, 0x50, 0x61, 0xF0, 0x4F, 0x64, 0x87, 0x14, 0x36, 0x41, 0x3F, 0xCD, 0x48, 0xD0, 0xF2, 0x30, 0x17, 0x01, 0x97, 0x18, 0xE8, 0xB1, 0x08, 0x52, 0x69, 0xD4,
-  0x93, 0xD0, 0x6A, 0xDC, 0xE8, 0x93, 0xF1, 0xA0, 0x30, 0x5B, 0xA8, 0xAE, 0x8C, 0x29, 0x2D, 0x6E, 0x38, 0xC4, 0xF7, 0x4B, 0xEB, 0x23, 0x02, 0xD5, 0x27, 0xAF,
-  0xC2, 0xE3, 0x3A, 0x5A, 0x69, 0x17, 0x71, 0x4A, 0x61, 0x33, 0xD4, 0x12, 0x23, 0x87, 0x69, 0xA6, 0x3D, 0xE0, 0xAA, 0x89, 0x34, 0x73, 0xBF, 0x8A, 0xD9, 0xA5,
-  0x5E, 0x70, 0x6E, 0xE3, 0x19, 0x7E, 0x50, 0x5A, 0x2B, 0x02, 0x10, 0x22, 0x34, 0x3F, 0x7A, 0x30, 0x8D, 0x84, 0xA4, 0xFC, 0x05, 0xF4, 0xE1, 0x1B, 0xC1, 0x86,
-  0xED, 0x33, 0x2B, 0xAD, 0x91, 0x08, 0x14, 0xF2, 0x81, 0xF0, 0xB8, 0x96, 0x56, 0xEA, 0x84, 0xAF, 0x18, 0x39, 0x5C, 0x2F, 0x22, 0x84, 0x0D, 0x77, 0xA4, 0x97,
-  0x22, 0x6A, 0x6B, 0xE9, 0x65, 0x69, 0x78, 0xEB, 0x4A, 0xE1, 0x2B, 0x84, 0x04, 0xAD, 0x88, 0xC3, 0x07, 0x73, 0x95, 0x88, 0x98, 0xBF, 0x80, 0xAF, 0x98, 0xC4,
-  0x71, 0x2D, 0xBF, 0xFC, 0xD4, 0x93, 0xC3, 0xE9, 0x93, 0xD7, 0xA4, 0xFD, 0x1D, 0x1E, 0xD5, 0x51, 0xC7, 0xCB, 0x4D, 0xE0, 0xD6, 0x50, 0x88, 0xA0, 0x85, 0xA9,
-  0xA3, 0xCB, 0xB5, 0x71, 0xBC, 0x23, 0x6D, 0x1C, 0xEF, 0x50, 0x1B, 0x06, 0xF9, 0x64, 0x93, 0x2B, 0x62, 0x97, 0x56, 0x87, 0x00, 0xD4, 0x27, 0x97, 0x37, 0x6B,
-  0xD7, 0xC7, 0xA7, 0x77, 0xBE, 0xC5, 0xF3, 0x5A, 0x4E, 0x32, 0xAA, 0xA1, 0x93, 0x90, 0x20, 0xEE, 0x23, 0x23, 0xAE, 0x95, 0xD1, 0x8E, 0xB4, 0x52, 0x44, 0x6B,
-  0x1D, 0xAD, 0x2C, 0x0C, 0xCB, 0x99, 0x11, 0xCB, 0xC6, 0x27, 0x09, 0xCA, 0x2A, 0x26, 0x06, 0xAB, 0x4F, 0xDE, 0x44, 0x27, 0x75, 0x14, 0xD3, 0xAD, 0xA1, 0x97,
-  0x38, 0x3D, 0x49, 0x7F, 0x19, 0xC1, 0xAC, 0x7C, 0x47, 0xBA, 0xE9, 0xF5, 0x76, 0x39, 0xAA, 0xAC, 0xC9, 0xCC, 0x32, 0xEC, 0x4F, 0x64, 0x3E, 0x87, 0x69, 0x50,
-  0xF9, 0xA1, 0x25, 0x01, 0x0E, 0xE3, 0x0B, 0x3B, 0xD7, 0x2E, 0xE9, 0x79, 0xE9, 0x62, 0x5A, 0x0A, 0x5D, 0xF5, 0x8A, 0x5A, 0x7A, 0x4E, 0xC8, 0x97, 0x95, 0x09,
-  0xAD, 0x61, 0xB2, 0x23, 0x7D, 0xF2, 0x9D, 0x1B, 0xD2, 0x59, 0x7D, 0xDA, 0xFA, 0x1D, 0x59, 0xD0, 0x55, 0xDB, 0x3A, 0x73, 0xE8, 0x37, 0x9E, 0x71, 0x4B, 0x5F,
-  0x0B, 0x50, 0x67, 0x4A, 0xFF, 0x3D, 0x31, 0xB5, 0x1F, 0x2C, 0xA7, 0x3A, 0x33, 0x43, 0x24, 0x84, 0x10, 0xA7, 0x1E, 0x96, 0x11, 0x4C, 0x91, 0xE0, 0xA0, 0x1E,
-  0x92, 0x31, 0x16, 0x98, 0xD7, 0x96, 0xF1, 0x18, 0x26, 0xF1, 0xC6, 0xF5, 0xB4, 0xFC, 0x80, 0x72, 0x3D, 0x85, 0x71, 0xF9, 0xA7, 0x57, 0xDA, 0x25, 0xDD, 0x67,
-  0x5C, 0x3A, 0x5C, 0xB1, 0x2D, 0x50, 0x2A, 0x86, 0x1E, 0xAD, 0x23, 0x60, 0x9F, 0x5B, 0x0B, 0x3C, 0x72, 0x07, 0x52, 0x5D, 0xE4, 0x91, 0xB0, 0x27, 0x08, 0xA4,
-  0x3B, 0x46, 0xF4, 0x18, 0xB7, 0x6A, 0x3C, 0xEE, 0x30, 0x15, 0x9B, 0x5D, 0x97, 0x4F, 0xC3, 0x66, 0xD7, 0xA0, 0x26, 0xF3, 0x0A, 0xB7, 0xA0, 0x9B, 0x1A, 0xE8,
-  0xAB, 0x11, 0x45, 0x61, 0xAF, 0x0F, 0xA3, 0x28, 0xCA, 0xEF, 0x43, 0x2B, 0x0A, 0xAC, 0xE5, 0x13, 0x8E, 0xA3, 0x55, 0x9C, 0x8A, 0x02, 0xEA, 0x93, 0x77, 0x86,
-  0xB3, 0x81, 0x41, 0xA6, 0x29, 0x85, 0x85, 0x1D, 0x3F, 0x98, 0x7B, 0x71, 0xBE, 0x1F, 0x5A, 0x75, 0x40, 0xC8, 0xCA, 0x35, 0xCB, 0x4F, 0x77, 0x38, 0x1C, 0x0B,
-  0x89, 0xEF, 0xE0, 0xA8, 0x74, 0x62, 0x20, 0x30, 0xEC, 0x38, 0x23, 0x60, 0x53, 0xA9, 0xEA, 0xC9, 0xC0, 0x87, 0x8D, 0xE3, 0xDC, 0xD6, 0xC9, 0x04, 0x2E, 0x6C,
-  0x77, 0x63, 0x56, 0xC7, 0x00, 0x69, 0xC0, 0x3F, 0xE6, 0x73, 0x6B, 0x56, 0x3D, 0x91, 0x80, 0x24, 0xE0, 0xAD, 0xBB, 0x52, 0x84, 0xDF, 0xF1, 0xC0, 0x4B, 0x66,
-  0x15, 0x66, 0x72, 0x33, 0xD0, 0xE2, 0xE5, 0x45, 0xA3, 0x03, 0x2F, 0xF4, 0xF9, 0x40, 0x91, 0x01, 0xB9, 0x7D, 0xE8, 0xA0, 0x00, 0x44, 0x7C, 0xA2, 0xC6, 0x53,
-  0x45, 0x59, 0x0C, 0x32, 0x8C, 0xE8, 0x62, 0xFA, 0xFD, 0x50, 0xF3, 0xBB, 0x88, 0xA2, 0xE4, 0xEC, 0xAE, 0x37, 0x1A, 0x8C, 0xC3, 0xE9, 0xDD, 0xA0, 0x7F, 0xBF,
-  0x13, 0x3C, 0x44, 0xBE, 0x5B, 0xFD, 0xF4, 0xAB, 0xA8, 0x06, 0xA2, 0xD1, 0x77, 0xB8, 0xCE, 0x50, 0x22, 0x60, 0xD7, 0x77, 0xA4, 0xFE, 0xC3, 0x79, 0x52, 0xFF,
-  0x11, 0xB8, 0xD2, 0xA2, 0x42, 0xC4, 0x5B, 0x60, 0xC4, 0x7B, 0x73, 0xD1, 0x8C, 0x86, 0x16, 0x0F, 0x16, 0xEA, 0x16, 0x0F, 0x1A, 0xEA, 0x34, 0xBE, 0x43, 0x4D,
-  0x48, 0xA1, 0x62, 0x06, 0xCB, 0x01, 0x59, 0x2D, 0xAB, 0x4E, 0x90, 0xEB, 0xDD, 0xD4, 0x89, 0x72, 0x82, 0x8C, 0x64, 0x90, 0x1B, 0x47, 0xAB, 0x22, 0xA3, 0xFB,
-  0x5D, 0xD6, 0x1D, 0x16, 0x51, 0x5B, 0xC7, 0x69, 0x3C, 0xE3, 0xFA, 0xD3, 0x62, 0x65, 0x94, 0x56, 0x06, 0x87, 0x03, 0x5D, 0xBC, 0x7B, 0xD9, 0x64, 0xBA, 0x20,
-  0xFA, 0x7D, 0x18, 0x3F, 0x0A, 0xB9, 0x7E, 0xE8, 0x58, 0x67, 0x13, 0xA7, 0x7C, 0xB0, 0x43, 0x20, 0x7D, 0xF2, 0x2D, 0x71, 0x7C, 0xED, 0xC2, 0xF5, 0xF8, 0xBB,
-  0x18, 0x1B, 0xD1, 0x1A, 0xED, 0xF9, 0x61, 0x54, 0xC6, 0x98, 0x7E, 0x68, 0x7D, 0x2D, 0x57, 0x96, 0xE7, 0xB9, 0x5E, 0x69, 0x95, 0x71, 0x38, 0x98, 0x56, 0xB4,
-  0xDF, 0xD1, 0xA3, 0x46, 0xD4, 0x25, 0x7A, 0x7D, 0x18, 0x8D, 0x85, 0x3C, 0x3F, 0xB4, 0xD2, 0xAE, 0xE6, 0xB6, 0xB5, 0x2E, 0xAD, 0x32, 0x0A, 0xA5, 0x4F, 0x3E,
-  0xB6, 0xBF, 0x86, 0xBF, 0x8D, 0xA8, 0x8B, 0xF5, 0xF8, 0x30, 0xCA, 0xE2, 0xDC, 0x3E, 0xB4, 0xAA, 0xA6, 0xEB, 0xF2, 0xE1, 0x10, 0x60, 0xF4, 0xC9, 0xAB, 0xF7,
-  0xCD, 0xE4, 0x7E, 0xD8, 0x99, 0xA2, 0x86, 0x6A, 0xE9, 0x83, 0x32, 0xF5, 0xD0, 0xDA, 0xB8, 0xAE, 0xA0, 0x8D, 0x6B, 0x24, 0xFC, 0xA7, 0x86, 0xB4, 0x71, 0xAD,
-  0xAE, 0x8D, 0x7B, 0xF6, 0x97, 0xEB, 0xC7, 0xA0, 0x1F, 0xFA, 0xB0, 0xDF, 0xD4, 0x28, 0x3F, 0x1C, 0x09, 0x40, 0xDC, 0x34, 0x06, 0x47, 0xDA, 0x2B, 0xA3, 0x99,
-  0x01, 0x29, 0xEC, 0xB7, 0x09, 0x17, 0x8A, 0x98, 0x7C, 0x68, 0x3D, 0xD9, 0xC4, 0xAC, 0x90, 0xE4, 0x99, 0x9F, 0xF0, 0xC9, 0x39, 0x7C, 0xA2, 0xFC, 0x16, 0xB2,
-  0xBD, 0xCB, 0xD7, 0xDA, 0x37, 0xE2, 0xF4, 0xA1, 0x0A, 0x43, 0x49, 0x9A, 0x92, 0xF3, 0xA6, 0xFE, 0x68, 0x57, 0xDB, 0x32, 0x00, 0xF3, 0x0E, 0x75, 0x33, 0x37,
-  0x66, 0xE4, 0x93, 0x49, 0x82, 0x2A, 0xEB, 0xFE, 0x31, 0x58, 0x7D, 0xF2, 0x35, 0x9C, 0x68, 0xAF, 0xE9, 0x49, 0x53, 0xE9, 0x78, 0xBC, 0xFF, 0x26, 0x3C, 0x2A,
-  0xC1, 0xEF, 0x43, 0x3B, 0x15, 0x25, 0x06, 0x26, 0x3F, 0xEE, 0xC2, 0xA9, 0xF4, 0xDC, 0x53, 0x02, 0x9C, 0xAB, 0xEF, 0x7B, 0x76, 0xDE, 0xAC, 0x02, 0x23, 0x22,
-  0x1A, 0xD3, 0x61, 0x8C, 0xEF, 0x26, 0xD4, 0x18, 0x7F, 0xF8, 0x91, 0xBF, 0x36, 0xB8, 0x48, 0x53, 0xFC, 0x21, 0x3C, 0xBA, 0xDD, 0x88, 0x04, 0x6D, 0x3F, 0xB0,
-  0x6C, 0x5B, 0x9F, 0xBC, 0x21, 0x81, 0xF6, 0x01, 0x0F, 0x15, 0x9F, 0xBA, 0x8B, 0x61, 0x11, 0xCF, 0xDC, 0x06, 0x1E, 0x31, 0x56, 0xFA, 0xE4, 0x03, 0xBE, 0x50,
-  0x19, 0x70, 0xE1, 0x59, 0x79, 0x64, 0x54, 0x88, 0xC4, 0xF1, 0x5C, 0x20, 0x2A, 0x54, 0x12, 0x7F, 0x51, 0xA3, 0xAE, 0x89, 0xA3, 0xD8, 0xB5, 0xC9, 0x25, 0x6D,
-  0xAC, 0xA1, 0x95, 0x15, 0x77, 0x17, 0x7F, 0x1C, 0x30, 0xDF, 0x39, 0xE8, 0x03, 0xC0, 0xF8, 0x44, 0x6F, 0xF2, 0x7D, 0xEB, 0xA0, 0x56, 0xF6, 0x7C, 0xFF, 0xE4,
-  0xCC, 0x5F, 0x1B, 0x8E, 0x68, 0x46, 0x1F, 0x7E, 0xBF, 0xE6, 0x4F, 0x33, 0x4F, 0x5D, 0xDB, 0xFC, 0x2A, 0xB6, 0xF0, 0xFF, 0x21, 0x7C, 0x2C, 0x17, 0x41, 0xC0,
-  0x2E, 0x04, 0x86, 0x02, 0xE5, 0x2E, 0x3D, 0x81, 0x9E, 0x3D, 0x41, 0x8D, 0x6F, 0xEB, 0xCA, 0xD1, 0x6E, 0xC6, 0x93, 0xC4, 0x1E, 0x59, 0x84, 0x92, 0x94, 0x3D,
-  0x61, 0x2E, 0x7D, 0xAE, 0xF8, 0x7B, 0xB2, 0xB0, 0x7C, 0xA0, 0x51, 0x03, 0xBB, 0x38, 0xA4, 0xCF, 0x62, 0x32, 0x5B, 0x56, 0x7B, 0xCE, 0x37, 0xDE, 0x25, 0x7F,
-  0x4D, 0x81, 0xF4, 0xF1, 0xED, 0x52, 0xA9, 0x63, 0xFA, 0x59, 0xEB, 0x24, 0xC6, 0x22, 0xAB, 0x7F, 0xDA, 0x6E, 0x2F, 0x87, 0xF8, 0x54, 0xA9, 0x26, 0x58, 0x3B,
-  0x3B, 0x5C, 0x0E, 0x8B, 0x9E, 0xDA, 0x2B, 0x7C, 0x24, 0x18, 0x38, 0xAD, 0xFC, 0x44, 0x30, 0x4A, 0x69, 0x02, 0xD4, 0x1C, 0x68, 0xEF, 0x0C, 0xFF, 0xF3, 0x81,
-  0xF6, 0x11, 0x87, 0xF8, 0x06, 0x1F, 0x0C, 0x46, 0xDA, 0x0D, 0xD3, 0xF4, 0x32, 0x1F, 0x0E, 0x1E, 0x26, 0x1E, 0x0E, 0x1E, 0x8B, 0x87, 0x83, 0xA3, 0x95, 0xAA,
-  0xEE, 0xCD, 0xA0, 0xDB, 0x3D, 0x56, 0x61, 0x5D, 0xF1, 0x01, 0xE1, 0x7B, 0xE1, 0x69, 0x05, 0xD2, 0x54, 0xE4, 0x69, 0x28, 0x78, 0x8A, 0x6D, 0xD8, 0xBF, 0x99,
-  0xCF, 0x1F, 0x1B, 0x47, 0x7C, 0xC9, 0xB0, 0x3A, 0x4B, 0xDD, 0x7E, 0xD3, 0x4F, 0x71, 0x53, 0xE3, 0xBE, 0xAF, 0x87, 0xB8, 0x69, 0x93, 0x74, 0x34, 0x1C, 0xE5,
-  0x06, 0x43, 0x0A, 0xC2, 0x9C, 0xFE, 0xCD, 0x7D, 0x3A, 0xFD, 0xA2, 0x86, 0xD3, 0x2F, 0xB6, 0x9C, 0xBE, 0x41, 0x6F, 0x17, 0x84, 0xFF, 0xD5, 0x3C, 0x5E, 0xF0,
-  0x55, 0xC2, 0xEB, 0xA5, 0x7C, 0x75, 0xBB, 0xF7, 0xEA, 0xF7, 0x85, 0x4E, 0x12, 0x1A, 0xC3, 0x9B, 0xFB, 0x74, 0x92, 0x0C, 0xD3, 0xAD, 0x64, 0xA7, 0x3C, 0xEC,
-  0x4C, 0x9A, 0x19, 0x97, 0x68, 0x36, 0x15, 0x57, 0x28, 0xEF, 0x1D, 0x1F, 0xD7, 0x1D, 0x0C, 0x79, 0xEA, 0x74, 0x1F, 0xEA, 0x51, 0x7F, 0x61, 0x44, 0x66, 0x93,
-  0xFB, 0x49, 0xCC, 0xD6, 0xB1, 0x14, 0x57, 0x39, 0x31, 0x7B, 0xFF, 0xED, 0xB7, 0xE5, 0x72, 0xB1, 0x78, 0x2F, 0x8F, 0x24, 0x17, 0xCB, 0x2D, 0x53, 0xDF, 0xAE,
-  0xE1, 0x06, 0x52, 0x5D, 0xC9, 0x74, 0x23, 0x70, 0x7D, 0xF2, 0x8A, 0x1E, 0x6B, 0x31, 0x89, 0x95, 0x32, 0x5E, 0xE5, 0x59, 0x27, 0x05, 0x8C, 0xD5, 0xB1, 0x23,
-  0x12, 0xD2, 0xBA, 0x51, 0xC4, 0x95, 0x53, 0xBB, 0x8E, 0xB1, 0xA7, 0xCE, 0x54, 0x6D, 0x9F, 0xA0, 0x4D, 0x8A, 0x52, 0xE1, 0xD5, 0xC6, 0xAE, 0xAC, 0x36, 0x0E,
-  0xAB, 0x4F, 0xDE, 0xC1, 0x64, 0xDC, 0x5A, 0xDB, 0x16, 0xCC, 0x3C, 0x5A, 0x5D, 0xAD, 0xAD, 0x0D, 0x7A, 0xFB, 0x0D, 0x8E, 0x91, 0x82, 0x8C, 0x92, 0x6F, 0xCB,
-  0xE9, 0x45, 0x0F, 0xB3, 0x0D, 0xEE, 0xE9, 0x75, 0x39, 0x75, 0x15, 0xE2, 0xB9, 0x6E, 0x50, 0x59, 0x1B, 0x02, 0x18, 0x12, 0x15, 0x38, 0xD2, 0x22, 0x9D, 0xA8,
-  0xAB, 0x22, 0xB6, 0xB5, 0x36, 0xC2, 0xA6, 0xA6, 0x0E, 0xA5, 0x8D, 0xB4, 0xB8, 0x3F, 0x45, 0x75, 0x07, 0xAA, 0x04, 0x6B, 0x4F, 0x9F, 0xF4, 0x4B, 0x60, 0x28,
-  0xDE, 0x87, 0xCA, 0x5A, 0xD5, 0x77, 0x22, 0xFF, 0xB6, 0x7A, 0xEC, 0xE3, 0xB0, 0x90, 0x76, 0xDF, 0x42, 0xAA, 0xBB, 0xD2, 0x5E, 0x43, 0x5F, 0xD4, 0x89, 0x7A,
-  0xA3, 0x26, 0x9D, 0x48, 0x90, 0x51, 0xDD, 0x89, 0x7A, 0x8F, 0xC3, 0x87, 0x50, 0x1F, 0x6B, 0x8F, 0x54, 0xD6, 0x07, 0x87, 0xD5, 0x27, 0xEF, 0x3D, 0x82, 0xCA,
-  0xA8, 0xE4, 0x3D, 0x21, 0x92, 0x6A, 0xCE, 0x73, 0x0F, 0x8E, 0xD2, 0xEB, 0x8C, 0xEA, 0xE1, 0xE8, 0x97, 0x73, 0x36, 0x09, 0x86, 0x81, 0x3C, 0x08, 0x0C, 0x1E,
-  0xA7, 0x0B, 0x13, 0xDB, 0x1C, 0x55, 0x77, 0x62, 0x01, 0x8D, 0xB3, 0x67, 0x38, 0xAC, 0x6C, 0x38, 0x31, 0x44, 0x8F, 0x2A, 0xEE, 0xD6, 0xC4, 0x70, 0x1F, 0xC6,
-  0x34, 0xE9, 0x97, 0x32, 0xE9, 0x66, 0x4C, 0x67, 0x8D, 0x2F, 0x17, 0x24, 0x6A, 0x7B, 0x3E, 0x29, 0xB2, 0x78, 0xA4, 0x61, 0xB0, 0x10, 0x69, 0xE8, 0xEB, 0x05,
-  0xE9, 0x5E, 0xF7, 0x46, 0x73, 0x5E, 0x41, 0xC0, 0xF6, 0x32, 0x4B, 0xF9, 0xAD, 0x01, 0x31, 0xE6, 0x64, 0x29, 0x70, 0xC8, 0xEB, 0x63, 0xCB, 0x7F, 0x29, 0x61,
-  0x95, 0xC7, 0x0A, 0x0E, 0xCC, 0x55, 0x18, 0x0E, 0xDD, 0xCD, 0xE6, 0xBF, 0x21, 0x15, 0x35, 0xC6, 0xEE, 0x06, 0x13, 0xE0, 0xD8, 0xB2, 0x11, 0x55, 0x00, 0x0B,
-  0x9A, 0x01, 0x9B, 0xF1, 0x95, 0x58, 0x09, 0xCA, 0x6C, 0x72, 0x3F, 0xF3, 0xFC, 0x6B, 0xCB, 0x29, 0x3F, 0xCF, 0xFF, 0xC9, 0x72, 0x4C, 0xF7, 0xBA, 0xDC, 0x54,
-  0x3F, 0xDE, 0xD1, 0x9F, 0x60, 0xAA, 0x4F, 0x07, 0x4B, 0x5C, 0x2C, 0x6C, 0x7B, 0x44, 0xED, 0xA5, 0x33, 0x69, 0x21, 0x33, 0xE8, 0x1B, 0x5C, 0x6A, 0x03, 0x14,
-  0xBE, 0x46, 0x97, 0x1E, 0x77, 0xED, 0x2F, 0x3F, 0x9F, 0xC6, 0x93, 0x5D, 0x4E, 0x81, 0x9A, 0xC3, 0x0C, 0x25, 0x85, 0xC7, 0x07, 0xAF, 0xA5, 0xFE, 0xB2, 0xCD,
-  0xCF, 0xED, 0x83, 0xF3, 0x73, 0x1F, 0x01, 0x99, 0x38, 0x66, 0x65, 0xCB, 0x42, 0xD8, 0xC8, 0xAE, 0x2E, 0x1D, 0xB3, 0x51, 0xAB, 0x62, 0xBD, 0x57, 0xD6, 0x41,
-  0xBF, 0x7B, 0x74, 0xF2, 0xB8, 0xCC, 0x0A, 0x19, 0xAA, 0x61, 0x54, 0xBD, 0xD1, 0xF0, 0xE8, 0xF1, 0xD8, 0x95, 0x3B, 0x9F, 0xB3, 0x15, 0xAE, 0x6A, 0xA6, 0xC5,
-  0xC1, 0x6F, 0xE8, 0xA3, 0xB4, 0x3E, 0x69, 0x36, 0x5E, 0x85, 0x9D, 0xAB, 0xE9, 0x62, 0x20, 0xD1, 0xC5, 0xF8, 0x71, 0x99, 0x16, 0xE7, 0x48, 0xD5, 0xBA, 0x24,
-  0x1C, 0xDD, 0x13, 0x43, 0xF7, 0x61, 0x5A, 0x81, 0x1B, 0x18, 0x76, 0x65, 0xCB, 0x62, 0xD0, 0x60, 0x58, 0x3F, 0xE0, 0x81, 0xF6, 0x01, 0xF8, 0x6C, 0xD4, 0xB8,
-  0x44, 0xFF, 0xD5, 0x03, 0xD7, 0xA0, 0xFB, 0xC8, 0xC6, 0x43, 0xC6, 0x52, 0xAD, 0xD0, 0x35, 0x1E, 0x3E, 0x1E, 0xFB, 0x72, 0x37, 0x01, 0x5E, 0xAD, 0x1C, 0xBA,
-  0x18, 0x38, 0x86, 0x2E, 0x7A, 0xD4, 0xBC, 0x89, 0x85, 0x14, 0xD4, 0x18, 0x1C, 0x87, 0x0F, 0xBF, 0x7E, 0xFD, 0x8B, 0x84, 0xA7, 0x5A, 0x46, 0x36, 0x78, 0x2C,
-  0x41, 0x6C, 0x66, 0x28, 0xBF, 0x88, 0x8D, 0x22, 0x8B, 0x67, 0xF3, 0x0C, 0x16, 0xE6, 0x70, 0xEC, 0xA0, 0xD1, 0x0A, 0x86, 0xE8, 0xFC, 0xDE, 0x97, 0xEC, 0x42,
-  0xAE, 0x1E, 0x53, 0xBD, 0x62, 0x6A, 0x39, 0x4E, 0x55, 0x35, 0x71, 0x58, 0x7D, 0xF2, 0x8A, 0x1D, 0x34, 0xBB, 0xB8, 0xCA, 0x3B, 0xBF, 0xFF, 0x95, 0x55, 0xC1,
-  0x55, 0xD3, 0x6A, 0x4A, 0x15, 0x31, 0xBC, 0xF0, 0x4B, 0x11, 0x3A, 0xDF, 0xAD, 0x18, 0x7D, 0x39, 0xE2, 0xF1, 0x94, 0x34, 0x16, 0xC6, 0x0A, 0x9F, 0x30, 0x2E,
-  0x5B, 0xD4, 0x78, 0x83, 0x60, 0xE5, 0x6A, 0x1A, 0xC9, 0x9E, 0x1E, 0x77, 0x55, 0x63, 0x92, 0x7C, 0xB5, 0x24, 0x10, 0xDE, 0x9E, 0x5A, 0x86, 0x8F, 0x4F, 0xE3,
-  0xC3, 0xB1, 0xF6, 0x0A, 0x8E, 0xB5, 0xF7, 0xF6, 0x26, 0x7C, 0x37, 0xAE, 0xCC, 0x21, 0xE2, 0x3B, 0x9B, 0x22, 0x0C, 0x59, 0xDB, 0xD7, 0xE9, 0x86, 0x2E, 0xFE,
-  0x14, 0x16, 0x1C, 0xE3, 0x3E, 0xA6, 0xD1, 0xF0, 0xB8, 0xAB, 0x6B, 0x2C, 0x2B, 0xE6, 0xCF, 0x90, 0xF8, 0x9F, 0xE9, 0x06, 0xA7, 0x5E, 0x48, 0xA0, 0xCC, 0x01,
-  0xE2, 0xF4, 0x86, 0x04, 0x52, 0xFB, 0xAD, 0xB3, 0xEF, 0x68, 0x5B, 0x22, 0x3D, 0x21, 0x8E, 0xAE, 0xD4, 0x10, 0x12, 0x2F, 0xC3, 0x64, 0xED, 0x55, 0x9E, 0x86,
-  0x91, 0x0B, 0xA2, 0x27, 0x15, 0x04, 0xEE, 0xF3, 0xBA, 0x5F, 0x9E, 0xFA, 0x82, 0xA7, 0x9E, 0x1A, 0x4F, 0xFD, 0x1A, 0x3C, 0xF5, 0x1B, 0xE2, 0x69, 0x20, 0x78,
-  0xEA, 0xAB, 0xF1, 0x34, 0xA8, 0xC1, 0xD3, 0xA0, 0x21, 0x9E, 0x86, 0x82, 0xA7, 0x81, 0x1A, 0x4F, 0xC3, 0x1A, 0x3C, 0x0D, 0x1B, 0xE2, 0x69, 0x24, 0x78, 0x1A,
-  0xAA, 0xF1, 0x34, 0xAA, 0xC1, 0xD3, 0xA8, 0x21, 0x9E, 0xC6, 0x82, 0xA7, 0x91, 0x1A, 0x4F, 0xE3, 0x1A, 0x3C, 0x8D, 0x1B, 0xE2, 0xE9, 0x48, 0xF0, 0x34, 0x56,
-  0xE3, 0xE9, 0xA8, 0x06, 0x4F, 0x47, 0x0D, 0xF1, 0x74, 0x2C, 0x78, 0x3A, 0x52, 0xE3, 0xE9, 0xB8, 0x06, 0x4F, 0xC7, 0x0D, 0xF1, 0x74, 0x22, 0x78, 0x3A, 0x56,
-  0xE3, 0xE9, 0xA4, 0x06, 0x4F, 0x27, 0x0D, 0xF1, 0x84, 0x8B, 0x72, 0x8C, 0xA9, 0x13, 0xC5, 0x41, 0xB7, 0x5B, 0x83, 0x2B, 0xA3, 0x29, 0xAE, 0xC2, 0x54, 0xA2,
-  0xA7, 0x9A, 0x4B, 0xD4, 0x49, 0x26, 0xA6, 0x4D, 0xB1, 0x15, 0x65, 0x13, 0x8A, 0xE9, 0x44, 0xAF, 0x4E, 0x3E, 0x31, 0x6B, 0x8A, 0xAD, 0x30, 0xA1, 0xE8, 0x29,
-  0x66, 0x14, 0xBD, 0x3A, 0x29, 0x85, 0xD9, 0x14, 0x5B, 0x61, 0x4E, 0xD1, 0x53, 0x4C, 0x2A, 0x7A, 0x75, 0xB2, 0x0A, 0xD2, 0x14, 0x5B, 0x61, 0x5A, 0xD1, 0x53,
-  0xCC, 0x2B, 0x7A, 0x75, 0x12, 0x8B, 0x79, 0x53, 0x6C, 0x85, 0x99, 0x45, 0x4F, 0x31, 0xB5, 0xE8, 0xD5, 0xC8, 0x2D, 0x4E, 0xE4, 0x13, 0xB1, 0x7B, 0x65, 0x8B,
-  0x04, 0x7C, 0x8A, 0x1C, 0x4D, 0xDA, 0x94, 0x1E, 0x3D, 0xE1, 0x40, 0xF8, 0x6C, 0x14, 0x13, 0xC8, 0x85, 0xEB, 0xCC, 0xAD, 0x45, 0x58, 0x64, 0x78, 0x34, 0x4F,
-  0x49, 0xF8, 0xB1, 0xB7, 0xF2, 0x2A, 0x17, 0x1A, 0x3E, 0xBC, 0xBE, 0x2C, 0x57, 0x66, 0x88, 0xF7, 0xF2, 0x27, 0x2A, 0x32, 0x00, 0xD9, 0xFD, 0xF8, 0x27, 0x02,
-  0x94, 0xEA, 0x0A, 0x14, 0xA8, 0x4C, 0x45, 0x61, 0x14, 0xAF, 0x28, 0x8C, 0x95, 0x2B, 0x0A, 0x8C, 0xB8, 0xDD, 0xD4, 0x12, 0x00, 0xF7, 0x80, 0x7D, 0xD7, 0x40,
-  0x9D, 0xE9, 0x41, 0x75, 0xA6, 0x47, 0x65, 0x98, 0x1E, 0x54, 0x61, 0xBA, 0xC2, 0xD3, 0x8D, 0x8A, 0x72, 0x02, 0x7A, 0xBF, 0xB6, 0x6E, 0x88, 0xA9, 0xFD, 0xA2,
-  0x2E, 0xAA, 0x5E, 0x75, 0x51, 0x1D, 0x95, 0x11, 0x55, 0x6F, 0x87, 0xF6, 0x31, 0x12, 0x7C, 0xFF, 0xA8, 0xCE, 0xF7, 0xA8, 0x3A, 0xDF, 0x83, 0x32, 0x7C, 0x8F,
-  0x76, 0xC8, 0xF7, 0x50, 0xF0, 0xFD, 0x51, 0x9D, 0xEF, 0x61, 0x75, 0xBE, 0x87, 0x65, 0xF8, 0x1E, 0xEE, 0x90, 0xEF, 0x3E, 0x04, 0x9B, 0x1F, 0x3F, 0x6A, 0x3F,
-  0x2C, 0x3D, 0xE2, 0x2F, 0x8B, 0x2B, 0x71, 0x0C, 0xA2, 0xEA, 0xD8, 0x3E, 0x6A, 0x60, 0xEE, 0x86, 0x14, 0x0E, 0xE2, 0x3C, 0x15, 0xE6, 0xCD, 0x0C, 0x42, 0xE5,
-  0xC3, 0x41, 0x72, 0x9E, 0xE4, 0x33, 0xB7, 0x9E, 0x2A, 0x53, 0xBB, 0x8B, 0x61, 0xC7, 0xFA, 0xE4, 0xED, 0xA6, 0xC4, 0xF8, 0x76, 0x5C, 0xDD, 0x9E, 0xD5, 0x2B,
-  0xE6, 0x8C, 0xAE, 0x9D, 0xD9, 0xF3, 0x09, 0xE5, 0x19, 0xF2, 0x32, 0x5F, 0x41, 0xED, 0xD5, 0xAB, 0x10, 0xA3, 0x06, 0xAA, 0xE4, 0x18, 0xE9, 0x8F, 0x18, 0x3B,
-  0x3F, 0x22, 0x43, 0x1A, 0x64, 0x2C, 0x25, 0x06, 0xA3, 0xA3, 0x92, 0xDA, 0x3C, 0xAE, 0x18, 0x9D, 0x90, 0xC6, 0x9D, 0xA9, 0x13, 0xA7, 0x1E, 0x28, 0x80, 0x8F,
-  0x15, 0x04, 0x30, 0xAE, 0x2E, 0x80, 0x52, 0x99, 0x0B, 0xD2, 0xB8, 0x3B, 0x01, 0x74, 0x99, 0x00, 0x3E, 0x44, 0x6F, 0xA6, 0xCE, 0x31, 0xE8, 0x1A, 0x15, 0xA8,
-  0x51, 0x03, 0x6B, 0x24, 0x18, 0x69, 0x7B, 0xC2, 0xA2, 0x81, 0xA3, 0x72, 0x0A, 0xED, 0x97, 0xCD, 0xAF, 0xE4, 0xC5, 0x4F, 0x85, 0xFC, 0x7B, 0x97, 0x09, 0x56,
-  0xBF, 0x2B, 0x2C, 0xBA, 0xBC, 0x00, 0xBA, 0xD5, 0x05, 0xD0, 0x2B, 0x25, 0x80, 0xEE, 0xE3, 0x4A, 0xC6, 0xC7, 0xDB, 0x1F, 0x13, 0x2E, 0x96, 0x56, 0x59, 0xF7,
-  0x8F, 0x8D, 0x66, 0xFD, 0x32, 0xC2, 0xDA, 0xA9, 0xF7, 0x0F, 0x22, 0xCE, 0xB5, 0x5F, 0xB4, 0xE4, 0xD6, 0xD7, 0xBC, 0x38, 0x50, 0xBD, 0x08, 0x38, 0x6A, 0x60,
-  0xBD, 0x0A, 0x29, 0x3C, 0x91, 0x70, 0x56, 0x32, 0xC0, 0x9F, 0x54, 0x77, 0x87, 0x52, 0x1A, 0x46, 0x5A, 0x77, 0xA7, 0xE2, 0x51, 0x42, 0x10, 0xEC, 0x43, 0xE6,
-  0x2A, 0x2A, 0xAE, 0x5E, 0x39, 0x1C, 0x35, 0xB0, 0xD4, 0x85, 0x14, 0x1E, 0x4B, 0x38, 0x2B, 0xA9, 0xE2, 0xB2, 0x29, 0xE9, 0x71, 0xC5, 0xA9, 0x65, 0x6F, 0x97,
-  0x39, 0x29, 0x56, 0xBB, 0x63, 0x82, 0x88, 0x7F, 0x65, 0x22, 0x4F, 0xC1, 0xD5, 0x2B, 0xDE, 0xA3, 0x9A, 0xEB, 0xB3, 0xBB, 0x8B, 0xE4, 0x47, 0xB2, 0x4F, 0x90,
-  0x17, 0xDB, 0x41, 0xD9, 0x5C, 0xB6, 0x5B, 0x71, 0xE0, 0xDB, 0x69, 0x2A, 0x0B, 0xBD, 0x43, 0xD6, 0xB3, 0xCD, 0x7D, 0x8E, 0x09, 0x54, 0x5F, 0x79, 0x1B, 0x35,
-  0xB0, 0x3D, 0x04, 0x29, 0xEC, 0xEB, 0x93, 0x8F, 0x25, 0x99, 0xAA, 0x53, 0x3F, 0xA8, 0xBC, 0x3F, 0xA4, 0xB9, 0xD2, 0xFB, 0x6C, 0x75, 0x53, 0xBE, 0xF4, 0x7E,
-  0xF1, 0xEE, 0xE7, 0x72, 0xA5, 0xF7, 0x78, 0x2F, 0xCD, 0x95, 0xDE, 0xAB, 0xD9, 0x4C, 0xA9, 0x8D, 0xB2, 0xC0, 0x18, 0xBE, 0x3F, 0x62, 0x66, 0xF9, 0xB4, 0x4B,
-  0x10, 0x8C, 0xF6, 0x5E, 0x9C, 0x86, 0x22, 0x8A, 0x3D, 0xB1, 0x9F, 0x6C, 0x9F, 0x67, 0x3D, 0x83, 0x9C, 0xB0, 0xA0, 0xB6, 0x11, 0x76, 0xFB, 0x75, 0x28, 0x9D,
-  0x31, 0xFF, 0x10, 0x57, 0x8D, 0x47, 0xEB, 0xB3, 0x5E, 0x1A, 0xD0, 0x39, 0x2A, 0x89, 0x7B, 0xE7, 0x8F, 0xDC, 0x4F, 0x52, 0x8A, 0xEA, 0x51, 0xFD, 0xF4, 0xF0,
-  0x5C, 0xB9, 0x4E, 0x4E, 0xC1, 0xCA, 0x44, 0xF3, 0x41, 0xBC, 0xD4, 0xA2, 0x1E, 0xCD, 0x19, 0x79, 0xBB, 0x89, 0xE6, 0x88, 0x3B, 0xC1, 0x7B, 0x89, 0xAC, 0x86,
-  0xC1, 0x96, 0x13, 0x80, 0x7C, 0x13, 0x85, 0x82, 0x00, 0xB2, 0x24, 0x70, 0x2F, 0x22, 0xE8, 0x53, 0x09, 0xF4, 0x53, 0xDA, 0xCF, 0x08, 0xFC, 0xB4, 0x7D, 0xD5,
-  0xB8, 0x3F, 0x68, 0xA0, 0x36, 0x81, 0xE2, 0x4A, 0x70, 0x54, 0x52, 0xA7, 0xE5, 0x16, 0x07, 0x13, 0x3A, 0x2D, 0x67, 0xD4, 0x3B, 0x5B, 0x1D, 0x04, 0xE4, 0x03,
-  0x2A, 0x80, 0x81, 0xB2, 0x4A, 0xAB, 0x4F, 0x33, 0x07, 0x0D, 0xE4, 0x27, 0x28, 0xAD, 0x04, 0x47, 0x25, 0x55, 0x5A, 0x6E, 0xE9, 0x33, 0xA1, 0x52, 0xF5, 0xF9,
-  0x25, 0x27, 0x72, 0x67, 0x2A, 0x1D, 0x52, 0x01, 0x0C, 0x95, 0x55, 0x5A, 0x7D, 0xD6, 0x31, 0x68, 0x60, 0xF7, 0x2E, 0x4A, 0x2B, 0xC1, 0x51, 0x49, 0x95, 0x96,
-  0x5B, 0xB2, 0x4B, 0xA8, 0x54, 0x7D, 0x3E, 0xC9, 0x89, 0xDC, 0x99, 0x4A, 0x47, 0x54, 0x00, 0x23, 0x65, 0x95, 0x56, 0xAF, 0x14, 0x0C, 0x1A, 0x28, 0x06, 0xA1,
-  0xB4, 0x12, 0x1C, 0x95, 0x54, 0x69, 0xB9, 0xD5, 0xE7, 0x84, 0x4A, 0xD5, 0xD7, 0x39, 0x38, 0x91, 0x3B, 0x53, 0xE9, 0x98, 0x0A, 0x60, 0xAC, 0xAC, 0xD2, 0xEA,
-  0xFB, 0xAB, 0x06, 0x0D, 0xEC, 0xDD, 0x46, 0x69, 0x25, 0x38, 0x2A, 0xA9, 0xD2, 0x72, 0xA5, 0xDB, 0x84, 0x4A, 0xD5, 0x57, 0x6E, 0x38, 0x91, 0x3B, 0x53, 0xE9,
-  0x11, 0x15, 0xC0, 0x91, 0xB2, 0x4A, 0xAB, 0x6F, 0x5D, 0x1F, 0x34, 0x50, 0xCF, 0x43, 0x69, 0x25, 0x38, 0x2A, 0xA9, 0xD2, 0x72, 0x15, 0x9C, 0x84, 0x4A, 0xD5,
-  0xF7, 0x4E, 0x71, 0x22, 0x77, 0xA6, 0xD2, 0x63, 0x2A, 0x80, 0x63, 0x65, 0x95, 0x56, 0xDF, 0xB9, 0x3F, 0x68, 0x60, 0xE7, 0x3E, 0x4A, 0x2B, 0xC1, 0x51, 0x49,
-  0x95, 0x96, 0xAB, 0xCD, 0x26, 0x54, 0xAA, 0xBE, 0xDD, 0x89, 0x13, 0xB9, 0x33, 0x95, 0x9E, 0x50, 0x01, 0x9C, 0x28, 0xAB, 0xB4, 0xFA, 0x96, 0x81, 0x41, 0x03,
-  0x9B, 0x5F, 0x50, 0x5A, 0xDD, 0x38, 0x47, 0x25, 0x55, 0x5A, 0x6E, 0x81, 0x71, 0x90, 0xB1, 0xF5, 0x45, 0x41, 0xA5, 0x59, 0x0B, 0x8C, 0x8F, 0xA0, 0x7E, 0x67,
-  0x5C, 0x4F, 0x2B, 0x7C, 0xFA, 0xE5, 0xE5, 0x4F, 0xAF, 0xB2, 0x0B, 0xFB, 0x99, 0x55, 0xBC, 0x44, 0x5F, 0x8F, 0xBD, 0x8C, 0x17, 0x97, 0x17, 0x12, 0x0E, 0x5A,
-  0x66, 0x2F, 0x4D, 0xD4, 0xB6, 0x98, 0xCF, 0xB7, 0x34, 0x06, 0x5C, 0xC2, 0xD2, 0x06, 0xC3, 0xAE, 0x3C, 0x69, 0x29, 0xB0, 0x34, 0x4E, 0xE5, 0x6E, 0x82, 0x07,
-  0x22, 0x87, 0xB9, 0x38, 0xF2, 0xFE, 0xBD, 0xD2, 0x9A, 0x0E, 0x03, 0x48, 0x86, 0x8F, 0x61, 0xF7, 0x44, 0x31, 0x7E, 0x80, 0x0C, 0xB2, 0x36, 0xC6, 0xDF, 0x63,
-  0x00, 0x41, 0x1A, 0x07, 0x8C, 0xA9, 0x37, 0xCA, 0x4C, 0xA5, 0xAB, 0x00, 0xA5, 0x98, 0xCA, 0xAA, 0xEC, 0xDC, 0x33, 0x53, 0x43, 0xC6, 0x54, 0x8E, 0x93, 0xA6,
-  0x98, 0x4A, 0xCF, 0x83, 0x4B, 0x31, 0x95, 0x35, 0x11, 0x8E, 0x98, 0x7A, 0x0C, 0x81, 0x8E, 0xCC, 0x8C, 0xC5, 0xAC, 0x42, 0xA8, 0xBB, 0xBC, 0x38, 0x7C, 0xF9,
-  0xE6, 0x42, 0xA3, 0x4B, 0x9A, 0xAE, 0x5D, 0x32, 0xE2, 0x25, 0x3B, 0xFD, 0x53, 0xC5, 0x3C, 0x4A, 0x7A, 0x2C, 0xEA, 0xBD, 0xB9, 0x50, 0x0D, 0x78, 0x1C, 0xB2,
-  0x4C, 0xC8, 0x1B, 0x75, 0x07, 0x55, 0x2A, 0x84, 0x21, 0x91, 0x3B, 0x0A, 0x7A, 0x14, 0x7D, 0x3F, 0x92, 0xC1, 0x65, 0x39, 0x19, 0x94, 0xAA, 0x92, 0x26, 0x65,
-  0x50, 0x22, 0xEC, 0x0B, 0x22, 0x77, 0x29, 0x03, 0x8C, 0x92, 0x97, 0x17, 0xDA, 0xFB, 0xBF, 0x6B, 0x97, 0x37, 0x6B, 0xD7, 0xDF, 0x78, 0xA4, 0x30, 0xAA, 0x70,
-  0xB8, 0x64, 0x5C, 0x19, 0x8F, 0x46, 0x03, 0xD5, 0xC0, 0x32, 0xCA, 0x1E, 0x02, 0xE6, 0xDD, 0x7B, 0x8C, 0x97, 0x94, 0xD0, 0x61, 0xC8, 0xE0, 0xF7, 0x04, 0x34,
-  0xAD, 0x14, 0x37, 0x39, 0x60, 0x92, 0xC3, 0x5E, 0x17, 0xB7, 0x57, 0x2B, 0x32, 0x28, 0xCF, 0x28, 0x07, 0xF7, 0x3A, 0x1C, 0x50, 0x2A, 0x47, 0x21, 0x7B, 0x1F,
-  0x7F, 0xF8, 0xA0, 0xC6, 0x58, 0xBA, 0x8E, 0x56, 0x4E, 0x75, 0x59, 0x8F, 0x8C, 0xDE, 0xD3, 0xA0, 0x20, 0xBD, 0x71, 0x76, 0x08, 0xA1, 0x77, 0x1B, 0x26, 0x43,
-  0x92, 0x67, 0x73, 0x6B, 0x01, 0x76, 0x2C, 0xEF, 0x83, 0x8A, 0x96, 0xBD, 0xEC, 0x14, 0xBF, 0x51, 0xD9, 0x9E, 0x41, 0xF4, 0x07, 0x93, 0x40, 0xA7, 0x13, 0x02,
-  0x5F, 0x19, 0x0B, 0x12, 0x5D, 0xD7, 0x58, 0x6C, 0xCF, 0x8B, 0xD9, 0x06, 0x43, 0x68, 0x5C, 0x11, 0xFE, 0x41, 0x4D, 0x6D, 0xE9, 0x91, 0xF9, 0xB9, 0xFE, 0x45,
-  0x88, 0x93, 0x3F, 0x95, 0x87, 0x4D, 0x74, 0xCD, 0x74, 0xAF, 0x1D, 0xDB, 0x35, 0x70, 0x3C, 0x30, 0xD6, 0x01, 0x50, 0xDA, 0xF9, 0x6D, 0x8D, 0x2F, 0xBE, 0x32,
-  0xF0, 0x21, 0x2E, 0x23, 0xA7, 0x9F, 0x98, 0x55, 0xCC, 0x6C, 0xD7, 0x17, 0xB3, 0x39, 0x3C, 0x0C, 0x3F, 0xC0, 0xF9, 0x3F, 0xFF, 0x5D, 0xB4, 0x83, 0xC0, 0x5A,
-  0x2D, 0x62, 0x02, 0xD0, 0x35, 0xDF, 0x9B, 0x9D, 0xEB, 0x40, 0xA9, 0xE7, 0xFA, 0xBE, 0xEB, 0x59, 0x0B, 0x2B, 0x43, 0x3B, 0x59, 0xD2, 0x3E, 0x94, 0x89, 0x3B,
-  0xD5, 0x58, 0xA2, 0xF8, 0x33, 0x7F, 0xE6, 0x59, 0xEB, 0x60, 0xF2, 0xC4, 0x74, 0x67, 0x9B, 0x15, 0x71, 0x82, 0x8E, 0x61, 0x9A, 0x97, 0x57, 0x70, 0xF0, 0x2D,
-  0x7E, 0xAC, 0x0D, 0x24, 0xDF, 0xDA, 0x7B, 0xFD, 0x8F, 0x77, 0x38, 0x3A, 0xE3, 0x35, 0x90, 0x17, 0x31, 0xF7, 0x0E, 0xB4, 0xF9, 0xC6, 0x61, 0x03, 0x64, 0x8B,
-  0x60, 0xDB, 0x7D, 0xED, 0x0F, 0xC0, 0x78, 0x65, 0x78, 0xDA, 0xD4, 0xF0, 0xC9, 0x5B, 0xD7, 0x0F, 0xB4, 0x73, 0x2D, 0xC4, 0x68, 0xBB, 0x33, 0xBA, 0x9D, 0xA3,
-  0xC3, 0xF8, 0xE2, 0x2D, 0x19, 0xE3, 0x3F, 0x7A, 0x36, 0x34, 0x0D, 0xA1, 0x9E, 0x6B, 0x7B, 0xA7, 0xC7, 0xBD, 0x3D, 0xB4, 0xDD, 0xB0, 0x8B, 0x39, 0x81, 0xE8,
-  0x0F, 0xED, 0x5A, 0x1B, 0xCF, 0x3E, 0xD0, 0x66, 0xD3, 0xFD, 0x3F, 0x28, 0xF5, 0xF4, 0x32, 0x5E, 0xDB, 0xE7, 0xCC, 0x74, 0x82, 0x25, 0x71, 0x5A, 0x11, 0x65,
-  0x1E, 0xF1, 0xD7, 0xAE, 0xE3, 0x13, 0x46, 0x1C, 0xFB, 0x59, 0xF3, 0xE8, 0x7A, 0xC7, 0x0F, 0x8C, 0x60, 0xE3, 0x6B, 0x4F, 0xCF, 0xCF, 0xB5, 0x7E, 0xB7, 0x1B,
-  0x6F, 0xA6, 0x41, 0x37, 0xE9, 0x76, 0x07, 0x5A, 0xEA, 0xC2, 0x0F, 0xE4, 0x26, 0xD8, 0xFF, 0x2A, 0x84, 0xB9, 0xD3, 0x88, 0xED, 0x93, 0x04, 0x92, 0x10, 0x00,
-  0x5F, 0x27, 0xD7, 0xDA, 0x4F, 0x12, 0xD8, 0x32, 0x8D, 0xC0, 0xD8, 0xFF, 0x23, 0xA1, 0x2F, 0xE8, 0x15, 0x28, 0x39, 0xD0, 0xE8, 0xAD, 0xAF, 0x62, 0xB7, 0xEE,
-  0xF6, 0x3B, 0x20, 0x43, 0xE0, 0x37, 0x84, 0x26, 0x9E, 0x97, 0xA4, 0x98, 0x42, 0xB7, 0x7B, 0x07, 0x1A, 0xDE, 0x49, 0xC2, 0xC6, 0x88, 0x7C, 0x22, 0xAE, 0x09,
-  0xA1, 0xE5, 0xA3, 0x95, 0xA0, 0x64, 0xE8, 0xEE, 0x12, 0x2A, 0x82, 0x38, 0xF4, 0x3D, 0x59, 0x80, 0xC4, 0x16, 0x07, 0x3C, 0x2C, 0x1D, 0xD0, 0x98, 0x74, 0xC0,
-  0xC2, 0x59, 0x4C, 0x6B, 0xE0, 0xD0, 0xBE, 0x6B, 0x13, 0xB0, 0x89, 0x45, 0x6B, 0x8F, 0x7F, 0x0A, 0x14, 0xEC, 0x69, 0xAF, 0x7B, 0xB3, 0xF7, 0x1C, 0xC0, 0x3B,
-  0x81, 0xFB, 0x21, 0xF0, 0x2C, 0x67, 0xD1, 0xEA, 0x8D, 0xF7, 0x23, 0x5C, 0xF4, 0x36, 0x22, 0x4C, 0xDD, 0xA7, 0xD7, 0x69, 0x17, 0xE9, 0x1B, 0x2D, 0x7E, 0xFD,
-  0xF9, 0xDE, 0xFE, 0x1E, 0x27, 0x9D, 0x9E, 0x83, 0xB1, 0xB5, 0xD8, 0xC1, 0x33, 0x4A, 0xE1, 0xBE, 0x76, 0x76, 0xC6, 0xBB, 0x61, 0xAD, 0xF0, 0x22, 0x34, 0xA2,
-  0x7F, 0x52, 0xB7, 0x42, 0x43, 0xFC, 0xF5, 0xCB, 0x3F, 0x84, 0xC5, 0xDE, 0x1D, 0x02, 0xD5, 0x2F, 0x30, 0x2E, 0x7F, 0xF9, 0x07, 0xFC, 0x7F, 0xF7, 0x8C, 0x86,
-  0xE2, 0x2F, 0xFF, 0xC0, 0x3F, 0x77, 0xCF, 0xA0, 0x27, 0x38, 0xA6, 0xFD, 0xDD, 0xFD, 0x4A, 0xA5, 0xB0, 0x2D, 0xBB, 0x45, 0xA6, 0xEC, 0x42, 0xA1, 0x95, 0xA6,
-  0x69, 0x91, 0x43, 0xD4, 0xAF, 0x91, 0xF7, 0xB6, 0x66, 0xAE, 0x09, 0xCA, 0x09, 0xC0, 0x8E, 0x85, 0xCA, 0x6D, 0x50, 0x89, 0x10, 0x54, 0x57, 0xA8, 0xDC, 0x9A,
-  0xD3, 0x96, 0x1A, 0x77, 0x94, 0xC8, 0x3C, 0x44, 0xCB, 0xB5, 0xE1, 0xF9, 0xE4, 0x1B, 0x27, 0x68, 0x05, 0x09, 0x97, 0xC8, 0x90, 0xF8, 0x64, 0x92, 0x60, 0x01,
-  0x7F, 0x00, 0x07, 0xED, 0xF6, 0xB8, 0xD2, 0x42, 0x53, 0x7B, 0x12, 0x5A, 0x61, 0x44, 0x29, 0xBB, 0x99, 0x61, 0x85, 0x3F, 0xCF, 0xEC, 0xCF, 0xAD, 0x1B, 0xF8,
-  0x2F, 0x1D, 0x28, 0xB6, 0x44, 0x84, 0x8D, 0x5E, 0xE0, 0x7F, 0x20, 0x17, 0xFC, 0x93, 0xA9, 0x1F, 0xC0, 0xFA, 0xDE, 0xB6, 0x5B, 0xEC, 0xB3, 0x5F, 0xA0, 0x9A,
-  0x0D, 0x04, 0x21, 0xFF, 0x16, 0xC3, 0x81, 0xEB, 0x06, 0x9F, 0x0E, 0xB4, 0xB5, 0x07, 0x84, 0xD1, 0x2F, 0x7D, 0xC0, 0x31, 0x20, 0x22, 0x0E, 0xFB, 0x5B, 0x48,
-  0xC1, 0xDA, 0xB6, 0x5F, 0x30, 0xAC, 0x40, 0x02, 0x3B, 0x00, 0x4D, 0x6D, 0xD0, 0x62, 0xE0, 0xFF, 0xBB, 0x67, 0xD0, 0x09, 0x1C, 0xC2, 0xFF, 0x77, 0xCF, 0xB0,
-  0x2B, 0xD4, 0x25, 0xF6, 0x78, 0xF7, 0x0C, 0x7A, 0x84, 0x13, 0xF8, 0x1F, 0xDA, 0x60, 0xBF, 0xD8, 0x0A, 0xFF, 0xC2, 0x1D, 0xDA, 0x3F, 0xDE, 0xA4, 0x07, 0xEC,
-  0x02, 0x3F, 0xCD, 0x63, 0x90, 0xBD, 0xE9, 0xBE, 0x45, 0xDF, 0x3C, 0xFE, 0xE9, 0x06, 0xD8, 0xA1, 0x07, 0xB7, 0xE0, 0xF8, 0x8E, 0x89, 0xE7, 0xF8, 0xE7, 0x56,
-  0x98, 0x27, 0x5E, 0xE0, 0x47, 0x70, 0x8D, 0xBE, 0x9D, 0x15, 0x2F, 0xB1, 0x03, 0x6C, 0x45, 0xDF, 0xA5, 0x49, 0x5B, 0xB1, 0x23, 0xB8, 0xC6, 0xDF, 0xC0, 0x78,
-  0xA0, 0xF1, 0x77, 0xFC, 0x15, 0x0A, 0x27, 0x7A, 0x07, 0xDF, 0x0B, 0xFF, 0x06, 0x19, 0x64, 0xA4, 0xA1, 0x54, 0xC2, 0xB3, 0xDB, 0xBB, 0x67, 0x04, 0xEF, 0x51,
-  0x22, 0xE1, 0xF8, 0x96, 0x1F, 0xC3, 0x75, 0xA0, 0x0F, 0xEF, 0x08, 0x82, 0xE9, 0x85, 0xDB, 0xE8, 0x02, 0xB4, 0x08, 0xF0, 0x3E, 0x27, 0x1E, 0xCE, 0x6E, 0xC3,
-  0x33, 0x84, 0xA6, 0xB0, 0x9C, 0x0D, 0x38, 0xBD, 0x8D, 0x4E, 0xE1, 0x2E, 0xF2, 0x82, 0x0A, 0xE0, 0x3C, 0xDD, 0x3D, 0xE3, 0x3C, 0xA1, 0x16, 0xD9, 0x51, 0x5A,
-  0xD4, 0x18, 0xF4, 0x02, 0x1E, 0x24, 0x5F, 0xB1, 0x1C, 0x24, 0x36, 0x3C, 0x42, 0x00, 0xB8, 0xB4, 0x09, 0x1E, 0xBE, 0xBA, 0xFD, 0xC6, 0x6C, 0xED, 0xF1, 0x4F,
-  0xB7, 0xEE, 0x61, 0x88, 0x8E, 0xC3, 0x74, 0x5C, 0x67, 0x66, 0x5B, 0x33, 0x8C, 0x04, 0xAD, 0x7D, 0xED, 0x7C, 0xC2, 0xC3, 0x34, 0x7A, 0x2C, 0x34, 0x8F, 0x7B,
-  0x61, 0x26, 0x6A, 0x8F, 0x7F, 0x7C, 0x74, 0x6F, 0xBF, 0x43, 0x1D, 0x8D, 0x3B, 0x13, 0xA2, 0xE0, 0x31, 0x46, 0x0D, 0x07, 0x36, 0x96, 0xE0, 0xD8, 0x0A, 0x07,
-  0xB9, 0x48, 0x68, 0xEB, 0x18, 0x16, 0x8A, 0x26, 0x3E, 0x92, 0x74, 0x53, 0x83, 0x48, 0x4E, 0xD8, 0x12, 0x11, 0xEA, 0x69, 0x3A, 0x42, 0x81, 0xAA, 0xBC, 0xA0,
-  0xB5, 0x77, 0xE9, 0x79, 0xAE, 0xF7, 0xAF, 0xBD, 0xE7, 0xD8, 0xE8, 0xF9, 0xDE, 0xBF, 0x4F, 0xB5, 0xBD, 0xE7, 0xF1, 0x50, 0x75, 0x97, 0x8E, 0x29, 0x4C, 0x63,
-  0x0B, 0x45, 0x8D, 0x2D, 0x62, 0x1A, 0x5B, 0xDC, 0xAF, 0xC6, 0xE2, 0x9F, 0x8C, 0xAD, 0xA3, 0xB5, 0xF8, 0x27, 0x5A, 0x73, 0x34, 0x57, 0x08, 0xCF, 0x95, 0xC6,
-  0xB5, 0xB5, 0x90, 0x69, 0xAB, 0x8A, 0x9A, 0xD8, 0x18, 0x0E, 0xDE, 0x43, 0xBC, 0xB7, 0x3F, 0xBC, 0xFB, 0x16, 0xC7, 0x02, 0xB9, 0xCA, 0x42, 0x8D, 0xA5, 0xB3,
-  0x2D, 0x09, 0x06, 0x4C, 0x0E, 0x12, 0x23, 0x53, 0x22, 0x49, 0x78, 0xBE, 0xA7, 0xB5, 0x28, 0x4A, 0x4C, 0x11, 0x0A, 0x0C, 0x81, 0x8F, 0x2C, 0x6A, 0xBE, 0x8B,
-  0xA3, 0x89, 0x70, 0xDE, 0x08, 0x2A, 0xC7, 0x16, 0x10, 0x40, 0x49, 0x89, 0x0C, 0xF3, 0x96, 0xC3, 0xC4, 0x06, 0xBD, 0xC6, 0x5D, 0x84, 0xFA, 0xAB, 0xAF, 0x1A,
-  0xD4, 0x44, 0x4C, 0x8F, 0x62, 0x9B, 0x5F, 0x28, 0x1D, 0x1E, 0xF9, 0x95, 0x04, 0xC4, 0x3F, 0x05, 0x22, 0x31, 0x70, 0x3E, 0x62, 0x94, 0xC0, 0x72, 0x2B, 0xC1,
-  0x42, 0x47, 0x1A, 0x25, 0x1C, 0xF4, 0xF3, 0x11, 0x19, 0x18, 0xD4, 0xA8, 0xA0, 0xDF, 0x6B, 0x90, 0x60, 0x10, 0x63, 0x9A, 0x12, 0x12, 0xF1, 0xAD, 0x81, 0x6C,
-  0x3C, 0x6A, 0xC4, 0x88, 0x37, 0xFC, 0x4B, 0xF0, 0xF0, 0x31, 0x54, 0x09, 0x0D, 0x7F, 0x3B, 0x7D, 0x26, 0x16, 0x35, 0x62, 0xF8, 0x0B, 0xE1, 0x65, 0x3C, 0xF1,
-  0x31, 0x5B, 0x8D, 0x27, 0xFE, 0x1E, 0xF3, 0x6C, 0x3C, 0x8A, 0xB2, 0xE1, 0xEF, 0x0E, 0x97, 0x59, 0x1D, 0x4B, 0x11, 0x72, 0x1D, 0x83, 0x35, 0x01, 0x60, 0x5E,
-  0x96, 0x7E, 0xD1, 0x3B, 0xED, 0x46, 0x18, 0x78, 0x46, 0x91, 0x87, 0x81, 0x37, 0x49, 0x63, 0x10, 0xD1, 0xE1, 0x01, 0x72, 0xBB, 0x87, 0x88, 0x42, 0x90, 0xA3,
-  0xAB, 0x45, 0x21, 0x48, 0xBB, 0x45, 0xF8, 0x09, 0x61, 0x32, 0xC2, 0x0F, 0x2D, 0x68, 0xB0, 0x2F, 0x18, 0xE7, 0xC9, 0x3F, 0xFC, 0x20, 0xB0, 0x4C, 0x89, 0x88,
-  0x03, 0xD2, 0x79, 0x25, 0x4B, 0xE2, 0xDF, 0xBE, 0x4D, 0x19, 0x12, 0x2D, 0x96, 0xDC, 0xFA, 0x6A, 0xA1, 0xEB, 0xD6, 0xCF, 0xC0, 0x40, 0xE7, 0x0E, 0x6A, 0xB9,
-  0x19, 0xFF, 0x58, 0xAC, 0x04, 0x09, 0xCC, 0x39, 0x94, 0x50, 0xF0, 0x2F, 0x66, 0xCA, 0x18, 0xA1, 0x1F, 0x54, 0x54, 0x62, 0x45, 0x7C, 0x3C, 0x51, 0x46, 0x07,
-  0x9D, 0xDE, 0xE4, 0x29, 0x85, 0x7F, 0xA2, 0x2E, 0x4B, 0x23, 0x6B, 0xD5, 0x21, 0x57, 0x7C, 0x8E, 0x4D, 0x32, 0xEC, 0x56, 0x9C, 0x15, 0x3E, 0xCC, 0x10, 0xBD,
-  0xF8, 0x28, 0xE6, 0xE2, 0xC4, 0x96, 0xA6, 0xA2, 0xC4, 0xEE, 0x18, 0x01, 0x24, 0x47, 0xD3, 0x4D, 0x40, 0xFC, 0x0E, 0xD6, 0x0F, 0x42, 0xE1, 0x6C, 0xDD, 0xEA,
-  0x38, 0x40, 0x00, 0x45, 0xB8, 0x1F, 0x8F, 0x55, 0x2C, 0x70, 0x6C, 0xE1, 0x62, 0x97, 0xB3, 0xD0, 0xB1, 0xBB, 0x19, 0x18, 0x79, 0x7A, 0x9B, 0x84, 0xC0, 0x8B,
-  0x59, 0xD8, 0x68, 0x8D, 0x28, 0x86, 0xAB, 0x3F, 0x1A, 0x6D, 0x27, 0xB9, 0xBC, 0x03, 0xB6, 0xAC, 0x84, 0x02, 0xE9, 0x60, 0x89, 0x3E, 0x2A, 0x7B, 0xCD, 0x60,
-  0x16, 0xAA, 0xED, 0x89, 0x35, 0xA5, 0xBD, 0xD3, 0xAD, 0x7A, 0x06, 0x40, 0x70, 0xAB, 0xD2, 0x5E, 0x30, 0x1A, 0x4F, 0xA3, 0x62, 0x89, 0xA6, 0x4D, 0x3D, 0x62,
-  0x7C, 0xFE, 0x2A, 0x81, 0x8C, 0x56, 0xFF, 0x43, 0x4C, 0xEC, 0x1A, 0x16, 0x05, 0x53, 0x97, 0xD8, 0x13, 0x37, 0x6D, 0xD7, 0x21, 0xF2, 0x5E, 0x13, 0xD5, 0x11,
-  0xDE, 0x11, 0x3F, 0x33, 0xC9, 0xDC, 0xD8, 0xD8, 0x41, 0x04, 0xE6, 0x91, 0x60, 0xE3, 0x39, 0xBC, 0x5A, 0xB2, 0x3D, 0xB9, 0x92, 0x96, 0xE9, 0x1A, 0xB4, 0xCD,
-  0xC3, 0x43, 0xED, 0x65, 0x10, 0x18, 0xA0, 0x00, 0x5C, 0x66, 0x5D, 0xA2, 0x7C, 0x34, 0x83, 0x17, 0x7C, 0x5D, 0x0F, 0x8D, 0x12, 0xEB, 0xCF, 0x1E, 0x70, 0x4D,
-  0xBD, 0xD1, 0x07, 0x10, 0xE1, 0xA4, 0x14, 0x55, 0xE7, 0x3F, 0x1B, 0xE2, 0xDD, 0x7E, 0xA0, 0x02, 0x73, 0xBD, 0x97, 0xE0, 0x8B, 0x7B, 0x9D, 0x68, 0xA9, 0x64,
-  0x8F, 0xD5, 0x37, 0x3B, 0x80, 0xEA, 0x12, 0xFA, 0x00, 0x1D, 0x47, 0x36, 0xCF, 0xB8, 0x09, 0xF5, 0xAE, 0x9D, 0x9F, 0x9F, 0x73, 0x65, 0xA4, 0x0B, 0xAA, 0xD0,
-  0xC2, 0x75, 0x3E, 0x93, 0xDB, 0xCD, 0x1A, 0xC4, 0x1F, 0x95, 0x48, 0x53, 0x45, 0x5B, 0x2E, 0x1D, 0xD2, 0x81, 0x96, 0x17, 0xBC, 0x4C, 0xD6, 0x1B, 0x48, 0x1A,
-  0x45, 0x2A, 0xA0, 0xD6, 0x89, 0x9E, 0xF8, 0xD5, 0x56, 0xA3, 0xBB, 0x27, 0xF2, 0x33, 0x49, 0x79, 0x99, 0x13, 0xC8, 0x85, 0x27, 0x86, 0xAE, 0x54, 0x0F, 0x4F,
-  0x92, 0xA8, 0xEE, 0xF6, 0x9F, 0x44, 0x91, 0x61, 0xB3, 0x36, 0x8D, 0x80, 0x24, 0x83, 0x43, 0x68, 0x0B, 0xE2, 0xE6, 0xCA, 0x0D, 0x48, 0x2A, 0x62, 0x58, 0x8E,
-  0x15, 0x58, 0x86, 0xFD, 0x31, 0xB2, 0xC6, 0x9D, 0xBA, 0xBF, 0xC4, 0xC7, 0x4B, 0xF8, 0xFF, 0x56, 0x85, 0x57, 0xAD, 0x2A, 0xB9, 0x65, 0x21, 0x61, 0x3C, 0x88,
-  0xAC, 0x24, 0x2E, 0x87, 0x44, 0x58, 0xE0, 0xF7, 0x45, 0x4F, 0x4F, 0x9F, 0xD2, 0xA3, 0x27, 0xA1, 0xD2, 0x44, 0xF4, 0x38, 0xD7, 0xA2, 0x1B, 0x29, 0x05, 0x6F,
-  0xE3, 0x4E, 0xE1, 0x10, 0xC8, 0x63, 0x18, 0x98, 0x6F, 0x85, 0xEA, 0x5D, 0xC3, 0x54, 0x17, 0x6D, 0xE1, 0xFF, 0xA3, 0xFE, 0x23, 0x8A, 0xFA, 0xBB, 0x0B, 0xF1,
-  0x39, 0xB6, 0x9D, 0xF2, 0x00, 0x06, 0x27, 0x5F, 0x74, 0x79, 0xBE, 0x77, 0xA0, 0xC9, 0x57, 0x55, 0x52, 0x69, 0xC5, 0xD2, 0x32, 0x19, 0xC9, 0x91, 0x5D, 0xA1,
-  0x84, 0x70, 0x61, 0x14, 0x97, 0x0E, 0x71, 0x1D, 0xB1, 0xB5, 0xC7, 0x56, 0x6D, 0x69, 0x34, 0xBE, 0x8B, 0x12, 0x92, 0xA5, 0x7B, 0x9D, 0x07, 0xE9, 0x41, 0xCC,
-  0xB9, 0x22, 0x29, 0xE0, 0x10, 0xDA, 0xB4, 0x7C, 0x63, 0x6A, 0x17, 0x77, 0xCD, 0xDB, 0x99, 0x7C, 0x28, 0x80, 0x06, 0xE2, 0x0A, 0x80, 0x06, 0x1E, 0xF5, 0x99,
-  0x18, 0x5A, 0xE2, 0x14, 0x61, 0x15, 0x64, 0xE5, 0x22, 0x9E, 0x1B, 0xE0, 0xC4, 0x49, 0xCC, 0x2C, 0x90, 0x96, 0x08, 0xB1, 0xF1, 0xCB, 0x00, 0x91, 0x3C, 0x3D,
-  0xD7, 0x9C, 0x8D, 0x6D, 0x83, 0x05, 0x22, 0x0B, 0x60, 0x81, 0xF1, 0xBB, 0xD2, 0x00, 0xFD, 0xE7, 0x8D, 0x66, 0x21, 0xE5, 0x09, 0x09, 0x3C, 0x7B, 0x96, 0xC4,
-  0x86, 0xCB, 0xB7, 0x2C, 0x35, 0x0F, 0x7B, 0x63, 0xED, 0xD9, 0xDB, 0x74, 0xA3, 0x51, 0x96, 0x93, 0x04, 0x43, 0xF5, 0xD3, 0x84, 0xE0, 0x63, 0x19, 0x0E, 0x10,
-  0x62, 0x99, 0x54, 0x40, 0xB8, 0x49, 0x43, 0xDF, 0x5A, 0xE9, 0x7A, 0x41, 0xAD, 0xBE, 0x45, 0xF8, 0x1E, 0x9D, 0x7D, 0x90, 0x3F, 0x1A, 0x73, 0x74, 0x41, 0x64,
-  0x3B, 0x61, 0x57, 0x71, 0x8C, 0x8B, 0x04, 0x46, 0x64, 0x2C, 0x45, 0x37, 0xFE, 0x68, 0x07, 0xD0, 0x14, 0x77, 0xC8, 0xC4, 0x06, 0xEF, 0xED, 0xD1, 0x9F, 0x76,
-  0xBC, 0xDD, 0x30, 0x97, 0x82, 0xEB, 0xE9, 0xA7, 0x05, 0x34, 0x97, 0x31, 0x46, 0xD1, 0x5D, 0x4F, 0x91, 0x25, 0x4A, 0x02, 0x1C, 0xE6, 0xA1, 0x9A, 0x1B, 0x33,
-  0xF2, 0xC9, 0x23, 0x33, 0x77, 0xE1, 0x58, 0xBF, 0x13, 0x19, 0x42, 0xE6, 0x50, 0x2D, 0xE2, 0x78, 0xAE, 0x98, 0x66, 0x23, 0x72, 0xEE, 0x2B, 0xC9, 0xEB, 0x99,
-  0x3D, 0x69, 0x3A, 0xB8, 0xD5, 0x27, 0x0B, 0x37, 0x1F, 0xF8, 0x56, 0x70, 0xBB, 0xDD, 0xCF, 0x44, 0x6B, 0xF7, 0x04, 0xF5, 0xD0, 0xF4, 0x0D, 0x6E, 0xD0, 0x09,
-  0x79, 0x08, 0x2F, 0x24, 0x93, 0x50, 0xE1, 0x9E, 0xE1, 0x0A, 0x58, 0xDC, 0x5E, 0xD8, 0x50, 0x19, 0x8D, 0x93, 0x91, 0x41, 0xDE, 0xD3, 0xC8, 0xD1, 0xC3, 0x61,
-  0x43, 0x1A, 0xDF, 0x6B, 0x0E, 0x1A, 0x39, 0x38, 0xD9, 0xC6, 0x97, 0x34, 0xD2, 0xCD, 0x74, 0x65, 0x05, 0x12, 0x84, 0x7B, 0xBD, 0xBD, 0x32, 0xE3, 0x4F, 0xDC,
-  0x5B, 0x59, 0xC4, 0xA3, 0xA9, 0x39, 0x20, 0x4A, 0xAC, 0xE8, 0xCD, 0xD8, 0x06, 0xCF, 0x17, 0x30, 0xFD, 0xC6, 0x75, 0x3A, 0x54, 0x70, 0x6A, 0x81, 0x9C, 0xA1,
-  0x60, 0xFB, 0x3A, 0x28, 0x8A, 0xE4, 0xCE, 0x0E, 0xB1, 0x9B, 0x22, 0x99, 0xC9, 0xC7, 0x37, 0x14, 0xFC, 0xEA, 0x11, 0x80, 0xF3, 0xB1, 0x9A, 0xA8, 0x7D, 0xF9,
-  0x07, 0x45, 0x71, 0xA7, 0xCD, 0x21, 0x5A, 0xF8, 0x4B, 0x62, 0xD2, 0xCA, 0x57, 0xB0, 0xF1, 0x4F, 0x35, 0x5C, 0x14, 0x4F, 0xEC, 0xE4, 0xB8, 0xFB, 0x35, 0xB4,
-  0x90, 0x70, 0xB0, 0x29, 0x9C, 0x6C, 0xD0, 0x0D, 0x3F, 0xF9, 0xF3, 0x0C, 0x96, 0x9E, 0x4B, 0x0A, 0x4B, 0xF8, 0x63, 0x91, 0xC4, 0xEE, 0x40, 0x4E, 0x03, 0xDD,
-  0x7C, 0x07, 0xD9, 0x4B, 0xCA, 0x4C, 0xF7, 0xF9, 0x34, 0x09, 0x34, 0x60, 0x8A, 0x90, 0xC7, 0x74, 0x84, 0x93, 0x21, 0x26, 0xA6, 0x84, 0x84, 0x19, 0x33, 0x9C,
-  0x97, 0xE2, 0xDD, 0x30, 0x3C, 0x0B, 0x08, 0x65, 0xF1, 0x9B, 0x0F, 0x93, 0x9B, 0xFD, 0x27, 0xA1, 0x18, 0xB6, 0x71, 0x60, 0x07, 0x31, 0x04, 0x09, 0x11, 0x65,
-  0x89, 0x89, 0x1B, 0x4D, 0x72, 0x5E, 0x96, 0x23, 0x33, 0xF6, 0x8B, 0x8D, 0x99, 0x74, 0xC0, 0xA4, 0x3D, 0xFF, 0x8B, 0x1A, 0xCD, 0xBF, 0x0F, 0xD8, 0x20, 0x1B,
-  0x8B, 0x79, 0xFB, 0x65, 0x08, 0xDA, 0x9A, 0x24, 0x16, 0x12, 0x73, 0x6F, 0xE9, 0xB2, 0xF8, 0x41, 0x80, 0xA3, 0xF8, 0x20, 0x29, 0xDD, 0x9A, 0x26, 0xC6, 0x73,
-  0xBA, 0x90, 0x41, 0x89, 0x6C, 0x62, 0x73, 0x3C, 0x21, 0x1E, 0x69, 0x3E, 0x97, 0x29, 0x2E, 0x66, 0x5F, 0xCC, 0x61, 0xAF, 0x2C, 0x72, 0x9D, 0x5B, 0x37, 0xA5,
-  0x7B, 0xB5, 0xA8, 0xBC, 0x22, 0x80, 0x8B, 0x70, 0x6F, 0x5E, 0x21, 0x64, 0xB4, 0x8F, 0x2F, 0x86, 0x83, 0x6E, 0xD2, 0x53, 0x5B, 0x5C, 0xA5, 0x4D, 0x13, 0xA0,
-  0x88, 0xB5, 0x18, 0x56, 0xEC, 0xDB, 0x4E, 0x93, 0x1F, 0x1F, 0x7C, 0xF2, 0xE0, 0xE9, 0x28, 0xC7, 0x1A, 0xC7, 0xA0, 0xA9, 0xE7, 0x17, 0x03, 0xC7, 0x77, 0x04,
-  0xC6, 0x69, 0x37, 0xAE, 0x14, 0x80, 0xA3, 0x6D, 0x8C, 0x31, 0x50, 0x31, 0x9E, 0xE5, 0x01, 0x42, 0x1B, 0xB6, 0x4D, 0x75, 0x2F, 0xA6, 0x5F, 0x3F, 0x70, 0xD7,
-  0x1F, 0x28, 0x21, 0xA9, 0x40, 0x74, 0x4D, 0x17, 0x07, 0x3A, 0x78, 0xBF, 0xC5, 0xD3, 0xA4, 0xB8, 0x6C, 0x93, 0xEB, 0xA9, 0x1F, 0x70, 0xE5, 0x40, 0x63, 0x78,
-  0xF6, 0x92, 0x39, 0x2E, 0x5D, 0x54, 0x90, 0xF6, 0x80, 0x96, 0xD2, 0xF1, 0xBD, 0x19, 0x1B, 0x0E, 0xC2, 0x4D, 0x7F, 0x18, 0xAD, 0xF0, 0xF0, 0x57, 0xD6, 0x27,
-  0x0E, 0xDF, 0x09, 0x9B, 0xDA, 0x2F, 0xA4, 0xC5, 0x5D, 0xA7, 0x49, 0x89, 0x4A, 0x4A, 0xCC, 0xBF, 0x7D, 0x1C, 0x07, 0xD8, 0xD0, 0x87, 0x11, 0x33, 0x66, 0x6F,
-  0x19, 0x61, 0x39, 0x12, 0x13, 0x8F, 0x83, 0x49, 0xE2, 0x63, 0x63, 0x19, 0xDB, 0x31, 0xFA, 0xE2, 0xD3, 0x6C, 0x0A, 0xC3, 0xD7, 0x6B, 0x70, 0x3E, 0xF0, 0xF6,
-  0xEB, 0xD6, 0xFE, 0x5D, 0x1E, 0x3B, 0x4C, 0x5C, 0x91, 0xED, 0xA8, 0x12, 0x41, 0x07, 0x0A, 0x39, 0xB6, 0x84, 0x7C, 0xE4, 0xE8, 0xE2, 0x0E, 0x73, 0xE9, 0x88,
-  0x69, 0x4A, 0x96, 0x60, 0xCF, 0xB7, 0x45, 0xCB, 0x32, 0xD5, 0x04, 0x82, 0x68, 0x08, 0xD8, 0x22, 0x36, 0x95, 0xA8, 0xC6, 0xEC, 0x42, 0x34, 0x10, 0xB4, 0xC7,
-  0x7D, 0x30, 0x83, 0xF6, 0x64, 0x1E, 0x9F, 0x4A, 0x18, 0x99, 0x00, 0x42, 0x67, 0xCA, 0x59, 0xC2, 0x99, 0x19, 0xCE, 0x95, 0x91, 0x58, 0xC2, 0x99, 0x01, 0x41,
-  0x01, 0xE1, 0x7E, 0xD3, 0xD2, 0x59, 0x03, 0x9D, 0x3B, 0x00, 0x3B, 0xEB, 0xD0, 0x87, 0x61, 0x70, 0x46, 0x82, 0x36, 0x40, 0x4F, 0x12, 0xB7, 0x97, 0x84, 0xBE,
-  0x80, 0x90, 0xDF, 0x67, 0x67, 0xAC, 0x41, 0xD8, 0xCB, 0xD4, 0x35, 0x6F, 0x3B, 0xC6, 0x7A, 0x4D, 0x1C, 0xF3, 0x62, 0x69, 0xD9, 0x66, 0x8B, 0x81, 0xC6, 0xD6,
-  0x31, 0x30, 0x2C, 0x12, 0xBA, 0xF5, 0x8D, 0x63, 0x05, 0x6F, 0xBE, 0x60, 0xD7, 0x5A, 0x7B, 0x7D, 0x53, 0xEC, 0x5C, 0xE4, 0xCD, 0x3A, 0xA6, 0x67, 0x5C, 0x7F,
-  0x83, 0xFB, 0xA2, 0xA9, 0x39, 0x1C, 0x74, 0x0F, 0xBA, 0xBC, 0x41, 0x00, 0xE9, 0x96, 0x10, 0x39, 0xE2, 0xC5, 0xFD, 0xA3, 0x3F, 0x7E, 0xFF, 0x6D, 0x84, 0x37,
-  0x70, 0x5F, 0xB3, 0x4B, 0xAD, 0x3D, 0xBA, 0xB1, 0xFA, 0xF0, 0xB7, 0x35, 0xEE, 0x57, 0x11, 0xC3, 0x4C, 0x4C, 0x8C, 0xB8, 0x67, 0x1A, 0x45, 0xC5, 0x9A, 0x7F,
-  0x15, 0x47, 0x0A, 0x97, 0x1D, 0x18, 0x27, 0xD0, 0xDC, 0x5B, 0x32, 0x50, 0xB1, 0xA3, 0x1A, 0xC1, 0x91, 0x93, 0xAF, 0x61, 0xA2, 0xFA, 0x0B, 0x31, 0x3C, 0xD0,
-  0xC7, 0x73, 0xAD, 0xA5, 0x77, 0xF5, 0xE7, 0x2D, 0x7A, 0xFD, 0x1D, 0xB0, 0xB3, 0x6C, 0xED, 0x3F, 0xEF, 0xED, 0xEF, 0x77, 0x7C, 0xD0, 0x19, 0x69, 0xB5, 0xFB,
-  0xA2, 0x09, 0xFC, 0xA1, 0x6D, 0x58, 0x27, 0xD9, 0xF7, 0xDF, 0xBA, 0x1B, 0xCF, 0xCF, 0x6B, 0xF0, 0xCE, 0x72, 0x70, 0x24, 0xCE, 0x6B, 0xF2, 0x01, 0xA6, 0x2F,
-  0x8E, 0xB9, 0xD5, 0x44, 0xA7, 0x1B, 0xC1, 0xC5, 0x9C, 0x91, 0xEE, 0x8F, 0x85, 0xA4, 0x3F, 0x96, 0xEE, 0xF3, 0x8C, 0x93, 0x60, 0xC5, 0xBB, 0x25, 0x96, 0xA5,
-  0xEE, 0xE2, 0xC6, 0x11, 0xE5, 0x74, 0xBC, 0x6A, 0xB0, 0xA5, 0xFF, 0x54, 0xC0, 0xE2, 0x59, 0xD2, 0x56, 0x2D, 0x5C, 0x25, 0x11, 0x95, 0x66, 0x58, 0xB9, 0x19,
-  0x69, 0xB2, 0x60, 0x9C, 0x9E, 0x2D, 0x27, 0xB3, 0xCF, 0x8B, 0x0D, 0xF8, 0xF8, 0x4A, 0x44, 0x54, 0x76, 0x0D, 0xA7, 0x9C, 0x61, 0xE8, 0x87, 0x29, 0x68, 0xDE,
-  0x78, 0x04, 0xB7, 0x63, 0x23, 0x18, 0x9F, 0xAF, 0x16, 0x00, 0xD0, 0x49, 0x6A, 0x38, 0x8A, 0x69, 0x08, 0xB5, 0x4D, 0xB6, 0x24, 0x44, 0x40, 0xBB, 0xFD, 0x30,
-  0x62, 0x21, 0x10, 0x9F, 0x75, 0x45, 0xBA, 0xDB, 0x9E, 0x5D, 0xA7, 0x03, 0xD6, 0xD6, 0xAC, 0xFA, 0x2E, 0xA6, 0x2D, 0xF1, 0x70, 0x4E, 0xC4, 0x0F, 0xC9, 0x67,
-  0x9E, 0xC4, 0x99, 0x17, 0x55, 0x82, 0x02, 0x88, 0x4F, 0x34, 0xC7, 0x8F, 0xB3, 0x4F, 0x14, 0xD9, 0x27, 0x9C, 0x7D, 0x04, 0x88, 0x26, 0x9C, 0xC5, 0x25, 0x8B,
-  0xD0, 0x18, 0x7F, 0x7A, 0x15, 0x71, 0x76, 0x3D, 0xCD, 0xA5, 0x93, 0x97, 0x12, 0x62, 0xEC, 0xE5, 0x03, 0x40, 0xFB, 0x15, 0xF8, 0x43, 0x9C, 0xAD, 0xEB, 0xA9,
-  0x1A, 0x5B, 0xA2, 0x14, 0x81, 0x00, 0x11, 0x5B, 0xF2, 0x82, 0x85, 0x60, 0xE5, 0x35, 0x09, 0xF8, 0x23, 0x7C, 0x86, 0x63, 0x6A, 0x73, 0xCF, 0x58, 0x11, 0xFC,
-  0x62, 0x7B, 0x48, 0xAC, 0x49, 0xEF, 0x17, 0xE6, 0x7E, 0xAC, 0x59, 0x8C, 0xC9, 0xB0, 0xE4, 0x51, 0x08, 0x1A, 0xB6, 0x8C, 0x41, 0x87, 0x74, 0xE4, 0x42, 0x8B,
-  0x46, 0x2C, 0x83, 0x0B, 0x4F, 0x95, 0x84, 0x15, 0xB6, 0x8E, 0x1C, 0x21, 0x42, 0x20, 0x4A, 0x26, 0xA3, 0x74, 0xA9, 0x8C, 0xCD, 0x24, 0x18, 0xB3, 0xA9, 0xF9,
-  0x42, 0xBC, 0x41, 0xC8, 0x52, 0xA2, 0x4D, 0xE8, 0x20, 0x0C, 0x3E, 0x8B, 0xCC, 0x42, 0x52, 0xD8, 0x42, 0xA2, 0xFE, 0xDE, 0x26, 0x58, 0x9E, 0xE0, 0x2F, 0x65,
-  0xBC, 0xF8, 0xE6, 0x6B, 0xCD, 0xF5, 0x34, 0xDB, 0xBD, 0x26, 0xB8, 0x28, 0x28, 0x36, 0x90, 0x69, 0x53, 0x02, 0x01, 0x8E, 0xB0, 0x22, 0x13, 0xEE, 0x8F, 0x09,
-  0x96, 0x96, 0x0F, 0x73, 0x62, 0x7C, 0x75, 0x28, 0x79, 0xAA, 0x87, 0xA3, 0x53, 0x21, 0x7B, 0xDB, 0x25, 0xF4, 0x84, 0x38, 0x19, 0x4C, 0x24, 0xCB, 0xA7, 0x9C,
-  0xC7, 0xAD, 0xC0, 0x92, 0x57, 0xD6, 0x2A, 0x21, 0xC2, 0xF0, 0xF6, 0xA3, 0x95, 0xA2, 0x9C, 0x81, 0x42, 0x41, 0x86, 0x60, 0x91, 0x2C, 0x23, 0x5E, 0xB7, 0xA4,
-  0x29, 0xAB, 0x1D, 0xE6, 0x68, 0x14, 0x4B, 0xE1, 0xD2, 0x68, 0x9E, 0xAD, 0x15, 0x26, 0x71, 0x36, 0xCA, 0xB1, 0xDF, 0xD9, 0xA1, 0x78, 0x14, 0x8A, 0x9D, 0x61,
-  0xF6, 0x36, 0x79, 0x72, 0x76, 0xB8, 0x0C, 0x56, 0xF6, 0xE4, 0xC9, 0xFF, 0x02, 0x49, 0x60, 0xC8, 0xA8, 0x55, 0x0C, 0x01, 0x00
+  0x1F, 0x8B, 0x08, 0x08, 0x00, 0x00, 0x00, 0x00, 0x02, 0xFF, 0x69, 0x6E, 0x64, 0x65, 0x78, 0x5F, 0x6F, 0x76, 0x33, 0x36, 0x36, 0x30, 0x2E, 0x68, 0x74, 0x6D,
+  0x6C, 0x00, 0xED, 0x3D, 0xE9, 0x7A, 0xDB, 0x46, 0x92, 0xFF, 0xFD, 0x14, 0x6D, 0x26, 0x63, 0x91, 0x2B, 0x92, 0x22, 0x78, 0xE9, 0xB0, 0x44, 0xAF, 0x0F, 0xC5,
+  0xCE, 0x8E, 0x9D, 0xF1, 0xD8, 0x8E, 0x93, 0xF9, 0xBC, 0xFE, 0x1C, 0x90, 0x6C, 0x92, 0x88, 0x41, 0x80, 0x03, 0x80, 0x12, 0x19, 0xAF, 0x9E, 0x63, 0x1F, 0x68,
+  0x5F, 0x6C, 0xAB, 0xFA, 0x00, 0x1A, 0x20, 0x00, 0xE2, 0x10, 0x29, 0x65, 0x76, 0x9D, 0x2F, 0x22, 0x8E, 0xEE, 0xEA, 0xBA, 0xBB, 0xAA, 0xBA, 0x01, 0x9C, 0x3F,
+  0x1C, 0xDB, 0x23, 0x6F, 0xBD, 0xA0, 0x64, 0xE6, 0xCD, 0xCD, 0xC1, 0x83, 0x73, 0xFE, 0x43, 0xE0, 0xDF, 0xF9, 0x8C, 0xEA, 0x63, 0x7E, 0xC8, 0x4E, 0xE7, 0xD4,
+  0xD3, 0xC9, 0x68, 0xA6, 0x3B, 0x2E, 0xF5, 0x2E, 0x2A, 0x4B, 0x6F, 0xD2, 0x38, 0xA9, 0x44, 0x6F, 0x5B, 0xFA, 0x9C, 0x5E, 0x54, 0xAE, 0x0C, 0x7A, 0xBD, 0xB0,
+  0x1D, 0xAF, 0x42, 0x46, 0xB6, 0xE5, 0x51, 0x0B, 0x9A, 0x5F, 0x1B, 0x63, 0x6F, 0x76, 0x31, 0xA6, 0x57, 0xC6, 0x88, 0x36, 0xD8, 0x49, 0xDD, 0xB0, 0x0C, 0xCF,
+  0xD0, 0xCD, 0x86, 0x3B, 0xD2, 0x4D, 0x7A, 0xA1, 0xA9, 0xB0, 0x3C, 0xC3, 0x33, 0xE9, 0xE0, 0xF2, 0xFD, 0xDB, 0x4E, 0x9B, 0xFC, 0xED, 0x63, 0xA7, 0xDF, 0x6F,
+  0x9D, 0x1F, 0xF1, 0x6B, 0x41, 0x1B, 0xD7, 0x5B, 0xAB, 0xE7, 0xF8, 0x6F, 0x68, 0x8F, 0xD7, 0xE4, 0x5B, 0xE8, 0x12, 0xFE, 0x9B, 0x00, 0x12, 0x8D, 0x89, 0x3E,
+  0x37, 0xCC, 0xF5, 0x19, 0x79, 0xEA, 0xC0, 0x98, 0xF5, 0x57, 0xD4, 0xBC, 0xA2, 0x9E, 0x31, 0xD2, 0xEB, 0xAE, 0x6E, 0xB9, 0x0D, 0x97, 0x3A, 0xC6, 0xE4, 0xF1,
+  0x46, 0xC7, 0xA1, 0x3E, 0xFA, 0x3A, 0x75, 0xEC, 0xA5, 0x35, 0x3E, 0x23, 0xDF, 0x69, 0x27, 0xF8, 0xDF, 0x66, 0xA3, 0x91, 0x6D, 0xDA, 0x0E, 0xDC, 0xBF, 0xFC,
+  0x01, 0xFF, 0x7B, 0x1C, 0x3F, 0xBA, 0x6B, 0xFC, 0x41, 0xCF, 0x88, 0xD6, 0x5F, 0xAC, 0x42, 0xF7, 0x6F, 0x1E, 0x84, 0x4E, 0x67, 0xED, 0x24, 0xEC, 0x45, 0xFF,
+  0x93, 0xF4, 0xFE, 0x2E, 0x1D, 0x79, 0x86, 0x6D, 0x35, 0xE7, 0xBA, 0x61, 0xC5, 0x40, 0x1A, 0x1B, 0xEE, 0xC2, 0xD4, 0x81, 0x07, 0x13, 0x93, 0xA6, 0xC2, 0xF9,
+  0x6E, 0x4E, 0xAD, 0x65, 0x7D, 0x0B, 0x34, 0x04, 0xD2, 0x18, 0x1B, 0x0E, 0x6F, 0x75, 0x86, 0x7C, 0x58, 0xCE, 0xAD, 0xAD, 0x60, 0xD3, 0xF0, 0xB2, 0x6C, 0x8B,
+  0x3E, 0x8E, 0x1F, 0xE8, 0xDA, 0xD1, 0x17, 0xD8, 0x00, 0x7F, 0x37, 0x9B, 0xCC, 0x0D, 0x8B, 0x2B, 0xD5, 0x19, 0xE9, 0x74, 0x5B, 0x8B, 0xD5, 0x16, 0x51, 0x76,
+  0xFA, 0xF8, 0xDF, 0x66, 0xA3, 0x85, 0x3E, 0x1E, 0x1B, 0xD6, 0xF4, 0x8C, 0x9C, 0xC4, 0x82, 0xB0, 0x9D, 0x31, 0x75, 0x1A, 0x8E, 0x3E, 0x36, 0x96, 0xEE, 0x19,
+  0xE9, 0xC6, 0xB5, 0x99, 0xEB, 0xCE, 0x14, 0x70, 0xF1, 0x6C, 0x40, 0xB6, 0xA1, 0xB5, 0x52, 0x9A, 0x38, 0xC6, 0x74, 0xE6, 0x81, 0x48, 0x37, 0xDA, 0x44, 0x99,
+  0x26, 0x4C, 0x68, 0x9B, 0x3C, 0x53, 0xF9, 0x16, 0xCF, 0x35, 0xDD, 0x34, 0xA6, 0x56, 0xC3, 0xF0, 0xE8, 0x1C, 0xC8, 0x71, 0x3D, 0x87, 0x7A, 0xA3, 0x59, 0x1A,
+  0x2A, 0x13, 0x63, 0xBA, 0x74, 0x68, 0x0C, 0x22, 0x3E, 0xDF, 0x52, 0x08, 0x86, 0x9B, 0x9B, 0xB7, 0x1A, 0xD7, 0x74, 0xF8, 0xD5, 0xF0, 0x1A, 0x82, 0x27, 0x43,
+  0x3A, 0xB1, 0x1D, 0x1A, 0xDB, 0x52, 0xB6, 0x30, 0xED, 0xD1, 0xD7, 0x86, 0xEB, 0xE9, 0x8E, 0x97, 0x05, 0xA0, 0x3E, 0xF1, 0xA8, 0xB3, 0x1D, 0x1E, 0x45, 0xAD,
+  0xD8, 0x0E, 0x2D, 0x79, 0x58, 0xD1, 0xC0, 0xB0, 0x4C, 0xC3, 0xA2, 0xD9, 0xD1, 0x4B, 0x1A, 0x37, 0x0C, 0x8E, 0xB7, 0xCA, 0x20, 0x18, 0x63, 0x3E, 0xAD, 0xCB,
+  0xE3, 0x91, 0x6E, 0x5D, 0xE9, 0x6E, 0x9A, 0xD2, 0x30, 0xD2, 0x37, 0xC7, 0x16, 0x66, 0xA4, 0xB5, 0x5A, 0x7F, 0xD9, 0xBC, 0x39, 0xA3, 0x5C, 0x6B, 0xF5, 0xA5,
+  0x67, 0x97, 0x37, 0x90, 0x93, 0x2D, 0xAA, 0xFF, 0xEF, 0x73, 0x3A, 0x36, 0x74, 0x52, 0x55, 0xAC, 0xFB, 0xA4, 0x05, 0x2A, 0x56, 0x23, 0xBA, 0x35, 0x26, 0x55,
+  0xDB, 0x31, 0xC0, 0x2E, 0x74, 0xE6, 0x7D, 0x4C, 0xB8, 0x02, 0xF3, 0xC8, 0x82, 0xD6, 0x62, 0x48, 0x4E, 0x31, 0x21, 0x95, 0x23, 0xF1, 0x56, 0x94, 0xD1, 0x03,
+  0x65, 0xB2, 0xA7, 0x18, 0x1A, 0xF3, 0x8A, 0x2F, 0x8B, 0x08, 0x39, 0x9F, 0x57, 0x8D, 0x54, 0x51, 0xCA, 0x46, 0x52, 0xA4, 0x30, 0x09, 0x8F, 0xAA, 0xD0, 0xF4,
+  0x6A, 0x46, 0x1A, 0x04, 0x7D, 0x68, 0x2D, 0xBE, 0x8F, 0x00, 0x1A, 0xAF, 0x01, 0x51, 0x1D, 0xC9, 0x41, 0x7D, 0x3C, 0xA9, 0x81, 0x67, 0xE1, 0xFF, 0x2D, 0x56,
+  0x49, 0x94, 0x24, 0xFA, 0x98, 0x7C, 0x7E, 0x26, 0x87, 0xAF, 0xC9, 0xE5, 0x6F, 0x32, 0xFB, 0x9C, 0x5C, 0x7E, 0x27, 0x8F, 0xEF, 0xC9, 0xE1, 0x7F, 0x32, 0xF9,
+  0x20, 0x2E, 0xCE, 0xED, 0xD1, 0xC8, 0x77, 0xC3, 0xA5, 0xE7, 0xD9, 0x96, 0x5B, 0x6A, 0x02, 0x4B, 0x32, 0xBB, 0xDF, 0x97, 0xAE, 0x67, 0x4C, 0xD6, 0x0D, 0x61,
+  0xE1, 0x60, 0x76, 0x0B, 0x1D, 0x02, 0xCC, 0x21, 0xF5, 0xAE, 0x29, 0x4D, 0x0F, 0x46, 0x2C, 0xFD, 0x0A, 0xDC, 0xD0, 0x74, 0x6A, 0xC6, 0xE9, 0xDE, 0x68, 0xE9,
+  0xB8, 0x18, 0xD5, 0x2D, 0x6C, 0x03, 0x00, 0x3B, 0x8F, 0xB7, 0xB8, 0xD1, 0x8C, 0x03, 0x35, 0x46, 0xC3, 0x98, 0xB1, 0xEC, 0xA5, 0x87, 0x3C, 0x8E, 0x95, 0x84,
+  0x0D, 0xE4, 0x18, 0xDE, 0x3A, 0xF6, 0x9E, 0xB0, 0xC4, 0x56, 0xB2, 0x9B, 0x6E, 0x65, 0xC7, 0xEB, 0x6C, 0x34, 0xA3, 0xA3, 0xAF, 0x74, 0x7C, 0xB8, 0x35, 0x48,
+  0xDB, 0x16, 0x3C, 0x36, 0x0D, 0x6B, 0xB1, 0xF4, 0x1A, 0x18, 0x6C, 0x2D, 0x76, 0x22, 0x73, 0xA6, 0x90, 0x92, 0xC4, 0x76, 0x3B, 0x2D, 0xE4, 0xE8, 0x2D, 0x56,
+  0xE9, 0x4C, 0x50, 0x91, 0x1D, 0x98, 0xFA, 0x90, 0x9A, 0x69, 0x28, 0x0B, 0x63, 0x48, 0x70, 0xBB, 0xC2, 0x57, 0x25, 0x47, 0x76, 0x91, 0x48, 0xB5, 0x7B, 0xFC,
+  0x97, 0xCC, 0x7C, 0x64, 0xC7, 0xF5, 0xD0, 0x25, 0x97, 0x9A, 0x60, 0x60, 0x49, 0x81, 0x39, 0xB4, 0xB9, 0x06, 0x1C, 0x52, 0x07, 0x70, 0x74, 0x6B, 0x4A, 0xC1,
+  0x17, 0xAC, 0xEA, 0xF2, 0x30, 0x3D, 0x6D, 0xC8, 0x44, 0x3E, 0xBA, 0xEA, 0x5E, 0x7A, 0x9A, 0xC2, 0x1D, 0x42, 0x9D, 0x34, 0xF9, 0x41, 0x81, 0x20, 0x45, 0x91,
+  0x6F, 0x2A, 0x22, 0x5A, 0x3B, 0x39, 0x90, 0x8F, 0xB5, 0x9C, 0xB0, 0x6E, 0xC5, 0xA6, 0x01, 0x5B, 0x5D, 0x83, 0x4C, 0x08, 0x27, 0x93, 0x6D, 0x29, 0xE5, 0x64,
+  0xD2, 0x69, 0x75, 0xBA, 0x5B, 0x03, 0xA9, 0x58, 0x2A, 0x23, 0x69, 0xE5, 0xE3, 0x14, 0xB7, 0x92, 0xAA, 0x04, 0xAE, 0x7E, 0x15, 0x1B, 0xD2, 0xDB, 0xAE, 0xC1,
+  0xF3, 0x3A, 0x7D, 0xE8, 0x42, 0x66, 0xE7, 0xC5, 0x24, 0x66, 0x42, 0xD1, 0xDB, 0xB1, 0xF8, 0xB1, 0x08, 0x2F, 0xD6, 0x04, 0x24, 0x7B, 0xE3, 0xD1, 0x0E, 0x49,
+  0x20, 0xBE, 0x89, 0x22, 0xE0, 0xD8, 0x18, 0xD3, 0xA3, 0x2B, 0xAF, 0x31, 0xA6, 0x23, 0xDB, 0xE1, 0xC1, 0x61, 0x42, 0x5E, 0x19, 0x11, 0xE4, 0x76, 0x8D, 0x3D,
+  0x9B, 0xD9, 0x57, 0xD4, 0x89, 0x61, 0x56, 0x44, 0xA8, 0xDD, 0xD3, 0xEE, 0x38, 0x03, 0x34, 0x1D, 0xA6, 0xC7, 0x58, 0xDE, 0x87, 0xC1, 0xB5, 0xB5, 0x51, 0x5B,
+  0xDB, 0x0E, 0xAE, 0x09, 0x36, 0xA3, 0x0F, 0x4D, 0x3A, 0x4E, 0x99, 0xCD, 0xC6, 0x74, 0xA2, 0x2F, 0x4D, 0x6F, 0x8B, 0x56, 0xEA, 0x2D, 0xFC, 0x2F, 0x6D, 0x44,
+  0xE6, 0x86, 0x3E, 0x61, 0xD5, 0xE8, 0x82, 0x39, 0x8E, 0xCF, 0x31, 0x63, 0xCA, 0x50, 0x43, 0x5F, 0x2C, 0xA8, 0x0E, 0xAD, 0x46, 0x34, 0x49, 0x0E, 0x99, 0x32,
+  0x8E, 0x78, 0x3F, 0x9F, 0x29, 0xAB, 0xDF, 0x6A, 0xB0, 0x7E, 0xF0, 0x98, 0x8B, 0xE6, 0xB3, 0x89, 0x3D, 0x5A, 0xBA, 0xA9, 0xF3, 0x79, 0x3E, 0x78, 0x67, 0x92,
+  0x65, 0xAE, 0x69, 0x30, 0xF3, 0x5F, 0x5A, 0x16, 0x4A, 0xB4, 0xE1, 0x39, 0x40, 0x66, 0xCC, 0x40, 0xD9, 0x18, 0x57, 0xC8, 0x87, 0x85, 0x18, 0x9B, 0x54, 0xD9,
+  0x8A, 0xB8, 0xA9, 0x56, 0x8A, 0xA7, 0x25, 0xE0, 0x43, 0x8C, 0xB1, 0x04, 0x55, 0x8E, 0x2F, 0xDE, 0x6C, 0x39, 0x8F, 0x8B, 0xA3, 0xE4, 0x60, 0x1A, 0x4C, 0xFA,
+  0x7C, 0x38, 0x67, 0x3A, 0xD4, 0xAB, 0xAD, 0x7A, 0xAB, 0xDE, 0x81, 0x3F, 0xB5, 0xBC, 0xCA, 0x25, 0xD8, 0xDB, 0x6E, 0x67, 0x28, 0x06, 0xF5, 0xB6, 0x17, 0x9D,
+  0x92, 0x9C, 0xFD, 0x56, 0x59, 0x64, 0xB7, 0xA4, 0x70, 0xF5, 0x49, 0x6B, 0x6E, 0x99, 0x87, 0x13, 0x54, 0x3A, 0xBF, 0x22, 0xC6, 0x68, 0x4B, 0x5E, 0x11, 0xCF,
+  0xED, 0x3F, 0x1A, 0x3C, 0x08, 0xF9, 0x3F, 0xAF, 0xED, 0x0A, 0x2B, 0xFE, 0xA5, 0x35, 0x3D, 0x37, 0x5F, 0xDC, 0xBB, 0xD6, 0x8D, 0x56, 0xB2, 0xD4, 0x1B, 0x22,
+  0xEA, 0x03, 0x0C, 0x2D, 0xC8, 0x41, 0x1D, 0x48, 0x46, 0x13, 0x23, 0x43, 0xA5, 0x4D, 0x01, 0x1E, 0x4C, 0x0C, 0xD3, 0x6C, 0x98, 0xF6, 0xF5, 0xF6, 0x48, 0x24,
+  0x5D, 0x93, 0x37, 0xF4, 0x74, 0xBB, 0xCA, 0x17, 0xC5, 0x76, 0x09, 0x9E, 0xEB, 0x4F, 0x81, 0xED, 0xFF, 0xB5, 0xA9, 0x45, 0x31, 0x8D, 0x62, 0x13, 0x45, 0x01,
+  0x7D, 0x2C, 0x37, 0x50, 0x26, 0x55, 0xE2, 0x91, 0x60, 0x7A, 0xDA, 0x73, 0x6D, 0x78, 0xA3, 0x59, 0x81, 0xD4, 0x33, 0x48, 0x8C, 0x1C, 0x6A, 0xEA, 0x18, 0xC1,
+  0x17, 0xAA, 0x50, 0x6C, 0x4D, 0xDF, 0xD4, 0xEE, 0x59, 0x28, 0x61, 0xAC, 0xBB, 0x3F, 0xD5, 0xA5, 0x26, 0x8F, 0x1D, 0x92, 0x7D, 0x75, 0xAF, 0xB5, 0x8D, 0xEA,
+  0xAD, 0x96, 0xD1, 0x2E, 0xEB, 0xD1, 0xA5, 0xD3, 0x9E, 0x3A, 0x74, 0x9D, 0x81, 0x98, 0xBA, 0xF8, 0x3D, 0xE3, 0xF5, 0xE3, 0xE2, 0xA5, 0x12, 0x36, 0x01, 0x08,
+  0x2D, 0x6A, 0x76, 0xDD, 0x0C, 0x43, 0x27, 0x0F, 0x99, 0x45, 0x1F, 0xFD, 0xEA, 0x68, 0xA5, 0x92, 0xC1, 0xDD, 0xFC, 0x25, 0x6F, 0xCA, 0x2E, 0x67, 0xDF, 0xF8,
+  0x7C, 0x9E, 0x4E, 0xBC, 0x84, 0xB5, 0x20, 0x16, 0xA7, 0x76, 0xD2, 0xBD, 0x5B, 0x43, 0xA9, 0xA6, 0x6C, 0xF5, 0x1C, 0x7E, 0x11, 0x33, 0x59, 0xFB, 0x62, 0x21,
+  0xA3, 0xF7, 0xCC, 0x0D, 0x3C, 0x59, 0x24, 0x32, 0x7C, 0x66, 0x62, 0x86, 0x36, 0x73, 0x31, 0xE5, 0x83, 0x78, 0xE8, 0xAF, 0xD5, 0x76, 0x3F, 0x76, 0x6D, 0x25,
+  0xA5, 0x71, 0x7A, 0x91, 0x3D, 0xA1, 0x0A, 0xB8, 0x39, 0x65, 0x25, 0x26, 0xC8, 0xAA, 0x2F, 0xEA, 0xE6, 0xB7, 0xCA, 0x34, 0x0F, 0xB3, 0x59, 0xC9, 0x4A, 0x2F,
+  0x79, 0xCE, 0x75, 0x08, 0x7B, 0x51, 0x5D, 0x75, 0x80, 0xE8, 0x14, 0x54, 0x77, 0xA5, 0xC6, 0xAA, 0xF5, 0x5B, 0x5B, 0x86, 0x1C, 0x99, 0xB6, 0x5B, 0xB2, 0x00,
+  0x96, 0x5C, 0xFF, 0xEA, 0x15, 0x9E, 0xBA, 0x53, 0x6D, 0x2A, 0xDD, 0x1C, 0x23, 0x3C, 0xD7, 0x5A, 0xB1, 0x9E, 0x36, 0xB5, 0x4A, 0xC9, 0x2A, 0x68, 0x6C, 0x39,
+  0xF3, 0x8C, 0x8C, 0x68, 0xBC, 0x1B, 0x0D, 0x17, 0xEA, 0xB2, 0x94, 0x4A, 0x53, 0xE5, 0x30, 0x33, 0xC6, 0x63, 0x6A, 0x6D, 0xDB, 0x1D, 0x92, 0x31, 0x78, 0x40,
+  0xFC, 0x3F, 0xEF, 0xCB, 0x28, 0x52, 0x37, 0x3D, 0x68, 0xBB, 0xB6, 0x18, 0x31, 0xD1, 0x24, 0x55, 0xD2, 0xC3, 0xA1, 0x48, 0x2A, 0xAA, 0xED, 0xD4, 0x5A, 0x2B,
+  0xB2, 0x0C, 0xF8, 0x80, 0xAD, 0x36, 0xBD, 0x79, 0x04, 0x2B, 0xB6, 0x90, 0xD2, 0x14, 0x6B, 0x4B, 0x62, 0x19, 0xB0, 0x91, 0xB4, 0xBA, 0x72, 0x8B, 0x4B, 0x6D,
+  0x4C, 0x03, 0xA2, 0xE3, 0x26, 0xB2, 0xE6, 0x8E, 0x22, 0xA3, 0x14, 0x24, 0xFD, 0x29, 0x46, 0x6E, 0xBD, 0x0A, 0xB7, 0xCA, 0x6B, 0x1C, 0xC1, 0x5E, 0xB9, 0x23,
+  0x65, 0xB3, 0xDC, 0xF9, 0x51, 0xB0, 0xAF, 0xEF, 0x1C, 0x77, 0xCC, 0xA9, 0x7B, 0xEA, 0xC4, 0x40, 0x23, 0x53, 0x77, 0xDD, 0x8B, 0x0A, 0xEE, 0xFC, 0xAA, 0x84,
+  0xB7, 0xD8, 0x9D, 0x8F, 0x8D, 0x2B, 0x62, 0x8C, 0x2F, 0x2A, 0xA6, 0x3D, 0xB5, 0x23, 0xF7, 0xD8, 0x7D, 0x2E, 0x66, 0x98, 0xC8, 0x2E, 0x2A, 0xA1, 0x05, 0xC6,
+  0x0A, 0xEB, 0x15, 0x5C, 0xAA, 0x0C, 0x1E, 0x7D, 0x77, 0x7A, 0x7C, 0xDC, 0x7F, 0xFC, 0xC8, 0x1A, 0xBA, 0x0B, 0xF1, 0xF7, 0x03, 0x5F, 0x8F, 0xE5, 0x5B, 0xFE,
+  0x60, 0x6E, 0xF3, 0x3C, 0xD0, 0x3D, 0xF7, 0xFC, 0x88, 0x01, 0x8D, 0x20, 0x72, 0x04, 0x98, 0x24, 0xE0, 0x26, 0xE2, 0x9D, 0x38, 0xF4, 0x64, 0x13, 0x17, 0xA6,
+  0xF0, 0xA1, 0xEE, 0xC4, 0x34, 0x61, 0xCD, 0x78, 0x34, 0xCD, 0x7C, 0x49, 0x85, 0x09, 0x65, 0x68, 0xAF, 0xA2, 0x14, 0x30, 0xA2, 0x84, 0xC4, 0x44, 0x2B, 0x3A,
+  0x4E, 0x02, 0x08, 0xDD, 0x58, 0x77, 0x5C, 0x5D, 0x85, 0x36, 0xB1, 0x8D, 0x42, 0x22, 0xC0, 0xC6, 0xAB, 0x91, 0xF9, 0x55, 0x0A, 0xBF, 0x22, 0x85, 0x62, 0xD9,
+  0x1E, 0xF7, 0x95, 0x09, 0x43, 0x85, 0x48, 0x15, 0x7D, 0x94, 0x75, 0x43, 0x4E, 0x05, 0xB0, 0xB6, 0xC1, 0xA0, 0xF3, 0x6B, 0xE9, 0x90, 0xA2, 0x72, 0x95, 0x9D,
+  0x2B, 0x83, 0x5F, 0x9F, 0xBF, 0xFE, 0x2B, 0x79, 0xF3, 0xEA, 0x8F, 0x58, 0x09, 0x6D, 0x43, 0x0A, 0x9D, 0x74, 0x86, 0x91, 0x15, 0x79, 0x48, 0x9E, 0x54, 0x84,
+  0x64, 0x18, 0x04, 0x9C, 0xEE, 0x4D, 0x6A, 0x4D, 0xBD, 0xD9, 0x45, 0x45, 0xAB, 0xE0, 0x9E, 0x16, 0x79, 0xD6, 0xAE, 0x10, 0x74, 0xE0, 0xEC, 0xE0, 0x4A, 0x37,
+  0x97, 0x78, 0xD4, 0xCA, 0x42, 0xEB, 0xA6, 0x6A, 0xC5, 0x36, 0x13, 0x9E, 0xC5, 0xE7, 0xB1, 0xE2, 0x89, 0xC3, 0x5C, 0xAE, 0x0C, 0xDE, 0x53, 0xEF, 0xFC, 0x88,
+  0xDF, 0xDA, 0x22, 0xB5, 0xF4, 0xB1, 0xC1, 0x92, 0xB9, 0x3A, 0xA4, 0xA9, 0x50, 0x9A, 0xE0, 0x27, 0x8E, 0x3E, 0xA7, 0xC8, 0x95, 0x4C, 0x92, 0x57, 0xA5, 0xEE,
+  0xF7, 0xAC, 0x0C, 0xDE, 0x51, 0x16, 0x11, 0x01, 0x1A, 0x99, 0x04, 0x7F, 0x2E, 0x82, 0xD4, 0xD0, 0xF8, 0xBE, 0x3E, 0x8B, 0x45, 0xA9, 0x86, 0xCE, 0xD5, 0x3C,
+  0x03, 0xDF, 0x1F, 0x36, 0x1A, 0xA4, 0xF3, 0xE6, 0x2D, 0x69, 0x34, 0x32, 0x34, 0xB6, 0x17, 0xCC, 0x9C, 0x84, 0xFC, 0xB5, 0xE3, 0xCA, 0xE0, 0xEF, 0xBF, 0xBE,
+  0x7C, 0x5A, 0x6D, 0xB7, 0xBA, 0x27, 0x2B, 0xAD, 0xD7, 0xEF, 0xD6, 0xCE, 0x8F, 0x78, 0x93, 0xFC, 0xB0, 0xFA, 0x95, 0xC1, 0x5B, 0x44, 0xA4, 0x7A, 0xD2, 0xEF,
+  0x96, 0x85, 0xD5, 0x43, 0x58, 0xAF, 0x5E, 0x54, 0x8F, 0xDB, 0xAD, 0x95, 0xD6, 0x3E, 0x69, 0x95, 0x00, 0xD5, 0xAD, 0x0C, 0x7E, 0x00, 0x48, 0xDA, 0x29, 0x82,
+  0x6A, 0xE5, 0x03, 0x85, 0xAC, 0x6D, 0x17, 0x64, 0x6D, 0xA7, 0x32, 0xF8, 0x19, 0x59, 0x0B, 0x31, 0x37, 0xD2, 0xD0, 0x2A, 0x43, 0x43, 0x1B, 0x4C, 0x86, 0xC1,
+  0x02, 0x56, 0x00, 0x11, 0xED, 0x32, 0xAC, 0xD5, 0x2A, 0x03, 0x64, 0x07, 0x42, 0x02, 0xEE, 0x96, 0x00, 0x04, 0xBE, 0x83, 0xE1, 0x04, 0xE8, 0xAC, 0x8E, 0xFB,
+  0x27, 0xC5, 0x21, 0x9D, 0x02, 0x75, 0x1F, 0x01, 0xD2, 0x09, 0x30, 0xAA, 0x5F, 0x86, 0x4F, 0x27, 0x95, 0x01, 0xC2, 0xE9, 0x77, 0x5B, 0xAB, 0x6E, 0x19, 0x9D,
+  0x01, 0xAB, 0x78, 0x85, 0x80, 0x00, 0xC8, 0xAA, 0x53, 0x86, 0x47, 0x60, 0x12, 0xCF, 0x7F, 0xFC, 0xA1, 0xDA, 0x05, 0xC2, 0xDA, 0xA7, 0xFD, 0xE2, 0x70, 0xC0,
+  0x1C, 0xFE, 0x8E, 0x08, 0x01, 0x32, 0xAB, 0x76, 0xB7, 0x04, 0x42, 0x60, 0x0C, 0xD0, 0x1F, 0x61, 0x14, 0x06, 0x01, 0x7A, 0xFD, 0x8A, 0x21, 0x83, 0x80, 0xB4,
+  0xE3, 0x12, 0x54, 0x81, 0x56, 0xFF, 0x1D, 0xD9, 0x03, 0x40, 0x56, 0x5A, 0xB7, 0x8C, 0x4E, 0x03, 0x20, 0x86, 0x12, 0xD8, 0x1A, 0x9A, 0x5A, 0x71, 0x48, 0xA0,
+  0xD3, 0xA7, 0xFD, 0xD5, 0x69, 0x3F, 0x1B, 0x00, 0x9C, 0x7E, 0xD0, 0x95, 0xA7, 0x4D, 0x50, 0xE9, 0xF3, 0x57, 0xDA, 0xDC, 0xF4, 0xCF, 0x25, 0xA4, 0x9C, 0xDE,
+  0x3A, 0xF7, 0xCC, 0x24, 0xFA, 0x01, 0x4F, 0xF8, 0x41, 0xB6, 0x49, 0x49, 0xC1, 0xC4, 0xDF, 0xFD, 0x54, 0x19, 0x74, 0x33, 0x4C, 0xFE, 0xA1, 0xE8, 0x90, 0xF5,
+  0x0D, 0xE1, 0xCF, 0x22, 0x12, 0xD4, 0x3C, 0x8C, 0x45, 0xC0, 0x24, 0x3A, 0x15, 0xC5, 0x83, 0x14, 0x9A, 0xF5, 0x62, 0x70, 0xD5, 0x57, 0x95, 0x41, 0xBF, 0xB3,
+  0x35, 0x5A, 0x28, 0x2E, 0x8C, 0x21, 0x2B, 0x6E, 0x58, 0xD4, 0x75, 0x73, 0xCB, 0x23, 0xE8, 0x5A, 0x19, 0x3C, 0xF3, 0x8F, 0xCB, 0x48, 0xA5, 0xD1, 0x29, 0x21,
+  0x16, 0x05, 0x1D, 0x2E, 0x99, 0x46, 0x47, 0x88, 0x26, 0x90, 0xCC, 0xED, 0x0A, 0x66, 0x97, 0x72, 0xC1, 0xDC, 0xC6, 0xD1, 0x5D, 0x2F, 0xB7, 0x54, 0x64, 0x47,
+  0xF0, 0xD0, 0xE2, 0xE8, 0xCE, 0x24, 0xE2, 0xA3, 0xF2, 0x2F, 0x20, 0x0F, 0x57, 0xF7, 0x96, 0x7C, 0x9F, 0x59, 0x6E, 0x89, 0x04, 0x5D, 0x21, 0x1E, 0xF0, 0x8F,
+  0x4B, 0x49, 0xA5, 0x8C, 0xFB, 0x52, 0xD0, 0x11, 0x72, 0x91, 0x2E, 0xAC, 0xBB, 0x23, 0xB9, 0x74, 0x77, 0x29, 0x97, 0x99, 0xEE, 0x2C, 0x0A, 0xB9, 0x2F, 0xBF,
+  0x27, 0x48, 0x45, 0x1E, 0xDE, 0x99, 0xA9, 0x04, 0xC8, 0xFC, 0x0B, 0xD8, 0xCA, 0x98, 0x5A, 0xB6, 0xE1, 0xE6, 0x4F, 0x3D, 0x45, 0xBF, 0xCA, 0xE0, 0x05, 0x6D,
+  0xFC, 0x84, 0x47, 0x65, 0xC4, 0xF1, 0x74, 0xE9, 0xD9, 0x25, 0x04, 0x22, 0x71, 0xE1, 0xE2, 0x68, 0x09, 0x69, 0x9C, 0xEC, 0x48, 0x1A, 0x27, 0x3B, 0x94, 0x86,
+  0x4E, 0xBF, 0x98, 0xF4, 0x8A, 0x9A, 0xB9, 0xC5, 0x21, 0x3B, 0x56, 0x06, 0x97, 0xAB, 0x85, 0xED, 0xE2, 0xD3, 0x3B, 0xAF, 0xF1, 0xBC, 0x94, 0x91, 0xF4, 0x4A,
+  0xC8, 0xC4, 0x47, 0x48, 0xD8, 0x48, 0x4F, 0x48, 0xA5, 0xB7, 0x23, 0xA9, 0xF4, 0x76, 0x28, 0x95, 0xA9, 0x6E, 0x58, 0x23, 0x6A, 0x98, 0xF8, 0x24, 0x41, 0x5E,
+  0xC1, 0x28, 0x7D, 0x2B, 0x83, 0x97, 0xC1, 0x49, 0x19, 0xC1, 0xB4, 0x4A, 0xC8, 0x45, 0xC5, 0x27, 0x6C, 0x2F, 0x3D, 0xC8, 0xCA, 0x77, 0x24, 0x1B, 0x4D, 0xDB,
+  0xE5, 0xAC, 0xB2, 0xA0, 0x23, 0x43, 0x37, 0xBF, 0xD0, 0xC9, 0x04, 0xD2, 0xA0, 0xFC, 0x53, 0x4B, 0xA8, 0x3B, 0xCC, 0x2F, 0xFC, 0x9C, 0x5C, 0xB2, 0xF3, 0xDC,
+  0xC5, 0xB4, 0x08, 0xB8, 0xE2, 0x15, 0xB5, 0x68, 0x4E, 0x28, 0x96, 0x95, 0x29, 0xAB, 0x61, 0xF2, 0xA3, 0xCA, 0xE0, 0x27, 0xDB, 0xC7, 0xB3, 0x78, 0xDA, 0xFA,
+  0x13, 0x9D, 0xB2, 0x55, 0xDB, 0x32, 0x39, 0xF4, 0x4B, 0x47, 0x5F, 0xB3, 0x97, 0x06, 0x94, 0x49, 0xE9, 0xDF, 0xD1, 0x31, 0xF9, 0x60, 0x58, 0x5E, 0x99, 0xCA,
+  0xC2, 0x4B, 0x87, 0x52, 0xAB, 0x1C, 0x94, 0x1E, 0xA4, 0x48, 0x70, 0x50, 0x0E, 0x48, 0x1F, 0x0B, 0xCC, 0x0B, 0x43, 0xBF, 0x0F, 0x49, 0xBC, 0x7E, 0x3D, 0xCC,
+  0x3F, 0xA1, 0x5C, 0x0F, 0x61, 0x5E, 0xFE, 0xE5, 0x19, 0xB9, 0x64, 0xFB, 0x8C, 0x73, 0xBB, 0x2B, 0xBE, 0x05, 0x2A, 0x8B, 0xA2, 0x07, 0xEB, 0x08, 0x38, 0xE6,
+  0xC6, 0x02, 0x4F, 0xBC, 0x01, 0x65, 0x5D, 0xE4, 0x89, 0x21, 0x4F, 0x22, 0xC8, 0x76, 0x8C, 0x54, 0x14, 0x6A, 0xB3, 0xD1, 0xB8, 0xC3, 0x50, 0x6C, 0x74, 0x9D,
+  0x3F, 0x0C, 0x1B, 0x5D, 0x83, 0x98, 0xC6, 0x57, 0xB8, 0x05, 0x7D, 0x4C, 0x40, 0x5E, 0x7B, 0x11, 0x14, 0x8E, 0x7A, 0x37, 0x82, 0x62, 0xF4, 0xDE, 0xB5, 0xA0,
+  0x40, 0x5B, 0xBE, 0xE0, 0x3C, 0x5A, 0xC4, 0xA8, 0x58, 0xC7, 0xCA, 0xE0, 0x8D, 0x6E, 0x2D, 0x61, 0x92, 0xD9, 0x97, 0xC0, 0xFC, 0x81, 0xEF, 0xCC, 0xBC, 0x04,
+  0xDD, 0x77, 0x2D, 0x3A, 0x40, 0x64, 0x6E, 0x8F, 0xF3, 0xA7, 0x3B, 0xA2, 0x1F, 0x77, 0x89, 0x6F, 0xE0, 0x28, 0x77, 0x60, 0x20, 0x21, 0xEC, 0x38, 0x22, 0xE0,
+  0xA9, 0x54, 0xF1, 0x60, 0xE0, 0xFD, 0xD2, 0xB2, 0xD6, 0x65, 0x22, 0x81, 0xE7, 0xA6, 0xBD, 0x1C, 0xAF, 0xCB, 0x84, 0x01, 0x7F, 0x9B, 0x4C, 0x8C, 0x11, 0x2D,
+  0x13, 0x04, 0xBC, 0xB2, 0xE7, 0xF4, 0x5E, 0x4C, 0xBC, 0x74, 0x54, 0x20, 0x93, 0x1B, 0x81, 0x14, 0x2F, 0x9F, 0xEF, 0x75, 0xE2, 0x85, 0x31, 0xEF, 0xC8, 0x33,
+  0x20, 0xB5, 0x77, 0xEE, 0xCF, 0xE9, 0xE8, 0x0B, 0x53, 0x9E, 0x22, 0xC2, 0xE2, 0x3D, 0x7D, 0x8F, 0x2E, 0xD3, 0xEF, 0xBB, 0xCA, 0xEF, 0x02, 0x8C, 0xC2, 0xD9,
+  0x9D, 0xD6, 0xEB, 0xF4, 0xFD, 0xF4, 0xAE, 0xD3, 0xBE, 0xDD, 0x04, 0x0F, 0x81, 0xEF, 0x56, 0x3E, 0xED, 0x22, 0xA2, 0x01, 0x6F, 0xF4, 0x13, 0xAE, 0x33, 0xE4,
+  0x70, 0xD8, 0xE5, 0x0D, 0xA9, 0x7D, 0x77, 0x96, 0xD4, 0xBE, 0x07, 0xA6, 0x34, 0x2D, 0xE0, 0xF1, 0xA6, 0xE8, 0xF1, 0x5E, 0x3E, 0xDF, 0x8F, 0x84, 0xA6, 0x77,
+  0xE6, 0xEA, 0xA6, 0x77, 0xEA, 0xEA, 0x88, 0xD8, 0xA1, 0x26, 0xB9, 0x50, 0x30, 0x82, 0x15, 0x1D, 0x79, 0x2D, 0xAB, 0x8C, 0x93, 0xD3, 0x56, 0x65, 0xBC, 0x9C,
+  0x44, 0x23, 0xEC, 0xE4, 0xFA, 0xC1, 0xAA, 0x48, 0xEF, 0x76, 0x97, 0x75, 0xBB, 0xAB, 0x1D, 0x1A, 0x8D, 0xA3, 0x5F, 0x7F, 0x99, 0xCE, 0xF5, 0xDC, 0xC2, 0x10,
+  0xFD, 0x40, 0x16, 0x6F, 0x9E, 0xEE, 0x33, 0x5C, 0x90, 0xE3, 0xDE, 0x8D, 0x1D, 0xF9, 0x54, 0xDF, 0xB5, 0xAF, 0x33, 0xA9, 0x95, 0xDF, 0xD9, 0x61, 0xA7, 0xCA,
+  0xE0, 0x35, 0xB5, 0x5C, 0xF2, 0xDC, 0x76, 0xC4, 0x9B, 0x1A, 0xF7, 0x22, 0x35, 0x36, 0xF2, 0xDD, 0x88, 0x8C, 0x13, 0x7D, 0xD7, 0xF2, 0x9A, 0xCD, 0x0D, 0xC7,
+  0xB1, 0x9D, 0xDC, 0x22, 0x13, 0xFD, 0x20, 0xAD, 0x68, 0xBC, 0x61, 0x47, 0x7B, 0x11, 0x97, 0x1C, 0xF5, 0x6E, 0x24, 0xE6, 0xD3, 0x7C, 0xD7, 0x42, 0xBB, 0x9A,
+  0x98, 0xC6, 0x22, 0xB7, 0xC8, 0x58, 0xAF, 0xCA, 0xE0, 0x63, 0xE3, 0x07, 0xF8, 0xDD, 0x8B, 0xB8, 0xF8, 0x88, 0x77, 0x23, 0x2C, 0x41, 0xED, 0x5D, 0x8B, 0x6A,
+  0xB8, 0xC8, 0xEF, 0x0E, 0xA1, 0x4F, 0x65, 0xF0, 0xEC, 0xED, 0x7E, 0x62, 0x3F, 0x1C, 0x2C, 0xA3, 0x84, 0x4A, 0xC9, 0x83, 0x11, 0x75, 0xE7, 0x95, 0xAE, 0x02,
+  0xD2, 0xB8, 0x46, 0xC4, 0x7F, 0xD9, 0x93, 0x34, 0xAE, 0x17, 0x77, 0x35, 0x1D, 0x5D, 0xDF, 0x07, 0xF9, 0xB0, 0x87, 0xFD, 0x86, 0xBA, 0x53, 0x60, 0xD3, 0x18,
+  0xEF, 0x88, 0x9B, 0xC6, 0xE0, 0x88, 0x3C, 0xD3, 0xF7, 0x33, 0x21, 0xF9, 0xE3, 0xEE, 0xC3, 0x84, 0x02, 0x22, 0xEF, 0x3E, 0xCA, 0x1B, 0x17, 0x08, 0xF2, 0xC6,
+  0x5F, 0xF0, 0xC9, 0x39, 0x7C, 0xA2, 0x7C, 0x0D, 0xD1, 0xDE, 0xE5, 0x0B, 0xF2, 0xA3, 0x3C, 0xBD, 0xAB, 0xC2, 0x50, 0x18, 0xA7, 0x70, 0xDE, 0xD4, 0xEE, 0xED,
+  0x6A, 0x5B, 0x06, 0x40, 0xDE, 0xA1, 0x6C, 0x26, 0xFA, 0x88, 0x7E, 0x19, 0x53, 0xAF, 0xC8, 0xBA, 0xBF, 0xD2, 0xB7, 0x32, 0xF8, 0x01, 0x4E, 0xC8, 0x0B, 0x76,
+  0xB2, 0xAF, 0x70, 0x5C, 0x1D, 0x7F, 0x1F, 0x16, 0x15, 0xA2, 0xF7, 0xAE, 0x8D, 0x8A, 0x21, 0x03, 0xC9, 0x8F, 0x3D, 0xB5, 0x0A, 0x3D, 0xF7, 0x14, 0xEA, 0x2E,
+  0xC4, 0xF7, 0x8E, 0x9F, 0xEF, 0x57, 0x80, 0x01, 0x12, 0x7B, 0x93, 0xA1, 0x42, 0xF7, 0x9D, 0xAF, 0x58, 0x53, 0xD3, 0xD3, 0xBF, 0x78, 0x86, 0x49, 0xDD, 0x02,
+  0x1B, 0x08, 0xFD, 0xBE, 0xB8, 0x89, 0x10, 0x4E, 0xC8, 0x07, 0x3C, 0xD9, 0xCF, 0x02, 0xB6, 0x32, 0x78, 0x54, 0x70, 0xE5, 0xD6, 0xA7, 0x55, 0xAA, 0xF6, 0x21,
+  0x1E, 0xF5, 0xD9, 0x54, 0xF1, 0x56, 0xE7, 0x6D, 0x42, 0x10, 0xCF, 0x48, 0xB2, 0xDD, 0x60, 0xD4, 0x6B, 0xB8, 0x80, 0xAD, 0x59, 0x19, 0xBC, 0xA4, 0x1E, 0x79,
+  0x8F, 0x87, 0x19, 0x1F, 0x8A, 0x54, 0xA0, 0xC8, 0x47, 0xA2, 0x3D, 0x87, 0xEA, 0xF3, 0xCA, 0xE0, 0x3D, 0xBE, 0xEF, 0x1A, 0x60, 0xE1, 0x59, 0x61, 0x60, 0x73,
+  0xDD, 0xFD, 0x0A, 0x33, 0x27, 0xBE, 0x8D, 0xF3, 0x0D, 0x1C, 0xE6, 0x87, 0xC3, 0x6C, 0x85, 0x5A, 0x8E, 0x0D, 0xC4, 0xF9, 0xB6, 0x28, 0xDE, 0xC7, 0x59, 0x21,
+  0xF2, 0x48, 0xB9, 0x36, 0xB8, 0x64, 0x8D, 0x09, 0x3A, 0x93, 0xED, 0xC3, 0xA9, 0x4F, 0x7D, 0xA6, 0x1B, 0x0F, 0x7B, 0xCE, 0x1B, 0x1F, 0xDC, 0x0E, 0xBF, 0x65,
+  0x1F, 0xD4, 0x83, 0xBF, 0xC6, 0x61, 0x70, 0xEE, 0x2E, 0x74, 0x4B, 0x36, 0x63, 0xEF, 0x38, 0xB8, 0x16, 0x0F, 0xAD, 0x0F, 0x6D, 0x73, 0xFC, 0x58, 0xD9, 0xDF,
+  0xF1, 0xDE, 0x7F, 0xFA, 0x1A, 0xBB, 0x80, 0x7E, 0x49, 0x08, 0x5B, 0x94, 0x64, 0xE6, 0x48, 0xF0, 0xFC, 0x41, 0x79, 0x7C, 0x29, 0x5B, 0x8A, 0x96, 0x24, 0x3C,
+  0x30, 0xEE, 0xD0, 0xA9, 0xCF, 0xC9, 0xB8, 0x17, 0x09, 0xC4, 0x3E, 0x3E, 0xFE, 0x8E, 0x4E, 0x0D, 0x17, 0x70, 0x24, 0xA0, 0x5F, 0x47, 0xEC, 0x91, 0x5B, 0x6E,
+  0x13, 0xD9, 0x1E, 0xE7, 0x56, 0x87, 0x14, 0x6F, 0xA3, 0x88, 0x7D, 0x4A, 0x3F, 0x57, 0x86, 0x10, 0x7D, 0xA4, 0x3E, 0x0C, 0x71, 0x9B, 0xF5, 0x3C, 0x6C, 0x34,
+  0x66, 0x5D, 0x7C, 0x78, 0x98, 0x48, 0xD2, 0xCE, 0x8F, 0x66, 0xDD, 0x6D, 0x0F, 0x67, 0x6E, 0x7D, 0xF2, 0x1B, 0x28, 0x2D, 0xFC, 0xE0, 0x37, 0x72, 0x69, 0x00,
+  0xD8, 0xD4, 0x99, 0xA9, 0xD4, 0xC9, 0x47, 0x8C, 0xE4, 0xF6, 0xF8, 0xFC, 0x37, 0xE2, 0xAE, 0x8F, 0xC7, 0x4E, 0xE2, 0x33, 0xE0, 0xDD, 0xD0, 0x33, 0xE0, 0x7D,
+  0xF9, 0x0C, 0x78, 0xB0, 0x20, 0xD9, 0x5A, 0x75, 0x5A, 0xAD, 0x93, 0x5B, 0x7C, 0x0E, 0xFC, 0x56, 0x68, 0x62, 0x3E, 0x28, 0x1B, 0x4D, 0x5D, 0x49, 0x93, 0xF2,
+  0x5C, 0xC6, 0x6A, 0x32, 0xB9, 0x6F, 0x14, 0x89, 0x95, 0xE1, 0xE2, 0x24, 0xB5, 0xDA, 0xFB, 0x7E, 0x58, 0x9F, 0x29, 0xF7, 0x6D, 0x3D, 0xAB, 0x1F, 0xEB, 0x0D,
+  0x7B, 0xA9, 0xCE, 0x50, 0x31, 0xFA, 0x97, 0xB7, 0x69, 0xF4, 0xD3, 0x12, 0x46, 0x3F, 0xDD, 0x30, 0xFA, 0x3D, 0x5A, 0xBB, 0x44, 0xFC, 0x5F, 0xCD, 0xE2, 0x25,
+  0x5D, 0x39, 0xAC, 0x3E, 0x96, 0xAE, 0x56, 0xEB, 0x56, 0xED, 0x7E, 0xAB, 0x91, 0xF8, 0xCA, 0xF0, 0xF2, 0x36, 0x8D, 0x24, 0x41, 0x75, 0x0B, 0xE9, 0xA9, 0x70,
+  0x3B, 0x83, 0xFD, 0xCC, 0x4B, 0x2C, 0x9A, 0x52, 0x05, 0x2A, 0x46, 0xC7, 0xA7, 0xB2, 0x3B, 0x5D, 0x11, 0x3A, 0xDD, 0x86, 0x78, 0xB2, 0xBF, 0x17, 0x64, 0xC7,
+  0x81, 0xD9, 0x42, 0x09, 0x71, 0x33, 0x07, 0x66, 0x6F, 0x5F, 0xBF, 0xCE, 0x17, 0x8B, 0xA9, 0xA3, 0xDC, 0x93, 0x58, 0x2C, 0x75, 0x35, 0x62, 0xBD, 0x80, 0x1B,
+  0x88, 0x75, 0x21, 0xD5, 0x0D, 0xBA, 0x57, 0x06, 0xCF, 0xD8, 0x31, 0x51, 0x38, 0x96, 0x4B, 0x79, 0x33, 0x27, 0xA8, 0xD1, 0xE5, 0x8A, 0x00, 0x85, 0xFC, 0x39,
+  0xEA, 0xB6, 0x25, 0x0A, 0x85, 0xBC, 0xEC, 0x44, 0x95, 0xB6, 0x89, 0x4C, 0xA1, 0xF0, 0x7C, 0x69, 0x16, 0x16, 0x9B, 0xE8, 0x5B, 0x19, 0xBC, 0x59, 0x9A, 0x9E,
+  0xB1, 0x30, 0x0D, 0xC8, 0x3C, 0xAA, 0x2D, 0xD2, 0x20, 0x1D, 0xAD, 0xB6, 0xC7, 0x39, 0x52, 0xA2, 0x91, 0xF3, 0xA5, 0x48, 0x5A, 0xF0, 0xCC, 0x62, 0xE7, 0x96,
+  0xDE, 0x8A, 0x54, 0x56, 0x20, 0x8E, 0x6D, 0x7B, 0x85, 0xA5, 0x21, 0x3B, 0x43, 0xA0, 0x02, 0x47, 0x24, 0x90, 0x49, 0x76, 0x51, 0x28, 0x3B, 0xA8, 0x03, 0x68,
+  0xD9, 0xC4, 0x91, 0x69, 0xBF, 0x34, 0x6E, 0x43, 0xCA, 0xBA, 0xD1, 0x38, 0x06, 0xAA, 0x56, 0x19, 0xB4, 0x73, 0x40, 0xD8, 0xBE, 0xDD, 0xF8, 0xB6, 0x8C, 0xC8,
+  0x5D, 0x17, 0xF7, 0x7D, 0xA2, 0x2F, 0x84, 0xDD, 0x6B, 0x08, 0x75, 0xE7, 0xE4, 0x05, 0x8C, 0xC5, 0x8C, 0x48, 0xEB, 0xED, 0xD3, 0x88, 0x24, 0x1A, 0xC5, 0x8D,
+  0x48, 0xAB, 0xDC, 0x1B, 0xA7, 0xB6, 0x70, 0x68, 0x61, 0x79, 0x88, 0xBE, 0x95, 0xC1, 0x5B, 0x87, 0xA2, 0x30, 0x0A, 0x59, 0x8F, 0x0F, 0xA4, 0x98, 0xF1, 0xDC,
+  0x82, 0xA1, 0x68, 0xCD, 0x5E, 0x39, 0x18, 0xED, 0x7C, 0xC6, 0x16, 0x03, 0xA1, 0x13, 0xEF, 0x04, 0x3A, 0xF7, 0xD3, 0x84, 0xA9, 0x39, 0xEE, 0x15, 0x37, 0x62,
+  0xD9, 0x1B, 0xB3, 0x67, 0x38, 0x2C, 0xAC, 0x38, 0x0A, 0xA0, 0x7B, 0xE5, 0x77, 0xB5, 0xBB, 0x57, 0xA6, 0x41, 0x3B, 0x97, 0x4A, 0xEF, 0x47, 0x75, 0x16, 0xF8,
+  0x0E, 0x49, 0x6A, 0x15, 0xF3, 0x34, 0xBC, 0x2F, 0x78, 0x1A, 0xF6, 0x16, 0x49, 0xF6, 0x48, 0xC3, 0x5E, 0x63, 0x5E, 0x89, 0xC0, 0xE6, 0x6A, 0x5A, 0xFE, 0x1D,
+  0x20, 0x5B, 0x42, 0x60, 0x9F, 0xD6, 0xFB, 0x16, 0xFF, 0x32, 0xC4, 0x0A, 0xCF, 0x15, 0xA2, 0xB3, 0x10, 0xA1, 0x3F, 0x75, 0xEF, 0x37, 0xFE, 0xF5, 0xB1, 0x28,
+  0x31, 0x77, 0xEF, 0x31, 0x00, 0x56, 0x96, 0x8D, 0x98, 0x00, 0xB8, 0xD3, 0xF4, 0x78, 0xC6, 0x97, 0x63, 0x25, 0x68, 0xC7, 0x79, 0xFE, 0xB5, 0x61, 0xE5, 0xCF,
+  0xF3, 0x7F, 0x31, 0xAC, 0xB1, 0x7D, 0x9D, 0x2F, 0xD5, 0x57, 0x07, 0xFA, 0x13, 0xA4, 0xFA, 0x6C, 0xB2, 0xC4, 0x45, 0xC7, 0x86, 0x93, 0x71, 0x21, 0x7A, 0x63,
+  0xB2, 0x64, 0xBD, 0x57, 0xB8, 0xD4, 0x06, 0x20, 0x5C, 0xC2, 0x96, 0x30, 0x77, 0x6D, 0x2F, 0xBF, 0x9E, 0xA9, 0xC1, 0xAE, 0xC0, 0x20, 0x9B, 0xC1, 0x74, 0x63,
+  0x0A, 0x8F, 0x77, 0x5E, 0x4B, 0xFD, 0xC7, 0x26, 0x3D, 0xEB, 0x3B, 0xA7, 0xE7, 0x36, 0x1C, 0x32, 0xB5, 0xC6, 0x85, 0x35, 0x0B, 0xFB, 0x06, 0x7A, 0x75, 0x69,
+  0x8D, 0xF7, 0xAA, 0x55, 0x7C, 0xF4, 0xC2, 0x32, 0x68, 0xB7, 0x8E, 0x4F, 0xEF, 0x97, 0x5A, 0x21, 0x41, 0x25, 0x94, 0x4A, 0xEB, 0x75, 0x8F, 0xEF, 0x8F, 0x5E,
+  0xD9, 0x93, 0x09, 0x5F, 0xE1, 0x2A, 0xA6, 0x5A, 0xA2, 0xFB, 0x8A, 0x3D, 0x31, 0xED, 0xD2, 0xFD, 0xFA, 0x2B, 0x7F, 0xF0, 0x6C, 0xB2, 0xE8, 0xC4, 0xC8, 0xA2,
+  0x7F, 0xBF, 0x54, 0x4B, 0x50, 0xB4, 0x2E, 0x4E, 0x51, 0xFF, 0xFE, 0xA8, 0x96, 0x67, 0x7B, 0xBA, 0x59, 0x58, 0xB3, 0x78, 0x6F, 0x50, 0xAC, 0x0F, 0x78, 0x40,
+  0xDE, 0x03, 0x9D, 0x7B, 0x55, 0x2E, 0x39, 0x7E, 0x71, 0xC7, 0xD5, 0x69, 0xDD, 0xB3, 0xF9, 0x90, 0x93, 0x54, 0xCA, 0x75, 0xF5, 0xBB, 0xF7, 0xC8, 0x75, 0x2D,
+  0x3D, 0xBC, 0x5A, 0xD8, 0x75, 0xF1, 0xEE, 0xE8, 0xBA, 0xD8, 0xD1, 0xFE, 0x55, 0xCC, 0xC7, 0xA0, 0xC4, 0xE4, 0xD8, 0x3D, 0xB9, 0x67, 0x1E, 0x8C, 0xD3, 0x54,
+  0x4A, 0xC9, 0x3A, 0xF7, 0xC5, 0x89, 0x8D, 0xF4, 0xCC, 0xEF, 0xDB, 0xDB, 0x88, 0xE6, 0x79, 0x5F, 0xC8, 0xE1, 0xF8, 0xC1, 0x5E, 0x2B, 0x18, 0x72, 0xF0, 0x5B,
+  0x5F, 0xB2, 0xF3, 0xA9, 0xBA, 0x4F, 0xF5, 0x8A, 0xA1, 0x61, 0x59, 0x45, 0xC5, 0x24, 0xFA, 0x56, 0x06, 0xCF, 0xF8, 0xC1, 0x7E, 0x17, 0x57, 0xC5, 0xE0, 0xB7,
+  0xBF, 0xB2, 0x2A, 0xA9, 0xDA, 0xB7, 0x98, 0x22, 0x45, 0x0C, 0xC7, 0xFF, 0x20, 0x48, 0x45, 0xEC, 0x56, 0x0C, 0x3E, 0x10, 0x72, 0x7F, 0x4A, 0x1A, 0x53, 0x7D,
+  0x8E, 0x0F, 0x92, 0xE7, 0x2D, 0x6A, 0xBC, 0xC4, 0x6E, 0xF9, 0x6A, 0x1A, 0xE1, 0x91, 0xEE, 0x77, 0x55, 0x63, 0x10, 0x7E, 0x83, 0x28, 0x20, 0xDE, 0x18, 0x1A,
+  0xBA, 0x8B, 0x2F, 0x5D, 0x80, 0x63, 0xF2, 0x0C, 0x8E, 0xC9, 0x5B, 0x73, 0xE9, 0xEF, 0x95, 0x8F, 0x33, 0x08, 0x75, 0x67, 0x53, 0x00, 0x21, 0xE9, 0x29, 0x05,
+  0xB6, 0xA1, 0x4B, 0x3C, 0x6C, 0x07, 0xC7, 0xB8, 0x8F, 0xA9, 0xD7, 0x3D, 0x69, 0x55, 0x08, 0x8F, 0x8A, 0xC5, 0xA3, 0x42, 0xEE, 0x57, 0xB6, 0xC1, 0x49, 0xF3,
+  0x11, 0x8C, 0x33, 0x00, 0x15, 0x5F, 0x1F, 0x41, 0xA6, 0xBF, 0x65, 0xF6, 0x1D, 0x6D, 0x72, 0x44, 0x93, 0xEC, 0x68, 0xC5, 0x2A, 0x42, 0xE8, 0x9D, 0xA7, 0xBC,
+  0x7D, 0x96, 0x87, 0x9E, 0xE2, 0x19, 0xA1, 0xC5, 0x32, 0x02, 0xF7, 0x79, 0xDD, 0x2E, 0x4D, 0x6D, 0x49, 0x93, 0x96, 0x8D, 0xA6, 0x76, 0x09, 0x9A, 0xDA, 0x7B,
+  0xA2, 0xA9, 0x23, 0x69, 0x6A, 0x67, 0xA3, 0xA9, 0x53, 0x82, 0xA6, 0xCE, 0x9E, 0x68, 0xEA, 0x4A, 0x9A, 0x3A, 0xD9, 0x68, 0xEA, 0x96, 0xA0, 0xA9, 0xBB, 0x27,
+  0x9A, 0x7A, 0x92, 0xA6, 0x6E, 0x36, 0x9A, 0x7A, 0x25, 0x68, 0xEA, 0xED, 0x89, 0xA6, 0xBE, 0xA4, 0xA9, 0x97, 0x8D, 0xA6, 0x7E, 0x09, 0x9A, 0xFA, 0x7B, 0xA2,
+  0xE9, 0x58, 0xD2, 0xD4, 0xCF, 0x46, 0xD3, 0x71, 0x09, 0x9A, 0x8E, 0xF7, 0x44, 0xD3, 0x89, 0xA4, 0xE9, 0x38, 0x1B, 0x4D, 0x27, 0x25, 0x68, 0x3A, 0xD9, 0x13,
+  0x4D, 0xA7, 0x92, 0xA6, 0x93, 0x6C, 0x34, 0x9D, 0x96, 0xA0, 0xE9, 0x74, 0x4F, 0x34, 0xE1, 0xA2, 0x1C, 0x27, 0xEA, 0x34, 0xE3, 0xA4, 0xDB, 0x2A, 0x41, 0x95,
+  0xBE, 0x2F, 0xAA, 0xFC, 0x50, 0x42, 0xCB, 0x1A, 0x4B, 0x94, 0x09, 0x26, 0x86, 0xFB, 0x22, 0x2B, 0x88, 0x26, 0x32, 0x86, 0x13, 0x5A, 0x99, 0x78, 0x62, 0xB4,
+  0x2F, 0xB2, 0xFC, 0x80, 0x42, 0xCB, 0x18, 0x51, 0x68, 0x65, 0x42, 0x8A, 0xF1, 0xBE, 0xC8, 0xF2, 0x63, 0x0A, 0x2D, 0x63, 0x50, 0xA1, 0x95, 0x89, 0x2A, 0xE8,
+  0xBE, 0xC8, 0xF2, 0xC3, 0x0A, 0x2D, 0x63, 0x5C, 0xA1, 0x95, 0x09, 0x2C, 0x26, 0xFB, 0x22, 0xCB, 0x8F, 0x2C, 0xB4, 0x8C, 0xA1, 0x85, 0x56, 0x22, 0xB6, 0x38,
+  0x6D, 0xED, 0x9E, 0x2C, 0xEA, 0x89, 0x14, 0x39, 0x48, 0xDA, 0x32, 0x3D, 0x7A, 0x22, 0x3A, 0xE1, 0xB3, 0x51, 0x9C, 0x21, 0xCF, 0x6D, 0x6B, 0x62, 0x4C, 0xFD,
+  0x22, 0xC3, 0xBD, 0x79, 0x4A, 0xC2, 0x55, 0x5E, 0xBE, 0x9C, 0xB9, 0xD0, 0xF0, 0xFE, 0xC5, 0x65, 0xBE, 0x32, 0x83, 0x3A, 0xCA, 0x9F, 0xA8, 0xC8, 0x00, 0x68,
+  0xB7, 0xD5, 0x2F, 0x41, 0x64, 0xAA, 0x2B, 0xB0, 0x4E, 0x79, 0x2A, 0x0A, 0x3D, 0xB5, 0xA2, 0xD0, 0xCF, 0x5C, 0x51, 0xE0, 0xC8, 0xED, 0xA6, 0x96, 0x00, 0xB0,
+  0x3B, 0xFC, 0xF3, 0x15, 0xD9, 0x89, 0xEE, 0x14, 0x27, 0xBA, 0x97, 0x87, 0xE8, 0x4E, 0x11, 0xA2, 0x0B, 0x3C, 0xDD, 0x98, 0x91, 0x4F, 0x80, 0xEF, 0x0F, 0xC6,
+  0x8A, 0x8E, 0xC9, 0x3F, 0xB2, 0xB3, 0x4A, 0x2B, 0xCE, 0xAA, 0xE3, 0x3C, 0xAC, 0xD2, 0x76, 0xA8, 0x1F, 0x3D, 0x49, 0xF7, 0xCF, 0xD9, 0xE9, 0xEE, 0x15, 0xA7,
+  0xBB, 0x93, 0x87, 0xEE, 0xDE, 0x0E, 0xE9, 0xEE, 0x4A, 0xBA, 0x3F, 0x66, 0xA7, 0xBB, 0x5B, 0x9C, 0xEE, 0x6E, 0x1E, 0xBA, 0xBB, 0x3B, 0xA4, 0xBB, 0x0D, 0xCE,
+  0xE6, 0xE7, 0x8F, 0xE4, 0xC3, 0xCC, 0xA1, 0xEE, 0x6C, 0x7B, 0x25, 0x8E, 0xF7, 0x28, 0x3A, 0xB7, 0xF7, 0xF6, 0x90, 0xBB, 0x21, 0x86, 0x1D, 0x95, 0xA6, 0x76,
+  0x16, 0x9A, 0x3A, 0x99, 0xBE, 0x0F, 0x15, 0x4F, 0x53, 0x7C, 0xE6, 0xA6, 0x65, 0x25, 0x6A, 0x77, 0x3E, 0xEC, 0xA4, 0x32, 0x78, 0xB5, 0xCC, 0x31, 0xBF, 0x9D,
+  0x14, 0xD7, 0xE7, 0x56, 0x1E, 0x7D, 0x3E, 0xD9, 0xA1, 0x3E, 0x9F, 0x32, 0x9A, 0x21, 0x2E, 0x73, 0x33, 0x88, 0xFD, 0xB4, 0x84, 0x26, 0x6B, 0xFB, 0xD0, 0x64,
+  0xFC, 0x5C, 0x3C, 0x92, 0xF3, 0x33, 0x12, 0x44, 0x20, 0x62, 0xC9, 0x31, 0x19, 0x1D, 0xE7, 0x94, 0xE6, 0x49, 0x41, 0xEF, 0x84, 0x38, 0xEE, 0x4C, 0x9C, 0x98,
+  0x7A, 0x20, 0x03, 0x3E, 0x16, 0x60, 0x40, 0xBF, 0x38, 0x03, 0x72, 0x45, 0x2E, 0x88, 0xE3, 0xEE, 0x18, 0xD0, 0xE2, 0x0C, 0x78, 0x1F, 0xBC, 0x80, 0x3C, 0x45,
+  0xA1, 0x4B, 0x54, 0xA0, 0x7A, 0x7B, 0x58, 0x23, 0x41, 0x4F, 0xAB, 0x49, 0x8D, 0x06, 0x8A, 0xF2, 0x09, 0xB4, 0xAD, 0x15, 0x17, 0x68, 0x2E, 0xFF, 0xD4, 0xDE,
+  0x65, 0x80, 0xD5, 0x6E, 0x49, 0x8D, 0xCE, 0xCF, 0x80, 0x56, 0x71, 0x06, 0x68, 0xB9, 0x18, 0xD0, 0xBA, 0x5F, 0xC1, 0x78, 0x7F, 0xF3, 0x9B, 0xD1, 0xDB, 0xB9,
+  0xD5, 0x2F, 0x3E, 0x9B, 0xB5, 0xF3, 0x30, 0x6B, 0xA7, 0xD6, 0xDF, 0x09, 0x28, 0x27, 0xFF, 0x20, 0xE1, 0xAD, 0xAF, 0x69, 0x7E, 0xA0, 0x53, 0xC2, 0x0F, 0xF4,
+  0xF6, 0x32, 0xB3, 0x9D, 0xC6, 0x50, 0x96, 0xD3, 0xC1, 0x9F, 0x16, 0x37, 0x87, 0x5C, 0x12, 0x46, 0x5C, 0x77, 0x27, 0xE2, 0x5E, 0x88, 0x11, 0xFC, 0x7B, 0xF5,
+  0x59, 0x44, 0xDC, 0x2B, 0x21, 0xE2, 0xE3, 0xBD, 0x88, 0xF8, 0x24, 0x86, 0xB2, 0x9C, 0x22, 0x3E, 0x29, 0x2E, 0xE2, 0x5C, 0xA9, 0xA5, 0xB6, 0xCB, 0x98, 0x14,
+  0xAB, 0xDD, 0x0A, 0x23, 0xD4, 0x8F, 0x89, 0xA4, 0x09, 0xB8, 0x5B, 0x42, 0xC0, 0xE5, 0xD6, 0x67, 0x77, 0xE7, 0xC9, 0x8F, 0xE3, 0xBE, 0x34, 0xBF, 0x5D, 0x0F,
+  0x8E, 0x8B, 0xFB, 0xF2, 0x5C, 0x13, 0xDF, 0x4E, 0x43, 0x59, 0x18, 0x1D, 0xA2, 0x9E, 0x4D, 0xEA, 0x53, 0x54, 0x40, 0x2B, 0xA1, 0x02, 0x9D, 0xBD, 0xD8, 0x78,
+  0xBB, 0x32, 0xF8, 0x98, 0x93, 0xA8, 0x32, 0xF5, 0x83, 0xC2, 0xFB, 0x43, 0xF6, 0x57, 0x7A, 0x1F, 0xCD, 0x57, 0xF9, 0x4B, 0xEF, 0xCF, 0xDF, 0xFC, 0x9A, 0xAF,
+  0xF4, 0xAE, 0x8E, 0xB2, 0xBF, 0xD2, 0xFB, 0x1E, 0x5E, 0xA3, 0x05, 0x84, 0xE1, 0xFB, 0x23, 0x46, 0x86, 0xCB, 0x86, 0x04, 0xC6, 0x90, 0xB7, 0xF2, 0xD4, 0x67,
+  0x91, 0xF2, 0xC4, 0x7E, 0xB8, 0x7D, 0x9A, 0xF6, 0x74, 0x52, 0xDC, 0x42, 0xD1, 0xD7, 0xA1, 0x34, 0xFB, 0xE2, 0x7B, 0x6B, 0x25, 0x1E, 0xAD, 0x4F, 0x7A, 0x69,
+  0x40, 0xF3, 0x38, 0x27, 0xEC, 0x9D, 0x3F, 0x72, 0x3F, 0x88, 0x08, 0x4A, 0x63, 0xF2, 0xD1, 0xF0, 0x3C, 0x73, 0x9D, 0x9C, 0x75, 0xCB, 0xE3, 0xCD, 0x3B, 0x6A,
+  0xA9, 0x25, 0xBB, 0x37, 0xE7, 0xE8, 0xED, 0xC6, 0x9B, 0x23, 0xEC, 0x10, 0xED, 0x39, 0xA2, 0x1A, 0xDE, 0x37, 0x1F, 0x03, 0x86, 0x45, 0x12, 0x59, 0x81, 0x64,
+  0x2C, 0x07, 0x6E, 0x85, 0x05, 0x6D, 0xC6, 0x81, 0x76, 0x44, 0xFA, 0x09, 0x8E, 0x9F, 0xB5, 0x2F, 0xEA, 0xF7, 0x3B, 0x7B, 0xA8, 0x4D, 0x20, 0xBB, 0x42, 0x14,
+  0xE5, 0x94, 0x69, 0xBB, 0xB8, 0x4C, 0xF3, 0x29, 0x75, 0x7B, 0x87, 0x5A, 0xDD, 0x61, 0x0C, 0xE8, 0x64, 0x16, 0x69, 0xA7, 0x84, 0x48, 0x3B, 0x7B, 0x11, 0x69,
+  0x88, 0xA2, 0x9C, 0x22, 0xED, 0x14, 0x17, 0x69, 0x3B, 0x97, 0x48, 0x3B, 0x3B, 0x14, 0x69, 0x97, 0x31, 0xA0, 0x9B, 0x59, 0xA4, 0xDD, 0x12, 0x22, 0xED, 0xEE,
+  0x45, 0xA4, 0x21, 0x8A, 0x72, 0x8A, 0xB4, 0x5B, 0x5C, 0xA4, 0x9D, 0x5C, 0x22, 0xED, 0xEE, 0x50, 0xA4, 0x3D, 0xC6, 0x80, 0x5E, 0x66, 0x91, 0xF6, 0x4A, 0x88,
+  0xB4, 0xB7, 0x17, 0x91, 0x86, 0x28, 0xCA, 0x29, 0xD2, 0x5E, 0x71, 0x91, 0x76, 0x73, 0x89, 0xB4, 0xB7, 0x43, 0x91, 0xF6, 0x19, 0x03, 0xFA, 0x99, 0x45, 0xDA,
+  0x2F, 0x21, 0xD2, 0xFE, 0x5E, 0x44, 0x1A, 0xA2, 0x28, 0xA7, 0x48, 0xFB, 0xC5, 0x45, 0xDA, 0xCB, 0x25, 0xD2, 0xFE, 0x0E, 0x45, 0x7A, 0xCC, 0x18, 0x70, 0x9C,
+  0x59, 0xA4, 0xC7, 0x25, 0x44, 0x7A, 0xBC, 0x17, 0x91, 0x86, 0x28, 0xCA, 0x29, 0xD2, 0xE3, 0xE2, 0x22, 0xED, 0xE7, 0x12, 0xE9, 0xF1, 0x0E, 0x45, 0x7A, 0xC2,
+  0x18, 0x70, 0x92, 0x59, 0xA4, 0x27, 0x25, 0x44, 0x7A, 0xB2, 0x17, 0x91, 0x86, 0x28, 0xCA, 0x29, 0xD2, 0x93, 0xE2, 0x22, 0x3D, 0xCE, 0x25, 0xD2, 0x93, 0x1D,
+  0x8A, 0xF4, 0x94, 0x31, 0xE0, 0x34, 0xB3, 0x48, 0x4F, 0x4B, 0x88, 0xF4, 0x74, 0x2F, 0x22, 0x6D, 0xA9, 0x14, 0xE5, 0x14, 0x69, 0x2B, 0xA7, 0x48, 0xF5, 0xA2,
+  0x89, 0x69, 0x2B, 0x6F, 0x62, 0xBA, 0xBF, 0xFA, 0x9D, 0x7E, 0x3D, 0x2C, 0xF0, 0xE9, 0x97, 0xA7, 0xBF, 0x3C, 0x4B, 0x2E, 0xEC, 0x27, 0x56, 0xF1, 0x42, 0x63,
+  0xDD, 0xF7, 0x32, 0x5E, 0xE8, 0xD3, 0xE8, 0x80, 0x38, 0x48, 0x99, 0xBF, 0x34, 0x91, 0x6C, 0x10, 0x9F, 0xAE, 0x69, 0xBC, 0x73, 0x0E, 0x4D, 0xEB, 0x74, 0x5B,
+  0xFD, 0x22, 0x9A, 0x26, 0xB0, 0xDC, 0x8D, 0xF3, 0x40, 0xE0, 0x90, 0x8B, 0x23, 0xED, 0xEF, 0x32, 0xAD, 0xE9, 0xF0, 0x0E, 0x61, 0xF7, 0xD1, 0x6D, 0x9D, 0x66,
+  0xF4, 0x1F, 0xC0, 0x83, 0xA4, 0x8D, 0xF1, 0xB7, 0xE8, 0x40, 0x10, 0xC7, 0x0E, 0x27, 0xEA, 0x65, 0x66, 0xA2, 0x3A, 0x65, 0x88, 0x6A, 0xEF, 0x87, 0xA8, 0x2E,
+  0x27, 0xEA, 0x59, 0x66, 0xA2, 0xBA, 0x65, 0x88, 0xEA, 0x6E, 0x25, 0xEA, 0x3E, 0x38, 0x3A, 0x3A, 0xD2, 0xA7, 0xA3, 0x02, 0xAE, 0xEE, 0xF2, 0xF9, 0xD1, 0xD3,
+  0x97, 0xCF, 0x09, 0x5B, 0xD2, 0xB4, 0xCD, 0x9C, 0x1E, 0x2F, 0x3C, 0xE8, 0x9F, 0xCA, 0xE7, 0x31, 0xD4, 0x15, 0xAF, 0xF7, 0xF2, 0x79, 0x56, 0x87, 0x27, 0x7A,
+  0xE6, 0x71, 0x79, 0xBD, 0x56, 0xA7, 0x48, 0x85, 0xD0, 0x47, 0x72, 0x47, 0x4E, 0x8F, 0x81, 0x6F, 0x07, 0x3C, 0xB8, 0xCC, 0xC7, 0x83, 0x76, 0x71, 0x1E, 0xB4,
+  0x72, 0xF2, 0xA0, 0xBD, 0x5B, 0x1E, 0xA0, 0x97, 0xBC, 0x7C, 0x4E, 0xDE, 0xFE, 0x95, 0x5C, 0xAE, 0x16, 0xB6, 0xBB, 0x74, 0xE8, 0x56, 0xAF, 0x22, 0xFA, 0x85,
+  0xFD, 0x4A, 0xBF, 0xD7, 0xEB, 0x64, 0x75, 0x2C, 0xBD, 0xE4, 0x29, 0x60, 0xD2, 0xAA, 0xDC, 0x32, 0x81, 0x5D, 0x9F, 0xC0, 0x77, 0x14, 0x24, 0x9D, 0xC9, 0x6F,
+  0x8A, 0x8E, 0x61, 0x0A, 0xB5, 0x16, 0x6E, 0xAF, 0xCE, 0x48, 0x60, 0x7C, 0x44, 0xD9, 0xB9, 0xD5, 0xE9, 0x80, 0x61, 0xD9, 0xF3, 0xC9, 0xFB, 0xF8, 0xE1, 0x7D,
+  0x36, 0xC2, 0x7A, 0xA5, 0x44, 0x37, 0x4A, 0x14, 0xDD, 0xAD, 0x4C, 0x0A, 0x0F, 0xE2, 0xFB, 0x81, 0xEB, 0xDD, 0xEC, 0x93, 0xC0, 0xC9, 0xF3, 0x89, 0x31, 0x05,
+  0x3D, 0x8E, 0x1F, 0x83, 0xB1, 0x96, 0xBF, 0xEC, 0x14, 0xBF, 0x75, 0xD9, 0x18, 0x81, 0xF7, 0x07, 0x95, 0x40, 0xA3, 0x93, 0x0C, 0x9F, 0xEB, 0x53, 0x1A, 0x5C,
+  0x27, 0xDC, 0xB7, 0xA7, 0xF9, 0x6C, 0x9D, 0x03, 0xD4, 0xAF, 0xA8, 0xF8, 0x30, 0x27, 0x99, 0x39, 0x74, 0x72, 0x51, 0xF9, 0xCE, 0x87, 0x29, 0x9E, 0xCA, 0xC3,
+  0x26, 0x15, 0x32, 0xB6, 0xAF, 0x2D, 0xD3, 0xD6, 0x71, 0x3E, 0xD0, 0x17, 0x1E, 0x60, 0xDA, 0xFC, 0x7D, 0x81, 0x2F, 0xBE, 0xD2, 0xF1, 0x21, 0x2E, 0x3D, 0xDB,
+  0x67, 0x5D, 0x47, 0xA6, 0xED, 0xCA, 0x6C, 0x0E, 0x0F, 0xFD, 0x0F, 0x79, 0xFE, 0xCF, 0x7F, 0x6F, 0xDB, 0x41, 0x60, 0xCC, 0xA7, 0x0A, 0x03, 0x2A, 0xC4, 0x75,
+  0x46, 0x17, 0x15, 0xC0, 0xD4, 0xB1, 0x5D, 0xD7, 0x76, 0x8C, 0xA9, 0x91, 0x36, 0x65, 0x8F, 0x74, 0xEB, 0x4A, 0x77, 0x55, 0x06, 0x8A, 0x0F, 0xB2, 0x86, 0x26,
+  0x42, 0xD4, 0x04, 0xDE, 0x32, 0x17, 0x28, 0xFE, 0x15, 0xAF, 0x5C, 0x90, 0x92, 0x54, 0xE0, 0x28, 0x4E, 0x07, 0x22, 0x8D, 0x63, 0xB4, 0xF1, 0xDC, 0x1D, 0x39,
+  0xC6, 0xC2, 0x1B, 0x3C, 0x18, 0xDB, 0xA3, 0xE5, 0x9C, 0x5A, 0x5E, 0x53, 0x1F, 0x8F, 0x2F, 0xAF, 0xE0, 0xE0, 0x35, 0x7E, 0x41, 0x0E, 0xD4, 0xA1, 0x7A, 0xF0,
+  0xE2, 0x6F, 0x6F, 0x30, 0x64, 0xC0, 0x6B, 0x20, 0x44, 0x3A, 0x3E, 0xA8, 0x93, 0xC9, 0xD2, 0xE2, 0xB3, 0x76, 0x95, 0x62, 0xDB, 0x1A, 0xF9, 0x06, 0x10, 0xAF,
+  0x74, 0x87, 0x0C, 0x75, 0x97, 0xBE, 0xB2, 0x5D, 0x8F, 0x5C, 0x10, 0x1F, 0xA2, 0x69, 0x8F, 0xD8, 0x1E, 0x93, 0x26, 0x67, 0xB6, 0x68, 0xC9, 0x59, 0xF0, 0xB3,
+  0x63, 0x42, 0x53, 0xBF, 0xD7, 0x21, 0x39, 0x38, 0x3B, 0xD1, 0x0E, 0xD0, 0xA0, 0xFC, 0x21, 0x26, 0x14, 0xA6, 0x24, 0x68, 0x57, 0x5D, 0x3A, 0x66, 0x9D, 0x8C,
+  0x86, 0xB5, 0x6F, 0x0C, 0x7B, 0x76, 0x19, 0xAF, 0xD5, 0x04, 0x31, 0x4D, 0x6F, 0x46, 0xAD, 0x6A, 0x80, 0x99, 0x43, 0xDD, 0x85, 0x6D, 0xB9, 0x94, 0x23, 0xC7,
+  0xFF, 0x19, 0x93, 0xE0, 0x7A, 0xD3, 0xF5, 0x74, 0x6F, 0xE9, 0x92, 0x87, 0x17, 0x17, 0xA4, 0xDD, 0x6A, 0xA9, 0xCD, 0x08, 0x0C, 0x13, 0x6D, 0x57, 0x27, 0x91,
+  0x0B, 0x1F, 0xE8, 0xCA, 0xAB, 0x3D, 0xF6, 0xFB, 0xDC, 0x10, 0x6A, 0xBA, 0x34, 0x04, 0xC4, 0xEF, 0x80, 0xEF, 0xB8, 0xAB, 0xD6, 0xC2, 0x08, 0x56, 0xC7, 0xBA,
+  0xA7, 0xD7, 0xBE, 0x85, 0xE4, 0x05, 0xA3, 0x02, 0x26, 0x75, 0xC2, 0x6E, 0x3D, 0x56, 0x6E, 0xDD, 0xD4, 0x9A, 0xC0, 0x43, 0xA0, 0xD7, 0xEF, 0x4D, 0x1D, 0x27,
+  0x8C, 0x31, 0xEB, 0xDD, 0xD0, 0xEA, 0x04, 0xEF, 0x84, 0xFB, 0x2A, 0x48, 0x3E, 0x90, 0xD7, 0x24, 0xD3, 0xD2, 0xC1, 0xC6, 0x80, 0xE4, 0xE0, 0x6E, 0x42, 0x22,
+  0x02, 0xE7, 0xF8, 0x8E, 0x4E, 0x81, 0x63, 0xD3, 0xBA, 0xF0, 0x95, 0x75, 0xE6, 0x28, 0xEB, 0xDC, 0xC7, 0x2A, 0x52, 0x03, 0x2F, 0xE3, 0xDA, 0x26, 0x05, 0x9D,
+  0x98, 0x56, 0x0F, 0xC4, 0xF7, 0x49, 0x41, 0x9F, 0x0E, 0x5A, 0xAB, 0x83, 0x43, 0xE8, 0xDE, 0xF4, 0xEC, 0xF7, 0x9E, 0x63, 0x58, 0xD3, 0xAA, 0xD6, 0xAF, 0x05,
+  0xB0, 0xD8, 0x6D, 0x04, 0x18, 0xB9, 0xCF, 0xAE, 0xB3, 0x21, 0xA2, 0x37, 0xAA, 0xE2, 0xFA, 0xE1, 0x41, 0xED, 0x40, 0xA0, 0xCE, 0xCE, 0x41, 0xD9, 0xAA, 0xFC,
+  0xE0, 0x11, 0xC3, 0xB0, 0x46, 0xCE, 0xCF, 0xC5, 0x30, 0xBC, 0x15, 0x5E, 0x84, 0x46, 0xEC, 0x27, 0x72, 0xCB, 0x57, 0xC4, 0xDF, 0xBE, 0xFF, 0x26, 0x35, 0xF6,
+  0xE6, 0x08, 0xB0, 0x7E, 0x82, 0x93, 0xC5, 0xF7, 0xDF, 0xE0, 0xEF, 0xCD, 0x23, 0x36, 0x3F, 0x7C, 0xFF, 0x0D, 0x7F, 0x6E, 0x1E, 0xC1, 0x48, 0x70, 0xCC, 0xC6,
+  0xBB, 0xF9, 0x8D, 0x71, 0x61, 0x93, 0x77, 0xD3, 0x44, 0xDE, 0xF9, 0x4C, 0xCB, 0x8D, 0xD3, 0x34, 0x05, 0xA9, 0xDF, 0x02, 0xEB, 0xAD, 0x8E, 0xEC, 0x31, 0x08,
+  0xC7, 0x03, 0x3D, 0x96, 0x22, 0x37, 0x41, 0x24, 0x92, 0x51, 0x2D, 0x29, 0x72, 0x63, 0xC2, 0x5A, 0x12, 0x61, 0x28, 0x81, 0x7A, 0xC8, 0x96, 0x0B, 0xDD, 0x71,
+  0xE9, 0x8F, 0x96, 0x57, 0xF5, 0x42, 0x26, 0x91, 0xC0, 0xF1, 0xC1, 0x20, 0x44, 0x02, 0xFE, 0x83, 0x7E, 0xD0, 0xEE, 0x40, 0x08, 0xCD, 0x57, 0xB5, 0x07, 0xBE,
+  0x16, 0x06, 0x98, 0xF2, 0x9B, 0x09, 0x5A, 0xF8, 0xEB, 0xC8, 0xFC, 0x5A, 0x5D, 0xC1, 0x9F, 0xA8, 0xA3, 0xD8, 0x60, 0x11, 0x36, 0x7A, 0x82, 0x7F, 0x80, 0x2F,
+  0xF8, 0x93, 0x28, 0x1F, 0x80, 0xFA, 0xD6, 0x34, 0xAB, 0xFC, 0x5B, 0x64, 0x20, 0x9A, 0x25, 0x38, 0x21, 0x77, 0x8D, 0xEE, 0xC0, 0xB6, 0xBD, 0x2F, 0x75, 0xB2,
+  0x70, 0x00, 0x31, 0xF6, 0xF9, 0x11, 0x38, 0x06, 0x40, 0xD4, 0xE2, 0xBF, 0x5B, 0x31, 0x58, 0x98, 0xE6, 0x13, 0x0E, 0x15, 0x50, 0xE0, 0x07, 0x20, 0xA9, 0x25,
+  0x6A, 0x0C, 0xFC, 0xBD, 0x79, 0x04, 0x83, 0xC0, 0x21, 0xFC, 0xBD, 0x79, 0x84, 0x43, 0xA1, 0x2C, 0x71, 0xC4, 0x9B, 0x47, 0x30, 0x22, 0x9C, 0xC0, 0x5F, 0x68,
+  0x83, 0xE3, 0x62, 0x2B, 0xFC, 0x85, 0x3B, 0x6C, 0x7C, 0xBC, 0xC9, 0x0E, 0xF8, 0x05, 0x71, 0x9A, 0x46, 0x20, 0x7F, 0xFD, 0x7E, 0x95, 0xBD, 0x0E, 0xFD, 0xCB,
+  0x0A, 0xC8, 0x61, 0x07, 0x6B, 0x30, 0x7C, 0x6B, 0x8C, 0xE7, 0xF8, 0xB3, 0x96, 0xEA, 0x89, 0x17, 0xC4, 0x11, 0x5C, 0x63, 0xAF, 0x8C, 0xC5, 0x4B, 0xFC, 0x00,
+  0x5B, 0xB1, 0x17, 0x7C, 0xB2, 0x56, 0xFC, 0x08, 0xAE, 0x89, 0xD7, 0x42, 0xD6, 0x89, 0x78, 0xF1, 0xE0, 0x56, 0xE6, 0x04, 0x2F, 0x06, 0x7C, 0xE2, 0xAE, 0x90,
+  0x40, 0x8E, 0x1A, 0x72, 0xC5, 0x3F, 0x5B, 0xDF, 0x3C, 0xA2, 0x78, 0x8F, 0x21, 0x09, 0xC7, 0x6B, 0x71, 0x0C, 0xD7, 0x01, 0x3F, 0xBC, 0x23, 0x11, 0x66, 0x17,
+  0xD6, 0xC1, 0x05, 0x68, 0xE1, 0xE1, 0x7D, 0x81, 0x3C, 0x9C, 0xAD, 0xFD, 0x33, 0xEC, 0xCD, 0xFA, 0x0A, 0x32, 0xE0, 0x74, 0x1D, 0x9C, 0xC2, 0x5D, 0xA4, 0x05,
+  0x05, 0x20, 0x68, 0xBA, 0x79, 0x24, 0x68, 0x42, 0x29, 0xF2, 0xA3, 0x28, 0xAB, 0xD1, 0xE9, 0x79, 0xC2, 0x49, 0x3E, 0xE3, 0x81, 0x91, 0x32, 0x3D, 0x82, 0x03,
+  0xB8, 0x34, 0x29, 0x1E, 0x3E, 0x5B, 0xFF, 0x38, 0xAE, 0x1E, 0x88, 0xEF, 0xC9, 0x1E, 0xA0, 0x8B, 0x56, 0xFB, 0x34, 0x6D, 0x6B, 0x64, 0x1A, 0x23, 0xF4, 0x04,
+  0xD5, 0x1A, 0xB9, 0x18, 0x08, 0x37, 0x8D, 0x16, 0x0B, 0xCD, 0x55, 0x2B, 0x4C, 0x04, 0x2D, 0xBF, 0x88, 0x7A, 0x50, 0x6B, 0x32, 0x43, 0x13, 0xC6, 0x84, 0x20,
+  0x84, 0x8F, 0xC9, 0x06, 0x03, 0x1B, 0xC7, 0xC0, 0xD8, 0x70, 0x07, 0xA9, 0x40, 0x58, 0x6B, 0x05, 0x0A, 0x03, 0xA3, 0xCE, 0x24, 0xAD, 0xC8, 0x24, 0x92, 0xE2,
+  0xB6, 0xA4, 0x87, 0x7A, 0x18, 0xF5, 0x50, 0x20, 0x2A, 0xC7, 0xAB, 0x1E, 0x5C, 0x3A, 0x8E, 0xED, 0x7C, 0x3A, 0x38, 0xC4, 0x46, 0x87, 0x07, 0x9F, 0xCF, 0xC8,
+  0xC1, 0xA1, 0xEA, 0xAA, 0x6E, 0xA2, 0x3E, 0x85, 0x4B, 0x6C, 0x9A, 0x51, 0x62, 0x53, 0x45, 0x62, 0xD3, 0xDB, 0x95, 0x98, 0xFA, 0x1D, 0xDB, 0x32, 0x52, 0x53,
+  0xBF, 0x1B, 0x9B, 0x22, 0xB9, 0xAD, 0xFD, 0x85, 0xD0, 0x84, 0xB4, 0xA6, 0x71, 0xD2, 0x2A, 0x22, 0x26, 0x3E, 0x87, 0x83, 0xF5, 0x50, 0xE7, 0xD5, 0x87, 0x37,
+  0xAF, 0x71, 0x2E, 0x88, 0x17, 0x99, 0x2F, 0xB1, 0x68, 0xB4, 0x15, 0x03, 0x01, 0x83, 0x83, 0xD0, 0xCC, 0x14, 0x0A, 0x12, 0x0E, 0x0F, 0x48, 0x95, 0x81, 0xC4,
+  0x10, 0x61, 0x8B, 0x22, 0x88, 0x99, 0x25, 0x9B, 0xED, 0xE2, 0x6C, 0x22, 0x8D, 0x37, 0xE8, 0x95, 0xA2, 0x0B, 0xD8, 0x21, 0x93, 0x10, 0x39, 0xE4, 0x0D, 0x83,
+  0x51, 0x26, 0xBD, 0xBD, 0x9B, 0x08, 0xB3, 0x57, 0x37, 0xAB, 0x53, 0x93, 0x3E, 0x3D, 0xF0, 0x6D, 0xEE, 0x56, 0xEE, 0x08, 0xCF, 0x9F, 0x89, 0x41, 0xE2, 0xFB,
+  0x24, 0x31, 0x0A, 0x2E, 0x66, 0x8C, 0x1C, 0x50, 0xD6, 0x31, 0x50, 0xD8, 0x4C, 0x93, 0x09, 0x06, 0xFB, 0xA6, 0x45, 0x02, 0x84, 0x75, 0x66, 0x08, 0x71, 0x38,
+  0xC8, 0x39, 0x2D, 0x13, 0x10, 0xF9, 0x01, 0x84, 0x64, 0x38, 0xEB, 0x3C, 0x70, 0xE2, 0xF0, 0x11, 0x73, 0x68, 0x26, 0x30, 0xE2, 0x95, 0xF9, 0x89, 0x50, 0xD6,
+  0x39, 0xA0, 0xC4, 0xF2, 0x46, 0xCC, 0xD9, 0xD9, 0x68, 0x12, 0x2F, 0x57, 0x4F, 0x86, 0xB3, 0xCE, 0x03, 0x27, 0x0E, 0x1F, 0x11, 0x22, 0xA4, 0x1A, 0x06, 0x6F,
+  0x02, 0x9D, 0x45, 0xAD, 0xFC, 0x89, 0x76, 0xD6, 0x0A, 0x20, 0x88, 0x88, 0x22, 0x0D, 0x82, 0x68, 0x12, 0x85, 0x20, 0xBD, 0xC3, 0x1D, 0xC4, 0x76, 0x77, 0xE1,
+  0x85, 0x20, 0x46, 0xCF, 0xE6, 0x85, 0x20, 0xEC, 0x96, 0xEE, 0xC7, 0xEF, 0x93, 0xE0, 0x7E, 0x58, 0x41, 0x83, 0x7F, 0x56, 0x39, 0x8D, 0xFF, 0xFE, 0x57, 0x8A,
+  0xE3, 0x84, 0x88, 0x30, 0x20, 0x9C, 0xCF, 0xA4, 0x49, 0xE2, 0x83, 0xBC, 0x11, 0x45, 0x62, 0xC5, 0x92, 0xB5, 0x9B, 0xCD, 0x75, 0xAD, 0xDD, 0x04, 0x08, 0x2C,
+  0x77, 0xC8, 0x16, 0x9B, 0x89, 0x2F, 0xD8, 0xC6, 0x00, 0x81, 0x9C, 0x23, 0x13, 0x08, 0xF1, 0x19, 0xCF, 0x38, 0x42, 0xD8, 0x57, 0x1E, 0x33, 0x91, 0x22, 0xBF,
+  0xE8, 0x18, 0x87, 0x07, 0x4B, 0x6F, 0xD2, 0x84, 0x22, 0xBE, 0x9B, 0x97, 0x24, 0x91, 0x45, 0xD6, 0x29, 0x57, 0x7E, 0x23, 0x2E, 0x66, 0xDA, 0x2D, 0x98, 0x15,
+  0xDE, 0xCD, 0x14, 0x3D, 0xFD, 0x28, 0x73, 0x71, 0x6A, 0xC6, 0x86, 0xA2, 0xD4, 0x6C, 0xEA, 0x1E, 0x04, 0x47, 0xC3, 0xA5, 0x47, 0xDD, 0x26, 0xD6, 0x0F, 0x7C,
+  0xE6, 0x6C, 0xDC, 0x6A, 0x5A, 0x80, 0x00, 0x03, 0x58, 0x53, 0x7D, 0x15, 0x77, 0x1C, 0x1B, 0xB0, 0xF8, 0xE5, 0x24, 0x70, 0xFC, 0x6E, 0x02, 0x44, 0x11, 0xDE,
+  0x86, 0x7B, 0xE0, 0xC5, 0x24, 0x68, 0xAC, 0x46, 0xA4, 0xC0, 0x6A, 0xF7, 0x7A, 0x9B, 0x41, 0xAE, 0x18, 0x80, 0xAF, 0x75, 0x21, 0x43, 0x9A, 0xB8, 0x6E, 0x10,
+  0x94, 0xBD, 0x46, 0x90, 0x85, 0x92, 0x03, 0xB9, 0xD0, 0x75, 0x70, 0xB6, 0x51, 0xCF, 0x80, 0x1E, 0x42, 0xAB, 0xC8, 0x13, 0x8E, 0xE3, 0x59, 0x50, 0x2C, 0x21,
+  0x64, 0xE8, 0x50, 0xFD, 0xEB, 0xE3, 0x10, 0x30, 0xB6, 0x24, 0xE1, 0x43, 0xE2, 0xD7, 0xB0, 0x28, 0x18, 0xB9, 0xC4, 0x1F, 0x03, 0x6A, 0xD8, 0x16, 0x8D, 0x1F,
+  0x35, 0x54, 0x1D, 0x11, 0x03, 0x89, 0xB3, 0x31, 0x9D, 0xE8, 0x4B, 0xD3, 0x0B, 0xBA, 0x39, 0xD4, 0x5B, 0x3A, 0x96, 0xA8, 0x96, 0x6C, 0x26, 0x57, 0xB1, 0x65,
+  0xBA, 0x3D, 0xEA, 0xE6, 0xD1, 0x11, 0x79, 0xEA, 0x79, 0x3A, 0x08, 0x00, 0xD7, 0x7E, 0x67, 0xC8, 0x1F, 0xA2, 0x8B, 0x82, 0xAF, 0xED, 0xA0, 0x52, 0x62, 0xFD,
+  0xD9, 0x01, 0xAA, 0x99, 0x35, 0xBA, 0xD0, 0x45, 0x1A, 0x29, 0x03, 0xD5, 0xFC, 0xE7, 0x92, 0x3A, 0xEB, 0xF7, 0x8C, 0x61, 0xB6, 0xF3, 0x14, 0x6C, 0xF1, 0xA0,
+  0x19, 0xAC, 0xDF, 0x1C, 0xF0, 0xFA, 0x66, 0x13, 0x40, 0x5D, 0xC2, 0x18, 0x20, 0xE3, 0x40, 0xE7, 0x65, 0x1D, 0x58, 0xC8, 0x9D, 0x5C, 0x5C, 0x5C, 0x08, 0x61,
+  0x44, 0x0B, 0xAA, 0xD0, 0xC2, 0xB6, 0xBE, 0xD2, 0xF5, 0x72, 0x01, 0xEC, 0x0F, 0x4A, 0xA4, 0x91, 0xA2, 0xAD, 0xE0, 0x0E, 0x6D, 0x42, 0xCB, 0xE7, 0xA2, 0x4C,
+  0xA6, 0x75, 0x62, 0x1A, 0x05, 0x22, 0x60, 0xDA, 0x89, 0x96, 0xF8, 0x78, 0xA3, 0xD1, 0xCD, 0x83, 0xF8, 0xB3, 0x98, 0xF2, 0xB2, 0x40, 0x50, 0x30, 0x4F, 0x4E,
+  0x5D, 0x91, 0x11, 0x22, 0xA5, 0xDF, 0x9B, 0xDA, 0x83, 0xC0, 0x33, 0x2C, 0x17, 0x63, 0xDD, 0xA3, 0x61, 0xE7, 0xE0, 0xEB, 0x82, 0xBC, 0x39, 0xB7, 0x3D, 0x1A,
+  0xF1, 0x18, 0x86, 0x65, 0x78, 0x86, 0x6E, 0x7E, 0x0C, 0xB4, 0x71, 0xA7, 0xE6, 0x5F, 0x2D, 0x65, 0xFF, 0x1B, 0x15, 0xDE, 0x6C, 0x55, 0xC9, 0x0D, 0x0D, 0xF1,
+  0xFD, 0x41, 0xA0, 0x25, 0x2A, 0x1F, 0x42, 0x6E, 0xE1, 0x41, 0xD8, 0x72, 0x1F, 0x3E, 0x64, 0x47, 0x0F, 0x7C, 0xA1, 0x49, 0xEF, 0x71, 0x41, 0x82, 0x1B, 0x11,
+  0x01, 0x6F, 0xC2, 0x8E, 0xC0, 0x90, 0xC0, 0x15, 0x08, 0xDC, 0xB6, 0x7C, 0xF1, 0x2E, 0x20, 0xD5, 0x45, 0x5D, 0xF8, 0x7F, 0xAF, 0x7F, 0x8F, 0xBC, 0xFE, 0xEE,
+  0x5C, 0x7C, 0xF6, 0x35, 0x0E, 0xDE, 0x2F, 0x7E, 0xD1, 0xE5, 0xF0, 0xA0, 0x4E, 0xE2, 0x57, 0x55, 0x22, 0x61, 0xC5, 0xCC, 0x18, 0x73, 0x94, 0x03, 0xBD, 0x42,
+  0x0E, 0xE1, 0x5A, 0x26, 0x2E, 0x1D, 0xE2, 0x3A, 0x62, 0xF5, 0x80, 0xAF, 0x69, 0x32, 0x6F, 0x7C, 0x13, 0x04, 0x24, 0x33, 0xFB, 0x3A, 0xAD, 0xA7, 0x03, 0x3E,
+  0xE7, 0x8A, 0x46, 0x3A, 0xFB, 0xBD, 0xC7, 0x86, 0xAB, 0x0F, 0xCD, 0xED, 0x43, 0x8B, 0x76, 0x63, 0x31, 0x15, 0x40, 0x03, 0x79, 0x05, 0xBA, 0x7A, 0x0E, 0xB3,
+  0x19, 0x05, 0x2C, 0xB5, 0xB6, 0x41, 0x95, 0x68, 0xA5, 0x02, 0x9E, 0xE8, 0x60, 0xC4, 0x61, 0xC8, 0xDC, 0x91, 0xE6, 0x70, 0xB1, 0xEA, 0x65, 0xE8, 0x11, 0x3E,
+  0xBD, 0x20, 0xD6, 0xD2, 0x34, 0x41, 0x03, 0x91, 0x04, 0xD0, 0x40, 0xF5, 0x6E, 0xAC, 0x83, 0xFE, 0xF3, 0x7A, 0x33, 0x1F, 0xF3, 0x10, 0x07, 0x1E, 0x3D, 0x0A,
+  0x43, 0xC3, 0xE5, 0x5B, 0x1E, 0x9A, 0xFB, 0xA3, 0xF1, 0xF6, 0xFC, 0x15, 0xBF, 0xC1, 0x2C, 0x2B, 0x50, 0x82, 0xA9, 0xFA, 0x61, 0x88, 0xF1, 0x4A, 0x84, 0x03,
+  0x88, 0x18, 0x63, 0xC6, 0x20, 0xDC, 0x39, 0x52, 0xD9, 0x58, 0xE9, 0x7A, 0xC2, 0xB4, 0xBE, 0x4A, 0xC5, 0xC6, 0xA1, 0x1A, 0xF0, 0x1F, 0x95, 0x39, 0xB8, 0x10,
+  0xAE, 0x4E, 0x46, 0x20, 0x4E, 0x43, 0x10, 0x91, 0xB0, 0x08, 0xDE, 0xF8, 0x8F, 0x0D, 0x00, 0x4D, 0x71, 0xDB, 0x4E, 0x2D, 0x6D, 0xF6, 0x67, 0x03, 0x6F, 0x36,
+  0x4C, 0xC5, 0xE0, 0x7A, 0xF8, 0x65, 0x0A, 0xCD, 0xE3, 0x08, 0x63, 0xE0, 0xAE, 0x87, 0x48, 0x12, 0x43, 0x01, 0x0E, 0xD3, 0x40, 0x4D, 0xF4, 0x11, 0xFD, 0xE2,
+  0xD0, 0x91, 0x3D, 0xB5, 0x8C, 0x3F, 0x68, 0x1C, 0x40, 0x6E, 0x50, 0x55, 0x6A, 0x39, 0xB6, 0x4C, 0xB3, 0x11, 0xB8, 0xB0, 0x95, 0xF0, 0xF5, 0xC4, 0x91, 0x48,
+  0x05, 0xCC, 0xEA, 0x8B, 0x81, 0x9B, 0x0F, 0x5C, 0xC3, 0x5B, 0x6F, 0x8E, 0x33, 0x20, 0x0D, 0x4D, 0x62, 0x0F, 0x4D, 0x5F, 0xE2, 0xAE, 0x21, 0x9F, 0x06, 0xFF,
+  0x42, 0x38, 0x08, 0xDD, 0x58, 0x01, 0x53, 0xF5, 0x85, 0x4F, 0x95, 0xDF, 0xC2, 0xD3, 0xC7, 0x6D, 0xCE, 0x1C, 0x1A, 0x4E, 0x1B, 0xB1, 0xFE, 0xBD, 0xE4, 0xA4,
+  0x91, 0x02, 0x93, 0xEF, 0xC6, 0x89, 0x02, 0x5D, 0x0E, 0xE7, 0x86, 0x17, 0x03, 0xF0, 0x40, 0x3B, 0xC8, 0x33, 0xFF, 0xA8, 0xD6, 0xCA, 0x3D, 0x1E, 0x0B, 0xCD,
+  0x01, 0x50, 0x68, 0x45, 0x6F, 0xC4, 0x77, 0x9D, 0x3E, 0x81, 0xF4, 0x1B, 0xD7, 0xE9, 0x50, 0xC0, 0x91, 0x05, 0xF2, 0x07, 0xCA, 0xBE, 0x0E, 0x06, 0x22, 0xBC,
+  0xB3, 0x43, 0xEE, 0xA6, 0x08, 0x47, 0xF2, 0xEA, 0x86, 0x82, 0xDF, 0x1C, 0x0A, 0xFD, 0x5C, 0xAC, 0x26, 0x92, 0xEF, 0xBF, 0x31, 0x10, 0x37, 0x64, 0x02, 0xDE,
+  0xC2, 0x9D, 0xD1, 0x31, 0xAB, 0x7C, 0x79, 0x4B, 0xF7, 0x8C, 0xE0, 0xA2, 0x78, 0x68, 0x27, 0xC7, 0xCD, 0x6F, 0x35, 0x75, 0x5F, 0x04, 0xA3, 0x65, 0x6B, 0xB2,
+  0xC1, 0x76, 0x21, 0xA5, 0xE7, 0x19, 0x3C, 0x3C, 0x8F, 0x29, 0x2C, 0xF9, 0x86, 0x0E, 0x2D, 0x20, 0xA6, 0x81, 0x61, 0x7E, 0x82, 0xE8, 0x25, 0xA2, 0xA6, 0x35,
+  0x91, 0x26, 0x81, 0x04, 0xC6, 0xD2, 0xE5, 0x71, 0x19, 0x61, 0x32, 0xC4, 0xD9, 0x14, 0xE2, 0x30, 0x27, 0x46, 0xD0, 0xB2, 0x7D, 0x37, 0x8C, 0x88, 0x02, 0x7C,
+  0x5E, 0xFC, 0xEE, 0x42, 0x72, 0x53, 0x7B, 0xA0, 0x6C, 0x0F, 0x89, 0xC2, 0xC0, 0x01, 0x14, 0x00, 0x21, 0x16, 0x25, 0xB1, 0x49, 0x28, 0x4D, 0x38, 0x2F, 0x4B,
+  0xCD, 0xCD, 0x02, 0x0F, 0x2E, 0x93, 0x18, 0x2E, 0x3A, 0xFA, 0x89, 0x29, 0xCD, 0xE7, 0x3A, 0x9F, 0x64, 0x15, 0x9F, 0x57, 0xCB, 0x83, 0xD0, 0x46, 0x92, 0xB8,
+  0x15, 0x99, 0x5B, 0x0B, 0x97, 0x95, 0x6C, 0x91, 0xC1, 0x83, 0xA0, 0x74, 0x23, 0x4D, 0x54, 0x63, 0xBA, 0xF8, 0x9C, 0x30, 0x9C, 0xB5, 0x29, 0xEC, 0x89, 0x8D,
+  0xE7, 0x12, 0xD9, 0xC5, 0xF5, 0x8B, 0x1B, 0xEC, 0x95, 0x41, 0xAF, 0x53, 0xEB, 0xA6, 0x6C, 0xAF, 0x16, 0xE3, 0x57, 0xD0, 0xE1, 0xB9, 0xBF, 0x61, 0x70, 0x6B,
+  0xCF, 0x60, 0x73, 0xA1, 0x02, 0x83, 0xED, 0x1C, 0xCC, 0xB6, 0xB8, 0xCA, 0x9A, 0x86, 0xBA, 0x22, 0xD4, 0xED, 0x7D, 0xE5, 0x66, 0xF2, 0x28, 0xFA, 0xEA, 0xE4,
+  0x93, 0xD6, 0x9F, 0xCD, 0x72, 0xBC, 0xB1, 0xD2, 0x9B, 0x59, 0xFE, 0xF6, 0xCE, 0xEA, 0x36, 0x45, 0x15, 0x77, 0xFD, 0x2A, 0x43, 0xE7, 0x60, 0x6F, 0xA5, 0xD2,
+  0x55, 0xCE, 0x67, 0x69, 0x1D, 0xA1, 0x0D, 0xDF, 0x3B, 0x7B, 0xA0, 0xC8, 0x17, 0xB7, 0x2C, 0x7E, 0xCC, 0x24, 0x63, 0xBE, 0xBB, 0x51, 0x19, 0x13, 0x13, 0x88,
+  0x8C, 0x5D, 0xF9, 0xDA, 0x72, 0x10, 0xA8, 0x53, 0xD3, 0xD3, 0x3F, 0x20, 0xB8, 0xB4, 0xBE, 0xAC, 0xD5, 0x97, 0xB8, 0x51, 0x33, 0x8B, 0xD7, 0x1F, 0x17, 0x0D,
+  0x15, 0x0C, 0xD2, 0x73, 0x9F, 0x0E, 0x6D, 0x07, 0x53, 0x52, 0x0C, 0x95, 0x95, 0x42, 0xA8, 0x67, 0x2F, 0xDE, 0x33, 0x54, 0x23, 0xEE, 0xF8, 0x9A, 0x2D, 0x91,
+  0x34, 0xF1, 0x7E, 0xB5, 0x16, 0xA4, 0xFF, 0x01, 0xA8, 0xC0, 0xE7, 0x05, 0xD7, 0x9A, 0x3A, 0xFE, 0xAD, 0xD6, 0x36, 0x6E, 0xC8, 0x71, 0x03, 0xCB, 0x55, 0xD5,
+  0x35, 0xBC, 0x44, 0xFD, 0x1E, 0x17, 0x63, 0x08, 0x47, 0xEA, 0xC0, 0xDF, 0xEB, 0x15, 0xD7, 0xF2, 0xB5, 0x71, 0x45, 0xC9, 0x1B, 0xA4, 0x34, 0x52, 0xDD, 0x85,
+  0xC8, 0x47, 0xC8, 0x47, 0xF5, 0x5D, 0x9F, 0xD0, 0x42, 0xEB, 0xBE, 0xE0, 0xEB, 0xBE, 0x1C, 0x3F, 0xFB, 0xAE, 0xEE, 0x0A, 0x5B, 0x5F, 0xB1, 0x70, 0x8E, 0x9A,
+  0x32, 0x86, 0xBA, 0xF2, 0x83, 0xA7, 0xAB, 0x1A, 0x27, 0x8D, 0x5F, 0x56, 0xED, 0x3D, 0x92, 0x90, 0xCD, 0x60, 0x7E, 0xA2, 0xCE, 0xA5, 0x85, 0x09, 0xC0, 0x70,
+  0x39, 0x09, 0x70, 0xC0, 0x3A, 0x5E, 0x95, 0xA5, 0x23, 0x2C, 0xFD, 0x86, 0x9F, 0x43, 0xD2, 0x21, 0xE7, 0xD8, 0xA8, 0xC9, 0x3F, 0xEF, 0x0B, 0xD7, 0x0E, 0x0F,
+  0x95, 0x0C, 0x04, 0x98, 0x0E, 0x37, 0x3F, 0x19, 0x9F, 0x19, 0x56, 0x5A, 0x07, 0x83, 0x7D, 0x76, 0x01, 0x7A, 0x6A, 0xE2, 0x62, 0x4B, 0xBD, 0xD8, 0x8E, 0x6B,
+  0xD9, 0x91, 0x2D, 0xD5, 0xC8, 0x5A, 0xCC, 0x76, 0xC6, 0x46, 0x28, 0xE8, 0xDF, 0x6A, 0x68, 0x4A, 0x6D, 0xF2, 0x1D, 0x10, 0xE5, 0x12, 0x1D, 0x0B, 0xFB, 0x9E,
+  0x81, 0xB2, 0x15, 0x42, 0x04, 0x5D, 0xF1, 0x66, 0x62, 0xF2, 0xC5, 0x0D, 0x8A, 0xD6, 0x5B, 0xB8, 0x57, 0xE5, 0x2C, 0x70, 0xEB, 0x64, 0x68, 0x8F, 0xD7, 0x35,
+  0x62, 0x40, 0xCF, 0x6B, 0xDD, 0xF0, 0x58, 0xEA, 0x04, 0xC0, 0x90, 0x11, 0xF4, 0x0A, 0x63, 0x22, 0x06, 0xC9, 0xB0, 0x88, 0xED, 0x40, 0x7B, 0x9F, 0x83, 0x38,
+  0xC3, 0x23, 0x1C, 0x34, 0x14, 0xDD, 0x5D, 0x5B, 0x23, 0xC2, 0xF7, 0xBA, 0x72, 0xE8, 0x8A, 0xA2, 0xF2, 0xE6, 0xBA, 0xD4, 0x32, 0x90, 0x3A, 0xD3, 0x38, 0xF1,
+  0x40, 0x8F, 0x49, 0x1D, 0xA1, 0x8E, 0xD2, 0x00, 0xB1, 0x18, 0xEB, 0x88, 0x96, 0xB8, 0x5D, 0xF5, 0x05, 0xBF, 0x22, 0x5A, 0xB1, 0xF5, 0x45, 0x14, 0x18, 0xBB,
+  0xFF, 0x33, 0x44, 0xD9, 0x27, 0x4F, 0x1D, 0x47, 0x5F, 0x57, 0x5B, 0xFC, 0x7E, 0x48, 0xA5, 0xD9, 0xA0, 0xEC, 0xB2, 0x07, 0x74, 0xF8, 0xA1, 0xAF, 0xC0, 0x5F,
+  0x46, 0x66, 0x9C, 0xEE, 0x60, 0x6F, 0x6E, 0x9D, 0x7C, 0x73, 0x8D, 0xA9, 0xA5, 0x9B, 0x67, 0x1C, 0x40, 0x93, 0x9F, 0xF9, 0x33, 0x76, 0x40, 0x3F, 0xC3, 0xD3,
+  0x8F, 0x45, 0x90, 0x8F, 0x4D, 0xB6, 0xBB, 0x44, 0x0F, 0xF0, 0x15, 0x1A, 0xF5, 0xF8, 0x71, 0x2D, 0x12, 0xFF, 0x79, 0xE4, 0xDB, 0x18, 0x62, 0x63, 0x91, 0x57,
+  0xDF, 0xF8, 0x68, 0x70, 0xB8, 0x4D, 0xFC, 0xA9, 0xD6, 0x42, 0x89, 0x17, 0x36, 0x0F, 0xE7, 0x5D, 0x6A, 0xA0, 0xAB, 0xCE, 0xB8, 0x1C, 0xFE, 0xEF, 0x36, 0x28,
+  0xFE, 0x78, 0x93, 0x53, 0x81, 0x2A, 0x83, 0xDE, 0xF1, 0x92, 0x09, 0x3F, 0x0D, 0x86, 0xE3, 0x5D, 0x9B, 0x2E, 0xF5, 0xB0, 0x75, 0xEC, 0x75, 0x51, 0x0E, 0x08,
+  0x80, 0x05, 0xAD, 0xB8, 0x7C, 0x78, 0x5B, 0xFF, 0x62, 0x0C, 0x1B, 0x82, 0x99, 0x0D, 0xB1, 0xF4, 0x4D, 0x32, 0x3C, 0xA4, 0xA8, 0x03, 0x40, 0x93, 0x73, 0xD2,
+  0x8A, 0x16, 0xBB, 0xC3, 0x0C, 0x08, 0x07, 0x1D, 0x81, 0xA1, 0xA3, 0x3B, 0xE6, 0x4A, 0xD4, 0xE4, 0xBF, 0x8C, 0x05, 0x90, 0x4A, 0xE8, 0x5C, 0x73, 0xD8, 0x7A,
+  0x72, 0xAD, 0xB6, 0xD1, 0xD7, 0x64, 0xCB, 0x75, 0x7E, 0xB4, 0xC4, 0x2C, 0xA6, 0x39, 0x67, 0x7B, 0x8F, 0x8F, 0xC4, 0xE6, 0xF2, 0xC6, 0x6B, 0x46, 0xFB, 0x19,
+  0xA9, 0xFE, 0xE7, 0xF8, 0xB0, 0x76, 0x64, 0xD4, 0xC8, 0x7F, 0xFD, 0x17, 0xF9, 0xF4, 0xB9, 0xF6, 0x49, 0xFB, 0x1C, 0x25, 0xC1, 0x70, 0x7F, 0xD2, 0x7F, 0x02,
+  0xD7, 0x62, 0xD5, 0x36, 0xA8, 0x60, 0xFC, 0x0A, 0xE1, 0x84, 0xF4, 0x1E, 0x92, 0x6E, 0x2D, 0xBC, 0x57, 0x1A, 0xC6, 0x34, 0x2C, 0x25, 0x69, 0x0A, 0x13, 0x2C,
+  0x3C, 0x91, 0x94, 0xED, 0x39, 0x11, 0x40, 0xE0, 0x7F, 0x1C, 0x35, 0x37, 0xEB, 0x50, 0x9F, 0x25, 0x5E, 0x90, 0x0F, 0x50, 0x89, 0x54, 0x3D, 0x02, 0xF8, 0x41,
+  0x16, 0x4A, 0x36, 0xDB, 0x72, 0x75, 0x57, 0x9C, 0x91, 0xF0, 0x44, 0x9B, 0x65, 0x01, 0x51, 0x09, 0x61, 0xBB, 0xBE, 0x41, 0x15, 0xC2, 0xBE, 0x97, 0x36, 0x2D,
+  0x7D, 0xCE, 0x2B, 0x2A, 0x07, 0xCC, 0xEE, 0xD9, 0xA2, 0xCE, 0x41, 0x2D, 0x26, 0xDD, 0xA2, 0x78, 0xA7, 0x4A, 0x13, 0x32, 0x6B, 0xF0, 0x79, 0x2F, 0x70, 0x5E,
+  0x17, 0x4E, 0x13, 0x8C, 0x9F, 0x7C, 0xA5, 0xEB, 0x89, 0x03, 0xD0, 0x61, 0x4E, 0x82, 0xA4, 0x02, 0x70, 0x35, 0xD7, 0x78, 0xC4, 0x66, 0x28, 0x17, 0x8E, 0x74,
+  0x4F, 0xAC, 0x02, 0x8D, 0x89, 0x6B, 0x58, 0x23, 0x4A, 0x0C, 0x0F, 0x98, 0x03, 0xF3, 0x14, 0x07, 0xA7, 0x93, 0xFF, 0x78, 0x7B, 0xF9, 0x92, 0xFB, 0x4F, 0xE6,
+  0x82, 0x75, 0x8B, 0xFC, 0xDA, 0xC0, 0xE8, 0xE2, 0x8C, 0xAC, 0xEA, 0xEB, 0xFA, 0x75, 0x7D, 0x26, 0xB4, 0xBE, 0x0E, 0x8D, 0x80, 0x38, 0x8A, 0x39, 0x13, 0xE4,
+  0x81, 0x38, 0x06, 0x7F, 0x9E, 0x42, 0x89, 0x03, 0x00, 0x0A, 0x76, 0x8D, 0x0D, 0x06, 0x44, 0x8C, 0xE7, 0xE1, 0x26, 0x12, 0x39, 0x7D, 0xA2, 0x2B, 0x62, 0x5A,
+  0xBA, 0xF2, 0xAA, 0x07, 0x6D, 0x59, 0xF9, 0xF3, 0xDD, 0x36, 0xA6, 0x61, 0xFE, 0xE3, 0x0C, 0x98, 0x87, 0xE1, 0xE1, 0x93, 0x39, 0x58, 0xC7, 0x05, 0x23, 0xEF,
+  0xB7, 0xBA, 0x74, 0xEB, 0x5C, 0x36, 0xBF, 0x2F, 0xE8, 0x34, 0x94, 0x0D, 0x06, 0x51, 0x1A, 0x22, 0xA3, 0xDA, 0x86, 0xA4, 0x91, 0xD9, 0x44, 0x7D, 0xE3, 0x6F,
+  0x60, 0x25, 0x42, 0xAF, 0xB4, 0x1A, 0xF4, 0x5C, 0x54, 0x7F, 0x5A, 0xCE, 0x87, 0x7C, 0xA2, 0x96, 0xB2, 0x45, 0xE0, 0x52, 0x9D, 0x51, 0xC0, 0xDD, 0xCD, 0xC9,
+  0x31, 0xB2, 0xEB, 0x1A, 0x7B, 0xC1, 0xF8, 0x7F, 0x15, 0x82, 0x3B, 0x23, 0xDA, 0x91, 0xD1, 0x84, 0xE4, 0x86, 0x6B, 0x58, 0x0D, 0x67, 0xDC, 0xAA, 0xCF, 0x20,
+  0xF6, 0x3C, 0x2B, 0x03, 0x8C, 0x97, 0x3E, 0xC1, 0xBC, 0x0C, 0x68, 0xF9, 0x77, 0x67, 0x94, 0xBD, 0x42, 0xD8, 0xBF, 0xDD, 0xF9, 0x1C, 0x32, 0xDC, 0x08, 0x14,
+  0x1F, 0xC6, 0x66, 0x03, 0x01, 0xC8, 0x07, 0x13, 0xDD, 0x28, 0xEE, 0xAD, 0x9A, 0x63, 0x47, 0xBF, 0xFE, 0x11, 0x9F, 0x68, 0xAA, 0x72, 0xAB, 0x18, 0x81, 0x30,
+  0x3C, 0xCA, 0xAE, 0x3C, 0x33, 0x3C, 0x64, 0x0E, 0xFA, 0xF0, 0x67, 0xA6, 0x3D, 0xAC, 0x7E, 0x42, 0x41, 0x40, 0x82, 0xF4, 0x0D, 0xEB, 0x39, 0x67, 0xE4, 0x80,
+  0x3D, 0x08, 0x75, 0x84, 0x17, 0x0F, 0x6E, 0x6A, 0x35, 0x1E, 0x3D, 0x7D, 0x6A, 0x7D, 0x16, 0x07, 0xD2, 0x0D, 0x05, 0x35, 0x02, 0xD0, 0xCB, 0x37, 0x36, 0x4B,
+  0x8D, 0xD9, 0x72, 0xC0, 0xC4, 0xB1, 0xE7, 0xE4, 0x08, 0x0F, 0xCF, 0xC8, 0x5B, 0x7D, 0xF4, 0x15, 0x86, 0x73, 0x89, 0x0D, 0xF3, 0x3E, 0x68, 0x3B, 0x25, 0x43,
+  0xC0, 0x65, 0x01, 0xC7, 0x0B, 0x63, 0x85, 0x29, 0xDB, 0x9B, 0xF7, 0xCF, 0xC8, 0xC4, 0x70, 0x5C, 0x2F, 0x88, 0x97, 0x01, 0xF1, 0x37, 0x62, 0xC5, 0x0B, 0x1F,
+  0x00, 0xA9, 0x13, 0x08, 0xDB, 0x66, 0x8A, 0x9E, 0xA0, 0x40, 0x64, 0x18, 0xA7, 0x30, 0xFC, 0x1A, 0x59, 0xED, 0x5F, 0x57, 0x58, 0x3D, 0x0B, 0x78, 0x1C, 0xE9,
+  0x06, 0x9D, 0xA2, 0x37, 0x7C, 0xCE, 0xCE, 0x94, 0xC8, 0x48, 0xB5, 0x05, 0xBF, 0x65, 0xAC, 0x2D, 0xF0, 0x96, 0xF8, 0xA4, 0xD5, 0x05, 0x93, 0x82, 0xC2, 0xF5,
+  0x17, 0x40, 0x4B, 0x95, 0x91, 0xA2, 0xEC, 0x6A, 0xC2, 0x91, 0x5A, 0x4A, 0x4F, 0x7C, 0x7A, 0xEF, 0x82, 0x5C, 0xA9, 0x46, 0xE1, 0x87, 0x8F, 0x43, 0xB8, 0x73,
+  0xFC, 0x18, 0x7E, 0x06, 0xD0, 0x87, 0x05, 0x7A, 0xD0, 0xFD, 0x1C, 0xE8, 0xFE, 0x37, 0x02, 0x11, 0xE4, 0xB0, 0xD1, 0xC0, 0xAD, 0x47, 0x9E, 0x1A, 0x48, 0x4A,
+  0xA8, 0x2C, 0x7D, 0x80, 0x40, 0x77, 0x30, 0x20, 0x43, 0x50, 0x58, 0x82, 0xA5, 0xC2, 0x76, 0xAF, 0x17, 0xAA, 0xC0, 0x01, 0xCE, 0x4D, 0x64, 0xF7, 0x27, 0x84,
+  0xFA, 0x6F, 0xA4, 0x0B, 0xC1, 0xE3, 0xC6, 0x35, 0x11, 0x7E, 0xC6, 0x5D, 0xC7, 0x08, 0x14, 0xC6, 0x49, 0x04, 0x27, 0xE2, 0x51, 0x1C, 0x36, 0x26, 0xF4, 0xDC,
+  0x0C, 0x91, 0xCF, 0xD9, 0xC3, 0x3F, 0xD2, 0x52, 0x23, 0xC4, 0xD6, 0x22, 0x1E, 0x83, 0x65, 0x47, 0x38, 0x18, 0x44, 0xCC, 0xE7, 0x44, 0x6B, 0x9F, 0x00, 0x7D,
+  0xF2, 0xFC, 0xCC, 0x3F, 0x6A, 0xC0, 0xE0, 0x7D, 0x69, 0xD4, 0x87, 0x87, 0x8A, 0x79, 0x5B, 0x8C, 0xA5, 0x2A, 0xDF, 0x7C, 0x84, 0xBE, 0x72, 0x84, 0xBE, 0x92,
+  0x73, 0x08, 0x7A, 0xE0, 0x37, 0xCC, 0x5E, 0x82, 0x02, 0xAB, 0xF2, 0x01, 0x0E, 0x0F, 0x3F, 0xA7, 0xD4, 0x9F, 0x71, 0x10, 0x54, 0xC6, 0x06, 0x60, 0xB7, 0x65,
+  0x20, 0x10, 0x4F, 0x63, 0xCB, 0x58, 0x31, 0x23, 0xA9, 0x34, 0xA9, 0xAC, 0x45, 0x2D, 0x84, 0x8E, 0x81, 0x0A, 0x82, 0x64, 0xD8, 0x2E, 0xE5, 0x56, 0x24, 0x7F,
+  0x61, 0xD3, 0x81, 0x34, 0x3C, 0xC5, 0xDC, 0x64, 0x66, 0xE5, 0xDB, 0x5C, 0x2D, 0x35, 0x41, 0x7B, 0x0F, 0xD9, 0xA3, 0x9F, 0xA0, 0x45, 0x26, 0x87, 0xA0, 0x46,
+  0xC7, 0x96, 0x31, 0xF9, 0x04, 0x71, 0xA1, 0xC1, 0xBC, 0x20, 0x66, 0x04, 0xF6, 0xC0, 0xD7, 0xE6, 0x8C, 0x70, 0x9D, 0x18, 0x33, 0xFD, 0xDA, 0xF8, 0x85, 0xBD,
+  0x41, 0x20, 0x25, 0x58, 0x12, 0x41, 0x5B, 0x0A, 0x88, 0x57, 0xCC, 0xE6, 0xD3, 0x60, 0xA0, 0xFC, 0xAE, 0x51, 0x0B, 0x67, 0xAA, 0x44, 0xA4, 0xA7, 0x52, 0xDD,
+  0x54, 0xB4, 0x76, 0xB9, 0xC9, 0xE2, 0xD8, 0xD9, 0x96, 0x05, 0xE3, 0x7E, 0xA1, 0x40, 0x96, 0xC9, 0x83, 0xC1, 0x7C, 0x21, 0xC8, 0x29, 0x40, 0x0E, 0x14, 0x99,
+  0xC4, 0x65, 0xE1, 0x32, 0xBC, 0x4E, 0xE2, 0xF7, 0xBE, 0x52, 0x7A, 0xE2, 0x71, 0xD3, 0x75, 0x46, 0xBC, 0x40, 0xBD, 0x31, 0x6F, 0xFF, 0x96, 0x31, 0x71, 0x07,
+  0x69, 0x07, 0x79, 0x7B, 0x64, 0x4B, 0x0B, 0xAF, 0x2F, 0xBA, 0x58, 0x87, 0xE6, 0xA5, 0x77, 0x0C, 0x3E, 0x94, 0x7A, 0x57, 0x42, 0x59, 0x38, 0x28, 0x50, 0x54,
+  0x6B, 0x0F, 0x12, 0xF0, 0x0F, 0x63, 0xAF, 0x94, 0xD7, 0xF9, 0x93, 0xB5, 0x4F, 0xBE, 0x8C, 0x86, 0x17, 0xDF, 0x7F, 0x03, 0x85, 0x87, 0x60, 0x0E, 0x12, 0xF7,
+  0xDA, 0xCD, 0x6F, 0x5B, 0xB3, 0xF8, 0xA0, 0x9C, 0x95, 0x15, 0x2F, 0x5E, 0x20, 0x88, 0x85, 0x16, 0x62, 0x59, 0x3C, 0x38, 0xB5, 0x86, 0x77, 0x69, 0xC9, 0x95,
+  0xD3, 0x24, 0x5E, 0x5F, 0x6C, 0x72, 0x3B, 0x06, 0x23, 0xD4, 0xA3, 0x87, 0x21, 0x90, 0x8A, 0x0E, 0x05, 0xDA, 0x27, 0xD5, 0x44, 0x62, 0xAB, 0x18, 0x73, 0x1A,
+  0xAE, 0xD8, 0x2C, 0xC0, 0x34, 0xDE, 0x03, 0x5C, 0x6C, 0xFA, 0x80, 0x78, 0x2C, 0x15, 0x60, 0x11, 0x1C, 0x99, 0x4D, 0x45, 0x30, 0x54, 0x4B, 0x95, 0x09, 0x38,
+  0x86, 0x97, 0x3B, 0x23, 0xEB, 0x6A, 0x5C, 0x28, 0x7E, 0xCD, 0x31, 0x65, 0xA7, 0xAB, 0x6B, 0x2F, 0x9D, 0x11, 0x06, 0xA0, 0x69, 0xB5, 0x23, 0x03, 0x72, 0x4A,
+  0x36, 0x4B, 0x3F, 0xBC, 0x52, 0x96, 0xC6, 0x45, 0x79, 0xD7, 0x0D, 0xD6, 0xEC, 0x99, 0x2F, 0x41, 0x38, 0xC1, 0x9E, 0x4B, 0xF1, 0xF8, 0xB3, 0x52, 0xCF, 0xE3,
+  0x41, 0x82, 0x28, 0xE9, 0x55, 0x2B, 0xBC, 0x41, 0x45, 0x54, 0xE0, 0xF8, 0x99, 0x1F, 0xB0, 0x70, 0xEC, 0xF8, 0x69, 0xA8, 0x81, 0x1F, 0xB8, 0x88, 0x16, 0xFC,
+  0x9C, 0x37, 0xF1, 0x47, 0x62, 0xF5, 0x04, 0x7D, 0xB1, 0x80, 0x0C, 0xEA, 0xF9, 0xCC, 0x30, 0xC7, 0x55, 0xDE, 0x59, 0xD9, 0x52, 0x3A, 0xE2, 0x21, 0x0D, 0x86,
+  0x2F, 0x1C, 0x6E, 0x34, 0xCC, 0x79, 0x2C, 0xF5, 0x01, 0x2F, 0x29, 0x51, 0x26, 0x1F, 0xB6, 0xDE, 0xAA, 0xB7, 0x44, 0x13, 0xB5, 0x3E, 0x82, 0x90, 0xD1, 0x49,
+  0xFE, 0xFC, 0xEE, 0x75, 0x00, 0xD9, 0xB3, 0x5F, 0xF0, 0x4B, 0x55, 0x35, 0xE2, 0xF4, 0xF7, 0x82, 0x29, 0xC2, 0xC2, 0xA7, 0xEA, 0xC5, 0x14, 0x0F, 0xCD, 0x1F,
+  0xAB, 0x40, 0x45, 0x2D, 0x02, 0x0D, 0xBD, 0x1A, 0xD7, 0x55, 0x3E, 0x73, 0x8F, 0xDD, 0x91, 0x96, 0x1F, 0x96, 0xA6, 0xF9, 0x0F, 0xAA, 0x3B, 0x20, 0xF5, 0x43,
+  0x52, 0xAD, 0xB4, 0x2A, 0x87, 0x55, 0x76, 0xFD, 0x0D, 0x10, 0x34, 0xAB, 0xD6, 0x0E, 0xB5, 0x9A, 0x4C, 0x21, 0x1A, 0x6D, 0xD9, 0x04, 0x7E, 0x58, 0x1B, 0x3E,
+  0x48, 0xF2, 0xFD, 0x57, 0xC0, 0x02, 0x37, 0xAD, 0xC1, 0x1B, 0x48, 0xB5, 0x21, 0x73, 0x48, 0x6B, 0xF2, 0x9E, 0x02, 0x6B, 0xC7, 0x1B, 0x4D, 0x2A, 0xEC, 0x55,
+  0x01, 0x8F, 0x13, 0xD3, 0xD6, 0x68, 0x3E, 0xAA, 0x6E, 0x86, 0x11, 0xEC, 0x0E, 0x16, 0xD8, 0xC4, 0x16, 0x8E, 0x0D, 0x0D, 0x88, 0x78, 0x6F, 0xB1, 0x64, 0xB5,
+  0xB1, 0x31, 0x31, 0xCB, 0xAA, 0x60, 0xEC, 0x72, 0x57, 0xEA, 0xF2, 0x60, 0x78, 0xF7, 0x5E, 0x74, 0xEB, 0x42, 0x78, 0x29, 0xF0, 0xF9, 0x12, 0x5C, 0xCA, 0x5C,
+  0x4E, 0x2F, 0xFC, 0x1A, 0xAE, 0xFF, 0xFB, 0x13, 0xAD, 0x3E, 0x1D, 0xA5, 0x15, 0xCC, 0xE1, 0xB6, 0x52, 0x64, 0x17, 0x9B, 0x07, 0xB6, 0x74, 0x60, 0x3B, 0x06,
+  0xFC, 0x25, 0x05, 0x82, 0xBD, 0x36, 0xD1, 0x8E, 0x71, 0x44, 0xD0, 0x2E, 0x70, 0x7A, 0xD8, 0x69, 0x63, 0x6E, 0xDF, 0xDC, 0xEA, 0x10, 0x33, 0x7D, 0x47, 0x1A,
+  0x28, 0xD2, 0x92, 0xAF, 0x6F, 0x09, 0xE8, 0xA1, 0xE9, 0xC4, 0x53, 0x95, 0x78, 0xB9, 0x65, 0x63, 0x4B, 0x8F, 0x2F, 0xAC, 0x36, 0xA7, 0x92, 0x4F, 0x33, 0x92,
+  0x4F, 0x05, 0xF9, 0xD8, 0x21, 0x58, 0xFD, 0xDF, 0xBE, 0x7F, 0xC4, 0x57, 0xC6, 0x5F, 0x9E, 0x05, 0x94, 0x5D, 0x0F, 0x53, 0xF1, 0x14, 0xFB, 0x3A, 0x14, 0xF2,
+  0xD2, 0x3B, 0x40, 0x7B, 0xAC, 0x4E, 0xA8, 0x64, 0x5D, 0x0F, 0xB3, 0x91, 0x25, 0xF7, 0x85, 0x60, 0x87, 0x80, 0xAC, 0xF8, 0xDD, 0x23, 0x41, 0x2D, 0xC8, 0x13,
+  0x2F, 0x79, 0xD2, 0xAD, 0x31, 0x61, 0xD5, 0x04, 0xD7, 0xF8, 0x83, 0x2A, 0x2B, 0x45, 0x78, 0x7F, 0xEB, 0x42, 0x1C, 0x6F, 0xA6, 0x10, 0xE9, 0xEF, 0x3F, 0xD9,
+  0xDA, 0xD5, 0x6F, 0xA9, 0xF4, 0xF6, 0xF1, 0x48, 0xED, 0x2D, 0x1B, 0xF1, 0xE5, 0x34, 0xFF, 0x34, 0x13, 0xB3, 0xFC, 0xD6, 0x81, 0x21, 0x04, 0x00, 0xE4, 0xFE,
+  0x95, 0x5E, 0x74, 0xDF, 0x12, 0x5F, 0xD6, 0xE5, 0xC4, 0x46, 0x16, 0x6F, 0xD5, 0x06, 0x3E, 0x49, 0xA1, 0x36, 0xBE, 0x81, 0xF0, 0xFE, 0x49, 0x68, 0x6E, 0x45,
+  0x85, 0xEF, 0xEA, 0xAE, 0xBC, 0x35, 0x29, 0xEE, 0x15, 0x11, 0x9F, 0xED, 0x78, 0xFE, 0xE3, 0x0F, 0x04, 0xD2, 0x36, 0xD3, 0xBE, 0xA6, 0xB8, 0x43, 0x5B, 0x3E,
+  0xCD, 0x47, 0x86, 0x14, 0x1C, 0x1C, 0xE5, 0x3B, 0x7E, 0xF0, 0x61, 0x25, 0x6F, 0x66, 0xB8, 0x64, 0x42, 0xF1, 0xE3, 0x32, 0xF4, 0x61, 0xC5, 0x9F, 0x9D, 0xB6,
+  0x92, 0xB7, 0xB9, 0x9F, 0x31, 0xC4, 0x4E, 0xDE, 0x47, 0x89, 0xA4, 0x04, 0x8D, 0x1B, 0x8E, 0x25, 0x6D, 0x8F, 0x51, 0x0E, 0x16, 0xFA, 0xB7, 0xEF, 0x2D, 0x17,
+  0xE3, 0x09, 0xD8, 0xCA, 0x48, 0xBF, 0x5B, 0xC0, 0xCB, 0x80, 0xD6, 0x0D, 0x6E, 0xC6, 0x6D, 0xE4, 0x4A, 0x91, 0x28, 0xEE, 0x4B, 0x8C, 0xF5, 0xE6, 0xC9, 0x52,
+  0xE1, 0x1C, 0xE7, 0xB3, 0x9C, 0xFF, 0xA6, 0x1A, 0xF1, 0x5E, 0x1A, 0x7E, 0x86, 0xF1, 0xDB, 0xE0, 0xC1, 0xF9, 0xD1, 0xCC, 0x9B, 0x9B, 0x83, 0x07, 0xFF, 0x0B,
+  0x02, 0x66, 0x13, 0x8C, 0x7C, 0x20, 0x01, 0x00
 };
 
-//File: index_ov5640.html.gz, Size: 9124
-#define index_ov5640_html_gz_len 9124
+//File: index_ov5640.html.gz, Size: 10420
+#define index_ov5640_html_gz_len 10420
 const uint8_t index_ov5640_html_gz[] = {
-  0x1F, 0x8B, 0x08, 0x08, 0xD9, 0x6C, 0x6A, 0x5E, 0x00, 0x03, 0x69, 0x6E, 0x64, 0x65, 0x78, 0x5F, 0x6F, 0x76, 0x35, 0x36, 0x34, 0x30, 0x2E, 0x68, 0x74, 0x6D,
-  0x6C, 0x00, 0xED, 0x3D, 0x6B, 0x77, 0xDB, 0xB6, 0x92, 0xDF, 0xF3, 0x2B, 0x18, 0xF5, 0x6E, 0x24, 0x9F, 0x58, 0xB6, 0xA8, 0x97, 0x1F, 0xB1, 0x95, 0x4D, 0x1C,
-  0x27, 0xE9, 0xB9, 0x4D, 0x6F, 0x1A, 0xA7, 0x69, 0x7B, 0xBA, 0x3D, 0x29, 0x25, 0x41, 0x12, 0x1B, 0x8A, 0xD4, 0x25, 0x29, 0xCB, 0x6E, 0x8E, 0x7F, 0xC7, 0xFE,
-  0xA0, 0xFD, 0x63, 0x3B, 0x03, 0x80, 0x24, 0x48, 0x81, 0x24, 0x48, 0x4A, 0xB2, 0xDB, 0x5D, 0xE5, 0x9C, 0x98, 0x0F, 0xCC, 0x60, 0xDE, 0x18, 0x0C, 0x40, 0xF2,
-  0xEC, 0xF1, 0xD8, 0x19, 0xF9, 0xB7, 0x0B, 0xA2, 0xCD, 0xFC, 0xB9, 0x35, 0x78, 0x74, 0xC6, 0xFE, 0x68, 0xF0, 0x3B, 0x9B, 0x11, 0x63, 0xCC, 0x0E, 0xE9, 0xE9,
-  0x9C, 0xF8, 0x86, 0x36, 0x9A, 0x19, 0xAE, 0x47, 0xFC, 0xF3, 0xDA, 0xD2, 0x9F, 0x34, 0x8F, 0x6B, 0xC9, 0xDB, 0xB6, 0x31, 0x27, 0xE7, 0xB5, 0x6B, 0x93, 0xAC,
-  0x16, 0x8E, 0xEB, 0xD7, 0xB4, 0x91, 0x63, 0xFB, 0xC4, 0x86, 0xE6, 0x2B, 0x73, 0xEC, 0xCF, 0xCE, 0xC7, 0xE4, 0xDA, 0x1C, 0x91, 0x26, 0x3D, 0xD9, 0x37, 0x6D,
-  0xD3, 0x37, 0x0D, 0xAB, 0xE9, 0x8D, 0x0C, 0x8B, 0x9C, 0xEB, 0x22, 0x2E, 0xDF, 0xF4, 0x2D, 0x32, 0xB8, 0xBC, 0x7A, 0xDF, 0x69, 0x6B, 0xFF, 0xFA, 0xD4, 0xEB,
-  0x77, 0x5B, 0x67, 0x87, 0xEC, 0x5A, 0xD4, 0xC6, 0xF3, 0x6F, 0xC5, 0x73, 0xFC, 0x0D, 0x9D, 0xF1, 0xAD, 0xF6, 0x35, 0x76, 0x09, 0x7F, 0x13, 0x20, 0xA2, 0x39,
-  0x31, 0xE6, 0xA6, 0x75, 0x7B, 0xAA, 0xBD, 0x70, 0xA1, 0xCF, 0xFD, 0xB7, 0xC4, 0xBA, 0x26, 0xBE, 0x39, 0x32, 0xF6, 0x3D, 0xC3, 0xF6, 0x9A, 0x1E, 0x71, 0xCD,
-  0xC9, 0xB3, 0x35, 0xC0, 0xA1, 0x31, 0xFA, 0x32, 0x75, 0x9D, 0xA5, 0x3D, 0x3E, 0xD5, 0xBE, 0xD1, 0x8F, 0xF1, 0xDF, 0x7A, 0xA3, 0x91, 0x63, 0x39, 0x2E, 0xDC,
-  0xBF, 0x7C, 0x8D, 0xFF, 0xD6, 0xEF, 0xD3, 0xDE, 0x3D, 0xF3, 0x4F, 0x72, 0xAA, 0xE9, 0xFD, 0xC5, 0x4D, 0xEC, 0xFE, 0xDD, 0xA3, 0xD8, 0xE9, 0xAC, 0x9D, 0x46,
-  0x3D, 0x87, 0x3F, 0xCE, 0x86, 0xF7, 0xC8, 0xC8, 0x37, 0x1D, 0xFB, 0x60, 0x6E, 0x98, 0xB6, 0x04, 0xD3, 0xD8, 0xF4, 0x16, 0x96, 0x01, 0x32, 0x98, 0x58, 0x24,
-  0x13, 0xCF, 0x37, 0x73, 0x62, 0x2F, 0xF7, 0x73, 0xB0, 0x21, 0x92, 0xE6, 0xD8, 0x74, 0x59, 0xAB, 0x53, 0x94, 0xC3, 0x72, 0x6E, 0xE7, 0xA2, 0xCD, 0xA2, 0xCB,
-  0x76, 0x6C, 0x22, 0x11, 0x20, 0x76, 0xB4, 0x72, 0x8D, 0x05, 0x36, 0xC0, 0xBF, 0xEB, 0x4D, 0xE6, 0xA6, 0xCD, 0x8C, 0xEA, 0x54, 0xEB, 0x74, 0x5B, 0x8B, 0x9B,
-  0x1C, 0x55, 0x76, 0xFA, 0xF8, 0x6F, 0xBD, 0xD1, 0xC2, 0x18, 0x8F, 0x4D, 0x7B, 0x7A, 0xAA, 0x1D, 0x4B, 0x51, 0x38, 0xEE, 0x98, 0xB8, 0x4D, 0xD7, 0x18, 0x9B,
-  0x4B, 0xEF, 0x54, 0xEB, 0xCA, 0xDA, 0xCC, 0x0D, 0x77, 0x0A, 0xB4, 0xF8, 0x0E, 0x10, 0xDB, 0xD4, 0xA5, 0x94, 0xF0, 0x26, 0xAE, 0x39, 0x9D, 0xF9, 0xA0, 0xD2,
-  0xB5, 0x36, 0x49, 0xA1, 0x71, 0x17, 0xCA, 0xD3, 0x67, 0xA6, 0xDC, 0xE4, 0x52, 0x33, 0x2C, 0x73, 0x6A, 0x37, 0x4D, 0x9F, 0xCC, 0x81, 0x1D, 0xCF, 0x77, 0x89,
-  0x3F, 0x9A, 0x65, 0x91, 0x32, 0x31, 0xA7, 0x4B, 0x97, 0x48, 0x08, 0x09, 0xE5, 0x96, 0xC1, 0x30, 0xDC, 0x5C, 0xBF, 0xD5, 0x5C, 0x91, 0xE1, 0x17, 0xD3, 0x6F,
-  0x72, 0x99, 0x0C, 0xC9, 0xC4, 0x71, 0x89, 0xB4, 0x65, 0xD0, 0xC2, 0x72, 0x46, 0x5F, 0x9A, 0x9E, 0x6F, 0xB8, 0xBE, 0x0A, 0x42, 0x63, 0xE2, 0x13, 0x37, 0x1F,
-  0x1F, 0x41, 0xAB, 0xC8, 0xC7, 0x96, 0xDE, 0x2D, 0x6F, 0x60, 0xDA, 0x96, 0x69, 0x13, 0x75, 0xF2, 0xD2, 0xFA, 0x8D, 0xA3, 0x63, 0xAD, 0x14, 0x14, 0x63, 0xCE,
-  0xA7, 0x59, 0x56, 0x42, 0x79, 0x5D, 0xEF, 0x8C, 0xFB, 0x8D, 0xDE, 0x6A, 0xFD, 0xC7, 0xFA, 0xCD, 0x19, 0x61, 0x66, 0x6A, 0x2C, 0x7D, 0xA7, 0xBA, 0x47, 0xAC,
-  0xB9, 0x55, 0x82, 0x8F, 0xFF, 0x9C, 0x93, 0xB1, 0x69, 0x68, 0x0D, 0xC1, 0x9D, 0x8F, 0x5B, 0x60, 0x53, 0x7B, 0x9A, 0x61, 0x8F, 0xB5, 0x86, 0xE3, 0x9A, 0xE0,
-  0x08, 0x06, 0x0D, 0x37, 0x16, 0x5C, 0x81, 0x81, 0x63, 0x41, 0xF6, 0x24, 0x2C, 0x67, 0xF8, 0x8C, 0x28, 0x11, 0xB9, 0xDB, 0xE0, 0x4F, 0x21, 0xE4, 0xE0, 0x2F,
-  0xD7, 0x81, 0x24, 0x3C, 0x52, 0xF4, 0x59, 0xFA, 0x12, 0x29, 0x4C, 0xD3, 0x19, 0xFE, 0xE6, 0xC6, 0x4D, 0x33, 0x53, 0x77, 0x41, 0xA3, 0x40, 0x87, 0x30, 0xCC,
-  0x8E, 0x1A, 0xD0, 0xF4, 0x7A, 0xA6, 0x35, 0x35, 0x8C, 0x92, 0x7B, 0x72, 0x18, 0x8E, 0x54, 0xAE, 0x72, 0xFC, 0x89, 0x46, 0x51, 0x80, 0x5D, 0x39, 0xAB, 0x51,
-  0xEC, 0x60, 0xFF, 0x64, 0x36, 0xC4, 0x38, 0x49, 0x8D, 0x22, 0xF8, 0x53, 0x8F, 0x24, 0x11, 0xB2, 0xDC, 0x68, 0x22, 0x41, 0x9C, 0x1E, 0x51, 0xD6, 0xF0, 0xA6,
-  0x79, 0xB7, 0x04, 0x6B, 0x36, 0x09, 0xAA, 0xD1, 0x45, 0x82, 0x38, 0x8B, 0x86, 0xDC, 0x28, 0x83, 0xBF, 0x3B, 0x85, 0x7C, 0xE3, 0x9B, 0xE1, 0xD2, 0xF7, 0x1D,
-  0xDB, 0xAB, 0x34, 0x44, 0xA5, 0xF9, 0xD9, 0x1F, 0x4B, 0xCF, 0x37, 0x27, 0xB7, 0x4D, 0xEE, 0xD2, 0xE0, 0x67, 0x0B, 0x03, 0x52, 0xC8, 0x21, 0xF1, 0x57, 0x84,
-  0x64, 0xA7, 0x1B, 0xB6, 0x71, 0x0D, 0x71, 0x67, 0x3A, 0xB5, 0x64, 0xB6, 0x37, 0x5A, 0xBA, 0x1E, 0xE6, 0x6D, 0x0B, 0xC7, 0x04, 0xC4, 0xEE, 0x7A, 0xC7, 0x71,
-  0x1F, 0x54, 0xEC, 0xA8, 0x39, 0x1A, 0x4A, 0xFA, 0x72, 0x96, 0x3E, 0xCA, 0x58, 0xAA, 0x09, 0x07, 0xD8, 0x31, 0xFD, 0x5B, 0xE9, 0x3D, 0xEE, 0x89, 0x92, 0x3B,
-  0x81, 0x0B, 0x66, 0x0E, 0x0B, 0x71, 0xBA, 0x4E, 0x47, 0x33, 0x32, 0xFA, 0x42, 0xC6, 0x4F, 0x73, 0xD3, 0xB0, 0xBC, 0xF4, 0xF0, 0xC0, 0xB4, 0x17, 0x4B, 0xBF,
-  0x89, 0xE9, 0xD4, 0x62, 0x2B, 0x3A, 0xA7, 0x06, 0x19, 0xB0, 0xD8, 0x6E, 0x67, 0x25, 0x15, 0xBD, 0xC5, 0x4D, 0xB6, 0x10, 0x44, 0x62, 0x07, 0x96, 0x31, 0x24,
-  0x56, 0x16, 0xC9, 0xDC, 0x19, 0x52, 0xC2, 0x2E, 0x8F, 0x55, 0xE9, 0xB9, 0x1B, 0xA5, 0x2C, 0x1A, 0xBC, 0xBA, 0x47, 0xFF, 0xA1, 0x2C, 0x47, 0x7A, 0xBC, 0x1F,
-  0xBB, 0xE4, 0x11, 0x0B, 0x1C, 0x2C, 0x71, 0x6D, 0x61, 0xA4, 0x26, 0xE3, 0xD0, 0x62, 0x05, 0x54, 0x65, 0x76, 0xE9, 0x1A, 0xF6, 0x94, 0x40, 0x74, 0xB8, 0xD9,
-  0x0F, 0x0E, 0xB3, 0xA7, 0x0A, 0x4A, 0x02, 0xC1, 0xE0, 0xDD, 0xCB, 0x9E, 0x9A, 0xB0, 0x10, 0xB1, 0xAF, 0x1D, 0xB0, 0x83, 0x12, 0x79, 0x8A, 0xA0, 0xF1, 0x4C,
-  0x42, 0x74, 0xA9, 0xBD, 0xB0, 0x54, 0x45, 0xEA, 0x4B, 0x71, 0x6B, 0x93, 0xA6, 0xFE, 0xB9, 0xC1, 0x22, 0x98, 0x04, 0x4E, 0x26, 0x79, 0xD3, 0xC8, 0xC9, 0xA4,
-  0xD3, 0xEA, 0x74, 0x73, 0x73, 0x29, 0x29, 0x97, 0x89, 0xA9, 0xA4, 0x24, 0x98, 0x84, 0x81, 0x26, 0x5F, 0x17, 0xA7, 0x33, 0xE7, 0x9A, 0xB8, 0x12, 0x45, 0x24,
-  0xC8, 0xED, 0x9E, 0x74, 0xC7, 0x0A, 0xD8, 0x0C, 0x18, 0x0A, 0xAE, 0x65, 0x81, 0x36, 0x8E, 0xAE, 0xAD, 0x8F, 0xDA, 0x99, 0x16, 0xCA, 0xD0, 0x1D, 0x80, 0x35,
-  0x18, 0x43, 0x8B, 0x8C, 0x33, 0x22, 0xF7, 0x98, 0x4C, 0x8C, 0xA5, 0xE5, 0xE7, 0xC8, 0xDB, 0x68, 0xE1, 0xBF, 0xAC, 0x1E, 0xA9, 0x7B, 0xFD, 0x8A, 0x35, 0x90,
-  0x73, 0xEA, 0x12, 0xBF, 0x49, 0xFA, 0x0C, 0x86, 0x55, 0x63, 0xB1, 0x20, 0x06, 0xB4, 0x1A, 0x91, 0xB4, 0xD9, 0xAA, 0x52, 0x3A, 0x2D, 0x8F, 0x69, 0x4A, 0x73,
-  0xD4, 0x5C, 0x53, 0x0C, 0x13, 0xA5, 0x42, 0x3C, 0x9F, 0x4E, 0x9C, 0xD1, 0x52, 0x36, 0x82, 0xAB, 0x99, 0xD4, 0x3A, 0xBE, 0xD3, 0x40, 0x64, 0x9E, 0x65, 0x52,
-  0xC3, 0x5E, 0xDA, 0x36, 0x6A, 0xB4, 0xE9, 0xBB, 0xC0, 0xA6, 0xA4, 0x23, 0x35, 0xC1, 0x95, 0xF2, 0xCE, 0x98, 0x60, 0xD3, 0xEA, 0x34, 0x09, 0x07, 0x94, 0x04,
-  0x8A, 0x30, 0x86, 0x68, 0x9E, 0x03, 0x4C, 0x05, 0xA8, 0xAA, 0xC9, 0xC5, 0x9F, 0x2D, 0xE7, 0xB2, 0x9C, 0x21, 0xE8, 0x4C, 0x87, 0x01, 0x8E, 0x75, 0xE7, 0x4E,
-  0x87, 0x46, 0xA3, 0xB5, 0xDF, 0xDA, 0xEF, 0xC0, 0x7F, 0x92, 0xDC, 0x3D, 0xDB, 0xB8, 0xB8, 0x78, 0x53, 0x2C, 0x2F, 0x11, 0x7C, 0xF2, 0x4B, 0x28, 0x69, 0x61,
-  0x2C, 0x57, 0x17, 0xEA, 0x9E, 0x14, 0xAF, 0xA5, 0xE8, 0x07, 0x39, 0x23, 0x4C, 0x8A, 0x49, 0x17, 0x37, 0x44, 0x89, 0xB5, 0x14, 0x55, 0xF1, 0xDC, 0xF9, 0xB3,
-  0xC9, 0x86, 0xD7, 0xFF, 0xF3, 0xD6, 0x2E, 0x88, 0xE2, 0x6F, 0x6D, 0xE9, 0x85, 0xE5, 0xE2, 0xDD, 0xB7, 0x6D, 0xB4, 0xD2, 0xB5, 0xDE, 0xE4, 0xF9, 0x0C, 0x50,
-  0x68, 0x43, 0xC6, 0xE9, 0xC2, 0xC4, 0x2B, 0x35, 0xE7, 0x11, 0xDA, 0x94, 0x90, 0xC1, 0xC4, 0xB4, 0xAC, 0xA6, 0xE5, 0xAC, 0xF2, 0x33, 0x91, 0x6C, 0x4B, 0x5E,
-  0xB3, 0xD3, 0x7C, 0x93, 0x2F, 0x4B, 0xED, 0x12, 0x22, 0xD7, 0x5F, 0x82, 0xDA, 0xBF, 0xB7, 0xC3, 0x65, 0xBA, 0x46, 0xB9, 0x81, 0xA2, 0x84, 0x3D, 0x56, 0xEB,
-  0x48, 0xC9, 0x94, 0x58, 0x26, 0x98, 0x39, 0xAB, 0xF3, 0x56, 0xA6, 0x3F, 0x9A, 0x95, 0x98, 0x54, 0x2D, 0x1C, 0xCF, 0x64, 0xCB, 0x37, 0x2E, 0xB1, 0x0C, 0xCC,
-  0xE0, 0x4B, 0xCD, 0xC6, 0x73, 0x27, 0x26, 0x22, 0xB8, 0x0A, 0x27, 0x54, 0x74, 0x0F, 0xA7, 0x92, 0x72, 0xC0, 0x72, 0x87, 0xF4, 0x58, 0x2D, 0x37, 0xEB, 0x9C,
-  0x74, 0x3F, 0xEE, 0x19, 0xF2, 0x46, 0x05, 0x22, 0x7A, 0x10, 0xB4, 0xA7, 0x2E, 0xB9, 0x55, 0x60, 0x66, 0x9F, 0xFF, 0x3D, 0x65, 0xB5, 0xD2, 0xF2, 0x45, 0x00,
-  0x3A, 0x00, 0x70, 0x2B, 0x3A, 0xE8, 0x7A, 0x0A, 0x5D, 0xA7, 0x77, 0xA9, 0x62, 0x8F, 0x61, 0x25, 0xB0, 0x56, 0x53, 0x08, 0x37, 0x19, 0x43, 0xA8, 0xDC, 0x54,
-  0x83, 0xD1, 0x57, 0x7A, 0xD3, 0x22, 0x13, 0x3F, 0x65, 0xA1, 0x83, 0xE6, 0xA9, 0x9D, 0xEC, 0xE8, 0xD6, 0x14, 0xEA, 0x04, 0xB9, 0x91, 0x23, 0x2C, 0xD8, 0xA5,
-  0x5B, 0x9F, 0x14, 0x33, 0x46, 0xCF, 0xC2, 0xC8, 0xD3, 0x55, 0x12, 0xA4, 0xCF, 0x54, 0xCD, 0xD0, 0x66, 0xCE, 0x87, 0x7C, 0x50, 0x0F, 0xF9, 0xB9, 0xD1, 0xEE,
-  0x4B, 0xD7, 0x11, 0x32, 0x1A, 0x67, 0x91, 0xC6, 0x2A, 0x5E, 0x4A, 0x43, 0x56, 0xEA, 0x04, 0x59, 0x8C, 0x45, 0x52, 0x45, 0x65, 0x7B, 0x65, 0x56, 0x84, 0x59,
-  0xAF, 0xD1, 0x64, 0x1A, 0xBB, 0x39, 0x37, 0x20, 0xED, 0x45, 0x73, 0x35, 0x00, 0xA3, 0x4C, 0x7F, 0x2A, 0xE6, 0x2E, 0xD4, 0x13, 0xF5, 0x7E, 0x2B, 0xA7, 0xCB,
-  0x91, 0xE5, 0x78, 0xD9, 0x7E, 0x65, 0x0C, 0x41, 0x7E, 0x4B, 0x5F, 0xD2, 0x11, 0xAF, 0x6A, 0x4A, 0x2B, 0x4F, 0xD4, 0xB8, 0xA5, 0x77, 0x94, 0x86, 0xEE, 0x4C,
-  0x9F, 0xCA, 0x76, 0xC7, 0x84, 0xCC, 0xF5, 0x96, 0x34, 0xD2, 0x66, 0xD6, 0xDF, 0x7C, 0x72, 0x03, 0xF3, 0x4D, 0x5C, 0xAB, 0x3B, 0xD5, 0x46, 0x44, 0x1E, 0x46,
-  0x63, 0x83, 0x9C, 0xAE, 0x52, 0x04, 0xCC, 0xD4, 0xC3, 0xCC, 0x1C, 0x8F, 0x49, 0x66, 0x95, 0x13, 0xE7, 0xBC, 0xD9, 0xA1, 0xD2, 0x90, 0x96, 0xD3, 0x0A, 0x68,
-  0xB2, 0x9D, 0xAE, 0xCA, 0xCC, 0xE1, 0x2A, 0x25, 0xF4, 0xC5, 0x24, 0x24, 0x6D, 0x22, 0x54, 0x61, 0xE5, 0x21, 0x12, 0x15, 0x31, 0x26, 0x23, 0xC7, 0x65, 0x8B,
-  0xB8, 0x29, 0x13, 0xFF, 0x72, 0x33, 0x2B, 0x44, 0x2E, 0x2B, 0xDD, 0x6D, 0x25, 0x74, 0x64, 0x6E, 0x74, 0xD0, 0xB7, 0x1D, 0x57, 0xF8, 0x70, 0x9C, 0x56, 0x49,
-  0x8F, 0x27, 0x6C, 0x99, 0xA4, 0x4A, 0x43, 0x60, 0xA8, 0x46, 0x14, 0x19, 0xC8, 0x01, 0x5B, 0xAD, 0x2B, 0x34, 0x41, 0x15, 0x5D, 0x5A, 0x39, 0xE0, 0xAB, 0x4D,
-  0x7C, 0x61, 0xB0, 0x99, 0xB6, 0xDE, 0xB2, 0xC1, 0xC5, 0x37, 0x6A, 0x01, 0xC9, 0x7E, 0x53, 0x45, 0x73, 0x4F, 0xF9, 0x63, 0x06, 0x91, 0xE1, 0x40, 0x1C, 0x6C,
-  0xB7, 0x8A, 0xB7, 0x2A, 0x1B, 0x42, 0xCE, 0x0E, 0x85, 0xFD, 0x71, 0x67, 0x87, 0xD1, 0x56, 0xBE, 0x33, 0xDC, 0x24, 0x27, 0x6E, 0xA3, 0xE3, 0xFD, 0x8C, 0x2C,
-  0xC3, 0xF3, 0xCE, 0x6B, 0xB8, 0xD9, 0xAB, 0x16, 0xDF, 0x55, 0x77, 0x36, 0x36, 0xAF, 0x35, 0x73, 0x7C, 0x5E, 0xB3, 0x9C, 0xA9, 0x93, 0xB8, 0x47, 0xEF, 0x33,
-  0x2D, 0xC3, 0x68, 0x7F, 0x5E, 0x8B, 0xAD, 0x38, 0xD6, 0x28, 0x54, 0x74, 0xA9, 0x36, 0x78, 0xF2, 0xCD, 0xC9, 0xD1, 0x51, 0xFF, 0xD9, 0x13, 0x7B, 0xE8, 0x2D,
-  0xF8, 0xFF, 0x1F, 0xD9, 0x02, 0xAD, 0x47, 0x7C, 0x1F, 0x6C, 0xCE, 0x3B, 0x3B, 0xA4, 0xD8, 0x12, 0x14, 0x1C, 0x02, 0x09, 0x29, 0x44, 0xF1, 0x6C, 0x50, 0x46,
-  0x57, 0xD0, 0xC4, 0x83, 0x04, 0x67, 0x68, 0xB8, 0x92, 0x26, 0xB4, 0x19, 0x9B, 0x6B, 0xD0, 0x18, 0x52, 0xA3, 0xCA, 0x18, 0x3A, 0x37, 0x49, 0xD2, 0x29, 0x37,
-  0x5C, 0x53, 0xBC, 0x15, 0x19, 0xA7, 0x21, 0x04, 0x30, 0x0A, 0x8E, 0xEB, 0xAC, 0xD0, 0x46, 0xDA, 0x28, 0x26, 0x7B, 0x6C, 0x7C, 0x33, 0xB2, 0xBE, 0x04, 0x4A,
-  0xAF, 0x05, 0xDA, 0xB0, 0x1D, 0x9F, 0x8D, 0x24, 0x29, 0x5D, 0xC5, 0x58, 0xE5, 0x30, 0xC2, 0x6A, 0x21, 0xE3, 0x02, 0x44, 0xDB, 0xA4, 0xD8, 0xD9, 0xB5, 0x6C,
-  0x4C, 0x14, 0x9B, 0xA0, 0xD0, 0x00, 0xB8, 0x36, 0xF8, 0xF9, 0xE2, 0xBB, 0x7F, 0x6A, 0xEF, 0xDE, 0xFE, 0x29, 0xD5, 0x50, 0x1E, 0x51, 0x18, 0x9C, 0x15, 0x7A,
-  0xA6, 0x60, 0x4C, 0x1F, 0x81, 0x4C, 0x6A, 0x5C, 0x33, 0x14, 0x03, 0x26, 0x43, 0x16, 0xB1, 0xA7, 0xFE, 0xEC, 0xBC, 0xA6, 0xD7, 0x70, 0x77, 0x4B, 0x70, 0xD6,
-  0xAE, 0x69, 0x18, 0xB8, 0xE9, 0xC1, 0xB5, 0x61, 0x2D, 0xF1, 0xA8, 0xA5, 0xC2, 0xEB, 0xBA, 0x69, 0x49, 0x9B, 0xF1, 0x88, 0x12, 0xCA, 0x58, 0x88, 0xC0, 0x71,
-  0x29, 0xD7, 0x06, 0x57, 0xC4, 0x3F, 0x3B, 0x64, 0xB7, 0x72, 0xB4, 0x96, 0xDD, 0x37, 0xB8, 0x30, 0x33, 0x87, 0x2C, 0x13, 0xCA, 0x52, 0xFC, 0xC4, 0x35, 0xE6,
-  0x04, 0xA5, 0xA2, 0xA4, 0x79, 0x51, 0xEB, 0x21, 0x64, 0x6D, 0xF0, 0x81, 0xD0, 0x2C, 0x03, 0xC8, 0x50, 0x52, 0xFC, 0x19, 0x4F, 0xE1, 0x63, 0xFD, 0x87, 0xF6,
-  0xCC, 0x97, 0xEC, 0x9A, 0x06, 0x33, 0x73, 0x05, 0xB9, 0x3F, 0x6E, 0x36, 0xB5, 0xDE, 0xBB, 0xF7, 0x5A, 0xB3, 0xA9, 0xD0, 0xD8, 0x59, 0x50, 0x77, 0x0A, 0xF4,
-  0x0F, 0x16, 0xC2, 0xA8, 0x21, 0x54, 0x3F, 0xEC, 0xA8, 0x36, 0xF8, 0xE1, 0xEA, 0xE7, 0x37, 0x2F, 0x1A, 0xED, 0x5E, 0xBF, 0x75, 0xA3, 0x9F, 0xB4, 0x5B, 0x7B,
-  0x67, 0x87, 0x0C, 0xAE, 0x78, 0x07, 0x60, 0x60, 0xEF, 0xB5, 0xD7, 0x6F, 0x5F, 0x35, 0xF4, 0xD6, 0x71, 0x55, 0x64, 0xFA, 0x49, 0x6D, 0xF0, 0xD3, 0x0F, 0x11,
-  0x65, 0xFD, 0x56, 0x15, 0x64, 0xC7, 0xC0, 0x26, 0xD0, 0xC5, 0x50, 0x75, 0xBB, 0x85, 0x50, 0xA1, 0xC8, 0x3B, 0xE5, 0x44, 0xAE, 0x1F, 0x41, 0xBF, 0x94, 0x87,
-  0x56, 0xF7, 0xF8, 0x46, 0xEF, 0xF5, 0xBB, 0x15, 0x78, 0xE8, 0xA3, 0x74, 0x81, 0x90, 0xC6, 0x71, 0xBF, 0x5B, 0x15, 0x57, 0x0F, 0x71, 0x81, 0x40, 0x8E, 0xDA,
-  0x20, 0x8F, 0xF6, 0x71, 0x15, 0xD1, 0x76, 0x6B, 0x03, 0xAA, 0xF2, 0x13, 0x44, 0xD5, 0x2A, 0x86, 0x0A, 0x45, 0xDB, 0x2E, 0x29, 0xDA, 0x4E, 0x6D, 0xF0, 0x23,
-  0x8A, 0x16, 0x2D, 0x03, 0x78, 0xA8, 0x64, 0x1E, 0x6D, 0x88, 0x52, 0x14, 0x57, 0x1B, 0xED, 0xB6, 0xD5, 0xAE, 0x22, 0x5A, 0xBD, 0x36, 0x40, 0x71, 0x20, 0xA6,
-  0xA3, 0x4A, 0x0E, 0x00, 0xDE, 0x44, 0x69, 0x02, 0x72, 0x6E, 0x8E, 0xFA, 0xC7, 0xE5, 0x31, 0x81, 0x27, 0x5D, 0x7D, 0x02, 0x4C, 0xC7, 0x20, 0xA8, 0x4A, 0x6E,
-  0x04, 0x5E, 0x84, 0x78, 0xFA, 0xDD, 0xD6, 0x4D, 0xB7, 0x8A, 0xCD, 0x80, 0x57, 0xBC, 0x45, 0x44, 0x80, 0xE4, 0xA6, 0x53, 0x45, 0x46, 0xE0, 0x12, 0x17, 0xDF,
-  0xBE, 0x6E, 0x74, 0x81, 0xB1, 0xF6, 0x49, 0xBF, 0x3C, 0x1E, 0x70, 0x87, 0x1F, 0x90, 0x20, 0x20, 0xE6, 0xA6, 0x5D, 0x2C, 0x3A, 0xC4, 0x11, 0x81, 0x33, 0x00,
-  0x3C, 0xE2, 0x28, 0x8D, 0x02, 0xEC, 0xFA, 0x2D, 0x25, 0x06, 0x11, 0xE9, 0x47, 0x15, 0xB8, 0x02, 0xAB, 0xFE, 0x01, 0xC5, 0x03, 0x48, 0x30, 0xE8, 0x55, 0x30,
-  0x45, 0x40, 0x44, 0x49, 0xD2, 0xFB, 0xD4, 0xD5, 0xCA, 0x63, 0x02, 0x9B, 0x3E, 0xE9, 0xDF, 0x9C, 0xF4, 0xD5, 0x10, 0xE0, 0x88, 0x8F, 0xA3, 0x54, 0x56, 0x4E,
-  0x90, 0x9D, 0x32, 0x64, 0xA5, 0x03, 0xFF, 0x5E, 0x1A, 0x16, 0xCC, 0x6F, 0x0A, 0x27, 0x03, 0x1C, 0x0E, 0x64, 0xC2, 0x0E, 0xD4, 0xF2, 0x00, 0x81, 0x92, 0x70,
-  0xA3, 0x59, 0x6D, 0xD0, 0x55, 0xC8, 0xB7, 0x62, 0x09, 0x39, 0x85, 0x8D, 0xD1, 0x4F, 0x93, 0x40, 0xB4, 0x3C, 0x4C, 0xFF, 0xC0, 0x25, 0x3A, 0x35, 0x21, 0x82,
-  0x94, 0x4A, 0x34, 0x24, 0xB4, 0x1A, 0x37, 0xB5, 0x41, 0xBF, 0x93, 0x9B, 0xA0, 0x95, 0x57, 0xC6, 0x90, 0xD6, 0x68, 0x6C, 0xE2, 0x79, 0x85, 0xF5, 0x11, 0x81,
-  0xD6, 0x06, 0x2F, 0xC3, 0xE3, 0x2A, 0x5A, 0x69, 0xE6, 0x71, 0x4A, 0x61, 0x53, 0xD4, 0x22, 0x90, 0xC3, 0x34, 0xD3, 0xEC, 0x70, 0xD5, 0x44, 0x9A, 0xD9, 0xAC,
-  0x62, 0xB6, 0xA9, 0x17, 0x9C, 0x4E, 0xBA, 0x86, 0xE7, 0x17, 0xD6, 0x4A, 0x00, 0x08, 0x11, 0x9A, 0x1F, 0xDD, 0x9B, 0x46, 0x42, 0x52, 0xFE, 0x06, 0xFA, 0xF0,
-  0x0C, 0x7F, 0xC9, 0xAA, 0x85, 0x85, 0x35, 0x12, 0x81, 0x42, 0x3E, 0x10, 0x1E, 0x57, 0xD2, 0x4A, 0x95, 0xF0, 0x25, 0x90, 0xC3, 0xF5, 0x12, 0x84, 0xB0, 0xEE,
-  0x96, 0xF4, 0x92, 0x47, 0x6D, 0x25, 0xBD, 0xCC, 0x0C, 0x77, 0x51, 0x2A, 0x7C, 0x85, 0x90, 0xA0, 0x95, 0xE0, 0xF0, 0xDE, 0x5C, 0x25, 0x22, 0xE6, 0x6F, 0xE0,
-  0x2B, 0x63, 0x62, 0x3B, 0xA6, 0x57, 0x7C, 0xB6, 0xCF, 0xE1, 0x6A, 0x83, 0x57, 0xA4, 0xF9, 0x3D, 0x1E, 0x55, 0x51, 0xC7, 0x8B, 0xA5, 0xEF, 0x54, 0x50, 0x48,
-  0x40, 0x0B, 0x53, 0x47, 0x8B, 0x6B, 0xE3, 0x78, 0x4B, 0xDA, 0x38, 0xDE, 0xA2, 0x36, 0x0C, 0xF2, 0xD9, 0x22, 0xD7, 0xC4, 0x2A, 0xAC, 0x8E, 0x00, 0xB0, 0x36,
-  0xB8, 0xBC, 0x59, 0x38, 0x1E, 0x3E, 0x3A, 0xF5, 0x1D, 0x9E, 0x57, 0x72, 0x92, 0x5E, 0x05, 0x9D, 0x84, 0x04, 0x71, 0x1F, 0xE9, 0x71, 0xAD, 0xF4, 0xB6, 0xA4,
-  0x95, 0x3C, 0x5A, 0xAB, 0x68, 0x65, 0x6A, 0x98, 0xF6, 0x88, 0x98, 0x16, 0x3E, 0xC6, 0x51, 0x54, 0x31, 0x02, 0x6C, 0x6D, 0xF0, 0x26, 0x3A, 0xA9, 0xA2, 0x98,
-  0x56, 0x05, 0xBD, 0x88, 0xF4, 0xC4, 0xFD, 0xA5, 0x07, 0xB3, 0xF2, 0x2D, 0xE9, 0x46, 0xD7, 0xB7, 0x39, 0xAA, 0x2C, 0xC8, 0xC8, 0x34, 0xAC, 0xCF, 0x64, 0x32,
-  0x81, 0x69, 0x50, 0xF1, 0xA1, 0x25, 0x06, 0x0E, 0xE3, 0x0B, 0x3B, 0xD7, 0x2E, 0xE9, 0x79, 0xE1, 0xFA, 0x65, 0x02, 0x5D, 0xF9, 0x22, 0x66, 0x72, 0x4E, 0x28,
-  0x2D, 0x4B, 0x7E, 0xEF, 0x84, 0x74, 0x96, 0x9F, 0xB6, 0x7E, 0x4F, 0xA6, 0x74, 0x1B, 0x41, 0x95, 0x39, 0xF4, 0x1B, 0xD7, 0xB8, 0xA5, 0xEF, 0x64, 0xA8, 0x32,
-  0xA5, 0xFF, 0x40, 0xC6, 0xDA, 0x47, 0xD3, 0x2E, 0xCF, 0x4C, 0x17, 0x09, 0x21, 0xC4, 0xAE, 0x86, 0xA5, 0x07, 0x53, 0x24, 0x38, 0xA8, 0x86, 0xA4, 0x8F, 0x35,
-  0xFD, 0x85, 0x69, 0x3C, 0x84, 0x49, 0xBC, 0xB1, 0x1A, 0x16, 0x1F, 0x50, 0x56, 0x43, 0x18, 0x97, 0x7F, 0x7A, 0xA9, 0x5D, 0xD2, 0x8D, 0xEF, 0x85, 0xC3, 0x15,
-  0xDB, 0x93, 0xA7, 0x62, 0xE8, 0xD1, 0xD2, 0x0D, 0xF6, 0xB9, 0xB6, 0xA6, 0x26, 0x77, 0x20, 0xD5, 0x75, 0x35, 0x09, 0x7B, 0x01, 0x81, 0x74, 0x0B, 0x53, 0x4D,
-  0xE0, 0x56, 0x8D, 0xC7, 0x2D, 0xA6, 0x62, 0xA3, 0x55, 0xF1, 0x34, 0x6C, 0xB4, 0x02, 0x35, 0x8D, 0xAF, 0xF1, 0x99, 0x88, 0xB1, 0x06, 0xFA, 0xDA, 0x89, 0xA2,
-  0xB0, 0xD7, 0xFB, 0x51, 0x14, 0xE5, 0xF7, 0xBE, 0x15, 0x05, 0xD6, 0xF2, 0x19, 0xC7, 0xD1, 0x32, 0x4E, 0x45, 0x01, 0x6B, 0x83, 0x77, 0x86, 0xBD, 0x84, 0x41,
-  0x66, 0x57, 0x0A, 0x0B, 0x3B, 0xBE, 0x37, 0xF7, 0xE2, 0x7C, 0xDF, 0xB7, 0xEA, 0x80, 0x90, 0xB9, 0x33, 0x2E, 0x3E, 0xDD, 0xE1, 0x70, 0x2C, 0x24, 0xBE, 0x83,
-  0xA3, 0xC2, 0x89, 0x41, 0x80, 0x61, 0xCB, 0x19, 0x01, 0x9B, 0x4A, 0x95, 0x4F, 0x06, 0xAE, 0x96, 0xB6, 0x7D, 0x5B, 0x25, 0x13, 0xB8, 0xB0, 0x9C, 0xE5, 0xB8,
-  0x3C, 0x06, 0x48, 0x03, 0xFE, 0x35, 0x99, 0x98, 0xA3, 0xF2, 0x89, 0x04, 0x24, 0x01, 0x6F, 0x9D, 0xB9, 0x22, 0xFC, 0x96, 0x07, 0x5E, 0x32, 0x2A, 0x31, 0x93,
-  0x1B, 0x81, 0x16, 0x2F, 0x2F, 0x76, 0x3A, 0xF0, 0x42, 0x9F, 0xF7, 0x14, 0x19, 0x90, 0xDB, 0xFB, 0x0E, 0x0A, 0x40, 0xC4, 0x67, 0x6A, 0x3C, 0x65, 0x94, 0xC5,
-  0x20, 0xC3, 0x88, 0x1E, 0x4C, 0xBF, 0xEF, 0x6B, 0x7E, 0x17, 0x51, 0x14, 0x9F, 0xDD, 0xE1, 0xD2, 0x73, 0x38, 0xBD, 0xEB, 0xB4, 0x37, 0x3B, 0xC1, 0x43, 0xE4,
-  0xDB, 0xD5, 0x4F, 0xBB, 0x8C, 0x6A, 0x20, 0x1A, 0x7D, 0x8F, 0xEB, 0x0C, 0x05, 0x02, 0x76, 0x75, 0x47, 0x6A, 0xDF, 0x9F, 0x27, 0xB5, 0x1F, 0x80, 0x2B, 0x4D,
-  0x4B, 0x44, 0xBC, 0x29, 0x46, 0xBC, 0x37, 0x17, 0xBB, 0xD1, 0xD0, 0xF4, 0xDE, 0x42, 0xDD, 0xF4, 0x5E, 0x43, 0x9D, 0xC6, 0x37, 0x05, 0x06, 0x52, 0x28, 0x99,
-  0xC1, 0x72, 0x40, 0x56, 0xCB, 0xAA, 0x12, 0xE4, 0xF4, 0x9B, 0x2A, 0x51, 0x2E, 0x20, 0x23, 0x1E, 0xE4, 0xFA, 0xD1, 0xAA, 0x48, 0x6F, 0xB3, 0xCB, 0xBA, 0xDD,
-  0x3C, 0x6A, 0xAB, 0x38, 0x8D, 0x6B, 0xAC, 0x3E, 0x4F, 0xE7, 0x46, 0x61, 0x65, 0x70, 0x38, 0xD0, 0xC5, 0xBB, 0x17, 0xBB, 0x4C, 0x17, 0x82, 0x7E, 0xEF, 0xC7,
-  0x8F, 0x42, 0xAE, 0xEF, 0x3B, 0xD6, 0x59, 0xC4, 0x2E, 0x1E, 0xEC, 0x10, 0xA8, 0x36, 0xF8, 0x8E, 0xD8, 0x9E, 0x76, 0xE1, 0xB8, 0xFC, 0x45, 0x98, 0x3B, 0xD1,
-  0x1A, 0xED, 0xF9, 0x7E, 0x54, 0xC6, 0x98, 0xBE, 0x6F, 0x7D, 0xCD, 0xE6, 0xA6, 0xEB, 0x3A, 0x6E, 0x61, 0x95, 0x71, 0x38, 0x98, 0x56, 0x34, 0xDF, 0xD1, 0xA3,
-  0x9D, 0xA8, 0x2B, 0xE8, 0xF5, 0x7E, 0x34, 0x16, 0xF2, 0x7C, 0xDF, 0x4A, 0xBB, 0x9E, 0x58, 0xE6, 0xA2, 0xB0, 0xCA, 0x28, 0x54, 0x6D, 0xF0, 0xA9, 0xF9, 0x1A,
-  0xFE, 0xEE, 0x44, 0x5D, 0xAC, 0xC7, 0xFB, 0x51, 0x16, 0xE7, 0xF6, 0xBE, 0x55, 0x35, 0x5C, 0x14, 0x0F, 0x87, 0x00, 0x53, 0x1B, 0xBC, 0x7C, 0xBF, 0x9B, 0xDC,
-  0x0F, 0x3B, 0x53, 0xD4, 0x50, 0x25, 0x7D, 0x50, 0xA6, 0xEE, 0x5B, 0x1B, 0xAB, 0x12, 0xDA, 0x58, 0x21, 0xE1, 0x3F, 0xED, 0x48, 0x1B, 0x2B, 0x75, 0x6D, 0x6C,
-  0xD8, 0x5F, 0x56, 0x0F, 0x41, 0x3F, 0xF4, 0xE9, 0xD3, 0xA1, 0x51, 0x7C, 0x38, 0x0A, 0x00, 0x71, 0xD3, 0x18, 0x1C, 0x69, 0x2F, 0x8D, 0xDD, 0x0C, 0x48, 0x61,
-  0xBF, 0xBB, 0x70, 0xA1, 0x88, 0xC9, 0xFB, 0xD6, 0xD3, 0xC4, 0x18, 0x91, 0xCF, 0x63, 0xE2, 0x97, 0x59, 0x5B, 0x16, 0x60, 0x6B, 0x83, 0xD7, 0x70, 0xA2, 0xBD,
-  0xA2, 0x27, 0xBB, 0x4A, 0xF9, 0xC4, 0xFE, 0x77, 0xA1, 0xB5, 0x18, 0xBF, 0x0F, 0x42, 0x71, 0x90, 0x60, 0x3B, 0x53, 0xBB, 0xD4, 0xE3, 0x4C, 0x31, 0x70, 0xAE,
-  0xBE, 0x0F, 0xEC, 0x7C, 0xB7, 0x0A, 0x8C, 0x88, 0xD8, 0x99, 0x0E, 0x05, 0xBE, 0x37, 0xA8, 0x46, 0xC5, 0xA7, 0x1A, 0xF9, 0x9B, 0x81, 0xF3, 0x74, 0xC5, 0x9F,
-  0xAE, 0xA3, 0x9B, 0x5A, 0x88, 0xDF, 0xF4, 0x7C, 0xD3, 0xB2, 0x60, 0x2A, 0x4C, 0x7C, 0xED, 0x0A, 0x0F, 0x15, 0x1F, 0xA7, 0x13, 0xB0, 0x04, 0x0F, 0xD1, 0xFA,
-  0x2E, 0x31, 0xE6, 0xB5, 0xC1, 0x15, 0xBE, 0x33, 0x19, 0x70, 0xE1, 0x59, 0x71, 0x64, 0x54, 0x8C, 0xC4, 0x76, 0x1D, 0x20, 0x2A, 0x54, 0x13, 0x7F, 0x3F, 0x65,
-  0x4D, 0x0B, 0x8E, 0x84, 0x6B, 0x83, 0x4B, 0xDA, 0x58, 0x43, 0x3B, 0xCB, 0xEF, 0x4E, 0xF9, 0x39, 0x3F, 0xFA, 0x44, 0x2F, 0x3E, 0xA2, 0x1B, 0x7F, 0xA3, 0x3A,
-  0xE8, 0x95, 0xBD, 0xD5, 0x60, 0x70, 0x46, 0xDF, 0x0E, 0xCB, 0x9B, 0xD1, 0x87, 0xD9, 0x57, 0xFC, 0xE9, 0xE4, 0xA1, 0x63, 0x8D, 0x9F, 0x09, 0xAB, 0xCB, 0x57,
-  0xE1, 0xE3, 0xB6, 0x08, 0x02, 0x86, 0x11, 0x60, 0xC8, 0x51, 0xFE, 0xCC, 0x0D, 0xD0, 0xB3, 0x27, 0xA2, 0xF1, 0x1D, 0x65, 0x19, 0xCA, 0x4D, 0x79, 0x34, 0xD8,
-  0x25, 0xD3, 0x50, 0x90, 0xB2, 0x27, 0xC6, 0xA5, 0x0F, 0x0A, 0x7F, 0x20, 0x53, 0xD3, 0x03, 0x1A, 0x35, 0x30, 0x8B, 0x43, 0xFA, 0x8C, 0x25, 0x33, 0x66, 0xB5,
-  0xE7, 0x77, 0xC5, 0x2E, 0xF9, 0xCB, 0x19, 0xA4, 0x8F, 0x63, 0x17, 0xCA, 0x4F, 0x92, 0x0F, 0x4F, 0xC7, 0x31, 0xE6, 0x19, 0xFD, 0xE3, 0x66, 0x73, 0xD6, 0xC5,
-  0xA7, 0x45, 0xB5, 0x80, 0xB5, 0xB3, 0xC3, 0x59, 0x37, 0xEF, 0xD1, 0xB0, 0xDC, 0x47, 0x7D, 0x81, 0xD3, 0xD2, 0x4F, 0xFA, 0xA2, 0x94, 0x06, 0x40, 0xCD, 0xBE,
-  0xF6, 0xCE, 0xF0, 0xBE, 0xEC, 0x6B, 0x9F, 0xB0, 0x00, 0xB7, 0xC3, 0x07, 0x7E, 0x91, 0x76, 0x63, 0x3C, 0x76, 0x53, 0x1F, 0xFA, 0xED, 0xC6, 0x1E, 0xFA, 0xED,
-  0x07, 0x0F, 0xFD, 0xF6, 0xA3, 0xDD, 0x6E, 0x37, 0x9D, 0x56, 0xEB, 0x58, 0x85, 0x75, 0xC5, 0x07, 0x7F, 0x37, 0xC2, 0xD3, 0x1C, 0xA4, 0xA9, 0xC8, 0x53, 0x37,
-  0xE0, 0x49, 0xD8, 0x15, 0x7E, 0x33, 0x99, 0x3C, 0x34, 0x8E, 0xF8, 0xBA, 0x54, 0x79, 0x96, 0x5A, 0xED, 0x5D, 0x3F, 0x9D, 0x4D, 0x8D, 0x7B, 0x53, 0x0F, 0x67,
-  0xD3, 0x26, 0xC9, 0x68, 0xD8, 0xCB, 0x0C, 0x86, 0x14, 0x84, 0x39, 0xFD, 0x9B, 0x4D, 0x3A, 0xFD, 0xB4, 0x82, 0xD3, 0x4F, 0xD7, 0x9C, 0x7E, 0x87, 0xDE, 0x1E,
-  0x10, 0xFE, 0x77, 0xF3, 0xF8, 0x80, 0xAF, 0x02, 0x5E, 0x2F, 0xE5, 0xAB, 0xD5, 0xDA, 0xA8, 0xDF, 0xE7, 0x3A, 0x49, 0x68, 0x0C, 0x6F, 0x36, 0xE9, 0x24, 0x29,
-  0xA6, 0x5B, 0xCA, 0x4E, 0x79, 0xD8, 0x19, 0xEC, 0x66, 0x5C, 0xA2, 0xD9, 0x94, 0xA8, 0x50, 0xDE, 0x3B, 0x3E, 0x13, 0xDA, 0xE9, 0xF2, 0xD4, 0x69, 0x13, 0xEA,
-  0x51, 0x7F, 0x11, 0x44, 0x6A, 0x93, 0xCD, 0x24, 0x66, 0x0B, 0x21, 0xC3, 0x55, 0x4E, 0xCC, 0xDE, 0x7F, 0xF7, 0x5D, 0xB1, 0x5C, 0x4C, 0xEC, 0xE5, 0x81, 0xE4,
-  0x62, 0x99, 0xB5, 0xD0, 0xDB, 0x05, 0xDC, 0x40, 0xAA, 0x4B, 0x99, 0x6E, 0x04, 0x5E, 0x1B, 0xBC, 0xA4, 0xC7, 0x9A, 0x20, 0xB1, 0x42, 0xC6, 0xAB, 0x3C, 0xED,
-  0xA4, 0x80, 0x42, 0xB1, 0x34, 0x22, 0x21, 0xA9, 0x1B, 0x45, 0x5C, 0x19, 0x05, 0x52, 0x81, 0x3D, 0x75, 0xA6, 0x2A, 0xFB, 0x04, 0x6D, 0x92, 0x97, 0x0A, 0x2F,
-  0x5C, 0x52, 0x5A, 0x6D, 0x1C, 0xB6, 0x36, 0x78, 0xEF, 0x12, 0xED, 0x95, 0x79, 0xAD, 0xCE, 0x9B, 0xB0, 0x51, 0x30, 0x44, 0xA2, 0x26, 0xE5, 0xE4, 0x0E, 0x3E,
-  0xE9, 0xAE, 0x40, 0x5C, 0x6C, 0x57, 0xDD, 0x4E, 0x27, 0xC1, 0x0A, 0x69, 0x57, 0xBB, 0x1A, 0x86, 0x4E, 0x6D, 0xD0, 0xA9, 0x86, 0xA1, 0x5B, 0x1B, 0x74, 0xAB,
-  0x61, 0xE8, 0x81, 0x1C, 0x0E, 0x7A, 0xD5, 0x70, 0xF4, 0x6B, 0x83, 0x7E, 0x35, 0x0C, 0x47, 0x20, 0xCB, 0xAA, 0x54, 0x40, 0xE6, 0x72, 0x5C, 0x00, 0x43, 0xFE,
-  0x26, 0x47, 0xD6, 0xAA, 0xBA, 0xF3, 0xCC, 0x97, 0x56, 0x69, 0xE7, 0xE1, 0xB0, 0xB5, 0xC1, 0xBB, 0xA5, 0xE5, 0x9B, 0x0B, 0xCB, 0x84, 0x69, 0x7B, 0xA3, 0xAB,
-  0x35, 0xB5, 0x76, 0xAF, 0xBD, 0xB7, 0xC3, 0x0C, 0x33, 0xA0, 0x43, 0xED, 0x1D, 0x52, 0x9D, 0x20, 0x09, 0xD3, 0x8F, 0xC5, 0x77, 0x0A, 0x3C, 0x88, 0x70, 0xE6,
-  0x3A, 0x8E, 0x5F, 0x5A, 0x1D, 0x01, 0x30, 0xA4, 0xF9, 0x70, 0x54, 0x3A, 0x9A, 0x45, 0x68, 0xCA, 0x18, 0x7A, 0xCA, 0x26, 0xE7, 0x8A, 0xE1, 0x4C, 0x2F, 0x16,
-  0xCE, 0x76, 0xE7, 0x3E, 0xDE, 0x6D, 0xF9, 0x94, 0x81, 0xC3, 0xC2, 0x6C, 0xF5, 0x16, 0x66, 0x88, 0x73, 0x54, 0x98, 0xD6, 0x68, 0x81, 0xFB, 0xE8, 0xBD, 0x5D,
-  0x7A, 0x4F, 0x40, 0x46, 0xC1, 0x37, 0xB0, 0x89, 0xDE, 0xF3, 0x30, 0x9C, 0x87, 0xEA, 0x83, 0x58, 0xE3, 0x5E, 0x79, 0x8D, 0x04, 0xD0, 0x90, 0x0F, 0xE0, 0x7B,
-  0xF0, 0x2A, 0xF9, 0x91, 0x80, 0xAC, 0x9C, 0x23, 0x55, 0x77, 0x1A, 0xA9, 0x2B, 0x56, 0xCC, 0x0B, 0xDA, 0x95, 0x47, 0xF5, 0xCE, 0x43, 0x1C, 0x0B, 0x17, 0xF8,
-  0xEA, 0x44, 0xA2, 0xB6, 0xBD, 0x92, 0x22, 0x13, 0x93, 0x48, 0x06, 0xCB, 0x8D, 0x86, 0x6D, 0x2B, 0xDF, 0x69, 0xE6, 0x1F, 0x10, 0xB0, 0xBE, 0xDA, 0x54, 0x7C,
-  0x15, 0x5E, 0x60, 0x4E, 0x36, 0x11, 0x08, 0x79, 0x7D, 0x70, 0xB3, 0x00, 0x24, 0xAC, 0xF4, 0x34, 0x80, 0x03, 0x73, 0x15, 0x86, 0x91, 0xB8, 0xA3, 0x17, 0x88,
-  0xC4, 0xE2, 0x8C, 0x20, 0xC4, 0x57, 0x72, 0xB4, 0xBB, 0xF7, 0xF4, 0xBF, 0x2B, 0x0F, 0x1E, 0x15, 0x5D, 0xBF, 0x60, 0x1A, 0x2C, 0xC1, 0x80, 0xEF, 0x0B, 0xD4,
-  0x8B, 0x24, 0xF4, 0x9B, 0x0B, 0x1F, 0xC2, 0x5A, 0x21, 0x35, 0x38, 0x3A, 0x74, 0x13, 0x9F, 0xCD, 0xF3, 0x0B, 0x2C, 0xFF, 0xA5, 0x36, 0xD9, 0x4C, 0x75, 0x67,
-  0x65, 0xDA, 0xC5, 0xAB, 0x3B, 0x3F, 0x99, 0xF6, 0xD8, 0x59, 0x15, 0x2B, 0xF0, 0x88, 0x1D, 0xFD, 0x05, 0x0A, 0x3C, 0x34, 0x3D, 0xC0, 0x15, 0xE2, 0xA6, 0x4B,
-  0xD4, 0xDE, 0x67, 0x93, 0x14, 0x32, 0x83, 0xBE, 0xC1, 0x05, 0x56, 0x40, 0xE1, 0x69, 0x74, 0xBD, 0x79, 0xDB, 0x99, 0xDA, 0xCF, 0xA7, 0x62, 0xAE, 0xC6, 0x29,
-  0x50, 0xCB, 0xD5, 0xBA, 0x92, 0x72, 0xF3, 0xBD, 0x57, 0xD0, 0x7F, 0x59, 0xE7, 0xE7, 0xF6, 0xDE, 0xF9, 0xD9, 0xC4, 0x00, 0x44, 0xEC, 0x71, 0x69, 0xCB, 0x42,
-  0xD8, 0xC8, 0xAE, 0x2E, 0xED, 0xF1, 0x4E, 0xAD, 0x8A, 0xF5, 0x5E, 0x5A, 0x07, 0xED, 0x7E, 0xBB, 0xF3, 0xB0, 0xCC, 0x0A, 0x19, 0xAA, 0x60, 0x54, 0xFA, 0x49,
-  0xEF, 0x01, 0x4D, 0x69, 0x9C, 0xC9, 0x84, 0xAD, 0x6B, 0x96, 0x33, 0x2D, 0x0E, 0x7E, 0x43, 0x9F, 0xD2, 0xF5, 0xC8, 0x6E, 0xE3, 0x55, 0xD8, 0x79, 0xC1, 0xD2,
-  0x8C, 0xA0, 0x8B, 0xFE, 0xC3, 0x32, 0x2D, 0xCE, 0x91, 0xAA, 0x75, 0x49, 0x38, 0xEA, 0x3E, 0x1C, 0xD3, 0xF2, 0x1D, 0xDF, 0xB0, 0x4A, 0x5B, 0x16, 0x83, 0x06,
-  0xC3, 0xFA, 0x88, 0x07, 0xDA, 0x15, 0xF0, 0xB9, 0x53, 0xE3, 0x0A, 0xFA, 0x2F, 0x1F, 0xB8, 0x8E, 0xBB, 0x1B, 0x52, 0x46, 0x05, 0x96, 0x7E, 0x59, 0x67, 0xA9,
-  0x52, 0xE8, 0xEA, 0x6F, 0x68, 0x91, 0x7C, 0x23, 0xA1, 0x6B, 0xE9, 0xE3, 0xD5, 0xD2, 0xA1, 0x8B, 0x81, 0x63, 0xE8, 0xA2, 0x47, 0xBB, 0x37, 0xB1, 0x90, 0x82,
-  0xF2, 0x36, 0xD6, 0x3B, 0xD9, 0xE4, 0x16, 0x98, 0x4D, 0x44, 0x30, 0xC6, 0x53, 0x25, 0x23, 0xDB, 0x94, 0xDF, 0x54, 0x36, 0xB2, 0x91, 0xA1, 0xFC, 0x8E, 0x37,
-  0x8A, 0x4C, 0xCC, 0xE6, 0x19, 0x2C, 0xCC, 0xE1, 0xD8, 0xC1, 0x4E, 0x2B, 0x36, 0x41, 0xE7, 0x1B, 0x5F, 0xA8, 0x0D, 0xB9, 0x7A, 0x48, 0xF5, 0x99, 0xA1, 0x69,
-  0xDB, 0x65, 0xD5, 0xC4, 0x61, 0x6B, 0x83, 0x97, 0xEC, 0x60, 0xB7, 0x4B, 0xEA, 0xBC, 0xF3, 0xCD, 0xAF, 0xA7, 0x07, 0x5C, 0xED, 0x5A, 0x4D, 0x89, 0x22, 0x86,
-  0x1B, 0x7E, 0xF7, 0xA3, 0xC6, 0xF7, 0xA8, 0x46, 0xDF, 0x01, 0x79, 0x38, 0x25, 0x8D, 0xA9, 0x31, 0xC7, 0x87, 0x97, 0x8B, 0x16, 0x35, 0xDE, 0x20, 0x58, 0xB1,
-  0x9A, 0x46, 0xBC, 0xA7, 0x87, 0x5D, 0xD5, 0x18, 0xC4, 0xDF, 0x5A, 0x09, 0x84, 0x37, 0x87, 0xA6, 0xE1, 0xE1, 0x83, 0xFE, 0x70, 0xAC, 0xBD, 0x84, 0x63, 0xED,
-  0xBD, 0xB5, 0x0C, 0x5F, 0xBB, 0x2B, 0x73, 0x08, 0x71, 0x3F, 0x5B, 0x84, 0x21, 0xED, 0xA9, 0x05, 0xBA, 0x8D, 0x8F, 0x3F, 0xE0, 0x05, 0xC7, 0xB8, 0x7B, 0xAD,
-  0xD7, 0x3D, 0x6E, 0xD5, 0x34, 0x96, 0x15, 0xF3, 0xC7, 0xFA, 0xBD, 0x2F, 0x74, 0x5B, 0x9B, 0x1E, 0x12, 0x28, 0x73, 0x00, 0x91, 0xDE, 0x90, 0x40, 0x6A, 0xBF,
-  0x55, 0x76, 0x9B, 0xAD, 0x4B, 0x44, 0x0F, 0xC4, 0xD1, 0x92, 0x1A, 0x42, 0xEC, 0x3D, 0x9B, 0xAC, 0x7D, 0xFC, 0x05, 0x05, 0xED, 0x9E, 0xEC, 0xFD, 0xA7, 0x72,
-  0x41, 0xE8, 0x52, 0x41, 0xE0, 0xEE, 0xBE, 0xCD, 0xF2, 0xD4, 0x0E, 0x78, 0xD2, 0xD5, 0x78, 0x6A, 0x57, 0xE0, 0xA9, 0xBD, 0x23, 0x9E, 0x3A, 0x01, 0x4F, 0x6D,
-  0x35, 0x9E, 0x3A, 0x15, 0x78, 0xEA, 0xEC, 0x88, 0xA7, 0x6E, 0xC0, 0x53, 0x47, 0x8D, 0xA7, 0x6E, 0x05, 0x9E, 0xBA, 0x3B, 0xE2, 0xA9, 0x17, 0xF0, 0xD4, 0x55,
-  0xE3, 0xA9, 0x57, 0x81, 0xA7, 0xDE, 0x8E, 0x78, 0xEA, 0x07, 0x3C, 0xF5, 0xD4, 0x78, 0xEA, 0x57, 0xE0, 0xA9, 0xBF, 0x23, 0x9E, 0x8E, 0x02, 0x9E, 0xFA, 0x6A,
-  0x3C, 0x1D, 0x55, 0xE0, 0xE9, 0x68, 0x47, 0x3C, 0x1D, 0x07, 0x3C, 0x1D, 0xA9, 0xF1, 0x74, 0x5C, 0x81, 0xA7, 0xE3, 0x1D, 0xF1, 0x74, 0x12, 0xF0, 0x74, 0xAC,
-  0xC6, 0xD3, 0x49, 0x05, 0x9E, 0x4E, 0x76, 0xC4, 0x13, 0xEE, 0xA6, 0x62, 0x4C, 0x9D, 0x28, 0x0E, 0xBA, 0xAD, 0x0A, 0x5C, 0x19, 0xBB, 0xE2, 0x2A, 0x4C, 0x25,
-  0x74, 0xD5, 0x5C, 0xA2, 0x4A, 0x32, 0x31, 0xDC, 0x15, 0x5B, 0x51, 0x36, 0xA1, 0x98, 0x4E, 0xE8, 0x55, 0xF2, 0x89, 0xD1, 0xAE, 0xD8, 0x0A, 0x13, 0x0A, 0x5D,
-  0x31, 0xA3, 0xD0, 0xAB, 0xA4, 0x14, 0xE3, 0x5D, 0xB1, 0x15, 0xE6, 0x14, 0xBA, 0x62, 0x52, 0xA1, 0x57, 0xC9, 0x2A, 0xC8, 0xAE, 0xD8, 0x0A, 0xD3, 0x0A, 0x5D,
-  0x31, 0xAF, 0xD0, 0xAB, 0x24, 0x16, 0x93, 0x5D, 0xB1, 0x15, 0x66, 0x16, 0xBA, 0x62, 0x6A, 0xA1, 0x57, 0xC8, 0x2D, 0x4E, 0xE4, 0x13, 0xB1, 0x8D, 0xB2, 0x45,
-  0x7C, 0x3E, 0x45, 0x8E, 0x26, 0x6D, 0x4A, 0x0F, 0x1C, 0x71, 0x20, 0x7C, 0x22, 0x8E, 0x09, 0xE4, 0xC2, 0xB1, 0x27, 0xE6, 0x34, 0x2C, 0x32, 0x3C, 0x98, 0x67,
-  0x63, 0x3C, 0xE1, 0x85, 0xBF, 0xCA, 0x85, 0x86, 0xAB, 0x57, 0x97, 0xC5, 0xCA, 0x0C, 0x62, 0x2F, 0x7F, 0xA1, 0x22, 0x03, 0x90, 0xDD, 0x16, 0xBF, 0x3E, 0xA0,
-  0x54, 0x57, 0xA0, 0x40, 0x45, 0x2A, 0x0A, 0x3D, 0xB1, 0xA2, 0xD0, 0x57, 0xAE, 0x28, 0x30, 0xE2, 0xB6, 0x53, 0x4B, 0x00, 0xDC, 0x1D, 0xF6, 0xC9, 0x04, 0x75,
-  0xA6, 0x3B, 0xE5, 0x99, 0xEE, 0x15, 0x61, 0xBA, 0x53, 0x86, 0xE9, 0x12, 0xCF, 0xB4, 0x2A, 0xCA, 0x09, 0xE8, 0x7D, 0x6D, 0xDE, 0x90, 0xB1, 0xF6, 0x8B, 0xBA,
-  0xA8, 0xF4, 0xF2, 0xA2, 0x3A, 0x2A, 0x22, 0x2A, 0x7D, 0x8B, 0xF6, 0xD1, 0x0B, 0xF8, 0xFE, 0x51, 0x9D, 0xEF, 0x5E, 0x79, 0xBE, 0x3B, 0x45, 0xF8, 0xEE, 0x6D,
-  0x91, 0xEF, 0x6E, 0xC0, 0xF7, 0x27, 0x75, 0xBE, 0xBB, 0xE5, 0xF9, 0xEE, 0x16, 0xE1, 0xBB, 0xBB, 0x45, 0xBE, 0xDB, 0x10, 0x6C, 0x7E, 0xFC, 0xA4, 0x7D, 0x9C,
-  0xB9, 0xC4, 0x9B, 0xE5, 0x57, 0xE2, 0x18, 0x44, 0xD9, 0xB1, 0xBD, 0xB7, 0x83, 0xB9, 0x1B, 0x52, 0xD8, 0x11, 0x79, 0xCA, 0xCD, 0x9B, 0x19, 0x84, 0xCA, 0x37,
-  0x89, 0xE4, 0x3C, 0xC9, 0x67, 0x6E, 0xBA, 0x2A, 0x53, 0xDB, 0x8B, 0x61, 0xC7, 0xB5, 0xC1, 0xDB, 0x65, 0x81, 0xF1, 0xED, 0xB8, 0xBC, 0x3D, 0xAB, 0x57, 0xCC,
-  0x19, 0x5D, 0x5B, 0xB3, 0xE7, 0x13, 0xCA, 0x33, 0xE4, 0x65, 0x9E, 0x82, 0xDA, 0xCB, 0x57, 0x21, 0x7A, 0x3B, 0xA8, 0x92, 0x63, 0xA4, 0x3F, 0x62, 0xEC, 0xFC,
-  0x88, 0x0C, 0x69, 0x90, 0xB1, 0x14, 0x18, 0x8C, 0x8E, 0x0A, 0x6A, 0xF3, 0xB8, 0x64, 0x74, 0x42, 0x1A, 0xB7, 0xA6, 0x4E, 0x9C, 0x7A, 0xA0, 0x00, 0x3E, 0x95,
-  0x10, 0x40, 0xBF, 0xBC, 0x00, 0x0A, 0x65, 0x2E, 0x48, 0xE3, 0xF6, 0x04, 0xD0, 0x62, 0x02, 0xB8, 0x8A, 0x5E, 0x7A, 0x9D, 0x61, 0xD0, 0x15, 0x2A, 0x50, 0xBD,
-  0x1D, 0xAC, 0x91, 0x60, 0xA4, 0xD5, 0x03, 0x8B, 0x06, 0x8E, 0x8A, 0x29, 0xB4, 0x5D, 0x34, 0xBF, 0x92, 0x17, 0x3F, 0x15, 0xF2, 0xEF, 0x6D, 0x26, 0x58, 0xED,
-  0x56, 0x60, 0xD1, 0xC5, 0x05, 0xD0, 0x2A, 0x2F, 0x00, 0xBD, 0x90, 0x00, 0x5A, 0x0F, 0x2B, 0x19, 0xEF, 0xAF, 0x7F, 0xA7, 0x38, 0x5F, 0x5A, 0x45, 0xDD, 0x5F,
-  0x18, 0xCD, 0xDA, 0x45, 0x84, 0xB5, 0x55, 0xEF, 0xEF, 0x44, 0x9C, 0x6B, 0xBF, 0x68, 0xF1, 0xAD, 0xAF, 0x59, 0x71, 0xA0, 0x7C, 0x11, 0xB0, 0xB7, 0x83, 0xF5,
-  0x2A, 0xA4, 0xF0, 0x44, 0xC2, 0x59, 0xC1, 0x00, 0x7F, 0x52, 0xDE, 0x1D, 0x0A, 0x69, 0x18, 0x69, 0xDD, 0x9E, 0x8A, 0x7B, 0x31, 0x41, 0xB0, 0x6F, 0xA4, 0xAB,
-  0xA8, 0xB8, 0x7C, 0xE5, 0xB0, 0xB7, 0x83, 0xA5, 0x2E, 0xA4, 0xF0, 0x58, 0xC2, 0x59, 0x41, 0x15, 0x17, 0x4D, 0x49, 0x8F, 0x4B, 0x4E, 0x2D, 0xF5, 0x6D, 0xE6,
-  0xA4, 0x58, 0xED, 0x16, 0x04, 0x21, 0x7E, 0xC0, 0x22, 0x4B, 0xC1, 0xE5, 0x2B, 0xDE, 0xBD, 0x8A, 0xEB, 0xB3, 0xDB, 0x8B, 0xE4, 0x47, 0xB2, 0xAF, 0x9B, 0xE7,
-  0xDB, 0x41, 0xD1, 0x5C, 0xB6, 0x55, 0x72, 0xE0, 0xDB, 0x6A, 0x2A, 0x0B, 0xBD, 0x43, 0xD6, 0xB3, 0xCE, 0x7D, 0x86, 0x09, 0x94, 0x5F, 0x79, 0xEB, 0xED, 0x60,
-  0x7B, 0x08, 0x52, 0xD8, 0xAE, 0x0D, 0x3E, 0x15, 0x64, 0xAA, 0x4A, 0xFD, 0xA0, 0xF4, 0xFE, 0x90, 0xDD, 0x95, 0xDE, 0x47, 0xF3, 0x9B, 0xE2, 0xA5, 0xF7, 0x8B,
-  0x77, 0x3F, 0x17, 0x2B, 0xBD, 0x8B, 0xBD, 0xEC, 0xAE, 0xF4, 0x5E, 0xCE, 0x66, 0x0A, 0x6D, 0x94, 0x05, 0xC6, 0xF0, 0x55, 0x48, 0x23, 0xD3, 0xA3, 0x5D, 0x82,
-  0x60, 0xB4, 0xF7, 0xC1, 0x69, 0x28, 0x22, 0xE1, 0x19, 0xE5, 0x78, 0xFB, 0x2C, 0xEB, 0xE9, 0x64, 0x84, 0x85, 0x52, 0xCF, 0xF0, 0xE2, 0x0B, 0x75, 0xFA, 0xFC,
-  0x1B, 0x5F, 0x15, 0x9E, 0x05, 0x4E, 0x7B, 0xD7, 0xC8, 0xC1, 0x51, 0x41, 0xDC, 0x5B, 0x7F, 0xC5, 0xC0, 0x20, 0xA1, 0x28, 0x9D, 0xEA, 0x47, 0xC7, 0x73, 0xE5,
-  0x3A, 0x39, 0x05, 0x2B, 0x12, 0xCD, 0x3B, 0x62, 0xA9, 0x45, 0x3D, 0x9A, 0x33, 0xF2, 0xB6, 0x13, 0xCD, 0x11, 0x77, 0x8C, 0xF7, 0x02, 0x59, 0x0D, 0x83, 0x2D,
-  0x26, 0x00, 0xF9, 0x26, 0x0A, 0x05, 0x01, 0xA4, 0x49, 0x60, 0x23, 0x22, 0x68, 0x53, 0x09, 0xB4, 0x13, 0xDA, 0x4F, 0x09, 0xFC, 0xB4, 0x7D, 0xD9, 0xB8, 0xDF,
-  0xD9, 0x41, 0x6D, 0x02, 0xC5, 0x15, 0xE3, 0xA8, 0xA0, 0x4E, 0x8B, 0x2D, 0x0E, 0xC6, 0x74, 0x5A, 0xCC, 0xA8, 0xB7, 0xB6, 0x3A, 0x08, 0xC8, 0x3B, 0x54, 0x00,
-  0x1D, 0x65, 0x95, 0x96, 0x9F, 0x66, 0x76, 0x76, 0x90, 0x9F, 0xA0, 0xB4, 0x62, 0x1C, 0x15, 0x54, 0x69, 0xB1, 0xA5, 0xCF, 0x98, 0x4A, 0xD5, 0xE7, 0x97, 0x9C,
-  0xC8, 0xAD, 0xA9, 0xB4, 0x4B, 0x05, 0xD0, 0x55, 0x56, 0x69, 0xF9, 0x59, 0x47, 0x67, 0x07, 0xBB, 0x77, 0x51, 0x5A, 0x31, 0x8E, 0x0A, 0xAA, 0xB4, 0xD8, 0x92,
-  0x5D, 0x4C, 0xA5, 0xEA, 0xF3, 0x49, 0x4E, 0xE4, 0xD6, 0x54, 0xDA, 0xA3, 0x02, 0xE8, 0x29, 0xAB, 0xB4, 0x7C, 0xA5, 0xA0, 0xB3, 0x83, 0x62, 0x10, 0x4A, 0x2B,
-  0xC6, 0x51, 0x41, 0x95, 0x16, 0x5B, 0x7D, 0x8E, 0xA9, 0x54, 0x7D, 0x9D, 0x83, 0x13, 0xB9, 0x35, 0x95, 0xF6, 0xA9, 0x00, 0xFA, 0xCA, 0x2A, 0x2D, 0xBF, 0xBF,
-  0xAA, 0xB3, 0x83, 0xBD, 0xDB, 0x28, 0xAD, 0x18, 0x47, 0x05, 0x55, 0x5A, 0xAC, 0x74, 0x1B, 0x53, 0xA9, 0xFA, 0xCA, 0x0D, 0x27, 0x72, 0x6B, 0x2A, 0x3D, 0xA2,
-  0x02, 0x38, 0x52, 0x56, 0x69, 0xF9, 0xAD, 0xEB, 0x9D, 0x1D, 0xD4, 0xF3, 0x50, 0x5A, 0x31, 0x8E, 0x0A, 0xAA, 0xB4, 0x58, 0x05, 0x27, 0xA6, 0x52, 0xF5, 0xBD,
-  0x53, 0x9C, 0xC8, 0xAD, 0xA9, 0xF4, 0x98, 0x0A, 0xE0, 0x58, 0x59, 0xA5, 0xE5, 0x77, 0xEE, 0x77, 0x76, 0xB0, 0x73, 0x1F, 0xA5, 0x15, 0xE3, 0xA8, 0xA0, 0x4A,
-  0x8B, 0xD5, 0x66, 0x63, 0x2A, 0x55, 0xDF, 0xEE, 0xC4, 0x89, 0xDC, 0x9A, 0x4A, 0x4F, 0xA8, 0x00, 0x4E, 0x94, 0x55, 0x5A, 0x7E, 0xCB, 0x40, 0x67, 0x07, 0x9B,
-  0x5F, 0x50, 0x5A, 0x2D, 0x91, 0xA3, 0x82, 0x2A, 0x2D, 0xB6, 0xC0, 0xD8, 0x49, 0xD9, 0xFA, 0xA2, 0xA0, 0xD2, 0xB4, 0x05, 0xC6, 0x07, 0x50, 0xBF, 0x33, 0x56,
-  0xC3, 0x12, 0x1F, 0xFC, 0x79, 0xF1, 0xD3, 0xCB, 0xF4, 0xC2, 0x7E, 0x6A, 0x15, 0x2F, 0xD6, 0xD7, 0x43, 0x2F, 0xE3, 0x89, 0xF2, 0x42, 0xC2, 0x41, 0xCB, 0xEC,
-  0x25, 0x91, 0xDA, 0x1A, 0xF3, 0xD9, 0x96, 0xC6, 0x80, 0x0B, 0x58, 0x5A, 0xA7, 0xDB, 0x92, 0x27, 0x2D, 0x39, 0x96, 0xC6, 0xA9, 0xDC, 0x4E, 0xF0, 0x40, 0xE4,
-  0x30, 0x17, 0x47, 0xDE, 0x3F, 0x28, 0xAD, 0xE9, 0x30, 0x80, 0x78, 0xF8, 0xE8, 0xB6, 0x4E, 0x14, 0xE3, 0x07, 0xC8, 0x20, 0x6D, 0x63, 0xFC, 0x06, 0x03, 0x08,
-  0xD2, 0xD8, 0x61, 0x4C, 0xBD, 0x51, 0x66, 0x2A, 0x59, 0x05, 0x28, 0xC4, 0x54, 0x5A, 0x65, 0x67, 0xC3, 0x4C, 0x75, 0x19, 0x53, 0x19, 0x4E, 0x9A, 0x60, 0x2A,
-  0x39, 0x0F, 0x2E, 0xC4, 0x54, 0xDA, 0x44, 0x38, 0x62, 0xEA, 0x21, 0x04, 0x3A, 0x32, 0x32, 0xA6, 0xA3, 0x12, 0xA1, 0xEE, 0xF2, 0xE2, 0xF0, 0xC5, 0x9B, 0x0B,
-  0x8D, 0x2E, 0x69, 0x3A, 0x56, 0xC1, 0x88, 0x17, 0xEF, 0xF4, 0x2F, 0x15, 0xF3, 0x28, 0xE9, 0x42, 0xD4, 0x7B, 0x73, 0xA1, 0x1A, 0xF0, 0x38, 0x64, 0x91, 0x90,
-  0xD7, 0x6B, 0x75, 0xCA, 0x54, 0x08, 0x43, 0x22, 0xB7, 0x14, 0xF4, 0x28, 0xFA, 0x76, 0x24, 0x83, 0xCB, 0x62, 0x32, 0x28, 0x54, 0x25, 0x8D, 0xCB, 0xA0, 0x40,
-  0xD8, 0x0F, 0x88, 0xDC, 0xA6, 0x0C, 0x30, 0x4A, 0x5E, 0x5E, 0x68, 0xEF, 0xFF, 0xA9, 0x5D, 0xDE, 0x2C, 0x1C, 0x6F, 0xE9, 0x92, 0xDC, 0xA8, 0xC2, 0xE1, 0xE2,
-  0x71, 0xA5, 0xDF, 0xEB, 0x75, 0x54, 0x03, 0x4B, 0x2F, 0x7D, 0x08, 0x98, 0xB4, 0x36, 0x18, 0x2F, 0x29, 0xA1, 0xDD, 0x90, 0xC1, 0x0F, 0x04, 0x34, 0xAD, 0x14,
-  0x37, 0x39, 0x60, 0x9C, 0x43, 0xBD, 0x85, 0xDB, 0xAB, 0x15, 0x19, 0x94, 0x67, 0x94, 0x9D, 0x8D, 0x0E, 0x07, 0x94, 0xCA, 0x5E, 0xC8, 0xDE, 0xA7, 0x8F, 0x57,
-  0x6A, 0x8C, 0x25, 0xEB, 0x68, 0xC5, 0x54, 0x97, 0xF6, 0xC8, 0x68, 0xC1, 0x41, 0x41, 0xDE, 0xE8, 0xEC, 0x10, 0x62, 0xEC, 0xBA, 0x6C, 0x52, 0x44, 0x76, 0x36,
-  0x31, 0xA7, 0x60, 0xB0, 0x72, 0x59, 0x52, 0x19, 0xB2, 0xB7, 0x9A, 0xE2, 0x17, 0x48, 0x9B, 0x23, 0x08, 0xF3, 0xA0, 0x7B, 0xF4, 0xAE, 0x40, 0xB2, 0x73, 0x63,
-  0x4A, 0xA2, 0xEB, 0x1A, 0x0B, 0xE2, 0x59, 0xC1, 0xD9, 0x60, 0x08, 0x8D, 0x6B, 0xC2, 0x3F, 0x97, 0xAA, 0xCD, 0x5C, 0x32, 0x39, 0xAF, 0x7D, 0x13, 0xE2, 0xE4,
-  0x8F, 0xDF, 0x61, 0x93, 0x9A, 0x36, 0x76, 0x56, 0xB6, 0xE5, 0x18, 0x18, 0xF8, 0x8D, 0x85, 0x0F, 0x94, 0x1E, 0xFC, 0xB1, 0xC0, 0x37, 0x5C, 0x19, 0xF8, 0xB4,
-  0x96, 0x91, 0xD1, 0x8F, 0xA0, 0xFE, 0x91, 0xE5, 0x78, 0xC1, 0xB4, 0x0D, 0x0F, 0xC3, 0xCF, 0xAB, 0xFE, 0xCF, 0x7F, 0xE7, 0x6D, 0x15, 0x30, 0xE7, 0x53, 0x41,
-  0x00, 0x35, 0xCD, 0x73, 0x47, 0xE7, 0x35, 0xA0, 0xD4, 0x75, 0x3C, 0xCF, 0x71, 0xCD, 0xA9, 0x99, 0x32, 0x36, 0xA7, 0x49, 0xFB, 0x50, 0x26, 0xEE, 0x44, 0x63,
-  0xC9, 0xB0, 0x7F, 0xE6, 0x8D, 0x5C, 0x73, 0xE1, 0x0F, 0x1E, 0x8D, 0x9D, 0xD1, 0x72, 0x4E, 0x6C, 0xFF, 0xC0, 0x18, 0x8F, 0x2F, 0xAF, 0xE1, 0xE0, 0x3B, 0xFC,
-  0x16, 0x1F, 0x48, 0xBE, 0x51, 0x7F, 0xF5, 0xAF, 0x77, 0x38, 0x0C, 0xE3, 0x35, 0x90, 0x17, 0x19, 0xD7, 0xF7, 0xB5, 0xC9, 0xD2, 0x66, 0x23, 0x61, 0x83, 0x60,
-  0xDB, 0x3D, 0xED, 0x2B, 0x60, 0xBC, 0x36, 0x5C, 0x6D, 0x68, 0x78, 0xE4, 0xAD, 0xE3, 0xF9, 0xDA, 0xB9, 0x16, 0x62, 0xB4, 0x9C, 0x11, 0xDD, 0xB7, 0x71, 0xC0,
-  0xF8, 0xE2, 0x2D, 0x19, 0xE3, 0x3F, 0xBA, 0x16, 0x34, 0x0D, 0xA1, 0x9E, 0x6A, 0xF5, 0xD3, 0x63, 0xBD, 0x8E, 0xF6, 0x17, 0x76, 0x31, 0x21, 0x10, 0xE6, 0xA1,
-  0x5D, 0x63, 0xE9, 0x5A, 0xFB, 0xDA, 0x68, 0xB8, 0xF7, 0x95, 0x52, 0x4F, 0x2F, 0xE3, 0xB5, 0x3D, 0xCE, 0xCC, 0x81, 0x3F, 0x23, 0x76, 0x23, 0xA2, 0xCC, 0x25,
-  0xDE, 0xC2, 0xB1, 0x3D, 0xC2, 0x88, 0x63, 0x3F, 0x73, 0x12, 0x5D, 0x3F, 0xF0, 0x7C, 0xC3, 0x5F, 0x7A, 0xDA, 0xE3, 0xF3, 0x73, 0xAD, 0xDD, 0x6A, 0x89, 0xCD,
-  0x34, 0xE8, 0x26, 0xD9, 0x6E, 0x5F, 0x4B, 0x5C, 0xF8, 0x48, 0x6E, 0xFC, 0xBD, 0x67, 0x21, 0xCC, 0x9D, 0x46, 0x2C, 0x8F, 0xC4, 0x90, 0x84, 0x00, 0xF8, 0xDE,
-  0xB8, 0xC6, 0x5E, 0x9C, 0xC0, 0xC6, 0xD8, 0xF0, 0x8D, 0xBD, 0xAF, 0x31, 0x7D, 0x41, 0xAF, 0x40, 0xC9, 0xBE, 0x46, 0x6F, 0x3D, 0x13, 0x6E, 0xDD, 0xED, 0x1D,
-  0x80, 0x0C, 0x81, 0xDF, 0x10, 0x9A, 0xB8, 0x6E, 0x9C, 0x62, 0x0A, 0xDD, 0xD4, 0xF7, 0x35, 0xBC, 0x13, 0x87, 0x15, 0x88, 0x7C, 0x14, 0x5C, 0x0B, 0x84, 0x96,
-  0x8D, 0x56, 0x82, 0x92, 0xA1, 0xBB, 0x8B, 0xA9, 0x08, 0x02, 0xCE, 0x07, 0x32, 0x05, 0x89, 0x4D, 0xF7, 0x79, 0xFC, 0xD9, 0xA7, 0xC1, 0x67, 0x9F, 0xC5, 0x2D,
-  0x41, 0x6B, 0x87, 0x87, 0xE0, 0xD2, 0x9E, 0x63, 0x11, 0xB0, 0x8A, 0x69, 0xA3, 0xCE, 0xBF, 0xF5, 0x0A, 0x16, 0x55, 0x6F, 0xDD, 0xD4, 0x9F, 0x02, 0x82, 0x03,
-  0xDF, 0xB9, 0xF2, 0x5D, 0xD3, 0x9E, 0x36, 0xF4, 0xFE, 0x5E, 0x84, 0x8D, 0xDE, 0x46, 0x94, 0x89, 0xFB, 0xF4, 0x3A, 0xED, 0x24, 0x79, 0xA3, 0xC1, 0xAF, 0x3F,
-  0xAD, 0xEF, 0xD5, 0x39, 0xF1, 0xF4, 0x1C, 0xCC, 0xAD, 0xC1, 0x0E, 0x9E, 0x50, 0x1A, 0xF7, 0xB4, 0xB3, 0x33, 0xDE, 0x0D, 0x6B, 0x85, 0x17, 0xA1, 0x11, 0xFD,
-  0x93, 0xB8, 0x15, 0x9A, 0xE2, 0xEF, 0xFF, 0xF8, 0x1A, 0xD8, 0xEC, 0xDD, 0x21, 0x50, 0xFD, 0x1C, 0x43, 0xF0, 0x3F, 0xBE, 0xC2, 0xFF, 0x77, 0x4F, 0x68, 0xD4,
-  0xFD, 0xC7, 0x57, 0xFC, 0x73, 0xF7, 0x04, 0x7A, 0x82, 0x63, 0xDA, 0xDF, 0xDD, 0xEF, 0x54, 0x0E, 0xEB, 0xD2, 0x9B, 0xA6, 0x4A, 0x2F, 0x14, 0x5B, 0x61, 0x9A,
-  0xA6, 0x19, 0x44, 0xFD, 0x1E, 0xF9, 0x6F, 0x63, 0xE4, 0x8C, 0x41, 0x3D, 0x3E, 0x58, 0x72, 0xA0, 0x74, 0x0B, 0x54, 0x12, 0x08, 0xAA, 0x15, 0x28, 0xDD, 0x9C,
-  0xD0, 0x96, 0x1A, 0x77, 0x95, 0xC8, 0x40, 0x82, 0x96, 0x0B, 0xC3, 0xF5, 0xC8, 0xB7, 0xB6, 0xDF, 0xF0, 0x63, 0x4E, 0x91, 0x22, 0xF1, 0xC1, 0x20, 0xC6, 0x02,
-  0xFE, 0x00, 0x0E, 0xDA, 0xD5, 0xB9, 0xD2, 0x42, 0x63, 0xE3, 0x7F, 0x13, 0x66, 0xF3, 0xA6, 0x90, 0xD9, 0x34, 0xA8, 0xD8, 0xC2, 0x3E, 0xF7, 0x8A, 0x98, 0x10,
-  0x90, 0x25, 0x18, 0x10, 0x75, 0x88, 0x48, 0x64, 0xEC, 0x62, 0x8A, 0x43, 0xFC, 0x3C, 0xB2, 0xBE, 0x34, 0x6E, 0xE0, 0xBF, 0x64, 0xCC, 0x5A, 0xD3, 0x15, 0x36,
-  0x7A, 0x8E, 0xFF, 0x81, 0x82, 0xF0, 0x4F, 0xAA, 0xA1, 0x00, 0xD6, 0xF7, 0x96, 0xD5, 0x60, 0x1F, 0x98, 0x03, 0x1B, 0x59, 0x42, 0x3C, 0xF4, 0x6E, 0x31, 0x32,
-  0x39, 0x8E, 0xFF, 0x79, 0x5F, 0x5B, 0xB8, 0x40, 0x18, 0xFD, 0x96, 0x0A, 0x1C, 0x03, 0x22, 0x62, 0xB3, 0xBF, 0xB9, 0x14, 0x2C, 0x2C, 0xEB, 0x39, 0xC3, 0x0A,
-  0x24, 0xB0, 0x03, 0x30, 0x99, 0x25, 0x9A, 0x2E, 0xFC, 0x7F, 0xF7, 0x04, 0x3A, 0x81, 0x43, 0xF8, 0xFF, 0xEE, 0x09, 0x76, 0x85, 0x46, 0x85, 0x3D, 0xDE, 0x3D,
-  0x81, 0x1E, 0xE1, 0x04, 0xFE, 0x87, 0x36, 0xD8, 0x2F, 0xB6, 0xC2, 0xBF, 0x70, 0x87, 0xF6, 0x8F, 0x37, 0xE9, 0x01, 0xBB, 0xC0, 0x4F, 0xB3, 0x18, 0x64, 0x6F,
-  0xD7, 0x6F, 0xD0, 0xB7, 0x9D, 0x7F, 0xBE, 0x01, 0x76, 0xE8, 0xC1, 0x2D, 0xC4, 0x20, 0x7B, 0x8C, 0xE7, 0xF8, 0xE7, 0x36, 0x50, 0x30, 0x5E, 0xE0, 0x47, 0x70,
-  0x8D, 0xBE, 0x11, 0x16, 0x2F, 0xB1, 0x03, 0x6C, 0x45, 0xDF, 0xDF, 0x49, 0x5B, 0xB1, 0x23, 0xB8, 0xC6, 0xDF, 0xFA, 0xB8, 0xAF, 0xF1, 0xF7, 0x0A, 0xE6, 0x0A,
-  0x27, 0x7A, 0xEF, 0xDF, 0x73, 0xEF, 0x06, 0x19, 0x64, 0xA4, 0xA1, 0x54, 0xC2, 0xB3, 0xDB, 0xBB, 0x27, 0x04, 0xEF, 0x51, 0x22, 0xE1, 0xF8, 0x96, 0x1F, 0xC3,
-  0x75, 0xA0, 0x0F, 0xEF, 0x04, 0x04, 0xD3, 0x0B, 0xB7, 0xD1, 0x05, 0x68, 0xE1, 0xE3, 0x7D, 0x4E, 0x3C, 0x9C, 0xDD, 0x86, 0x67, 0x08, 0x4D, 0x61, 0x39, 0x1B,
-  0x70, 0x7A, 0x1B, 0x9D, 0xC2, 0x5D, 0xE4, 0x05, 0x15, 0xC0, 0x79, 0xBA, 0x7B, 0xC2, 0x79, 0x42, 0x2D, 0xB2, 0xA3, 0xB8, 0xA8, 0xE1, 0x7F, 0xF4, 0x23, 0x9F,
-  0x07, 0xEC, 0x4F, 0x81, 0x77, 0x12, 0x6B, 0x4F, 0x3B, 0x1F, 0xF0, 0xB8, 0x8F, 0x01, 0x00, 0x3C, 0x0A, 0xAE, 0x13, 0xEB, 0xC0, 0xF0, 0xC1, 0x21, 0x20, 0x6F,
-  0x22, 0xDE, 0x01, 0x46, 0x94, 0xD0, 0xCD, 0xD7, 0x6E, 0x1D, 0xD8, 0xE0, 0x16, 0x14, 0xE1, 0xDE, 0x29, 0x0F, 0x1B, 0x88, 0x88, 0x71, 0xB9, 0x86, 0x8B, 0x5D,
-  0x4E, 0x43, 0xC7, 0xEE, 0xA6, 0x60, 0xE4, 0xA1, 0x30, 0x0E, 0x81, 0x17, 0xD3, 0xB0, 0xD1, 0x51, 0x43, 0xC0, 0xD5, 0xEE, 0xF5, 0x22, 0x6C, 0x89, 0x48, 0xC7,
-  0xE6, 0x94, 0x28, 0x90, 0x03, 0xCC, 0xCF, 0xA3, 0xA1, 0x70, 0x04, 0xE6, 0xA0, 0xD5, 0x83, 0x09, 0x65, 0xFD, 0x74, 0x2D, 0xC2, 0x01, 0x04, 0x2F, 0x20, 0x68,
-  0xCF, 0x19, 0x8D, 0xA7, 0x51, 0xF8, 0xD4, 0xB4, 0x21, 0x24, 0x3B, 0x5F, 0x9E, 0xC5, 0x90, 0xD1, 0xD4, 0x3F, 0xC4, 0xC4, 0xAE, 0x61, 0xA2, 0x90, 0xB8, 0xC4,
-  0xB6, 0xDB, 0x35, 0x1D, 0x9B, 0xC8, 0x7B, 0x8D, 0xC5, 0x4B, 0xDE, 0x11, 0x3F, 0x1B, 0x93, 0x89, 0xB1, 0xB4, 0xFC, 0x08, 0xCC, 0x25, 0x90, 0xE8, 0xDA, 0x3C,
-  0x6C, 0xB1, 0x24, 0x3F, 0x77, 0xE8, 0xCE, 0x18, 0x2A, 0x82, 0x51, 0xE1, 0x71, 0x72, 0x54, 0x00, 0xAB, 0x74, 0xFD, 0x46, 0xFD, 0xD2, 0x75, 0x1D, 0xF7, 0xD7,
-  0xFA, 0x53, 0x6C, 0xF4, 0xB4, 0xFE, 0xDB, 0xA9, 0x46, 0xE3, 0xE9, 0x5E, 0x3C, 0xB8, 0x0B, 0xE1, 0xF3, 0xF0, 0x50, 0x7B, 0xE1, 0xFB, 0x06, 0x28, 0x00, 0x6B,
-  0x2C, 0x33, 0x94, 0x8F, 0x66, 0xF0, 0x24, 0xD0, 0x71, 0xD1, 0x28, 0xD9, 0xF7, 0xEE, 0x41, 0x22, 0x98, 0x58, 0x7A, 0x00, 0x12, 0x24, 0x99, 0x14, 0xD5, 0xC1,
-  0xBF, 0x97, 0xC4, 0xBD, 0xBD, 0xA2, 0x02, 0x73, 0xDC, 0x17, 0x10, 0x2A, 0xEB, 0x07, 0xD1, 0x3C, 0xA9, 0xCE, 0x72, 0x9E, 0x03, 0x40, 0x75, 0x09, 0x7D, 0x80,
-  0x8E, 0x23, 0x9B, 0x67, 0xDC, 0x84, 0x7A, 0x87, 0x71, 0xEE, 0x9C, 0x2B, 0x23, 0x99, 0x64, 0x41, 0x0B, 0xC7, 0xFE, 0x42, 0x6E, 0x97, 0x0B, 0x10, 0x7F, 0x94,
-  0x36, 0x25, 0x12, 0x39, 0x2E, 0x1D, 0x72, 0x00, 0x2D, 0x2F, 0xF8, 0xC0, 0xA9, 0x77, 0x24, 0x8D, 0x22, 0x15, 0x50, 0xEB, 0x44, 0x4F, 0x7C, 0xB6, 0xD6, 0xE8,
-  0xEE, 0x91, 0xFC, 0x4C, 0x92, 0x72, 0x72, 0x02, 0xB9, 0xF0, 0xC0, 0xB5, 0xA9, 0x63, 0x27, 0x7A, 0x48, 0xA4, 0x83, 0x90, 0x0C, 0x46, 0x91, 0x61, 0xB9, 0x80,
-  0xE4, 0x93, 0xC4, 0x83, 0x43, 0x68, 0x0B, 0xC1, 0xCD, 0xB9, 0xE3, 0x93, 0x44, 0xC4, 0x30, 0x6D, 0xD3, 0x37, 0x0D, 0xEB, 0x53, 0x64, 0x8D, 0x5B, 0x75, 0x7F,
-  0x89, 0x8F, 0x17, 0xF0, 0xFF, 0xB5, 0x9C, 0x4F, 0x2D, 0x4F, 0x59, 0xB3, 0x90, 0x30, 0x1E, 0x44, 0x56, 0x22, 0xCA, 0x21, 0x16, 0x16, 0xF8, 0xFD, 0xA0, 0xA7,
-  0xC7, 0x8F, 0xE9, 0xD1, 0xA3, 0x50, 0x69, 0x41, 0xF4, 0x38, 0xD7, 0xA2, 0x1B, 0x09, 0x05, 0xAF, 0xE3, 0x4E, 0xE0, 0x08, 0x90, 0x0B, 0x18, 0x12, 0x81, 0x7F,
-  0x01, 0xE9, 0x0D, 0xDA, 0xC2, 0xFF, 0x47, 0xFD, 0x07, 0x14, 0xF5, 0xB7, 0x17, 0xE2, 0x33, 0x6C, 0x3B, 0xE1, 0x01, 0x0C, 0x4E, 0x9E, 0x4F, 0x3F, 0x85, 0x44,
-  0x5B, 0x9E, 0x24, 0x87, 0xA1, 0x3B, 0x9C, 0xEC, 0xC3, 0x64, 0xE6, 0x92, 0x85, 0xE7, 0x97, 0xB7, 0xDF, 0x8E, 0x1B, 0xF5, 0xF0, 0x8D, 0x46, 0xF5, 0x3D, 0x8C,
-  0x4B, 0x96, 0x39, 0xFA, 0x12, 0x86, 0xA5, 0xC8, 0xF2, 0x20, 0xA5, 0xC1, 0xEC, 0x1F, 0x27, 0xD6, 0xE6, 0x88, 0x9B, 0xEA, 0xAB, 0x0F, 0x2F, 0xDE, 0x7D, 0x7E,
-  0xF1, 0xF1, 0xE3, 0x07, 0x6D, 0x09, 0x36, 0xAB, 0xF7, 0x3F, 0x63, 0xDA, 0x02, 0x93, 0x00, 0xF7, 0x33, 0xD0, 0xE7, 0x7D, 0xA6, 0x48, 0x5B, 0xBF, 0xFE, 0xF6,
-  0x6B, 0xFB, 0x37, 0x00, 0xFD, 0xFA, 0x5F, 0x76, 0x9D, 0x31, 0x82, 0xA8, 0x9E, 0x02, 0x2E, 0x3C, 0xFE, 0x5A, 0x7F, 0x1A, 0x18, 0x7C, 0x23, 0x9D, 0xC2, 0xF0,
-  0xF5, 0xBA, 0xF5, 0x3D, 0x60, 0xF5, 0x6E, 0x1F, 0x50, 0xB1, 0x74, 0x10, 0xC6, 0x9C, 0x06, 0x96, 0x2A, 0x4C, 0xE8, 0x40, 0x7F, 0x06, 0x7F, 0xCE, 0x34, 0xFD,
-  0x08, 0xFE, 0x3E, 0x7D, 0x1A, 0x99, 0x48, 0xC9, 0xEE, 0xEA, 0x4F, 0x4D, 0xDA, 0x19, 0xCC, 0x4E, 0x1A, 0xE6, 0x19, 0x48, 0xF2, 0x79, 0x7D, 0xBF, 0x7E, 0x5A,
-  0xAF, 0xC3, 0xB5, 0xA0, 0xFB, 0xBB, 0x18, 0x3B, 0x77, 0xCF, 0x42, 0x0E, 0xD9, 0xE8, 0x0A, 0x37, 0x22, 0xF1, 0x8B, 0x59, 0xDD, 0x4B, 0x56, 0xE5, 0x3A, 0x4F,
-  0xD7, 0x09, 0x7B, 0x9B, 0xF5, 0x94, 0x0E, 0x88, 0x22, 0x4C, 0x86, 0x82, 0x58, 0x68, 0x08, 0x7D, 0x2D, 0x15, 0x35, 0x1D, 0x6E, 0xC7, 0x63, 0x17, 0xB4, 0x4D,
-  0xAD, 0x65, 0x6F, 0xCD, 0x85, 0xD5, 0x70, 0x60, 0x63, 0x09, 0x8E, 0xB5, 0xE9, 0x66, 0x26, 0x12, 0xDA, 0x5A, 0xC0, 0xB2, 0x96, 0xF0, 0xB4, 0xEE, 0x2F, 0xD7,
-  0x61, 0x1A, 0x9B, 0x2A, 0x6A, 0x6C, 0x2A, 0x68, 0x6C, 0xBA, 0x59, 0x8D, 0x71, 0xD4, 0x95, 0xB5, 0x16, 0xE0, 0xC9, 0xD1, 0x5C, 0x2E, 0x3C, 0x57, 0x1A, 0xD7,
-  0xD6, 0x54, 0xA6, 0xAD, 0x32, 0x6A, 0x62, 0xB1, 0x0B, 0x26, 0x45, 0xC4, 0x7D, 0xFB, 0xF1, 0xDD, 0x77, 0x18, 0x6D, 0xE4, 0x2A, 0x0B, 0x35, 0x96, 0x4C, 0xAE,
-  0x24, 0x18, 0x30, 0x28, 0xC6, 0x2A, 0x1F, 0x89, 0xB0, 0xA9, 0x45, 0x15, 0x84, 0x1C, 0x43, 0xE0, 0x05, 0x03, 0x35, 0xDF, 0xC5, 0x22, 0x41, 0xE0, 0xBC, 0x11,
-  0x54, 0x86, 0x2D, 0x20, 0x80, 0x92, 0x12, 0x19, 0xE6, 0x35, 0x87, 0x11, 0x6A, 0x19, 0x3B, 0x77, 0x11, 0xEA, 0xAF, 0x9E, 0x6A, 0x50, 0x0B, 0xA6, 0xEA, 0x51,
-  0x6C, 0xF3, 0x72, 0xA5, 0xC3, 0x27, 0xF4, 0x4A, 0x02, 0xE2, 0x5F, 0x95, 0x93, 0x18, 0x38, 0x2F, 0x04, 0x14, 0xC0, 0x72, 0x2B, 0xC1, 0x42, 0x0B, 0x08, 0x4A,
-  0x38, 0xE8, 0x97, 0xC8, 0x52, 0x30, 0xA8, 0x51, 0x41, 0x3F, 0xFD, 0x25, 0xC1, 0x10, 0x94, 0x2A, 0x94, 0x90, 0x04, 0x9F, 0xAD, 0x4A, 0xC7, 0xA3, 0x46, 0x4C,
-  0xF0, 0xB1, 0x28, 0x09, 0x1E, 0x5E, 0x1A, 0x51, 0x42, 0xC3, 0x3F, 0x74, 0x94, 0x8A, 0x45, 0x8D, 0x18, 0xFE, 0x6D, 0x21, 0x19, 0x4F, 0xBC, 0x14, 0xA3, 0xC6,
-  0x13, 0xFF, 0x24, 0x4E, 0x3A, 0x1E, 0x45, 0xD9, 0xF0, 0xCF, 0xD0, 0xC8, 0xAC, 0x8E, 0x55, 0x7E, 0x32, 0x1D, 0x83, 0x35, 0x01, 0x60, 0x9E, 0xAA, 0x3E, 0xD7,
-  0xC5, 0xCC, 0x9A, 0x17, 0x8A, 0xB2, 0x30, 0xF0, 0x26, 0x49, 0x0C, 0x41, 0x74, 0xB8, 0x87, 0x92, 0xDD, 0x7D, 0x44, 0xA1, 0xF7, 0x96, 0xA5, 0x16, 0x85, 0x16,
-  0x96, 0x15, 0x84, 0x9F, 0x10, 0x26, 0x25, 0xFC, 0xD0, 0x25, 0x33, 0x5A, 0x6F, 0xCD, 0x94, 0x3F, 0x6D, 0xC1, 0xF0, 0xAE, 0x2B, 0x11, 0x71, 0xCC, 0x97, 0x96,
-  0x92, 0x25, 0x41, 0x3B, 0x8E, 0x46, 0x34, 0x24, 0xBA, 0x1C, 0x77, 0xEB, 0xA9, 0x85, 0xAE, 0x5B, 0x2F, 0x05, 0x03, 0x2D, 0x09, 0xAB, 0xE5, 0x66, 0xD0, 0x32,
-  0x05, 0xC9, 0xC2, 0x55, 0x4B, 0xEF, 0xA0, 0x5D, 0x1A, 0x23, 0x58, 0x7F, 0x56, 0x63, 0x25, 0xF8, 0xEA, 0xB8, 0x8C, 0x0E, 0x5A, 0xB5, 0xCE, 0x52, 0x0A, 0xFF,
-  0xBA, 0x73, 0x9A, 0x46, 0x16, 0xAA, 0x43, 0x6E, 0xF0, 0xFD, 0x63, 0xC9, 0xB0, 0x5B, 0xB2, 0xD8, 0xBF, 0x7B, 0xE7, 0x30, 0xAE, 0x89, 0x82, 0x6B, 0x84, 0x2B,
-  0xF3, 0x3C, 0xBB, 0x8B, 0xC0, 0x32, 0xBC, 0x63, 0x64, 0xD8, 0xD7, 0x46, 0xCC, 0x3B, 0x46, 0x30, 0xFD, 0xF5, 0x09, 0x47, 0xDD, 0xA8, 0xB1, 0x06, 0x35, 0x4E,
-  0x23, 0x3B, 0x3B, 0xA0, 0x5B, 0xD6, 0xB0, 0x10, 0x62, 0x92, 0x15, 0x3B, 0x89, 0xDD, 0x9E, 0x11, 0xFA, 0x9A, 0x10, 0x7E, 0x9F, 0x9D, 0xB1, 0x06, 0x61, 0x2F,
-  0x43, 0x67, 0x7C, 0x7B, 0x60, 0x2C, 0x16, 0x10, 0xBC, 0x2E, 0x66, 0xA6, 0x35, 0x6E, 0x30, 0x50, 0xC1, 0x44, 0x70, 0x6F, 0x02, 0xA1, 0xAB, 0x56, 0x1C, 0x2B,
-  0x30, 0x7C, 0xC1, 0xAE, 0x35, 0xEA, 0xED, 0x71, 0xB0, 0x66, 0xC4, 0x9B, 0x1D, 0x8C, 0x5D, 0x63, 0xF5, 0x2D, 0x6E, 0x6A, 0x68, 0x60, 0xA7, 0xFB, 0xAD, 0xFD,
-  0x16, 0x6F, 0xE0, 0xBB, 0xB7, 0x61, 0x96, 0x89, 0x78, 0x71, 0xF1, 0xF7, 0xC7, 0x0F, 0xDF, 0x45, 0x78, 0x7D, 0xE7, 0x15, 0xBB, 0xD4, 0xA8, 0xD3, 0x5D, 0x11,
-  0x87, 0x7F, 0x2C, 0x70, 0x2A, 0x10, 0x28, 0x45, 0x10, 0x23, 0x6E, 0x78, 0x40, 0x51, 0xB1, 0xE6, 0xCF, 0x44, 0xA4, 0x70, 0xD9, 0x26, 0x2B, 0x0D, 0x30, 0x91,
-  0x86, 0x0C, 0x34, 0xD8, 0x0E, 0x81, 0xE0, 0xC8, 0xC9, 0xEB, 0xA5, 0x65, 0xFD, 0x42, 0x0C, 0x17, 0xF4, 0xF1, 0x54, 0x6B, 0xD4, 0x5A, 0xB5, 0xA7, 0x0D, 0x7A,
-  0xFD, 0x1D, 0xB0, 0x33, 0x6B, 0xEC, 0x3D, 0xD5, 0xF7, 0xF6, 0x0E, 0x3C, 0xD0, 0x19, 0x69, 0x34, 0xDB, 0x41, 0x13, 0xF8, 0x43, 0xDB, 0xB0, 0x4E, 0xD2, 0xEF,
-  0xBF, 0x75, 0x96, 0xAE, 0x97, 0xD5, 0xE0, 0x9D, 0x69, 0x63, 0x11, 0x27, 0xAB, 0xC9, 0x15, 0x01, 0xC1, 0x8E, 0xD7, 0x9A, 0xD4, 0xE8, 0x2E, 0x0E, 0x5E, 0xFE,
-  0xD0, 0xE8, 0xE2, 0xB6, 0xD6, 0x10, 0x2B, 0x3A, 0x7C, 0x19, 0x91, 0xA0, 0xA1, 0x37, 0x02, 0x8F, 0xBF, 0x13, 0x8D, 0x03, 0x5C, 0x16, 0x0C, 0xE0, 0x7B, 0xF0,
-  0x80, 0x03, 0x97, 0xCC, 0x9D, 0x6B, 0xB2, 0xA6, 0x7F, 0x6C, 0x1E, 0x1A, 0xFF, 0xCC, 0x1C, 0xB3, 0x32, 0x4D, 0x64, 0xB7, 0x58, 0x15, 0xC2, 0x0D, 0x22, 0xB8,
-  0x85, 0x02, 0xF7, 0x53, 0x34, 0xEA, 0x6C, 0xF7, 0x0A, 0x1D, 0x15, 0xEE, 0x22, 0xB7, 0x99, 0x39, 0xAB, 0x2C, 0x48, 0xD6, 0x7B, 0x02, 0x38, 0x84, 0x1E, 0x9B,
-  0x9E, 0x31, 0xB4, 0xF2, 0xBB, 0xE6, 0xED, 0xC6, 0xBC, 0xFC, 0x0D, 0x0D, 0x82, 0x2B, 0x00, 0xEA, 0xBB, 0xB4, 0x4E, 0x28, 0xA0, 0x25, 0x76, 0x1E, 0xD6, 0x80,
-  0xAC, 0x4C, 0xC4, 0x13, 0x03, 0x26, 0x4F, 0x71, 0xCC, 0xAC, 0x78, 0x5C, 0xA0, 0xAC, 0x2C, 0x5E, 0x06, 0x88, 0xF8, 0x29, 0x98, 0x33, 0x58, 0xA8, 0xF6, 0x9C,
-  0xB2, 0xA0, 0x9D, 0xC6, 0xEE, 0x86, 0xB9, 0x8D, 0x58, 0x30, 0x7D, 0xC4, 0xE2, 0xDF, 0x5F, 0xB0, 0x82, 0x1B, 0x52, 0x1E, 0x93, 0xC0, 0x93, 0x27, 0x71, 0x6C,
-  0xB8, 0x8D, 0x85, 0x0D, 0x20, 0x61, 0x6F, 0xAC, 0x3D, 0x7B, 0x7D, 0x78, 0xB4, 0xB2, 0xC0, 0x49, 0x82, 0xA1, 0xE0, 0x71, 0x4C, 0xF0, 0xC2, 0x18, 0x01, 0x84,
-  0x98, 0x63, 0x2A, 0x20, 0xDC, 0x95, 0x56, 0x5B, 0x5B, 0xEF, 0x7F, 0x4E, 0xAD, 0xBE, 0x41, 0xF8, 0xA6, 0xC4, 0x3D, 0x90, 0x3F, 0x1A, 0x73, 0x74, 0x21, 0x3E,
-  0x87, 0x4E, 0x60, 0x9C, 0xC6, 0x30, 0x22, 0x63, 0x09, 0xBA, 0xF1, 0x77, 0x78, 0x48, 0x31, 0x4E, 0x0D, 0xD3, 0xBE, 0x20, 0x26, 0xA6, 0x7F, 0x7B, 0xC2, 0x5D,
-  0xDA, 0x3D, 0x20, 0xC2, 0x0D, 0x83, 0xC2, 0x72, 0xC6, 0xFA, 0x7A, 0xC8, 0xE1, 0x21, 0x6D, 0x9A, 0x82, 0x86, 0x76, 0xB1, 0x8E, 0x26, 0x93, 0xFA, 0xD5, 0xF0,
-  0x33, 0x62, 0x93, 0x09, 0x85, 0xA2, 0x5B, 0x0D, 0x51, 0x1C, 0xB4, 0x57, 0x38, 0xCC, 0x42, 0x35, 0x31, 0x46, 0xE4, 0xB3, 0x0B, 0x71, 0x6C, 0x6A, 0x9B, 0x7F,
-  0x12, 0x19, 0x42, 0xE6, 0x8C, 0x0D, 0x62, 0xBB, 0x4E, 0x90, 0x48, 0x22, 0x72, 0xEE, 0x67, 0xF1, 0xEB, 0xF1, 0x21, 0x3A, 0x70, 0xBD, 0x70, 0x69, 0x5D, 0xB4,
-  0x05, 0x56, 0xFA, 0x8F, 0x26, 0xC0, 0x91, 0xB1, 0x6D, 0xA8, 0x12, 0xAE, 0x63, 0x19, 0x3C, 0x6C, 0x22, 0xD6, 0xAB, 0x2B, 0x16, 0xC1, 0x33, 0x70, 0xB2, 0xCD,
-  0x7D, 0x49, 0xA4, 0xCB, 0xE1, 0xDC, 0xF4, 0x25, 0x08, 0xEB, 0x7A, 0x5D, 0x8A, 0x2B, 0xA5, 0x9E, 0x2E, 0x7A, 0x22, 0x8B, 0x66, 0x74, 0xA9, 0x11, 0x10, 0xC5,
-  0xB6, 0x0A, 0x8C, 0xD8, 0x6E, 0xF5, 0xE7, 0x30, 0xE2, 0xE2, 0x06, 0x00, 0x54, 0x75, 0x62, 0x0B, 0x10, 0x43, 0xC1, 0xF6, 0xAE, 0x51, 0x14, 0xF1, 0xDD, 0x6B,
-  0xC1, 0x8E, 0xB1, 0xF8, 0xCA, 0xA4, 0xB8, 0xF7, 0xE5, 0x77, 0x97, 0x00, 0x9C, 0x87, 0xF3, 0x59, 0xED, 0x1F, 0x5F, 0x29, 0x8A, 0x3B, 0x6D, 0x02, 0x91, 0xC0,
-  0x9B, 0x91, 0x31, 0x9D, 0x7B, 0xF9, 0x4B, 0xEF, 0x54, 0xC3, 0x6D, 0x3F, 0xB1, 0xDD, 0x6A, 0x77, 0xBF, 0x87, 0x16, 0x12, 0x0E, 0x24, 0xD1, 0x7A, 0x2B, 0x67,
-  0x7B, 0x6D, 0xDD, 0xF5, 0x91, 0xC2, 0x0A, 0x2B, 0x87, 0x55, 0x5A, 0x65, 0x95, 0x2D, 0x4E, 0x26, 0xA3, 0x14, 0xCF, 0x31, 0x1F, 0xA9, 0xF4, 0x4D, 0x77, 0x5D,
-  0xAA, 0x74, 0x29, 0xC9, 0x2E, 0xF1, 0xC7, 0xC2, 0x98, 0x25, 0x8C, 0xF9, 0x09, 0x3F, 0xDA, 0xE3, 0x72, 0x02, 0x13, 0x19, 0x07, 0xF1, 0x96, 0x19, 0x11, 0xAE,
-  0x3E, 0x33, 0x3D, 0xC6, 0x4C, 0x80, 0x49, 0x9B, 0x0B, 0x3B, 0x7F, 0x4B, 0x22, 0x5F, 0x76, 0x09, 0x95, 0xF5, 0x87, 0x07, 0x79, 0x7B, 0x28, 0x02, 0x19, 0x0E,
-  0xEC, 0x40, 0x40, 0x10, 0x13, 0x51, 0x21, 0x15, 0x65, 0xC8, 0x8C, 0xFD, 0x84, 0x01, 0x9B, 0x8E, 0xD6, 0xB4, 0xE7, 0x5F, 0xA9, 0x55, 0xFF, 0xB6, 0xCF, 0x46,
-  0x78, 0x21, 0x68, 0xEE, 0x15, 0x21, 0x68, 0x6D, 0x55, 0x3E, 0x97, 0x98, 0x8D, 0xAD, 0x4F, 0x06, 0x3F, 0x88, 0xC5, 0x14, 0xDF, 0xB9, 0xD6, 0x5A, 0x5B, 0x97,
-  0x17, 0x17, 0xD1, 0x42, 0x06, 0x25, 0xB2, 0x11, 0x16, 0xD5, 0x03, 0xF1, 0x48, 0x17, 0xD0, 0x52, 0xC5, 0xC5, 0xEC, 0x8B, 0x45, 0x14, 0x9C, 0x16, 0x64, 0xCE,
-  0x9F, 0xE8, 0x86, 0x59, 0x2A, 0xAF, 0x08, 0xE0, 0x22, 0xDC, 0x20, 0x9D, 0x0B, 0x19, 0x6D, 0xA6, 0x16, 0x70, 0xD0, 0xF9, 0x98, 0xDA, 0xFA, 0x03, 0x9F, 0xBA,
-  0x09, 0xA0, 0x88, 0x35, 0x1F, 0x36, 0x78, 0x4A, 0x26, 0x49, 0xBE, 0x38, 0x7A, 0x65, 0xC1, 0xD3, 0x61, 0x92, 0x35, 0x16, 0xA0, 0xA9, 0xE7, 0xE7, 0x03, 0x8B,
-  0xDB, 0xB2, 0xEB, 0x82, 0xB0, 0x3D, 0xDF, 0x59, 0x5C, 0xD1, 0xAB, 0x89, 0xA8, 0xB0, 0xA2, 0xC5, 0xAC, 0x03, 0xBC, 0x1F, 0xCC, 0x93, 0x44, 0x46, 0xE3, 0xF5,
-  0xFF, 0x2B, 0xAC, 0x74, 0x69, 0x0C, 0x4F, 0x3D, 0x9E, 0xED, 0xD2, 0x22, 0x98, 0xB4, 0x07, 0x3A, 0xE7, 0xF4, 0xDC, 0x11, 0x1B, 0x3C, 0xC2, 0x6D, 0xD0, 0x18,
-  0x3A, 0xF0, 0xF0, 0x77, 0xD6, 0x27, 0xA6, 0x12, 0x31, 0x05, 0xEF, 0xE5, 0xD2, 0xE2, 0x2C, 0x92, 0xA4, 0x44, 0x01, 0x9E, 0x39, 0x9B, 0x87, 0xA3, 0x06, 0x1B,
-  0x28, 0x31, 0x7C, 0x09, 0xCA, 0x4F, 0x89, 0x91, 0x91, 0x98, 0x78, 0x50, 0x8A, 0x13, 0x2F, 0x8C, 0x7C, 0x6C, 0x0F, 0xFD, 0xF3, 0xCF, 0xA3, 0x21, 0x0C, 0x76,
-  0x38, 0x01, 0x04, 0xD7, 0x5B, 0x35, 0xF6, 0xEE, 0xB2, 0xD8, 0x61, 0xE2, 0x8A, 0x14, 0xA9, 0x4A, 0x04, 0x8D, 0xDA, 0x72, 0x6C, 0x31, 0xF9, 0xC8, 0xD1, 0x89,
-  0xD6, 0x7B, 0x69, 0x07, 0x13, 0x96, 0x34, 0xC1, 0x9E, 0xAF, 0x8B, 0x96, 0xE5, 0xAC, 0x31, 0x04, 0x51, 0x3C, 0x5E, 0x23, 0x36, 0x91, 0x94, 0x0A, 0x76, 0x11,
-  0x34, 0x08, 0x68, 0x17, 0x1D, 0x22, 0x85, 0xF6, 0xF8, 0x58, 0x99, 0x48, 0xFF, 0x02, 0x95, 0x5F, 0x2C, 0x81, 0x88, 0x79, 0xA0, 0x72, 0x76, 0x0D, 0x33, 0xDC,
-  0xD0, 0x36, 0x21, 0xE3, 0xCD, 0xF2, 0x19, 0xB8, 0x2D, 0x38, 0x1A, 0x4F, 0x8F, 0x73, 0x00, 0x68, 0x4E, 0xCC, 0x1E, 0x84, 0xA1, 0xB0, 0x6C, 0xC3, 0xAE, 0xAF,
-  0x09, 0x89, 0x77, 0x66, 0x7C, 0x81, 0x66, 0x23, 0xD6, 0x4C, 0x40, 0x02, 0x78, 0xD7, 0xD3, 0x05, 0x89, 0x20, 0xA0, 0xDD, 0x5E, 0xA8, 0x17, 0x04, 0xE2, 0x99,
-  0x68, 0xA4, 0x95, 0xF4, 0xD9, 0xC4, 0xFA, 0x4C, 0x22, 0xA1, 0xB0, 0xF4, 0x19, 0xC4, 0xFA, 0xEC, 0xE1, 0x4E, 0xD0, 0x42, 0xF0, 0xC4, 0x56, 0x24, 0x48, 0x92,
-  0x2D, 0x75, 0x22, 0x4A, 0x3D, 0x98, 0x49, 0xE5, 0x40, 0x7C, 0xA6, 0xA9, 0x88, 0x28, 0x32, 0xA2, 0x28, 0x32, 0xC2, 0x45, 0x86, 0x00, 0x51, 0xE2, 0x9E, 0x3F,
-  0xAD, 0x0B, 0xE3, 0xCA, 0x4F, 0x2F, 0x23, 0xCE, 0x56, 0xC3, 0x4C, 0x3A, 0xF9, 0x94, 0x49, 0x60, 0x2F, 0x1B, 0x00, 0xDA, 0xCF, 0x61, 0xDC, 0x16, 0xD9, 0x5A,
-  0x0D, 0xD5, 0xD8, 0x0A, 0xA6, 0x5C, 0x08, 0x10, 0xB1, 0x25, 0x9F, 0x98, 0x05, 0xAC, 0xBC, 0x22, 0x3E, 0x7F, 0xAE, 0xD3, 0xB0, 0xC7, 0xDA, 0xC4, 0x35, 0xE6,
-  0xC4, 0x83, 0x09, 0x59, 0x48, 0xEC, 0x98, 0xDE, 0xCF, 0x1D, 0xA2, 0x58, 0x33, 0x81, 0xC9, 0x70, 0x6A, 0x97, 0x0B, 0x1A, 0xB6, 0x14, 0xA0, 0x43, 0x3A, 0x32,
-  0xA1, 0x83, 0x46, 0x6C, 0x6C, 0x0B, 0x4F, 0x95, 0x84, 0x15, 0xB6, 0x8E, 0x9C, 0x27, 0x42, 0xC0, 0x26, 0x4A, 0x03, 0xAD, 0x97, 0x2C, 0x27, 0xB0, 0x84, 0x87,
-  0x31, 0x9B, 0x48, 0x6B, 0xC4, 0x06, 0x21, 0x4B, 0xB1, 0x36, 0xA1, 0x83, 0x30, 0xF8, 0x34, 0x32, 0x73, 0x49, 0x61, 0xE5, 0xEA, 0xDA, 0x7B, 0x8B, 0xE0, 0x34,
-  0x8F, 0xBF, 0xA9, 0xF3, 0xE2, 0xDB, 0xD7, 0x9A, 0xE3, 0x6A, 0x96, 0xB3, 0x22, 0xB8, 0x59, 0x34, 0x58, 0x0A, 0xD6, 0x86, 0x04, 0x12, 0x4B, 0xC2, 0x26, 0xD3,
-  0x18, 0x87, 0xFC, 0x99, 0xE9, 0x41, 0xEA, 0x8E, 0xEF, 0x93, 0x25, 0x8F, 0x6B, 0x61, 0x31, 0x34, 0x97, 0xBD, 0xF5, 0xAD, 0x55, 0x31, 0x71, 0x32, 0x98, 0x48,
-  0x96, 0x8F, 0x39, 0x8F, 0x6B, 0xC1, 0x28, 0x6B, 0xFA, 0x5E, 0x40, 0x84, 0xE1, 0xED, 0x07, 0x2B, 0x45, 0x39, 0x03, 0xB9, 0x82, 0x0C, 0xC1, 0x22, 0x59, 0x46,
-  0xBC, 0xAE, 0x49, 0x53, 0x56, 0x23, 0xC9, 0xD0, 0x28, 0x96, 0x0B, 0xA5, 0x71, 0x3E, 0x5D, 0x2B, 0x4C, 0xE2, 0x2C, 0x55, 0x67, 0xBF, 0xB3, 0xC3, 0xE0, 0xB1,
-  0x39, 0x76, 0x86, 0x8B, 0x05, 0x83, 0x47, 0x67, 0x87, 0x33, 0x7F, 0x6E, 0x0D, 0x1E, 0xFD, 0x2F, 0x5E, 0x72, 0x0B, 0x89, 0x42, 0x10, 0x01, 0x00
+  0x1F, 0x8B, 0x08, 0x08, 0x00, 0x00, 0x00, 0x00, 0x02, 0xFF, 0x69, 0x6E, 0x64, 0x65, 0x78, 0x5F, 0x6F, 0x76, 0x35, 0x36, 0x34, 0x30, 0x2E, 0x68, 0x74, 0x6D,
+  0x6C, 0x00, 0xED, 0x7D, 0xEB, 0x7A, 0xDB, 0x46, 0x92, 0xE8, 0x7F, 0x3F, 0x45, 0x9B, 0xC9, 0x5A, 0xE4, 0x8A, 0xA4, 0x08, 0xDE, 0x44, 0xC9, 0x12, 0x7D, 0x6C,
+  0x59, 0xB1, 0x73, 0x26, 0xCE, 0x78, 0x6C, 0xC7, 0xC9, 0x7C, 0x5E, 0x7F, 0x0E, 0x48, 0x36, 0x49, 0xC4, 0x20, 0xC0, 0x05, 0x40, 0x49, 0x8C, 0x57, 0xCF, 0xB1,
+  0x0F, 0xB4, 0x2F, 0x76, 0xAA, 0xFA, 0x02, 0x34, 0x40, 0x00, 0xC4, 0x45, 0xA4, 0x94, 0xD9, 0x13, 0x7F, 0x11, 0x71, 0xE9, 0xAA, 0xAE, 0x7B, 0x57, 0x57, 0x37,
+  0x80, 0xB3, 0xC7, 0x13, 0x7B, 0xEC, 0xAD, 0x97, 0x94, 0xCC, 0xBD, 0x85, 0x39, 0x7C, 0x74, 0xC6, 0x7F, 0x08, 0xFC, 0x77, 0x36, 0xA7, 0xFA, 0x84, 0x1F, 0xB2,
+  0xD3, 0x05, 0xF5, 0x74, 0x32, 0x9E, 0xEB, 0x8E, 0x4B, 0xBD, 0xF3, 0xCA, 0xCA, 0x9B, 0x36, 0x06, 0x95, 0xE8, 0x6D, 0x4B, 0x5F, 0xD0, 0xF3, 0xCA, 0x95, 0x41,
+  0xAF, 0x97, 0xB6, 0xE3, 0x55, 0xC8, 0xD8, 0xB6, 0x3C, 0x6A, 0x41, 0xF3, 0x6B, 0x63, 0xE2, 0xCD, 0xCF, 0x27, 0xF4, 0xCA, 0x18, 0xD3, 0x06, 0x3B, 0xA9, 0x1B,
+  0x96, 0xE1, 0x19, 0xBA, 0xD9, 0x70, 0xC7, 0xBA, 0x49, 0xCF, 0x35, 0x15, 0x97, 0x67, 0x78, 0x26, 0x1D, 0x5E, 0xBE, 0x7F, 0xDB, 0x69, 0x93, 0xBF, 0x7F, 0xEC,
+  0xF5, 0xBB, 0xAD, 0xB3, 0x23, 0x7E, 0x2D, 0x68, 0xE3, 0x7A, 0x6B, 0xF5, 0x1C, 0xFF, 0x1B, 0xD9, 0x93, 0x35, 0xF9, 0x16, 0xBA, 0x84, 0xFF, 0x4D, 0x81, 0x88,
+  0xC6, 0x54, 0x5F, 0x18, 0xE6, 0xFA, 0x94, 0x3C, 0x77, 0xA0, 0xCF, 0xFA, 0x6B, 0x6A, 0x5E, 0x51, 0xCF, 0x18, 0xEB, 0x75, 0x57, 0xB7, 0xDC, 0x86, 0x4B, 0x1D,
+  0x63, 0xFA, 0x74, 0x03, 0x70, 0xA4, 0x8F, 0xBF, 0xCE, 0x1C, 0x7B, 0x65, 0x4D, 0x4E, 0xC9, 0x77, 0xDA, 0x00, 0xFF, 0x6D, 0x36, 0x1A, 0xDB, 0xA6, 0xED, 0xC0,
+  0xFD, 0xCB, 0x1F, 0xF0, 0xDF, 0xD3, 0xF8, 0xDE, 0x5D, 0xE3, 0x4F, 0x7A, 0x4A, 0xB4, 0xFE, 0xF2, 0x26, 0x74, 0xFF, 0xF6, 0x51, 0xE8, 0x74, 0xDE, 0x4E, 0xA2,
+  0x5E, 0xC0, 0x0F, 0xD2, 0xE1, 0x5D, 0x3A, 0xF6, 0x0C, 0xDB, 0x6A, 0x2E, 0x74, 0xC3, 0x8A, 0xC1, 0x34, 0x31, 0xDC, 0xA5, 0xA9, 0x83, 0x0C, 0xA6, 0x26, 0x4D,
+  0xC5, 0xF3, 0xDD, 0x82, 0x5A, 0xAB, 0xFA, 0x16, 0x6C, 0x88, 0xA4, 0x31, 0x31, 0x1C, 0xDE, 0xEA, 0x14, 0xE5, 0xB0, 0x5A, 0x58, 0x5B, 0xD1, 0xA6, 0xD1, 0x65,
+  0xD9, 0x16, 0x7D, 0x1A, 0xDF, 0xD1, 0xB5, 0xA3, 0x2F, 0xB1, 0x01, 0xFE, 0x6E, 0x36, 0x59, 0x18, 0x16, 0x37, 0xAA, 0x53, 0xD2, 0xE9, 0xB6, 0x96, 0x37, 0x5B,
+  0x54, 0xD9, 0xE9, 0xE3, 0xBF, 0xCD, 0x46, 0x4B, 0x7D, 0x32, 0x31, 0xAC, 0xD9, 0x29, 0x19, 0xC4, 0xA2, 0xB0, 0x9D, 0x09, 0x75, 0x1A, 0x8E, 0x3E, 0x31, 0x56,
+  0xEE, 0x29, 0xE9, 0xC6, 0xB5, 0x59, 0xE8, 0xCE, 0x0C, 0x68, 0xF1, 0x6C, 0x20, 0xB6, 0xA1, 0xB5, 0x52, 0x9A, 0x38, 0xC6, 0x6C, 0xEE, 0x81, 0x4A, 0x37, 0xDA,
+  0x44, 0x85, 0x26, 0x5C, 0x68, 0x9B, 0x3E, 0x53, 0xE5, 0x16, 0x2F, 0x35, 0xDD, 0x34, 0x66, 0x56, 0xC3, 0xF0, 0xE8, 0x02, 0xD8, 0x71, 0x3D, 0x87, 0x7A, 0xE3,
+  0x79, 0x1A, 0x29, 0x53, 0x63, 0xB6, 0x72, 0x68, 0x0C, 0x21, 0xBE, 0xDC, 0x52, 0x18, 0x86, 0x9B, 0x9B, 0xB7, 0x1A, 0xD7, 0x74, 0xF4, 0xD5, 0xF0, 0x1A, 0x42,
+  0x26, 0x23, 0x3A, 0xB5, 0x1D, 0x1A, 0xDB, 0x52, 0xB6, 0x30, 0xED, 0xF1, 0xD7, 0x86, 0xEB, 0xE9, 0x8E, 0x97, 0x05, 0xA1, 0x3E, 0xF5, 0xA8, 0xB3, 0x1D, 0x1F,
+  0x45, 0xAB, 0xD8, 0x8E, 0x2D, 0xB9, 0x5B, 0xD1, 0xC0, 0xB0, 0x4C, 0xC3, 0xA2, 0xD9, 0xC9, 0x4B, 0xEA, 0x37, 0x8C, 0x8E, 0xB7, 0xCA, 0xA0, 0x18, 0x63, 0x31,
+  0xAB, 0xCB, 0xE3, 0xB1, 0x6E, 0x5D, 0xE9, 0x6E, 0x9A, 0xD1, 0x30, 0xD6, 0x37, 0xFB, 0x16, 0x6E, 0xA4, 0xB5, 0x5A, 0xFF, 0xB6, 0x79, 0x73, 0x4E, 0xB9, 0xD5,
+  0xEA, 0x2B, 0xCF, 0x2E, 0xEF, 0x20, 0x83, 0x2D, 0xA6, 0xFF, 0x7F, 0x16, 0x74, 0x62, 0xE8, 0xA4, 0xAA, 0x78, 0xF7, 0xA0, 0x05, 0x26, 0x56, 0x23, 0xBA, 0x35,
+  0x21, 0x55, 0xDB, 0x31, 0xC0, 0x2F, 0x74, 0x16, 0x7D, 0x4C, 0xB8, 0x02, 0xE3, 0xC8, 0x92, 0xD6, 0x62, 0x58, 0x4E, 0x71, 0x21, 0x55, 0x22, 0xF1, 0x5E, 0x94,
+  0x31, 0x02, 0x65, 0xF2, 0xA7, 0x18, 0x1E, 0xF3, 0xAA, 0x2F, 0x8B, 0x0A, 0xB9, 0x9C, 0x6F, 0x1A, 0xA9, 0xAA, 0x94, 0x8D, 0xA4, 0x4A, 0x61, 0x10, 0x1E, 0x57,
+  0xA1, 0xE9, 0xD5, 0x9C, 0x34, 0x08, 0xC6, 0xD0, 0x5A, 0x3C, 0x8C, 0x40, 0x1A, 0x6F, 0x01, 0x51, 0x1B, 0xC9, 0xC1, 0x7D, 0x3C, 0xAB, 0x41, 0x64, 0xE1, 0xFF,
+  0x96, 0x37, 0x49, 0x9C, 0x24, 0xC6, 0x98, 0x7C, 0x71, 0x26, 0x47, 0xAC, 0xC9, 0x15, 0x6F, 0x32, 0xC7, 0x9C, 0x5C, 0x71, 0x27, 0x4F, 0xEC, 0xC9, 0x11, 0x7F,
+  0x32, 0xC5, 0x20, 0xAE, 0xCE, 0xED, 0xD9, 0xC8, 0x77, 0xA3, 0x95, 0xE7, 0xD9, 0x96, 0x5B, 0x6A, 0x00, 0x4B, 0x72, 0xBB, 0x3F, 0x56, 0xAE, 0x67, 0x4C, 0xD7,
+  0x0D, 0xE1, 0xE1, 0xE0, 0x76, 0x4B, 0x1D, 0x12, 0xCC, 0x11, 0xF5, 0xAE, 0x29, 0x4D, 0x4F, 0x46, 0x2C, 0xFD, 0x0A, 0xC2, 0xD0, 0x6C, 0x66, 0xC6, 0xD9, 0xDE,
+  0x78, 0xE5, 0xB8, 0x98, 0xD5, 0x2D, 0x6D, 0x03, 0x10, 0x3B, 0x4F, 0xB7, 0x84, 0xD1, 0x8C, 0x1D, 0x35, 0xC6, 0xA3, 0x98, 0xBE, 0xEC, 0x95, 0x87, 0x32, 0x8E,
+  0xD5, 0x84, 0x0D, 0xEC, 0x18, 0xDE, 0x3A, 0xF6, 0x9E, 0xF0, 0xC4, 0x56, 0x72, 0x98, 0x6E, 0x65, 0xA7, 0xEB, 0x74, 0x3C, 0xA7, 0xE3, 0xAF, 0x74, 0x72, 0xB8,
+  0x35, 0x49, 0xDB, 0x96, 0x3C, 0x36, 0x0D, 0x6B, 0xB9, 0xF2, 0x1A, 0x98, 0x6C, 0x2D, 0x77, 0xA2, 0x73, 0x66, 0x90, 0x92, 0xC5, 0x76, 0x3B, 0x2D, 0xE5, 0xE8,
+  0x2D, 0x6F, 0xD2, 0x85, 0xA0, 0x12, 0x3B, 0x34, 0xF5, 0x11, 0x35, 0xD3, 0x48, 0x16, 0xCE, 0x90, 0x10, 0x76, 0x45, 0xAC, 0x4A, 0xCE, 0xEC, 0x22, 0x99, 0x6A,
+  0xF7, 0xF8, 0xDF, 0x32, 0xCB, 0x91, 0x1D, 0xD7, 0x43, 0x97, 0x5C, 0x6A, 0x82, 0x83, 0x45, 0xAE, 0x2D, 0xF5, 0xC4, 0x54, 0x1D, 0x5A, 0x5C, 0x03, 0x55, 0xA9,
+  0x5D, 0x3A, 0xBA, 0x35, 0xA3, 0x10, 0x1D, 0x6E, 0xEA, 0xF2, 0x30, 0x7D, 0x22, 0x91, 0x49, 0x20, 0x18, 0xBC, 0x7B, 0xE9, 0x13, 0x17, 0x1E, 0x22, 0xEA, 0xA4,
+  0xC9, 0x0F, 0x0A, 0xA4, 0x2D, 0x8A, 0xC6, 0x53, 0x09, 0xD1, 0xDA, 0xC9, 0xA9, 0x7D, 0xAC, 0x2F, 0x85, 0xAD, 0x2D, 0x76, 0x62, 0xB0, 0x35, 0x58, 0xC8, 0x29,
+  0xE2, 0x74, 0xBA, 0x6D, 0x92, 0x39, 0x9D, 0x76, 0x5A, 0x9D, 0xEE, 0xD6, 0xD4, 0x2A, 0x96, 0xCB, 0xC8, 0x44, 0xF3, 0x69, 0x4A, 0xA0, 0xD9, 0xAE, 0x8B, 0xD3,
+  0xB9, 0x7D, 0x45, 0x9D, 0x18, 0x45, 0x44, 0xC8, 0xED, 0x9E, 0x74, 0x27, 0x19, 0xB0, 0xE9, 0x30, 0x14, 0x5C, 0xD1, 0xAD, 0xE8, 0xDA, 0xDA, 0xB8, 0xAD, 0x6D,
+  0x47, 0xD7, 0x04, 0x6B, 0xD0, 0x47, 0x26, 0x9D, 0xA4, 0x44, 0xEE, 0x09, 0x9D, 0xEA, 0x2B, 0xD3, 0xDB, 0x22, 0x6F, 0xBD, 0x85, 0xFF, 0xD2, 0x7A, 0x64, 0xEE,
+  0xF5, 0x09, 0x2B, 0x24, 0xE7, 0xCC, 0x25, 0x3E, 0xC7, 0xF4, 0x29, 0x87, 0x55, 0x7D, 0xB9, 0xA4, 0x3A, 0xB4, 0x1A, 0xD3, 0xA4, 0xB9, 0x6C, 0xA6, 0xEC, 0x3A,
+  0x3E, 0xA6, 0x65, 0x9A, 0xC1, 0x6E, 0x35, 0x45, 0x3F, 0x51, 0xCA, 0xC5, 0xF3, 0xE9, 0xD4, 0x1E, 0xAF, 0xDC, 0xD4, 0xB1, 0x2B, 0x1F, 0xBE, 0x53, 0x29, 0x32,
+  0xD7, 0x34, 0x98, 0x61, 0xAF, 0x2C, 0x0B, 0x35, 0xDA, 0xF0, 0x1C, 0x60, 0x33, 0xA6, 0xA3, 0x6C, 0x82, 0x2B, 0xE4, 0x9D, 0x21, 0xC1, 0x26, 0x55, 0x71, 0x22,
+  0x0E, 0xD8, 0x4A, 0x89, 0x21, 0xC4, 0xB5, 0x81, 0x29, 0x89, 0xAA, 0x9C, 0x5C, 0xBC, 0xF9, 0x6A, 0x11, 0x97, 0x33, 0xC8, 0xCE, 0x34, 0x18, 0xE0, 0x78, 0x77,
+  0xCE, 0x6C, 0xA4, 0x57, 0x5B, 0xF5, 0x56, 0xBD, 0x03, 0x7F, 0x6A, 0x79, 0x8D, 0x4B, 0x88, 0xB7, 0xDD, 0xCE, 0x50, 0xF8, 0xE8, 0x6D, 0x2F, 0xB0, 0x24, 0x85,
+  0xB1, 0xAD, 0xBA, 0xC8, 0xEE, 0x49, 0xE1, 0x4A, 0x8B, 0xD6, 0xDC, 0x32, 0xC2, 0x24, 0x98, 0x74, 0x7E, 0x43, 0x8C, 0xB1, 0x96, 0xBC, 0x2A, 0x5E, 0xD8, 0x7F,
+  0x36, 0xF8, 0xF0, 0xFA, 0xBF, 0xDE, 0xDA, 0x15, 0x51, 0xFC, 0x4B, 0x5B, 0x7A, 0x6E, 0xB9, 0xB8, 0xF7, 0x6D, 0x1B, 0xAD, 0x64, 0xAD, 0x37, 0x44, 0x3E, 0x03,
+  0x14, 0x5A, 0x90, 0x71, 0x3A, 0x30, 0xF1, 0x4A, 0xCC, 0x79, 0x94, 0x36, 0x05, 0x64, 0x30, 0x35, 0x4C, 0xB3, 0x61, 0xDA, 0xD7, 0xDB, 0x33, 0x91, 0x74, 0x4B,
+  0xDE, 0xB0, 0xD3, 0xED, 0x26, 0x5F, 0x94, 0xDA, 0x15, 0x44, 0xAE, 0xBF, 0x04, 0xB5, 0xFF, 0xDB, 0x86, 0x16, 0xC5, 0x35, 0x8A, 0x0D, 0x14, 0x05, 0xEC, 0xB1,
+  0x5C, 0x47, 0x99, 0x4C, 0x89, 0x67, 0x82, 0xA9, 0xB3, 0x3A, 0xF7, 0xDA, 0xF0, 0xC6, 0xF3, 0x02, 0x93, 0xAA, 0xA5, 0xED, 0x1A, 0x7C, 0x71, 0xC7, 0xA1, 0xA6,
+  0x8E, 0x19, 0x7C, 0xA1, 0xD9, 0xF8, 0xD6, 0x89, 0x89, 0x0A, 0x9E, 0x85, 0x13, 0x26, 0xBA, 0x87, 0x53, 0x49, 0x69, 0xF2, 0xDC, 0x21, 0x39, 0x56, 0xC7, 0x9B,
+  0xF5, 0x96, 0x74, 0x3F, 0xEC, 0x19, 0xED, 0xB2, 0x11, 0x5D, 0x06, 0xED, 0x99, 0x43, 0xD7, 0x19, 0x98, 0xA9, 0x8B, 0xDF, 0x53, 0x5E, 0x2B, 0x2D, 0x5E, 0x04,
+  0x60, 0x03, 0x80, 0xB0, 0xA2, 0x66, 0xD7, 0xCD, 0xD0, 0x75, 0x72, 0x97, 0x59, 0xEC, 0xD1, 0xAF, 0x04, 0x56, 0x2A, 0x19, 0xC2, 0x4D, 0xCA, 0x10, 0x1A, 0x6F,
+  0xAA, 0x72, 0xF4, 0x8D, 0xBD, 0x69, 0xD2, 0xA9, 0x97, 0xB0, 0xEE, 0xC1, 0xF2, 0xD4, 0x4E, 0x7A, 0x74, 0x6B, 0x28, 0x75, 0x82, 0xAD, 0x91, 0xC3, 0x2F, 0xD8,
+  0x25, 0x5B, 0x5F, 0x2C, 0x66, 0x8C, 0x9E, 0xB9, 0x91, 0x27, 0xAB, 0x44, 0xA6, 0xCF, 0x4C, 0xCD, 0xD0, 0x66, 0x21, 0x86, 0x7C, 0x50, 0x0F, 0xFD, 0xAD, 0xDA,
+  0xEE, 0xC7, 0xAE, 0x23, 0xA4, 0x34, 0x4E, 0x2F, 0x28, 0x63, 0xC5, 0x2B, 0xD3, 0x90, 0x95, 0x38, 0x41, 0x56, 0x63, 0x51, 0x37, 0xBF, 0x57, 0xA6, 0x45, 0x98,
+  0xCD, 0x1A, 0x4D, 0x7A, 0x79, 0x6F, 0xA1, 0x43, 0xDA, 0x8B, 0xE6, 0xAA, 0x03, 0x46, 0xA7, 0xA0, 0xB9, 0x2B, 0xF5, 0x44, 0xAD, 0xDF, 0xDA, 0xD2, 0xE5, 0xD8,
+  0xB4, 0xDD, 0x74, 0xBF, 0xD2, 0x47, 0x20, 0xBF, 0x95, 0x17, 0xD3, 0x91, 0xA8, 0x6A, 0xF6, 0x12, 0x8D, 0xBB, 0x57, 0x78, 0xE8, 0x4E, 0xF5, 0xA9, 0x74, 0x77,
+  0x8C, 0xC8, 0x5C, 0x6B, 0xC5, 0x46, 0xDA, 0xD4, 0xFA, 0x9B, 0x47, 0x6F, 0x60, 0xBE, 0x89, 0x4B, 0x77, 0xA7, 0x64, 0x4C, 0xE3, 0xC3, 0x68, 0x68, 0x90, 0xD3,
+  0xB2, 0x14, 0x01, 0x53, 0xF5, 0x30, 0x37, 0x26, 0x13, 0x6A, 0x6D, 0xDB, 0x09, 0x91, 0x1E, 0x2A, 0xF5, 0xAB, 0x92, 0x9A, 0x6C, 0x27, 0xAB, 0xB2, 0x95, 0x5F,
+  0x11, 0x61, 0x09, 0xF5, 0xB7, 0x54, 0x61, 0xE3, 0x43, 0x24, 0x2A, 0x62, 0x42, 0xC7, 0xB6, 0xC3, 0xD7, 0x74, 0x13, 0x26, 0xFE, 0xC5, 0x66, 0x56, 0x88, 0xFC,
+  0xF3, 0xBE, 0x42, 0x47, 0xEA, 0x36, 0x08, 0x6D, 0xD7, 0x71, 0x45, 0x0C, 0xC7, 0x49, 0x95, 0xF4, 0x70, 0xC2, 0x96, 0x4A, 0x6A, 0x3B, 0x55, 0x8D, 0x28, 0x32,
+  0x90, 0x03, 0xB6, 0xDA, 0x54, 0x68, 0x84, 0x2A, 0xB6, 0xB4, 0xD2, 0x14, 0xAB, 0x4D, 0x62, 0x61, 0xB0, 0x91, 0xB4, 0xDE, 0x72, 0x87, 0x8B, 0x6F, 0xCC, 0x02,
+  0xA2, 0xFD, 0x26, 0x8A, 0xE6, 0x9E, 0xF2, 0xC7, 0x14, 0x22, 0xFD, 0x81, 0x58, 0x6E, 0xC6, 0x0A, 0xB7, 0x2A, 0x1A, 0x42, 0xCE, 0x8E, 0x94, 0xDD, 0x73, 0x67,
+  0x47, 0xC1, 0x46, 0xBF, 0x33, 0xDC, 0x42, 0xA7, 0x6E, 0xB2, 0x13, 0xFD, 0x8C, 0x4D, 0xDD, 0x75, 0xCF, 0x2B, 0xB8, 0x15, 0xAC, 0x12, 0xDE, 0x73, 0x77, 0x36,
+  0x31, 0xAE, 0x88, 0x31, 0x39, 0xAF, 0x98, 0xF6, 0xCC, 0x8E, 0xDC, 0x63, 0xF7, 0xB9, 0x96, 0x61, 0xB4, 0x3F, 0xAF, 0x84, 0x56, 0x1C, 0x2B, 0x0C, 0x2A, 0xB8,
+  0x54, 0x19, 0x3E, 0xF9, 0xEE, 0xE4, 0xF8, 0xB8, 0xFF, 0xF4, 0x89, 0x35, 0x72, 0x97, 0xE2, 0xEF, 0x07, 0xBE, 0x40, 0xEB, 0x52, 0xCF, 0x03, 0x9B, 0x73, 0xCF,
+  0x8E, 0x18, 0xB6, 0x08, 0x05, 0x47, 0x40, 0x42, 0x02, 0x51, 0x22, 0x1B, 0x8C, 0xA3, 0x4B, 0x36, 0x71, 0x21, 0xC1, 0x19, 0xE9, 0x4E, 0x4C, 0x13, 0xD6, 0x8C,
+  0xCF, 0x35, 0x58, 0x0C, 0xA9, 0x30, 0x65, 0x8C, 0xEC, 0x9B, 0x28, 0xE9, 0x8C, 0x1B, 0xA1, 0x29, 0xD1, 0x8A, 0x4E, 0x92, 0x10, 0x02, 0x18, 0x03, 0xC7, 0x75,
+  0x56, 0x68, 0x13, 0xDB, 0x28, 0x24, 0x7B, 0x6C, 0x7C, 0x33, 0x36, 0xBF, 0x4A, 0xA5, 0x57, 0xA4, 0x36, 0x2C, 0xDB, 0xE3, 0x23, 0x49, 0x42, 0x57, 0x21, 0x56,
+  0x05, 0x8C, 0xB2, 0x5A, 0xC8, 0xB9, 0x00, 0xD1, 0x36, 0x18, 0x76, 0x7E, 0x2D, 0x1D, 0x53, 0x54, 0xA1, 0x12, 0xB8, 0x32, 0xFC, 0xED, 0xE2, 0xA7, 0xBF, 0x91,
+  0x37, 0xAF, 0xFF, 0x8C, 0xD5, 0xD0, 0x36, 0xA2, 0x30, 0x38, 0x67, 0xE8, 0x59, 0xD1, 0x87, 0x94, 0x49, 0x45, 0x68, 0x86, 0x61, 0xC0, 0x64, 0xC8, 0xA4, 0xD6,
+  0xCC, 0x9B, 0x9F, 0x57, 0xB4, 0x0A, 0xEE, 0x6E, 0x91, 0x67, 0xED, 0x0A, 0xC1, 0xC0, 0xCD, 0x0E, 0xAE, 0x74, 0x73, 0x85, 0x47, 0xAD, 0x2C, 0xBC, 0x6E, 0x9A,
+  0x56, 0x6C, 0x33, 0x11, 0x51, 0x7C, 0x19, 0x2B, 0x11, 0x38, 0x2C, 0xE5, 0xCA, 0xF0, 0x3D, 0xF5, 0xCE, 0x8E, 0xF8, 0xAD, 0x2D, 0x5A, 0x4B, 0xEF, 0x1B, 0x5C,
+  0x98, 0x9B, 0x43, 0x9A, 0x09, 0xA5, 0x29, 0x7E, 0xEA, 0xE8, 0x0B, 0x8A, 0x52, 0xC9, 0xA4, 0x79, 0x55, 0xEB, 0x3E, 0x64, 0x65, 0xF8, 0x8E, 0xB2, 0x2C, 0x03,
+  0xC8, 0xC8, 0xA4, 0xF8, 0x33, 0x91, 0xC2, 0x87, 0xFA, 0xF7, 0xED, 0x59, 0x2C, 0xD9, 0x35, 0x74, 0x6E, 0xE6, 0x19, 0xE4, 0xFE, 0xB8, 0xD1, 0x20, 0xBD, 0x37,
+  0x6F, 0x49, 0xA3, 0x91, 0xA1, 0xB1, 0xBD, 0x64, 0xEE, 0x24, 0xF5, 0x0F, 0x16, 0xC2, 0xA9, 0xA1, 0x4C, 0x3F, 0xFC, 0xA8, 0x32, 0xFC, 0xC7, 0xFB, 0xDF, 0x5E,
+  0x3D, 0xAF, 0xB6, 0x7B, 0xFD, 0xD6, 0x8D, 0x76, 0xD2, 0x6E, 0xD5, 0xCE, 0x8E, 0x38, 0x5C, 0xFE, 0x0E, 0xC0, 0xC0, 0xDE, 0x92, 0x1F, 0x5E, 0xBF, 0xAC, 0x6A,
+  0xAD, 0x41, 0x59, 0x64, 0xDA, 0x49, 0x65, 0xF8, 0xEB, 0x3F, 0x02, 0xCA, 0xFA, 0xAD, 0x32, 0xC8, 0x06, 0xC0, 0x26, 0xD0, 0xC5, 0x51, 0x75, 0xBB, 0xB9, 0x50,
+  0xA1, 0xC8, 0x3B, 0xC5, 0x44, 0xAE, 0x1D, 0x43, 0xBF, 0x8C, 0x87, 0x56, 0x77, 0x70, 0xA3, 0xF5, 0xFA, 0xDD, 0x12, 0x3C, 0xF4, 0x51, 0xBA, 0x40, 0x48, 0x75,
+  0xD0, 0xEF, 0x96, 0xC5, 0xD5, 0x43, 0x5C, 0x20, 0x90, 0xE3, 0x36, 0xC8, 0xA3, 0x3D, 0x28, 0x23, 0xDA, 0x6E, 0x65, 0xC8, 0x54, 0x7E, 0x82, 0xA8, 0x5A, 0x83,
+  0xDC, 0xA2, 0x6D, 0x17, 0x14, 0x6D, 0xA7, 0x32, 0xFC, 0x05, 0x45, 0x8B, 0x96, 0x01, 0x3C, 0x94, 0x32, 0x8F, 0x36, 0x44, 0x29, 0x86, 0xAB, 0x8D, 0x76, 0xDB,
+  0x6A, 0x97, 0x11, 0xAD, 0x56, 0x19, 0xA2, 0x38, 0x10, 0xD3, 0x71, 0x29, 0x07, 0x00, 0x6F, 0x62, 0x34, 0x01, 0x39, 0x37, 0xC7, 0xFD, 0x41, 0x71, 0x4C, 0xE0,
+  0x49, 0xEF, 0x3F, 0x02, 0xA6, 0x01, 0x08, 0xAA, 0x94, 0x1B, 0x81, 0x17, 0x21, 0x9E, 0x7E, 0xB7, 0x75, 0xD3, 0x2D, 0x63, 0x33, 0xE0, 0x15, 0xAF, 0x11, 0x11,
+  0x20, 0xB9, 0xE9, 0x94, 0x91, 0x11, 0xB8, 0xC4, 0xC5, 0x8F, 0x3F, 0x54, 0xBB, 0xC0, 0x58, 0xFB, 0xA4, 0x5F, 0x1C, 0x0F, 0xB8, 0xC3, 0x3F, 0x90, 0x20, 0x20,
+  0xE6, 0xA6, 0xDD, 0x2D, 0x41, 0x10, 0x38, 0x03, 0xC0, 0x23, 0x8E, 0xC2, 0x28, 0xC0, 0xAE, 0x5F, 0x33, 0x62, 0x10, 0x91, 0x76, 0x5C, 0x82, 0x2B, 0xB0, 0xEA,
+  0x7F, 0xA0, 0x78, 0x00, 0x09, 0x06, 0xBD, 0x12, 0xA6, 0x08, 0x88, 0x18, 0x49, 0x5A, 0x9F, 0xB9, 0x5A, 0x71, 0x4C, 0x60, 0xD3, 0x27, 0xFD, 0x9B, 0x93, 0x7E,
+  0x36, 0x04, 0x38, 0xE2, 0xE3, 0x28, 0x95, 0x96, 0x13, 0xA4, 0xA7, 0x0C, 0x69, 0xE9, 0xC0, 0x7F, 0xAE, 0x74, 0x13, 0xE6, 0x37, 0xB9, 0x93, 0x01, 0x01, 0x07,
+  0x32, 0xE1, 0x07, 0xD9, 0xF2, 0x00, 0x85, 0x12, 0x7F, 0xA3, 0x59, 0x65, 0xD8, 0xCD, 0x90, 0x6F, 0x85, 0x12, 0x72, 0x06, 0x1B, 0xA2, 0x9F, 0x25, 0x81, 0x68,
+  0x79, 0x98, 0xFE, 0x81, 0x4B, 0x74, 0x2A, 0x4A, 0x04, 0x29, 0x94, 0x68, 0xC4, 0xD0, 0xAA, 0xDF, 0x54, 0x86, 0xFD, 0xCE, 0xD6, 0x04, 0xAD, 0xB8, 0x32, 0x46,
+  0xAC, 0x46, 0x63, 0x51, 0xD7, 0xCD, 0xAD, 0x8F, 0x00, 0xB4, 0x32, 0x7C, 0xE1, 0x1F, 0x97, 0xD1, 0x4A, 0xA3, 0x53, 0x42, 0x2D, 0x0A, 0x39, 0x5C, 0x33, 0x8D,
+  0x8E, 0x50, 0x4D, 0xA0, 0x99, 0xBB, 0x55, 0xCC, 0x2E, 0xF5, 0x82, 0xD3, 0x49, 0x47, 0x77, 0xBD, 0xDC, 0x5A, 0x91, 0x80, 0x10, 0xA1, 0xC5, 0xD1, 0xBD, 0x69,
+  0xC4, 0x27, 0xE5, 0x5F, 0x40, 0x1F, 0xAE, 0xEE, 0xAD, 0x78, 0xB5, 0x30, 0xB7, 0x46, 0x02, 0x50, 0xC8, 0x07, 0xFC, 0xE3, 0x52, 0x5A, 0x29, 0x13, 0xBE, 0x14,
+  0x72, 0x84, 0x5E, 0x64, 0x08, 0xEB, 0xEE, 0x48, 0x2F, 0xDD, 0x5D, 0xEA, 0x65, 0xAE, 0x3B, 0xCB, 0x42, 0xE1, 0xCB, 0x87, 0x04, 0xAD, 0xC8, 0xC3, 0x7B, 0x73,
+  0x95, 0x80, 0x98, 0x7F, 0x01, 0x5F, 0x99, 0x50, 0xCB, 0x36, 0xDC, 0xFC, 0xB3, 0x7D, 0x01, 0x57, 0x19, 0xBE, 0xA4, 0x8D, 0x9F, 0xF1, 0xA8, 0x8C, 0x3A, 0x9E,
+  0xAF, 0x3C, 0xBB, 0x84, 0x42, 0x24, 0x2D, 0x5C, 0x1D, 0x2D, 0xA1, 0x8D, 0xC1, 0x8E, 0xB4, 0x31, 0xD8, 0xA1, 0x36, 0x74, 0xFA, 0xC5, 0xA4, 0x57, 0xD4, 0xCC,
+  0xAD, 0x0E, 0x09, 0x58, 0x19, 0x5E, 0xDE, 0x2C, 0x6D, 0x17, 0x1F, 0x9D, 0xFA, 0x09, 0xCF, 0x4B, 0x39, 0x49, 0xAF, 0x84, 0x4E, 0x7C, 0x82, 0x84, 0x8F, 0xF4,
+  0x84, 0x56, 0x7A, 0x3B, 0xD2, 0x4A, 0x6F, 0x87, 0x5A, 0x99, 0xE9, 0x86, 0x35, 0xA6, 0x86, 0x89, 0x8F, 0x71, 0xE4, 0x55, 0x8C, 0x02, 0x5B, 0x19, 0xBE, 0x0A,
+  0x4E, 0xCA, 0x28, 0xA6, 0x55, 0x42, 0x2F, 0x2A, 0x3D, 0x61, 0x7F, 0xE9, 0xC1, 0xAC, 0x7C, 0x47, 0xBA, 0xD1, 0xB4, 0x5D, 0x8E, 0x2A, 0x4B, 0x3A, 0x36, 0x74,
+  0xF3, 0x0B, 0x9D, 0x4E, 0x61, 0x1A, 0x94, 0x7F, 0x68, 0x09, 0x81, 0xC3, 0xF8, 0xC2, 0xCF, 0xC9, 0x25, 0x3B, 0xCF, 0x5D, 0xBF, 0x8C, 0xA0, 0x2B, 0x5E, 0xC4,
+  0x8C, 0xCE, 0x09, 0x63, 0xCB, 0x92, 0x3F, 0xDB, 0x3E, 0x9D, 0xC5, 0xA7, 0xAD, 0x3F, 0xD3, 0x19, 0xDB, 0x46, 0x50, 0x66, 0x0E, 0xFD, 0xCA, 0xD1, 0xD7, 0xEC,
+  0x8D, 0x0D, 0x65, 0xA6, 0xF4, 0xEF, 0xE8, 0x84, 0x7C, 0x30, 0x2C, 0xAF, 0x4C, 0x65, 0xE1, 0x95, 0x43, 0xA9, 0x55, 0x0E, 0x4B, 0x0F, 0xA6, 0x48, 0x70, 0x50,
+  0x0E, 0x49, 0x1F, 0x6B, 0xFA, 0x4B, 0x43, 0x7F, 0x08, 0x93, 0x78, 0xFD, 0x7A, 0x94, 0x7F, 0x40, 0xB9, 0x1E, 0xC1, 0xB8, 0xFC, 0xEB, 0x0B, 0x72, 0xC9, 0x36,
+  0xBE, 0xE7, 0x0E, 0x57, 0x7C, 0x4F, 0x5E, 0x16, 0x43, 0x0F, 0x96, 0x6E, 0xB0, 0xCF, 0x8D, 0x35, 0xB5, 0x78, 0x07, 0xCA, 0xBA, 0xAE, 0x16, 0xC3, 0x9E, 0x24,
+  0x90, 0x6D, 0x61, 0xAA, 0x28, 0xDC, 0x66, 0xE3, 0x71, 0x87, 0xA9, 0xD8, 0xF8, 0x3A, 0x7F, 0x1A, 0x36, 0xBE, 0x06, 0x35, 0x4D, 0xAE, 0xF0, 0x99, 0x88, 0x09,
+  0x01, 0x7D, 0xED, 0x45, 0x51, 0xD8, 0xEB, 0xFD, 0x28, 0x8A, 0xF1, 0x7B, 0xDF, 0x8A, 0x02, 0x6B, 0xF9, 0x82, 0xE3, 0x68, 0x11, 0xA7, 0x62, 0x80, 0x95, 0xE1,
+  0x1B, 0xDD, 0x5A, 0xC1, 0x20, 0xB3, 0x2F, 0x85, 0xF9, 0x1D, 0xDF, 0x9B, 0x7B, 0x09, 0xBE, 0xEF, 0x5B, 0x75, 0x40, 0xC8, 0xC2, 0x9E, 0xE4, 0x9F, 0xEE, 0x08,
+  0x38, 0x1E, 0x12, 0xDF, 0xC0, 0x51, 0xEE, 0xC4, 0x40, 0x62, 0xD8, 0x71, 0x46, 0xC0, 0xA7, 0x52, 0xC5, 0x93, 0x81, 0xF7, 0x2B, 0xCB, 0x5A, 0x97, 0xC9, 0x04,
+  0x2E, 0x4C, 0x7B, 0x35, 0x59, 0x97, 0x49, 0x03, 0xFE, 0x3E, 0x9D, 0x1A, 0x63, 0x5A, 0x26, 0x09, 0x78, 0x6D, 0x2F, 0xE8, 0x83, 0x18, 0x78, 0xE9, 0xB8, 0xC0,
+  0x4C, 0x6E, 0x0C, 0x5A, 0xBC, 0xBC, 0xD8, 0xEB, 0xC0, 0x0B, 0x7D, 0xDE, 0x53, 0x64, 0x40, 0x6E, 0xEF, 0x3D, 0x9E, 0xD3, 0xF1, 0x17, 0x66, 0x3C, 0x45, 0x94,
+  0xC5, 0x21, 0xFD, 0x88, 0x2E, 0xA7, 0xDF, 0xF7, 0x35, 0xBF, 0x0B, 0x28, 0x0A, 0xCF, 0xEE, 0x70, 0xE9, 0xD9, 0x9F, 0xDE, 0x75, 0xDA, 0x77, 0x3B, 0xC1, 0x43,
+  0xE4, 0xBB, 0xD5, 0x4F, 0xBB, 0x88, 0x6A, 0x20, 0x1A, 0xFD, 0x8C, 0xEB, 0x0C, 0x39, 0x02, 0x76, 0x79, 0x47, 0x6A, 0xDF, 0x9F, 0x27, 0xB5, 0x1F, 0x80, 0x2B,
+  0xCD, 0x0A, 0x44, 0xBC, 0x19, 0x46, 0xBC, 0x57, 0x17, 0xFB, 0xD1, 0xD0, 0xEC, 0xDE, 0x42, 0xDD, 0xEC, 0x5E, 0x43, 0x1D, 0x11, 0x9B, 0x02, 0xA5, 0x14, 0x0A,
+  0x66, 0xB0, 0x02, 0x90, 0xD7, 0xB2, 0xCA, 0x04, 0x39, 0xED, 0xA6, 0x4C, 0x94, 0x93, 0x64, 0x84, 0x83, 0x5C, 0x3F, 0x58, 0x15, 0xE9, 0xDD, 0xED, 0xB2, 0x6E,
+  0xF7, 0x66, 0x87, 0x4E, 0xE3, 0xE8, 0xD7, 0x5F, 0x66, 0x0B, 0x3D, 0xB7, 0x32, 0x04, 0x1C, 0xE8, 0xE2, 0xCD, 0xF3, 0x7D, 0xA6, 0x0B, 0xB2, 0xDF, 0xFB, 0xF1,
+  0x23, 0x9F, 0xEB, 0xFB, 0x8E, 0x75, 0x26, 0xB5, 0xF2, 0x07, 0x3B, 0x04, 0xAA, 0x0C, 0x7F, 0xA2, 0x96, 0x4B, 0x2E, 0x6C, 0x47, 0xBC, 0x26, 0x73, 0x2F, 0x5A,
+  0x63, 0x3D, 0xDF, 0x8F, 0xCA, 0x38, 0xD3, 0xF7, 0xAD, 0xAF, 0xF9, 0xC2, 0x70, 0x1C, 0xDB, 0xC9, 0xAD, 0x32, 0x01, 0x07, 0xD3, 0x8A, 0xC6, 0x1B, 0x76, 0xB4,
+  0x17, 0x75, 0xC9, 0x5E, 0xEF, 0x47, 0x63, 0x3E, 0xCF, 0xF7, 0xAD, 0xB4, 0xAB, 0xA9, 0x69, 0x2C, 0x73, 0xAB, 0x8C, 0x41, 0x55, 0x86, 0x1F, 0x1B, 0x3F, 0xC0,
+  0xEF, 0x5E, 0xD4, 0xC5, 0x7B, 0xBC, 0x1F, 0x65, 0x09, 0x6E, 0xEF, 0x5B, 0x55, 0xA3, 0x65, 0xFE, 0x70, 0x08, 0x30, 0x95, 0xE1, 0x8B, 0xB7, 0xFB, 0xC9, 0xFD,
+  0xB0, 0xB3, 0x8C, 0x1A, 0x2A, 0xA5, 0x0F, 0xC6, 0xD4, 0xBD, 0x57, 0xBA, 0x0A, 0x68, 0xE3, 0x1A, 0x09, 0xFF, 0x75, 0x4F, 0xDA, 0xB8, 0x5E, 0xDE, 0xD7, 0x70,
+  0x74, 0xFD, 0x10, 0xF4, 0xC3, 0x9E, 0x3E, 0x1D, 0xE9, 0x4E, 0x81, 0x4D, 0x63, 0x1C, 0x10, 0x37, 0x8D, 0xC1, 0x11, 0x79, 0xA1, 0xEF, 0x67, 0x40, 0xF2, 0xFB,
+  0xDD, 0x87, 0x0B, 0x05, 0x4C, 0xDE, 0xB7, 0x9E, 0xA6, 0xFA, 0x98, 0x7E, 0x99, 0x50, 0xAF, 0xC8, 0xDA, 0xB2, 0x02, 0x5B, 0x19, 0xFE, 0x00, 0x27, 0xE4, 0x25,
+  0x3B, 0xD9, 0x57, 0xCA, 0xA7, 0xF6, 0xBF, 0x0F, 0xAD, 0x85, 0xF8, 0x7D, 0x10, 0x8A, 0x83, 0x04, 0xDB, 0x9E, 0x59, 0x85, 0x1E, 0x67, 0x0A, 0x81, 0x0B, 0xF5,
+  0xBD, 0xE3, 0xE7, 0xFB, 0x55, 0x60, 0x40, 0xC4, 0xDE, 0x74, 0xA8, 0xF0, 0x7D, 0x87, 0x6A, 0x7C, 0x54, 0x74, 0x8B, 0x9A, 0xE9, 0xE9, 0x5F, 0x3C, 0xC3, 0xA4,
+  0x6E, 0x81, 0x6D, 0x6A, 0x3E, 0x2C, 0x6E, 0x55, 0x83, 0x13, 0xF2, 0x01, 0x4F, 0xF6, 0xB3, 0x4C, 0xAA, 0x74, 0x1E, 0x55, 0x5D, 0xB9, 0x55, 0x50, 0x95, 0xAB,
+  0x7D, 0xF8, 0x99, 0xFA, 0xD0, 0xA9, 0x78, 0x71, 0xF3, 0x36, 0x25, 0x88, 0x87, 0x1F, 0xD9, 0x9E, 0x23, 0xEA, 0x35, 0x5C, 0xA0, 0xD6, 0xAC, 0x0C, 0x5F, 0x51,
+  0x8F, 0xBC, 0xC7, 0xC3, 0x8C, 0x4F, 0x3B, 0x2A, 0x58, 0xE4, 0x33, 0xCE, 0x9E, 0x43, 0xF5, 0x45, 0x65, 0xF8, 0x1E, 0x5F, 0x69, 0x0D, 0xB8, 0xF0, 0xAC, 0x30,
+  0xB2, 0x85, 0xEE, 0x7E, 0x85, 0xD9, 0x38, 0xBE, 0x84, 0xF4, 0x0D, 0x1C, 0xE6, 0xC7, 0xC3, 0xBC, 0x85, 0x5A, 0x8E, 0x0D, 0xCC, 0xF9, 0xDE, 0x28, 0x5E, 0x43,
+  0x5A, 0x21, 0xF2, 0x48, 0xB9, 0x36, 0xBC, 0x64, 0x8D, 0x09, 0x86, 0x93, 0xED, 0xDD, 0x65, 0x7E, 0x9C, 0x93, 0x3D, 0xB8, 0x8D, 0x4F, 0x62, 0x87, 0xDF, 0xA3,
+  0x0F, 0xD6, 0xC1, 0x5F, 0x5E, 0x31, 0x3C, 0x63, 0x2F, 0x01, 0x16, 0xCD, 0xD8, 0x3B, 0x0B, 0xAE, 0xC5, 0x43, 0xE8, 0x23, 0xDB, 0x9C, 0x3C, 0x55, 0x36, 0x11,
+  0xBC, 0xF7, 0x9F, 0xAA, 0x46, 0x10, 0x30, 0x2F, 0x89, 0x61, 0x8B, 0x8D, 0xCC, 0x1D, 0x89, 0x9E, 0x3F, 0xF8, 0x8E, 0xAF, 0xA2, 0x4B, 0x31, 0x92, 0x84, 0x27,
+  0xC0, 0x1D, 0x3A, 0xF3, 0x05, 0x19, 0xF7, 0x62, 0x80, 0xD8, 0xE7, 0xC1, 0xDF, 0xD1, 0x99, 0xE1, 0x02, 0x8D, 0x04, 0xCC, 0xEB, 0x88, 0x3D, 0x4A, 0xCB, 0x5D,
+  0x22, 0xDB, 0x63, 0xDA, 0x6A, 0x97, 0xE2, 0x1D, 0x1C, 0xB1, 0x4F, 0xDD, 0xE7, 0x4A, 0x43, 0xA3, 0xCF, 0xC8, 0x87, 0x31, 0x6E, 0x73, 0x9E, 0xC7, 0x8D, 0xC6,
+  0xBC, 0x8B, 0x0F, 0x05, 0x13, 0xC9, 0xDA, 0xD9, 0xD1, 0xBC, 0xBB, 0xED, 0x09, 0xC0, 0xAD, 0x4F, 0x74, 0x03, 0xA7, 0x85, 0x1F, 0xE8, 0x46, 0x29, 0x0D, 0x81,
+  0x9A, 0x3A, 0xF3, 0x94, 0x3A, 0xF9, 0x88, 0x75, 0xD6, 0x3D, 0x3E, 0xD7, 0x8D, 0xB4, 0xEB, 0x93, 0x89, 0x93, 0xF8, 0x6C, 0x77, 0x37, 0xF4, 0x6C, 0x77, 0x5F,
+  0x3E, 0xDB, 0xDD, 0x0F, 0x36, 0x35, 0xDE, 0x74, 0x5A, 0xAD, 0xC1, 0x1D, 0x3E, 0xDF, 0x7D, 0x27, 0x3C, 0xB1, 0x10, 0x94, 0x8D, 0xA7, 0xAE, 0xE4, 0x49, 0xD9,
+  0xFC, 0x7F, 0x33, 0x9D, 0x3E, 0x34, 0x8E, 0xC4, 0xF2, 0x63, 0x71, 0x96, 0x5A, 0xED, 0x7D, 0x3F, 0x84, 0xCF, 0x8C, 0xFB, 0xAE, 0x9E, 0xC1, 0x8F, 0x8D, 0x86,
+  0xBD, 0xD4, 0x60, 0xA8, 0x38, 0xFD, 0xAB, 0xBB, 0x74, 0xFA, 0x59, 0x09, 0xA7, 0x9F, 0x6D, 0x38, 0xFD, 0x1E, 0xBD, 0x5D, 0x12, 0xFE, 0xAF, 0xE6, 0xF1, 0x92,
+  0xAF, 0x1C, 0x5E, 0x1F, 0xCB, 0x57, 0xAB, 0x75, 0xA7, 0x7E, 0xBF, 0xD5, 0x49, 0x7C, 0x63, 0x78, 0x75, 0x97, 0x4E, 0x92, 0x60, 0xBA, 0x85, 0xEC, 0x54, 0x84,
+  0x9D, 0xE1, 0x7E, 0xC6, 0x25, 0x96, 0x4D, 0xA9, 0x0A, 0x15, 0xBD, 0xE3, 0xA3, 0xBF, 0x9D, 0xAE, 0x48, 0x9D, 0xEE, 0x42, 0x3D, 0xD9, 0xDF, 0xF7, 0xB1, 0xE3,
+  0xC4, 0x6C, 0xA9, 0x64, 0xB8, 0x99, 0x13, 0xB3, 0xB7, 0x3F, 0xFD, 0x94, 0x2F, 0x17, 0x53, 0x7B, 0x79, 0x20, 0xB9, 0x58, 0x6A, 0xC9, 0x7B, 0xBD, 0x84, 0x1B,
+  0x48, 0x75, 0x21, 0xD3, 0x0D, 0xC0, 0x2B, 0xC3, 0x17, 0xEC, 0x98, 0x28, 0x12, 0xCB, 0x65, 0xBC, 0x99, 0xE7, 0xA7, 0xD1, 0x9A, 0x78, 0x40, 0x42, 0xFE, 0x29,
+  0xEA, 0xB6, 0x3A, 0xB8, 0xC2, 0x5E, 0x76, 0xA6, 0x4A, 0xFB, 0x44, 0xA6, 0x54, 0x78, 0xE9, 0xD0, 0xC2, 0x6A, 0x13, 0xB0, 0x95, 0xE1, 0x5B, 0x87, 0x92, 0x97,
+  0xC6, 0x55, 0x76, 0xDE, 0x94, 0xFD, 0xA0, 0x3E, 0x92, 0x6C, 0x52, 0x8E, 0x6E, 0xD4, 0x8C, 0xDD, 0xFC, 0x89, 0x7B, 0x2A, 0xB2, 0xEE, 0x9A, 0x8C, 0xC1, 0x0A,
+  0x69, 0x57, 0xBB, 0x1C, 0x86, 0x4E, 0x65, 0xD8, 0x29, 0x87, 0xA1, 0x5B, 0x19, 0x76, 0xCB, 0x61, 0xE8, 0x81, 0x1C, 0x9A, 0xBD, 0x72, 0x38, 0xFA, 0x95, 0x61,
+  0xBF, 0x1C, 0x86, 0x63, 0x90, 0x65, 0x59, 0x2A, 0x20, 0x73, 0x19, 0xE4, 0xC0, 0xB0, 0x7D, 0x2F, 0xEB, 0x5D, 0x39, 0xCF, 0x62, 0x65, 0x16, 0x76, 0x1E, 0x01,
+  0x5B, 0x19, 0xBE, 0x59, 0x99, 0x9E, 0xB1, 0x34, 0x0D, 0x98, 0xB6, 0x57, 0xBB, 0xA4, 0x41, 0xDA, 0xBD, 0x76, 0x6D, 0x8F, 0x19, 0xA6, 0xA4, 0x23, 0xDB, 0xAB,
+  0xC2, 0x3A, 0x32, 0x09, 0xD3, 0x06, 0xEA, 0xAB, 0x23, 0x1E, 0x44, 0x38, 0x73, 0x6C, 0xDB, 0x2B, 0xAC, 0x0E, 0x09, 0x0C, 0x69, 0x3E, 0x1C, 0x15, 0x8E, 0x66,
+  0x01, 0x9A, 0x22, 0x86, 0xDE, 0xDA, 0x49, 0x38, 0xD3, 0xF2, 0x85, 0xB3, 0xFD, 0xB9, 0x8F, 0xBB, 0x2E, 0x9E, 0x32, 0x08, 0x58, 0x98, 0xAD, 0xAE, 0x61, 0x86,
+  0xB8, 0x40, 0x85, 0x91, 0x6A, 0x0B, 0xDC, 0x47, 0xEB, 0xED, 0xD3, 0x7B, 0x24, 0x19, 0x39, 0x5F, 0xB4, 0xA7, 0x7A, 0x4F, 0xE5, 0xC1, 0xE4, 0x02, 0xA0, 0xF7,
+  0x49, 0xAF, 0xB8, 0x46, 0x24, 0x34, 0xE4, 0x03, 0xF8, 0xBA, 0xC3, 0x52, 0x7E, 0xA4, 0x20, 0x2B, 0xE6, 0x48, 0xE5, 0x9D, 0x26, 0xD6, 0x15, 0xDB, 0xA5, 0x33,
+  0x8B, 0x6E, 0xE9, 0xCC, 0xE2, 0xE1, 0x8D, 0x85, 0x4B, 0x7C, 0x43, 0x26, 0xB5, 0x8A, 0x25, 0x91, 0x1C, 0x56, 0x18, 0x0D, 0x7F, 0x7A, 0x60, 0xAF, 0x99, 0xBF,
+  0x24, 0x60, 0x73, 0x51, 0x31, 0xFF, 0x66, 0x8B, 0x2D, 0x13, 0x01, 0x9F, 0xD7, 0x07, 0x37, 0x0B, 0x40, 0xC2, 0x0A, 0x4F, 0x03, 0x04, 0xB0, 0x50, 0xA1, 0x1F,
+  0x89, 0x3B, 0x5A, 0xAD, 0xD8, 0x8C, 0xC0, 0xC7, 0x57, 0x70, 0xB4, 0xBB, 0xF7, 0xF4, 0xBF, 0x1B, 0x1F, 0x3C, 0xBA, 0x7B, 0x4D, 0x83, 0xE3, 0x64, 0x03, 0xF9,
+  0xBC, 0xD6, 0xBF, 0x97, 0xF0, 0xA1, 0xAC, 0x15, 0x32, 0x83, 0x63, 0x43, 0x37, 0xF5, 0xF8, 0x3C, 0x3F, 0xC7, 0xF2, 0xDF, 0x8E, 0xAB, 0x3B, 0xD7, 0x86, 0x95,
+  0xBF, 0xBA, 0xF3, 0xAB, 0x61, 0x4D, 0xEC, 0xEB, 0x7C, 0x05, 0x1E, 0xB5, 0xA3, 0xBF, 0x40, 0x81, 0x87, 0xA5, 0x07, 0xB8, 0xD2, 0xDC, 0x70, 0x32, 0xEE, 0x3E,
+  0xD8, 0x48, 0x0F, 0x18, 0xF4, 0x0D, 0x2E, 0xB0, 0x02, 0x0A, 0x97, 0xB0, 0x75, 0xEB, 0x5D, 0x67, 0x6A, 0xBF, 0x9D, 0xAA, 0xB9, 0x9A, 0xA0, 0x20, 0x5B, 0xAE,
+  0xD6, 0x8D, 0x29, 0x37, 0xDF, 0x7B, 0x05, 0xFD, 0x9F, 0x9B, 0xFC, 0xAC, 0xEF, 0x9D, 0x9F, 0xBB, 0x18, 0x80, 0xA8, 0x35, 0x29, 0x6C, 0x59, 0x08, 0x1B, 0xD8,
+  0xD5, 0xA5, 0x35, 0xD9, 0xAB, 0x55, 0xF1, 0xDE, 0x0B, 0xEB, 0xA0, 0xDD, 0x6F, 0x77, 0x1E, 0x96, 0x59, 0x21, 0x43, 0x25, 0x8C, 0x4A, 0x3B, 0xE9, 0x3D, 0xA0,
+  0x29, 0x8D, 0x3D, 0x9D, 0xF2, 0x75, 0xCD, 0x62, 0xA6, 0x25, 0xC0, 0x6F, 0xD8, 0xC3, 0xD8, 0x2E, 0xDD, 0x6F, 0xBC, 0xF2, 0x3B, 0xCF, 0x59, 0x9A, 0x51, 0x74,
+  0xD1, 0x7F, 0x58, 0xA6, 0x25, 0x38, 0x5A, 0x17, 0xE7, 0xA8, 0xFB, 0x70, 0x4C, 0xCB, 0xB3, 0x3D, 0xDD, 0x2C, 0x6C, 0x59, 0x1C, 0x1A, 0x0C, 0xEB, 0x03, 0x1E,
+  0x90, 0xF7, 0xC0, 0xE7, 0x5E, 0x8D, 0x4B, 0xF6, 0x5F, 0x3C, 0x70, 0x0D, 0xBA, 0xDD, 0x87, 0x65, 0x5D, 0x9C, 0xA5, 0x52, 0xA1, 0xAB, 0x3F, 0x78, 0x40, 0xA1,
+  0x6B, 0xE5, 0xE1, 0xD5, 0xC2, 0xA1, 0x8B, 0x83, 0x63, 0xE8, 0x62, 0x47, 0xFB, 0x37, 0x31, 0x9F, 0x82, 0xE2, 0x36, 0xD6, 0x3B, 0x69, 0x3F, 0xB0, 0x08, 0xC6,
+  0x79, 0x2A, 0x65, 0x64, 0xDD, 0x87, 0x12, 0xC4, 0xC6, 0x7A, 0xE6, 0x57, 0xF9, 0x6D, 0x64, 0xF3, 0x1C, 0x16, 0xE6, 0x70, 0xFC, 0x60, 0xAF, 0x15, 0x1B, 0xD9,
+  0xF9, 0x9D, 0x2F, 0xD4, 0xFA, 0x5C, 0x3D, 0xA4, 0xFA, 0xCC, 0xC8, 0xB0, 0xAC, 0xA2, 0x6A, 0x12, 0xB0, 0x95, 0xE1, 0x0B, 0x7E, 0xB0, 0xDF, 0x25, 0x75, 0xD1,
+  0xF9, 0xDD, 0xAF, 0xA7, 0x4B, 0xAE, 0xF6, 0xAD, 0xA6, 0x48, 0x11, 0xC3, 0xF1, 0x3F, 0xEF, 0x52, 0x11, 0x7B, 0x54, 0x83, 0xCF, 0xBD, 0x3C, 0x9C, 0x92, 0xC6,
+  0x4C, 0x5F, 0xE0, 0x33, 0xEA, 0x79, 0x8B, 0x1A, 0xAF, 0x10, 0x2C, 0x5F, 0x4D, 0x23, 0xDC, 0xD3, 0xC3, 0xAE, 0x6A, 0x0C, 0xC3, 0x2F, 0x27, 0x05, 0xC2, 0x1B,
+  0x23, 0x43, 0x77, 0xF1, 0x7D, 0x0E, 0x70, 0x4C, 0x5E, 0xC0, 0x31, 0x79, 0x6B, 0xAE, 0xFC, 0x07, 0x24, 0xE2, 0x1C, 0x42, 0xDD, 0xCF, 0x16, 0x60, 0x48, 0x7A,
+  0x38, 0x85, 0x6D, 0xE3, 0x13, 0xCF, 0xF1, 0xC1, 0x31, 0xEE, 0x5E, 0xEB, 0x75, 0x07, 0xAD, 0x0A, 0xE1, 0x59, 0xB1, 0x78, 0x7B, 0x83, 0xFB, 0x95, 0x6D, 0x6B,
+  0xD3, 0x7C, 0x02, 0xE3, 0x1C, 0x40, 0xA5, 0xD7, 0x27, 0x90, 0xD9, 0x6F, 0x99, 0xDD, 0x66, 0x9B, 0x12, 0xD1, 0xA4, 0x38, 0x5A, 0xB1, 0x86, 0x10, 0x7A, 0x9D,
+  0x2A, 0x6F, 0x1F, 0x7E, 0x0F, 0x45, 0xBB, 0x17, 0xF7, 0x9A, 0xDB, 0x78, 0x41, 0x68, 0xB1, 0x82, 0xC0, 0xDD, 0x7D, 0x77, 0xCB, 0x53, 0x5B, 0xF2, 0xA4, 0x65,
+  0xE3, 0xA9, 0x5D, 0x82, 0xA7, 0xF6, 0x9E, 0x78, 0xEA, 0x48, 0x9E, 0xDA, 0xD9, 0x78, 0xEA, 0x94, 0xE0, 0xA9, 0xB3, 0x27, 0x9E, 0xBA, 0x92, 0xA7, 0x4E, 0x36,
+  0x9E, 0xBA, 0x25, 0x78, 0xEA, 0xEE, 0x89, 0xA7, 0x9E, 0xE4, 0xA9, 0x9B, 0x8D, 0xA7, 0x5E, 0x09, 0x9E, 0x7A, 0x7B, 0xE2, 0xA9, 0x2F, 0x79, 0xEA, 0x65, 0xE3,
+  0xA9, 0x5F, 0x82, 0xA7, 0xFE, 0x9E, 0x78, 0x3A, 0x96, 0x3C, 0xF5, 0xB3, 0xF1, 0x74, 0x5C, 0x82, 0xA7, 0xE3, 0x3D, 0xF1, 0x34, 0x90, 0x3C, 0x1D, 0x67, 0xE3,
+  0x69, 0x50, 0x82, 0xA7, 0xC1, 0x9E, 0x78, 0x3A, 0x91, 0x3C, 0x0D, 0xB2, 0xF1, 0x74, 0x52, 0x82, 0xA7, 0x93, 0x3D, 0xF1, 0x84, 0xBB, 0xA9, 0x38, 0x53, 0x27,
+  0x19, 0x07, 0xDD, 0x56, 0x09, 0xAE, 0xF4, 0x7D, 0x71, 0xE5, 0xA7, 0x12, 0x5A, 0xD6, 0x5C, 0xA2, 0x4C, 0x32, 0x31, 0xDA, 0x17, 0x5B, 0x41, 0x36, 0x91, 0x31,
+  0x9D, 0xD0, 0xCA, 0xE4, 0x13, 0xE3, 0x7D, 0xB1, 0xE5, 0x27, 0x14, 0x5A, 0xC6, 0x8C, 0x42, 0x2B, 0x93, 0x52, 0x4C, 0xF6, 0xC5, 0x96, 0x9F, 0x53, 0x68, 0x19,
+  0x93, 0x0A, 0xAD, 0x4C, 0x56, 0x41, 0xF7, 0xC5, 0x96, 0x9F, 0x56, 0x68, 0x19, 0xF3, 0x0A, 0xAD, 0x4C, 0x62, 0x31, 0xDD, 0x17, 0x5B, 0x7E, 0x66, 0xA1, 0x65,
+  0x4C, 0x2D, 0xB4, 0x12, 0xB9, 0xC5, 0x49, 0x6B, 0xF7, 0x6C, 0x51, 0x4F, 0x4C, 0x91, 0x83, 0x49, 0x5B, 0xA6, 0x07, 0x8E, 0x04, 0x10, 0x3E, 0x11, 0xC7, 0x05,
+  0x72, 0x61, 0x5B, 0x53, 0x63, 0xE6, 0x17, 0x19, 0x1E, 0xCC, 0xB3, 0x31, 0xAE, 0xF2, 0x5E, 0xE7, 0xCC, 0x85, 0x86, 0xF7, 0x2F, 0x2F, 0xF3, 0x95, 0x19, 0xD4,
+  0x5E, 0xFE, 0x42, 0x45, 0x06, 0x20, 0xBB, 0xAD, 0x7E, 0x64, 0x22, 0x53, 0x5D, 0x81, 0x01, 0xE5, 0xA9, 0x28, 0xF4, 0xD4, 0x8A, 0x42, 0x3F, 0x73, 0x45, 0x81,
+  0x13, 0xB7, 0x9B, 0x5A, 0x02, 0xE0, 0xEE, 0xF0, 0x2F, 0x63, 0x64, 0x67, 0xBA, 0x53, 0x9C, 0xE9, 0x5E, 0x1E, 0xA6, 0x3B, 0x45, 0x98, 0x2E, 0xF0, 0x4C, 0x6B,
+  0x46, 0x39, 0x01, 0xBD, 0x3F, 0x18, 0x37, 0x74, 0x42, 0xFE, 0x99, 0x5D, 0x54, 0x5A, 0x71, 0x51, 0x1D, 0xE7, 0x11, 0x95, 0xB6, 0x43, 0xFB, 0xE8, 0x49, 0xBE,
+  0x7F, 0xC9, 0xCE, 0x77, 0xAF, 0x38, 0xDF, 0x9D, 0x3C, 0x7C, 0xF7, 0x76, 0xC8, 0x77, 0x57, 0xF2, 0xFD, 0x31, 0x3B, 0xDF, 0xDD, 0xE2, 0x7C, 0x77, 0xF3, 0xF0,
+  0xDD, 0xDD, 0x21, 0xDF, 0x6D, 0x08, 0x36, 0xBF, 0x7C, 0x24, 0x1F, 0xE6, 0x0E, 0x75, 0xE7, 0xDB, 0x2B, 0x71, 0x1C, 0xA2, 0xE8, 0xD8, 0xDE, 0xDB, 0xC3, 0xDC,
+  0x0D, 0x29, 0xEC, 0xA8, 0x3C, 0xB5, 0xB3, 0xF0, 0xD4, 0xC9, 0xF4, 0xE9, 0xA9, 0x78, 0x9E, 0xE2, 0x67, 0x6E, 0x5A, 0x56, 0xA6, 0x76, 0x17, 0xC3, 0x06, 0x95,
+  0xE1, 0xEB, 0x55, 0x8E, 0xF1, 0x6D, 0x50, 0xDC, 0x9E, 0x5B, 0x79, 0xEC, 0x79, 0xB0, 0x43, 0x7B, 0x3E, 0x61, 0x3C, 0x43, 0x5E, 0xE6, 0x66, 0x50, 0xFB, 0x49,
+  0x09, 0x4B, 0xD6, 0xF6, 0x61, 0xC9, 0xF8, 0x25, 0x7A, 0x64, 0xE7, 0x17, 0x64, 0x88, 0x40, 0xC6, 0x92, 0x63, 0x30, 0x3A, 0xCE, 0xA9, 0xCD, 0x41, 0xC1, 0xE8,
+  0x84, 0x34, 0xEE, 0x4C, 0x9D, 0x38, 0xF5, 0x40, 0x01, 0x7C, 0x2C, 0x20, 0x80, 0x7E, 0x71, 0x01, 0xE4, 0xCA, 0x5C, 0x90, 0xC6, 0xDD, 0x09, 0xA0, 0xC5, 0x05,
+  0xF0, 0x3E, 0x78, 0xB7, 0x79, 0x8A, 0x41, 0x97, 0xA8, 0x40, 0xF5, 0xF6, 0xB0, 0x46, 0x82, 0x91, 0x56, 0x93, 0x16, 0x0D, 0x1C, 0xE5, 0x53, 0x68, 0x5B, 0x2B,
+  0xAE, 0xD0, 0x5C, 0xF1, 0xA9, 0xBD, 0xCB, 0x04, 0xAB, 0xDD, 0x92, 0x16, 0x9D, 0x5F, 0x00, 0xAD, 0xE2, 0x02, 0xD0, 0x72, 0x09, 0xA0, 0xF5, 0xB0, 0x92, 0xF1,
+  0xFE, 0xE6, 0xE7, 0xA8, 0xB7, 0x4B, 0xAB, 0x5F, 0x7C, 0x34, 0x6B, 0xE7, 0x11, 0xD6, 0x4E, 0xBD, 0xBF, 0x13, 0x70, 0x4E, 0xFE, 0x49, 0xC2, 0x5B, 0x5F, 0xD3,
+  0xE2, 0x40, 0xA7, 0x44, 0x1C, 0xE8, 0xED, 0x65, 0x64, 0x3B, 0x89, 0xE1, 0x2C, 0x67, 0x80, 0x3F, 0x29, 0xEE, 0x0E, 0xB9, 0x34, 0x8C, 0xB4, 0xEE, 0x4E, 0xC5,
+  0xBD, 0x90, 0x20, 0x5E, 0xB0, 0xEF, 0xD0, 0x67, 0x51, 0x71, 0xAF, 0x84, 0x8A, 0x8F, 0xF7, 0xA2, 0xE2, 0x41, 0x0C, 0x67, 0x39, 0x55, 0x3C, 0x28, 0xAE, 0xE2,
+  0x5C, 0x53, 0x4B, 0x6D, 0x97, 0x39, 0x29, 0x56, 0xBB, 0x15, 0x41, 0xA8, 0xDF, 0x29, 0x49, 0x53, 0x70, 0xB7, 0x84, 0x82, 0xCB, 0xAD, 0xCF, 0xEE, 0x2E, 0x92,
+  0x1F, 0xC7, 0x7D, 0xC4, 0x7E, 0xBB, 0x1D, 0x1C, 0x17, 0x8F, 0xE5, 0xB9, 0x06, 0xBE, 0x9D, 0xA6, 0xB2, 0xD0, 0x3B, 0x64, 0x3D, 0x9B, 0xDC, 0xA7, 0x98, 0x80,
+  0x56, 0xC2, 0x04, 0x3A, 0x7B, 0xF1, 0xF1, 0x76, 0x65, 0xF8, 0x31, 0x27, 0x53, 0x65, 0xEA, 0x07, 0x85, 0xF7, 0x87, 0xEC, 0xAF, 0xF4, 0x3E, 0x5E, 0xDC, 0xE4,
+  0x2F, 0xBD, 0x5F, 0xBC, 0xF9, 0x2D, 0x5F, 0xE9, 0x5D, 0xED, 0x65, 0x7F, 0xA5, 0xF7, 0x3D, 0xBC, 0x3C, 0x0D, 0x18, 0xC3, 0x57, 0x21, 0x8D, 0x0D, 0x97, 0x75,
+  0x09, 0x82, 0x21, 0x6F, 0xE5, 0xA9, 0x2F, 0x22, 0xE5, 0x19, 0xE5, 0x70, 0xFB, 0x34, 0xEB, 0xE9, 0xA4, 0x84, 0x85, 0xA2, 0x6F, 0xF3, 0x68, 0xF6, 0xC5, 0xA7,
+  0xDC, 0x4A, 0x3C, 0x0B, 0x9C, 0xF4, 0xAE, 0x91, 0xE6, 0x71, 0x4E, 0xDC, 0x3B, 0x7F, 0xC5, 0xC0, 0x30, 0xA2, 0x28, 0x8D, 0xE9, 0x47, 0xC3, 0xF3, 0xCC, 0x75,
+  0x72, 0x06, 0x96, 0x27, 0x9A, 0x77, 0xD4, 0x52, 0x4B, 0xF6, 0x68, 0xCE, 0xC9, 0xDB, 0x4D, 0x34, 0x47, 0xDC, 0x21, 0xDE, 0x73, 0x64, 0x35, 0x1C, 0x36, 0x9F,
+  0x00, 0x46, 0x45, 0x26, 0xB2, 0x82, 0xC8, 0x58, 0x09, 0xDC, 0x89, 0x08, 0xDA, 0x4C, 0x02, 0xED, 0x88, 0xF6, 0x13, 0x02, 0x3F, 0x6B, 0x5F, 0x34, 0xEE, 0x77,
+  0xF6, 0x50, 0x9B, 0x40, 0x71, 0x85, 0x38, 0xCA, 0xA9, 0xD3, 0x76, 0x71, 0x9D, 0xE6, 0x33, 0xEA, 0xF6, 0x0E, 0xAD, 0xBA, 0xC3, 0x04, 0xD0, 0xC9, 0xAC, 0xD2,
+  0x4E, 0x09, 0x95, 0x76, 0xF6, 0xA2, 0xD2, 0x10, 0x47, 0x39, 0x55, 0xDA, 0x29, 0xAE, 0xD2, 0x76, 0x2E, 0x95, 0x76, 0x76, 0xA8, 0xD2, 0x2E, 0x13, 0x40, 0x37,
+  0xB3, 0x4A, 0xBB, 0x25, 0x54, 0xDA, 0xDD, 0x8B, 0x4A, 0x43, 0x1C, 0xE5, 0x54, 0x69, 0xB7, 0xB8, 0x4A, 0x3B, 0xB9, 0x54, 0xDA, 0xDD, 0xA1, 0x4A, 0x7B, 0x4C,
+  0x00, 0xBD, 0xCC, 0x2A, 0xED, 0x95, 0x50, 0x69, 0x6F, 0x2F, 0x2A, 0x0D, 0x71, 0x94, 0x53, 0xA5, 0xBD, 0xE2, 0x2A, 0xED, 0xE6, 0x52, 0x69, 0x6F, 0x87, 0x2A,
+  0xED, 0x33, 0x01, 0xF4, 0x33, 0xAB, 0xB4, 0x5F, 0x42, 0xA5, 0xFD, 0xBD, 0xA8, 0x34, 0xC4, 0x51, 0x4E, 0x95, 0xF6, 0x8B, 0xAB, 0xB4, 0x97, 0x4B, 0xA5, 0xFD,
+  0x1D, 0xAA, 0xF4, 0x98, 0x09, 0xE0, 0x38, 0xB3, 0x4A, 0x8F, 0x4B, 0xA8, 0xF4, 0x78, 0x2F, 0x2A, 0x0D, 0x71, 0x94, 0x53, 0xA5, 0xC7, 0xC5, 0x55, 0xDA, 0xCF,
+  0xA5, 0xD2, 0xE3, 0x1D, 0xAA, 0x74, 0xC0, 0x04, 0x30, 0xC8, 0xAC, 0xD2, 0x41, 0x09, 0x95, 0x0E, 0xF6, 0xA2, 0xD2, 0x10, 0x47, 0x39, 0x55, 0x3A, 0x28, 0xAE,
+  0xD2, 0xE3, 0x5C, 0x2A, 0x1D, 0xEC, 0x50, 0xA5, 0x27, 0x4C, 0x00, 0x27, 0x99, 0x55, 0x7A, 0x52, 0x42, 0xA5, 0x27, 0x7B, 0x51, 0x69, 0x4B, 0xE5, 0x28, 0xA7,
+  0x4A, 0x5B, 0x39, 0x55, 0xAA, 0x17, 0x9D, 0x98, 0xB6, 0xF2, 0x4E, 0x4C, 0xF7, 0x57, 0xBF, 0xD3, 0xAF, 0x47, 0x05, 0x3E, 0xF8, 0xF3, 0xFC, 0xD7, 0x17, 0xC9,
+  0x85, 0xFD, 0xC4, 0x2A, 0x5E, 0xA8, 0xAF, 0x87, 0x5E, 0xC6, 0x0B, 0x7D, 0x75, 0x1D, 0x08, 0x07, 0x2D, 0xF3, 0x97, 0x44, 0x92, 0x0D, 0xE6, 0xD3, 0x2D, 0x8D,
+  0x03, 0xE7, 0xB0, 0xB4, 0x4E, 0xB7, 0xD5, 0x2F, 0x62, 0x69, 0x82, 0xCA, 0xDD, 0x04, 0x0F, 0x44, 0x0E, 0x73, 0x71, 0xE4, 0xFD, 0x5D, 0xA6, 0x35, 0x1D, 0x0E,
+  0x10, 0x0E, 0x1F, 0xDD, 0xD6, 0x49, 0xC6, 0xF8, 0x01, 0x32, 0x48, 0xDA, 0x18, 0x7F, 0x87, 0x01, 0x04, 0x69, 0xEC, 0x70, 0xA6, 0x5E, 0x65, 0x66, 0xAA, 0x53,
+  0x86, 0xA9, 0xF6, 0x7E, 0x98, 0xEA, 0x72, 0xA6, 0x5E, 0x64, 0x66, 0xAA, 0x5B, 0x86, 0xA9, 0xEE, 0x56, 0xA6, 0x1E, 0x42, 0xA0, 0xA3, 0x63, 0x7D, 0x36, 0x2E,
+  0x10, 0xEA, 0x2E, 0x2F, 0x8E, 0x9E, 0xBF, 0xBA, 0x20, 0x6C, 0x49, 0xD3, 0x36, 0x73, 0x46, 0xBC, 0x70, 0xA7, 0x7F, 0xA9, 0x98, 0xC7, 0x48, 0x57, 0xA2, 0xDE,
+  0xAB, 0x8B, 0xAC, 0x01, 0x4F, 0x40, 0xE6, 0x09, 0x79, 0xBD, 0x56, 0xA7, 0x48, 0x85, 0xD0, 0x27, 0x72, 0x47, 0x41, 0x8F, 0xA1, 0x6F, 0x07, 0x32, 0xB8, 0xCC,
+  0x27, 0x83, 0x76, 0x71, 0x19, 0xB4, 0x72, 0xCA, 0xA0, 0xBD, 0x5B, 0x19, 0x60, 0x94, 0xBC, 0xBC, 0x20, 0x6F, 0xFF, 0x46, 0x2E, 0x6F, 0x96, 0xB6, 0xBB, 0x72,
+  0xE8, 0xD6, 0xA8, 0x22, 0xE0, 0xC2, 0x71, 0xA5, 0xDF, 0xEB, 0x75, 0xB2, 0x06, 0x96, 0x5E, 0xF2, 0x10, 0x30, 0x6D, 0x55, 0xEE, 0x98, 0xC1, 0xAE, 0xCF, 0xE0,
+  0x3B, 0x0A, 0x9A, 0xCE, 0x14, 0x37, 0x05, 0x60, 0x98, 0x43, 0xAD, 0x85, 0xDB, 0xAB, 0x33, 0x32, 0x18, 0x9F, 0x51, 0x76, 0xEE, 0x74, 0x38, 0x60, 0x54, 0xF6,
+  0x7C, 0xF6, 0x3E, 0x7E, 0x78, 0x9F, 0x8D, 0xB1, 0x5E, 0x29, 0xD5, 0x8D, 0x13, 0x55, 0x97, 0x6B, 0x50, 0x88, 0x6F, 0x74, 0x76, 0x04, 0x31, 0x76, 0x53, 0x36,
+  0x09, 0x22, 0x3B, 0x9B, 0x1A, 0x33, 0x30, 0xD8, 0x78, 0x59, 0x32, 0x19, 0xF2, 0xB7, 0x9A, 0xE2, 0x97, 0x4C, 0x1B, 0x63, 0x08, 0xF3, 0xA0, 0x7B, 0xF4, 0x2E,
+  0x29, 0xD9, 0x85, 0x3E, 0xA3, 0xC1, 0x75, 0xC2, 0x83, 0x78, 0x5A, 0x70, 0xD6, 0x39, 0x42, 0xFD, 0x8A, 0x8A, 0xCF, 0xAE, 0x92, 0xB9, 0x43, 0xA7, 0xE7, 0x95,
+  0xEF, 0x7C, 0x9C, 0xE2, 0xF1, 0x3B, 0x6C, 0x52, 0x21, 0x13, 0xFB, 0xDA, 0x32, 0x6D, 0x1D, 0x03, 0xBF, 0xBE, 0xF4, 0x80, 0xD2, 0xE6, 0x1F, 0x4B, 0x7C, 0xC3,
+  0x95, 0x8E, 0x4F, 0x6B, 0xE9, 0xD9, 0xBE, 0xBE, 0x3C, 0x36, 0x6D, 0x57, 0x4E, 0xDB, 0xF0, 0xD0, 0xFF, 0x4C, 0xEB, 0xFF, 0xFC, 0xF7, 0xB6, 0xAD, 0x02, 0xC6,
+  0x62, 0xA6, 0x08, 0xA0, 0x42, 0x5C, 0x67, 0x7C, 0x5E, 0x01, 0x4A, 0x1D, 0xDB, 0x75, 0x6D, 0xC7, 0x98, 0x19, 0x69, 0x63, 0xF3, 0x58, 0xB7, 0xAE, 0x74, 0x57,
+  0x15, 0xA0, 0xF8, 0xDC, 0x6E, 0x68, 0xC4, 0x43, 0x95, 0xF3, 0x96, 0xB9, 0x50, 0xF1, 0x8F, 0xB4, 0xE5, 0xC2, 0x94, 0x64, 0x02, 0x47, 0x71, 0x36, 0x10, 0x69,
+  0x1C, 0x93, 0x8B, 0x9C, 0xB9, 0x63, 0xC7, 0x58, 0x7A, 0xC3, 0x47, 0x13, 0x7B, 0xBC, 0x5A, 0x50, 0xCB, 0x6B, 0xEA, 0x93, 0xC9, 0xE5, 0x15, 0x1C, 0xFC, 0x84,
+  0x1F, 0x08, 0x04, 0x73, 0xA8, 0x1E, 0xBC, 0xFC, 0xFB, 0x1B, 0xCC, 0x0D, 0xF0, 0x1A, 0x28, 0x91, 0x4E, 0x0E, 0xEA, 0x64, 0xBA, 0xB2, 0xF8, 0xF0, 0x5C, 0xA5,
+  0xD8, 0xB6, 0x46, 0xBE, 0x01, 0xC6, 0x2B, 0xDD, 0x21, 0x23, 0xDD, 0xA5, 0xAF, 0x6D, 0xD7, 0x23, 0xE7, 0xC4, 0xC7, 0x68, 0xDA, 0x63, 0xB6, 0x99, 0xA4, 0xC9,
+  0x85, 0x2D, 0x5A, 0x72, 0x11, 0xFC, 0xE2, 0x98, 0xD0, 0xD4, 0x87, 0x3A, 0x24, 0x07, 0xA7, 0x03, 0xED, 0x00, 0x9D, 0xC2, 0xEF, 0x62, 0x4A, 0x61, 0xEC, 0x81,
+  0x76, 0xD5, 0x95, 0x63, 0xD6, 0xC9, 0x78, 0x54, 0xFB, 0xC6, 0xA8, 0x67, 0x97, 0xF1, 0x5A, 0x4D, 0x30, 0xD3, 0xF4, 0xE6, 0xD4, 0xAA, 0x06, 0x94, 0x39, 0xD4,
+  0x5D, 0xDA, 0x96, 0x4B, 0x39, 0x71, 0xFC, 0x3F, 0x63, 0x1A, 0x5C, 0x6F, 0xBA, 0x9E, 0xEE, 0xAD, 0x5C, 0xF2, 0xF8, 0xFC, 0x9C, 0xB4, 0x5B, 0x2D, 0xB5, 0x19,
+  0x81, 0x6E, 0xA2, 0xED, 0xEA, 0x24, 0x72, 0xE1, 0x03, 0xBD, 0xF1, 0x6A, 0x4F, 0x7D, 0x98, 0x5B, 0x42, 0x4D, 0x97, 0x86, 0x90, 0xF8, 0x00, 0xF8, 0x32, 0xBB,
+  0x6A, 0x2D, 0x4C, 0x60, 0x75, 0xA2, 0x7B, 0x7A, 0xED, 0x5B, 0x48, 0x5F, 0xD0, 0x2B, 0x50, 0x52, 0x27, 0xEC, 0xD6, 0x53, 0xE5, 0xD6, 0x6D, 0xAD, 0x09, 0x32,
+  0x04, 0x7E, 0x7D, 0x68, 0xEA, 0x38, 0x61, 0x8A, 0x19, 0x74, 0x43, 0xAB, 0x13, 0xBC, 0x13, 0x86, 0x55, 0x88, 0x7C, 0x24, 0xAF, 0x49, 0xA1, 0xA5, 0xA3, 0x8D,
+  0x41, 0xC9, 0xD1, 0xDD, 0x86, 0x54, 0x04, 0x51, 0xF0, 0x1D, 0x9D, 0x81, 0xC4, 0x66, 0x75, 0x11, 0x14, 0xEB, 0x2C, 0x22, 0xD6, 0x79, 0x30, 0x55, 0xB4, 0x76,
+  0x74, 0x04, 0x71, 0xC6, 0xB5, 0x4D, 0x0A, 0x56, 0x31, 0xAB, 0x1E, 0x88, 0x0F, 0xD0, 0x82, 0x45, 0x1D, 0xB4, 0x6E, 0x0E, 0x0E, 0x01, 0x41, 0xD3, 0xB3, 0xDF,
+  0x7B, 0x8E, 0x61, 0xCD, 0xAA, 0x5A, 0xBF, 0x16, 0x60, 0x63, 0xB7, 0x11, 0x65, 0xE4, 0x3E, 0xBB, 0xCE, 0x3A, 0x89, 0xDE, 0xA8, 0x8A, 0xEB, 0x87, 0x07, 0xB5,
+  0x03, 0x41, 0x3C, 0x3B, 0x07, 0x73, 0xAB, 0xF2, 0x83, 0x27, 0x8C, 0xC6, 0x1A, 0x39, 0x3B, 0x13, 0xDD, 0xF0, 0x56, 0x78, 0x11, 0x1A, 0xB1, 0x9F, 0xC8, 0x2D,
+  0xDF, 0x14, 0x7F, 0xFF, 0xFE, 0x9B, 0xB4, 0xD9, 0xDB, 0x23, 0xA0, 0xFA, 0x19, 0x8E, 0x0B, 0xDF, 0x7F, 0x83, 0xBF, 0xB7, 0x4F, 0xD8, 0x50, 0xF0, 0xFD, 0x37,
+  0xFC, 0xB9, 0x7D, 0x02, 0x3D, 0xC1, 0x31, 0xEB, 0xEF, 0xF6, 0x77, 0x26, 0x87, 0x4D, 0xE9, 0xCD, 0x12, 0xA5, 0xE7, 0x8B, 0x2D, 0x37, 0x4D, 0xB3, 0x14, 0xA2,
+  0x7E, 0x0F, 0xFC, 0xB7, 0x3A, 0xB6, 0x27, 0xA0, 0x1E, 0x0F, 0x2C, 0x59, 0x2A, 0xDD, 0x04, 0x95, 0x48, 0x41, 0xB5, 0xA4, 0xD2, 0x8D, 0x29, 0x6B, 0x49, 0x84,
+  0xAB, 0x04, 0x06, 0x22, 0x5B, 0x2E, 0x75, 0xC7, 0xA5, 0x3F, 0x5A, 0x5E, 0xD5, 0x0B, 0x39, 0x45, 0x82, 0xC4, 0x87, 0xC3, 0x10, 0x0B, 0xF8, 0x1F, 0xC0, 0x41,
+  0xBB, 0x03, 0xA1, 0x34, 0xDF, 0xD8, 0xC4, 0x6F, 0xC4, 0x6C, 0x5E, 0xE5, 0x32, 0x9B, 0x2A, 0x13, 0x9B, 0xDF, 0x67, 0x2D, 0x8F, 0x09, 0x01, 0x59, 0x8A, 0x01,
+  0x31, 0x87, 0x08, 0x44, 0xC6, 0x2F, 0x26, 0x38, 0xC4, 0x6F, 0x63, 0xF3, 0x6B, 0xF5, 0x06, 0xFE, 0x44, 0x63, 0xD6, 0x86, 0xAE, 0xB0, 0xD1, 0x33, 0xFC, 0x03,
+  0x0A, 0xC2, 0x9F, 0x44, 0x43, 0x01, 0xAC, 0x6F, 0x4D, 0xB3, 0xCA, 0xBF, 0x7A, 0x07, 0x36, 0xB2, 0x82, 0x78, 0xE8, 0xAE, 0x31, 0x32, 0xD9, 0xB6, 0xF7, 0xA5,
+  0x4E, 0x96, 0x0E, 0x10, 0xC6, 0x3E, 0xF0, 0x02, 0xC7, 0x80, 0x88, 0x5A, 0xFC, 0x77, 0x2B, 0x05, 0x4B, 0xD3, 0x7C, 0xC6, 0xB1, 0x02, 0x09, 0xFC, 0x00, 0x4C,
+  0x66, 0x85, 0xA6, 0x0B, 0x7F, 0x6F, 0x9F, 0x40, 0x27, 0x70, 0x08, 0x7F, 0x6F, 0x9F, 0x60, 0x57, 0x68, 0x54, 0xD8, 0xE3, 0xED, 0x13, 0xE8, 0x11, 0x4E, 0xE0,
+  0x2F, 0xB4, 0xC1, 0x7E, 0xB1, 0x15, 0xFE, 0xC2, 0x1D, 0xD6, 0x3F, 0xDE, 0x64, 0x07, 0xFC, 0x82, 0x38, 0x4D, 0x63, 0x90, 0xBF, 0xF2, 0xBF, 0xCA, 0x5E, 0xC1,
+  0xFE, 0xE5, 0x06, 0xD8, 0x61, 0x07, 0x6B, 0x88, 0x41, 0xD6, 0x04, 0xCF, 0xF1, 0x67, 0x2D, 0x15, 0x8C, 0x17, 0xC4, 0x11, 0x5C, 0x63, 0xAF, 0xA9, 0xC5, 0x4B,
+  0xFC, 0x00, 0x5B, 0xB1, 0x97, 0x8A, 0xB2, 0x56, 0xFC, 0x08, 0xAE, 0x89, 0x57, 0x51, 0xD6, 0x89, 0x78, 0xD9, 0xE1, 0x56, 0xE1, 0x04, 0x2F, 0x23, 0x7C, 0xE6,
+  0xDE, 0x20, 0x83, 0x9C, 0x34, 0x94, 0x8A, 0x7F, 0xB6, 0xBE, 0x7D, 0x42, 0xF1, 0x1E, 0x23, 0x12, 0x8E, 0xD7, 0xE2, 0x18, 0xAE, 0x03, 0x7D, 0x78, 0x47, 0x12,
+  0xCC, 0x2E, 0xAC, 0x83, 0x0B, 0xD0, 0xC2, 0xC3, 0xFB, 0x82, 0x78, 0x38, 0x5B, 0xFB, 0x67, 0x08, 0xCD, 0x60, 0x05, 0x1B, 0x70, 0xBA, 0x0E, 0x4E, 0xE1, 0x2E,
+  0xF2, 0x82, 0x0A, 0x10, 0x3C, 0xDD, 0x3E, 0x11, 0x3C, 0xA1, 0x16, 0xF9, 0x51, 0x58, 0xD4, 0xF0, 0x17, 0xFD, 0xC8, 0x13, 0x01, 0xFB, 0xA3, 0xF4, 0x4E, 0x6A,
+  0xD6, 0xC8, 0xF9, 0x50, 0xC4, 0x7D, 0x0C, 0x00, 0xE0, 0x51, 0x70, 0x9D, 0x9A, 0x4D, 0xDD, 0x03, 0x87, 0x80, 0x64, 0x8E, 0xBA, 0x4D, 0x8C, 0x28, 0xBE, 0x9B,
+  0x6F, 0xDC, 0x6A, 0x5A, 0xE0, 0x16, 0x0C, 0x61, 0xED, 0x54, 0x84, 0x0D, 0x44, 0xC4, 0xB9, 0xDC, 0xC0, 0xC5, 0x2F, 0x27, 0xA1, 0xE3, 0x77, 0x13, 0x30, 0x8A,
+  0x50, 0x18, 0x86, 0xC0, 0x8B, 0x49, 0xD8, 0xD8, 0xA8, 0xA1, 0xE0, 0x6A, 0xF7, 0x7A, 0x01, 0xB6, 0x48, 0xA4, 0xE3, 0x13, 0x5D, 0x14, 0x48, 0x13, 0x27, 0x0D,
+  0xC1, 0x50, 0x38, 0x06, 0x73, 0x20, 0x07, 0x72, 0x96, 0x7B, 0x70, 0xBA, 0x11, 0xE1, 0x00, 0x42, 0x54, 0x35, 0xC8, 0x33, 0x4E, 0xE3, 0x69, 0x10, 0x3E, 0x09,
+  0x19, 0x41, 0xB2, 0xF3, 0xF5, 0x69, 0x08, 0x19, 0x9B, 0x8F, 0xF8, 0x98, 0xF8, 0x35, 0x4C, 0x14, 0x22, 0x97, 0xF8, 0x1E, 0xC0, 0x86, 0x6D, 0xD1, 0xF8, 0x5E,
+  0x43, 0xF1, 0x52, 0x74, 0x24, 0xCE, 0x26, 0x74, 0xAA, 0xAF, 0x4C, 0x2F, 0x00, 0x73, 0x28, 0x64, 0xDF, 0x96, 0x08, 0x5B, 0x7C, 0xE6, 0xB1, 0x75, 0xE8, 0x4E,
+  0x19, 0x2A, 0xE4, 0xA8, 0xF0, 0x38, 0x3A, 0x2A, 0x80, 0x55, 0x3A, 0x5E, 0xF5, 0xE0, 0xD2, 0x71, 0x6C, 0xE7, 0xD3, 0xC1, 0x21, 0x36, 0x3A, 0x3C, 0xF8, 0x7C,
+  0x4A, 0x58, 0x3C, 0xAD, 0x85, 0x83, 0xBB, 0x12, 0x3E, 0x8F, 0x8E, 0xC8, 0x73, 0xCF, 0xD3, 0x41, 0x01, 0x58, 0xF8, 0x99, 0xA3, 0x7C, 0x88, 0x2E, 0x92, 0x40,
+  0xDB, 0x41, 0xA3, 0x64, 0x1F, 0xAD, 0x06, 0xAE, 0x29, 0x26, 0x96, 0x2E, 0x80, 0xC8, 0x24, 0x93, 0xA1, 0x6A, 0xFE, 0xE7, 0x8A, 0x3A, 0xEB, 0xF7, 0x4C, 0x60,
+  0xB6, 0xF3, 0x1C, 0x42, 0xE5, 0x41, 0x33, 0x98, 0xBC, 0x1D, 0xF0, 0x9C, 0xA7, 0x09, 0xA8, 0x2E, 0xA1, 0x0F, 0xD0, 0x71, 0x60, 0xF3, 0x32, 0x37, 0x14, 0x7A,
+  0x87, 0x71, 0xEE, 0x5C, 0x28, 0x23, 0x9A, 0x64, 0x41, 0x0B, 0xDB, 0xFA, 0x4A, 0xD7, 0xAB, 0x25, 0x88, 0x3F, 0x48, 0x9B, 0x22, 0x89, 0x9C, 0x90, 0x0E, 0x6D,
+  0x42, 0xCB, 0x0B, 0x31, 0x70, 0x6A, 0x9D, 0x98, 0x46, 0x81, 0x0A, 0x98, 0x75, 0xA2, 0x27, 0x3E, 0xDD, 0x68, 0x74, 0xFB, 0x28, 0xFE, 0x2C, 0x26, 0xE5, 0x14,
+  0x04, 0x0A, 0xE1, 0x81, 0x6B, 0x33, 0xC7, 0x8E, 0xF4, 0x10, 0x49, 0x07, 0x21, 0x19, 0x0C, 0x22, 0xC3, 0x6A, 0x09, 0xC9, 0x27, 0x0D, 0x07, 0x07, 0xDF, 0x16,
+  0xE4, 0xCD, 0x85, 0xED, 0xD1, 0x48, 0xC4, 0x30, 0x2C, 0xC3, 0x33, 0x74, 0xF3, 0x63, 0x60, 0x8D, 0x3B, 0x75, 0xFF, 0x6A, 0x29, 0xFF, 0xDF, 0xC8, 0xF9, 0xB2,
+  0xE5, 0x29, 0x1B, 0x16, 0xE2, 0xC7, 0x83, 0xC0, 0x4A, 0x54, 0x39, 0x84, 0xC2, 0xC2, 0xA3, 0xB0, 0xE7, 0x3E, 0x7E, 0xCC, 0x8E, 0x1E, 0xF9, 0x4A, 0x93, 0xD1,
+  0xE3, 0x9C, 0x04, 0x37, 0x22, 0x0A, 0xDE, 0xC4, 0x1D, 0xC1, 0x21, 0x91, 0x2B, 0x18, 0x22, 0x81, 0x7F, 0x09, 0xE9, 0x0D, 0xDA, 0xC2, 0xFF, 0x8F, 0xFA, 0x0F,
+  0x28, 0xEA, 0xEF, 0x2E, 0xC4, 0x67, 0x9F, 0xF5, 0x70, 0xB8, 0xF8, 0x7C, 0xFA, 0x10, 0x12, 0xED, 0xF8, 0x24, 0xD9, 0x0F, 0xDD, 0xFE, 0x64, 0x1F, 0x26, 0x33,
+  0x97, 0x3C, 0x3C, 0xBF, 0x58, 0xFF, 0x38, 0xA9, 0x1E, 0xF8, 0xAF, 0x59, 0x3A, 0xA8, 0x61, 0x5C, 0x32, 0x8D, 0xF1, 0x57, 0x3F, 0x2C, 0x05, 0x96, 0x07, 0x29,
+  0x0D, 0x66, 0xFF, 0x38, 0xB1, 0x36, 0xC6, 0xC2, 0x54, 0x5F, 0xBE, 0x7B, 0xFE, 0xE6, 0xCB, 0xF3, 0x0F, 0x1F, 0xDE, 0x91, 0x15, 0xD8, 0xAC, 0xD6, 0xFF, 0x82,
+  0x69, 0x0B, 0x4C, 0x02, 0x9C, 0x2F, 0x40, 0x9F, 0xFB, 0x85, 0x21, 0x6D, 0x7D, 0xFA, 0xFC, 0xA9, 0xFD, 0x19, 0x40, 0xBF, 0xFD, 0x87, 0x75, 0xC0, 0x19, 0x41,
+  0x54, 0x87, 0x80, 0x0B, 0x8F, 0xBF, 0x1D, 0x1C, 0x4A, 0x83, 0xAF, 0x26, 0x53, 0xE8, 0xBF, 0xF3, 0xF7, 0xA0, 0x06, 0xAC, 0xDE, 0xD6, 0x01, 0x15, 0x4F, 0x07,
+  0x61, 0xCC, 0xA9, 0x62, 0xA9, 0xC2, 0x80, 0x0E, 0xB4, 0xA7, 0xF0, 0x73, 0x46, 0xB4, 0x63, 0xF8, 0x3D, 0x3C, 0x0C, 0x4C, 0xA4, 0x60, 0x77, 0x07, 0x87, 0x06,
+  0xEB, 0x0C, 0x66, 0x27, 0x55, 0xE3, 0x0C, 0x24, 0xF9, 0xEC, 0xA0, 0x7E, 0x70, 0x7A, 0x70, 0x00, 0xD7, 0x64, 0xF7, 0xB7, 0x21, 0x76, 0x6E, 0x9F, 0xFA, 0x1C,
+  0xF2, 0xD1, 0x15, 0x6E, 0x04, 0xE2, 0x57, 0xB3, 0xBA, 0x17, 0xBC, 0xF4, 0x76, 0x9E, 0xAC, 0x13, 0xFE, 0x8A, 0xED, 0x19, 0x1B, 0x10, 0x55, 0x98, 0x14, 0x05,
+  0xF1, 0xD0, 0xE0, 0xFB, 0x5A, 0x22, 0x6A, 0x36, 0xDC, 0x4E, 0x26, 0x0E, 0x68, 0x9B, 0x59, 0x4B, 0x6D, 0xC3, 0x85, 0xB3, 0xE1, 0xC0, 0xC6, 0x31, 0x38, 0x36,
+  0xA6, 0x9B, 0xA9, 0x48, 0x58, 0x6B, 0x05, 0xCB, 0x46, 0xC2, 0xD3, 0xBA, 0xBF, 0x5C, 0x87, 0x6B, 0x6C, 0x96, 0x51, 0x63, 0x33, 0x45, 0x63, 0xB3, 0xBB, 0xD5,
+  0x98, 0x40, 0x5D, 0x5A, 0x6B, 0x12, 0xCF, 0x16, 0xCD, 0x6D, 0x85, 0x17, 0x4A, 0x13, 0xDA, 0x9A, 0xC5, 0x69, 0xAB, 0x88, 0x9A, 0x78, 0xEC, 0x82, 0x49, 0x11,
+  0x75, 0x5E, 0x7F, 0x78, 0xF3, 0x13, 0x46, 0x9B, 0x78, 0x95, 0xF9, 0x1A, 0x8B, 0x26, 0x57, 0x31, 0x18, 0x30, 0x28, 0x86, 0x2A, 0x1F, 0x91, 0xB0, 0x49, 0x82,
+  0x0A, 0xC2, 0x16, 0x43, 0x10, 0x05, 0x83, 0x6C, 0xBE, 0x8B, 0x45, 0x02, 0xE9, 0xBC, 0x01, 0x54, 0x8A, 0x2D, 0x20, 0x40, 0x26, 0x25, 0x72, 0xCC, 0x1B, 0x0E,
+  0xA3, 0xD4, 0x32, 0xF6, 0xEE, 0x22, 0xCC, 0x5F, 0xDD, 0xAC, 0x41, 0x4D, 0x4E, 0xD5, 0x83, 0xD8, 0xE6, 0x6E, 0x95, 0x8E, 0x98, 0xD0, 0x67, 0x12, 0x90, 0xF8,
+  0xD4, 0x5D, 0x8C, 0x81, 0x8B, 0x42, 0x40, 0x0E, 0x2C, 0xEB, 0x18, 0x2C, 0xAC, 0x80, 0x90, 0x09, 0x07, 0xFB, 0x3C, 0x5A, 0x02, 0x86, 0x75, 0x66, 0x0C, 0x71,
+  0x34, 0xC8, 0x52, 0x45, 0x26, 0x24, 0xF2, 0x5B, 0x5A, 0xC9, 0x78, 0xD6, 0x79, 0xF0, 0xC4, 0xD1, 0x23, 0x4A, 0x23, 0x99, 0xD0, 0x88, 0xAF, 0x2F, 0x25, 0x62,
+  0x59, 0xE7, 0xC0, 0x12, 0x2B, 0x1B, 0x51, 0x8A, 0xC9, 0xC6, 0x93, 0xF8, 0x4E, 0x4F, 0x32, 0x9E, 0x75, 0x1E, 0x3C, 0x71, 0xF4, 0x88, 0xCA, 0x4F, 0xAA, 0x63,
+  0xF0, 0x26, 0x00, 0x2C, 0x52, 0xD5, 0x67, 0x9A, 0x9A, 0x59, 0x8B, 0x42, 0x51, 0x1A, 0x06, 0xD1, 0x24, 0x8A, 0x41, 0x46, 0x87, 0x7B, 0x28, 0xD9, 0xDD, 0x47,
+  0x14, 0x7A, 0x6B, 0x9A, 0xD9, 0xA2, 0xD0, 0xD2, 0x34, 0x65, 0xF8, 0xF1, 0x61, 0x12, 0xC2, 0x0F, 0x5B, 0x32, 0x63, 0xF5, 0xD6, 0x54, 0xF9, 0xB3, 0x16, 0x1C,
+  0xEF, 0xA6, 0x12, 0x11, 0xC7, 0x62, 0x65, 0x66, 0xB2, 0x24, 0x68, 0x27, 0xD0, 0xA8, 0x86, 0xC4, 0x96, 0xE3, 0xD6, 0x6E, 0xB6, 0xD0, 0xB5, 0x76, 0x13, 0x30,
+  0xB0, 0x92, 0x70, 0xB6, 0xDC, 0x0C, 0x5A, 0x26, 0x20, 0x59, 0x3A, 0xD9, 0xD2, 0x3B, 0x68, 0x97, 0xC4, 0x08, 0xD6, 0x9F, 0xB3, 0xB1, 0x22, 0x3F, 0x85, 0x1E,
+  0x47, 0x07, 0xAB, 0x5A, 0xA7, 0x29, 0x45, 0x7C, 0x72, 0x3A, 0x49, 0x23, 0xCB, 0xAC, 0x43, 0xAE, 0xFC, 0x28, 0x73, 0xCC, 0xB0, 0x5B, 0xB0, 0xD8, 0xBF, 0x7F,
+  0xE7, 0xD0, 0xAF, 0x68, 0x06, 0xD7, 0xF0, 0xB7, 0x0B, 0x88, 0xEC, 0x2E, 0x00, 0x4B, 0xF1, 0x0E, 0xD7, 0x5E, 0x39, 0x63, 0xB4, 0x89, 0x4F, 0x57, 0x06, 0xBD,
+  0x06, 0x6E, 0x0C, 0x93, 0x7E, 0x64, 0x47, 0x98, 0x0B, 0xE2, 0xD1, 0xE7, 0xE6, 0x14, 0x02, 0x50, 0xF5, 0x0A, 0xE1, 0x1E, 0x5F, 0x35, 0xD9, 0x6A, 0x3A, 0x2E,
+  0x5E, 0x37, 0xC5, 0x8E, 0x06, 0xB7, 0x7A, 0xC0, 0x97, 0xD6, 0x61, 0x7A, 0x47, 0xFE, 0xEB, 0xBF, 0x08, 0xE2, 0x09, 0xF4, 0x24, 0x16, 0xE5, 0x15, 0xBA, 0xC7,
+  0x30, 0xBD, 0xF6, 0xA8, 0x20, 0xBD, 0x5A, 0xE1, 0x0D, 0x2A, 0x42, 0x06, 0xFC, 0xAC, 0xC9, 0xF6, 0xE9, 0x01, 0x10, 0xA7, 0x8E, 0x9F, 0x86, 0x1A, 0xCC, 0x29,
+  0x7B, 0x3B, 0x8A, 0xDF, 0x82, 0x9F, 0xF3, 0x26, 0x7E, 0x4F, 0x23, 0x7B, 0xB2, 0x6E, 0xEA, 0xCB, 0x25, 0x04, 0xC8, 0x8B, 0xB9, 0x61, 0x4E, 0xAA, 0x1C, 0x58,
+  0x31, 0x43, 0x64, 0x81, 0xB2, 0x95, 0x31, 0x81, 0x17, 0x84, 0x7A, 0xC1, 0xAF, 0x55, 0x0F, 0xDA, 0x13, 0xB9, 0x2E, 0x25, 0x9A, 0x35, 0x27, 0x8E, 0x7E, 0xFD,
+  0x23, 0xEE, 0xE6, 0xA8, 0xF2, 0x6E, 0xEB, 0xAD, 0x7A, 0x4B, 0x34, 0xF1, 0x9C, 0xB5, 0x9F, 0xCB, 0x22, 0x66, 0x5C, 0x62, 0xFE, 0xE5, 0xDD, 0x4F, 0x01, 0x66,
+  0xCF, 0x7E, 0xC9, 0x2F, 0x55, 0x0F, 0xD8, 0x86, 0x90, 0xA3, 0x3F, 0x96, 0x38, 0xE1, 0x90, 0xAA, 0x57, 0x94, 0x85, 0x7B, 0x3D, 0x50, 0x60, 0xBC, 0xF9, 0x53,
+  0x15, 0x29, 0x5C, 0xB6, 0xE8, 0x35, 0x01, 0x4C, 0xB4, 0x1A, 0x07, 0x2A, 0x77, 0x82, 0x20, 0x38, 0xF2, 0xF2, 0xC3, 0xCA, 0x34, 0xFF, 0x49, 0x75, 0x07, 0xB4,
+  0x7E, 0x48, 0xAA, 0x95, 0x56, 0xE5, 0xB0, 0xCA, 0xAE, 0xBF, 0x01, 0x86, 0xE6, 0xD5, 0xDA, 0xA1, 0x56, 0xAB, 0x35, 0x5D, 0xB0, 0x0C, 0x5A, 0x6D, 0xB4, 0x65,
+  0x13, 0xF8, 0x61, 0x6D, 0x78, 0x27, 0xC9, 0xF7, 0x5F, 0x83, 0x08, 0xDC, 0xB4, 0x06, 0x6F, 0x0C, 0x0B, 0x4B, 0x45, 0x69, 0x4D, 0xDE, 0x53, 0x10, 0xED, 0x64,
+  0xA3, 0x49, 0x85, 0x6D, 0x60, 0x11, 0x45, 0x16, 0xC2, 0x96, 0xD0, 0x49, 0x55, 0xAD, 0x1B, 0x89, 0xC5, 0x4A, 0x8A, 0xEE, 0x54, 0x95, 0x71, 0xE5, 0x56, 0x35,
+  0x10, 0x08, 0x0C, 0x60, 0x02, 0x3F, 0x83, 0x9F, 0x35, 0x1D, 0xBA, 0xB0, 0xAF, 0xE8, 0x86, 0x05, 0x60, 0x73, 0xDF, 0xC5, 0xC0, 0x82, 0x79, 0x31, 0x28, 0xF0,
+  0x0E, 0xAC, 0x3D, 0xF9, 0xB6, 0x0E, 0xB3, 0xB7, 0xC0, 0xCC, 0x05, 0xB0, 0x70, 0xCE, 0xB9, 0x7D, 0x9D, 0x06, 0xC9, 0x7B, 0x8F, 0x00, 0xFB, 0xD0, 0x13, 0xC3,
+  0xD5, 0x47, 0xE6, 0xF6, 0xAE, 0x45, 0xBB, 0x89, 0x28, 0xB2, 0x43, 0x03, 0x79, 0x05, 0x40, 0x3D, 0x87, 0x55, 0x23, 0x15, 0xB4, 0xD4, 0xDA, 0x86, 0x55, 0x92,
+  0x95, 0x8A, 0x78, 0xAA, 0xC3, 0x14, 0x2D, 0x8C, 0x99, 0x97, 0xA8, 0x73, 0x14, 0xAF, 0xD5, 0xCB, 0x00, 0x11, 0x3E, 0x05, 0x73, 0x06, 0x0B, 0x25, 0xCF, 0x18,
+  0x0B, 0xE4, 0x34, 0x74, 0x37, 0xB6, 0xF4, 0xFD, 0xD7, 0xAD, 0x13, 0xFB, 0x94, 0x87, 0x24, 0xF0, 0xE4, 0x49, 0x18, 0x1B, 0x6E, 0x96, 0xE1, 0xC3, 0x94, 0xDF,
+  0x1B, 0x6F, 0xCF, 0xDF, 0x9C, 0x1E, 0xAC, 0x5F, 0x08, 0x92, 0x60, 0xC0, 0x79, 0x1C, 0x12, 0xBC, 0x32, 0x12, 0x01, 0x21, 0xC6, 0x84, 0x09, 0x08, 0x37, 0xE4,
+  0x55, 0x36, 0x76, 0x15, 0x3C, 0x63, 0x56, 0x5F, 0xA5, 0x62, 0x3F, 0x66, 0x0D, 0xE4, 0x8F, 0xC6, 0x1C, 0x5C, 0x08, 0xCF, 0xD4, 0x23, 0x18, 0x67, 0x21, 0x8C,
+  0xC8, 0x58, 0x84, 0x6E, 0xBE, 0xAF, 0x80, 0x61, 0x9C, 0xC1, 0x30, 0x71, 0x41, 0x0D, 0x4C, 0x32, 0x6B, 0xCA, 0x5D, 0xD6, 0x3D, 0x20, 0xC2, 0xBD, 0x92, 0xB5,
+  0xB4, 0x55, 0x97, 0xA3, 0x23, 0xD6, 0x34, 0x01, 0x0D, 0xEB, 0x62, 0x13, 0x4D, 0x2A, 0xF5, 0xD7, 0xA3, 0x2F, 0x88, 0x2D, 0x4E, 0x28, 0x0C, 0xDD, 0xF5, 0x08,
+  0xC5, 0xC1, 0x7A, 0x85, 0xC3, 0x34, 0x54, 0x53, 0x7D, 0x4C, 0xBF, 0x38, 0x10, 0xC7, 0x66, 0x96, 0xF1, 0x27, 0x8D, 0x43, 0xC8, 0x9D, 0xB1, 0x4A, 0x2D, 0xC7,
+  0x96, 0xE9, 0x2A, 0x22, 0x17, 0x7E, 0x16, 0xBE, 0x1E, 0x4E, 0x04, 0x36, 0x16, 0xF0, 0x55, 0x5B, 0xE0, 0x0B, 0x0C, 0xDF, 0xC2, 0x15, 0xA0, 0xBB, 0xAC, 0xB7,
+  0x6B, 0x58, 0x6C, 0x8F, 0xAD, 0x8A, 0x97, 0x2C, 0xB5, 0xA7, 0xE0, 0xE4, 0xFB, 0x1A, 0xA3, 0x48, 0x57, 0xA3, 0x85, 0xE1, 0xC5, 0x20, 0x3C, 0xD0, 0x0E, 0xF2,
+  0x54, 0xED, 0x55, 0x4F, 0xE4, 0xD1, 0x8C, 0x2D, 0x68, 0x02, 0xA2, 0xD0, 0x86, 0x84, 0x31, 0xDF, 0xA8, 0xFF, 0x0C, 0x46, 0x5C, 0xDC, 0x66, 0x80, 0xAA, 0x8E,
+  0x6C, 0x34, 0x7A, 0xA4, 0xEC, 0x90, 0x63, 0x28, 0xC2, 0x7B, 0xE4, 0xE4, 0xBE, 0xB4, 0xF0, 0xFA, 0xA7, 0xBA, 0xC3, 0xE6, 0x77, 0x87, 0x02, 0x9C, 0x8B, 0xB3,
+  0x66, 0xF2, 0xFD, 0x37, 0x86, 0xE2, 0x96, 0x40, 0x9A, 0x65, 0xB8, 0x73, 0x3A, 0x61, 0x33, 0x3C, 0x6F, 0xE5, 0x9E, 0x12, 0xDC, 0x5C, 0x14, 0xDA, 0x13, 0x77,
+  0xFB, 0x7B, 0x4D, 0xDD, 0x61, 0x16, 0x59, 0xD5, 0x15, 0x6C, 0x6F, 0xAC, 0xEE, 0x66, 0x59, 0xC7, 0x15, 0xB0, 0x99, 0xD6, 0x72, 0xE3, 0x96, 0x40, 0xA3, 0x51,
+  0xCA, 0x5F, 0xF9, 0xCC, 0xD0, 0x37, 0xDB, 0x70, 0x9A, 0xA5, 0xCB, 0x98, 0x1C, 0xD6, 0x8F, 0x23, 0xD0, 0x22, 0x18, 0xF3, 0x23, 0x7E, 0x54, 0x13, 0x72, 0x02,
+  0x13, 0x99, 0xC8, 0x78, 0xCB, 0x8D, 0x08, 0xD7, 0xB8, 0xB9, 0x1E, 0x43, 0x26, 0xC0, 0xA5, 0x2D, 0x84, 0xBD, 0x7D, 0xE3, 0xA3, 0x58, 0xDC, 0xF1, 0x95, 0xF5,
+  0x87, 0x0B, 0xB3, 0x03, 0x5F, 0x04, 0x71, 0x38, 0xB0, 0x03, 0x05, 0x41, 0x48, 0x44, 0xB9, 0x54, 0x94, 0xBA, 0xE4, 0x1E, 0x0C, 0x1F, 0x72, 0x6D, 0x9A, 0xDB,
+  0x16, 0xFD, 0xC4, 0xAC, 0xFA, 0x73, 0x9D, 0x8F, 0xF0, 0x4A, 0xD0, 0xAC, 0xE5, 0x21, 0x68, 0x63, 0xED, 0x7F, 0x2B, 0x31, 0x77, 0xB6, 0x0A, 0xAA, 0x6C, 0x02,
+  0x60, 0xF8, 0xCE, 0x49, 0x6B, 0x63, 0xF5, 0x5F, 0x5D, 0xAA, 0x8B, 0x5F, 0xEA, 0x0F, 0x2F, 0xC6, 0x2B, 0xE2, 0x89, 0x5D, 0xA6, 0x4B, 0x14, 0x17, 0xB7, 0x2F,
+  0x1E, 0x51, 0x70, 0xF6, 0x93, 0x3A, 0x4B, 0x63, 0xDB, 0x72, 0x99, 0xBC, 0x02, 0x80, 0x0B, 0x7F, 0x6F, 0xF8, 0x56, 0xC8, 0x60, 0x1F, 0xB9, 0x82, 0x83, 0xCD,
+  0xFA, 0xB2, 0xAD, 0x72, 0x88, 0x09, 0xA2, 0x02, 0x8A, 0x58, 0xB7, 0xC3, 0xCA, 0x07, 0x84, 0xA2, 0xE4, 0xAB, 0xA3, 0x57, 0x1A, 0x3C, 0x1B, 0x26, 0x79, 0x63,
+  0x05, 0x9A, 0x79, 0xFE, 0x76, 0x60, 0x75, 0x47, 0xFA, 0x81, 0x22, 0x6C, 0x39, 0x59, 0xCD, 0x20, 0x36, 0xB6, 0xAB, 0x5C, 0xE9, 0x59, 0xCE, 0x6E, 0x33, 0x80,
+  0xF2, 0x15, 0x97, 0x20, 0x65, 0xA7, 0xA6, 0xA7, 0x7F, 0x40, 0x74, 0x69, 0xB0, 0xAC, 0xD5, 0x97, 0xB8, 0x5E, 0x33, 0xCB, 0xDA, 0xEF, 0x17, 0xBD, 0x06, 0xBC,
+  0xC3, 0x73, 0x9F, 0x8F, 0x6C, 0x07, 0x27, 0xAB, 0x98, 0x34, 0x2B, 0xE5, 0x01, 0xCF, 0x5E, 0xBE, 0x67, 0xA4, 0x46, 0x62, 0xE3, 0x35, 0x2B, 0x1C, 0x36, 0xF1,
+  0xBE, 0x9C, 0x2D, 0x62, 0x9E, 0x16, 0xA0, 0x0A, 0x02, 0x50, 0x70, 0xAD, 0xA9, 0xE3, 0xDF, 0x6A, 0x6D, 0xE3, 0x86, 0xEC, 0x37, 0x70, 0x23, 0xD5, 0x76, 0xC2,
+  0x0B, 0x37, 0xEF, 0xB1, 0x44, 0x49, 0x38, 0x51, 0x07, 0xFE, 0x0E, 0xDB, 0xB8, 0x96, 0x3F, 0x19, 0x57, 0x94, 0xBC, 0x41, 0x4E, 0x23, 0x35, 0x0F, 0xC8, 0xC2,
+  0x84, 0x7E, 0xD4, 0x40, 0x92, 0x56, 0xA5, 0x10, 0x71, 0x87, 0x15, 0x2A, 0xAE, 0x58, 0x72, 0x46, 0x4D, 0x99, 0xCF, 0x5D, 0xF9, 0xE9, 0xDC, 0x55, 0x8D, 0xB3,
+  0xC6, 0x2F, 0xAB, 0xCE, 0x17, 0x99, 0x9A, 0xCD, 0x61, 0xB0, 0xA0, 0xCE, 0xA5, 0x85, 0x53, 0x81, 0xD1, 0x6A, 0x1A, 0xD0, 0xC0, 0xD6, 0xAD, 0xD9, 0xC4, 0x84,
+  0x6D, 0x71, 0x80, 0x9F, 0x43, 0xD2, 0x21, 0x67, 0xD8, 0xA8, 0xC9, 0xBF, 0x9F, 0x1E, 0x59, 0xC3, 0x46, 0xA1, 0xC3, 0xCD, 0x4F, 0xC6, 0x67, 0x46, 0x95, 0xD6,
+  0xC1, 0xB4, 0x9F, 0x5D, 0x00, 0x48, 0x4D, 0x5C, 0x6C, 0xA9, 0x17, 0xDB, 0x71, 0x2D, 0x3B, 0xB2, 0xA5, 0x9A, 0x63, 0x8B, 0xA1, 0xC7, 0xD8, 0x48, 0x1C, 0xFD,
+  0x5B, 0x0D, 0x4D, 0xC9, 0x14, 0xDE, 0x01, 0x53, 0x2E, 0xD1, 0xB1, 0xDC, 0xE5, 0x19, 0xA8, 0x5B, 0xA1, 0x44, 0xB0, 0x15, 0x6F, 0x2E, 0x46, 0x42, 0xDC, 0xDF,
+  0x6B, 0xBD, 0x85, 0x7B, 0x55, 0x2E, 0x02, 0xB7, 0x4E, 0xB0, 0x92, 0x52, 0x23, 0x06, 0x40, 0x5E, 0xEB, 0x86, 0xC7, 0x26, 0x51, 0x80, 0x0C, 0x05, 0x41, 0xAF,
+  0x30, 0x83, 0x62, 0x98, 0x0C, 0x8B, 0xD8, 0x0E, 0xB4, 0xF7, 0x25, 0x88, 0xC3, 0x2D, 0xE2, 0x41, 0x47, 0xD1, 0xDD, 0xB5, 0x35, 0x26, 0xFC, 0x19, 0x03, 0x8E,
+  0x5D, 0x31, 0x54, 0xDE, 0x5C, 0x97, 0x56, 0x06, 0x5A, 0x67, 0x16, 0x27, 0x9E, 0x98, 0x34, 0xA9, 0x23, 0xCC, 0x51, 0x3A, 0x20, 0x96, 0xCF, 0x1C, 0xD1, 0x12,
+  0x1F, 0x13, 0x78, 0xC9, 0xAF, 0x88, 0x56, 0xAC, 0xEA, 0x8E, 0x0A, 0x63, 0xF7, 0x7F, 0x31, 0x2C, 0x6F, 0xF0, 0xDC, 0x71, 0xF4, 0x75, 0xB5, 0xC5, 0xEF, 0x87,
+  0x4C, 0x9A, 0x75, 0xBA, 0x51, 0xC1, 0x91, 0xF4, 0xCB, 0x3C, 0x8E, 0xF3, 0x1D, 0x3C, 0x13, 0x51, 0x27, 0xDF, 0x5C, 0x63, 0x66, 0xE9, 0xE6, 0x29, 0x47, 0xD0,
+  0xE4, 0x67, 0xFE, 0xF0, 0x19, 0xF0, 0xCF, 0xE8, 0xF4, 0x13, 0x03, 0x56, 0x91, 0x62, 0x6B, 0xAE, 0x7A, 0x40, 0xAF, 0xB0, 0xA8, 0xA7, 0x4F, 0x6B, 0x91, 0x6C,
+  0xD1, 0x23, 0xDF, 0x26, 0x90, 0x49, 0x8B, 0x19, 0xF6, 0xAD, 0x4F, 0x06, 0xC7, 0xDB, 0xC4, 0x9F, 0x6A, 0x2D, 0x34, 0x05, 0xC3, 0xE6, 0xE1, 0x19, 0x98, 0x9A,
+  0x16, 0xAB, 0xC3, 0x1F, 0xC7, 0xFF, 0x87, 0x0D, 0x86, 0x3F, 0xD9, 0x94, 0x54, 0x60, 0xCA, 0x60, 0x77, 0x7C, 0x61, 0x96, 0x9F, 0x06, 0xDD, 0x71, 0xD0, 0xA6,
+  0x4B, 0x3D, 0x6C, 0x1D, 0x7B, 0x5D, 0x14, 0x06, 0x02, 0x64, 0x41, 0x2B, 0xAE, 0x1F, 0xDE, 0xD6, 0xBF, 0x18, 0x23, 0x86, 0x60, 0x98, 0x41, 0x2A, 0x7D, 0x97,
+  0x0C, 0x77, 0x29, 0x2A, 0x02, 0xD0, 0xE4, 0x8C, 0xB4, 0xA2, 0x1B, 0x0A, 0xC3, 0x02, 0x08, 0x67, 0x00, 0x81, 0xA3, 0x63, 0x38, 0xE6, 0x46, 0xD4, 0xE4, 0xBF,
+  0x4C, 0x04, 0x30, 0xF1, 0xD0, 0xB9, 0xE5, 0xB0, 0x55, 0x96, 0x5A, 0x6D, 0x03, 0xD6, 0x64, 0x45, 0x6C, 0x3F, 0x75, 0x61, 0x1E, 0xD3, 0x5C, 0xB0, 0x67, 0x3E,
+  0x8E, 0xC4, 0x43, 0x3D, 0x8D, 0x9F, 0x18, 0xEF, 0xA7, 0xA4, 0xFA, 0x1F, 0x93, 0xC3, 0xDA, 0x91, 0xC1, 0x8A, 0xA4, 0x9F, 0x3E, 0xD7, 0x3E, 0x69, 0x9F, 0xA3,
+  0x2C, 0x18, 0xEE, 0xCF, 0xFA, 0xCF, 0x10, 0x5A, 0xAC, 0xDA, 0x06, 0x17, 0x4C, 0x5E, 0x21, 0x9A, 0x90, 0xDF, 0x43, 0xD2, 0xAD, 0x85, 0x9F, 0x51, 0x81, 0x3E,
+  0x0D, 0x4B, 0x99, 0x62, 0x85, 0x19, 0x16, 0x91, 0x48, 0xEA, 0xF6, 0x8C, 0x08, 0x24, 0xF0, 0x3F, 0xF6, 0x9A, 0x5B, 0x74, 0x68, 0xCF, 0x92, 0x2E, 0x56, 0xBF,
+  0x13, 0xF8, 0xEA, 0x11, 0xC4, 0x8F, 0xB2, 0x70, 0xB2, 0xD9, 0x96, 0x9B, 0xBB, 0x12, 0x8C, 0x44, 0x24, 0xDA, 0x9C, 0xE4, 0x27, 0x96, 0x0A, 0x99, 0x65, 0x34,
+  0x2D, 0x7D, 0xC1, 0x6B, 0x2B, 0x07, 0xCC, 0xEF, 0x59, 0x19, 0xFE, 0xA0, 0x16, 0x33, 0x39, 0x93, 0x15, 0xC5, 0xF8, 0x79, 0x38, 0xC4, 0xBC, 0x97, 0x38, 0xAE,
+  0x8B, 0xA0, 0x09, 0xCE, 0x4F, 0xBE, 0xD2, 0xF5, 0xD4, 0x01, 0xEC, 0x30, 0x26, 0x41, 0x86, 0x0F, 0xB4, 0x9A, 0x6B, 0x3C, 0x62, 0x23, 0x94, 0x0B, 0x47, 0xBA,
+  0x27, 0xE6, 0x62, 0x13, 0xE2, 0x1A, 0xD6, 0x98, 0x12, 0xC3, 0x03, 0xE1, 0xC0, 0x38, 0xC5, 0xD1, 0xE9, 0xE4, 0xFF, 0xBE, 0xBD, 0x7C, 0xC5, 0xE3, 0x27, 0x0B,
+  0xC1, 0xBA, 0x45, 0x7E, 0x6B, 0x60, 0x76, 0x71, 0x4A, 0x6E, 0xEA, 0xEB, 0xFA, 0x75, 0x7D, 0x2E, 0xAC, 0xBE, 0x0E, 0x8D, 0x80, 0x39, 0x8A, 0x13, 0x18, 0x98,
+  0x35, 0x62, 0x1F, 0xBC, 0x98, 0xA9, 0xE4, 0x01, 0x80, 0x05, 0x41, 0x63, 0x93, 0x01, 0x91, 0x70, 0x79, 0xB8, 0xB4, 0x2A, 0x87, 0xCF, 0x8D, 0x72, 0xB7, 0x18,
+  0x37, 0x44, 0xD8, 0xC6, 0x39, 0x91, 0xFF, 0x18, 0x19, 0x4E, 0x8A, 0xF0, 0xF0, 0xD9, 0x02, 0xBC, 0xE3, 0x9C, 0xB1, 0xF7, 0x7B, 0x5D, 0x86, 0x75, 0xAE, 0x1B,
+  0xAC, 0x68, 0x87, 0xA6, 0x66, 0x41, 0x96, 0x86, 0xC4, 0xA8, 0xBE, 0x21, 0x79, 0x64, 0x3E, 0x51, 0xDF, 0xF8, 0x1B, 0x78, 0x89, 0xB0, 0x2B, 0xAD, 0x06, 0x90,
+  0xCB, 0xEA, 0xCF, 0xAB, 0xC5, 0x88, 0x0F, 0xD4, 0x52, 0xB7, 0x88, 0x5C, 0x9A, 0x33, 0x2A, 0xB8, 0xBB, 0x39, 0x38, 0x46, 0x9E, 0x75, 0x41, 0x28, 0xE8, 0xFF,
+  0x6F, 0x42, 0x71, 0xA7, 0x44, 0x3B, 0x32, 0x9A, 0x30, 0xD3, 0xE0, 0x16, 0x56, 0xC3, 0x11, 0xB7, 0xEA, 0x0B, 0x88, 0x2F, 0x44, 0x20, 0x62, 0xBC, 0x84, 0x7B,
+  0xE1, 0x80, 0x2C, 0xFF, 0xAE, 0x58, 0x85, 0xF0, 0x6F, 0x77, 0x3E, 0x87, 0x1C, 0x37, 0x82, 0xC5, 0xC7, 0xB1, 0xD9, 0xC0, 0x5F, 0xCE, 0x10, 0x68, 0x22, 0x24,
+  0x83, 0xD6, 0x94, 0xB5, 0x07, 0xEE, 0x15, 0x7C, 0x19, 0x85, 0x5D, 0x79, 0x61, 0x78, 0x28, 0x1C, 0x8C, 0xE1, 0x2F, 0x4C, 0x7B, 0x54, 0xFD, 0x84, 0x8A, 0x80,
+  0xD9, 0xCA, 0x37, 0xAC, 0xFE, 0x9C, 0x12, 0x75, 0xBD, 0xE1, 0xB6, 0x56, 0xE3, 0xD9, 0xD3, 0xA7, 0xD6, 0x67, 0x71, 0x20, 0xC3, 0x50, 0xA8, 0xA2, 0xF0, 0xC6,
+  0x66, 0xF3, 0x54, 0xB6, 0x3B, 0x69, 0xEA, 0xD8, 0x0B, 0x72, 0x84, 0x87, 0xA7, 0xE4, 0xAD, 0x3E, 0xFE, 0x0A, 0xDD, 0xB9, 0xC4, 0x86, 0x71, 0x1F, 0xAC, 0x9D,
+  0x92, 0x11, 0xD0, 0xB2, 0x84, 0xE3, 0xA5, 0x71, 0x83, 0xF3, 0xA7, 0x37, 0xEF, 0x5F, 0x90, 0xA9, 0xE1, 0xB8, 0x5E, 0x90, 0x2F, 0x03, 0xE1, 0x6F, 0xC4, 0xAE,
+  0x62, 0x5C, 0xD3, 0xA8, 0x13, 0x48, 0xDB, 0xE6, 0x8A, 0x9D, 0xA0, 0x42, 0x64, 0x1A, 0xA7, 0x08, 0xFC, 0x1A, 0x45, 0xED, 0x5F, 0x57, 0x44, 0x3D, 0x0F, 0x64,
+  0x1C, 0x01, 0x03, 0xA0, 0xE8, 0x0D, 0x5F, 0xB2, 0x73, 0x75, 0x8D, 0x40, 0xF1, 0x05, 0xBF, 0x65, 0xAC, 0x2F, 0xF0, 0x96, 0xF8, 0x84, 0xEB, 0x39, 0xD3, 0x82,
+  0x22, 0x75, 0x5C, 0xCE, 0xA9, 0x32, 0x56, 0x94, 0xB5, 0x7E, 0xEC, 0xA9, 0xA5, 0x40, 0x2E, 0xD9, 0xC6, 0xCB, 0x2B, 0xD5, 0x29, 0xFC, 0xF4, 0x71, 0x04, 0x77,
+  0x8E, 0x9F, 0xC2, 0xCF, 0x10, 0x60, 0x58, 0xA2, 0x07, 0xE0, 0x67, 0xC0, 0xF7, 0xBF, 0x13, 0xC8, 0x20, 0x47, 0x8D, 0x06, 0x2E, 0xC8, 0x7B, 0x6A, 0x22, 0x29,
+  0xB1, 0xB2, 0xE9, 0x03, 0x24, 0xBA, 0xC3, 0x21, 0x19, 0x81, 0xC1, 0x12, 0x0D, 0xD2, 0xDC, 0x76, 0xAF, 0x17, 0xAA, 0xD7, 0x01, 0xCD, 0x4D, 0x14, 0xF7, 0x27,
+  0xC4, 0xFA, 0xEF, 0xA4, 0x8B, 0xBB, 0x38, 0xA3, 0xD7, 0x44, 0xFA, 0x19, 0x77, 0x9D, 0xED, 0xFA, 0xB4, 0xAD, 0x44, 0x74, 0x22, 0x1F, 0xC5, 0x6E, 0x63, 0x52,
+  0xCF, 0xCD, 0x14, 0xF9, 0x8C, 0xAD, 0x67, 0x49, 0x4F, 0x8D, 0x30, 0x5B, 0x8B, 0x44, 0x0C, 0x4B, 0x2C, 0x7F, 0x61, 0xC6, 0x7C, 0x46, 0xB4, 0xF6, 0x00, 0xF8,
+  0x93, 0xE7, 0xA7, 0xFE, 0x51, 0x03, 0x3A, 0xEF, 0x4B, 0xA7, 0x3E, 0x3C, 0x54, 0xDC, 0xDB, 0x62, 0x22, 0x55, 0xE5, 0xE6, 0x13, 0xF4, 0x95, 0x13, 0xF4, 0x95,
+  0x9C, 0x41, 0xD2, 0x03, 0xBF, 0x61, 0xF1, 0x12, 0x54, 0x58, 0x95, 0x77, 0x70, 0x78, 0xF8, 0x39, 0xA5, 0x9A, 0x8C, 0x9D, 0xA0, 0x31, 0x36, 0x80, 0xBA, 0x2D,
+  0x1D, 0x81, 0x7A, 0x1A, 0x5B, 0xFA, 0x8A, 0xE9, 0x49, 0xE5, 0x49, 0x15, 0x2D, 0x5A, 0x21, 0x00, 0x06, 0x26, 0x08, 0x9A, 0x61, 0x7B, 0xF7, 0x5A, 0x91, 0xF9,
+  0x0B, 0x1B, 0x0E, 0xA4, 0xE3, 0x29, 0xEE, 0x26, 0x67, 0x56, 0xBE, 0xCF, 0xD5, 0x52, 0x27, 0x68, 0xEF, 0x61, 0xF6, 0xE8, 0x4F, 0xD0, 0x22, 0x83, 0x43, 0x50,
+  0x30, 0x63, 0x5B, 0xC5, 0xF9, 0x00, 0x71, 0xAE, 0xC1, 0xB8, 0x20, 0x46, 0x04, 0xF6, 0xA0, 0xED, 0xE6, 0x88, 0x70, 0x9D, 0x98, 0x33, 0xFD, 0xD6, 0xF8, 0x95,
+  0xBD, 0xA2, 0x25, 0x25, 0x59, 0x12, 0x49, 0x5B, 0x0A, 0x8A, 0xD7, 0xCC, 0xE7, 0xD3, 0x70, 0xA0, 0xFE, 0xAE, 0xD1, 0x0A, 0xE7, 0xAA, 0x46, 0x64, 0xA4, 0x52,
+  0xC3, 0x54, 0xB4, 0x90, 0xB8, 0x29, 0xE2, 0xD8, 0xD1, 0x96, 0x25, 0xE3, 0x7E, 0xA1, 0x40, 0x16, 0xD5, 0x83, 0xCE, 0x7C, 0x25, 0xC8, 0x21, 0x40, 0x76, 0x14,
+  0x19, 0xC4, 0x65, 0x15, 0x31, 0xBC, 0x26, 0xE2, 0x43, 0x5F, 0x29, 0x90, 0x78, 0xDC, 0x74, 0x9D, 0x31, 0x2F, 0x67, 0x6F, 0x8C, 0xDB, 0xBF, 0x67, 0x9C, 0xB8,
+  0x83, 0xB6, 0x83, 0x79, 0x7B, 0xA4, 0xC0, 0xCC, 0x8B, 0x7D, 0x2E, 0x56, 0xAD, 0x79, 0xA1, 0x1E, 0x93, 0x0F, 0xA5, 0xF8, 0x94, 0x50, 0xA3, 0x0D, 0x0A, 0x14,
+  0xD5, 0xDA, 0xA3, 0x04, 0xFA, 0xC3, 0xD4, 0x2B, 0xC5, 0x78, 0xFE, 0x46, 0x83, 0x67, 0x5F, 0xC6, 0xA3, 0xF3, 0xEF, 0xBF, 0xE1, 0x9A, 0x74, 0xD3, 0x82, 0x89,
+  0x7B, 0xED, 0xF6, 0xF7, 0xAD, 0xB3, 0xF8, 0xA0, 0xB6, 0x94, 0x95, 0x2E, 0x5E, 0x20, 0x88, 0xC5, 0x16, 0x12, 0x59, 0x3C, 0x3A, 0xB5, 0xA0, 0x76, 0x69, 0xC9,
+  0x35, 0xD4, 0x24, 0x59, 0x9F, 0x6F, 0x4A, 0x3B, 0x86, 0x22, 0xB4, 0xA3, 0xC7, 0x21, 0x94, 0x8A, 0x0D, 0x05, 0xD6, 0x27, 0xCD, 0x44, 0x52, 0xAB, 0x38, 0x73,
+  0x1A, 0xAD, 0xD8, 0x2C, 0xA0, 0x34, 0x3E, 0x02, 0x9C, 0x6F, 0xC6, 0x80, 0x78, 0x2A, 0x15, 0x64, 0x11, 0x1A, 0x99, 0x4F, 0x45, 0x28, 0x54, 0xEB, 0x86, 0x09,
+  0x34, 0x86, 0x97, 0x14, 0x22, 0xAB, 0x64, 0xD2, 0x32, 0x2F, 0x56, 0x40, 0xCD, 0x42, 0x5A, 0x26, 0xBF, 0x86, 0x0B, 0x81, 0xBE, 0x8F, 0xEA, 0xB3, 0x71, 0x5A,
+  0xAD, 0x0D, 0x6E, 0x2B, 0xF5, 0x39, 0xB1, 0x8A, 0xB8, 0x05, 0x80, 0x2D, 0x1D, 0xF2, 0x57, 0xA5, 0x30, 0x58, 0xFE, 0xF4, 0xB4, 0x47, 0x94, 0xF5, 0xC9, 0xD4,
+  0x32, 0xAC, 0x8E, 0x13, 0x01, 0xD6, 0x4C, 0x41, 0x02, 0x78, 0x37, 0x57, 0x55, 0x62, 0x04, 0x01, 0xED, 0x02, 0xA1, 0x23, 0xD0, 0x46, 0x6C, 0x49, 0x5E, 0x74,
+  0xDD, 0x5C, 0x70, 0x8D, 0x04, 0x96, 0xE4, 0x85, 0xD6, 0xCD, 0x45, 0x56, 0x75, 0x56, 0x24, 0xDF, 0xE9, 0x13, 0x08, 0x92, 0xA6, 0x4B, 0x9D, 0xAA, 0x52, 0x97,
+  0x0B, 0xCE, 0x5B, 0x20, 0xBE, 0xB0, 0x7A, 0x82, 0x2A, 0x32, 0x9A, 0x51, 0x64, 0x54, 0x88, 0x0C, 0x01, 0x82, 0xF5, 0xCD, 0xED, 0xAB, 0xDF, 0x7E, 0xF8, 0xFB,
+  0xF5, 0x45, 0xC0, 0xD9, 0xF5, 0x28, 0x95, 0x4E, 0xB1, 0xB2, 0xAC, 0xB0, 0x97, 0x0E, 0x00, 0xED, 0x71, 0x46, 0xA5, 0xB2, 0x75, 0x3D, 0xCA, 0xC6, 0x96, 0x5C,
+  0x99, 0x46, 0x80, 0x80, 0xAD, 0xF8, 0xF5, 0xEB, 0x60, 0xFE, 0xEA, 0x89, 0x37, 0x7F, 0xE9, 0x30, 0xEB, 0x66, 0x33, 0x20, 0xD7, 0xF8, 0x93, 0x2A, 0xD5, 0x6D,
+  0xBC, 0xBF, 0xB5, 0x92, 0xCF, 0x9B, 0x29, 0x4C, 0xFA, 0x2B, 0xE0, 0x5B, 0x41, 0xFD, 0x96, 0x0A, 0xB4, 0x4F, 0x47, 0x2A, 0xB4, 0x6C, 0xC4, 0x97, 0x00, 0xFC,
+  0xD3, 0x4C, 0xC2, 0xF2, 0x5B, 0x07, 0xCE, 0x13, 0x20, 0xE0, 0xEB, 0xC9, 0x43, 0xD2, 0x8B, 0xEE, 0xBA, 0xE0, 0xEB, 0x42, 0x9C, 0xD9, 0xC8, 0xEA, 0x8F, 0xDA,
+  0xC0, 0x67, 0x29, 0xD4, 0xC6, 0x77, 0x10, 0x0E, 0x9F, 0x44, 0xE6, 0x56, 0x52, 0xF8, 0xDE, 0xC1, 0xCA, 0x5B, 0x93, 0xE2, 0x6A, 0xB8, 0xF8, 0x96, 0xCB, 0xC5,
+  0x8F, 0x3F, 0x10, 0x48, 0x35, 0x4D, 0xFB, 0x9A, 0xE2, 0x93, 0xBB, 0x72, 0x5F, 0x3E, 0x19, 0x51, 0xC8, 0x40, 0x29, 0xDF, 0x73, 0x80, 0x71, 0xC8, 0x9B, 0x1B,
+  0x2E, 0x99, 0x52, 0xFC, 0xE2, 0x10, 0x7D, 0x5C, 0xF1, 0xF7, 0x8C, 0x6D, 0x65, 0x6F, 0xF3, 0x39, 0xB7, 0x90, 0x38, 0x39, 0x8C, 0x12, 0xFD, 0x05, 0x8F, 0x1B,
+  0xC1, 0x28, 0x6D, 0x97, 0x43, 0x0E, 0x11, 0xFA, 0xB7, 0x1F, 0xAC, 0x14, 0xE3, 0x19, 0xD8, 0x2A, 0x48, 0x1F, 0x2C, 0x90, 0x65, 0xC0, 0xEB, 0x86, 0x34, 0xE3,
+  0xB6, 0x92, 0xA4, 0x68, 0x14, 0x77, 0x55, 0xC5, 0xC6, 0xF9, 0x64, 0xAD, 0x70, 0x89, 0xF3, 0x15, 0x4D, 0xFF, 0xAD, 0x46, 0xE2, 0x1D, 0x46, 0xFC, 0x0C, 0x2B,
+  0x70, 0xC3, 0x47, 0x67, 0x47, 0x73, 0x6F, 0x61, 0x0E, 0x1F, 0xFD, 0x3F, 0xA3, 0xF9, 0x4A, 0xBB, 0x69, 0x24, 0x01, 0x00
 };
@@ -130,9 +130,13 @@ void setup() {
   } else {
     // Best option for face detection/recognition
     config.frame_size = FRAMESIZE_240X240;
-#if CONFIG_IDF_TARGET_ESP32S3
-    config.fb_count = 2;
-#endif
+    if (psramFound()) {
+      // The motion pipeline holds up to three driver buffers (queued frame,
+      // current and reference, see frame_ring.h), one more keeps capturing.
+      // Without PSRAM there is one buffer and the pipeline is not started.
+      config.fb_count = 4;
+      config.grab_mode = CAMERA_GRAB_LATEST;
+    }
   }
 
 #if defined(CAMERA_MODEL_ESP_EYE)
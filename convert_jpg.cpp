@@ -1,11 +1,305 @@
 #include <stddef.h>
 #include <string.h>
-#include "esp_attr.h"
-#include "soc/efuse_reg.h"
-#include "esp_heap_caps.h"
-#include "esp_camera.h"
-#include "img_converters.h"
 #include "convert_jpg.h"
 
-//#include "jpge.h"
-//#include "yuv.h"
\ No newline at end of file
+#define CJ_OUT_SIZE    512
+#define CJ_RECIP_BITS  15
+
+typedef struct {
+  uint16_t code[256];
+  uint8_t size[256];
+} cj_huff_t;
+
+// Annex K.3 luminance tables: number of codes per length, then the symbols.
+static constexpr uint8_t cj_dc_bits[16] = {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0};
+static constexpr uint8_t cj_dc_vals[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+static constexpr uint8_t cj_ac_bits[16] = {0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d};
+static constexpr uint8_t cj_ac_vals[162] = {
+  0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1,
+  0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26,
+  0x27, 0x28, 0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56,
+  0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85,
+  0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa,
+  0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6,
+  0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9,
+  0xfa,
+};
+
+// Canonical code assignment (Annex C), evaluated by the compiler.
+static constexpr cj_huff_t cj_build_huff(const uint8_t *bits, const uint8_t *vals) {
+  cj_huff_t t = {};
+  uint16_t code = 0;
+  int k = 0;
+  for (int len = 1; len <= 16; len++) {
+    for (int i = 0; i < bits[len - 1]; i++, k++) {
+      t.code[vals[k]] = code++;
+      t.size[vals[k]] = len;
+    }
+    code <<= 1;
+  }
+  return t;
+}
+
+static constexpr cj_huff_t cj_dc_huff = cj_build_huff(cj_dc_bits, cj_dc_vals);
+static constexpr cj_huff_t cj_ac_huff = cj_build_huff(cj_ac_bits, cj_ac_vals);
+
+static const uint8_t cj_zigzag[64] = {
+  0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,  12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6,  7,  14, 21, 28,
+  35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51, 58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+// Annex K.1 luminance quantization table, natural order.
+static const uint8_t cj_std_quant[64] = {
+  16, 11, 10, 16, 24,  40,  51,  61,  12, 12, 14, 19, 26,  58,  60,  55,  14, 13, 16, 24, 40,  57,  69,  56,  14, 17, 22, 29, 51,  87,  80,  62,
+  18, 22, 37, 56, 68,  109, 103, 77,  24, 35, 55, 64, 81,  104, 113, 92,  49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99,
+};
+
+// AAN output scale per row and column, cos(k * pi / 16) * sqrt(2), Q14.
+static const uint16_t cj_aan_scale[8] = {16384, 22725, 21407, 19266, 16384, 12873, 8867, 4520};
+
+typedef struct {
+  gray_jpg_out_cb cb;
+  void *arg;
+  size_t index;  // bytes handed to cb so far
+  bool failed;
+  uint32_t bit_buf;
+  int bit_count;
+  size_t out_len;
+  uint8_t out[CJ_OUT_SIZE];
+} cj_writer_t;
+
+static void cj_flush(cj_writer_t *w) {
+  if (w->out_len && !w->failed) {
+    if (w->cb(w->arg, w->index, w->out, w->out_len) != w->out_len) {
+      w->failed = true;
+    }
+    w->index += w->out_len;
+  }
+  w->out_len = 0;
+}
+
+static inline void cj_put_byte(cj_writer_t *w, uint8_t b) {
+  if (w->out_len == CJ_OUT_SIZE) {
+    cj_flush(w);
+  }
+  w->out[w->out_len++] = b;
+}
+
+static void cj_put_marker(cj_writer_t *w, const uint8_t *data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    cj_put_byte(w, data[i]);
+  }
+}
+
+static inline void cj_put_bits(cj_writer_t *w, uint32_t bits, int count) {
+  w->bit_buf = (w->bit_buf << count) | (bits & ((1u << count) - 1));
+  w->bit_count += count;
+  while (w->bit_count >= 8) {
+    uint8_t b = w->bit_buf >> (w->bit_count - 8);
+    cj_put_byte(w, b);
+    if (b == 0xff) {
+      cj_put_byte(w, 0);  // byte stuffing
+    }
+    w->bit_count -= 8;
+  }
+}
+
+static void cj_write_headers(cj_writer_t *w, const uint8_t *quant, uint16_t width, uint16_t height) {
+  static const uint8_t soi_app0[] = {0xff, 0xd8, 0xff, 0xe0, 0, 16, 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0};
+  uint8_t hdr[32];
+
+  cj_put_marker(w, soi_app0, sizeof(soi_app0));
+
+  const uint8_t dqt[] = {0xff, 0xdb, 0, 67, 0};
+  cj_put_marker(w, dqt, sizeof(dqt));
+  for (int i = 0; i < 64; i++) {
+    cj_put_byte(w, quant[cj_zigzag[i]]);
+  }
+
+  const uint8_t sof0[] = {0xff, 0xc0, 0, 11, 8, (uint8_t)(height >> 8), (uint8_t)height, (uint8_t)(width >> 8), (uint8_t)width, 1, 1, 0x11, 0};
+  cj_put_marker(w, sof0, sizeof(sof0));
+
+  // DHT: DC table 0 then AC table 0
+  hdr[0] = 0xff;
+  hdr[1] = 0xc4;
+  hdr[2] = 0;
+  hdr[3] = 2 + 2 * 17 + sizeof(cj_dc_vals) + sizeof(cj_ac_vals);
+  hdr[4] = 0x00;
+  cj_put_marker(w, hdr, 5);
+  cj_put_marker(w, cj_dc_bits, sizeof(cj_dc_bits));
+  cj_put_marker(w, cj_dc_vals, sizeof(cj_dc_vals));
+  cj_put_byte(w, 0x10);
+  cj_put_marker(w, cj_ac_bits, sizeof(cj_ac_bits));
+  cj_put_marker(w, cj_ac_vals, sizeof(cj_ac_vals));
+
+  static const uint8_t sos[] = {0xff, 0xda, 0, 8, 1, 1, 0x00, 0, 63, 0};
+  cj_put_marker(w, sos, sizeof(sos));
+}
+
+#define CJ_MUL(v, c) (((v) * (c)) >> 8)
+
+// Fixed point AAN forward DCT (Arai, Agui, Nakajima) as in IJG jfdctfst, in
+// place. Outputs come out scaled by 8 * aan[u] * aan[v], folded into the
+// quantizer reciprocals.
+static void cj_fdct(int32_t *d) {
+  for (int pass = 0; pass < 2; pass++) {
+    int step = pass ? 8 : 1;
+    int next = pass ? 1 : 8;
+    for (int k = 0; k < 8; k++) {
+      int32_t *p = d + k * next;
+      int32_t tmp0 = p[0 * step] + p[7 * step];
+      int32_t tmp7 = p[0 * step] - p[7 * step];
+      int32_t tmp1 = p[1 * step] + p[6 * step];
+      int32_t tmp6 = p[1 * step] - p[6 * step];
+      int32_t tmp2 = p[2 * step] + p[5 * step];
+      int32_t tmp5 = p[2 * step] - p[5 * step];
+      int32_t tmp3 = p[3 * step] + p[4 * step];
+      int32_t tmp4 = p[3 * step] - p[4 * step];
+
+      // Even part
+      int32_t tmp10 = tmp0 + tmp3;
+      int32_t tmp13 = tmp0 - tmp3;
+      int32_t tmp11 = tmp1 + tmp2;
+      int32_t tmp12 = tmp1 - tmp2;
+      p[0 * step] = tmp10 + tmp11;
+      p[4 * step] = tmp10 - tmp11;
+      int32_t z1 = CJ_MUL(tmp12 + tmp13, 181);  // 0.707106781
+      p[2 * step] = tmp13 + z1;
+      p[6 * step] = tmp13 - z1;
+
+      // Odd part
+      tmp10 = tmp4 + tmp5;
+      tmp11 = tmp5 + tmp6;
+      tmp12 = tmp6 + tmp7;
+      int32_t z5 = CJ_MUL(tmp10 - tmp12, 98);  // 0.382683433
+      int32_t z2 = CJ_MUL(tmp10, 139) + z5;    // 0.541196100
+      int32_t z4 = CJ_MUL(tmp12, 334) + z5;    // 1.306562965
+      int32_t z3 = CJ_MUL(tmp11, 181);         // 0.707106781
+      int32_t z11 = tmp7 + z3;
+      int32_t z13 = tmp7 - z3;
+      p[5 * step] = z13 + z2;
+      p[3 * step] = z13 - z2;
+      p[1 * step] = z11 + z4;
+      p[7 * step] = z11 - z4;
+    }
+  }
+}
+
+static inline int cj_category(int v) {
+  v = v < 0 ? -v : v;
+  return v ? 32 - __builtin_clz(v) : 0;
+}
+
+static inline void cj_put_value(cj_writer_t *w, int v, int cat) {
+  cj_put_bits(w, v < 0 ? v - 1 : v, cat);
+}
+
+static void cj_encode_block(cj_writer_t *w, int32_t *d, const int32_t *recip, int *dc_pred) {
+  int16_t q[64];
+
+  cj_fdct(d);
+  for (int i = 0; i < 64; i++) {
+    int32_t v = d[cj_zigzag[i]];
+    int32_t r = recip[i];
+    const int32_t round = 1 << (CJ_RECIP_BITS - 1);
+    q[i] = v < 0 ? -((-v * r + round) >> CJ_RECIP_BITS) : (v * r + round) >> CJ_RECIP_BITS;
+  }
+
+  int diff = q[0] - *dc_pred;
+  *dc_pred = q[0];
+  int cat = cj_category(diff);
+  cj_put_bits(w, cj_dc_huff.code[cat], cj_dc_huff.size[cat]);
+  cj_put_value(w, diff, cat);
+
+  int run = 0;
+  for (int i = 1; i < 64; i++) {
+    if (!q[i]) {
+      run++;
+      continue;
+    }
+    while (run > 15) {
+      cj_put_bits(w, cj_ac_huff.code[0xf0], cj_ac_huff.size[0xf0]);
+      run -= 16;
+    }
+    cat = cj_category(q[i]);
+    int sym = (run << 4) | cat;
+    cj_put_bits(w, cj_ac_huff.code[sym], cj_ac_huff.size[sym]);
+    cj_put_value(w, q[i], cat);
+    run = 0;
+  }
+  if (run) {
+    cj_put_bits(w, cj_ac_huff.code[0x00], cj_ac_huff.size[0x00]);
+  }
+}
+
+bool gray2jpg_rows(const uint8_t *src, uint16_t width, uint16_t height, size_t stride, uint8_t quality, gray_jpg_out_cb cb, gray_jpg_row_cb row_cb, void *arg) {
+  cj_writer_t w;
+  uint8_t quant[64];
+  int32_t recip[64];  // zigzag order
+  int32_t block[64];
+
+  if (!src || !width || !height || !cb) {
+    return false;
+  }
+  memset(&w, 0, offsetof(cj_writer_t, out));
+  w.cb = cb;
+  w.arg = arg;
+
+  quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
+  int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+  for (int i = 0; i < 64; i++) {
+    int q = (cj_std_quant[i] * scale + 50) / 100;
+    quant[i] = q < 1 ? 1 : q > 255 ? 255 : q;
+  }
+  for (int i = 0; i < 64; i++) {
+    int n = cj_zigzag[i];
+    // divisor = q * 8 * aan[row] * aan[col]
+    uint64_t divisor = (uint64_t)quant[n] * cj_aan_scale[n >> 3] * cj_aan_scale[n & 7];  // Q28, times 8 is Q25
+    recip[i] = (int32_t)((((uint64_t)1 << (CJ_RECIP_BITS + 25)) + divisor / 2) / divisor);
+  }
+
+  cj_write_headers(&w, quant, width, height);
+
+  int dc_pred = 0;
+  for (int by = 0; by < height; by += 8) {
+    for (int bx = 0; bx < width; bx += 8) {
+      // Edge blocks repeat the last column and row
+      for (int y = 0; y < 8; y++) {
+        const uint8_t *row = src + (size_t)(by + y < height ? by + y : height - 1) * stride;
+        if (bx + 8 <= width) {
+          for (int x = 0; x < 8; x++) {
+            block[y * 8 + x] = row[bx + x] - 128;
+          }
+        } else {
+          for (int x = 0; x < 8; x++) {
+            block[y * 8 + x] = row[bx + x < width ? bx + x : width - 1] - 128;
+          }
+        }
+      }
+      cj_encode_block(&w, block, recip, &dc_pred);
+      if (w.failed) {
+        return false;
+      }
+    }
+    if (by + 8 >= height) {
+      // Pad the last byte with ones, then EOI
+      if (w.bit_count) {
+        cj_put_bits(&w, 0x7f, 8 - w.bit_count);
+      }
+      cj_put_byte(&w, 0xff);
+      cj_put_byte(&w, 0xd9);
+    }
+    if (row_cb) {
+      cj_flush(&w);
+      if (!w.failed) {
+        row_cb(arg, by / 8);
+      }
+    }
+  }
+  cj_flush(&w);
+  return !w.failed;
+}
+
+bool gray2jpg_cb(const uint8_t *src, uint16_t width, uint16_t height, size_t stride, uint8_t quality, gray_jpg_out_cb cb, void *arg) {
+  return gray2jpg_rows(src, width, height, stride, quality, cb, NULL, arg);
+}
@@ -0,0 +1,28 @@
+#ifndef _CONVERT_JPG_H_
+#define _CONVERT_JPG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Baseline JPEG encoder for 8-bit grayscale frames, the only format the
+// sensor runs in. One component, no color conversion or subsampling: blocks
+// are read straight from the frame (any stride), transformed with a fixed
+// point AAN DCT, quantized with reciprocal multiplies and coded with the
+// standard luminance Huffman tables, built at compile time.
+
+// Same contract as jpg_out_cb in img_converters.h: `index` is the output
+// offset, returning less than `len` aborts the encode.
+typedef size_t (*gray_jpg_out_cb)(void *arg, size_t index, const void *data, size_t len);
+// Called once the output of MCU row `row` (8 pixel rows) has gone to the out
+// callback, so streaming consumers can push finished rows right away.
+typedef void (*gray_jpg_row_cb)(void *arg, uint16_t row);
+
+// Encodes width x height pixels, rows `stride` bytes apart, at quality 1-100
+// (IJG scaling). Output goes to `cb` in chunks of up to a few hundred bytes.
+bool gray2jpg_cb(const uint8_t *src, uint16_t width, uint16_t height, size_t stride, uint8_t quality, gray_jpg_out_cb cb, void *arg);
+// Same, with `row_cb` (may be NULL) after every MCU row; the last row also
+// holds the end of image marker.
+bool gray2jpg_rows(const uint8_t *src, uint16_t width, uint16_t height, size_t stride, uint8_t quality, gray_jpg_out_cb cb, gray_jpg_row_cb row_cb, void *arg);
+
+#endif /* _CONVERT_JPG_H_ */
@@ -0,0 +1,137 @@
+#include <string.h>
+#include <stdint.h>
+#include "copy_service.h"
+
+#ifdef ESP_PLATFORM
+#include "esp32-hal-log.h"
+#include "soc/soc_caps.h"
+#if SOC_ASYNC_MEMCPY_SUPPORTED
+#define COPY_SERVICE_DMA 1
+#include "esp_async_memcpy.h"
+#include "esp_memory_utils.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#endif
+#else
+#include <stdio.h>
+#define log_e(fmt, ...) fprintf(stderr, fmt "\n", ##__VA_ARGS__)
+#endif
+
+#define COPY_QUEUE_DEPTH 8
+#define COPY_TASK_STACK  3072
+#define COPY_TASK_PRIO   5
+#define COPY_TASK_CORE   0
+
+static os_queue_t copy_queue = NULL;
+
+#if COPY_SERVICE_DMA
+// One DMA transfer is split into chunks the descriptor backlog can describe.
+#define COPY_DMA_CHUNK (16 * 1024)
+
+static async_memcpy_t copy_dma = NULL;
+static SemaphoreHandle_t copy_dma_done = NULL;
+
+static bool IRAM_ATTR copy_dma_isr(async_memcpy_t mcp, async_memcpy_event_t *event, void *arg) {
+  BaseType_t woken = pdFALSE;
+  xSemaphoreGiveFromISR(copy_dma_done, &woken);
+  return woken == pdTRUE;
+}
+
+static bool copy_dma_eligible(const copy_job_t *job) {
+  return copy_dma && esp_ptr_internal(job->dst) && esp_ptr_internal(job->src) && ((uintptr_t)job->dst % 4) == 0 && ((uintptr_t)job->src % 4) == 0
+         && (job->len % 4) == 0;
+}
+
+static bool copy_dma_run(copy_job_t *job) {
+  for (size_t off = 0; off < job->len; off += COPY_DMA_CHUNK) {
+    size_t n = job->len - off < COPY_DMA_CHUNK ? job->len - off : COPY_DMA_CHUNK;
+    if (esp_async_memcpy(copy_dma, (uint8_t *)job->dst + off, (uint8_t *)job->src + off, n, copy_dma_isr, NULL) != ESP_OK) {
+      return false;
+    }
+    xSemaphoreTake(copy_dma_done, portMAX_DELAY);
+  }
+  return true;
+}
+#endif
+
+static void copy_job_finish(copy_job_t *job) {
+  if (job->cb) {
+    job->cb(job->arg);
+  }
+  job->busy = false;
+  os_sem_give(job->done);
+}
+
+static void copy_task(void *arg) {
+  copy_job_t *job;
+
+  while (true) {
+    if (!os_queue_receive(copy_queue, &job, OS_WAIT_FOREVER)) {
+      continue;
+    }
+#if COPY_SERVICE_DMA
+    if (!copy_dma_eligible(job) || !copy_dma_run(job)) {
+      memcpy(job->dst, job->src, job->len);
+    }
+#else
+    memcpy(job->dst, job->src, job->len);
+#endif
+    copy_job_finish(job);
+  }
+}
+
+bool copy_service_init(void) {
+  if (copy_queue) {
+    return true;
+  }
+#if COPY_SERVICE_DMA
+  async_memcpy_config_t config = ASYNC_MEMCPY_DEFAULT_CONFIG();
+  copy_dma_done = xSemaphoreCreateBinary();
+  if (!copy_dma_done || esp_async_memcpy_install(&config, &copy_dma) != ESP_OK) {
+    log_e("Async memcpy unavailable, copies will use the CPU");
+    copy_dma = NULL;
+  }
+#endif
+  copy_queue = os_queue_create(COPY_QUEUE_DEPTH, sizeof(copy_job_t *));
+  if (!copy_queue) {
+    log_e("Copy service queue allocation failed");
+    return false;
+  }
+  if (!os_task_create(copy_task, "copy", COPY_TASK_STACK, NULL, COPY_TASK_PRIO, COPY_TASK_CORE)) {
+    log_e("Copy service task creation failed");
+    return false;
+  }
+  return true;
+}
+
+bool copy_job_init(copy_job_t *job) {
+  memset(job, 0, sizeof(copy_job_t));
+  job->done = os_sem_create();
+  return job->done != NULL;
+}
+
+bool copy_service_submit(copy_job_t *job, void *dst, const void *src, size_t len, copy_done_cb_t cb, void *arg) {
+  if (job->busy) {
+    return false;
+  }
+  // Drop a completion nobody waited for
+  os_sem_take(job->done, 0);
+  job->dst = dst;
+  job->src = src;
+  job->len = len;
+  job->cb = cb;
+  job->arg = arg;
+  job->busy = true;
+  if (!copy_queue || !os_queue_send(copy_queue, &job, 0)) {
+    memcpy(dst, src, len);
+    copy_job_finish(job);
+  }
+  return true;
+}
+
+bool copy_service_wait(copy_job_t *job, uint32_t timeout_ms) {
+  if (!job->busy) {
+    return true;
+  }
+  return os_sem_take(job->done, timeout_ms);
+}
@@ -0,0 +1,37 @@
+#ifndef _COPY_SERVICE_H_
+#define _COPY_SERVICE_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "os_port.h"
+
+// Background memcpy for the copies that can not be avoided (frame snapshots,
+// background seeding). Copies run on a worker task so they overlap with the
+// diff/label stages; between internal buffers the worker hands them to the
+// async memcpy DMA engine on chips that have one (SOC_ASYNC_MEMCPY_SUPPORTED).
+// PSRAM buffers and the original ESP32 use a CPU copy on the worker core.
+
+typedef void (*copy_done_cb_t)(void *arg);
+
+typedef struct {
+  void *dst;
+  const void *src;
+  size_t len;
+  copy_done_cb_t cb;  // runs on the worker task once the copy has finished
+  void *arg;
+  os_sem_t done;
+  volatile bool busy;
+} copy_job_t;
+
+bool copy_service_init(void);
+
+// Prepares a caller-owned job, it can be submitted again once it completed.
+bool copy_job_init(copy_job_t *job);
+
+// Queues the copy. Without a running service the copy is done synchronously.
+bool copy_service_submit(copy_job_t *job, void *dst, const void *src, size_t len, copy_done_cb_t cb, void *arg);
+
+// Blocks until the job completed; returns false on timeout.
+bool copy_service_wait(copy_job_t *job, uint32_t timeout_ms);
+
+#endif /* _COPY_SERVICE_H_ */
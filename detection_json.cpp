@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include "mem_policy.h"
+#include "detection_json.h"
+
+#ifdef ESP_PLATFORM
+#include "esp32-hal-log.h"
+#define dj_alloc(size) mem_class_alloc(MEM_CLASS_JPEG, size)
+#else
+#define log_e(format, ...) fprintf(stderr, format "\n", ##__VA_ARGS__)
+#define dj_alloc(size)     malloc(size)
+#endif
+
+static char *dj_sse_bufs[DETECTION_SSE_CLIENTS];
+static std::atomic<bool> dj_sse_used[DETECTION_SSE_CLIENTS];
+
+size_t detection_json(const mp_result_t *result, char *buf, size_t buf_len) {
+  const md_regions_t *r = &result->regions;
+  size_t n = 0;
+
+#define REPORT(...)                                           \
+  do {                                                        \
+    if (n < buf_len) {                                        \
+      n += snprintf(buf + n, buf_len - n, __VA_ARGS__);       \
+    }                                                         \
+  } while (0)
+
+  REPORT(
+    "{\"seq\":%u,\"ts_us\":%lld,\"width\":%u,\"height\":%u,\"dropped\":%u,\"truncated\":%s,\"regions\":[", (unsigned)result->seq,
+    (long long)result->capture_us, result->width, result->height, r->dropped, r->truncated ? "true" : "false"
+  );
+  for (int i = 0; i < r->count; i++) {
+    REPORT(
+      "%s{\"id\":%d,\"bbox\":[%u,%u,%u,%u],\"area\":%u,\"centroid\":[%u,%u]}", i ? "," : "", i, r->min_x[i], r->min_y[i], r->max_x[i] - r->min_x[i] + 1,
+      r->max_y[i] - r->min_y[i] + 1, (unsigned)r->area[i], r->cx[i], r->cy[i]
+    );
+  }
+  REPORT("]}");
+#undef REPORT
+
+  return n < buf_len ? n : buf_len - 1;
+}
+
+bool detection_sse_init(void) {
+  for (int i = 0; i < DETECTION_SSE_CLIENTS; i++) {
+    if (dj_sse_bufs[i]) {
+      continue;
+    }
+    dj_sse_bufs[i] = (char *)dj_alloc(DETECTION_SSE_BUF_SIZE);
+    if (!dj_sse_bufs[i]) {
+      log_e("Detection event buffer allocation failed");
+      return false;
+    }
+  }
+  return true;
+}
+
+char *detection_sse_claim(void) {
+  for (int i = 0; i < DETECTION_SSE_CLIENTS; i++) {
+    bool expected = false;
+    if (dj_sse_bufs[i] && dj_sse_used[i].compare_exchange_strong(expected, true)) {
+      return dj_sse_bufs[i];
+    }
+  }
+  return NULL;
+}
+
+void detection_sse_release(char *buf) {
+  for (int i = 0; i < DETECTION_SSE_CLIENTS; i++) {
+    if (dj_sse_bufs[i] == buf) {
+      dj_sse_used[i].store(false);
+      return;
+    }
+  }
+}
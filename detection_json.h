@@ -0,0 +1,32 @@
+#ifndef _DETECTION_JSON_H_
+#define _DETECTION_JSON_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "motion_pipeline.h"
+
+// Detections as compact JSON for machine consumers, served by /detections
+// and streamed by /events, so they never need a JPEG for the boxes:
+//
+// {"seq":12,"ts_us":345,"width":240,"height":240,"dropped":0,"truncated":false,
+//  "regions":[{"id":0,"bbox":[x,y,w,h],"area":a,"centroid":[x,y]}]}
+//
+// Region ids are indices into the frame's region table, stable within one
+// frame only.
+
+#define DETECTION_JSON_MAX (128 + MD_MAX_REGIONS * 80)
+
+// Event stream buffers are allocated once at init, one per connection.
+#define DETECTION_SSE_CLIENTS  3
+#define DETECTION_SSE_BUF_SIZE (DETECTION_JSON_MAX + 64)
+
+// Returns the JSON length, truncated to buf_len - 1 when the buffer is short.
+size_t detection_json(const mp_result_t *result, char *buf, size_t buf_len);
+
+bool detection_sse_init(void);
+// DETECTION_SSE_BUF_SIZE bytes, NULL when every buffer is in use.
+char *detection_sse_claim(void);
+void detection_sse_release(char *buf);
+
+#endif /* _DETECTION_JSON_H_ */
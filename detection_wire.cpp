@@ -0,0 +1,92 @@
+#include "detection_wire.h"
+
+static uint8_t *dw_put16(uint8_t *p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  return p + 2;
+}
+
+static uint8_t *dw_put32(uint8_t *p, uint32_t v) {
+  p = dw_put16(p, v);
+  return dw_put16(p, v >> 16);
+}
+
+static uint16_t dw_get16(const uint8_t *p) {
+  return p[0] | p[1] << 8;
+}
+
+static uint32_t dw_get32(const uint8_t *p) {
+  return dw_get16(p) | (uint32_t)dw_get16(p + 2) << 16;
+}
+
+size_t detection_wire_size(const mp_result_t *result) {
+  return DW_HEADER_LEN + (size_t)result->regions.count * DW_REGION_LEN;
+}
+
+size_t detection_wire_encode(const mp_result_t *result, uint8_t *buf, size_t buf_len) {
+  const md_regions_t *r = &result->regions;
+  size_t len = detection_wire_size(result);
+  uint8_t *p = buf;
+
+  if (len > buf_len) {
+    return 0;
+  }
+  *p++ = 'M';
+  *p++ = 'D';
+  *p++ = DW_VERSION;
+  *p++ = DW_HEADER_LEN;
+  *p++ = DW_REGION_LEN;
+  *p++ = r->truncated ? DW_FLAG_TRUNCATED : 0;
+  p = dw_put16(p, r->count);
+  p = dw_put32(p, result->seq);
+  p = dw_put16(p, result->width);
+  p = dw_put16(p, result->height);
+  p = dw_put32(p, (uint64_t)result->capture_us);
+  p = dw_put32(p, (uint64_t)result->capture_us >> 32);
+  p = dw_put32(p, (uint32_t)(result->publish_us - result->capture_us));
+  p = dw_put16(p, r->dropped);
+  p = dw_put16(p, 0);
+  for (int i = 0; i < r->count; i++) {
+    p = dw_put16(p, r->min_x[i]);
+    p = dw_put16(p, r->min_y[i]);
+    p = dw_put16(p, r->max_x[i] - r->min_x[i] + 1);
+    p = dw_put16(p, r->max_y[i] - r->min_y[i] + 1);
+    p = dw_put16(p, r->cx[i]);
+    p = dw_put16(p, r->cy[i]);
+    p = dw_put32(p, r->area[i]);
+  }
+  return len;
+}
+
+size_t detection_wire_decode(const uint8_t *buf, size_t len, dw_header_t *header) {
+  // The version 1 fields, a later header only grows
+  if (len < DW_HEADER_LEN || buf[0] != 'M' || buf[1] != 'D' || buf[2] < 1 || buf[3] < DW_HEADER_LEN || buf[4] < DW_REGION_LEN) {
+    return 0;
+  }
+  header->version = buf[2];
+  header->header_len = buf[3];
+  header->region_len = buf[4];
+  header->flags = buf[5];
+  header->count = dw_get16(buf + 6);
+  header->seq = dw_get32(buf + 8);
+  header->width = dw_get16(buf + 12);
+  header->height = dw_get16(buf + 14);
+  header->capture_us = (int64_t)(dw_get32(buf + 16) | (uint64_t)dw_get32(buf + 20) << 32);
+  header->publish_delay_us = dw_get32(buf + 24);
+  header->dropped = dw_get16(buf + 28);
+
+  size_t total = header->header_len + (size_t)header->count * header->region_len;
+  return total <= len ? total : 0;
+}
+
+void detection_wire_region(const uint8_t *buf, const dw_header_t *header, int index, dw_region_t *region) {
+  const uint8_t *p = buf + header->header_len + (size_t)index * header->region_len;
+
+  region->x = dw_get16(p);
+  region->y = dw_get16(p + 2);
+  region->w = dw_get16(p + 4);
+  region->h = dw_get16(p + 6);
+  region->cx = dw_get16(p + 8);
+  region->cy = dw_get16(p + 10);
+  region->area = dw_get32(p + 12);
+}
@@ -0,0 +1,74 @@
+#ifndef _DETECTION_WIRE_H_
+#define _DETECTION_WIRE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "motion_pipeline.h"
+
+// Binary detection record, the format every binary transport carries (/ws
+// pushes, /detections?format=bin). Little endian, no padding:
+//
+//   off  size  header
+//     0     2  magic "MD"
+//     2     1  version, DW_VERSION
+//     3     1  header length in bytes, DW_HEADER_LEN for version 1
+//     4     1  region length in bytes, DW_REGION_LEN for version 1
+//     5     1  flags, DW_FLAG_*
+//     6     2  region count
+//     8     4  frame seq
+//    12     2  width
+//    14     2  height
+//    16     8  capture time, us since boot
+//    24     4  capture to publish, us
+//    28     2  regions dropped by the region table
+//    30     2  reserved, 0
+//
+//   then count regions of: u16 x, y, w, h, cx, cy, u32 area
+//
+// Decoders take both lengths from the header and skip what they do not
+// know, so later versions may only append fields.
+
+#define DW_VERSION      1
+#define DW_HEADER_LEN   32
+#define DW_REGION_LEN   16
+#define DW_FLAG_TRUNCATED 0x01  // provisional labels ran out, regions were merged
+
+#define DETECTION_WIRE_MAX (DW_HEADER_LEN + MD_MAX_REGIONS * DW_REGION_LEN)
+
+typedef struct {
+  uint8_t version;
+  uint8_t header_len;
+  uint8_t region_len;
+  uint8_t flags;
+  uint16_t count;
+  uint32_t seq;
+  uint16_t width;
+  uint16_t height;
+  int64_t capture_us;
+  uint32_t publish_delay_us;
+  uint16_t dropped;
+} dw_header_t;
+
+typedef struct {
+  uint16_t x;
+  uint16_t y;
+  uint16_t w;
+  uint16_t h;
+  uint16_t cx;  // centroid
+  uint16_t cy;
+  uint32_t area;
+} dw_region_t;
+
+// Writes the record of `result` to buf, returns its length or 0 when buf is
+// shorter than detection_wire_size(). Allocates nothing.
+size_t detection_wire_size(const mp_result_t *result);
+size_t detection_wire_encode(const mp_result_t *result, uint8_t *buf, size_t buf_len);
+
+// Parses the header of the record at buf. Returns the record length, 0 when
+// the data is not a record or is cut short.
+size_t detection_wire_decode(const uint8_t *buf, size_t len, dw_header_t *header);
+// Region `index` of a record accepted by detection_wire_decode().
+void detection_wire_region(const uint8_t *buf, const dw_header_t *header, int index, dw_region_t *region);
+
+#endif /* _DETECTION_WIRE_H_ */
@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp32-hal-log.h"
+#include "img_converters.h"
+#include "convert_jpg.h"
+#include "os_port.h"
+#include "mem_policy.h"
+#include "motion_pipeline.h"
+#include "encode_cache.h"
+
+#define EC_POLL_MS 5
+
+typedef enum {
+  EC_EMPTY,
+  EC_ENCODING,
+  EC_READY,
+} ec_state_t;
+
+typedef struct {
+  ec_output_t out;  // first member, readers get a pointer to it
+  ec_key_t key;
+  ec_state_t state;
+  int refs;
+  uint8_t *buf;
+  size_t cap;
+  bool overflow;
+} ec_entry_t;
+
+static ec_entry_t ec_entries[ENCODE_CACHE_ENTRIES];
+static os_mutex_t ec_lock;
+static ec_stats_t ec_stats;
+
+static bool ec_key_equal(const ec_key_t *a, const ec_key_t *b) {
+  return a->format == b->format && a->annotated == b->annotated && (a->format != EC_FORMAT_JPEG || a->quality == b->quality);
+}
+
+// Entry holding `key` for frame `seq`, or the newest one of the key when
+// seq is 0. Called with ec_lock held.
+static ec_entry_t *ec_find(const ec_key_t *key, uint32_t seq) {
+  ec_entry_t *found = NULL;
+
+  for (int i = 0; i < ENCODE_CACHE_ENTRIES; i++) {
+    ec_entry_t *e = &ec_entries[i];
+    if (e->state == EC_EMPTY || !ec_key_equal(&e->key, key)) {
+      continue;
+    }
+    if (seq ? e->out.seq == seq : (e->state == EC_READY && (!found || e->out.seq > found->out.seq))) {
+      found = e;
+    }
+  }
+  return found;
+}
+
+// Entry to encode into: an empty one, else the unreferenced one with the
+// oldest frame. Called with ec_lock held.
+static ec_entry_t *ec_victim(void) {
+  ec_entry_t *victim = NULL;
+
+  for (int i = 0; i < ENCODE_CACHE_ENTRIES; i++) {
+    ec_entry_t *e = &ec_entries[i];
+    if (e->state == EC_EMPTY) {
+      return e;
+    }
+    if (e->state == EC_READY && !e->refs && (!victim || e->out.seq < victim->out.seq)) {
+      victim = e;
+    }
+  }
+  return victim;
+}
+
+static bool ec_reserve(ec_entry_t *e, size_t size) {
+  if (e->cap >= size) {
+    return true;
+  }
+  mem_class_free(MEM_CLASS_JPEG, e->buf);
+  e->buf = (uint8_t *)mem_class_alloc(MEM_CLASS_JPEG, size);
+  e->cap = e->buf ? size : 0;
+  return e->buf != NULL;
+}
+
+static size_t ec_jpeg_write(void *arg, size_t index, const void *data, size_t len) {
+  ec_entry_t *e = (ec_entry_t *)arg;
+
+  if (index + len > e->cap) {
+    e->overflow = true;
+    return 0;
+  }
+  memcpy(e->buf + index, data, len);
+  e->out.len = index + len;
+  return len;
+}
+
+// Runs without ec_lock, the entry is owned by the caller while EC_ENCODING.
+static bool ec_encode(ec_entry_t *e, const mp_result_t *r) {
+  const uint8_t *src = e->key.annotated ? r->frame : r->raw;
+
+  if (!src) {
+    log_e("Encode cache: no %s frame published", e->key.annotated ? "annotated" : "raw");
+    return false;
+  }
+  e->out.len = 0;
+  e->out.seq = r->seq;
+  e->out.capture_us = r->capture_us;
+  if (e->key.format == EC_FORMAT_JPEG) {
+    e->overflow = false;
+    return ec_reserve(e, ENCODE_CACHE_JPEG_SIZE)
+           && gray2jpg_cb(src, r->width, r->height, r->width, e->key.quality, ec_jpeg_write, e) && !e->overflow;
+  }
+
+  uint8_t *bmp = NULL;
+  size_t bmp_len = 0;
+  if (!fmt2bmp((uint8_t *)src, r->len, r->width, r->height, PIXFORMAT_GRAYSCALE, &bmp, &bmp_len)) {
+    return false;
+  }
+  bool ok = ec_reserve(e, bmp_len);
+  if (ok) {
+    memcpy(e->buf, bmp, bmp_len);
+    e->out.len = bmp_len;
+  }
+  free(bmp);
+  return ok;
+}
+
+bool encode_cache_init(void) {
+  if (ec_lock) {
+    return true;
+  }
+  ec_lock = os_mutex_create();
+  if (!ec_lock) {
+    log_e("Encode cache: mutex creation failed");
+    return false;
+  }
+  return true;
+}
+
+const ec_output_t *encode_cache_get(const ec_key_t *key, uint32_t max_age_ms, uint32_t timeout_ms) {
+  int64_t deadline = os_time_us() + (int64_t)timeout_ms * 1000;
+  bool waited = false;
+
+  if (max_age_ms) {
+    os_mutex_lock(ec_lock);
+    ec_entry_t *e = ec_find(key, 0);
+    if (e && os_time_us() - e->out.capture_us <= (int64_t)max_age_ms * 1000) {
+      e->refs++;
+      ec_stats.stale_hits++;
+      os_mutex_unlock(ec_lock);
+      return &e->out;
+    }
+    os_mutex_unlock(ec_lock);
+  }
+
+  const mp_result_t *r = motion_pipeline_acquire(0, timeout_ms);
+  if (!r) {
+    return NULL;
+  }
+  for (;;) {
+    os_mutex_lock(ec_lock);
+    ec_entry_t *e = ec_find(key, r->seq);
+    if (e && e->state == EC_READY) {
+      e->refs++;
+      ec_stats.hits++;
+      os_mutex_unlock(ec_lock);
+      motion_pipeline_release(r);
+      return &e->out;
+    }
+    if (e) {
+      // Another request is encoding this frame, wait for its result
+      if (!waited) {
+        ec_stats.waits++;
+        waited = true;
+      }
+      os_mutex_unlock(ec_lock);
+      if (os_time_us() >= deadline) {
+        motion_pipeline_release(r);
+        return NULL;
+      }
+      os_sleep_ms(EC_POLL_MS);
+      continue;
+    }
+    e = ec_victim();
+    if (!e) {
+      ec_stats.no_entry++;
+      os_mutex_unlock(ec_lock);
+      motion_pipeline_release(r);
+      return NULL;
+    }
+    e->key = *key;
+    e->out.seq = r->seq;
+    e->state = EC_ENCODING;
+    e->refs = 1;
+    os_mutex_unlock(ec_lock);
+
+    int64_t t0 = os_time_us();
+    bool ok = ec_encode(e, r);
+    motion_pipeline_release(r);
+
+    os_mutex_lock(ec_lock);
+    if (ok) {
+      e->state = EC_READY;
+      e->out.buf = e->buf;
+      ec_stats.encodes++;
+      ec_stats.encode_us = os_time_us() - t0;
+    } else {
+      e->state = EC_EMPTY;
+      e->refs = 0;
+      ec_stats.failures++;
+    }
+    os_mutex_unlock(ec_lock);
+    return ok ? &e->out : NULL;
+  }
+}
+
+void encode_cache_release(const ec_output_t *out) {
+  if (!out) {
+    return;
+  }
+  os_mutex_lock(ec_lock);
+  ((ec_entry_t *)out)->refs--;
+  os_mutex_unlock(ec_lock);
+}
+
+void encode_cache_get_stats(ec_stats_t *stats) {
+  os_mutex_lock(ec_lock);
+  *stats = ec_stats;
+  os_mutex_unlock(ec_lock);
+}
+
+size_t encode_cache_report_json(char *buf, size_t buf_len) {
+  ec_stats_t st;
+  encode_cache_get_stats(&st);
+
+  int n = snprintf(
+    buf, buf_len, "{\"hits\":%u,\"stale_hits\":%u,\"encodes\":%u,\"waits\":%u,\"failures\":%u,\"no_entry\":%u,\"encode_us\":%u}", (unsigned)st.hits,
+    (unsigned)st.stale_hits, (unsigned)st.encodes, (unsigned)st.waits, (unsigned)st.failures, (unsigned)st.no_entry, (unsigned)st.encode_us
+  );
+  if (n < 0) {
+    return 0;
+  }
+  return (size_t)n < buf_len ? n : buf_len - 1;
+}
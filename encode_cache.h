@@ -0,0 +1,57 @@
+#ifndef _ENCODE_CACHE_H_
+#define _ENCODE_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Encoded still images of the newest pipeline result, shared by the snapshot
+// handlers. Entries are keyed by format and quality and tagged with the frame
+// sequence number they were encoded from, so any number of clients polling
+// the same frame cost one encode; a request racing an encode of its key waits
+// for it instead of running its own.
+
+#define ENCODE_CACHE_ENTRIES   6
+#define ENCODE_CACHE_JPEG_SIZE (64 * 1024)
+
+typedef enum {
+  EC_FORMAT_JPEG,
+  EC_FORMAT_BMP,
+} ec_format_t;
+
+typedef struct {
+  ec_format_t format;
+  uint8_t quality;  // JPEG only
+  bool annotated;   // frame with the motion boxes instead of the raw frame
+} ec_key_t;
+
+typedef struct {
+  const uint8_t *buf;
+  size_t len;
+  uint32_t seq;     // pipeline frame sequence number
+  int64_t capture_us;
+} ec_output_t;
+
+typedef struct {
+  uint32_t hits;
+  uint32_t stale_hits;  // served an older frame within max_age
+  uint32_t encodes;
+  uint32_t waits;       // waited for an encode of the same key and frame
+  uint32_t failures;
+  uint32_t no_entry;    // every entry held by readers
+  uint32_t encode_us;   // last encode time
+} ec_stats_t;
+
+bool encode_cache_init(void);
+
+// Encoding of the newest pipeline result. A cached entry captured at most
+// max_age_ms ago is returned as is, 0 always asks for the newest frame.
+// Waits up to timeout_ms for a result; returns NULL on timeout or failure.
+// The output is immutable until released.
+const ec_output_t *encode_cache_get(const ec_key_t *key, uint32_t max_age_ms, uint32_t timeout_ms);
+void encode_cache_release(const ec_output_t *out);
+
+void encode_cache_get_stats(ec_stats_t *stats);
+size_t encode_cache_report_json(char *buf, size_t buf_len);
+
+#endif /* _ENCODE_CACHE_H_ */
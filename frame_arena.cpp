@@ -0,0 +1,147 @@
+#include <string.h>
+#include "frame_arena.h"
+
+#ifdef ESP_PLATFORM
+#include "esp_heap_caps.h"
+#include "esp32-hal-log.h"
+#else
+#include <stdio.h>
+#include <stdlib.h>
+#define log_e(format, ...) fprintf(stderr, format "\n", ##__VA_ARGS__)
+#define log_i(format, ...)
+#endif
+
+#define FRAME_ARENA_MIN_INTERNAL (8 * 1024)
+
+typedef struct {
+  uint8_t *base;
+  size_t size;
+  size_t used;
+  size_t high_water;
+} arena_block_t;
+
+static arena_block_t arena[ARENA_REGION_MAX];
+
+#ifdef ESP_PLATFORM
+static size_t arena_class_used[MEM_CLASS_MAX];
+
+static const uint32_t arena_caps[ARENA_REGION_MAX] = {
+  MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT,
+  MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT,
+};
+
+static uint8_t *arena_carve(arena_region_t region, size_t size) {
+  if (region == ARENA_INTERNAL && !mem_internal_room(size)) {
+    return NULL;
+  }
+  return (uint8_t *)heap_caps_aligned_alloc(FRAME_ARENA_ALIGN, size, arena_caps[region]);
+}
+#else
+static uint8_t *arena_carve(arena_region_t region, size_t size) {
+  return (uint8_t *)aligned_alloc(FRAME_ARENA_ALIGN, (size + FRAME_ARENA_ALIGN - 1) & ~(size_t)(FRAME_ARENA_ALIGN - 1));
+}
+#endif
+
+bool frame_arena_init(size_t psram_size, size_t internal_size) {
+  size_t sizes[ARENA_REGION_MAX] = {psram_size, internal_size};
+
+  for (int i = 0; i < ARENA_REGION_MAX; i++) {
+    if (arena[i].base) {
+      continue;
+    }
+    arena[i].base = arena_carve((arena_region_t)i, sizes[i]);
+    while (!arena[i].base && i == ARENA_INTERNAL && sizes[i] / 2 >= FRAME_ARENA_MIN_INTERNAL) {
+      sizes[i] /= 2;
+      arena[i].base = arena_carve((arena_region_t)i, sizes[i]);
+    }
+    if (!arena[i].base) {
+      log_e("Frame arena: region %d (%u bytes) allocation failed", i, (unsigned)sizes[i]);
+      return false;
+    }
+    arena[i].size = sizes[i];
+    arena[i].used = 0;
+    arena[i].high_water = 0;
+    log_i("Frame arena: region %d has %u bytes", i, (unsigned)sizes[i]);
+  }
+  return true;
+}
+
+static void *arena_take(arena_region_t region, size_t size) {
+  arena_block_t *a = &arena[region];
+  size_t start = (a->used + FRAME_ARENA_ALIGN - 1) & ~(size_t)(FRAME_ARENA_ALIGN - 1);
+
+  if (!a->base || start + size > a->size) {
+    return NULL;
+  }
+  a->used = start + size;
+  if (a->used > a->high_water) {
+    a->high_water = a->used;
+  }
+  return a->base + start;
+}
+
+#ifdef ESP_PLATFORM
+static arena_region_t arena_region_for(uint32_t caps) {
+  return (caps & MALLOC_CAP_SPIRAM) ? ARENA_PSRAM : ARENA_INTERNAL;
+}
+
+void *frame_arena_alloc(mem_class_t cls, size_t size) {
+  const mem_policy_t *p = mem_policy_get(cls);
+  bool fallback = false;
+
+  void *ptr = arena_take(arena_region_for(p->caps), size);
+  if (!ptr && p->fallback_caps) {
+    ptr = arena_take(arena_region_for(p->fallback_caps), size);
+    fallback = true;
+  }
+  if (!ptr) {
+    log_e("Frame arena: no room for %u bytes of %s", size, p->name);
+    return NULL;
+  }
+  arena_class_used[cls] += size;
+  mem_class_charge(cls, size, fallback);
+  return ptr;
+}
+
+void frame_arena_reset(void) {
+  for (int i = 0; i < ARENA_REGION_MAX; i++) {
+    arena[i].used = 0;
+  }
+  for (int i = 0; i < MEM_CLASS_MAX; i++) {
+    if (arena_class_used[i]) {
+      mem_class_release((mem_class_t)i, arena_class_used[i]);
+      arena_class_used[i] = 0;
+    }
+  }
+}
+#else
+// One kind of memory on the host, the regions only keep the budgets apart
+void *frame_arena_alloc(mem_class_t cls, size_t size) {
+  void *ptr = arena_take(ARENA_INTERNAL, size);
+  if (!ptr) {
+    ptr = arena_take(ARENA_PSRAM, size);
+  }
+  if (!ptr) {
+    log_e("Frame arena: no room for %u bytes", (unsigned)size);
+  }
+  return ptr;
+}
+
+void frame_arena_reset(void) {
+  for (int i = 0; i < ARENA_REGION_MAX; i++) {
+    arena[i].used = 0;
+  }
+}
+#endif
+
+size_t frame_arena_used(arena_region_t region) {
+  return arena[region].used;
+}
+
+size_t frame_arena_high_water(arena_region_t region) {
+  return arena[region].high_water;
+}
+
+size_t frame_arena_size(arena_region_t region) {
+  return arena[region].size;
+}
@@ -0,0 +1,43 @@
+#ifndef _FRAME_ARENA_H_
+#define _FRAME_ARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "mem_policy.h"
+
+// Per-frame scratch of the motion pipeline: two bump allocated regions, one
+// in PSRAM and one in internal DRAM, carved once by motion_pipeline_start()
+// and sized for its working buffers plus the extra below. The processing task
+// owns the arena: it resets it before each frame, and scratch taken on that
+// task (the stripe buffers, the annotate callback) lasts until the next one.
+// Classes that prefer internal RAM go to the DRAM region and spill into PSRAM
+// once it is full, see mem_policy.cpp. Host builds use plain heap regions.
+#define FRAME_ARENA_PSRAM_EXTRA    (64 * 1024)
+#define FRAME_ARENA_INTERNAL_EXTRA (8 * 1024)
+#define FRAME_ARENA_ALIGN          16
+
+typedef enum {
+  ARENA_PSRAM = 0,
+  ARENA_INTERNAL,
+  ARENA_REGION_MAX
+} arena_region_t;
+
+// Carves both regions once; call before the first frame is processed.
+// The internal region is shrunk if the DRAM heap cannot hold it above
+// MEM_INTERNAL_RESERVE; its classes then spill into PSRAM.
+bool frame_arena_init(size_t psram_size, size_t internal_size);
+
+// Bump allocation in the region preferred by the class policy, falling back
+// to the other region when allowed. Returns NULL when both are exhausted,
+// memory is only given back by frame_arena_reset().
+void *frame_arena_alloc(mem_class_t cls, size_t size);
+
+// Releases every allocation of the current frame at once.
+void frame_arena_reset(void);
+
+size_t frame_arena_used(arena_region_t region);
+size_t frame_arena_high_water(arena_region_t region);
+size_t frame_arena_size(arena_region_t region);
+
+#endif /* _FRAME_ARENA_H_ */
@@ -0,0 +1,54 @@
+#include "esp32-hal-log.h"
+#include "frame_ring.h"
+
+static uint32_t ring_seq;
+
+bool frame_ring_capture(ring_frame_t *frame) {
+  frame->fb = esp_camera_fb_get();
+  if (!frame->fb) {
+    log_e("Camera capture failed");
+    return false;
+  }
+  frame->seq = ++ring_seq;
+  return true;
+}
+
+void frame_ring_release(ring_frame_t *frame) {
+  if (frame->fb) {
+    esp_camera_fb_return(frame->fb);
+    frame->fb = NULL;
+  }
+}
+
+static bool ring_source_capture(mp_frame_t *frame, void *ctx) {
+  ring_frame_t rf;
+
+  if (!frame_ring_capture(&rf)) {
+    return false;
+  }
+  if (rf.fb->format != PIXFORMAT_GRAYSCALE) {
+    log_e("Motion pipeline needs grayscale frames");
+    frame_ring_release(&rf);
+    return false;
+  }
+  frame->buf = rf.fb->buf;
+  frame->len = rf.fb->len;
+  frame->width = rf.fb->width;
+  frame->height = rf.fb->height;
+  frame->seq = rf.seq;
+  frame->handle = rf.fb;
+  return true;
+}
+
+static void ring_source_release(mp_frame_t *frame, void *ctx) {
+  ring_frame_t rf = {(camera_fb_t *)frame->handle, frame->seq};
+
+  frame_ring_release(&rf);
+  frame->handle = NULL;
+}
+
+static const mp_source_t ring_source = {ring_source_capture, ring_source_release, NULL};
+
+const mp_source_t *frame_ring_source(void) {
+  return &ring_source;
+}
@@ -0,0 +1,29 @@
+#ifndef _FRAME_RING_H_
+#define _FRAME_RING_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_camera.h"
+#include "motion_pipeline.h"
+
+// Driver frame buffers configured in camerattgo.ino. The motion pipeline holds
+// at most three of them (queued, current and reference), the driver keeps
+// filling the rest.
+#define FRAME_RING_FB_COUNT 4
+
+typedef struct {
+  camera_fb_t *fb;  // owned by the camera driver, never copied
+  uint32_t seq;     // increments by one for every captured frame
+} ring_frame_t;
+
+// Grabs the newest frame from the driver and tags it with a sequence number.
+bool frame_ring_capture(ring_frame_t *frame);
+
+// Gives the frame back to the driver.
+void frame_ring_release(ring_frame_t *frame);
+
+// Frame source for the motion pipeline. Frames are handed over by pointer,
+// the pipeline keeps its reference frame in a driver buffer.
+const mp_source_t *frame_ring_source(void);
+
+#endif /* _FRAME_RING_H_ */
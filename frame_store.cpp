@@ -0,0 +1,358 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include "FS.h"
+#include "LittleFS.h"
+#include "esp32-hal-log.h"
+#include "os_port.h"
+#include "mem_policy.h"
+#include "frame_store.h"
+
+#define FS_PATH_MAX    40
+#define FS_TASK_STACK  4096
+#define FS_TASK_PRIO   2
+// Free space a sequence is started with and needs at least, in 240x240 raw
+// frames; the recorder itself checks every frame against its real size
+#define FS_SEQ_RESERVE (4 * 240 * 240)
+#define FS_SEQ_MIN     (2 * 240 * 240)
+#define FS_READERS     4
+#define FS_CHUNK       512
+
+// Serializes every file system access. Sends drop it between chunks, they
+// list their file in fs_reading instead so eviction passes it over.
+static os_mutex_t fs_lock;
+static uint32_t fs_reading[FS_READERS];
+static int fs_readers;
+static uint32_t fs_next_id;
+static os_sem_t fs_rec_wake;
+static std::atomic<bool> fs_recording(false);
+static uint32_t fs_rec_id;
+static int64_t fs_rec_until_us;
+
+// Archive file names are [fm]<id>.lgr and s<id>.lgs, anything else is left
+// alone.
+static bool fs_parse(const char *name, uint32_t *id) {
+  char *end;
+
+  if ((name[0] != 'f' && name[0] != 'm' && name[0] != 's') || name[1] < '0' || name[1] > '9') {
+    return false;
+  }
+  *id = strtoul(name + 1, &end, 10);
+  return !strcmp(end, name[0] == 's' ? ".lgs" : ".lgr");
+}
+
+static void fs_put32(uint8_t *p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+// Counts the archive files and finds the oldest one and the newest id.
+static int fs_scan(char *oldest, uint32_t *min_id, uint32_t *max_id) {
+  File dir = LittleFS.open(FRAME_STORE_DIR);
+  int count = 0;
+
+  *min_id = UINT32_MAX;
+  *max_id = 0;
+  if (!dir || !dir.isDirectory()) {
+    return 0;
+  }
+  for (File f = dir.openNextFile(); f; f = dir.openNextFile()) {
+    uint32_t id;
+    if (!f.isDirectory() && fs_parse(f.name(), &id)) {
+      count++;
+      if (id < *min_id) {
+        *min_id = id;
+        snprintf(oldest, FS_PATH_MAX, FRAME_STORE_DIR "/%s", f.name());
+      }
+      if (id > *max_id) {
+        *max_id = id;
+      }
+    }
+    f.close();
+  }
+  dir.close();
+  return count;
+}
+
+// Whether the file with this id is being recorded or sent. Called with
+// fs_lock held.
+static bool fs_busy(uint32_t id) {
+  if (fs_recording.load() && id == fs_rec_id) {
+    return true;
+  }
+  for (int i = 0; i < fs_readers; i++) {
+    if (fs_reading[i] == id) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static size_t fs_write(void *arg, size_t index, const void *data, size_t len) {
+  return ((File *)arg)->write((const uint8_t *)data, len);
+}
+
+static size_t fs_free(void) {
+  return LittleFS.totalBytes() - LittleFS.usedBytes();
+}
+
+// Removes the oldest files until there is room for one more file of `need`
+// bytes, sparing files being recorded or sent. Called with fs_lock held.
+static void fs_make_room(size_t need) {
+  char oldest[FS_PATH_MAX];
+  uint32_t min_id, max_id;
+
+  for (;;) {
+    int count = fs_scan(oldest, &min_id, &max_id);
+    if (!count || (count < FRAME_STORE_FILES && fs_free() >= need)) {
+      return;
+    }
+    if (fs_busy(min_id) || !LittleFS.remove(oldest)) {
+      return;
+    }
+  }
+}
+
+// Records pipeline results into s<id>.lgs until `until_us`, see frame_store.h.
+static void fs_record(uint32_t id, int64_t until_us) {
+  char path[FS_PATH_MAX];
+  uint8_t *ref = NULL;
+  uint16_t width = 0;
+  uint16_t height = 0;
+  uint32_t last_seq = 0;
+  uint32_t frames = 0;
+  File f;
+
+  snprintf(path, sizeof(path), FRAME_STORE_DIR "/s%06u.lgs", (unsigned)id);
+  while (os_time_us() < until_us) {
+    const mp_result_t *r = motion_pipeline_acquire(last_seq, 1000);
+    if (!r) {
+      continue;
+    }
+    last_seq = r->seq;
+    const uint8_t *px = r->raw ? r->raw : r->frame;
+    size_t len = (size_t)r->width * r->height;
+    if (!ref) {
+      width = r->width;
+      height = r->height;
+      ref = (uint8_t *)mem_class_alloc(MEM_CLASS_FRAME, len);
+    }
+    if (!ref || r->width != width || r->height != height) {
+      motion_pipeline_release(r);
+      break;
+    }
+
+    bool key = frames % FRAME_STORE_KEY_INTERVAL == 0;
+    bool ok = false;
+    os_mutex_lock(fs_lock);
+    if (!frames) {
+      const uint8_t header[FRAME_STORE_SEQ_HEADER_LEN] = {'L', 'S', 1, 0, (uint8_t)width, (uint8_t)(width >> 8), (uint8_t)height, (uint8_t)(height >> 8)};
+      f = LittleFS.open(path, FILE_WRITE);
+      ok = f && f.write(header, sizeof(header)) == sizeof(header);
+    } else {
+      ok = true;
+    }
+    // The worst case keyframe is a little over a raw frame
+    if (ok && fs_free() < len + len / 8) {
+      ok = false;
+    }
+    if (ok) {
+      uint8_t record[FRAME_STORE_RECORD_LEN];
+      size_t start = f.position();
+      fs_put32(record + 4, r->seq);
+      fs_put32(record + 8, (uint64_t)r->capture_us);
+      fs_put32(record + 12, (uint64_t)r->capture_us >> 32);
+      ok = f.write(record, sizeof(record)) == sizeof(record);
+      if (ok) {
+        ok = key ? lossless_gray_encode(px, width, height, width, fs_write, &f) : lossless_gray_encode_delta(px, ref, width, height, width, fs_write, &f);
+      }
+      size_t end = f.position();
+      fs_put32(record, end - start - sizeof(record));
+      // Readers only ever see complete records
+      ok = ok && f.seek(start) && f.write(record, 4) == 4 && f.seek(end);
+      f.flush();
+    }
+    os_mutex_unlock(fs_lock);
+    memcpy(ref, px, len);
+    motion_pipeline_release(r);
+    if (!ok) {
+      break;
+    }
+    frames++;
+  }
+  os_mutex_lock(fs_lock);
+  if (f) {
+    f.close();
+  }
+  if (!frames) {
+    LittleFS.remove(path);
+  }
+  os_mutex_unlock(fs_lock);
+  if (ref) {
+    mem_class_free(MEM_CLASS_FRAME, ref);
+  }
+  log_i("Sequence %s: %u frames", path, (unsigned)frames);
+}
+
+static void fs_record_task(void *arg) {
+  for (;;) {
+    os_sem_take(fs_rec_wake, OS_WAIT_FOREVER);
+    fs_record(fs_rec_id, fs_rec_until_us);
+    fs_recording.store(false);
+  }
+}
+
+bool frame_store_begin(void) {
+  char oldest[FS_PATH_MAX];
+  uint32_t min_id, max_id;
+
+  if (fs_lock) {
+    return true;
+  }
+  if (!LittleFS.begin(true)) {
+    log_e("LittleFS mount failed");
+    return false;
+  }
+  if (!LittleFS.exists(FRAME_STORE_DIR) && !LittleFS.mkdir(FRAME_STORE_DIR)) {
+    log_e("Cannot create " FRAME_STORE_DIR);
+    return false;
+  }
+  fs_next_id = fs_scan(oldest, &min_id, &max_id) ? max_id + 1 : 0;
+  fs_rec_wake = os_sem_create();
+  if (!fs_rec_wake || !os_task_create(fs_record_task, "fs_record", FS_TASK_STACK, NULL, FS_TASK_PRIO, OS_NO_AFFINITY)) {
+    log_e("Frame store: recorder task creation failed");
+    return false;
+  }
+  fs_lock = os_mutex_create();
+  return fs_lock != NULL;
+}
+
+int32_t frame_store_save(const mp_result_t *result, bool mask) {
+  const uint8_t *px = mask ? result->mask : result->raw ? result->raw : result->frame;
+  size_t need = LOSSLESS_GRAY_HEADER_LEN + (size_t)result->width * result->height;
+  char path[FS_PATH_MAX];
+
+  if (!fs_lock || !px) {
+    return -1;
+  }
+  os_mutex_lock(fs_lock);
+  fs_make_room(need);
+  uint32_t id = fs_next_id++;
+  snprintf(path, sizeof(path), FRAME_STORE_DIR "/%c%06u.lgr", mask ? 'm' : 'f', (unsigned)id);
+  File f = LittleFS.open(path, FILE_WRITE);
+  bool ok = f && lossless_gray_encode(px, result->width, result->height, result->width, fs_write, &f);
+  if (f) {
+    f.close();
+  }
+  if (!ok) {
+    log_e("Storing %s failed", path);
+    LittleFS.remove(path);
+  }
+  os_mutex_unlock(fs_lock);
+  return ok ? (int32_t)id : -1;
+}
+
+int32_t frame_store_record(uint32_t duration_ms) {
+  bool idle = false;
+
+  if (!fs_lock || !fs_recording.compare_exchange_strong(idle, true)) {
+    return -1;
+  }
+  os_mutex_lock(fs_lock);
+  fs_rec_id = fs_next_id++;
+  fs_make_room(FS_SEQ_RESERVE);
+  bool room = fs_free() >= FS_SEQ_MIN;
+  os_mutex_unlock(fs_lock);
+  if (!room) {
+    fs_recording.store(false);
+    return -1;
+  }
+  fs_rec_until_us = os_time_us() + duration_ms * 1000LL;
+  os_sem_give(fs_rec_wake);
+  return fs_rec_id;
+}
+
+frame_store_res_t frame_store_send(const char *name, lossless_gray_out_cb cb, void *arg) {
+  char path[FS_PATH_MAX];
+  uint8_t chunk[FS_CHUNK];
+  uint32_t id;
+
+  if (!fs_lock || !fs_parse(name, &id) || strlen(name) + sizeof(FRAME_STORE_DIR) >= sizeof(path)) {
+    return FRAME_STORE_MISSING;
+  }
+  snprintf(path, sizeof(path), FRAME_STORE_DIR "/%s", name);
+  os_mutex_lock(fs_lock);
+  if (fs_readers == FS_READERS) {
+    os_mutex_unlock(fs_lock);
+    return FRAME_STORE_BUSY;
+  }
+  File f = LittleFS.open(path, FILE_READ);
+  if (!f) {
+    os_mutex_unlock(fs_lock);
+    return FRAME_STORE_MISSING;
+  }
+  fs_reading[fs_readers++] = id;
+  size_t size = f.size();
+  size_t index = 0;
+  for (;;) {
+    size_t n = index < size ? f.read(chunk, size - index < sizeof(chunk) ? size - index : sizeof(chunk)) : 0;
+    os_mutex_unlock(fs_lock);
+    // The client may be slow, nothing else waits for it
+    if (!n || cb(arg, index, chunk, n) != n) {
+      break;
+    }
+    index += n;
+    os_mutex_lock(fs_lock);
+  }
+  os_mutex_lock(fs_lock);
+  f.close();
+  for (int i = 0; i < fs_readers; i++) {
+    if (fs_reading[i] == id) {
+      fs_reading[i] = fs_reading[--fs_readers];
+      break;
+    }
+  }
+  os_mutex_unlock(fs_lock);
+  return index == size ? FRAME_STORE_OK : FRAME_STORE_FAILED;
+}
+
+size_t frame_store_report_json(char *buf, size_t buf_len) {
+  size_t n = 0;
+  int files = 0;
+
+#define REPORT(...)                                           \
+  do {                                                        \
+    if (n < buf_len) {                                        \
+      n += snprintf(buf + n, buf_len - n, __VA_ARGS__);       \
+    }                                                         \
+  } while (0)
+
+  if (!fs_lock) {
+    REPORT("{\"used\":0,\"total\":0,\"recording\":-1,\"files\":[]}");
+    return n < buf_len ? n : buf_len - 1;
+  }
+  os_mutex_lock(fs_lock);
+  REPORT(
+    "{\"used\":%u,\"total\":%u,\"recording\":%d,\"files\":[", (unsigned)LittleFS.usedBytes(), (unsigned)LittleFS.totalBytes(),
+    fs_recording.load() ? (int)fs_rec_id : -1
+  );
+  File dir = LittleFS.open(FRAME_STORE_DIR);
+  if (dir && dir.isDirectory()) {
+    for (File f = dir.openNextFile(); f; f = dir.openNextFile()) {
+      uint32_t id;
+      if (!f.isDirectory() && fs_parse(f.name(), &id)) {
+        REPORT("%s{\"name\":\"%s\",\"size\":%u}", files++ ? "," : "", f.name(), (unsigned)f.size());
+      }
+      f.close();
+    }
+    dir.close();
+  }
+  os_mutex_unlock(fs_lock);
+  REPORT("]}");
+#undef REPORT
+
+  return n < buf_len ? n : buf_len - 1;
+}
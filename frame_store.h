@@ -0,0 +1,61 @@
+#ifndef _FRAME_STORE_H_
+#define _FRAME_STORE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "motion_pipeline.h"
+#include "lossless_gray.h"
+
+// Lossless frame archive on LittleFS. Frames and masks of pipeline results
+// are coded with lossless_gray.h straight into FRAME_STORE_DIR/f<id>.lgr
+// (frames) and m<id>.lgr (masks), ids counting up across reboots. Past
+// FRAME_STORE_FILES files, or when a raw frame would not fit in the free
+// space, the oldest files go first.
+//
+// Sequences record every pipeline result for a while into s<id>.lgs:
+//
+//   "LS", version 1, 0, u16 width, u16 height          (little endian)
+//   per frame: u32 length, u32 seq, i64 capture_us, then a lossless_gray
+//              stream of `length` bytes
+//
+// Every FRAME_STORE_KEY_INTERVAL-th frame, starting with the first, is a
+// keyframe coded on its own; the others are coded in delta mode against the
+// frame before. Readers seek by hopping over the record lengths to the
+// keyframe at or before the frame they want and decode forward from there.
+// A sequence ends early when the free space drops below a raw frame; it is
+// never evicted while it is being written.
+
+#define FRAME_STORE_DIR   "/frames"
+#define FRAME_STORE_FILES 32
+#define FRAME_STORE_KEY_INTERVAL 25
+#define FRAME_STORE_SEQ_HEADER_LEN 8
+#define FRAME_STORE_RECORD_LEN 16
+
+bool frame_store_begin(void);
+
+// Stores the frame as captured, or the mask. Returns the new file id, -1 on
+// failure.
+int32_t frame_store_save(const mp_result_t *result, bool mask);
+
+// Starts recording a sequence of duration_ms on the recorder task. Returns
+// the sequence id, -1 when a recording is running or there is no space.
+int32_t frame_store_record(uint32_t duration_ms);
+
+typedef enum {
+  FRAME_STORE_OK,
+  FRAME_STORE_MISSING,  // no such file, nothing went to cb
+  FRAME_STORE_FAILED,   // cb gave up or the read failed part way
+  FRAME_STORE_BUSY,     // too many sends running, nothing went to cb
+} frame_store_res_t;
+
+// Streams the stored file `name` (e.g. "f000012.lgr") to cb. A sequence being
+// recorded is sent up to its last complete frame. The store is not locked
+// while cb runs; the file is kept from eviction until the send ends.
+frame_store_res_t frame_store_send(const char *name, lossless_gray_out_cb cb, void *arg);
+
+// {"used":u,"total":t,"recording":id or -1,"files":[{"name":"f000012.lgr","size":n},...]}
+#define FRAME_STORE_JSON_MAX (64 + FRAME_STORE_FILES * 48)
+size_t frame_store_report_json(char *buf, size_t buf_len);
+
+#endif /* _FRAME_STORE_H_ */
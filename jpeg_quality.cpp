@@ -0,0 +1,89 @@
+#include <string.h>
+#include "jpeg_quality.h"
+
+size_t jq_map_size(int width, int height) {
+  return (size_t)((width + JQ_BLOCK - 1) / JQ_BLOCK) * ((height + JQ_BLOCK - 1) / JQ_BLOCK);
+}
+
+static bool jq_block_moving(const uint8_t *mask, int width, int height, int bx, int by) {
+  int x1 = (bx + 1) * JQ_BLOCK < width ? (bx + 1) * JQ_BLOCK : width;
+  int y1 = (by + 1) * JQ_BLOCK < height ? (by + 1) * JQ_BLOCK : height;
+
+  for (int y = by * JQ_BLOCK; y < y1; y++) {
+    const uint8_t *row = mask + (size_t)y * width;
+    for (int x = bx * JQ_BLOCK; x < x1; x++) {
+      if (row[x]) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void jq_build_map(const uint8_t *mask, int width, int height, uint8_t level, uint8_t *map) {
+  int bw = (width + JQ_BLOCK - 1) / JQ_BLOCK;
+  int bh = (height + JQ_BLOCK - 1) / JQ_BLOCK;
+
+  level = level > JQ_LEVEL_MAX ? JQ_LEVEL_MAX : level;
+  memset(map, level, (size_t)bw * bh);
+  for (int by = 0; by < bh; by++) {
+    for (int bx = 0; bx < bw; bx++) {
+      if (!jq_block_moving(mask, width, height, bx, by)) {
+        continue;
+      }
+      // The ring of blocks around motion stays sharp too, the mask edge
+      // rarely matches the object edge
+      for (int y = by - 1; y <= by + 1; y++) {
+        for (int x = bx - 1; x <= bx + 1; x++) {
+          if (x >= 0 && y >= 0 && x < bw && y < bh) {
+            map[y * bw + x] = 0;
+          }
+        }
+      }
+    }
+  }
+}
+
+// Replaces every cell x cell square of the block with its mean.
+static void jq_filter_block(uint8_t *frame, size_t pitch, int bpp, int x0, int y0, int x1, int y1, int cell) {
+  for (int cy = y0; cy < y1; cy += cell) {
+    int cy1 = cy + cell < y1 ? cy + cell : y1;
+    for (int cx = x0; cx < x1; cx += cell) {
+      int cx1 = cx + cell < x1 ? cx + cell : x1;
+      uint32_t sum = 0;
+      for (int y = cy; y < cy1; y++) {
+        const uint8_t *p = frame + y * pitch + (size_t)cx * bpp;
+        for (int x = cx; x < cx1; x++, p += bpp) {
+          sum += *p;
+        }
+      }
+      int n = (cy1 - cy) * (cx1 - cx);
+      uint8_t mean = (sum + n / 2) / n;
+      for (int y = cy; y < cy1; y++) {
+        uint8_t *p = frame + y * pitch + (size_t)cx * bpp;
+        for (int x = cx; x < cx1; x++, p += bpp) {
+          *p = mean;
+        }
+      }
+    }
+  }
+}
+
+void jq_prefilter(uint8_t *frame, int width, int height, size_t pitch, int bpp, const uint8_t *map) {
+  int bw = (width + JQ_BLOCK - 1) / JQ_BLOCK;
+  int bh = (height + JQ_BLOCK - 1) / JQ_BLOCK;
+
+  for (int by = 0; by < bh; by++) {
+    for (int bx = 0; bx < bw; bx++) {
+      uint8_t level = map[by * bw + bx];
+      if (!level) {
+        continue;
+      }
+      int x0 = bx * JQ_BLOCK;
+      int y0 = by * JQ_BLOCK;
+      int x1 = x0 + JQ_BLOCK < width ? x0 + JQ_BLOCK : width;
+      int y1 = y0 + JQ_BLOCK < height ? y0 + JQ_BLOCK : height;
+      jq_filter_block(frame, pitch, bpp, x0, y0, x1, y1, 1 << (level > JQ_LEVEL_MAX ? JQ_LEVEL_MAX : level));
+    }
+  }
+}
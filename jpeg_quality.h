@@ -0,0 +1,30 @@
+#ifndef _JPEG_QUALITY_H_
+#define _JPEG_QUALITY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Region weighted JPEG quality. Neither fmt2jpg nor JPEGENC take per block
+// quantization tables, so the weighting happens on the pixels: a per MCU map
+// built from the motion mask keeps moving blocks as they are and low-pass
+// filters static ones before encoding. A filtered block has no energy in the
+// high frequency coefficients, which quantize to zero and cost almost no
+// bits, whichever encoder runs next.
+
+#define JQ_BLOCK     8
+// Filter levels: 1 averages 2x2 cells, 2 averages 4x4 cells, 3 keeps only
+// the block mean (DC).
+#define JQ_LEVEL_MAX 3
+
+// Map entries for a frame, one per 8x8 block, partial blocks included.
+size_t jq_map_size(int width, int height);
+
+// map[b] = 0 for blocks holding motion or bordering one, `level` elsewhere.
+void jq_build_map(const uint8_t *mask, int width, int height, uint8_t level, uint8_t *map);
+
+// Filters every block of the frame by its map level, in place. Pixels are
+// `bpp` bytes apart, only the first byte of each (gray or YUYV luma) is
+// touched; `pitch` is the row length in bytes.
+void jq_prefilter(uint8_t *frame, int width, int height, size_t pitch, int bpp, const uint8_t *map);
+
+#endif /* _JPEG_QUALITY_H_ */
@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include "os_port.h"
+#include "mem_policy.h"
+#include "convert_jpg.h"
+#include "jpeg_stream.h"
+
+#ifdef ESP_PLATFORM
+#include "esp32-hal-log.h"
+#define js_alloc(size) mem_class_alloc(MEM_CLASS_JPEG, size)
+#else
+#define log_e(format, ...) fprintf(stderr, format "\n", ##__VA_ARGS__)
+#define js_alloc(size)     malloc(size)
+#endif
+
+#define JS_TASK_STACK 4096
+#define JS_TASK_PRIO  4
+// Markers sent after the last slab of an encode
+#define JS_END_OK     -1
+#define JS_END_FAILED -2
+
+typedef struct {
+  const uint8_t *src;
+  uint16_t width;
+  uint16_t height;
+  size_t stride;
+  uint8_t quality;
+} js_job_t;
+
+typedef struct {
+  uint8_t *buf;
+  size_t len;
+} js_slab_t;
+
+static js_slab_t js_slabs[JPEG_STREAM_SLABS];
+static os_queue_t js_jobs;
+static os_queue_t js_free;    // slab indices the encoder may fill
+static os_queue_t js_filled;  // slab indices for the sender, then an end marker
+static os_sem_t js_session;   // taken by the caller owning the ring
+static std::atomic<bool> js_abort(false);
+static int js_cur = -1;       // slab the encoder is filling
+static jpeg_stream_stats_t js_stats;
+
+static void js_hand_over(void) {
+  if (js_cur >= 0) {
+    os_queue_send(js_filled, &js_cur, OS_WAIT_FOREVER);
+    js_cur = -1;
+  }
+}
+
+static size_t js_write(void *arg, size_t index, const void *data, size_t len) {
+  const uint8_t *p = (const uint8_t *)data;
+  size_t left = len;
+
+  while (left) {
+    if (js_abort.load()) {
+      return 0;
+    }
+    if (js_cur < 0 && !os_queue_receive(js_free, &js_cur, 0)) {
+      // Every slab is queued or being sent, wait for the sender
+      js_stats.slab_waits++;
+      os_queue_receive(js_free, &js_cur, OS_WAIT_FOREVER);
+    }
+    js_slab_t *slab = &js_slabs[js_cur];
+    size_t n = JPEG_STREAM_SLAB_SIZE - slab->len;
+    n = n < left ? n : left;
+    memcpy(slab->buf + slab->len, p, n);
+    slab->len += n;
+    p += n;
+    left -= n;
+    if (slab->len == JPEG_STREAM_SLAB_SIZE) {
+      js_hand_over();
+    }
+  }
+  return len;
+}
+
+static void js_row_done(void *arg, uint16_t row) {
+  js_hand_over();
+}
+
+static void js_encode_task(void *arg) {
+  for (;;) {
+    js_job_t job;
+    if (!os_queue_receive(js_jobs, &job, OS_WAIT_FOREVER)) {
+      continue;
+    }
+    bool ok = gray2jpg_rows(job.src, job.width, job.height, job.stride, job.quality, js_write, js_row_done, NULL);
+    if (js_cur >= 0 && !js_slabs[js_cur].len) {
+      os_queue_send(js_free, &js_cur, OS_WAIT_FOREVER);
+      js_cur = -1;
+    }
+    js_hand_over();
+    int end = ok ? JS_END_OK : JS_END_FAILED;
+    os_queue_send(js_filled, &end, OS_WAIT_FOREVER);
+  }
+}
+
+bool jpeg_stream_start(void) {
+  if (js_jobs) {
+    return true;
+  }
+  js_free = os_queue_create(JPEG_STREAM_SLABS, sizeof(int));
+  js_filled = os_queue_create(JPEG_STREAM_SLABS + 1, sizeof(int));
+  js_jobs = os_queue_create(1, sizeof(js_job_t));
+  js_session = os_sem_create();
+  if (!js_free || !js_filled || !js_jobs || !js_session) {
+    log_e("JPEG stream: queue creation failed");
+    return false;
+  }
+  for (int i = 0; i < JPEG_STREAM_SLABS; i++) {
+    js_slabs[i].buf = (uint8_t *)js_alloc(JPEG_STREAM_SLAB_SIZE);
+    if (!js_slabs[i].buf) {
+      log_e("JPEG stream: slab allocation failed");
+      return false;
+    }
+    os_queue_send(js_free, &i, 0);
+  }
+  if (!os_task_create(js_encode_task, "jpeg_stream", JS_TASK_STACK, NULL, JS_TASK_PRIO, OS_NO_AFFINITY)) {
+    log_e("JPEG stream: encoder task creation failed");
+    return false;
+  }
+  os_sem_give(js_session);
+  return true;
+}
+
+jpeg_stream_res_t jpeg_stream_encode(
+  const uint8_t *src, uint16_t width, uint16_t height, size_t stride, uint8_t quality, jpeg_stream_send_fn send, void *arg, uint32_t timeout_ms
+) {
+  int64_t t0 = os_time_us();
+  int64_t first = 0;
+  size_t bytes = 0;
+  bool sent_ok = true;
+  int index;
+
+  if (!js_session || !os_sem_take(js_session, timeout_ms)) {
+    js_stats.busy++;
+    return JPEG_STREAM_BUSY;
+  }
+  js_abort.store(false);
+  js_job_t job = {src, width, height, stride, quality};
+  os_queue_send(js_jobs, &job, OS_WAIT_FOREVER);
+
+  // Drain until the end marker, also after a failed send, so every slab
+  // goes back to the free queue
+  while (os_queue_receive(js_filled, &index, OS_WAIT_FOREVER) && index >= 0) {
+    js_slab_t *slab = &js_slabs[index];
+    if (sent_ok) {
+      if (!first) {
+        first = os_time_us();
+      }
+      sent_ok = send(arg, slab->buf, slab->len);
+      bytes += slab->len;
+      if (!sent_ok) {
+        js_abort.store(true);
+      }
+    }
+    slab->len = 0;
+    os_queue_send(js_free, &index, OS_WAIT_FOREVER);
+  }
+
+  bool ok = sent_ok && index == JS_END_OK;
+  if (ok) {
+    js_stats.encodes++;
+    js_stats.ttfb_us = first - t0;
+    js_stats.total_us = os_time_us() - t0;
+    js_stats.bytes = bytes;
+  } else {
+    js_stats.failures++;
+  }
+  os_sem_give(js_session);
+  return ok ? JPEG_STREAM_OK : JPEG_STREAM_FAILED;
+}
+
+void jpeg_stream_get_stats(jpeg_stream_stats_t *stats) {
+  *stats = js_stats;
+}
+
+size_t jpeg_stream_report_json(char *buf, size_t buf_len) {
+  jpeg_stream_stats_t st;
+  jpeg_stream_get_stats(&st);
+
+  int n = snprintf(
+    buf, buf_len, "{\"encodes\":%u,\"failures\":%u,\"busy\":%u,\"slab_waits\":%u,\"ttfb_us\":%u,\"total_us\":%u,\"bytes\":%u}", (unsigned)st.encodes,
+    (unsigned)st.failures, (unsigned)st.busy, (unsigned)st.slab_waits, (unsigned)st.ttfb_us, (unsigned)st.total_us, (unsigned)st.bytes
+  );
+  if (n < 0) {
+    return 0;
+  }
+  return (size_t)n < buf_len ? n : buf_len - 1;
+}
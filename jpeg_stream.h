@@ -0,0 +1,48 @@
+#ifndef _JPEG_STREAM_H_
+#define _JPEG_STREAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Encode-while-sending path for single JPEG responses. An encoder task writes
+// the gray2jpg_rows() output into a fixed ring of preallocated slabs and hands
+// a slab over as soon as it fills or an MCU row ends; the requesting task
+// sends it while the next rows are encoded. Nothing is allocated per frame.
+// The ring serves one encode at a time.
+
+#define JPEG_STREAM_SLABS     4
+#define JPEG_STREAM_SLAB_SIZE (8 * 1024)
+
+typedef enum {
+  JPEG_STREAM_OK,
+  JPEG_STREAM_BUSY,    // the ring stayed taken for timeout_ms, nothing was sent
+  JPEG_STREAM_FAILED,  // encode or send failed, output may be cut short
+} jpeg_stream_res_t;
+
+// Returns false to abort the encode.
+typedef bool (*jpeg_stream_send_fn)(void *arg, const uint8_t *data, size_t len);
+
+typedef struct {
+  uint32_t encodes;
+  uint32_t failures;
+  uint32_t busy;
+  uint32_t slab_waits;  // encoder found no free slab, sending is the bottleneck
+  uint32_t ttfb_us;     // last call to first byte passed to send
+  uint32_t total_us;    // last call to last byte
+  uint32_t bytes;       // last JPEG size
+} jpeg_stream_stats_t;
+
+bool jpeg_stream_start(void);
+
+// Encodes width x height grayscale pixels (rows `stride` bytes apart) and
+// passes the JPEG to `send` piece by piece, on the calling task. `src` must
+// stay valid until this returns.
+jpeg_stream_res_t jpeg_stream_encode(
+  const uint8_t *src, uint16_t width, uint16_t height, size_t stride, uint8_t quality, jpeg_stream_send_fn send, void *arg, uint32_t timeout_ms
+);
+
+void jpeg_stream_get_stats(jpeg_stream_stats_t *stats);
+size_t jpeg_stream_report_json(char *buf, size_t buf_len);
+
+#endif /* _JPEG_STREAM_H_ */
@@ -0,0 +1,276 @@
+#include <string.h>
+#include "lossless_gray.h"
+
+#define LG_CONTEXTS 8
+#define LG_LIMIT    24   // longest unary prefix before the raw escape
+#define LG_RESET    64   // context statistics are halved at this count
+#define LG_OUT_BUF  256
+
+// Running sum and count of the values coded in one context, k is the
+// smallest with n << k >= a.
+typedef struct {
+  uint32_t a;
+  uint16_t n;
+} lg_ctx_t;
+
+typedef struct {
+  lg_ctx_t ctx[LG_CONTEXTS];
+  lg_ctx_t run;
+} lg_model_t;
+
+typedef struct {
+  lossless_gray_out_cb cb;
+  void *arg;
+  size_t index;  // bytes handed to cb
+  uint32_t acc;  // pending bits, the low `bits` of it
+  int bits;
+  size_t n;
+  bool ok;
+  uint8_t buf[LG_OUT_BUF];
+} lg_writer_t;
+
+typedef struct {
+  const uint8_t *data;
+  size_t len;
+  size_t pos;
+  uint32_t acc;
+  int bits;
+  bool ok;
+} lg_reader_t;
+
+static void lg_model_init(lg_model_t *m) {
+  for (int i = 0; i < LG_CONTEXTS; i++) {
+    m->ctx[i] = {4, 1};
+  }
+  m->run = {16, 1};
+}
+
+static int lg_k(const lg_ctx_t *c, int kmax) {
+  int k = 0;
+  while (k < kmax && ((uint32_t)c->n << k) < c->a) {
+    k++;
+  }
+  return k;
+}
+
+static void lg_update(lg_ctx_t *c, uint32_t v) {
+  c->a += v;
+  if (++c->n == LG_RESET) {
+    c->a >>= 1;
+    c->n >>= 1;
+  }
+}
+
+// Value the model codes at x: the pixel, or in delta mode its difference
+// to the reference frame, -128..127.
+static inline int lg_value(const uint8_t *row, const uint8_t *ref, int x) {
+  return ref ? (int8_t)(row[x] - ref[x]) : row[x];
+}
+
+// Left, upper and upper left neighbours, replicated from the row above or
+// the left at the edges. ref and ref_up are the reference rows in delta mode,
+// NULL otherwise.
+static inline void lg_neighbours(const uint8_t *row, const uint8_t *up, const uint8_t *ref, const uint8_t *ref_up, int x, int *a, int *b, int *c) {
+  *a = x ? lg_value(row, ref, x - 1) : (up ? lg_value(up, ref_up, 0) : 0);
+  *b = up ? lg_value(up, ref_up, x) : *a;
+  *c = x && up ? lg_value(up, ref_up, x - 1) : *b;
+}
+
+static inline int lg_predict(int a, int b, int c) {
+  int lo = a < b ? a : b;
+  int hi = a < b ? b : a;
+  return c >= hi ? lo : c <= lo ? hi : a + b - c;
+}
+
+static inline int lg_context(int a, int b, int c) {
+  int g = (a > c ? a - c : c - a) + (b > c ? b - c : c - b);
+  if (!g) {
+    return 0;
+  }
+  int bucket = 32 - __builtin_clz(g);
+  return bucket < LG_CONTEXTS ? bucket : LG_CONTEXTS - 1;
+}
+
+static void lg_flush(lg_writer_t *w) {
+  if (w->ok && w->n && w->cb(w->arg, w->index, w->buf, w->n) != w->n) {
+    w->ok = false;
+  }
+  w->index += w->n;
+  w->n = 0;
+}
+
+// n up to 24 bits
+static void lg_put_bits(lg_writer_t *w, uint32_t v, int n) {
+  w->acc = (w->acc << n) | v;
+  w->bits += n;
+  while (w->bits >= 8) {
+    w->bits -= 8;
+    w->buf[w->n++] = w->acc >> w->bits;
+    if (w->n == LG_OUT_BUF) {
+      lg_flush(w);
+    }
+  }
+  w->acc &= (1u << w->bits) - 1;
+}
+
+static void lg_put_rice(lg_writer_t *w, lg_ctx_t *c, uint32_t v, int kmax, int raw_bits) {
+  int k = lg_k(c, kmax);
+  uint32_t q = v >> k;
+
+  if (q < LG_LIMIT) {
+    lg_put_bits(w, ((1u << q) - 1) << 1, q + 1);
+    if (k) {
+      lg_put_bits(w, v & ((1u << k) - 1), k);
+    }
+  } else {
+    lg_put_bits(w, (1u << LG_LIMIT) - 1, LG_LIMIT);
+    lg_put_bits(w, v, raw_bits);
+  }
+  lg_update(c, v);
+}
+
+static uint32_t lg_get_bits(lg_reader_t *r, int n) {
+  while (r->bits < n) {
+    if (r->pos >= r->len) {
+      r->ok = false;
+      return 0;
+    }
+    r->acc = (r->acc << 8) | r->data[r->pos++];
+    r->bits += 8;
+  }
+  r->bits -= n;
+  return (r->acc >> r->bits) & ((1u << n) - 1);
+}
+
+static uint32_t lg_get_rice(lg_reader_t *r, lg_ctx_t *c, int kmax, int raw_bits) {
+  int k = lg_k(c, kmax);
+  uint32_t q = 0;
+  uint32_t v;
+
+  while (q < LG_LIMIT && lg_get_bits(r, 1)) {
+    q++;
+  }
+  if (q < LG_LIMIT) {
+    v = q << k | (k ? lg_get_bits(r, k) : 0);
+  } else {
+    v = lg_get_bits(r, raw_bits);
+  }
+  lg_update(c, v);
+  return v;
+}
+
+// Pixels are predicted by the median edge detector and contexts come from the
+// local gradient; delta values are predicted as 0 and contexts come from the
+// size of the neighbouring differences, so static areas cost runs and noise.
+static bool lg_encode(const uint8_t *src, const uint8_t *ref, uint16_t width, uint16_t height, size_t stride, lossless_gray_out_cb cb, void *arg) {
+  lg_writer_t w;
+  lg_model_t m;
+
+  w.cb = cb;
+  w.arg = arg;
+  w.index = 0;
+  w.acc = 0;
+  w.bits = 0;
+  w.n = 0;
+  w.ok = true;
+  lg_model_init(&m);
+
+  const uint8_t header[LOSSLESS_GRAY_HEADER_LEN] = {
+    'L', 'G', LOSSLESS_GRAY_VERSION, (uint8_t)(ref ? LOSSLESS_GRAY_DELTA : 0), (uint8_t)width, (uint8_t)(width >> 8), (uint8_t)height, (uint8_t)(height >> 8)
+  };
+  memcpy(w.buf, header, sizeof(header));
+  w.n = sizeof(header);
+
+  for (int y = 0; y < height && w.ok; y++) {
+    const uint8_t *row = src + y * stride;
+    const uint8_t *up = y ? row - stride : NULL;
+    const uint8_t *ref_row = ref ? ref + y * stride : NULL;
+    const uint8_t *ref_up = ref && y ? ref_row - stride : NULL;
+    bool after_run = false;
+    for (int x = 0; x < width;) {
+      int a, b, c;
+      lg_neighbours(row, up, ref_row, ref_up, x, &a, &b, &c);
+      if (!after_run && a == b && b == c) {
+        int run = 0;
+        while (x + run < width && lg_value(row, ref_row, x + run) == a) {
+          run++;
+        }
+        lg_put_rice(&w, &m.run, run, 15, 16);
+        x += run;
+        after_run = x < width;
+        continue;
+      }
+      after_run = false;
+      int8_t e = (int8_t)(lg_value(row, ref_row, x) - (ref ? 0 : lg_predict(a, b, c)));
+      uint32_t u = e >= 0 ? 2 * e : -2 * e - 1;
+      lg_put_rice(&w, &m.ctx[ref ? lg_context(a, b, 0) : lg_context(a, b, c)], u, 8, 8);
+      x++;
+    }
+  }
+  if (w.bits) {
+    lg_put_bits(&w, 0, 8 - w.bits);
+  }
+  lg_flush(&w);
+  return w.ok;
+}
+
+bool lossless_gray_encode(const uint8_t *src, uint16_t width, uint16_t height, size_t stride, lossless_gray_out_cb cb, void *arg) {
+  return lg_encode(src, NULL, width, height, stride, cb, arg);
+}
+
+bool lossless_gray_encode_delta(const uint8_t *src, const uint8_t *ref, uint16_t width, uint16_t height, size_t stride, lossless_gray_out_cb cb, void *arg) {
+  return lg_encode(src, ref, width, height, stride, cb, arg);
+}
+
+bool lossless_gray_info(const uint8_t *data, size_t len, uint16_t *width, uint16_t *height) {
+  if (len < LOSSLESS_GRAY_HEADER_LEN || data[0] != 'L' || data[1] != 'G' || data[2] != LOSSLESS_GRAY_VERSION) {
+    return false;
+  }
+  *width = data[4] | data[5] << 8;
+  *height = data[6] | data[7] << 8;
+  return true;
+}
+
+bool lossless_gray_decode(const uint8_t *data, size_t len, const uint8_t *ref, uint8_t *out, size_t out_len) {
+  uint16_t width, height;
+  lg_reader_t r = {data, len, LOSSLESS_GRAY_HEADER_LEN, 0, 0, true};
+  lg_model_t m;
+
+  if (!lossless_gray_info(data, len, &width, &height) || (size_t)width * height > out_len) {
+    return false;
+  }
+  if (!(data[3] & LOSSLESS_GRAY_DELTA)) {
+    ref = NULL;
+  } else if (!ref) {
+    return false;
+  }
+  lg_model_init(&m);
+  for (int y = 0; y < height && r.ok; y++) {
+    uint8_t *row = out + y * width;
+    const uint8_t *up = y ? row - width : NULL;
+    const uint8_t *ref_row = ref ? ref + y * width : NULL;
+    const uint8_t *ref_up = ref && y ? ref_row - width : NULL;
+    bool after_run = false;
+    for (int x = 0; x < width && r.ok;) {
+      int a, b, c;
+      lg_neighbours(row, up, ref_row, ref_up, x, &a, &b, &c);
+      if (!after_run && a == b && b == c) {
+        uint32_t run = lg_get_rice(&r, &m.run, 15, 16);
+        if (run > (uint32_t)(width - x)) {
+          return false;
+        }
+        for (uint32_t k = 0; k < run; k++, x++) {
+          row[x] = ref ? ref_row[x] + a : a;
+        }
+        after_run = x < width;
+        continue;
+      }
+      after_run = false;
+      uint32_t u = lg_get_rice(&r, &m.ctx[ref ? lg_context(a, b, 0) : lg_context(a, b, c)], 8, 8);
+      int e = u & 1 ? -(int)((u + 1) >> 1) : (int)(u >> 1);
+      row[x] = ref ? ref_row[x] + e : lg_predict(a, b, c) + e;
+      x++;
+    }
+  }
+  return r.ok;
+}
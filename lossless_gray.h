@@ -0,0 +1,53 @@
+#ifndef _LOSSLESS_GRAY_H_
+#define _LOSSLESS_GRAY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Lossless codec for 8-bit grayscale frames and masks, a cut down LOCO-I
+// (JPEG-LS) in one streaming pass:
+//
+// - each pixel is predicted from its left (a), upper (b) and upper left (c)
+//   neighbours by the median edge detector, the residual mod 256 is zigzag
+//   mapped and Rice coded with k adapted per context, the context being the
+//   local gradient |a - c| + |b - c| in 8 log2 buckets;
+// - where a == b == c the coder switches to run mode and codes the number of
+//   pixels equal to a up to the end of the row, Rice coded with a k of its
+//   own; a run that stops before the end of the row is followed by one
+//   pixel in regular mode.
+//
+// In delta mode (flag LOSSLESS_GRAY_DELTA) the model codes the difference of
+// each pixel to the same pixel of a reference frame, the previous frame of a
+// sequence, predicted as 0 with contexts from the neighbouring differences:
+// a static scene codes as runs plus sensor noise.
+//
+// Rice codes longer than LG_LIMIT ones escape to the raw value (8 bits for
+// residuals, 16 for runs). Bits are MSB first, the last byte zero padded.
+//
+// Stream: "LG", version 1, flags, u16 width, u16 height (little endian),
+// then the bits. Frames shrink as far as the sensor noise allows, a motion
+// mask comes to a few hundred bytes.
+
+#define LOSSLESS_GRAY_VERSION    1
+#define LOSSLESS_GRAY_HEADER_LEN 8
+#define LOSSLESS_GRAY_DELTA      0x01  // flags: coded against a reference frame
+
+// Same contract as gray_jpg_out_cb (convert_jpg.h): `index` is the output
+// offset, returning less than `len` aborts the encode.
+typedef size_t (*lossless_gray_out_cb)(void *arg, size_t index, const void *data, size_t len);
+
+// Encodes width x height pixels, rows `stride` bytes apart. Output goes to
+// `cb` in chunks of up to 256 bytes; nothing is allocated.
+bool lossless_gray_encode(const uint8_t *src, uint16_t width, uint16_t height, size_t stride, lossless_gray_out_cb cb, void *arg);
+// Delta mode against ref, a frame of the same size and stride.
+bool lossless_gray_encode_delta(const uint8_t *src, const uint8_t *ref, uint16_t width, uint16_t height, size_t stride, lossless_gray_out_cb cb, void *arg);
+
+// Reads the size from the stream header, false when it is not one.
+bool lossless_gray_info(const uint8_t *data, size_t len, uint16_t *width, uint16_t *height);
+// Decodes into out (width * height bytes, rows packed). ref is the frame a
+// delta stream was coded against, rows packed, ignored for other streams.
+// Returns false on a malformed or short stream, or a delta stream without ref.
+bool lossless_gray_decode(const uint8_t *data, size_t len, const uint8_t *ref, uint8_t *out, size_t out_len);
+
+#endif /* _LOSSLESS_GRAY_H_ */
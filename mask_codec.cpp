@@ -0,0 +1,97 @@
+#include <string.h>
+#include "mask_codec.h"
+
+#define MC_MAX_RUN 128
+
+// Byte `i` of the bit-packed mask, the last one zero padded.
+static uint8_t mc_packed_byte(const uint8_t *mask, size_t bits, size_t i) {
+  size_t bit = i * 8;
+  uint8_t v = 0;
+
+  if (bit + 8 <= bits) {
+    const uint8_t *p = mask + bit;
+    for (int k = 0; k < 8; k++) {
+      v = (v << 1) | (p[k] != 0);
+    }
+    return v;
+  }
+  for (int k = 0; k < 8; k++, bit++) {
+    v = (v << 1) | (bit < bits && mask[bit] != 0);
+  }
+  return v;
+}
+
+size_t mask_encoded_max(int width, int height) {
+  size_t packed = ((size_t)width * height + 7) / 8;
+  return packed + (packed + MC_MAX_RUN - 1) / MC_MAX_RUN;
+}
+
+size_t mask_encode(const uint8_t *mask, int width, int height, uint8_t *out, size_t out_len) {
+  size_t bits = (size_t)width * height;
+  size_t packed = (bits + 7) / 8;
+  size_t n = 0;
+  size_t lit = 0;  // output offset of the open literal header, 0 when none
+  size_t i = 0;
+
+  while (i < packed) {
+    uint8_t v = mc_packed_byte(mask, bits, i);
+    size_t run = 1;
+    while (i + run < packed && run < MC_MAX_RUN && mc_packed_byte(mask, bits, i + run) == v) {
+      run++;
+    }
+    // A pair only breaks even as a run, inside a literal it stays there
+    if (run >= 3 || (run == 2 && !lit)) {
+      if (n + 2 > out_len) {
+        return 0;
+      }
+      out[n++] = (uint8_t)(1 - (int)run);
+      out[n++] = v;
+      lit = 0;
+      i += run;
+      continue;
+    }
+    if (!lit || out[lit - 1] == MC_MAX_RUN - 1) {
+      if (n + 1 > out_len) {
+        return 0;
+      }
+      out[n++] = 0xff;  // bumped to 0 by the first literal
+      lit = n;
+    }
+    if (n + 1 > out_len) {
+      return 0;
+    }
+    out[lit - 1]++;
+    out[n++] = v;
+    i++;
+  }
+  return n;
+}
+
+bool mask_decode(const uint8_t *data, size_t len, int width, int height, uint8_t *mask) {
+  size_t bits = (size_t)width * height;
+  size_t bit = 0;
+  size_t i = 0;
+
+  while (bit < bits) {
+    if (i >= len) {
+      return false;
+    }
+    int8_t h = (int8_t)data[i++];
+    if (h == -128) {
+      continue;
+    }
+    size_t count = h >= 0 ? (size_t)h + 1 : (size_t)(1 - h);
+    size_t step = h >= 0 ? 1 : 0;
+    if (i + (h >= 0 ? count : 1) > len) {
+      return false;
+    }
+    for (size_t k = 0; k < count && bit < bits; k++) {
+      uint8_t v = data[i + k * step];
+      for (int b = 7; b >= 0 && bit < bits; b--) {
+        mask[bit++] = (v >> b) & 1 ? 255 : 0;
+      }
+    }
+    i += h >= 0 ? count : 1;
+  }
+  return true;
+}
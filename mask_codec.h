@@ -0,0 +1,24 @@
+#ifndef _MASK_CODEC_H_
+#define _MASK_CODEC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Compact wire format for the binary motion mask: one bit per pixel, row
+// major with no row padding, MSB first, set for nonzero mask bytes. The bit
+// stream is then PackBits coded: a header byte n in 0..127 is followed by
+// n + 1 literal bytes, n in -127..-1 by one byte repeated 1 - n times. A
+// mostly empty mask comes down to a few hundred bytes.
+
+// Worst case mask_encode() output for a width x height mask.
+size_t mask_encoded_max(int width, int height);
+
+// Returns the encoded size, 0 when out_len is too small.
+size_t mask_encode(const uint8_t *mask, int width, int height, uint8_t *out, size_t out_len);
+
+// Inverse of mask_encode(), writes 0 or 255 per pixel. Returns false on a
+// malformed or short payload.
+bool mask_decode(const uint8_t *data, size_t len, int width, int height, uint8_t *mask);
+
+#endif /* _MASK_CODEC_H_ */
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <string.h>
+#include "esp_heap_caps.h"
+#include "esp32-hal-log.h"
+#include "freertos/FreeRTOS.h"
+#include "frame_arena.h"
+#include "mem_policy.h"
+
+#define CAPS_INTERNAL (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+#define CAPS_PSRAM    (MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT)
+
+// Budgets are sized for 240x240 grayscale frames. Only the small, hot classes
+// prefer internal RAM; full frame masks are bulk buffers like the frames.
+static const mem_policy_t mem_policies[MEM_CLASS_MAX] = {
+  {"line", CAPS_INTERNAL, CAPS_PSRAM, 16 * 1024},
+  {"mask", CAPS_PSRAM, CAPS_INTERNAL, 3 * 240 * 240},
+  {"labels", CAPS_INTERNAL, CAPS_PSRAM, 240 * 240 * 2},
+  {"frame", CAPS_PSRAM, 0, 15 * 240 * 240},
+  {"jpeg", CAPS_PSRAM, CAPS_INTERNAL, 656 * 1024},
+};
+
+static mem_class_stats_t mem_stats[MEM_CLASS_MAX];
+static portMUX_TYPE mem_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+const mem_policy_t *mem_policy_get(mem_class_t cls) {
+  return &mem_policies[cls];
+}
+
+bool mem_internal_room(size_t size) {
+  return heap_caps_get_free_size(CAPS_INTERNAL) >= size + MEM_INTERNAL_RESERVE;
+}
+
+// Internal allocations are refused once they would eat into the reserve.
+static void *mem_heap_alloc(size_t size, uint32_t caps) {
+  if ((caps & MALLOC_CAP_INTERNAL) && !mem_internal_room(size)) {
+    return NULL;
+  }
+  return heap_caps_malloc(size, caps);
+}
+
+void mem_class_charge(mem_class_t cls, size_t size, bool fallback) {
+  portENTER_CRITICAL(&mem_stats_lock);
+  mem_class_stats_t *st = &mem_stats[cls];
+  st->used += size;
+  st->allocs++;
+  if (fallback) {
+    st->fallbacks++;
+  }
+  if (st->used > st->peak) {
+    st->peak = st->used;
+  }
+  portEXIT_CRITICAL(&mem_stats_lock);
+}
+
+void mem_class_release(mem_class_t cls, size_t size) {
+  portENTER_CRITICAL(&mem_stats_lock);
+  mem_class_stats_t *st = &mem_stats[cls];
+  st->used = (st->used > size) ? st->used - size : 0;
+  portEXIT_CRITICAL(&mem_stats_lock);
+}
+
+void *mem_class_alloc(mem_class_t cls, size_t size) {
+  const mem_policy_t *p = &mem_policies[cls];
+  bool fallback = false;
+
+  void *ptr = mem_heap_alloc(size, p->caps);
+  if (!ptr && p->fallback_caps) {
+    ptr = mem_heap_alloc(size, p->fallback_caps);
+    fallback = true;
+  }
+  if (!ptr) {
+    portENTER_CRITICAL(&mem_stats_lock);
+    mem_stats[cls].failures++;
+    portEXIT_CRITICAL(&mem_stats_lock);
+    log_e("%s: allocation of %u bytes failed", p->name, size);
+    return NULL;
+  }
+  mem_class_charge(cls, heap_caps_get_allocated_size(ptr), fallback);
+  return ptr;
+}
+
+void mem_class_free(mem_class_t cls, void *ptr) {
+  if (!ptr) {
+    return;
+  }
+  mem_class_release(cls, heap_caps_get_allocated_size(ptr));
+  heap_caps_free(ptr);
+}
+
+void mem_class_get_stats(mem_class_t cls, mem_class_stats_t *stats) {
+  portENTER_CRITICAL(&mem_stats_lock);
+  *stats = mem_stats[cls];
+  portEXIT_CRITICAL(&mem_stats_lock);
+}
+
+size_t mem_policy_report_json(char *buf, size_t buf_len) {
+  static const char *region_names[ARENA_REGION_MAX] = {"psram", "internal"};
+  size_t n = 0;
+
+#define REPORT(...)                                           \
+  do {                                                        \
+    if (n < buf_len) {                                        \
+      n += snprintf(buf + n, buf_len - n, __VA_ARGS__);       \
+    }                                                         \
+  } while (0)
+
+  REPORT("{\"classes\":[");
+  for (int i = 0; i < MEM_CLASS_MAX; i++) {
+    mem_class_stats_t st;
+    mem_class_get_stats((mem_class_t)i, &st);
+    REPORT(
+      "%s{\"name\":\"%s\",\"used\":%u,\"peak\":%u,\"budget\":%u,\"allocs\":%u,\"fallbacks\":%u,\"failures\":%u,\"over_budget\":%s}", i ? "," : "",
+      mem_policies[i].name, st.used, st.peak, mem_policies[i].budget, st.allocs, st.fallbacks, st.failures,
+      st.peak > mem_policies[i].budget ? "true" : "false"
+    );
+  }
+  REPORT("],\"arena\":{");
+  for (int i = 0; i < ARENA_REGION_MAX; i++) {
+    REPORT(
+      "%s\"%s\":{\"size\":%u,\"used\":%u,\"high_water\":%u}", i ? "," : "", region_names[i], frame_arena_size((arena_region_t)i),
+      frame_arena_used((arena_region_t)i), frame_arena_high_water((arena_region_t)i)
+    );
+  }
+  REPORT(
+    "},\"heap\":{\"internal_free\":%u,\"internal_min_free\":%u,\"internal_largest\":%u,\"psram_free\":%u,\"psram_min_free\":%u}}",
+    heap_caps_get_free_size(CAPS_INTERNAL), heap_caps_get_minimum_free_size(CAPS_INTERNAL), heap_caps_get_largest_free_block(CAPS_INTERNAL),
+    heap_caps_get_free_size(CAPS_PSRAM), heap_caps_get_minimum_free_size(CAPS_PSRAM)
+  );
+#undef REPORT
+
+  return n < buf_len ? n : buf_len - 1;
+}
@@ -0,0 +1,58 @@
+#ifndef _MEM_POLICY_H_
+#define _MEM_POLICY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Every buffer of the detection pipeline belongs to one class. The class
+// decides where the buffer is placed and whose budget it is charged to.
+typedef enum {
+  MEM_CLASS_LINE = 0,  // row buffers touched for every pixel
+  MEM_CLASS_MASK,      // binary masks and visited maps, full frame sized
+  MEM_CLASS_LABELS,    // connected component label maps
+  MEM_CLASS_FRAME,     // full frames and frame copies
+  MEM_CLASS_JPEG,      // encoder output
+  MEM_CLASS_MAX
+} mem_class_t;
+
+// Internal DRAM kept free for task stacks, lwIP and the drivers: buffers that
+// would leave less than this go to their fallback heap instead.
+#define MEM_INTERNAL_RESERVE (64 * 1024)
+
+typedef struct {
+  const char *name;
+  uint32_t caps;           // preferred heap capabilities
+  uint32_t fallback_caps;  // used when the preferred heap is full, 0 = none
+  size_t budget;           // bytes the class is expected to stay below
+} mem_policy_t;
+
+typedef struct {
+  size_t used;
+  size_t peak;
+  uint32_t allocs;
+  uint32_t fallbacks;
+  uint32_t failures;
+} mem_class_stats_t;
+
+const mem_policy_t *mem_policy_get(mem_class_t cls);
+
+// Whether `size` more bytes of internal DRAM still leave MEM_INTERNAL_RESERVE.
+bool mem_internal_room(size_t size);
+
+// Heap allocation following the class policy. Buffers must be released with
+// mem_class_free() so the class accounting stays correct.
+void *mem_class_alloc(mem_class_t cls, size_t size);
+void mem_class_free(mem_class_t cls, void *ptr);
+
+// Accounting for memory the class obtained elsewhere (frame arena).
+void mem_class_charge(mem_class_t cls, size_t size, bool fallback);
+void mem_class_release(mem_class_t cls, size_t size);
+
+void mem_class_get_stats(mem_class_t cls, mem_class_stats_t *stats);
+
+// Writes a JSON report of every class, the frame arena and the heaps.
+// Returns the number of characters written (without the terminator).
+size_t mem_policy_report_json(char *buf, size_t buf_len);
+
+#endif /* _MEM_POLICY_H_ */
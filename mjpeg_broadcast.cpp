@@ -0,0 +1,461 @@
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include "esp32-hal-log.h"
+#include "convert_jpg.h"
+#include "os_port.h"
+#include "mem_policy.h"
+#include "snap_ring.h"
+#include "motion_pipeline.h"
+#include "mjpeg_broadcast.h"
+
+#define MJPEG_TASK_STACK 4096
+#define MJPEG_TASK_PRIO  3
+#define MJPEG_POLL_MS    5
+// A tile is dirty once this many pixels moved this far from the keyframe
+#define MJPEG_TILE_PIX_DIFF 24
+#define MJPEG_TILE_MIN_PIX  6
+
+// Tile headers start 4-byte aligned
+#define MB_TILE_SPAN(len) ((sizeof(mjpeg_tile_t) + (len) + 3) & ~(size_t)3)
+
+typedef struct {
+  mjpeg_frame_t frame;  // first member, viewers get a pointer to it
+  uint8_t *buf;
+  size_t cap;
+  uint8_t *tiles_buf;
+  bool overflow;
+} mjpeg_slab_t;
+
+static mjpeg_slab_t mb_slabs[MJPEG_SLABS];
+static snap_ring_t mb_ring;
+static os_sem_t mb_wake;
+static int mb_quality;
+static std::atomic<int32_t> mb_viewers(0);
+static std::atomic<int32_t> mb_tile_viewers(0);
+static std::atomic<bool> mb_want_key(true);
+// Frame the current keyframe was encoded from and the tiles changed since
+static uint8_t *mb_ref;
+static uint8_t *mb_dirty;
+static uint16_t mb_ref_w;
+static uint16_t mb_ref_h;
+static uint32_t mb_key_num;
+static mjpeg_viewer_t mb_viewer_slots[MJPEG_MAX_VIEWERS];
+static std::atomic<bool> mb_viewer_used[MJPEG_MAX_VIEWERS];
+static mjpeg_stats_t mb_stats;
+
+static size_t mb_slab_write(void *arg, size_t index, const void *data, size_t len) {
+  mjpeg_slab_t *slab = (mjpeg_slab_t *)arg;
+
+  if (index + len > slab->cap) {
+    slab->overflow = true;
+    return 0;
+  }
+  memcpy(slab->buf + index, data, len);
+  slab->frame.len = index + len;
+  return len;
+}
+
+static size_t mb_tile_write(void *arg, size_t index, const void *data, size_t len) {
+  mjpeg_slab_t *slab = (mjpeg_slab_t *)arg;
+  mjpeg_tile_t *tile = (mjpeg_tile_t *)(slab->tiles_buf + slab->frame.tiles_len);
+
+  if (slab->frame.tiles_len + MB_TILE_SPAN(index + len) > MJPEG_TILE_SLAB_SIZE) {
+    slab->overflow = true;
+    return 0;
+  }
+  memcpy((uint8_t *)(tile + 1) + index, data, len);
+  tile->len = index + len;
+  return len;
+}
+
+static bool mb_tiles_reset(uint16_t w, uint16_t h) {
+  if (mb_ref && mb_ref_w == w && mb_ref_h == h) {
+    return true;
+  }
+  mem_class_free(MEM_CLASS_FRAME, mb_ref);
+  mem_class_free(MEM_CLASS_MASK, mb_dirty);
+  size_t tiles = (size_t)((w + MJPEG_TILE_SIZE - 1) / MJPEG_TILE_SIZE) * ((h + MJPEG_TILE_SIZE - 1) / MJPEG_TILE_SIZE);
+  mb_ref = (uint8_t *)mem_class_alloc(MEM_CLASS_FRAME, (size_t)w * h);
+  mb_dirty = (uint8_t *)mem_class_alloc(MEM_CLASS_MASK, tiles);
+  if (!mb_ref || !mb_dirty) {
+    log_e("MJPEG: tile state allocation failed");
+    mem_class_free(MEM_CLASS_FRAME, mb_ref);
+    mem_class_free(MEM_CLASS_MASK, mb_dirty);
+    mb_ref = mb_dirty = NULL;
+    return false;
+  }
+  mb_ref_w = w;
+  mb_ref_h = h;
+  return true;
+}
+
+static bool mb_tile_changed(const uint8_t *frame, int x0, int y0, int tw, int th) {
+  int moved = 0;
+
+  for (int y = y0; y < y0 + th; y++) {
+    const uint8_t *a = frame + (size_t)y * mb_ref_w + x0;
+    const uint8_t *b = mb_ref + (size_t)y * mb_ref_w + x0;
+    for (int x = 0; x < tw; x++) {
+      int d = a[x] - b[x];
+      if ((d > MJPEG_TILE_PIX_DIFF || d < -MJPEG_TILE_PIX_DIFF) && ++moved >= MJPEG_TILE_MIN_PIX) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Marks the tiles that changed since the keyframe, true when the frame has to
+// be a keyframe instead.
+static bool mb_tiles_update(const mp_result_t *r) {
+  if (!mb_tiles_reset(r->width, r->height)) {
+    return true;
+  }
+  if (mb_want_key.exchange(false) || mb_stats.encoded + 1 - mb_key_num >= MJPEG_KEY_INTERVAL) {
+    return true;
+  }
+  int tiles_x = (r->width + MJPEG_TILE_SIZE - 1) / MJPEG_TILE_SIZE;
+  int tiles_y = (r->height + MJPEG_TILE_SIZE - 1) / MJPEG_TILE_SIZE;
+  int dirty = 0;
+  for (int ty = 0; ty < tiles_y; ty++) {
+    for (int tx = 0; tx < tiles_x; tx++) {
+      uint8_t *d = &mb_dirty[ty * tiles_x + tx];
+      if (!*d) {
+        int x0 = tx * MJPEG_TILE_SIZE;
+        int y0 = ty * MJPEG_TILE_SIZE;
+        int tw = x0 + MJPEG_TILE_SIZE < r->width ? MJPEG_TILE_SIZE : r->width - x0;
+        int th = y0 + MJPEG_TILE_SIZE < r->height ? MJPEG_TILE_SIZE : r->height - y0;
+        *d = mb_tile_changed(r->frame, x0, y0, tw, th);
+      }
+      dirty += *d;
+    }
+  }
+  return dirty * 2 > tiles_x * tiles_y;
+}
+
+static bool mb_encode_tiles(mjpeg_slab_t *slab, const mp_result_t *r) {
+  int tiles_x = (r->width + MJPEG_TILE_SIZE - 1) / MJPEG_TILE_SIZE;
+  int tiles_y = (r->height + MJPEG_TILE_SIZE - 1) / MJPEG_TILE_SIZE;
+
+  for (int ty = 0; ty < tiles_y; ty++) {
+    for (int tx = 0; tx < tiles_x; tx++) {
+      if (!mb_dirty[ty * tiles_x + tx]) {
+        continue;
+      }
+      mjpeg_tile_t *tile = (mjpeg_tile_t *)(slab->tiles_buf + slab->frame.tiles_len);
+      if (slab->frame.tiles_len + MB_TILE_SPAN(0) > MJPEG_TILE_SLAB_SIZE) {
+        return false;
+      }
+      tile->x = tx * MJPEG_TILE_SIZE;
+      tile->y = ty * MJPEG_TILE_SIZE;
+      tile->w = tile->x + MJPEG_TILE_SIZE < r->width ? MJPEG_TILE_SIZE : r->width - tile->x;
+      tile->h = tile->y + MJPEG_TILE_SIZE < r->height ? MJPEG_TILE_SIZE : r->height - tile->y;
+      tile->len = 0;
+      const uint8_t *src = r->frame + (size_t)tile->y * r->width + tile->x;
+      if (!gray2jpg_cb(src, tile->w, tile->h, r->width, mb_quality, mb_tile_write, slab) || slab->overflow) {
+        return false;
+      }
+      slab->frame.tiles_len += MB_TILE_SPAN(tile->len);
+      slab->frame.tile_count++;
+    }
+  }
+  return true;
+}
+
+// Detections travelling with the slab: the motion score and the largest
+// MJPEG_MAX_BOXES regions, largest first.
+static void mb_set_boxes(mjpeg_frame_t *frame, const mp_result_t *r) {
+  const md_regions_t *rg = &r->regions;
+  uint32_t areas[MJPEG_MAX_BOXES];
+  uint64_t total = 0;
+
+  frame->box_count = 0;
+  for (int i = 0; i < rg->count; i++) {
+    total += rg->area[i];
+    int k = frame->box_count < MJPEG_MAX_BOXES ? frame->box_count++ : MJPEG_MAX_BOXES;
+    for (; k > 0 && areas[k - 1] < rg->area[i]; k--) {
+      if (k < MJPEG_MAX_BOXES) {
+        areas[k] = areas[k - 1];
+        frame->boxes[k] = frame->boxes[k - 1];
+      }
+    }
+    if (k < MJPEG_MAX_BOXES) {
+      areas[k] = rg->area[i];
+      frame->boxes[k] = {rg->min_x[i], rg->min_y[i], (uint16_t)(rg->max_x[i] - rg->min_x[i] + 1), (uint16_t)(rg->max_y[i] - rg->min_y[i] + 1)};
+    }
+  }
+  uint32_t pixels = (uint32_t)r->width * r->height;
+  frame->motion_score = pixels ? (total * 1000 + pixels - 1) / pixels : 0;
+  frame->region_count = rg->count;
+}
+
+static void mb_encode_task(void *arg) {
+  uint32_t last_seq = 0;
+
+  for (;;) {
+    int32_t viewers = mb_viewers.load();
+    int32_t tile_viewers = mb_tile_viewers.load();
+    if (viewers <= 0) {
+      os_sem_take(mb_wake, OS_WAIT_FOREVER);
+      continue;
+    }
+    const mp_result_t *r = motion_pipeline_acquire(last_seq, 1000);
+    if (!r) {
+      continue;
+    }
+    last_seq = r->seq;
+
+    int index = snap_ring_claim(&mb_ring);
+    if (index < 0) {
+      motion_pipeline_release(r);
+      mb_stats.no_slab++;
+      continue;
+    }
+    mjpeg_slab_t *slab = &mb_slabs[index];
+    int64_t t0 = os_time_us();
+    slab->frame.len = 0;
+    slab->frame.tiles_len = 0;
+    slab->frame.tile_count = 0;
+    slab->overflow = false;
+    bool key = tile_viewers > 0 && mb_tiles_update(r);
+    if (tile_viewers > 0 && !key && !mb_encode_tiles(slab, r)) {
+      // Too much changed for the tile slab, the whole frame is cheaper
+      mb_stats.tile_overflows++;
+      slab->frame.tiles_len = 0;
+      slab->frame.tile_count = 0;
+      slab->overflow = false;
+      key = true;
+    }
+    bool ok = true;
+    if (key || viewers > tile_viewers) {
+      ok = gray2jpg_cb(r->frame, r->width, r->height, r->width, mb_quality, mb_slab_write, slab) && !slab->overflow;
+    }
+    if (ok && key && mb_ref) {
+      memcpy(mb_ref, r->frame, (size_t)r->width * r->height);
+      memset(mb_dirty, 0, ((r->width + MJPEG_TILE_SIZE - 1) / MJPEG_TILE_SIZE) * ((r->height + MJPEG_TILE_SIZE - 1) / MJPEG_TILE_SIZE));
+    }
+    slab->frame.seq = r->seq;
+    slab->frame.capture_us = r->capture_us;
+    slab->frame.width = r->width;
+    slab->frame.height = r->height;
+    mb_set_boxes(&slab->frame, r);
+    motion_pipeline_release(r);
+
+    if (!ok) {
+      snap_ring_abort(&mb_ring, index);
+      mb_stats.overflows++;
+      if (key) {
+        mb_want_key.store(true);
+      }
+      continue;
+    }
+    slab->frame.num = mb_stats.encoded + 1;
+    slab->frame.key = key;
+    if (key) {
+      mb_key_num = slab->frame.num;
+      mb_stats.keyframes++;
+    }
+    slab->frame.key_num = mb_key_num;
+    mb_stats.tiles += slab->frame.tile_count;
+    slab->frame.publish_us = os_time_us();
+    snap_ring_publish(&mb_ring, index, slab->frame.seq);
+    mb_stats.encoded++;
+    mb_stats.encode_us = os_time_us() - t0;
+  }
+}
+
+bool mjpeg_broadcast_start(int quality) {
+  if (mb_wake) {
+    return true;
+  }
+  mb_quality = quality;
+  snap_ring_init(&mb_ring, MJPEG_SLABS);
+  for (int i = 0; i < MJPEG_SLABS; i++) {
+    mb_slabs[i].buf = (uint8_t *)mem_class_alloc(MEM_CLASS_JPEG, MJPEG_SLAB_SIZE);
+    if (!mb_slabs[i].buf) {
+      log_e("MJPEG: slab allocation failed");
+      return false;
+    }
+    mb_slabs[i].cap = MJPEG_SLAB_SIZE;
+    mb_slabs[i].frame.buf = mb_slabs[i].buf;
+    mb_slabs[i].tiles_buf = (uint8_t *)mem_class_alloc(MEM_CLASS_JPEG, MJPEG_TILE_SLAB_SIZE);
+    if (!mb_slabs[i].tiles_buf) {
+      log_e("MJPEG: tile slab allocation failed");
+      return false;
+    }
+    mb_slabs[i].frame.tiles = mb_slabs[i].tiles_buf;
+  }
+  mb_wake = os_sem_create();
+  if (!mb_wake || !os_task_create(mb_encode_task, "mjpeg_enc", MJPEG_TASK_STACK, NULL, MJPEG_TASK_PRIO, OS_NO_AFFINITY)) {
+    log_e("MJPEG: encoder task creation failed");
+    return false;
+  }
+  return true;
+}
+
+mjpeg_viewer_t *mjpeg_broadcast_join(int fd, bool tiles) {
+  for (int i = 0; i < MJPEG_MAX_VIEWERS; i++) {
+    bool expected = false;
+    if (!mb_viewer_used[i].compare_exchange_strong(expected, true)) {
+      continue;
+    }
+    mjpeg_viewer_t *viewer = &mb_viewer_slots[i];
+    memset(viewer, 0, sizeof(*viewer));
+    viewer->fd = fd;
+    viewer->tiles = tiles;
+    viewer->joined_us = os_time_us();
+    if (tiles) {
+      mb_want_key.store(true);
+      mb_tile_viewers.fetch_add(1);
+    }
+    if (mb_viewers.fetch_add(1) == 0 && mb_wake) {
+      os_sem_give(mb_wake);
+    }
+    return viewer;
+  }
+  return NULL;
+}
+
+void mjpeg_broadcast_leave(mjpeg_viewer_t *viewer) {
+  if (!viewer) {
+    return;
+  }
+  if (viewer->tiles) {
+    mb_tile_viewers.fetch_sub(1);
+  }
+  mb_viewers.fetch_sub(1);
+  mb_viewer_used[viewer - mb_viewer_slots].store(false);
+}
+
+const mjpeg_frame_t *mjpeg_broadcast_acquire(uint32_t after_seq, uint32_t timeout_ms) {
+  int64_t deadline = os_time_us() + (int64_t)timeout_ms * 1000;
+
+  for (;;) {
+    int index = snap_ring_ref(&mb_ring);
+    if (index >= 0) {
+      if (mb_slabs[index].frame.seq > after_seq) {
+        return &mb_slabs[index].frame;
+      }
+      snap_ring_unref(&mb_ring, index);
+    }
+    if (os_time_us() >= deadline) {
+      return NULL;
+    }
+    os_sleep_ms(MJPEG_POLL_MS);
+  }
+}
+
+void mjpeg_broadcast_release(const mjpeg_frame_t *frame) {
+  if (frame) {
+    snap_ring_unref(&mb_ring, (const mjpeg_slab_t *)frame - mb_slabs);
+  }
+}
+
+static bool mb_viewer_can_send(mjpeg_viewer_t *viewer, const mjpeg_frame_t *frame) {
+  if (!viewer->tiles) {
+    return frame->len > 0;
+  }
+  if (frame->key || frame->key_num == viewer->key_num) {
+    return true;
+  }
+  // The viewer lost this keyframe, unless it is still about to send it
+  if (frame->key_num != viewer->held_key) {
+    mb_want_key.store(true);
+  }
+  return false;
+}
+
+const mjpeg_frame_t *mjpeg_viewer_next(mjpeg_viewer_t *viewer, uint32_t timeout_ms) {
+  int64_t deadline = os_time_us() + (int64_t)timeout_ms * 1000;
+
+  for (;;) {
+    int64_t left = deadline - os_time_us();
+    const mjpeg_frame_t *frame = mjpeg_broadcast_acquire(viewer->last_seq, left > 0 ? left / 1000 : 0);
+    if (!frame) {
+      return NULL;
+    }
+    if (viewer->last_num && frame->num > viewer->last_num + 1) {
+      viewer->dropped += frame->num - viewer->last_num - 1;
+    }
+    viewer->last_seq = frame->seq;
+    viewer->last_num = frame->num;
+    if (mb_viewer_can_send(viewer, frame)) {
+      if (viewer->tiles && frame->key) {
+        viewer->held_key = frame->num;
+      }
+      return frame;
+    }
+    if (frame->len || viewer->tiles) {
+      viewer->dropped++;
+    }
+    mjpeg_broadcast_release(frame);
+  }
+}
+
+const mjpeg_tile_t *mjpeg_tile_next(const mjpeg_frame_t *frame, const mjpeg_tile_t *tile) {
+  size_t off = tile ? (const uint8_t *)tile - frame->tiles + MB_TILE_SPAN(tile->len) : 0;
+  return off < frame->tiles_len ? (const mjpeg_tile_t *)(frame->tiles + off) : NULL;
+}
+
+void mjpeg_viewer_done(mjpeg_viewer_t *viewer, const mjpeg_frame_t *frame, bool sent, int64_t send_us) {
+  if (frame->num == viewer->held_key) {
+    viewer->held_key = 0;
+    if (sent) {
+      viewer->key_num = frame->num;
+    }
+  }
+  if (sent) {
+    viewer->sent++;
+    viewer->latency_us = send_us > frame->publish_us ? send_us - frame->publish_us : 0;
+    if (viewer->latency_us > viewer->max_latency_us) {
+      viewer->max_latency_us = viewer->latency_us;
+    }
+  } else {
+    viewer->dropped++;
+  }
+  mjpeg_broadcast_release(frame);
+}
+
+void mjpeg_broadcast_get_stats(mjpeg_stats_t *stats) {
+  *stats = mb_stats;
+  stats->viewers = mb_viewers.load();
+  stats->tile_viewers = mb_tile_viewers.load();
+}
+
+size_t mjpeg_broadcast_report_json(char *buf, size_t buf_len) {
+  mjpeg_stats_t st;
+  size_t n = 0;
+  int64_t now = os_time_us();
+  bool first = true;
+
+#define REPORT(...)                                           \
+  do {                                                        \
+    if (n < buf_len) {                                        \
+      n += snprintf(buf + n, buf_len - n, __VA_ARGS__);       \
+    }                                                         \
+  } while (0)
+
+  mjpeg_broadcast_get_stats(&st);
+  REPORT(
+    "{\"viewers\":%d,\"tile_viewers\":%d,\"encoded\":%u,\"overflows\":%u,\"no_slab\":%u,\"encode_us\":%u,\"keyframes\":%u,\"tiles\":%u,"
+    "\"tile_overflows\":%u,\"clients\":[",
+    (int)st.viewers, (int)st.tile_viewers, (unsigned)st.encoded, (unsigned)st.overflows, (unsigned)st.no_slab, (unsigned)st.encode_us, (unsigned)st.keyframes,
+    (unsigned)st.tiles, (unsigned)st.tile_overflows
+  );
+  for (int i = 0; i < MJPEG_MAX_VIEWERS; i++) {
+    if (!mb_viewer_used[i].load()) {
+      continue;
+    }
+    const mjpeg_viewer_t *v = &mb_viewer_slots[i];
+    REPORT(
+      "%s{\"fd\":%d,\"tiles\":%s,\"age_s\":%u,\"sent\":%u,\"dropped\":%u,\"latency_us\":%u,\"max_latency_us\":%u}", first ? "" : ",", v->fd, v->tiles ? "true" : "false",
+      (unsigned)((now - v->joined_us) / 1000000), (unsigned)v->sent, (unsigned)v->dropped, (unsigned)v->latency_us, (unsigned)v->max_latency_us
+    );
+    first = false;
+  }
+  REPORT("]}");
+#undef REPORT
+
+  return n < buf_len ? n : buf_len - 1;
+}
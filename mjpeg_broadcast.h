@@ -0,0 +1,120 @@
+#ifndef _MJPEG_BROADCAST_H_
+#define _MJPEG_BROADCAST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Encode-once MJPEG source for every /stream viewer. While at least one
+// viewer has joined, the encoder task turns each published pipeline result
+// into one JPEG slab; viewers share the slabs by reference, so another viewer
+// only costs its socket writes.
+//
+// Each viewer holds at most one slab and always moves on to the newest one,
+// so a slow viewer loses frames instead of queueing them.
+//
+// Tile viewers get a keyframe and after it only the MJPEG_TILE_SIZE squares
+// that changed since that keyframe, each a JPEG of its own. A delta slab holds
+// every tile dirtied since its keyframe, so a viewer that skips deltas still
+// composes the current frame as long as it sent the keyframe. Keyframes come
+// every MJPEG_KEY_INTERVAL slabs, once half the tiles are dirty, and when a
+// tile viewer joins or missed one.
+
+#define MJPEG_SLABS          3
+#define MJPEG_SLAB_SIZE      (64 * 1024)
+#define MJPEG_TILE_SLAB_SIZE (48 * 1024)
+#define MJPEG_MAX_VIEWERS    4
+#define MJPEG_TILE_SIZE      32
+#define MJPEG_KEY_INTERVAL   50
+// Largest regions of the frame kept with each slab for X-Boxes headers
+#define MJPEG_MAX_BOXES      8
+
+typedef struct {
+  uint16_t x;
+  uint16_t y;
+  uint16_t w;
+  uint16_t h;
+  uint32_t len;  // JPEG bytes following the header
+} mjpeg_tile_t;
+
+typedef struct {
+  uint16_t x;
+  uint16_t y;
+  uint16_t w;
+  uint16_t h;
+} mjpeg_box_t;
+
+typedef struct {
+  const uint8_t *buf;  // whole frame, empty when only tile viewers need this slab
+  size_t len;
+  uint32_t seq;        // pipeline frame sequence number
+  uint32_t num;        // encoder sequence number, no gaps between published slabs
+  int64_t capture_us;
+  int64_t publish_us;
+  uint16_t width;
+  uint16_t height;
+  bool key;            // buf is the keyframe of the tile viewers
+  uint32_t key_num;    // keyframe the tiles apply to
+  const uint8_t *tiles;  // dirty tiles, walk them with mjpeg_tile_next()
+  size_t tiles_len;
+  uint16_t tile_count;
+  uint16_t motion_score;  // region area per mille of the frame
+  uint16_t region_count;  // regions of the frame, boxes holds the largest
+  uint8_t box_count;
+  mjpeg_box_t boxes[MJPEG_MAX_BOXES];
+} mjpeg_frame_t;
+
+typedef struct {
+  int fd;                   // viewer socket, for reports only
+  bool tiles;
+  uint32_t key_num;         // last keyframe sent
+  uint32_t held_key;        // keyframe acquired but not sent yet
+  int64_t joined_us;
+  uint32_t last_seq;
+  uint32_t last_num;
+  uint32_t sent;
+  uint32_t dropped;         // published slabs this viewer never sent
+  uint32_t latency_us;      // last publish to send start time
+  uint32_t max_latency_us;
+} mjpeg_viewer_t;
+
+typedef struct {
+  uint32_t encoded;
+  uint32_t overflows;  // frames larger than a slab, skipped
+  uint32_t no_slab;    // every slab still held by viewers, frame skipped
+  uint32_t encode_us;  // last encode time
+  uint32_t keyframes;
+  uint32_t tiles;      // tiles encoded for delta slabs
+  uint32_t tile_overflows;  // delta slab full, a keyframe was sent instead
+  int32_t viewers;
+  int32_t tile_viewers;
+} mjpeg_stats_t;
+
+bool mjpeg_broadcast_start(int quality);
+
+// Viewers join before their first acquire and leave after their last release.
+// Returns NULL when all MJPEG_MAX_VIEWERS slots are taken.
+mjpeg_viewer_t *mjpeg_broadcast_join(int fd, bool tiles);
+void mjpeg_broadcast_leave(mjpeg_viewer_t *viewer);
+
+// Newest slab with seq > after_seq, waiting up to timeout_ms. The slab is
+// immutable until released.
+const mjpeg_frame_t *mjpeg_broadcast_acquire(uint32_t after_seq, uint32_t timeout_ms);
+void mjpeg_broadcast_release(const mjpeg_frame_t *frame);
+
+// Newest slab the viewer has not seen yet and can send: a tile viewer only
+// gets keyframes and the deltas of the last keyframe it sent. Slabs it skipped
+// count as dropped.
+const mjpeg_frame_t *mjpeg_viewer_next(mjpeg_viewer_t *viewer, uint32_t timeout_ms);
+// Releases a slab from mjpeg_viewer_next(), counted as sent when the viewer
+// started writing it at send_us, dropped otherwise.
+void mjpeg_viewer_done(mjpeg_viewer_t *viewer, const mjpeg_frame_t *frame, bool sent, int64_t send_us);
+
+// First tile of a delta slab for tile NULL, the one after `tile` otherwise,
+// NULL past the last. Its JPEG follows the header.
+const mjpeg_tile_t *mjpeg_tile_next(const mjpeg_frame_t *frame, const mjpeg_tile_t *tile);
+
+void mjpeg_broadcast_get_stats(mjpeg_stats_t *stats);
+size_t mjpeg_broadcast_report_json(char *buf, size_t buf_len);
+
+#endif /* _MJPEG_BROADCAST_H_ */
@@ -0,0 +1,340 @@
+#include <string.h>
+#include "motion_detect.h"
+
+#define MD_ALIGN(n) (((n) + 3) & ~(size_t)3)
+
+// Per provisional label statistics, structure of arrays.
+typedef struct {
+  md_label_t *parent;
+  uint16_t *min_x;
+  uint16_t *min_y;
+  uint16_t *max_x;
+  uint16_t *max_y;
+  uint32_t *area;
+  uint32_t *sum_x;
+  uint32_t *sum_y;
+  md_label_t *row[2];
+} md_tables_t;
+
+void md_diff_threshold(const uint8_t *cur, const uint8_t *ref, size_t len, uint8_t threshold, uint8_t *mask) {
+  for (size_t i = 0; i < len; i++) {
+    int d = cur[i] - ref[i];
+    mask[i] = (d > threshold || -d > threshold) ? 255 : 0;
+  }
+}
+
+void md_dilate_rows_h(const uint8_t *mask, int width, int y0, int y1, uint8_t *tmp) {
+  for (int y = y0; y < y1; y++) {
+    const uint8_t *m = mask + y * width;
+    uint8_t *t = tmp + y * width;
+    for (int x = 1; x < width - 1; x++) {
+      t[x] = m[x - 1] | m[x] | m[x + 1];
+    }
+  }
+}
+
+void md_dilate_rows_v(uint8_t *mask, int width, int height, int y0, int y1, const uint8_t *tmp) {
+  for (int y = y0; y < y1; y++) {
+    uint8_t *m = mask + y * width;
+    const uint8_t *t = tmp + y * width;
+    if (y == 0 || y == height - 1) {
+      memset(m, 0, width);
+      continue;
+    }
+    m[0] = 0;
+    m[width - 1] = 0;
+    for (int x = 1; x < width - 1; x++) {
+      m[x] = t[x - width] | t[x] | t[x + width];
+    }
+  }
+}
+
+// Separable: row maxima into tmp, then the column maximum of three rows.
+void md_dilate(uint8_t *mask, int width, int height, uint8_t *tmp) {
+  md_dilate_rows_h(mask, width, 0, height, tmp);
+  md_dilate_rows_v(mask, width, height, 0, height, tmp);
+}
+
+size_t md_scratch_size(int width) {
+  return MD_ALIGN(MD_MAX_LABELS * sizeof(md_label_t)) + 4 * MD_ALIGN(MD_MAX_LABELS * sizeof(uint16_t)) + 3 * MD_ALIGN(MD_MAX_LABELS * sizeof(uint32_t))
+         + 2 * MD_ALIGN((width + 2) * sizeof(md_label_t));
+}
+
+size_t md_stripe_scratch_size(int width) {
+  return md_scratch_size(width) + MD_ALIGN(width * sizeof(md_label_t));
+}
+
+size_t md_merge_scratch_size(int count) {
+  return MD_ALIGN(count * MD_MAX_LABELS * sizeof(md_label_t));
+}
+
+static void md_tables_map(md_tables_t *t, void *scratch, int width) {
+  uint8_t *p = (uint8_t *)scratch;
+  t->parent = (md_label_t *)p;
+  p += MD_ALIGN(MD_MAX_LABELS * sizeof(md_label_t));
+  uint16_t **u16[4] = {&t->min_x, &t->min_y, &t->max_x, &t->max_y};
+  for (int i = 0; i < 4; i++) {
+    *u16[i] = (uint16_t *)p;
+    p += MD_ALIGN(MD_MAX_LABELS * sizeof(uint16_t));
+  }
+  uint32_t **u32[3] = {&t->area, &t->sum_x, &t->sum_y};
+  for (int i = 0; i < 3; i++) {
+    *u32[i] = (uint32_t *)p;
+    p += MD_ALIGN(MD_MAX_LABELS * sizeof(uint32_t));
+  }
+  for (int i = 0; i < 2; i++) {
+    // One guard label on each side so x - 1 and x + 1 never leave the row
+    t->row[i] = (md_label_t *)p + 1;
+    p += MD_ALIGN((width + 2) * sizeof(md_label_t));
+  }
+}
+
+static md_label_t md_find(md_label_t *parent, md_label_t x) {
+  while (parent[x] != x) {
+    parent[x] = parent[parent[x]];
+    x = parent[x];
+  }
+  return x;
+}
+
+// The smaller label becomes the root, so roots keep raster order.
+static md_label_t md_union(md_label_t *parent, md_label_t a, md_label_t b) {
+  a = md_find(parent, a);
+  b = md_find(parent, b);
+  if (a < b) {
+    parent[b] = a;
+    return a;
+  }
+  parent[a] = b;
+  return b;
+}
+
+// Labels rows y0..y1-1 as if nothing was above y0. Returns the next free
+// provisional label; the labels of row y0 are copied to `first_row`.
+static md_label_t md_scan(const uint8_t *mask, int width, int y0, int y1, md_tables_t *t, md_label_t *labels, md_label_t *first_row, bool *truncated) {
+  md_label_t next = 1;
+
+  for (int i = 0; i < 2; i++) {
+    memset(t->row[i] - 1, 0, (width + 2) * sizeof(md_label_t));
+  }
+  for (int y = y0; y < y1; y++) {
+    md_label_t *prev = t->row[(y + 1) & 1];
+    md_label_t *cur = t->row[y & 1];
+    const uint8_t *m = mask + y * width;
+
+    for (int x = 0; x < width; x++) {
+      if (!m[x]) {
+        cur[x] = 0;
+        continue;
+      }
+      md_label_t l = 0;
+      const md_label_t nb[4] = {cur[x - 1], prev[x - 1], prev[x], prev[x + 1]};
+      for (int k = 0; k < 4; k++) {
+        if (nb[k]) {
+          l = l ? md_union(t->parent, l, nb[k]) : md_find(t->parent, nb[k]);
+        }
+      }
+      if (!l) {
+        if (next < MD_MAX_LABELS) {
+          l = next++;
+          t->parent[l] = l;
+          t->min_x[l] = x;
+          t->max_x[l] = x;
+          t->min_y[l] = y;
+          t->max_y[l] = y;
+          t->area[l] = 0;
+          t->sum_x[l] = 0;
+          t->sum_y[l] = 0;
+        } else {
+          // Out of labels: the pixel joins the last label instead
+          l = md_find(t->parent, MD_MAX_LABELS - 1);
+          *truncated = true;
+        }
+      }
+      cur[x] = l;
+      if (x < t->min_x[l]) {
+        t->min_x[l] = x;
+      }
+      if (x > t->max_x[l]) {
+        t->max_x[l] = x;
+      }
+      if (y > t->max_y[l]) {
+        t->max_y[l] = y;
+      }
+      t->area[l]++;
+      t->sum_x[l] += x;
+      t->sum_y[l] += y;
+      if (labels) {
+        labels[y * width + x] = l;
+      }
+    }
+    cur[-1] = 0;
+    cur[width] = 0;
+    if (first_row && y == y0) {
+      memcpy(first_row, cur, width * sizeof(md_label_t));
+    }
+  }
+  return next;
+}
+
+// Adds the statistics of label `s` in `from` to label `d` in `to`.
+static void md_accumulate(md_tables_t *to, md_label_t d, const md_tables_t *from, md_label_t s) {
+  if (from->min_x[s] < to->min_x[d]) {
+    to->min_x[d] = from->min_x[s];
+  }
+  if (from->min_y[s] < to->min_y[d]) {
+    to->min_y[d] = from->min_y[s];
+  }
+  if (from->max_x[s] > to->max_x[d]) {
+    to->max_x[d] = from->max_x[s];
+  }
+  if (from->max_y[s] > to->max_y[d]) {
+    to->max_y[d] = from->max_y[s];
+  }
+  to->area[d] += from->area[s];
+  to->sum_x[d] += from->sum_x[s];
+  to->sum_y[d] += from->sum_y[s];
+}
+
+// Folds every label into its root; roots come first in raster order.
+static void md_fold(md_tables_t *t, md_label_t next) {
+  for (md_label_t l = 1; l < next; l++) {
+    md_label_t r = md_find(t->parent, l);
+    if (r != l) {
+      md_accumulate(t, r, t, l);
+    }
+  }
+}
+
+// Appends root `l` to the region table. area[] of the root then holds its
+// region index + 1, or 0 when it did not fit.
+static void md_emit(md_tables_t *t, md_label_t l, md_regions_t *out) {
+  if (out->count >= MD_MAX_REGIONS) {
+    out->dropped++;
+    t->area[l] = 0;
+    return;
+  }
+  int i = out->count++;
+  out->min_x[i] = t->min_x[l];
+  out->min_y[i] = t->min_y[l];
+  out->max_x[i] = t->max_x[l];
+  out->max_y[i] = t->max_y[l];
+  out->area[i] = t->area[l];
+  out->cx[i] = t->sum_x[l] / t->area[l];
+  out->cy[i] = t->sum_y[l] / t->area[l];
+  t->area[l] = i + 1;
+}
+
+int md_label_regions(const uint8_t *mask, int width, int height, void *scratch, md_regions_t *out, md_label_t *labels) {
+  md_tables_t t;
+
+  md_tables_map(&t, scratch, width);
+  memset(out, 0, sizeof(md_regions_t));
+  md_label_t next = md_scan(mask, width, 0, height, &t, labels, NULL, &out->truncated);
+  md_fold(&t, next);
+  for (md_label_t l = 1; l < next; l++) {
+    if (t.parent[l] == l) {
+      md_emit(&t, l, out);
+    }
+  }
+
+  if (labels) {
+    // sum_x[] is free now, reuse it as the provisional label -> region map
+    for (md_label_t l = 1; l < next; l++) {
+      md_label_t r = md_find(t.parent, l);
+      t.sum_x[l] = t.area[r];
+    }
+    for (int i = 0; i < width * height; i++) {
+      labels[i] = mask[i] ? (md_label_t)t.sum_x[labels[i]] : 0;
+    }
+  }
+  return out->count;
+}
+
+void md_label_stripe(const uint8_t *mask, int width, int y0, int y1, void *scratch, md_stripe_t *stripe) {
+  md_tables_t t;
+
+  md_tables_map(&t, scratch, width);
+  stripe->y0 = y0;
+  stripe->y1 = y1;
+  stripe->scratch = scratch;
+  stripe->truncated = false;
+  stripe->first_row = (md_label_t *)((uint8_t *)scratch + md_scratch_size(width));
+  memset(stripe->first_row, 0, width * sizeof(md_label_t));
+  stripe->next = md_scan(mask, width, y0, y1, &t, NULL, stripe->first_row, &stripe->truncated);
+  stripe->last_row = t.row[(y1 - 1) & 1];
+  md_fold(&t, stripe->next);
+  // The seam merge only looks at roots
+  for (int x = 0; x < width; x++) {
+    if (stripe->first_row[x]) {
+      stripe->first_row[x] = md_find(t.parent, stripe->first_row[x]);
+    }
+    if (stripe->last_row[x]) {
+      stripe->last_row[x] = md_find(t.parent, stripe->last_row[x]);
+    }
+  }
+}
+
+int md_merge_stripes(const md_stripe_t *stripes, int count, int width, void *scratch, md_regions_t *out) {
+  md_tables_t t[MD_MAX_STRIPES];
+  md_label_t base[MD_MAX_STRIPES + 1];
+  md_label_t *parent = (md_label_t *)scratch;
+
+  memset(out, 0, sizeof(md_regions_t));
+  // Stripe k owns the global labels base[k] + 1 .. base[k] + next - 1, in
+  // raster order like the provisional labels of a single pass.
+  base[0] = 0;
+  for (int k = 0; k < count; k++) {
+    md_tables_map(&t[k], stripes[k].scratch, width);
+    base[k + 1] = base[k] + stripes[k].next;
+    out->truncated |= stripes[k].truncated;
+  }
+  for (md_label_t g = 0; g < base[count]; g++) {
+    parent[g] = g;
+  }
+
+  // 8-connected joins across every seam
+  for (int k = 0; k + 1 < count; k++) {
+    const md_label_t *above = stripes[k].last_row;
+    const md_label_t *below = stripes[k + 1].first_row;
+    for (int x = 0; x < width; x++) {
+      if (!below[x]) {
+        continue;
+      }
+      for (int dx = -1; dx <= 1; dx++) {
+        if (x + dx >= 0 && x + dx < width && above[x + dx]) {
+          md_union(parent, base[k] + above[x + dx], base[k + 1] + below[x]);
+        }
+      }
+    }
+  }
+
+  // Stripe roots joined at a seam fold into the global root, which always
+  // lies in the same or an earlier stripe.
+  for (int k = 0; k < count; k++) {
+    for (md_label_t l = 1; l < stripes[k].next; l++) {
+      if (t[k].parent[l] != l) {
+        continue;
+      }
+      md_label_t g = base[k] + l;
+      md_label_t r = md_find(parent, g);
+      if (r == g) {
+        continue;
+      }
+      int kr = k;
+      while (r < base[kr]) {
+        kr--;
+      }
+      md_accumulate(&t[kr], r - base[kr], &t[k], l);
+    }
+  }
+
+  for (int k = 0; k < count; k++) {
+    for (md_label_t l = 1; l < stripes[k].next; l++) {
+      if (t[k].parent[l] == l && parent[base[k] + l] == base[k] + l) {
+        md_emit(&t[k], l, out);
+      }
+    }
+  }
+  return out->count;
+}
@@ -0,0 +1,73 @@
+#ifndef _MOTION_DETECT_H_
+#define _MOTION_DETECT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Provisional labels one labeling pass can hand out. The union-find table and
+// the per-label statistics for this many labels stay in internal RAM.
+#define MD_MAX_LABELS  1024
+// Regions reported per frame, larger frames keep the first ones in raster order.
+#define MD_MAX_REGIONS 64
+
+typedef uint16_t md_label_t;
+
+// Region statistics as a fixed capacity structure of arrays.
+typedef struct {
+  uint16_t count;
+  uint16_t dropped;  // regions that did not fit in the table
+  bool truncated;    // provisional labels ran out, some regions were merged
+  uint16_t min_x[MD_MAX_REGIONS];
+  uint16_t min_y[MD_MAX_REGIONS];
+  uint16_t max_x[MD_MAX_REGIONS];
+  uint16_t max_y[MD_MAX_REGIONS];
+  uint16_t cx[MD_MAX_REGIONS];  // centroid
+  uint16_t cy[MD_MAX_REGIONS];
+  uint32_t area[MD_MAX_REGIONS];
+} md_regions_t;
+
+// mask[i] = 255 where |cur[i] - ref[i]| > threshold, 0 elsewhere.
+void md_diff_threshold(const uint8_t *cur, const uint8_t *ref, size_t len, uint8_t threshold, uint8_t *mask);
+
+// 3x3 binary dilation in place, the one pixel frame border is cleared.
+// `tmp` holds width * height bytes.
+void md_dilate(uint8_t *mask, int width, int height, uint8_t *tmp);
+
+// The two passes of md_dilate() for rows y0..y1-1, for stripe workers. Every
+// stripe must finish the row pass before any stripe starts the column pass.
+void md_dilate_rows_h(const uint8_t *mask, int width, int y0, int y1, uint8_t *tmp);
+void md_dilate_rows_v(uint8_t *mask, int width, int height, int y0, int y1, const uint8_t *tmp);
+
+// Bytes of scratch md_label_regions() needs for frames `width` pixels wide.
+size_t md_scratch_size(int width);
+
+// 8-connected labeling of every non-zero mask pixel. Only two label rows are
+// kept while scanning; when `labels` is not NULL the full uint16 label map is
+// written too, holding the region index + 1 (0 for background and for regions
+// that were dropped). Returns the number of regions in `out`.
+int md_label_regions(const uint8_t *mask, int width, int height, void *scratch, md_regions_t *out, md_label_t *labels);
+
+// Stripe parallel labeling: each horizontal stripe is labeled on its own by
+// md_label_stripe() (one worker per stripe), md_merge_stripes() then joins
+// the components crossing stripe borders. The regions come out identical to
+// md_label_regions() on the whole mask unless labels run out in a stripe.
+#define MD_MAX_STRIPES 8
+
+typedef struct {
+  int y0;
+  int y1;
+  md_label_t next;
+  bool truncated;
+  void *scratch;          // md_stripe_scratch_size() bytes, kept until merged
+  md_label_t *first_row;  // root labels of the stripe border rows
+  md_label_t *last_row;
+} md_stripe_t;
+
+size_t md_stripe_scratch_size(int width);
+size_t md_merge_scratch_size(int count);
+
+void md_label_stripe(const uint8_t *mask, int width, int y0, int y1, void *scratch, md_stripe_t *stripe);
+int md_merge_stripes(const md_stripe_t *stripes, int count, int width, void *scratch, md_regions_t *out);
+
+#endif /* _MOTION_DETECT_H_ */
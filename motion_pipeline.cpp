@@ -0,0 +1,486 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "os_port.h"
+#include "mem_policy.h"
+#include "frame_arena.h"
+#include "copy_service.h"
+#include "snap_ring.h"
+#include "jpeg_quality.h"
+#include "motion_pipeline.h"
+
+#ifdef ESP_PLATFORM
+#include "esp32-hal-log.h"
+#define mp_alloc(cls, size) mem_class_alloc(cls, size)
+#else
+#define log_e(format, ...)  fprintf(stderr, format "\n", ##__VA_ARGS__)
+#define mp_alloc(cls, size) malloc(size)
+#endif
+
+#define MP_CAPTURE_CORE    0
+#define MP_PROCESS_CORE    1
+#define MP_CAPTURE_PRIO    5
+#define MP_PROCESS_PRIO    4
+#define MP_TASK_STACK      4096
+#define MP_POLL_MS         5
+
+// Result snapshots are published through a snap_ring_t, the processing task
+// is its only writer.
+typedef struct {
+  mp_result_t result;  // first member, readers get a pointer to it
+  uint8_t *buf;
+  uint8_t *mask_buf;
+  uint8_t *raw_buf;
+  uint8_t *map_buf;
+} mp_slot_t;
+
+static mp_config_t mp_config;
+// Written by the setters, picked up by the processing task per frame
+static os_mutex_t mp_tune_lock;
+static uint8_t mp_tune_threshold;
+static mp_zone_t mp_tune_zones[MP_MAX_ZONES];
+static int mp_tune_zone_count;
+static os_queue_t mp_queue;
+static mp_slot_t mp_slots[MP_RESULT_SLOTS];
+static snap_ring_t mp_ring;
+static copy_job_t mp_frame_copy;
+static copy_job_t mp_mask_copy;
+static copy_job_t mp_raw_copy;
+
+// Working buffers of the processing task, taken from the frame arena for
+// each frame
+static uint8_t *mp_mask;
+static uint8_t *mp_tmp;
+static void *mp_merge_scratch;
+#ifdef MP_VERIFY_STRIPES
+static void *mp_verify_scratch;
+static md_regions_t mp_verify_regions;
+#endif
+
+// Stripe workers: stripe 0 runs on the processing task itself, the others on
+// helper tasks that wait for the next phase on their start semaphore.
+typedef struct {
+  int index;
+  void *scratch;
+  os_sem_t start;
+  os_sem_t done;
+} mp_worker_t;
+
+static mp_worker_t mp_workers[MD_MAX_STRIPES];
+static md_stripe_t mp_stripes[MD_MAX_STRIPES];
+static int mp_stripe_count;
+static int mp_phase;
+static mp_frame_t mp_work_cur;
+static mp_frame_t mp_work_ref;
+
+static mp_stats_t mp_stats;
+static int64_t mp_start_us;
+static int64_t mp_capture_busy_us;
+static int64_t mp_process_busy_us;
+
+static void mp_capture_task(void *arg) {
+  const mp_source_t *src = mp_config.source;
+
+  for (;;) {
+    mp_frame_t frame;
+    int64_t t0 = os_time_us();
+    if (!src->capture(&frame, src->ctx)) {
+      os_sleep_ms(100);
+      continue;
+    }
+    int64_t t1 = os_time_us();
+    frame.capture_us = t1;
+    mp_stats.captured++;
+    mp_stats.capture_us = t1 - t0;
+    if (!os_queue_send(mp_queue, &frame, 0)) {
+      // Processing is still busy with older frames
+      src->release(&frame, src->ctx);
+      mp_stats.dropped++;
+    }
+    mp_capture_busy_us += os_time_us() - t1;
+  }
+}
+
+static int mp_stripe_y(int k, int height) {
+  return height * k / mp_stripe_count;
+}
+
+// Phase 0: diff, threshold and the row pass of the dilation.
+// Phase 1: column pass of the dilation and labeling of the stripe.
+// All stripes finish phase 0 before any stripe starts phase 1.
+static void mp_stripe_run(mp_worker_t *w, int phase) {
+  int width = mp_work_cur.width;
+  int height = mp_work_cur.height;
+  int y0 = mp_stripe_y(w->index, height);
+  int y1 = mp_stripe_y(w->index + 1, height);
+
+  if (phase == 0) {
+    size_t offset = (size_t)y0 * width;
+    md_diff_threshold(mp_work_cur.buf + offset, mp_work_ref.buf + offset, (size_t)(y1 - y0) * width, mp_config.threshold, mp_mask + offset);
+    md_dilate_rows_h(mp_mask, width, y0, y1, mp_tmp);
+  } else {
+    md_dilate_rows_v(mp_mask, width, height, y0, y1, mp_tmp);
+    md_label_stripe(mp_mask, width, y0, y1, w->scratch, &mp_stripes[w->index]);
+  }
+}
+
+static void mp_worker_task(void *arg) {
+  mp_worker_t *w = (mp_worker_t *)arg;
+
+  for (;;) {
+    os_sem_take(w->start, OS_WAIT_FOREVER);
+    mp_stripe_run(w, mp_phase);
+    os_sem_give(w->done);
+  }
+}
+
+static void mp_run_phase(int phase) {
+  mp_phase = phase;
+  for (int k = 1; k < mp_stripe_count; k++) {
+    os_sem_give(mp_workers[k].start);
+  }
+  mp_stripe_run(&mp_workers[0], phase);
+  for (int k = 1; k < mp_stripe_count; k++) {
+    os_sem_take(mp_workers[k].done, OS_WAIT_FOREVER);
+  }
+}
+
+// Returns false when the mask snapshot copy could not be queued.
+static bool mp_detect(const mp_frame_t *cur, const mp_frame_t *ref, md_regions_t *regions, uint8_t *mask_copy) {
+  mp_work_cur = *cur;
+  mp_work_ref = *ref;
+  mp_run_phase(0);
+  mp_run_phase(1);
+  // The mask is final now, its snapshot copy overlaps the seam merge
+  bool copied = copy_service_submit(&mp_mask_copy, mask_copy, mp_mask, (size_t)cur->width * cur->height, NULL, NULL);
+  md_merge_stripes(mp_stripes, mp_stripe_count, cur->width, mp_merge_scratch, regions);
+#ifdef MP_VERIFY_STRIPES
+  // The stripes must give exactly what a single pass over the mask gives
+  md_label_regions(mp_mask, cur->width, cur->height, mp_verify_scratch, &mp_verify_regions, NULL);
+  if (!regions->truncated && memcmp(regions, &mp_verify_regions, sizeof(md_regions_t)) != 0) {
+    log_e("Pipeline: stripe labeling differs from a single pass (frame %u)", (unsigned)cur->seq);
+  }
+#endif
+  return copied;
+}
+
+static bool mp_region_in_zones(const md_regions_t *r, int i, const mp_zone_t *zones, int count) {
+  for (int z = 0; z < count; z++) {
+    const mp_zone_t *zone = &zones[z];
+    if (r->max_x[i] >= zone->x && r->min_x[i] < zone->x + zone->w && r->max_y[i] >= zone->y && r->min_y[i] < zone->y + zone->h) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void mp_filter_zones(md_regions_t *r, const mp_zone_t *zones, int count) {
+  int n = 0;
+
+  for (int i = 0; i < r->count; i++) {
+    if (!mp_region_in_zones(r, i, zones, count)) {
+      continue;
+    }
+    r->min_x[n] = r->min_x[i];
+    r->min_y[n] = r->min_y[i];
+    r->max_x[n] = r->max_x[i];
+    r->max_y[n] = r->max_y[i];
+    r->cx[n] = r->cx[i];
+    r->cy[n] = r->cy[i];
+    r->area[n] = r->area[i];
+    n++;
+  }
+  r->count = n;
+}
+
+// Carves the working buffers of one frame out of the frame arena.
+static bool mp_take_scratch(void) {
+  size_t frame_len = (size_t)mp_config.max_width * mp_config.max_height;
+
+  frame_arena_reset();
+  mp_mask = (uint8_t *)frame_arena_alloc(MEM_CLASS_MASK, frame_len);
+  mp_tmp = (uint8_t *)frame_arena_alloc(MEM_CLASS_MASK, frame_len);
+  mp_merge_scratch = frame_arena_alloc(MEM_CLASS_LABELS, md_merge_scratch_size(mp_stripe_count));
+  bool ok = mp_mask && mp_tmp && mp_merge_scratch;
+  for (int k = 0; k < mp_stripe_count; k++) {
+    mp_workers[k].scratch = frame_arena_alloc(MEM_CLASS_LABELS, md_stripe_scratch_size(mp_config.max_width));
+    ok = ok && mp_workers[k].scratch;
+  }
+#ifdef MP_VERIFY_STRIPES
+  mp_verify_scratch = frame_arena_alloc(MEM_CLASS_LABELS, md_scratch_size(mp_config.max_width));
+  ok = ok && mp_verify_scratch;
+#endif
+  return ok;
+}
+
+static void mp_process_task(void *arg) {
+  const mp_source_t *src = mp_config.source;
+  mp_frame_t ref = {};
+  mp_zone_t zones[MP_MAX_ZONES];
+  int zone_count;
+
+  for (;;) {
+    mp_frame_t cur;
+    if (!os_queue_receive(mp_queue, &cur, OS_WAIT_FOREVER)) {
+      continue;
+    }
+    int64_t t0 = os_time_us();
+    os_mutex_lock(mp_tune_lock);
+    mp_config.threshold = mp_tune_threshold;
+    zone_count = mp_tune_zone_count;
+    memcpy(zones, mp_tune_zones, sizeof(zones));
+    os_mutex_unlock(mp_tune_lock);
+
+    if (cur.width > mp_config.max_width || cur.height > mp_config.max_height || cur.len < (size_t)cur.width * cur.height) {
+      log_e("Pipeline: unsupported frame %ux%u (%u bytes)", cur.width, cur.height, (unsigned)cur.len);
+      src->release(&cur, src->ctx);
+      continue;
+    }
+    if (ref.buf && (ref.width != cur.width || ref.height != cur.height)) {
+      // Frame size changed, the reference can not be compared anymore
+      src->release(&ref, src->ctx);
+      ref.buf = NULL;
+    }
+    if (!mp_take_scratch()) {
+      log_e("Pipeline: frame arena too small");
+      src->release(&cur, src->ctx);
+      continue;
+    }
+
+    int index = snap_ring_claim(&mp_ring);
+    bool copied = true;
+    if (index >= 0) {
+      mp_slot_t *slot = &mp_slots[index];
+      mp_result_t *r = &slot->result;
+      r->len = (size_t)cur.width * cur.height;
+      // The frame snapshot is copied while the stripes are processed
+      copied = copy_service_submit(&mp_frame_copy, slot->buf, cur.buf, r->len, NULL, NULL);
+      if (slot->raw_buf) {
+        copied = copy_service_submit(&mp_raw_copy, slot->raw_buf, cur.buf, r->len, NULL, NULL) && copied;
+      }
+      if (ref.buf) {
+        copied = mp_detect(&cur, &ref, &r->regions, slot->mask_buf) && copied;
+        if (zone_count) {
+          mp_filter_zones(&r->regions, zones, zone_count);
+        }
+        if (slot->map_buf) {
+          jq_build_map(mp_mask, cur.width, cur.height, mp_config.static_filter, slot->map_buf);
+        }
+      } else {
+        memset(&r->regions, 0, sizeof(r->regions));
+        memset(slot->mask_buf, 0, r->len);
+        if (slot->map_buf) {
+          memset(slot->map_buf, 0, jq_map_size(cur.width, cur.height));
+        }
+      }
+      r->detect_us = os_time_us() - t0;
+      // The copies always finish; until then the worker still writes the
+      // slot and reads the working mask, so there is no giving up early
+      copy_service_wait(&mp_frame_copy, OS_WAIT_FOREVER);
+      copy_service_wait(&mp_mask_copy, OS_WAIT_FOREVER);
+      copy_service_wait(&mp_raw_copy, OS_WAIT_FOREVER);
+    }
+    if (index >= 0 && !copied) {
+      // A snapshot would be stale or partial, the slot is not published
+      log_e("Pipeline: snapshot copy not queued (frame %u)", (unsigned)cur.seq);
+      snap_ring_abort(&mp_ring, index);
+      mp_stats.copy_failed++;
+    } else if (index >= 0) {
+      mp_slot_t *slot = &mp_slots[index];
+      mp_result_t *r = &slot->result;
+      if (slot->map_buf) {
+        jq_prefilter(slot->buf, cur.width, cur.height, cur.width, 1, slot->map_buf);
+      }
+      if (mp_config.annotate) {
+        mp_config.annotate(slot->buf, cur.width, cur.height, &r->regions, mp_config.annotate_arg);
+      }
+      r->seq = cur.seq;
+      r->capture_us = cur.capture_us;
+      r->width = cur.width;
+      r->height = cur.height;
+      r->publish_us = os_time_us();
+      snap_ring_publish(&mp_ring, index, r->seq);
+      mp_stats.published++;
+      mp_stats.latency_us = r->publish_us - cur.capture_us;
+    } else {
+      mp_stats.no_slot++;
+    }
+
+    // The frame just processed is the next reference, the old one goes back
+    if (ref.buf) {
+      src->release(&ref, src->ctx);
+    }
+    ref = cur;
+    mp_stats.processed++;
+
+    int64_t t1 = os_time_us();
+    mp_stats.process_us = t1 - t0;
+    mp_process_busy_us += t1 - t0;
+  }
+}
+
+bool motion_pipeline_start(const mp_config_t *config) {
+  size_t frame_len = (size_t)config->max_width * config->max_height;
+
+  if (mp_queue) {
+    return true;
+  }
+  mp_config = *config;
+  mp_tune_threshold = config->threshold;
+  mp_tune_lock = os_mutex_create();
+  if (!mp_tune_lock) {
+    log_e("Pipeline: mutex creation failed");
+    return false;
+  }
+  snap_ring_init(&mp_ring, MP_RESULT_SLOTS);
+  mp_stripe_count = config->stripes < 1 ? 1 : config->stripes > MD_MAX_STRIPES ? MD_MAX_STRIPES : config->stripes;
+  // Masks go to PSRAM, label scratch to internal RAM (mem_policy.cpp); each
+  // buffer may lose up to FRAME_ARENA_ALIGN to alignment
+  size_t mask_bytes = 2 * (frame_len + FRAME_ARENA_ALIGN);
+  size_t label_bytes = md_merge_scratch_size(mp_stripe_count) + mp_stripe_count * (md_stripe_scratch_size(config->max_width) + FRAME_ARENA_ALIGN)
+                       + FRAME_ARENA_ALIGN;
+#ifdef MP_VERIFY_STRIPES
+  label_bytes += md_scratch_size(config->max_width) + FRAME_ARENA_ALIGN;
+#endif
+  if (!frame_arena_init(mask_bytes + FRAME_ARENA_PSRAM_EXTRA, label_bytes + FRAME_ARENA_INTERNAL_EXTRA)) {
+    log_e("Pipeline: frame arena allocation failed");
+    return false;
+  }
+  for (int k = 0; k < mp_stripe_count; k++) {
+    mp_worker_t *w = &mp_workers[k];
+    w->index = k;
+    if (k == 0) {
+      continue;
+    }
+    w->start = os_sem_create();
+    w->done = os_sem_create();
+    // Helpers alternate between the cores, starting with the capture core
+    int core = (k & 1) ? MP_CAPTURE_CORE : MP_PROCESS_CORE;
+    if (!w->start || !w->done || !os_task_create(mp_worker_task, "mp_stripe", MP_TASK_STACK, w, MP_PROCESS_PRIO, core)) {
+      log_e("Pipeline: stripe worker creation failed");
+      return false;
+    }
+  }
+  // The published frame is drawn on or filtered, the raw one is a copy
+  bool modified = config->annotate || config->static_filter;
+  bool raw_copy = modified && config->keep_raw;
+  for (int i = 0; i < MP_RESULT_SLOTS; i++) {
+    mp_slots[i].buf = (uint8_t *)mp_alloc(MEM_CLASS_FRAME, frame_len);
+    mp_slots[i].mask_buf = (uint8_t *)mp_alloc(MEM_CLASS_FRAME, frame_len);
+    if (raw_copy) {
+      mp_slots[i].raw_buf = (uint8_t *)mp_alloc(MEM_CLASS_FRAME, frame_len);
+    }
+    if (config->static_filter) {
+      mp_slots[i].map_buf = (uint8_t *)mp_alloc(MEM_CLASS_MASK, jq_map_size(config->max_width, config->max_height));
+    }
+    if (!mp_slots[i].buf || !mp_slots[i].mask_buf || (raw_copy && !mp_slots[i].raw_buf)
+        || (config->static_filter && !mp_slots[i].map_buf)) {
+      log_e("Pipeline: result slot allocation failed");
+      return false;
+    }
+    mp_slots[i].result.frame = mp_slots[i].buf;
+    mp_slots[i].result.mask = mp_slots[i].mask_buf;
+    mp_slots[i].result.mcu_map = mp_slots[i].map_buf;
+    mp_slots[i].result.raw = modified ? mp_slots[i].raw_buf : mp_slots[i].buf;
+  }
+
+  mp_queue = os_queue_create(MP_QUEUE_DEPTH, sizeof(mp_frame_t));
+  if (!mp_queue || !copy_job_init(&mp_frame_copy) || !copy_job_init(&mp_mask_copy) || !copy_job_init(&mp_raw_copy)) {
+    log_e("Pipeline: queue creation failed");
+    return false;
+  }
+  mp_start_us = os_time_us();
+  if (!os_task_create(mp_process_task, "mp_process", MP_TASK_STACK, NULL, MP_PROCESS_PRIO, MP_PROCESS_CORE)
+      || !os_task_create(mp_capture_task, "mp_capture", MP_TASK_STACK, NULL, MP_CAPTURE_PRIO, MP_CAPTURE_CORE)) {
+    log_e("Pipeline: task creation failed");
+    return false;
+  }
+  return true;
+}
+
+const mp_result_t *motion_pipeline_acquire(uint32_t after_seq, uint32_t timeout_ms) {
+  int64_t deadline = os_time_us() + (int64_t)timeout_ms * 1000;
+
+  for (;;) {
+    int index = snap_ring_ref(&mp_ring);
+    if (index >= 0) {
+      if (mp_slots[index].result.seq > after_seq) {
+        return &mp_slots[index].result;
+      }
+      snap_ring_unref(&mp_ring, index);
+    }
+    if (os_time_us() >= deadline) {
+      return NULL;
+    }
+    os_sleep_ms(MP_POLL_MS);
+  }
+}
+
+void motion_pipeline_release(const mp_result_t *result) {
+  if (result) {
+    snap_ring_unref(&mp_ring, (const mp_slot_t *)result - mp_slots);
+  }
+}
+
+void motion_pipeline_set_threshold(uint8_t threshold) {
+  if (!mp_tune_lock) {
+    return;
+  }
+  os_mutex_lock(mp_tune_lock);
+  mp_tune_threshold = threshold;
+  os_mutex_unlock(mp_tune_lock);
+}
+
+uint8_t motion_pipeline_get_threshold(void) {
+  return mp_tune_threshold;
+}
+
+bool motion_pipeline_set_zones(const mp_zone_t *zones, int count) {
+  if (!mp_tune_lock || count < 0 || count > MP_MAX_ZONES) {
+    return false;
+  }
+  os_mutex_lock(mp_tune_lock);
+  memcpy(mp_tune_zones, zones, sizeof(mp_zone_t) * count);
+  mp_tune_zone_count = count;
+  os_mutex_unlock(mp_tune_lock);
+  return true;
+}
+
+int motion_pipeline_get_zones(mp_zone_t *zones) {
+  if (!mp_tune_lock) {
+    return 0;
+  }
+  os_mutex_lock(mp_tune_lock);
+  int count = mp_tune_zone_count;
+  memcpy(zones, mp_tune_zones, sizeof(mp_zone_t) * count);
+  os_mutex_unlock(mp_tune_lock);
+  return count;
+}
+
+void motion_pipeline_get_stats(mp_stats_t *stats) {
+  int64_t elapsed = os_time_us() - mp_start_us;
+
+  *stats = mp_stats;
+  if (mp_queue && elapsed > 0) {
+    stats->capture_busy_pct = mp_capture_busy_us * 100 / elapsed;
+    stats->process_busy_pct = mp_process_busy_us * 100 / elapsed;
+  }
+}
+
+size_t motion_pipeline_report_json(char *buf, size_t buf_len) {
+  mp_stats_t st;
+  motion_pipeline_get_stats(&st);
+
+  int n = snprintf(
+    buf, buf_len,
+    "{\"captured\":%u,\"dropped\":%u,\"processed\":%u,\"published\":%u,\"no_slot\":%u,\"copy_failed\":%u,\"queued\":%u,"
+    "\"capture_us\":%u,\"process_us\":%u,\"latency_us\":%u,\"capture_busy_pct\":%u,\"process_busy_pct\":%u}",
+    (unsigned)st.captured, (unsigned)st.dropped, (unsigned)st.processed, (unsigned)st.published, (unsigned)st.no_slot, (unsigned)st.copy_failed,
+    (unsigned)(mp_queue ? os_queue_count(mp_queue) : 0), (unsigned)st.capture_us, (unsigned)st.process_us, (unsigned)st.latency_us,
+    (unsigned)st.capture_busy_pct, (unsigned)st.process_busy_pct
+  );
+  if (n < 0) {
+    return 0;
+  }
+  return (size_t)n < buf_len ? n : buf_len - 1;
+}
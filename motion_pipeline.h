@@ -0,0 +1,120 @@
+#ifndef _MOTION_PIPELINE_H_
+#define _MOTION_PIPELINE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "motion_detect.h"
+
+// Capture and processing run on their own tasks: the capture task (core 0)
+// pulls frames from the source into a bounded queue, the processing task
+// (core 1) diffs each frame against the previous one, labels the motion and
+// publishes the result. HTTP handlers only read published results.
+//
+// Diff, dilation and labeling of a frame are split into horizontal stripes
+// handled by one worker each (the processing task plus helper tasks on the
+// other core); md_merge_stripes() joins regions crossing the stripe borders.
+// tools/stripe_check.cpp checks the stripe stages against a single pass on the
+// host; build with MP_VERIFY_STRIPES to also compare every frame on the device.
+//
+// With static_filter set, static 8x8 blocks of the published frame are low
+// pass filtered (jpeg_quality.h) so encoders spend their bits on the motion.
+
+// Frames waiting between capture and processing. A full queue drops the new
+// frame, so processing never falls behind by more than this.
+#define MP_QUEUE_DEPTH   1
+// Published result snapshots: one being written, the newest one and the
+// rest for readers that are still sending an older generation.
+#define MP_RESULT_SLOTS  4
+// Detection zones, see motion_pipeline_set_zones()
+#define MP_MAX_ZONES     4
+
+typedef struct {
+  const uint8_t *buf;  // 8-bit grayscale, width * height bytes
+  size_t len;
+  uint16_t width;
+  uint16_t height;
+  uint32_t seq;
+  int64_t capture_us;
+  void *handle;        // owned by the source
+} mp_frame_t;
+
+// Where frames come from: the camera driver on the device (frame_ring.h), a
+// replay of recorded frames in host builds (tools/pipeline_replay.cpp).
+typedef struct {
+  bool (*capture)(mp_frame_t *frame, void *ctx);
+  void (*release)(mp_frame_t *frame, void *ctx);
+  void *ctx;
+} mp_source_t;
+
+typedef struct {
+  uint16_t x;
+  uint16_t y;
+  uint16_t w;
+  uint16_t h;
+} mp_zone_t;
+
+// Draws on the published copy of the frame, runs on the processing task.
+typedef void (*mp_annotate_fn_t)(uint8_t *frame, uint16_t width, uint16_t height, const md_regions_t *regions, void *arg);
+
+typedef struct {
+  const mp_source_t *source;
+  uint16_t max_width;  // working buffers are sized for this frame size
+  uint16_t max_height;
+  uint8_t threshold;   // per pixel difference counted as motion
+  uint8_t stripes;     // horizontal stripes processed in parallel, up to MD_MAX_STRIPES
+  mp_annotate_fn_t annotate;
+  void *annotate_arg;
+  bool keep_raw;       // also publish the frame as captured when annotating or filtering
+  uint8_t static_filter;  // jq filter level of static blocks in `frame`, 0 leaves them
+} mp_config_t;
+
+typedef struct {
+  uint32_t seq;
+  int64_t capture_us;
+  int64_t publish_us;
+  uint16_t width;
+  uint16_t height;
+  int64_t detect_us;     // diff, dilation and labeling time
+  const uint8_t *frame;  // annotated and filtered copy of the frame
+  const uint8_t *raw;    // frame as captured, NULL when `frame` is modified without keep_raw
+  const uint8_t *mask;   // motion mask after dilation, 0 or 255
+  const uint8_t *mcu_map;  // jq level per 8x8 block, NULL without static_filter
+  size_t len;            // bytes of frame and of mask
+  md_regions_t regions;
+} mp_result_t;
+
+typedef struct {
+  uint32_t captured;
+  uint32_t dropped;      // queue was full
+  uint32_t processed;
+  uint32_t published;
+  uint32_t no_slot;      // every result slot was held by readers, frame skipped
+  uint32_t copy_failed;  // a snapshot copy could not be queued, frame skipped
+  uint32_t capture_us;   // last time spent waiting for the source
+  uint32_t process_us;   // last diff + label + publish time
+  uint32_t latency_us;   // last capture to publish time
+  uint32_t capture_busy_pct;  // share of wall time each task was working
+  uint32_t process_busy_pct;
+} mp_stats_t;
+
+bool motion_pipeline_start(const mp_config_t *config);
+
+// Newest result with seq > after_seq, waiting up to timeout_ms for one.
+// Returns NULL on timeout. The result is an immutable snapshot that stays
+// valid until released; any number of readers can hold results, lock free.
+const mp_result_t *motion_pipeline_acquire(uint32_t after_seq, uint32_t timeout_ms);
+void motion_pipeline_release(const mp_result_t *result);
+
+// Runtime tuning, taken over from the next frame on. With zones set, only
+// regions whose bounding box overlaps a zone are published; the mask still
+// shows all motion. No zones means the whole frame.
+void motion_pipeline_set_threshold(uint8_t threshold);
+uint8_t motion_pipeline_get_threshold(void);
+bool motion_pipeline_set_zones(const mp_zone_t *zones, int count);
+int motion_pipeline_get_zones(mp_zone_t *zones);
+
+void motion_pipeline_get_stats(mp_stats_t *stats);
+size_t motion_pipeline_report_json(char *buf, size_t buf_len);
+
+#endif /* _MOTION_PIPELINE_H_ */
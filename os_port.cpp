@@ -0,0 +1,265 @@
+#include "os_port.h"
+
+#ifdef ESP_PLATFORM
+
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+static TickType_t os_ticks(uint32_t timeout_ms) {
+  return timeout_ms == OS_WAIT_FOREVER ? portMAX_DELAY : pdMS_TO_TICKS(timeout_ms);
+}
+
+bool os_task_create(os_task_fn_t fn, const char *name, uint32_t stack_size, void *arg, int priority, int core) {
+  BaseType_t affinity = core == OS_NO_AFFINITY ? tskNO_AFFINITY : core;
+  return xTaskCreatePinnedToCore(fn, name, stack_size, arg, priority, NULL, affinity) == pdPASS;
+}
+
+void os_task_exit(void) {
+  vTaskDelete(NULL);
+}
+
+os_queue_t os_queue_create(size_t depth, size_t item_size) {
+  return (os_queue_t)xQueueCreate(depth, item_size);
+}
+
+bool os_queue_send(os_queue_t q, const void *item, uint32_t timeout_ms) {
+  return xQueueSend((QueueHandle_t)q, item, os_ticks(timeout_ms)) == pdTRUE;
+}
+
+bool os_queue_receive(os_queue_t q, void *item, uint32_t timeout_ms) {
+  return xQueueReceive((QueueHandle_t)q, item, os_ticks(timeout_ms)) == pdTRUE;
+}
+
+size_t os_queue_count(os_queue_t q) {
+  return uxQueueMessagesWaiting((QueueHandle_t)q);
+}
+
+os_sem_t os_sem_create(void) {
+  return (os_sem_t)xSemaphoreCreateBinary();
+}
+
+void os_sem_give(os_sem_t s) {
+  xSemaphoreGive((SemaphoreHandle_t)s);
+}
+
+bool os_sem_take(os_sem_t s, uint32_t timeout_ms) {
+  return xSemaphoreTake((SemaphoreHandle_t)s, os_ticks(timeout_ms)) == pdTRUE;
+}
+
+os_mutex_t os_mutex_create(void) {
+  return (os_mutex_t)xSemaphoreCreateMutex();
+}
+
+void os_mutex_lock(os_mutex_t m) {
+  xSemaphoreTake((SemaphoreHandle_t)m, portMAX_DELAY);
+}
+
+void os_mutex_unlock(os_mutex_t m) {
+  xSemaphoreGive((SemaphoreHandle_t)m);
+}
+
+int64_t os_time_us(void) {
+  return esp_timer_get_time();
+}
+
+void os_sleep_ms(uint32_t ms) {
+  vTaskDelay(pdMS_TO_TICKS(ms));
+}
+
+#else /* host build */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct os_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  uint8_t *items;
+  size_t item_size;
+  size_t depth;
+  size_t head;
+  size_t count;
+};
+
+struct os_sem {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool given;
+};
+
+struct os_mutex {
+  pthread_mutex_t lock;
+};
+
+typedef struct {
+  os_task_fn_t fn;
+  void *arg;
+} os_task_start_t;
+
+static void *os_task_entry(void *p) {
+  os_task_start_t start = *(os_task_start_t *)p;
+  free(p);
+  start.fn(start.arg);
+  return NULL;
+}
+
+bool os_task_create(os_task_fn_t fn, const char *name, uint32_t stack_size, void *arg, int priority, int core) {
+  (void)name;
+  (void)stack_size;
+  (void)priority;
+  (void)core;
+  os_task_start_t *start = (os_task_start_t *)malloc(sizeof(os_task_start_t));
+  pthread_t thread;
+  if (!start) {
+    return false;
+  }
+  start->fn = fn;
+  start->arg = arg;
+  if (pthread_create(&thread, NULL, os_task_entry, start) != 0) {
+    free(start);
+    return false;
+  }
+  pthread_detach(thread);
+  return true;
+}
+
+void os_task_exit(void) {
+  pthread_exit(NULL);
+}
+
+static void os_deadline(struct timespec *ts, uint32_t timeout_ms) {
+  clock_gettime(CLOCK_REALTIME, ts);
+  ts->tv_sec += timeout_ms / 1000;
+  ts->tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+  if (ts->tv_nsec >= 1000000000L) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000L;
+  }
+}
+
+// Waits on `cond` until `ready` holds; `lock` must be held by the caller.
+template <typename F> static bool os_wait(pthread_cond_t *cond, pthread_mutex_t *lock, uint32_t timeout_ms, F ready) {
+  struct timespec ts;
+  if (timeout_ms != OS_WAIT_FOREVER) {
+    os_deadline(&ts, timeout_ms);
+  }
+  while (!ready()) {
+    int err = timeout_ms == OS_WAIT_FOREVER ? pthread_cond_wait(cond, lock) : pthread_cond_timedwait(cond, lock, &ts);
+    if (err == ETIMEDOUT) {
+      return ready();
+    }
+  }
+  return true;
+}
+
+os_queue_t os_queue_create(size_t depth, size_t item_size) {
+  os_queue_t q = (os_queue_t)calloc(1, sizeof(struct os_queue));
+  if (!q) {
+    return NULL;
+  }
+  q->items = (uint8_t *)malloc(depth * item_size);
+  if (!q->items) {
+    free(q);
+    return NULL;
+  }
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->not_empty, NULL);
+  pthread_cond_init(&q->not_full, NULL);
+  q->item_size = item_size;
+  q->depth = depth;
+  return q;
+}
+
+bool os_queue_send(os_queue_t q, const void *item, uint32_t timeout_ms) {
+  pthread_mutex_lock(&q->lock);
+  bool ok = os_wait(&q->not_full, &q->lock, timeout_ms, [q] { return q->count < q->depth; });
+  if (ok) {
+    memcpy(q->items + ((q->head + q->count) % q->depth) * q->item_size, item, q->item_size);
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return ok;
+}
+
+bool os_queue_receive(os_queue_t q, void *item, uint32_t timeout_ms) {
+  pthread_mutex_lock(&q->lock);
+  bool ok = os_wait(&q->not_empty, &q->lock, timeout_ms, [q] { return q->count > 0; });
+  if (ok) {
+    memcpy(item, q->items + q->head * q->item_size, q->item_size);
+    q->head = (q->head + 1) % q->depth;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return ok;
+}
+
+size_t os_queue_count(os_queue_t q) {
+  pthread_mutex_lock(&q->lock);
+  size_t n = q->count;
+  pthread_mutex_unlock(&q->lock);
+  return n;
+}
+
+os_sem_t os_sem_create(void) {
+  os_sem_t s = (os_sem_t)calloc(1, sizeof(struct os_sem));
+  if (s) {
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+  }
+  return s;
+}
+
+void os_sem_give(os_sem_t s) {
+  pthread_mutex_lock(&s->lock);
+  s->given = true;
+  pthread_cond_signal(&s->cond);
+  pthread_mutex_unlock(&s->lock);
+}
+
+bool os_sem_take(os_sem_t s, uint32_t timeout_ms) {
+  pthread_mutex_lock(&s->lock);
+  bool ok = os_wait(&s->cond, &s->lock, timeout_ms, [s] { return s->given; });
+  if (ok) {
+    s->given = false;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return ok;
+}
+
+os_mutex_t os_mutex_create(void) {
+  os_mutex_t m = (os_mutex_t)calloc(1, sizeof(struct os_mutex));
+  if (m) {
+    pthread_mutex_init(&m->lock, NULL);
+  }
+  return m;
+}
+
+void os_mutex_lock(os_mutex_t m) {
+  pthread_mutex_lock(&m->lock);
+}
+
+void os_mutex_unlock(os_mutex_t m) {
+  pthread_mutex_unlock(&m->lock);
+}
+
+int64_t os_time_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void os_sleep_ms(uint32_t ms) {
+  struct timespec ts = {(time_t)(ms / 1000), (long)(ms % 1000) * 1000000L};
+  nanosleep(&ts, NULL);
+}
+
+#endif /* ESP_PLATFORM */
@@ -0,0 +1,42 @@
+#ifndef _OS_PORT_H_
+#define _OS_PORT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Thin task/queue/semaphore layer so the pipeline services run on FreeRTOS on
+// the device and on POSIX threads in host builds (ESP_PLATFORM undefined).
+
+#define OS_WAIT_FOREVER 0xffffffffu
+#define OS_NO_AFFINITY  -1
+
+typedef struct os_queue *os_queue_t;
+typedef struct os_sem *os_sem_t;
+typedef struct os_mutex *os_mutex_t;
+typedef void (*os_task_fn_t)(void *arg);
+
+// `core` pins the task on the device, it is ignored on the host.
+bool os_task_create(os_task_fn_t fn, const char *name, uint32_t stack_size, void *arg, int priority, int core);
+// Ends the calling task, task functions must not return.
+void os_task_exit(void);
+
+// Bounded queue of fixed size items, copied in and out.
+os_queue_t os_queue_create(size_t depth, size_t item_size);
+bool os_queue_send(os_queue_t q, const void *item, uint32_t timeout_ms);
+bool os_queue_receive(os_queue_t q, void *item, uint32_t timeout_ms);
+size_t os_queue_count(os_queue_t q);
+
+// Binary semaphore, created empty.
+os_sem_t os_sem_create(void);
+void os_sem_give(os_sem_t s);
+bool os_sem_take(os_sem_t s, uint32_t timeout_ms);
+
+os_mutex_t os_mutex_create(void);
+void os_mutex_lock(os_mutex_t m);
+void os_mutex_unlock(os_mutex_t m);
+
+int64_t os_time_us(void);
+void os_sleep_ms(uint32_t ms);
+
+#endif /* _OS_PORT_H_ */
@@ -0,0 +1,84 @@
+#include <JPEGENC.h>
+#include "esp32-hal-log.h"
+#include "os_port.h"
+#include "roi_jpeg.h"
+
+// The encoder state is a few kilobytes, too much for the request worker
+// stacks; one instance is shared under a mutex.
+static JPEGENC roi_encoder;
+static os_mutex_t roi_lock;
+
+static uint16_t roi_align_down(int v) {
+  return (uint16_t)(v < 0 ? 0 : v - v % ROI_JPEG_MCU);
+}
+
+bool roi_jpeg_init(void) {
+  if (!roi_lock) {
+    roi_lock = os_mutex_create();
+  }
+  return roi_lock != NULL;
+}
+
+bool roi_jpeg_align(const md_regions_t *regions, int index, uint16_t frame_w, uint16_t frame_h, uint16_t margin, roi_rect_t *out) {
+  uint16_t limit_w = roi_align_down(frame_w);
+  uint16_t limit_h = roi_align_down(frame_h);
+
+  if (!limit_w || !limit_h) {
+    return false;
+  }
+  int x0 = roi_align_down(regions->min_x[index] - margin);
+  int y0 = roi_align_down(regions->min_y[index] - margin);
+  int x1 = roi_align_down(regions->max_x[index] + margin + ROI_JPEG_MCU);
+  int y1 = roi_align_down(regions->max_y[index] + margin + ROI_JPEG_MCU);
+  x1 = x1 > limit_w ? limit_w : x1;
+  y1 = y1 > limit_h ? limit_h : y1;
+  x0 = x0 >= x1 ? x1 - ROI_JPEG_MCU : x0;
+  y0 = y0 >= y1 ? y1 - ROI_JPEG_MCU : y0;
+
+  out->x = x0;
+  out->y = y0;
+  out->w = x1 - x0;
+  out->h = y1 - y0;
+  return true;
+}
+
+int roi_jpeg_largest(const md_regions_t *regions) {
+  int best = -1;
+
+  for (int i = 0; i < regions->count; i++) {
+    if (best < 0 || regions->area[i] > regions->area[best]) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+static uint8_t roi_quality_level(uint8_t quality) {
+  if (quality >= 90) {
+    return JPEGE_Q_BEST;
+  }
+  if (quality >= 75) {
+    return JPEGE_Q_HIGH;
+  }
+  if (quality >= 50) {
+    return JPEGE_Q_MED;
+  }
+  return JPEGE_Q_LOW;
+}
+
+size_t roi_jpeg_encode(const uint8_t *frame, uint16_t frame_w, const roi_rect_t *roi, uint8_t quality, uint8_t *out, size_t out_len) {
+  JPEGENCODE enc;
+  int size = 0;
+
+  os_mutex_lock(roi_lock);
+  if (roi_encoder.open(out, out_len) == JPEGE_SUCCESS
+      && roi_encoder.encodeBegin(&enc, roi->w, roi->h, JPEGE_PIXEL_GRAYSCALE, JPEGE_SUBSAMPLE_444, roi_quality_level(quality)) == JPEGE_SUCCESS
+      && roi_encoder.addFrame(&enc, (uint8_t *)frame + (size_t)roi->y * frame_w + roi->x, frame_w) == JPEGE_SUCCESS) {
+    size = roi_encoder.close();
+  } else {
+    log_e("ROI: encoding %ux%u failed (%d)", roi->w, roi->h, roi_encoder.getLastError());
+    roi_encoder.close();
+  }
+  os_mutex_unlock(roi_lock);
+  return size > 0 ? (size_t)size : 0;
+}
@@ -0,0 +1,36 @@
+#ifndef _ROI_JPEG_H_
+#define _ROI_JPEG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "motion_detect.h"
+
+// JPEG crops of the detected regions. Crops are grown by a margin and snapped
+// to the 8x8 MCU grid, so JPEGENC encodes them straight out of the frame
+// buffer with the frame width as pitch, without copying the crop first.
+
+#define ROI_JPEG_MCU 8
+
+typedef struct {
+  uint16_t x;
+  uint16_t y;
+  uint16_t w;
+  uint16_t h;
+} roi_rect_t;
+
+bool roi_jpeg_init(void);
+
+// Box of region `index` grown by `margin` pixels, aligned to the MCU grid and
+// clipped to the frame. False for frames smaller than one MCU.
+bool roi_jpeg_align(const md_regions_t *regions, int index, uint16_t frame_w, uint16_t frame_h, uint16_t margin, roi_rect_t *out);
+
+// Index of the region with the largest area, -1 when there is none.
+int roi_jpeg_largest(const md_regions_t *regions);
+
+// Encodes the crop of an 8-bit grayscale frame into out. `quality` is 0..100
+// and maps onto the JPEGENC quality levels. Returns the JPEG size, 0 on
+// failure or when out is too small.
+size_t roi_jpeg_encode(const uint8_t *frame, uint16_t frame_w, const roi_rect_t *roi, uint8_t quality, uint8_t *out, size_t out_len);
+
+#endif /* _ROI_JPEG_H_ */
@@ -0,0 +1,60 @@
+#include "snap_ring.h"
+
+void snap_ring_init(snap_ring_t *ring, int count) {
+  ring->count = count < SNAP_RING_MAX ? count : SNAP_RING_MAX;
+  ring->next = 0;
+  ring->latest.store(-1);
+  for (int i = 0; i < SNAP_RING_MAX; i++) {
+    ring->refs[i].store(0);
+    ring->gen[i].store(0);
+  }
+}
+
+int snap_ring_claim(snap_ring_t *ring) {
+  int latest = ring->latest.load(std::memory_order_acquire);
+
+  for (int n = 0; n < ring->count; n++) {
+    int i = (ring->next + n) % ring->count;
+    int32_t idle = 0;
+    if (i != latest && ring->refs[i].compare_exchange_strong(idle, SNAP_RING_WRITING, std::memory_order_acquire)) {
+      ring->gen[i].store(0, std::memory_order_relaxed);
+      ring->next = (i + 1) % ring->count;
+      return i;
+    }
+  }
+  return -1;
+}
+
+void snap_ring_publish(snap_ring_t *ring, int slot, uint32_t gen) {
+  ring->gen[slot].store(gen, std::memory_order_release);
+  ring->refs[slot].store(0, std::memory_order_release);
+  ring->latest.store(slot, std::memory_order_release);
+}
+
+void snap_ring_abort(snap_ring_t *ring, int slot) {
+  ring->refs[slot].store(0, std::memory_order_release);
+}
+
+int snap_ring_ref(snap_ring_t *ring) {
+  int i = ring->latest.load(std::memory_order_acquire);
+  if (i < 0) {
+    return -1;
+  }
+  uint32_t gen = ring->gen[i].load(std::memory_order_acquire);
+  int32_t refs = ring->refs[i].load(std::memory_order_relaxed);
+  do {
+    if (gen == 0 || refs < 0) {
+      return -1;
+    }
+  } while (!ring->refs[i].compare_exchange_weak(refs, refs + 1, std::memory_order_acquire));
+  if (ring->gen[i].load(std::memory_order_acquire) != gen) {
+    // Rewritten between the load of latest and our reference
+    ring->refs[i].fetch_sub(1, std::memory_order_release);
+    return -1;
+  }
+  return i;
+}
+
+void snap_ring_unref(snap_ring_t *ring, int slot) {
+  ring->refs[slot].fetch_sub(1, std::memory_order_release);
+}
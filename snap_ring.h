@@ -0,0 +1,41 @@
+#ifndef _SNAP_RING_H_
+#define _SNAP_RING_H_
+
+#include <stdint.h>
+#include <atomic>
+
+// Lock free ring of immutable, reference counted snapshots with one writer and
+// any number of readers. The writer claims a slot nobody reads by moving its
+// reference count from 0 to SNAP_RING_WRITING, fills it, then publishes it as
+// the latest slot. Readers take a reference with a CAS that fails while the
+// slot is being written and check the generation afterwards, so a slot
+// rewritten under them is never returned; they retry with the newest one.
+// Neither side ever blocks. The slot payloads live with the caller, indexed
+// like the ring.
+
+#define SNAP_RING_MAX     8
+#define SNAP_RING_WRITING -1
+
+typedef struct {
+  int count;
+  int next;  // writer side only
+  std::atomic<int32_t> latest;
+  std::atomic<int32_t> refs[SNAP_RING_MAX];
+  std::atomic<uint32_t> gen[SNAP_RING_MAX];  // 0 while written or never published
+} snap_ring_t;
+
+void snap_ring_init(snap_ring_t *ring, int count);
+
+// Writer: next slot that is neither published nor referenced, -1 if none.
+int snap_ring_claim(snap_ring_t *ring);
+// Writer: makes the claimed slot the latest one, `gen` must not be 0.
+void snap_ring_publish(snap_ring_t *ring, int slot, uint32_t gen);
+// Writer: gives a claimed slot back without publishing it.
+void snap_ring_abort(snap_ring_t *ring, int slot);
+
+// Reader: reference on the latest slot, -1 when there is none yet or when it
+// was claimed for writing in the meantime (just try again).
+int snap_ring_ref(snap_ring_t *ring);
+void snap_ring_unref(snap_ring_t *ring, int slot);
+
+#endif /* _SNAP_RING_H_ */
@@ -0,0 +1,52 @@
+// Prints binary detection records (detection_wire.h), one line per record
+// and one indented line per region. Reads back to back records from a file
+// or stdin, e.g. a saved /detections?format=bin response:
+//
+//   g++ -O2 -I.. detection_dump.cpp ../detection_wire.cpp -o detection_dump
+//   curl -s 'http://cam/detections?format=bin' | ./detection_dump
+//
+// Exits with 1 when the input ends in something that is not a record.
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "detection_wire.h"
+
+static bool load(FILE *f, std::vector<uint8_t> &data) {
+  uint8_t chunk[4096];
+  size_t n;
+
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+    data.insert(data.end(), chunk, chunk + n);
+  }
+  return !ferror(f);
+}
+
+int main(int argc, char **argv) {
+  std::vector<uint8_t> data;
+  FILE *f = argc > 1 ? fopen(argv[1], "rb") : stdin;
+
+  if (!f || !load(f, data)) {
+    fprintf(stderr, "%s: cannot read\n", argc > 1 ? argv[1] : "stdin");
+    return 1;
+  }
+  size_t off = 0;
+  while (off < data.size()) {
+    dw_header_t hdr;
+    size_t len = detection_wire_decode(data.data() + off, data.size() - off, &hdr);
+    if (!len) {
+      fprintf(stderr, "offset %zu: not a detection record\n", off);
+      return 1;
+    }
+    printf(
+      "seq %u v%u %ux%u ts %lld us +%u us regions %u dropped %u%s\n", (unsigned)hdr.seq, hdr.version, hdr.width, hdr.height, (long long)hdr.capture_us,
+      (unsigned)hdr.publish_delay_us, hdr.count, hdr.dropped, hdr.flags & DW_FLAG_TRUNCATED ? " truncated" : ""
+    );
+    for (int i = 0; i < hdr.count; i++) {
+      dw_region_t r;
+      detection_wire_region(data.data() + off, &hdr, i, &r);
+      printf("  %d: bbox %u,%u %ux%u centroid %u,%u area %u\n", i, r.x, r.y, r.w, r.h, r.cx, r.cy, (unsigned)r.area);
+    }
+    off += len;
+  }
+  return 0;
+}
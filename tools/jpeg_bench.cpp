@@ -0,0 +1,129 @@
+// Host benchmark of gray2jpg_cb (convert_jpg.cpp) at the qualities the
+// sketch uses: 80 for /stream and /capture, 90 for /subtraction.
+//
+//   g++ -O2 -I.. jpeg_bench.cpp ../convert_jpg.cpp -o jpeg_bench
+//   ./jpeg_bench [frame.pgm]
+//
+// fmt2jpg runs the jpge encoder of esp32-camera. To compare against it, build
+// with WITH_JPGE and the esp32-camera conversions sources:
+//
+//   g++ -O2 -DWITH_JPGE -I.. -I$CAM/conversions/private_include jpeg_bench.cpp ../convert_jpg.cpp $CAM/conversions/jpge.cpp
+//
+// Without a PGM (binary P5, 8 bit) a synthetic 240x240 frame is used.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include "convert_jpg.h"
+#ifdef WITH_JPGE
+#include "jpge.h"
+#endif
+
+#define BENCH_RUNS 200
+
+static double now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static bool load_pgm(const char *path, std::vector<uint8_t> &px, int *w, int *h) {
+  FILE *f = fopen(path, "rb");
+  int maxval = 0;
+  if (!f) {
+    return false;
+  }
+  bool ok = fscanf(f, "P5 %d %d %d", w, h, &maxval) == 3 && maxval == 255 && fgetc(f) != EOF;
+  if (ok) {
+    px.resize((size_t)*w * *h);
+    ok = fread(px.data(), 1, px.size(), f) == px.size();
+  }
+  fclose(f);
+  return ok;
+}
+
+static void synth_frame(std::vector<uint8_t> &px, int w, int h) {
+  px.resize((size_t)w * h);
+  srand(1);
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      int v = (x + y) / 2 + rand() % 16 + (((x / 24 + y / 24) & 1) ? 48 : 0);
+      px[y * w + x] = v > 255 ? 255 : v;
+    }
+  }
+}
+
+static size_t count_cb(void *arg, size_t index, const void *data, size_t len) {
+  *(size_t *)arg = index + len;
+  return len;
+}
+
+#ifdef WITH_JPGE
+class count_stream : public jpge::output_stream {
+public:
+  size_t len = 0;
+  bool put_buf(const void *data, int n) override {
+    len += n;
+    return true;
+  }
+  jpge::uint get_size() const override {
+    return len;
+  }
+};
+
+// Same encoder setup as fmt2jpg for PIXFORMAT_GRAYSCALE
+static size_t jpge_encode(const uint8_t *px, int w, int h, int quality) {
+  count_stream stream;
+  jpge::params params;
+  params.m_quality = quality;
+  params.m_subsampling = jpge::Y_ONLY;
+  jpge::jpeg_encoder enc;
+  if (!enc.init(&stream, w, h, 1, params)) {
+    return 0;
+  }
+  for (jpge::uint pass = 0; pass < enc.get_total_passes(); pass++) {
+    for (int y = 0; y < h; y++) {
+      enc.process_scanline(px + (size_t)y * w);
+    }
+    enc.process_scanline(NULL);
+  }
+  enc.deinit();
+  return stream.len;
+}
+#endif
+
+int main(int argc, char **argv) {
+  std::vector<uint8_t> px;
+  int w = 240;
+  int h = 240;
+  static const int qualities[] = {80, 90};
+
+  if (argc > 1 && !load_pgm(argv[1], px, &w, &h)) {
+    fprintf(stderr, "%s: not an 8-bit binary PGM\n", argv[1]);
+    return 1;
+  }
+  if (px.empty()) {
+    synth_frame(px, w, h);
+  }
+  printf("%dx%d, %d runs\n", w, h, BENCH_RUNS);
+  for (int quality : qualities) {
+    size_t len = 0;
+    double t0 = now_us();
+    for (int i = 0; i < BENCH_RUNS; i++) {
+      if (!gray2jpg_cb(px.data(), w, h, w, quality, count_cb, &len)) {
+        fprintf(stderr, "gray2jpg_cb failed\n");
+        return 1;
+      }
+    }
+    printf("q%d gray2jpg_cb: %6zu bytes %8.1f us\n", quality, len, (now_us() - t0) / BENCH_RUNS);
+#ifdef WITH_JPGE
+    t0 = now_us();
+    for (int i = 0; i < BENCH_RUNS; i++) {
+      len = jpge_encode(px.data(), w, h, quality);
+    }
+    printf("q%d jpge (fmt2jpg): %6zu bytes %8.1f us\n", quality, len, (now_us() - t0) / BENCH_RUNS);
+#endif
+  }
+  return 0;
+}
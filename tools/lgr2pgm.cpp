@@ -0,0 +1,90 @@
+// Host decoder of lossless_gray.h streams (/lossless, stored .lgr files):
+// writes the image as a binary PGM. With -e it encodes a PGM instead, to
+// check sizes and round trips on recorded frames.
+//
+//   g++ -O2 -I.. lgr2pgm.cpp ../lossless_gray.cpp -o lgr2pgm
+//   curl -s http://cam/lossless > frame.lgr && ./lgr2pgm frame.lgr frame.pgm
+//   ./lgr2pgm -e frame.pgm frame.lgr
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "lossless_gray.h"
+
+static bool load(const char *path, std::vector<uint8_t> &data) {
+  FILE *f = fopen(path, "rb");
+  uint8_t chunk[4096];
+  size_t n;
+
+  if (!f) {
+    return false;
+  }
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+    data.insert(data.end(), chunk, chunk + n);
+  }
+  bool ok = !ferror(f);
+  fclose(f);
+  return ok;
+}
+
+static size_t file_out(void *arg, size_t index, const void *data, size_t len) {
+  return fwrite(data, 1, len, (FILE *)arg);
+}
+
+static int encode(const char *in, const char *out) {
+  std::vector<uint8_t> px;
+  int w = 0;
+  int h = 0;
+  int maxval = 0;
+  FILE *f = fopen(in, "rb");
+
+  bool ok = f && fscanf(f, "P5 %d %d %d", &w, &h, &maxval) == 3 && maxval == 255 && fgetc(f) != EOF && w > 0 && h > 0 && w <= 0xffff && h <= 0xffff;
+  if (ok) {
+    px.resize((size_t)w * h);
+    ok = fread(px.data(), 1, px.size(), f) == px.size();
+  }
+  if (f) {
+    fclose(f);
+  }
+  if (!ok) {
+    fprintf(stderr, "%s: not an 8-bit binary PGM\n", in);
+    return 1;
+  }
+  FILE *o = fopen(out, "wb");
+  if (!o || !lossless_gray_encode(px.data(), w, h, w, file_out, o)) {
+    fprintf(stderr, "%s: write failed\n", out);
+    return 1;
+  }
+  printf("%dx%d: %zu -> %ld bytes\n", w, h, px.size(), ftell(o));
+  fclose(o);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  std::vector<uint8_t> data;
+  uint16_t w, h;
+
+  if (argc == 4 && !strcmp(argv[1], "-e")) {
+    return encode(argv[2], argv[3]);
+  }
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s in.lgr out.pgm | -e in.pgm out.lgr\n", argv[0]);
+    return 2;
+  }
+  if (!load(argv[1], data) || !lossless_gray_info(data.data(), data.size(), &w, &h)) {
+    fprintf(stderr, "%s: not a lossless gray stream\n", argv[1]);
+    return 1;
+  }
+  std::vector<uint8_t> px((size_t)w * h);
+  if (!lossless_gray_decode(data.data(), data.size(), NULL, px.data(), px.size())) {
+    fprintf(stderr, "%s: corrupt stream\n", argv[1]);
+    return 1;
+  }
+  FILE *o = fopen(argv[2], "wb");
+  if (!o || fprintf(o, "P5\n%u %u\n255\n", w, h) < 0 || fwrite(px.data(), 1, px.size(), o) != px.size()) {
+    fprintf(stderr, "%s: write failed\n", argv[2]);
+    return 1;
+  }
+  fclose(o);
+  return 0;
+}
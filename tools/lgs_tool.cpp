@@ -0,0 +1,136 @@
+// Host reader of recorded sequences (frame_store.h, /store?get=s<id>.lgs).
+// Lists the frames with their keyframes, or seeks to one frame: it hops over
+// the record lengths to the keyframe at or before it and decodes forward.
+//
+//   g++ -O2 -I.. lgs_tool.cpp ../lossless_gray.cpp -o lgs_tool
+//   ./lgs_tool seq.lgs                 list frames
+//   ./lgs_tool seq.lgs 42 frame.pgm    frame 42 (0 based) as a PGM
+//   ./lgs_tool seq.lgs all prefix      every frame as prefix_NNNN.pgm
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "lossless_gray.h"
+
+#define SEQ_HEADER_LEN 8
+#define RECORD_LEN     16
+
+typedef struct {
+  size_t offset;  // of the lossless_gray stream
+  size_t len;
+  uint32_t seq;
+  int64_t capture_us;
+  bool key;
+} record_t;
+
+static uint32_t get32(const uint8_t *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static bool load(const char *path, std::vector<uint8_t> &data) {
+  FILE *f = fopen(path, "rb");
+  uint8_t chunk[4096];
+  size_t n;
+
+  if (!f) {
+    return false;
+  }
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+    data.insert(data.end(), chunk, chunk + n);
+  }
+  bool ok = !ferror(f);
+  fclose(f);
+  return ok;
+}
+
+// Index of every complete record; a cut off last record is left out.
+static void scan(const std::vector<uint8_t> &data, std::vector<record_t> &records) {
+  size_t off = SEQ_HEADER_LEN;
+
+  while (off + RECORD_LEN + LOSSLESS_GRAY_HEADER_LEN <= data.size()) {
+    const uint8_t *p = data.data() + off;
+    record_t r;
+    r.offset = off + RECORD_LEN;
+    r.len = get32(p);
+    r.seq = get32(p + 4);
+    r.capture_us = (int64_t)(get32(p + 8) | (uint64_t)get32(p + 12) << 32);
+    if (r.len < LOSSLESS_GRAY_HEADER_LEN || r.len > data.size() - r.offset) {
+      break;
+    }
+    r.key = !(data[r.offset + 3] & LOSSLESS_GRAY_DELTA);
+    records.push_back(r);
+    off = r.offset + r.len;
+  }
+}
+
+static bool write_pgm(const char *path, const std::vector<uint8_t> &px, int w, int h) {
+  FILE *o = fopen(path, "wb");
+  bool ok = o && fprintf(o, "P5\n%d %d\n255\n", w, h) > 0 && fwrite(px.data(), 1, px.size(), o) == px.size();
+  if (o) {
+    fclose(o);
+  }
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  std::vector<uint8_t> data;
+  std::vector<record_t> records;
+
+  if (argc != 2 && argc != 4) {
+    fprintf(stderr, "usage: %s seq.lgs [frame|all out]\n", argv[0]);
+    return 2;
+  }
+  if (!load(argv[1], data) || data.size() < SEQ_HEADER_LEN || data[0] != 'L' || data[1] != 'S' || data[2] != 1) {
+    fprintf(stderr, "%s: not a sequence\n", argv[1]);
+    return 1;
+  }
+  int w = data[4] | data[5] << 8;
+  int h = data[6] | data[7] << 8;
+  scan(data, records);
+
+  if (argc == 2) {
+    size_t keys = 0;
+    for (size_t i = 0; i < records.size(); i++) {
+      const record_t &r = records[i];
+      keys += r.key;
+      printf("%4zu seq %u t %.3f s %6zu bytes%s\n", i, (unsigned)r.seq, (r.capture_us - records[0].capture_us) / 1e6, r.len, r.key ? " key" : "");
+    }
+    printf("%dx%d, %zu frames, %zu keyframes, %zu bytes (%.1f raw frames)\n", w, h, records.size(), keys, data.size(), (double)data.size() / (w * h));
+    return 0;
+  }
+
+  bool all = !strcmp(argv[2], "all");
+  size_t want = all ? records.size() - 1 : strtoul(argv[2], NULL, 10);
+  if (records.empty() || want >= records.size()) {
+    fprintf(stderr, "no frame %s, %zu frames\n", argv[2], records.size());
+    return 1;
+  }
+  size_t first = 0;
+  if (!all) {
+    for (first = want; !records[first].key; first--) {
+    }
+  }
+  std::vector<uint8_t> prev((size_t)w * h);
+  std::vector<uint8_t> cur((size_t)w * h);
+  for (size_t i = first; i <= want; i++) {
+    const record_t &r = records[i];
+    if (!lossless_gray_decode(data.data() + r.offset, r.len, prev.data(), cur.data(), cur.size())) {
+      fprintf(stderr, "frame %zu: corrupt\n", i);
+      return 1;
+    }
+    if (all) {
+      char path[512];
+      snprintf(path, sizeof(path), "%s_%04zu.pgm", argv[3], i);
+      if (!write_pgm(path, cur, w, h)) {
+        fprintf(stderr, "%s: write failed\n", path);
+        return 1;
+      }
+    }
+    prev.swap(cur);
+  }
+  if (!all && !write_pgm(argv[3], prev, w, h)) {
+    fprintf(stderr, "%s: write failed\n", argv[3]);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,205 @@
+// Host replay harness of the motion pipeline (motion_pipeline.h): feeds
+// recorded frames through the POSIX build of the capture and processing
+// tasks at a camera frame rate and prints the /pipeline report, to measure
+// how capture, stripes and processing overlap.
+//
+//   g++ -O2 -pthread -I.. pipeline_replay.cpp ../motion_pipeline.cpp ../frame_arena.cpp ../os_port.cpp ../copy_service.cpp ../snap_ring.cpp ../motion_detect.cpp ../jpeg_quality.cpp ../lossless_gray.cpp -o pipeline_replay
+//   ./pipeline_replay [-f fps] [-s stripes] [-t threshold] [-l loops] frames.lgs|frame.pgm ...
+//
+// Sequences (/store?record=, .lgs) are decoded up front, PGMs (binary P5,
+// 8 bit) are one frame each; all frames must have the same size. With -f 0
+// frames come without pause, the drop count then shows the processing rate.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "os_port.h"
+#include "copy_service.h"
+#include "lossless_gray.h"
+#include "motion_pipeline.h"
+
+#define SEQ_HEADER_LEN 8
+#define RECORD_LEN     16
+
+typedef struct {
+  std::vector<std::vector<uint8_t>> frames;
+  uint16_t width;
+  uint16_t height;
+  uint32_t loops;
+  uint32_t interval_us;
+  uint32_t next;     // frames handed out so far
+  int64_t due_us;
+} replay_t;
+
+static bool load(const char *path, std::vector<uint8_t> &data) {
+  FILE *f = fopen(path, "rb");
+  uint8_t chunk[4096];
+  size_t n;
+
+  if (!f) {
+    return false;
+  }
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+    data.insert(data.end(), chunk, chunk + n);
+  }
+  bool ok = !ferror(f);
+  fclose(f);
+  return ok;
+}
+
+static uint32_t get32(const uint8_t *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Decodes every complete record of a sequence, see frame_store.h.
+static bool add_sequence(replay_t *rp, const std::vector<uint8_t> &data) {
+  uint16_t w = data[4] | data[5] << 8;
+  uint16_t h = data[6] | data[7] << 8;
+  std::vector<uint8_t> prev((size_t)w * h);
+  size_t off = SEQ_HEADER_LEN;
+
+  while (off + RECORD_LEN + LOSSLESS_GRAY_HEADER_LEN <= data.size()) {
+    size_t len = get32(data.data() + off);
+    off += RECORD_LEN;
+    if (len > data.size() - off) {
+      break;
+    }
+    std::vector<uint8_t> px((size_t)w * h);
+    if (!lossless_gray_decode(data.data() + off, len, prev.data(), px.data(), px.size())) {
+      return false;
+    }
+    prev = px;
+    rp->frames.push_back(px);
+    off += len;
+  }
+  rp->width = w;
+  rp->height = h;
+  return true;
+}
+
+static bool add_pgm(replay_t *rp, const std::vector<uint8_t> &data) {
+  int w, h, maxval, header;
+
+  std::string text((const char *)data.data(), data.size() < 64 ? data.size() : 64);
+  if (sscanf(text.c_str(), "P5 %d %d %d%n", &w, &h, &maxval, &header) != 3 || maxval != 255 || w <= 0 || h <= 0 || w > 0xffff || h > 0xffff) {
+    return false;
+  }
+  header++;  // single whitespace after maxval
+  if (data.size() < header + (size_t)w * h) {
+    return false;
+  }
+  rp->frames.emplace_back(data.begin() + header, data.begin() + header + (size_t)w * h);
+  rp->width = w;
+  rp->height = h;
+  return true;
+}
+
+static bool replay_capture(mp_frame_t *frame, void *ctx) {
+  replay_t *rp = (replay_t *)ctx;
+
+  if (rp->next == rp->frames.size() * rp->loops) {
+    return false;
+  }
+  // Frames come at the sensor rate, like esp_camera_fb_get()
+  int64_t now = os_time_us();
+  if (rp->due_us > now) {
+    usleep(rp->due_us - now);
+  }
+  rp->due_us = (rp->due_us > now ? rp->due_us : now) + rp->interval_us;
+  const std::vector<uint8_t> &px = rp->frames[rp->next % rp->frames.size()];
+  frame->buf = px.data();
+  frame->len = px.size();
+  frame->width = rp->width;
+  frame->height = rp->height;
+  frame->seq = ++rp->next;
+  frame->handle = NULL;
+  return true;
+}
+
+static void replay_release(mp_frame_t *frame, void *ctx) {
+}
+
+int main(int argc, char **argv) {
+  static replay_t rp;
+  int fps = 25;
+  int stripes = 2;
+  int threshold = 70;
+  int opt;
+
+  rp.loops = 1;
+  while ((opt = getopt(argc, argv, "f:s:t:l:")) != -1) {
+    switch (opt) {
+      case 'f': fps = atoi(optarg); break;
+      case 's': stripes = atoi(optarg); break;
+      case 't': threshold = atoi(optarg); break;
+      case 'l': rp.loops = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+      default:
+        fprintf(stderr, "usage: %s [-f fps] [-s stripes] [-t threshold] [-l loops] frames.lgs|frame.pgm ...\n", argv[0]);
+        return 2;
+    }
+  }
+  for (int i = optind; i < argc; i++) {
+    std::vector<uint8_t> data;
+    uint16_t w = rp.width;
+    uint16_t h = rp.height;
+    bool ok = load(argv[i], data) && data.size() >= SEQ_HEADER_LEN;
+    if (ok && data[0] == 'L' && data[1] == 'S' && data[2] == 1) {
+      ok = add_sequence(&rp, data);
+    } else if (ok) {
+      ok = add_pgm(&rp, data);
+    }
+    if (!ok || (w && (w != rp.width || h != rp.height))) {
+      fprintf(stderr, "%s: not a sequence or PGM of the same size\n", argv[i]);
+      return 1;
+    }
+  }
+  if (rp.frames.empty()) {
+    fprintf(stderr, "no frames\n");
+    return 1;
+  }
+  rp.interval_us = fps > 0 ? 1000000 / fps : 0;
+
+  static mp_source_t source = {replay_capture, replay_release, &rp};
+  mp_config_t config = {&source, rp.width, rp.height, (uint8_t)threshold, (uint8_t)stripes, NULL, NULL, false, 0};
+  if (!copy_service_init() || !motion_pipeline_start(&config)) {
+    fprintf(stderr, "pipeline start failed\n");
+    return 1;
+  }
+
+  // Reads results like an HTTP consumer until every frame was processed or
+  // dropped
+  uint32_t total = rp.frames.size() * rp.loops;
+  uint32_t last_seq = 0;
+  uint32_t results = 0;
+  uint32_t regions = 0;
+  int64_t detect_us = 0;
+  int64_t latency_us = 0;
+  mp_stats_t st;
+  for (;;) {
+    const mp_result_t *r = motion_pipeline_acquire(last_seq, 200);
+    if (r) {
+      last_seq = r->seq;
+      results++;
+      regions += r->regions.count;
+      detect_us += r->detect_us;
+      latency_us += r->publish_us - r->capture_us;
+      motion_pipeline_release(r);
+    }
+    motion_pipeline_get_stats(&st);
+    if (st.processed + st.dropped >= total && !r) {
+      break;
+    }
+  }
+
+  char report[512];
+  motion_pipeline_report_json(report, sizeof(report));
+  printf("%ux%u, %u frames, %d fps, %d stripes\n", rp.width, rp.height, (unsigned)total, fps, stripes);
+  printf(
+    "read %u results: %.1f regions, detect %.0f us, latency %.0f us on average\n", (unsigned)results, results ? (double)regions / results : 0.0,
+    results ? (double)detect_us / results : 0.0, results ? (double)latency_us / results : 0.0
+  );
+  printf("{\"pipeline\":%s}\n", report);
+  return 0;
+}
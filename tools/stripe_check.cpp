@@ -0,0 +1,108 @@
+// Host check of the stripe parallel stages of motion_detect.h against their
+// single pass versions: md_dilate_rows_h/v over all stripes must give
+// md_dilate(), and md_label_stripe() + md_merge_stripes() must give the
+// regions of md_label_regions(), for random masks, odd frame sizes and
+// 1..MD_MAX_STRIPES stripes split like the pipeline does.
+//
+//   g++ -O2 -I.. stripe_check.cpp ../motion_detect.cpp -o stripe_check
+//   ./stripe_check [masks] [seed]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "motion_detect.h"
+
+static bool same_regions(const md_regions_t *a, const md_regions_t *b) {
+  if (a->count != b->count || a->dropped != b->dropped) {
+    return false;
+  }
+  for (int i = 0; i < a->count; i++) {
+    if (a->min_x[i] != b->min_x[i] || a->min_y[i] != b->min_y[i] || a->max_x[i] != b->max_x[i] || a->max_y[i] != b->max_y[i] || a->cx[i] != b->cx[i]
+        || a->cy[i] != b->cy[i] || a->area[i] != b->area[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Blobs of random size on sparse noise, so regions cross stripe borders in
+// every shape
+static void random_mask(uint8_t *mask, int width, int height) {
+  int noise = rand() % 8;
+  int blobs = rand() % 24;
+
+  for (int i = 0; i < width * height; i++) {
+    mask[i] = rand() % 100 < noise ? 255 : 0;
+  }
+  for (int b = 0; b < blobs; b++) {
+    int w = 1 + rand() % (width / 2 + 1);
+    int h = 1 + rand() % (height / 2 + 1);
+    int x0 = rand() % width;
+    int y0 = rand() % height;
+    bool hollow = rand() % 3 == 0;
+    for (int y = y0; y < y0 + h && y < height; y++) {
+      for (int x = x0; x < x0 + w && x < width; x++) {
+        bool edge = y == y0 || x == x0 || y == y0 + h - 1 || x == x0 + w - 1;
+        if (!hollow || edge) {
+          mask[y * width + x] = 255;
+        }
+      }
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  int masks = argc > 1 ? atoi(argv[1]) : 3000;
+  srand(argc > 2 ? atoi(argv[2]) : 1);
+
+  int dilate_bad = 0;
+  int label_bad = 0;
+  int truncated = 0;
+  for (int m = 0; m < masks; m++) {
+    int count = 1 + m % MD_MAX_STRIPES;
+    int width = 3 + rand() % 318;
+    int height = count + rand() % 240;
+    size_t len = (size_t)width * height;
+    std::vector<uint8_t> mask(len), single(len), striped(len), tmp(len);
+    random_mask(mask.data(), width, height);
+
+    // Dilation: row pass of every stripe before any column pass
+    single = mask;
+    md_dilate(single.data(), width, height, tmp.data());
+    striped = mask;
+    for (int k = 0; k < count; k++) {
+      md_dilate_rows_h(striped.data(), width, height * k / count, height * (k + 1) / count, tmp.data());
+    }
+    for (int k = 0; k < count; k++) {
+      md_dilate_rows_v(striped.data(), width, height, height * k / count, height * (k + 1) / count, tmp.data());
+    }
+    if (single != striped) {
+      printf("dilate differs: %dx%d, %d stripes\n", width, height, count);
+      dilate_bad++;
+    }
+
+    // Labeling of the dilated mask
+    md_regions_t expect;
+    md_regions_t got;
+    std::vector<uint8_t> scratch(md_scratch_size(width));
+    md_label_regions(single.data(), width, height, scratch.data(), &expect, NULL);
+    std::vector<std::vector<uint8_t>> stripe_scratch(count, std::vector<uint8_t>(md_stripe_scratch_size(width)));
+    std::vector<uint8_t> merge_scratch(md_merge_scratch_size(count));
+    md_stripe_t stripes[MD_MAX_STRIPES];
+    for (int k = 0; k < count; k++) {
+      md_label_stripe(single.data(), width, height * k / count, height * (k + 1) / count, stripe_scratch[k].data(), &stripes[k]);
+    }
+    md_merge_stripes(stripes, count, width, merge_scratch.data(), &got);
+    // Running out of labels merges regions differently, by design
+    if (expect.truncated || got.truncated) {
+      truncated++;
+      continue;
+    }
+    if (!same_regions(&expect, &got)) {
+      printf("regions differ: %dx%d, %d stripes, %d vs %d regions\n", width, height, count, expect.count, got.count);
+      label_bad++;
+    }
+  }
+  printf("%d masks: %d dilation and %d labeling mismatches, %d skipped as truncated\n", masks, dilate_bad, label_bad, truncated);
+  return dilate_bad || label_bad ? 1 : 0;
+}
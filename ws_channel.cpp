@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp32-hal-log.h"
+#include "os_port.h"
+#include "motion_pipeline.h"
+#include "detection_wire.h"
+#include "ws_channel.h"
+
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+
+#define WS_TASK_STACK 4096
+#define WS_TASK_PRIO  3
+#define WS_MSG_MAX    128
+
+typedef struct {
+  int fd;  // -1 when the slot is free
+  ws_push_t push;
+  bool last_empty;
+  // Held across each send on the socket, so pushes and control replies never
+  // interleave
+  os_mutex_t send_lock;
+} ws_client_t;
+
+static httpd_handle_t ws_server;
+static ws_control_fn ws_control;
+// Guards the client table; never held across a send, so a stalled subscriber
+// only holds up its own frames and not the httpd task
+static os_mutex_t ws_lock;
+static ws_client_t ws_clients[WS_MAX_CLIENTS];
+static uint8_t ws_frame[DETECTION_WIRE_MAX];
+static ws_stats_t ws_stats;
+
+static const char *ws_push_names[] = {"off", "motion", "all"};
+
+static ws_client_t *ws_client_find(int fd) {
+  for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+    if (ws_clients[i].fd == fd) {
+      return &ws_clients[i];
+    }
+  }
+  return NULL;
+}
+
+static void ws_client_drop(ws_client_t *c) {
+  c->fd = -1;
+  ws_stats.clients--;
+}
+
+static void ws_push_task(void *arg) {
+  uint32_t last_seq = 0;
+
+  for (;;) {
+    const mp_result_t *result = motion_pipeline_acquire(last_seq, 1000);
+    if (!result) {
+      continue;
+    }
+    last_seq = result->seq;
+    if (!ws_stats.clients) {
+      motion_pipeline_release(result);
+      continue;
+    }
+    bool empty = !result->regions.count;
+    httpd_ws_frame_t frame = {};
+    frame.final = true;
+    frame.type = HTTPD_WS_TYPE_BINARY;
+    frame.payload = ws_frame;
+    frame.len = detection_wire_encode(result, ws_frame, sizeof(ws_frame));
+    motion_pipeline_release(result);
+
+    int fds[WS_MAX_CLIENTS];
+    os_mutex_lock(ws_lock);
+    for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+      ws_client_t *c = &ws_clients[i];
+      bool skip = c->fd < 0 || c->push == WS_PUSH_OFF || (c->push == WS_PUSH_MOTION && empty && c->last_empty);
+      c->last_empty = empty;
+      fds[i] = skip ? -1 : c->fd;
+    }
+    os_mutex_unlock(ws_lock);
+
+    for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+      ws_client_t *c = &ws_clients[i];
+      if (fds[i] < 0) {
+        continue;
+      }
+      os_mutex_lock(c->send_lock);
+      bool sent = httpd_ws_get_fd_info(ws_server, fds[i]) == HTTPD_WS_CLIENT_WEBSOCKET && httpd_ws_send_frame_async(ws_server, fds[i], &frame) == ESP_OK;
+      os_mutex_unlock(c->send_lock);
+      os_mutex_lock(ws_lock);
+      if (sent) {
+        ws_stats.pushed++;
+      } else {
+        ws_stats.send_errors++;
+        // The slot may have been taken over meanwhile
+        if (c->fd == fds[i]) {
+          ws_client_drop(c);
+        }
+      }
+      os_mutex_unlock(ws_lock);
+    }
+  }
+}
+
+static bool ws_parse_zones(const char *s, mp_zone_t *zones, int *count) {
+  *count = 0;
+  while (*s) {
+    long v[4];
+    char *end;
+    for (int k = 0; k < 4; k++) {
+      v[k] = strtol(s, &end, 10);
+      if (end == s || v[k] < 0 || v[k] > 0xffff || (k < 3 && *end != ',')) {
+        return false;
+      }
+      s = k < 3 ? end + 1 : end;
+    }
+    if (*count == MP_MAX_ZONES || (*s && *s != ';')) {
+      return false;
+    }
+    zones[(*count)++] = {(uint16_t)v[0], (uint16_t)v[1], (uint16_t)v[2], (uint16_t)v[3]};
+    if (*s) {
+      s++;
+    }
+  }
+  return true;
+}
+
+// Applies the keys of one control message, returns an error or NULL. Runs
+// without ws_lock: a control may write the sensor over I2C. The push mode is
+// only returned, the caller stores it.
+static const char *ws_apply(const char *msg, ws_push_t *push) {
+  char value[WS_MSG_MAX];
+  char variable[32];
+
+  if (httpd_query_key_value(msg, "push", value, sizeof(value)) == ESP_OK) {
+    int mode = -1;
+    for (int k = 0; k <= WS_PUSH_ALL; k++) {
+      if (!strcmp(value, ws_push_names[k])) {
+        mode = k;
+      }
+    }
+    if (mode < 0) {
+      return "bad push mode";
+    }
+    *push = (ws_push_t)mode;
+  }
+  if (httpd_query_key_value(msg, "threshold", value, sizeof(value)) == ESP_OK) {
+    int threshold = atoi(value);
+    if (threshold < 1 || threshold > 255) {
+      return "bad threshold";
+    }
+    motion_pipeline_set_threshold(threshold);
+  }
+  if (httpd_query_key_value(msg, "zones", value, sizeof(value)) == ESP_OK) {
+    mp_zone_t zones[MP_MAX_ZONES];
+    int count;
+    if (!ws_parse_zones(value, zones, &count) || !motion_pipeline_set_zones(zones, count)) {
+      return "bad zones";
+    }
+  }
+  if (httpd_query_key_value(msg, "var", variable, sizeof(variable)) == ESP_OK) {
+    if (httpd_query_key_value(msg, "val", value, sizeof(value)) != ESP_OK || !ws_control || ws_control(variable, atoi(value)) < 0) {
+      return "control failed";
+    }
+  }
+  return NULL;
+}
+
+bool ws_channel_start(httpd_handle_t server, ws_control_fn control) {
+  if (ws_lock) {
+    return true;
+  }
+  ws_server = server;
+  ws_control = control;
+  for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+    ws_clients[i].fd = -1;
+    ws_clients[i].send_lock = os_mutex_create();
+    if (!ws_clients[i].send_lock) {
+      log_e("WebSocket: lock creation failed");
+      return false;
+    }
+  }
+  ws_lock = os_mutex_create();
+  if (!ws_lock || !os_task_create(ws_push_task, "ws_push", WS_TASK_STACK, NULL, WS_TASK_PRIO, OS_NO_AFFINITY)) {
+    log_e("WebSocket: push task creation failed");
+    return false;
+  }
+  return true;
+}
+
+static esp_err_t ws_reply(httpd_req_t *req, int fd, const char *reply) {
+  httpd_ws_frame_t out = {};
+  out.final = true;
+  out.type = HTTPD_WS_TYPE_TEXT;
+  out.payload = (uint8_t *)reply;
+  out.len = strlen(reply);
+
+  os_mutex_lock(ws_lock);
+  ws_client_t *c = ws_client_find(fd);
+  os_mutex_unlock(ws_lock);
+  // Only pushes to this socket can hold its send lock
+  if (c) {
+    os_mutex_lock(c->send_lock);
+  }
+  esp_err_t res = httpd_ws_send_frame(req, &out);
+  if (c) {
+    os_mutex_unlock(c->send_lock);
+  }
+  return res;
+}
+
+esp_err_t ws_channel_handler(httpd_req_t *req) {
+  int fd = httpd_req_to_sockfd(req);
+
+  if (!ws_lock) {
+    return ESP_FAIL;
+  }
+  if (req->method == HTTP_GET) {
+    // Handshake done, the socket subscribes right away; failing closes it
+    os_mutex_lock(ws_lock);
+    // A closed subscriber's descriptor can come back before a push noticed
+    ws_client_t *c = ws_client_find(fd);
+    if (!c && (c = ws_client_find(-1))) {
+      ws_stats.clients++;
+    }
+    if (c) {
+      c->fd = fd;
+      c->push = WS_PUSH_MOTION;
+      c->last_empty = false;
+    } else {
+      ws_stats.rejected++;
+    }
+    os_mutex_unlock(ws_lock);
+    return c ? ESP_OK : ESP_FAIL;
+  }
+
+  char msg[WS_MSG_MAX];
+  httpd_ws_frame_t frame = {};
+  esp_err_t res = httpd_ws_recv_frame(req, &frame, 0);
+  if (res != ESP_OK) {
+    return res;
+  }
+  if (frame.len >= sizeof(msg)) {
+    // The payload can only be read whole; the error is sent and the socket
+    // closed instead of buffering it
+    ws_reply(req, fd, "{\"ok\":false,\"error\":\"message too long\"}");
+    return ESP_FAIL;
+  }
+  if (frame.len) {
+    frame.payload = (uint8_t *)msg;
+    res = httpd_ws_recv_frame(req, &frame, frame.len);
+    if (res != ESP_OK) {
+      return res;
+    }
+  }
+  msg[frame.len] = 0;
+
+  os_mutex_lock(ws_lock);
+  ws_client_t *c = ws_client_find(fd);
+  ws_push_t push = c ? c->push : WS_PUSH_OFF;
+  os_mutex_unlock(ws_lock);
+  const char *error = frame.type != HTTPD_WS_TYPE_TEXT ? "expected a text message" : c ? ws_apply(msg, &push) : "not subscribed";
+  os_mutex_lock(ws_lock);
+  // The subscriber may have been dropped meanwhile
+  if (!error && c->fd == fd) {
+    c->push = push;
+  }
+  ws_stats.controls++;
+  os_mutex_unlock(ws_lock);
+
+  char reply[128];
+  if (error) {
+    snprintf(reply, sizeof(reply), "{\"ok\":false,\"error\":\"%s\"}", error);
+  } else {
+    mp_zone_t zones[MP_MAX_ZONES];
+    snprintf(
+      reply, sizeof(reply), "{\"ok\":true,\"push\":\"%s\",\"threshold\":%u,\"zones\":%d}", ws_push_names[push], motion_pipeline_get_threshold(),
+      motion_pipeline_get_zones(zones)
+    );
+  }
+  return ws_reply(req, fd, reply);
+}
+
+#else
+
+bool ws_channel_start(httpd_handle_t server, ws_control_fn control) {
+  return false;
+}
+
+esp_err_t ws_channel_handler(httpd_req_t *req) {
+  return ESP_FAIL;
+}
+
+#endif /* CONFIG_HTTPD_WS_SUPPORT */
+
+void ws_channel_get_stats(ws_stats_t *stats) {
+  *stats = ws_stats;
+}
+
+size_t ws_channel_report_json(char *buf, size_t buf_len) {
+  ws_stats_t st;
+  ws_channel_get_stats(&st);
+
+  int n = snprintf(
+    buf, buf_len, "{\"clients\":%d,\"pushed\":%u,\"send_errors\":%u,\"controls\":%u,\"rejected\":%u}", (int)st.clients, (unsigned)st.pushed,
+    (unsigned)st.send_errors, (unsigned)st.controls, (unsigned)st.rejected
+  );
+  if (n < 0) {
+    return 0;
+  }
+  return (size_t)n < buf_len ? n : buf_len - 1;
+}
@@ -0,0 +1,52 @@
+#ifndef _WS_CHANNEL_H_
+#define _WS_CHANNEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_http_server.h"
+
+// WebSocket push channel on /ws. Every socket that completes the handshake
+// is a subscriber: a push task sends it the detections of every pipeline
+// result as one binary frame holding a detection_wire.h record.
+//
+// Text messages on the same socket are controls in query string form, one or
+// more keys per message:
+//
+//   push=off|motion|all     this subscriber's frames, motion (the default)
+//                           skips frames without regions after the first
+//   threshold=<1-255>       motion pipeline diff threshold
+//   zones=x,y,w,h;...       detection zones, empty for the whole frame
+//   var=<name>&val=<n>      same as /control
+//
+// Each message is answered with a JSON text frame: {"ok":true,...} or
+// {"ok":false,"error":"..."}. Messages of 128 bytes or more are answered
+// with an error and the socket is closed, they are never read.
+
+#define WS_MAX_CLIENTS 4
+
+typedef enum {
+  WS_PUSH_OFF,
+  WS_PUSH_MOTION,
+  WS_PUSH_ALL,
+} ws_push_t;
+
+// Applies a /control variable, returns < 0 when it was rejected.
+typedef int (*ws_control_fn)(const char *variable, int value);
+
+typedef struct {
+  uint32_t pushed;       // frames sent, over all subscribers
+  uint32_t send_errors;  // failed sends, the subscriber was dropped
+  uint32_t controls;     // control messages handled
+  uint32_t rejected;     // handshakes over WS_MAX_CLIENTS
+  int32_t clients;
+} ws_stats_t;
+
+bool ws_channel_start(httpd_handle_t server, ws_control_fn control);
+// URI handler of /ws, registered with is_websocket set.
+esp_err_t ws_channel_handler(httpd_req_t *req);
+
+void ws_channel_get_stats(ws_stats_t *stats);
+size_t ws_channel_report_json(char *buf, size_t buf_len);
+
+#endif /* _WS_CHANNEL_H_ */